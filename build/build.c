@@ -217,7 +217,11 @@ rpmRC doScript(rpmSpec spec, rpmBuildFlags what, const char *name,
     (void) poptParseArgvString(buildCmd, &argc, &argv);
 
     rpmlog(RPMLOG_NOTICE, _("Executing(%s): %s\n"), name, buildCmd);
-    if (rpmfcExec((ARGV_const_t)argv, NULL, sb_stdoutp, 1, buildSubdir)) {
+    struct buildStats_s bs;
+    buildStatsBegin(&bs);
+    int xx = rpmfcExec((ARGV_const_t)argv, NULL, sb_stdoutp, 1, buildSubdir);
+    buildStatsEnd(spec, &bs, name, RPMRC_OK);
+    if (xx) {
 	rpmlog(RPMLOG_ERR, _("Bad exit status from %s (%s)\n"),
 		scriptName, name);
 	goto exit;
@@ -295,8 +299,13 @@ static rpmRC doCheckBuildRequires(rpmts ts, rpmSpec spec, int test)
     return rc;
 }
 
+/* Measure a build stage, evaluating to its result */
+#define STAGE(_name, _call) \
+    (buildStatsBegin(&bs), buildStatsEnd(spec, &bs, (_name), (_call)))
+
 static rpmRC buildSpec(rpmts ts, BTA_t buildArgs, rpmSpec spec, int what)
 {
+    struct buildStats_s bs;
     rpmRC rc = RPMRC_OK;
     int missing_buildreqs = 0;
     int test = (what & RPMBUILD_NOBUILD);
@@ -325,6 +334,8 @@ static rpmRC buildSpec(rpmts ts, BTA_t buildArgs, rpmSpec spec, int what)
 #endif
     if (nthreads > 0)
 	omp_set_num_threads(nthreads);
+    /* Share the same budget with threaded payload compression */
+    int prev_budget = rpmioSetThreadBudget(nthreads);
 #endif
 
     if (rpmExpandNumeric("%{?source_date_epoch_from_changelog}") &&
@@ -434,25 +445,27 @@ static rpmRC buildSpec(rpmts ts, BTA_t buildArgs, rpmSpec spec, int what)
 		goto exit;
 
 	if ((what & RPMBUILD_PACKAGESOURCE) &&
-	    (rc = processSourceFiles(spec, buildArgs->pkgFlags)))
+	    (rc = STAGE("sourcefiles",
+			processSourceFiles(spec, buildArgs->pkgFlags))))
 		goto exit;
 
 	if (((what & RPMBUILD_INSTALL) || (what & RPMBUILD_PACKAGEBINARY) ||
 	    (what & RPMBUILD_FILECHECK)) &&
-	    (rc = processBinaryFiles(spec, buildArgs->pkgFlags,
-				     what & RPMBUILD_INSTALL, test)))
+	    (rc = STAGE("files", processBinaryFiles(spec, buildArgs->pkgFlags,
+				     what & RPMBUILD_INSTALL, test))))
 		goto exit;
 
 	if (((what & RPMBUILD_INSTALL) || (what & RPMBUILD_PACKAGEBINARY)) &&
-	    (rc = processBinaryPolicies(spec, test)))
+	    (rc = STAGE("policies", processBinaryPolicies(spec, test))))
 		goto exit;
 
 	if (((what & RPMBUILD_PACKAGESOURCE) && !test) &&
-	    (rc = packageSources(spec, &cookie)))
+	    (rc = STAGE("packagesource", packageSources(spec, &cookie))))
 		goto exit;
 
 	if (((what & RPMBUILD_PACKAGEBINARY) && !test) &&
-	    (rc = packageBinaries(spec, cookie, (didBuild == 0))))
+	    (rc = STAGE("packagebinary",
+			packageBinaries(spec, cookie, (didBuild == 0)))))
 		goto exit;
 	
 	if ((what & RPMBUILD_CLEAN) &&
@@ -474,6 +487,7 @@ static rpmRC buildSpec(rpmts ts, BTA_t buildArgs, rpmSpec spec, int what)
 exit:
 #ifdef ENABLE_OPENMP
     omp_set_num_threads(prev_threads);
+    rpmioSetThreadBudget(prev_budget);
 #endif
     freeStringBuf(sink);
     free(cookie);
@@ -510,5 +524,7 @@ exit:
 int rpmSpecBuild(rpmts ts, rpmSpec spec, BTA_t buildArgs)
 {
     /* buildSpec() can recurse with different buildAmount, pass it separately */
-    return buildSpec(ts, buildArgs, spec, buildArgs->buildAmount);
+    int rc = buildSpec(ts, buildArgs, spec, buildArgs->buildAmount);
+    buildStatsReport(spec);
+    return rc;
 }
@@ -0,0 +1,183 @@
+/** \ingroup rpmbuild
+ * \file build/buildstats.c
+ *  Time and resource usage of the build stages and packaging tasks.
+ */
+
+#include "system.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#include <rpm/rpmlog.h>
+#include <rpm/rpmmacro.h>
+#include <rpm/rpmstring.h>
+#include <rpm/rpmts.h>		/* _rpmts_stats */
+
+#include "build/rpmbuild_internal.h"
+
+#include "debug.h"
+
+static rpmtime_t tvUsecs(const struct timeval *tv)
+{
+    return tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+void buildStatsBegin(struct buildStats_s *bs)
+{
+    rpmswNow(&bs->begin);
+    (void) getrusage(RUSAGE_SELF, &bs->self);
+    (void) getrusage(RUSAGE_CHILDREN, &bs->children);
+}
+
+rpmRC buildStatsEnd(rpmSpec spec, struct buildStats_s *bs, const char *name,
+		    rpmRC rc)
+{
+    struct rusage self, children;
+    struct rpmsw_s end;
+    struct buildStage_s *st;
+
+    rpmswNow(&end);
+    (void) getrusage(RUSAGE_SELF, &self);
+    (void) getrusage(RUSAGE_CHILDREN, &children);
+
+    spec->stages = xrealloc(spec->stages,
+			    (spec->nstages + 1) * sizeof(*spec->stages));
+    st = &spec->stages[spec->nstages++];
+    st->name = xstrdup(name);
+    st->usecs = rpmswDiff(&end, &bs->begin);
+    st->utime = tvUsecs(&self.ru_utime) - tvUsecs(&bs->self.ru_utime) +
+		tvUsecs(&children.ru_utime) - tvUsecs(&bs->children.ru_utime);
+    st->stime = tvUsecs(&self.ru_stime) - tvUsecs(&bs->self.ru_stime) +
+		tvUsecs(&children.ru_stime) - tvUsecs(&bs->children.ru_stime);
+    /* High-water marks only, of rpmbuild and its largest child so far */
+    st->maxrss = (self.ru_maxrss > children.ru_maxrss) ?
+		 self.ru_maxrss : children.ru_maxrss;
+    /* On Linux, the block counts are in 512 byte units */
+    st->rbytes = 512 * (uint64_t) (self.ru_inblock - bs->self.ru_inblock +
+			children.ru_inblock - bs->children.ru_inblock);
+    st->wbytes = 512 * (uint64_t) (self.ru_oublock - bs->self.ru_oublock +
+			children.ru_oublock - bs->children.ru_oublock);
+
+    return rc;
+}
+
+static void formatJson(rpmSpec spec, char **buf, int *n)
+{
+    for (int i = 0; i < spec->nstages; i++) {
+	struct buildStage_s *st = &spec->stages[i];
+	char *s = NULL;
+	rasprintf(&s, "%s{\"name\": \"%s\", \"usecs\": %lu, "
+		  "\"utime_usecs\": %lu, \"stime_usecs\": %lu, "
+		  "\"maxrss\": %ld, \"read_bytes\": %" PRIu64 ", "
+		  "\"write_bytes\": %" PRIu64 "}",
+		  (*n)++ ? ", " : "",
+		  st->name, (unsigned long) st->usecs,
+		  (unsigned long) st->utime, (unsigned long) st->stime,
+		  st->maxrss, st->rbytes, st->wbytes);
+	rstrcat(buf, s);
+	free(s);
+    }
+}
+
+static void formatPkgJson(rpmSpec spec, char **buf, int *n)
+{
+    for (Package pkg = spec->packages; pkg != NULL; pkg = pkg->next) {
+	struct buildPkgStats_s *ps = &pkg->stats;
+	char *nevra, *s = NULL;
+	if (pkg->filename == NULL)
+	    continue;
+	nevra = headerGetAsString(pkg->header, RPMTAG_NEVRA);
+	rasprintf(&s, "%s{\"nevra\": \"%s\", \"usecs\": %lu, "
+		  "\"cpu_usecs\": %lu, \"depgen_usecs\": %lu, "
+		  "\"payload_usecs\": %lu}",
+		  (*n)++ ? ", " : "", nevra,
+		  (unsigned long) ps->usecs, (unsigned long) ps->cpuUsecs,
+		  (unsigned long) ps->depgenUsecs,
+		  (unsigned long) ps->payloadUsecs);
+	rstrcat(buf, s);
+	free(s);
+	free(nevra);
+    }
+}
+
+static char *formatStats(rpmSpec spec, int format)
+{
+    static const unsigned int scale = (1000 * 1000);
+    char *buf = NULL;
+
+    if (format == RPMTS_STATS_JSON) {
+	int n = 0;
+	rstrcat(&buf, "{\"stages\": [");
+	formatJson(spec, &buf, &n);
+	for (int x = 0; x < spec->BACount && spec->BASpecs; x++)
+	    formatJson(spec->BASpecs[x], &buf, &n);
+	n = 0;
+	rstrcat(&buf, "], \"packages\": [");
+	formatPkgJson(spec, &buf, &n);
+	for (int x = 0; x < spec->BACount && spec->BASpecs; x++)
+	    formatPkgJson(spec->BASpecs[x], &buf, &n);
+	rstrcat(&buf, "]}\n");
+	return buf;
+    }
+
+    rstrcat(&buf, "");
+    for (int i = 0; i < spec->nstages; i++) {
+	struct buildStage_s *st = &spec->stages[i];
+	char *s = NULL;
+	size_t len = strlen(st->name);
+	rasprintf(&s, "   %s:%*s %6lu.%06lu secs %6lu.%06lu cpu %8ld kB\n",
+		  st->name, (int) (len < 16 ? 16 - len : 0), "",
+		  st->usecs/scale, st->usecs%scale,
+		  (st->utime + st->stime)/scale, (st->utime + st->stime)%scale,
+		  st->maxrss);
+	rstrcat(&buf, s);
+	free(s);
+    }
+    for (Package pkg = spec->packages; pkg != NULL; pkg = pkg->next) {
+	struct buildPkgStats_s *ps = &pkg->stats;
+	char *s = NULL;
+	if (pkg->filename == NULL)
+	    continue;
+	rasprintf(&s, "   %s: %lu.%06lu secs (payload %lu.%06lu secs)\n",
+		  pkg->filename, ps->usecs/scale, ps->usecs%scale,
+		  ps->payloadUsecs/scale, ps->payloadUsecs%scale);
+	rstrcat(&buf, s);
+	free(s);
+    }
+    for (int x = 0; x < spec->BACount && spec->BASpecs; x++) {
+	char *s = formatStats(spec->BASpecs[x], format);
+	rstrcat(&buf, s);
+	free(s);
+    }
+    return buf;
+}
+
+void buildStatsReport(rpmSpec spec)
+{
+    char *path = rpmExpand("%{?_build_stats_file}", NULL);
+
+    if (*path) {
+	char *stats = formatStats(spec, RPMTS_STATS_JSON);
+	FILE *fp = fopen(path, "w");
+	int failed = (fp == NULL);
+	if (fp) {
+	    failed |= (fputs(stats, fp) == EOF);
+	    failed |= (fclose(fp) != 0);
+	}
+	if (failed) {
+	    rpmlog(RPMLOG_WARNING, _("Could not write build statistics %s: %s\n"),
+		   path, strerror(errno));
+	}
+	free(stats);
+    }
+
+    if (_rpmts_stats) {
+	char *stats = formatStats(spec, (_rpmts_stats == RPMTS_STATS_JSON) ?
+				  RPMTS_STATS_JSON : RPMTS_STATS_TEXT);
+	fputs(stats, stderr);
+	free(stats);
+    }
+    free(path);
+}
@@ -244,7 +244,7 @@ static void FileEntryFree(FileEntry entry)
  */
 static char *strtokWithQuotes(char *s, const char *delim, int *quotes)
 {
-    static char *olds = NULL;
+    static __thread char *olds = NULL;
     char *token;
 
     if (s == NULL)
@@ -984,6 +984,67 @@ static int isHardLink(FileListRec flp, FileListRec tlp)
 	    (flp->fl_dev == tlp->fl_dev));
 }
 
+struct inodeRef_s {
+    dev_t dev;
+    ino_t ino;
+    int ix;
+};
+
+static int inodeRefCmp(const void *a, const void *b)
+{
+    const struct inodeRef_s *ra = a, *rb = b;
+    if (ra->dev != rb->dev)
+	return (ra->dev < rb->dev) ? -1 : 1;
+    if (ra->ino != rb->ino)
+	return (ra->ino < rb->ino) ? -1 : 1;
+    return ra->ix - rb->ix;
+}
+
+/**
+ * Find the file records whose content needs to be digested. The digest
+ * of hard links is only calculated once for the first one in the set,
+ * and of duplicate entries (which get merged) for the last one.
+ * @param files		package file records (sorted)
+ * @return		array of digest sources: index of the record whose
+ * 			digest to use, or -1 for none
+ */
+static int *digestSources(FileRecords files)
+{
+    int *src = xmalloc(files->used * sizeof(*src));
+    struct inodeRef_s *refs = NULL;
+    int nrefs = 0;
+
+    for (int i = 0; i < files->used; i++) {
+	FileListRec flp = files->recs + i;
+
+	src[i] = -1;
+	if (!S_ISREG(flp->fl_mode) ||
+		(flp->flags & (RPMFILE_GHOST | RPMFILE_EXCLUDE)))
+	    continue;
+	if (i < files->used - 1 && rstreq(flp->cpioPath, flp[1].cpioPath))
+	    continue;
+	src[i] = i;
+	if (flp->fl_nlink > 1) {
+	    if (refs == NULL)
+		refs = xmalloc(files->used * sizeof(*refs));
+	    refs[nrefs].dev = flp->fl_dev;
+	    refs[nrefs].ino = flp->fl_ino;
+	    refs[nrefs].ix = i;
+	    nrefs++;
+	}
+    }
+
+    if (nrefs > 1) {
+	qsort(refs, nrefs, sizeof(*refs), inodeRefCmp);
+	for (int i = 1; i < nrefs; i++) {
+	    if (refs[i].dev == refs[i-1].dev && refs[i].ino == refs[i-1].ino)
+		src[refs[i].ix] = src[refs[i-1].ix];
+	}
+    }
+    free(refs);
+    return src;
+}
+
 /**
  * Verify that file attributes scope over hardlinks correctly.
  * If partial hardlink sets are possible, then add tracking dependency.
@@ -1033,6 +1094,7 @@ static void genCpioListAndHeader(FileList fl, Package pkg, int isSrc)
 {
     FileListRec flp;
     char buf[BUFSIZ];
+    char **digests = NULL;
     int i, npaths = 0;
     int fail_on_dupes = rpmExpandNumeric("%{?_duplicate_files_terminate_build}") > 0;
     uint32_t defaultalgo = RPM_HASH_MD5, digestalgo;
@@ -1106,6 +1168,31 @@ static void genCpioListAndHeader(FileList fl, Package pkg, int isSrc)
     
     pkg->dpaths = xmalloc((fl->files.used + 1) * sizeof(*pkg->dpaths));
 
+    /*
+     * Calculate the file digests up front, in parallel. This is all I/O
+     * and hashing which doesn't touch the header, results are stored by
+     * file list index so the output is the same regardless of ordering.
+     * Each inode is read only once, hard links share the digest.
+     */
+    int *dsrc = digestSources(&fl->files);
+    digests = xcalloc(fl->files.used, sizeof(*digests));
+    #pragma omp parallel for schedule(dynamic, 16)
+    for (i = 0; i < fl->files.used; i++) {
+	FileListRec rec = fl->files.recs + i;
+	char dbuf[2 * 64 + 1];
+
+	if (dsrc[i] != i)
+	    continue;
+	dbuf[0] = '\0';
+	(void) rpmDoDigest(digestalgo, rec->diskPath, 1, (unsigned char *)dbuf);
+	digests[i] = xstrdup(dbuf);
+    }
+    for (i = 0; i < fl->files.used; i++) {
+	if (dsrc[i] >= 0 && dsrc[i] != i && digests[dsrc[i]])
+	    digests[i] = xstrdup(digests[dsrc[i]]);
+    }
+    free(dsrc);
+
     /* Generate the header. */
     for (i = 0, flp = fl->files.recs; i < fl->files.used; i++, flp++) {
 	rpm_ino_t fileid = flp - fl->files.recs;
@@ -1239,9 +1326,13 @@ static void genCpioListAndHeader(FileList fl, Package pkg, int isSrc)
 	}
 	
 	buf[0] = '\0';
-	if (S_ISREG(flp->fl_mode) && !(flp->flags & RPMFILE_GHOST))
-	    (void) rpmDoDigest(digestalgo, flp->diskPath, 1, 
-			       (unsigned char *)buf);
+	if (S_ISREG(flp->fl_mode) && !(flp->flags & RPMFILE_GHOST)) {
+	    if (digests[i])
+		rstrlcpy(buf, digests[i], sizeof(buf));
+	    else
+		(void) rpmDoDigest(digestalgo, flp->diskPath, 1,
+				   (unsigned char *)buf);
+	}
 	headerPutString(h, RPMTAG_FILEDIGESTS, buf);
 	
 	buf[0] = '\0';
@@ -1286,6 +1377,10 @@ static void genCpioListAndHeader(FileList fl, Package pkg, int isSrc)
     }
     pkg->dpaths[npaths] = NULL;
 
+    for (i = 0; i < fl->files.used; i++)
+	free(digests[i]);
+    free(digests);
+
     if (totalFileSize < UINT32_MAX) {
 	rpm_off_t totalsize = totalFileSize;
 	headerPutUint32(h, RPMTAG_SIZE, &totalsize, 1);
@@ -1542,8 +1637,12 @@ static rpmRC addFile(FileList fl, const char * diskPath,
     
     /* S_XXX macro must be consistent with type in find call at check-files script */
     if (check_fileList && (S_ISREG(fileMode) || S_ISLNK(fileMode))) {
+	/* file lists can be read in parallel, check-files sorts this */
+	#pragma omp critical(check_fileList)
+	{
 	appendStringBuf(check_fileList, diskPath);
 	appendStringBuf(check_fileList, "\n");
+	}
     }
 
     /* Add to the file list */
@@ -1848,6 +1947,79 @@ static int haveModinfo(Elf *elf)
     return have_modinfo;
 }
 
+/* Build-id scan result of a single file */
+struct buildIdScan_s {
+    int haveid;		/* file should have a build-id */
+    int isDbg;		/* debug file? */
+    ssize_t len;	/* build-id length, -1 on error */
+    char *id;		/* build-id as hex string */
+    char *errmsg;	/* libelf error on failure */
+};
+
+/*
+ * Look up the build-id of a file. This only looks at the file itself so
+ * it's safe to call in parallel for different files.
+ */
+static void scanBuildID(FileListRec flp, struct buildIdScan_s *scan)
+{
+    struct stat sbuf;
+    if (lstat(flp->diskPath, &sbuf) == 0 && S_ISREG (sbuf.st_mode)) {
+	/* We determine whether this is a main or
+	   debug ELF based on path.  */
+	int isDbg = strncmp (flp->cpioPath,
+			     DEBUG_LIB_PREFIX, strlen (DEBUG_LIB_PREFIX)) == 0;
+
+	/* For the main package files mimic what find-debuginfo.sh does.
+	   Only check build-ids for executable files. Debug files are
+	   always non-executable. */
+	if (!isDbg
+	    && (sbuf.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH)) == 0)
+	  return;
+
+	int fd = open (flp->diskPath, O_RDONLY);
+	if (fd >= 0) {
+	    /* Only real ELF files, that are ET_EXEC, ET_DYN or
+	       kernel modules (ET_REL files with .modinfo section)
+	       should have build-ids. */
+	    GElf_Ehdr ehdr;
+#ifdef HAVE_DWELF_ELF_BEGIN
+	    Elf *elf = dwelf_elf_begin(fd);
+#else
+	    Elf *elf = elf_begin (fd, ELF_C_READ, NULL);
+#endif
+	    if (elf != NULL && elf_kind(elf) == ELF_K_ELF
+		&& gelf_getehdr(elf, &ehdr) != NULL
+		&& (ehdr.e_type == ET_EXEC || ehdr.e_type == ET_DYN
+		    || (ehdr.e_type == ET_REL && haveModinfo(elf)))) {
+		const void *build_id;
+		ssize_t len = dwelf_elf_gnu_build_id (elf, &build_id);
+
+		scan->haveid = 1;
+		scan->isDbg = isDbg;
+		scan->len = len;
+		/* len == -1 means error. Zero means no
+		   build-id. We want at least a length of 2 so we
+		   have at least a xx/yy (hex) dir/file. But
+		   reasonable build-ids are between 16 bytes (md5
+		   is 128 bits) and 64 bytes (largest sha3 is 512
+		   bits), common is 20 bytes (sha1 is 160 bits). */
+		if (len >= 16 && len <= 64) {
+		    const unsigned char *p = build_id;
+		    const unsigned char *end = p + len;
+		    char *id_str = scan->id = xmalloc(2 * len + 1);
+		    while (p < end)
+			id_str += sprintf(id_str, "%02x", (unsigned)*p++);
+		    *id_str = '\0';
+		} else if (len < 0) {
+		    scan->errmsg = xstrdup(elf_errmsg (-1));
+		}
+	    }
+	    elf_end (elf);
+	    close (fd);
+	}
+    }
+}
+
 static int generateBuildIDs(FileList fl, ARGV_t *files)
 {
     int rc = 0;
@@ -1894,100 +2066,72 @@ static int generateBuildIDs(FileList fl, ARGV_t *files)
     /* Collect and check all build-ids for ELF files in this package.  */
     int needMain = 0;
     int needDbg = 0;
+    struct buildIdScan_s *scans = xcalloc(fl->files.used, sizeof(*scans));
+
+    /* Scanning is independent for each file, do it in parallel */
+    #pragma omp parallel for schedule(dynamic, 16)
+    for (i = 0; i < fl->files.used; i++)
+	scanBuildID(fl->files.recs + i, &scans[i]);
+
+    /* Merge the results in file list order to keep the output stable */
     for (i = 0, flp = fl->files.recs; i < fl->files.used; i++, flp++) {
-	struct stat sbuf;
-	if (lstat(flp->diskPath, &sbuf) == 0 && S_ISREG (sbuf.st_mode)) {
-	    /* We determine whether this is a main or
-	       debug ELF based on path.  */
-	    int isDbg = strncmp (flp->cpioPath,
-				 DEBUG_LIB_PREFIX, strlen (DEBUG_LIB_PREFIX)) == 0;
-
-	    /* For the main package files mimic what find-debuginfo.sh does.
-	       Only check build-ids for executable files. Debug files are
-	       always non-executable. */
-	    if (!isDbg
-		&& (sbuf.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH)) == 0)
-	      continue;
-
-	    int fd = open (flp->diskPath, O_RDONLY);
-	    if (fd >= 0) {
-		/* Only real ELF files, that are ET_EXEC, ET_DYN or
-		   kernel modules (ET_REL files with .modinfo section)
-		   should have build-ids. */
-		GElf_Ehdr ehdr;
-#ifdef HAVE_DWELF_ELF_BEGIN
-		Elf *elf = dwelf_elf_begin(fd);
-#else
-		Elf *elf = elf_begin (fd, ELF_C_READ, NULL);
-#endif
-		if (elf != NULL && elf_kind(elf) == ELF_K_ELF
-		    && gelf_getehdr(elf, &ehdr) != NULL
-		    && (ehdr.e_type == ET_EXEC || ehdr.e_type == ET_DYN
-			|| (ehdr.e_type == ET_REL && haveModinfo(elf)))) {
-		    const void *build_id;
-		    ssize_t len = dwelf_elf_gnu_build_id (elf, &build_id);
-		    /* len == -1 means error. Zero means no
-		       build-id. We want at least a length of 2 so we
-		       have at least a xx/yy (hex) dir/file. But
-		       reasonable build-ids are between 16 bytes (md5
-		       is 128 bits) and 64 bytes (largest sha3 is 512
-		       bits), common is 20 bytes (sha1 is 160 bits). */
-		    if (len >= 16 && len <= 64) {
-			int addid = 0;
-			if (isDbg) {
-			    needDbg = 1;
-			    addid = 1;
-			}
-			else if (build_id_links != BUILD_IDS_ALLDEBUG) {
-			    needMain = 1;
-			    addid = 1;
-			}
-			if (addid) {
-			    const unsigned char *p = build_id;
-			    const unsigned char *end = p + len;
-			    char *id_str;
-			    if (allocated <= nr_ids) {
-				allocated += 16;
-				paths = xrealloc (paths,
-						  allocated * sizeof(char *));
-				ids = xrealloc (ids,
-						allocated * sizeof(char *));
-			    }
+	struct buildIdScan_s *scan = &scans[i];
+	ssize_t len = scan->len;
 
-			    paths[nr_ids] = xstrdup(flp->cpioPath);
-			    id_str = ids[nr_ids] = xmalloc(2 * len + 1);
-			    while (p < end)
-				id_str += sprintf(id_str, "%02x",
-						  (unsigned)*p++);
-			    *id_str = '\0';
-			    nr_ids++;
-			}
-		    } else {
-			if (len < 0) {
-			    rpmlog(terminate ? RPMLOG_ERR : RPMLOG_WARNING,
-				   _("error reading build-id in %s: %s\n"),
-				   flp->diskPath, elf_errmsg (-1));
-			} else if (len == 0) {
-			      rpmlog(terminate ? RPMLOG_ERR : RPMLOG_WARNING,
-				     _("Missing build-id in %s\n"),
-				     flp->diskPath);
-			} else {
-			    rpmlog(terminate ? RPMLOG_ERR : RPMLOG_WARNING,
-				   (len < 16
-				    ? _("build-id found in %s too small\n")
-				    : _("build-id found in %s too large\n")),
-				   flp->diskPath);
-			}
-			if (terminate)
-			    rc = 1;
-		    }
+	if (!scan->haveid)
+	    continue;
+
+	if (len >= 16 && len <= 64) {
+	    int addid = 0;
+	    if (scan->isDbg) {
+		needDbg = 1;
+		addid = 1;
+	    }
+	    else if (build_id_links != BUILD_IDS_ALLDEBUG) {
+		needMain = 1;
+		addid = 1;
+	    }
+	    if (addid) {
+		if (allocated <= nr_ids) {
+		    allocated += 16;
+		    paths = xrealloc (paths,
+				      allocated * sizeof(char *));
+		    ids = xrealloc (ids,
+				    allocated * sizeof(char *));
 		}
-		elf_end (elf);
-		close (fd);
+
+		paths[nr_ids] = xstrdup(flp->cpioPath);
+		ids[nr_ids] = scan->id;
+		scan->id = NULL;
+		nr_ids++;
 	    }
+	} else {
+	    if (len < 0) {
+		rpmlog(terminate ? RPMLOG_ERR : RPMLOG_WARNING,
+		       _("error reading build-id in %s: %s\n"),
+		       flp->diskPath, scan->errmsg);
+	    } else if (len == 0) {
+		  rpmlog(terminate ? RPMLOG_ERR : RPMLOG_WARNING,
+			 _("Missing build-id in %s\n"),
+			 flp->diskPath);
+	    } else {
+		rpmlog(terminate ? RPMLOG_ERR : RPMLOG_WARNING,
+		       (len < 16
+			? _("build-id found in %s too small\n")
+			: _("build-id found in %s too large\n")),
+		       flp->diskPath);
+	    }
+	    if (terminate)
+		rc = 1;
 	}
     }
 
+    for (i = 0; i < fl->files.used; i++) {
+	free(scans[i].id);
+	free(scans[i].errmsg);
+    }
+    free(scans);
+
     /* Process and clean up all build-ids.  */
     if (nr_ids > 0) {
 	const char *errdir = _("failed to create directory");
@@ -2446,6 +2590,8 @@ static void processSpecialDir(rpmSpec spec, Package pkg, FileList fl,
 			    getStringBuf(docScript), test, NULL)) {
 	    fl->processingFailed = 1;
 	}
+	/* the script changed the buildroot under the glob cache */
+	rpmGlobCacheFlush();
     }
 
     /* Add copied files in buildroot to file list */
@@ -2606,12 +2752,25 @@ static void addPackageFileList (struct FileList_s *fl, Package pkg,
     argvFree(fileNames);
 }
 
-static rpmRC processPackageFiles(rpmSpec spec, rpmBuildPkgFlags pkgFlags,
-				 Package pkg, int didInstall, int test)
-{
+/*
+ * %files processing of a package in two parts: reading the file list
+ * (manifests, macros, globs and the files themselves) depends only on
+ * the package and can be done for all packages in parallel. The rest
+ * (special dirs which run scripts, build-id links which depend on the
+ * packages done before, and the header) is done in package order.
+ */
+typedef struct PackageFiles_s {
     struct FileList_s fl;
-    specialDir specialDoc = NULL;
-    specialDir specialLic = NULL;
+    specialDir specialDoc;
+    specialDir specialLic;
+    rpmRC rc;
+    rpmlogDefer log;		/* messages of a parallel read */
+} * PackageFiles;
+
+static rpmRC readPackageFiles(rpmSpec spec, rpmBuildPkgFlags pkgFlags,
+				Package pkg, PackageFiles pf)
+{
+    FileList fl = &pf->fl;
 
     pkg->cpioList = NULL;
 
@@ -2620,30 +2779,37 @@ static rpmRC processPackageFiles(rpmSpec spec, rpmBuildPkgFlags pkgFlags,
 	    return RPMRC_FAIL;
     }
     /* Init the file list structure */
-    memset(&fl, 0, sizeof(fl));
-
-    fl.pool = rpmstrPoolLink(spec->pool);
+    fl->pool = rpmstrPoolLink(spec->pool);
     /* XXX spec->buildRoot == NULL, then xstrdup("") is returned */
-    fl.buildRoot = rpmGenPath(spec->rootDir, spec->buildRoot, NULL);
-    fl.buildRootLen = strlen(fl.buildRoot);
+    fl->buildRoot = rpmGenPath(spec->rootDir, spec->buildRoot, NULL);
+    fl->buildRootLen = strlen(fl->buildRoot);
 
-    resetPackageFilesDefaults (&fl, pkgFlags);
+    resetPackageFilesDefaults (fl, pkgFlags);
 
     {	char *docs = rpmGetPath("%{?__docdir_path}", NULL);
-	argvSplit(&fl.docDirs, docs, ":");
+	argvSplit(&fl->docDirs, docs, ":");
 	free(docs);
     }
 
-    addPackageFileList (&fl, pkg, &pkg->fileList,
-			&specialDoc, &specialLic, 1);
+    addPackageFileList (fl, pkg, &pkg->fileList,
+			&pf->specialDoc, &pf->specialLic, 1);
+
+    return fl->processingFailed ? RPMRC_FAIL : RPMRC_OK;
+}
+
+static rpmRC finishPackageFiles(rpmSpec spec, rpmBuildPkgFlags pkgFlags,
+				Package pkg, int didInstall, int test,
+				PackageFiles pf)
+{
+    FileList fl = &pf->fl;
 
     /* Now process special docs and licenses if present */
-    if (specialDoc)
-	processSpecialDir(spec, pkg, &fl, specialDoc, didInstall, test);
-    if (specialLic)
-	processSpecialDir(spec, pkg, &fl, specialLic, didInstall, test);
+    if (pf->specialDoc)
+	processSpecialDir(spec, pkg, fl, pf->specialDoc, didInstall, test);
+    if (pf->specialLic)
+	processSpecialDir(spec, pkg, fl, pf->specialLic, didInstall, test);
     
-    if (fl.processingFailed)
+    if (fl->processingFailed)
 	goto exit;
 
 #ifdef HAVE_LIBDW
@@ -2652,35 +2818,106 @@ static rpmRC processPackageFiles(rpmSpec spec, rpmBuildPkgFlags pkgFlags,
     if (!rstreq(arch, "noarch")) {
 	/* Go through the current package list and generate a files list. */
 	ARGV_t idFiles = NULL;
-	if (generateBuildIDs (&fl, &idFiles) != 0) {
+	int rc = generateBuildIDs (fl, &idFiles);
+	rpmGlobCacheFlush();
+	if (rc != 0) {
 	    rpmlog(RPMLOG_ERR, _("Generating build-id links failed\n"));
-	    fl.processingFailed = 1;
+	    fl->processingFailed = 1;
 	    argvFree(idFiles);
 	    goto exit;
 	}
 
 	if (idFiles != NULL) {
-	    resetPackageFilesDefaults (&fl, pkgFlags);
-	    addPackageFileList (&fl, pkg, &idFiles, NULL, NULL, 0);
+	    resetPackageFilesDefaults (fl, pkgFlags);
+	    addPackageFileList (fl, pkg, &idFiles, NULL, NULL, 0);
 	}
 	argvFree(idFiles);
 
-	if (fl.processingFailed)
+	if (fl->processingFailed)
 	    goto exit;
     }
 #endif
 
     /* Verify that file attributes scope over hardlinks correctly. */
-    if (checkHardLinks(&fl.files))
+    if (checkHardLinks(&fl->files))
 	(void) rpmlibNeedsFeature(pkg, "PartialHardlinkSets", "4.0.4-1");
 
-    genCpioListAndHeader(&fl, pkg, 0);
+    genCpioListAndHeader(fl, pkg, 0);
 
 exit:
-    FileListFree(&fl);
-    specialDirFree(specialDoc);
-    specialDirFree(specialLic);
-    return fl.processingFailed ? RPMRC_FAIL : RPMRC_OK;
+    return fl->processingFailed ? RPMRC_FAIL : RPMRC_OK;
+}
+
+static void freePackageFiles(PackageFiles pf)
+{
+    FileListFree(&pf->fl);
+    specialDirFree(pf->specialDoc);
+    specialDirFree(pf->specialLic);
+    rpmlogDeferFree(pf->log);
+    memset(pf, 0, sizeof(*pf));
+}
+
+static rpmRC processPackageFiles(rpmSpec spec, rpmBuildPkgFlags pkgFlags,
+				 Package pkg, int didInstall, int test)
+{
+    struct PackageFiles_s pf;
+    rpmRC rc;
+
+    memset(&pf, 0, sizeof(pf));
+    rc = readPackageFiles(spec, pkgFlags, pkg, &pf);
+    if (rc == RPMRC_OK)
+	rc = finishPackageFiles(spec, pkgFlags, pkg, didInstall, test, &pf);
+    freePackageFiles(&pf);
+    return rc;
+}
+
+/*
+ * Read the file lists of the packages up to (not including) last in
+ * parallel. Each thread expands macros in a context of its own, log
+ * messages are held back to be logged in package order.
+ */
+static PackageFiles readAllPackageFiles(rpmSpec spec, rpmBuildPkgFlags pkgFlags,
+					Package last, int *npfs)
+{
+    Package *pkgs = NULL;
+    PackageFiles pfs = NULL;
+    int npkgs = 0;
+
+    for (Package pkg = spec->packages; pkg != last; pkg = pkg->next)
+	npkgs++;
+    if (npkgs < 2)
+	return NULL;
+
+    pkgs = xcalloc(npkgs, sizeof(*pkgs));
+    pfs = xcalloc(npkgs, sizeof(*pfs));
+    npkgs = 0;
+    for (Package pkg = spec->packages; pkg != last; pkg = pkg->next) {
+	pkgs[npkgs++] = pkg;
+	if (pkg->fileList)
+	    headerPutString(pkg->header, RPMTAG_SOURCERPM, spec->sourceRpmName);
+    }
+
+    #pragma omp parallel
+    {
+    rpmMacroContext mc = rpmMacroContextNew(NULL);
+    rpmMacroContext omc = rpmMacroContextSetThread(mc);
+
+    #pragma omp for schedule(dynamic, 1)
+    for (int i = 0; i < npkgs; i++) {
+	if (pkgs[i]->fileList == NULL)
+	    continue;
+	rpmlogDeferStart();
+	pfs[i].rc = readPackageFiles(spec, pkgFlags, pkgs[i], &pfs[i]);
+	pfs[i].log = rpmlogDeferStop();
+    }
+
+    rpmMacroContextSetThread(omc);
+    rpmMacroContextFree(mc);
+    } /* omp parallel */
+
+    free(pkgs);
+    *npfs = npkgs;
+    return pfs;
 }
 
 static void genSourceRpmName(rpmSpec spec)
@@ -3157,12 +3394,20 @@ rpmRC processBinaryFiles(rpmSpec spec, rpmBuildPkgFlags pkgFlags,
     /* The debugsource package, if it exists, that the debuginfo package(s)
        should Recommend.  */
     Package dbgsrcpkg = findDebugsourcePackage(spec);
+    PackageFiles pfs = NULL;		/* file lists read in parallel */
+    int npfs = 0;
+    int ix;
     
 #ifdef HAVE_LIBDW
     elf_version (EV_CURRENT);
 #endif
     check_fileList = newStringBuf();
     genSourceRpmName(spec);
+    /* lots of %files patterns tend to hit the same directories */
+    rpmGlobCacheEnable();
+    char *fccache = rpmExpand("%{?_fileclass_cache}", NULL);
+    spec->fccache = rpmfcCacheNew(fccache);
+    free(fccache);
     buildroot = rpmGenPath(spec->rootDir, spec->buildRoot, NULL);
     
     if (rpmExpandNumeric("%{?_debuginfo_subpackages}")) {
@@ -3195,7 +3440,11 @@ rpmRC processBinaryFiles(rpmSpec spec, rpmBuildPkgFlags pkgFlags,
 	    addPackageDeps(dbgpkg, dbgsrcpkg, RPMTAG_RECOMMENDNAME);
     }
 
-    for (pkg = spec->packages; pkg != NULL; pkg = pkg->next) {
+    /* The packages before the debuginfo ones can be read up front */
+    pfs = readAllPackageFiles(spec, pkgFlags, maindbg, &npfs);
+
+    for (pkg = spec->packages, ix = 0; pkg != NULL; pkg = pkg->next, ix++) {
+	PackageFiles pf = (ix < npfs) ? &pfs[ix] : NULL;
 	char *nvr;
 	const char *a;
 	int header_color;
@@ -3218,13 +3467,23 @@ rpmRC processBinaryFiles(rpmSpec spec, rpmBuildPkgFlags pkgFlags,
 	if (pkg->fileList == NULL)
 	    continue;
 
-	headerPutString(pkg->header, RPMTAG_SOURCERPM, spec->sourceRpmName);
+	if (pf == NULL)
+	    headerPutString(pkg->header, RPMTAG_SOURCERPM, spec->sourceRpmName);
 
 	nvr = headerGetAsString(pkg->header, RPMTAG_NVRA);
 	rpmlog(RPMLOG_NOTICE, _("Processing files: %s\n"), nvr);
 	free(nvr);
 
-	if ((rc = processPackageFiles(spec, pkgFlags, pkg, didInstall, test)) != RPMRC_OK)
+	if (pf) {
+	    pf->log = rpmlogDeferFlush(pf->log);
+	    rc = pf->rc;
+	    if (rc == RPMRC_OK)
+		rc = finishPackageFiles(spec, pkgFlags, pkg, didInstall, test, pf);
+	    freePackageFiles(pf);
+	} else {
+	    rc = processPackageFiles(spec, pkgFlags, pkg, didInstall, test);
+	}
+	if (rc != RPMRC_OK)
 	    goto exit;
 
 	if (maindbg)
@@ -3233,7 +3492,12 @@ rpmRC processBinaryFiles(rpmSpec spec, rpmBuildPkgFlags pkgFlags,
 	else if (deplink && pkg != deplink)
 	    addPackageDeps(pkg, deplink, RPMTAG_REQUIRENAME);
 
-        if ((rc = rpmfcGenerateDepends(spec, pkg)) != RPMRC_OK)
+	struct rpmsw_s dbegin, dend;
+	rpmswNow(&dbegin);
+	rc = rpmfcGenerateDepends(spec, pkg);
+	rpmswNow(&dend);
+	pkg->stats.depgenUsecs = rpmswDiff(&dend, &dbegin);
+	if (rc != RPMRC_OK)
 	    goto exit;
 
 	a = headerGetString(pkg->header, RPMTAG_ARCH);
@@ -3267,6 +3531,12 @@ rpmRC processBinaryFiles(rpmSpec spec, rpmBuildPkgFlags pkgFlags,
 	rc = RPMRC_FAIL;
     }
 exit:
+    /* on failure the rest is dropped, as if it hadn't been read yet */
+    for (ix = 0; ix < npfs; ix++)
+	freePackageFiles(&pfs[ix]);
+    free(pfs);
+    rpmGlobCacheDisable();
+    spec->fccache = rpmfcCacheFree(spec->fccache);
     check_fileList = freeStringBuf(check_fileList);
     _free(buildroot);
     _free(uniquearch);
@@ -6,12 +6,15 @@
 #include "system.h"
 
 #include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <sys/wait.h>
+#include <time.h>
 
 #include <rpm/rpmlib.h>			/* RPMSIGTAG*, rpmReadPackageFile */
 #include <rpm/rpmfileutil.h>
 #include <rpm/rpmlog.h>
+#include <rpm/rpmsw.h>
 
 #include "rpmio/rpmio_internal.h"	/* fdInitDigest, fdFiniDigest */
 #include "lib/fsm.h"
@@ -22,22 +25,134 @@
 
 #include "debug.h"
 
+/*
+ * Source file read-ahead while writing the payload. The files whose
+ * content goes into the archive are listed in the order the archive
+ * writer iterates them (plain files first, then the hard link sets),
+ * and the kernel is asked to start reading up to %_build_readahead bytes
+ * of the upcoming files while the current one is being compressed.
+ */
+struct readahead_s {
+    ARGV_t dpaths;
+    int *order;		/* file indexes in archive content order */
+    rpm_loff_t *sizes;
+    int nfiles;
+    int next;		/* next file to hint */
+    int done;		/* files consumed */
+    rpm_loff_t ahead;	/* bytes hinted but not yet consumed */
+    rpm_loff_t window;
+};
+
+static int needsContent(rpmfiles fi, int i)
+{
+    return !(rpmfilesFFlags(fi, i) & RPMFILE_GHOST) &&
+	    S_ISREG(rpmfilesFMode(fi, i)) && rpmfilesFSize(fi, i) > 0;
+}
+
+static void readaheadInit(struct readahead_s *ra, rpmfiles fi, ARGV_t dpaths)
+{
+    int fc = rpmfilesFC(fi);
+    const int *hardlinks;
+
+    memset(ra, 0, sizeof(*ra));
+    ra->window = rpmExpandNumeric("%{?_build_readahead}");
+    if (ra->window <= 0 || fc == 0)
+	return;
+
+    ra->dpaths = dpaths;
+    ra->order = xmalloc(fc * sizeof(*ra->order));
+    ra->sizes = xmalloc(fc * sizeof(*ra->sizes));
+    for (int i = 0; i < fc; i++) {
+	if (rpmfilesFNlink(fi, i) < 2 && needsContent(fi, i))
+	    ra->order[ra->nfiles++] = i;
+    }
+    for (int i = 0; i < fc; i++) {
+	if (rpmfilesFLinks(fi, i, &hardlinks) > 1 && hardlinks[0] == i &&
+		needsContent(fi, i))
+	    ra->order[ra->nfiles++] = i;
+    }
+    for (int i = 0; i < ra->nfiles; i++)
+	ra->sizes[i] = rpmfilesFSize(fi, ra->order[i]);
+}
+
+static void readaheadFree(struct readahead_s *ra)
+{
+    free(ra->order);
+    free(ra->sizes);
+}
+
+/* Account for file fx being written and hint the files after it */
+static void readaheadNext(struct readahead_s *ra, int fx)
+{
+#ifdef POSIX_FADV_WILLNEED
+    if (ra->order == NULL)
+	return;
+
+    /* Resynchronize if the archive writer went a different way */
+    int p = ra->done;
+    while (p < ra->nfiles && ra->order[p] != fx)
+	p++;
+    if (p >= ra->nfiles)
+	return;
+    for (; ra->done < p; ra->done++) {
+	if (ra->next > ra->done)
+	    ra->ahead -= ra->sizes[ra->done];
+    }
+    if (ra->next > ra->done) {
+	ra->ahead -= ra->sizes[ra->done];
+    } else {
+	/* Not hinted, the current file is being read right away anyway */
+	ra->next = ra->done + 1;
+	ra->ahead = 0;
+    }
+    ra->done++;
+
+    while (ra->next < ra->nfiles && ra->ahead < ra->window) {
+	int ix = ra->next++;
+	rpm_loff_t len = ra->sizes[ix];
+	int fd;
+
+	if (len > ra->window - ra->ahead)
+	    len = ra->window - ra->ahead;
+	fd = open(ra->dpaths[ra->order[ix]], O_RDONLY|O_CLOEXEC);
+	if (fd >= 0) {
+	    (void) posix_fadvise(fd, 0, len, POSIX_FADV_WILLNEED);
+	    close(fd);
+	}
+	ra->ahead += ra->sizes[ix];
+    }
+#endif
+}
+
 static int rpmPackageFilesArchive(rpmfiles fi, int isSrc,
-				  FD_t cfd, ARGV_t dpaths,
+				  FD_t cfd, ARGV_t dpaths, rpm_loff_t * offsets,
 				  rpm_loff_t * archiveSize, char ** failedFile)
 {
     int rc = 0;
     rpmfi archive = rpmfiNewArchiveWriter(cfd, fi);
+    rpm_loff_t pos = 0;
+    struct readahead_s ra;
+
+    readaheadInit(&ra, fi, dpaths);
 
     while (!rc && (rc = rpmfiNext(archive)) >= 0) {
         /* Copy file into archive. */
 	FD_t rfd = NULL;
 	const char *path = dpaths[rpmfiFX(archive)];
 
+	/* Header of this file starts where the previous file ended */
+	if (offsets)
+	    offsets[rpmfiFX(archive)] = pos;
+
+	readaheadNext(&ra, rpmfiFX(archive));
+
 	rfd = Fopen(path, "r.ufdio");
 	if (Ferror(rfd)) {
 	    rc = RPMERR_OPEN_FAILED;
 	} else {
+#ifdef POSIX_FADV_SEQUENTIAL
+	    (void) posix_fadvise(Fileno(rfd), 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
 	    rc = rpmfiArchiveWriteFile(archive, rfd);
 	}
 
@@ -49,6 +164,7 @@ static int rpmPackageFilesArchive(rpmfiles fi, int isSrc,
 	    Fclose(rfd);
 	    errno = myerrno;
 	}
+	pos = rpmfiArchiveTell(archive);
     }
 
     if (rc == RPMERR_ITER_END)
@@ -62,6 +178,7 @@ static int rpmPackageFilesArchive(rpmfiles fi, int isSrc,
 	*archiveSize = (rc == 0) ? rpmfiArchiveTell(archive) : 0;
 
     rpmfiFree(archive);
+    readaheadFree(&ra);
 
     return rc;
 }
@@ -69,10 +186,12 @@ static int rpmPackageFilesArchive(rpmfiles fi, int isSrc,
  * @todo Create transaction set *much* earlier.
  */
 static rpmRC cpio_doio(FD_t fdo, Package pkg, const char * fmodeMacro,
-			int pld_algo,
-			rpm_loff_t *archiveSize, char ** pldig)
+			int pld_algo, rpm_loff_t *offsets,
+			const uint8_t *dict, size_t dictlen,
+			rpm_loff_t *archiveSize, char ** pldig, char ** cpldig)
 {
     char *failedFile = NULL;
+    rpmDigestBundle cbundle = NULL;
     FD_t cfd;
     int fsmrc;
 
@@ -81,12 +200,34 @@ static rpmRC cpio_doio(FD_t fdo, Package pkg, const char * fmodeMacro,
     if (cfd == NULL)
 	return RPMRC_FAIL;
 
+    if (dict && fdSetDictionary(cfd, dict, dictlen)) {
+	rpmlog(RPMLOG_ERR, _("Unable to use payload dictionary\n"));
+	Fclose(cfd);
+	return RPMRC_FAIL;
+    }
+
     /* Calculate alternative (uncompressed) payload digest while writing */
     fdInitDigestID(cfd, pld_algo, RPMTAG_PAYLOADDIGESTALT, 0);
+
+    /*
+     * Calculate the compressed one while writing too where we can see
+     * the compressed data, otherwise the caller has to read it back.
+     */
+    if (fdIsPlain(cfd)) {
+	fdInitDigestID(cfd, pld_algo, RPMTAG_PAYLOADDIGEST, 0);
+    } else {
+	cbundle = rpmDigestBundleNew();
+	rpmDigestBundleAddID(cbundle, pld_algo, RPMTAG_PAYLOADDIGEST, 0);
+	if (fdSetOutputBundle(cfd, cbundle))
+	    cbundle = rpmDigestBundleFree(cbundle);
+    }
+
     fsmrc = rpmPackageFilesArchive(pkg->cpioList, headerIsSource(pkg->header),
-				   cfd, pkg->dpaths,
+				   cfd, pkg->dpaths, offsets,
 				   archiveSize, &failedFile);
     fdFiniDigest(cfd, RPMTAG_PAYLOADDIGESTALT, (void **)pldig, NULL, 1);
+    if (cbundle == NULL)
+	fdFiniDigest(cfd, RPMTAG_PAYLOADDIGEST, (void **)cpldig, NULL, 1);
 
     if (fsmrc) {
 	char *emsg = rpmfileStrerror(fsmrc);
@@ -101,6 +242,13 @@ static rpmRC cpio_doio(FD_t fdo, Package pkg, const char * fmodeMacro,
     free(failedFile);
     Fclose(cfd);
 
+    /* The compression layer writes out the rest when closed */
+    if (cbundle) {
+	rpmDigestBundleFinal(cbundle, RPMTAG_PAYLOADDIGEST,
+			     (void **)cpldig, NULL, 1);
+	rpmDigestBundleFree(cbundle);
+    }
+
     return (fsmrc == 0) ? RPMRC_OK : RPMRC_FAIL;
 }
 
@@ -273,6 +421,146 @@ static int haveRichDep(Package pkg)
     return 0;
 }
 
+/* Collect up to size bytes from the start of the package files */
+static uint8_t *samplePayload(Package pkg, size_t size, size_t *lenp)
+{
+    rpmfiles fi = pkg->cpioList;
+    int fc = rpmfilesFC(fi);
+    uint8_t *sample = xmalloc(size);
+    size_t len = 0;
+
+    for (int i = 0; i < fc && len < size; i++) {
+	FD_t fd;
+	ssize_t nb;
+
+	if (!S_ISREG(rpmfilesFMode(fi, i)) || rpmfilesFSize(fi, i) == 0 ||
+		(rpmfilesFFlags(fi, i) & RPMFILE_GHOST))
+	    continue;
+	fd = Fopen(pkg->dpaths[i], "r.ufdio");
+	if (fd == NULL || Ferror(fd)) {
+	    Fclose(fd);
+	    continue;
+	}
+	while (len < size && (nb = Fread(sample + len, 1, size - len, fd)) > 0)
+	    len += nb;
+	Fclose(fd);
+    }
+
+    *lenp = len;
+    if (len == 0)
+	sample = _free(sample);
+    return sample;
+}
+
+/* Compress a sample, return the compressed size and time taken */
+static int trialCompress(const char *rpmio_flags, const uint8_t *sample,
+			 size_t len, size_t *csize, rpmtime_t *usecs)
+{
+    FILE *tf = tmpfile();
+    struct rpmsw_s begin, end;
+    struct stat sb;
+    FD_t cfd;
+    int rc = -1;
+
+    if (tf == NULL)
+	return rc;
+
+    rpmswNow(&begin);
+    cfd = Fdopen(fdDup(fileno(tf)), rpmio_flags);
+    if (cfd) {
+	ssize_t nb = Fwrite(sample, 1, len, cfd);
+	if (Fclose(cfd) == 0 && nb == (ssize_t) len && fstat(fileno(tf), &sb) == 0) {
+	    rpmswNow(&end);
+	    *usecs = rpmswDiff(&end, &begin);
+	    *csize = sb.st_size;
+	    rc = 0;
+	}
+    }
+    fclose(tf);
+    return rc;
+}
+
+/*
+ * Pick the compression level of a binary package payload when
+ * %_payload_time_budget or %_payload_ratio_target is set: the highest of
+ * %_payload_levels up to the configured one whose compression time,
+ * estimated from a sample of the package files, fits in the package's
+ * share of the time budget, but no higher than the first level reaching
+ * the ratio target. Returns new flags or NULL to keep the configured ones.
+ */
+static char *adaptIOFlags(Package pkg, const char *rpmio_flags)
+{
+    int ratio = rpmExpandNumeric("%{?_payload_ratio_target}");
+    int ssize = rpmExpandNumeric("%{?_payload_sample_size}");
+    const char *rest = rpmio_flags + 1;
+    char *levels = NULL;
+    ARGV_t lvls = NULL;
+    uint8_t *sample = NULL;
+    uint64_t pkgsize;
+    size_t slen = 0;
+    char *flags = NULL;
+    int maxlevel;
+
+    if (pkg->pldBudget <= 0 && ratio <= 0)
+	return NULL;
+
+    /* Only for explicit levels, ie "w<level>[flags].<io>" */
+    maxlevel = strtol(rest, (char **)&rest, 10);
+    if (rest == rpmio_flags + 1 || maxlevel <= 0)
+	return NULL;
+
+    sample = samplePayload(pkg, ssize > 0 ? ssize : 1024 * 1024, &slen);
+    if (sample == NULL)
+	return NULL;
+    pkgsize = headerGetNumber(pkg->header, RPMTAG_LONGSIZE);
+    if (pkgsize < slen)
+	pkgsize = slen;
+
+    levels = rpmExpand("%{?_payload_levels}", NULL);
+    if (*levels == '\0') {
+	free(levels);
+	levels = xstrdup("1 3 6 9 12 15 19");
+    }
+    argvSplit(&lvls, levels, " \t");
+
+    for (ARGV_const_t l = lvls; l && *l; l++) {
+	int level = atoi(*l);
+	char *trial = NULL;
+	size_t csize = 0;
+	rpmtime_t usecs = 0;
+	double estimate;
+
+	if (level <= 0 || level > maxlevel)
+	    continue;
+	rasprintf(&trial, "w%d%s", level, rest);
+	if (trialCompress(trial, sample, slen, &csize, &usecs)) {
+	    free(trial);
+	    break;
+	}
+	estimate = (double) usecs / 1000000 * pkgsize / slen;
+	rpmlog(RPMLOG_DEBUG, "payload level %d: %zu%% in %.2fs (estimated)\n",
+	       level, (size_t) (csize * 100 / slen), estimate);
+
+	/* Going over the budget, stay at the previous level if there's one */
+	if (pkg->pldBudget > 0 && estimate > pkg->pldBudget && flags) {
+	    free(trial);
+	    break;
+	}
+	free(flags);
+	flags = trial;
+	if (ratio > 0 && csize * 100 <= (size_t) ratio * slen)
+	    break;
+    }
+
+    if (flags)
+	rpmlog(RPMLOG_DEBUG, "payload compression: %s\n", flags);
+
+    argvFree(lvls);
+    free(levels);
+    free(sample);
+    return flags;
+}
+
 static char *getIOFlags(Package pkg)
 {
     char *rpmio_flags;
@@ -289,6 +577,16 @@ static char *getIOFlags(Package pkg)
 	free(rpmio_flags);
 	rpmio_flags = xstrdup("w9.gzdio");
     }
+
+    /* Adapt the level to the package if asked to */
+    if (!headerIsSource(pkg->header)) {
+	char *flags = adaptIOFlags(pkg, rpmio_flags);
+	if (flags) {
+	    free(rpmio_flags);
+	    rpmio_flags = flags;
+	}
+    }
+
     s = strchr(rpmio_flags, '.');
     if (s) {
 	char *buf = NULL;
@@ -444,6 +742,108 @@ exit:
  * header. In other words, we need to write things in the exact opposite
  * order to how the RPM format is laid on disk.
  */
+/* Does the payload compression mode (eg w19S.zstdio) ask for frames? */
+static int isSeekable(const char *rpmio_flags)
+{
+    const char *s = strchr(rpmio_flags, '.');
+    return (s && rstreq(s, ".zstdio") &&
+	    (memchr(rpmio_flags, 'S', s - rpmio_flags) ||
+	     memchr(rpmio_flags, 'C', s - rpmio_flags)));
+}
+
+/* Maximum size of a file used as dictionary training sample */
+#define DICT_SAMPLE_MAX	(128 * 1024)
+
+/*
+ * Train a payload dictionary on the (small) files of the package. Only
+ * files up to DICT_SAMPLE_MAX bytes, and no more than 100 times the
+ * dictionary size in total, are used as samples.
+ */
+static uint8_t * trainDict(rpmfiles fi, ARGV_t dpaths, size_t capacity,
+			   size_t *lenp)
+{
+    int fc = rpmfilesFC(fi);
+    size_t budget = capacity * 100;
+    size_t total = 0;
+    unsigned int nsamples = 0;
+    size_t *sizes = xmalloc(fc * sizeof(*sizes));
+    uint8_t *samples = NULL;
+    uint8_t *dict = NULL;
+
+    for (int i = 0; i < fc && total < budget; i++) {
+	rpm_loff_t fsize = rpmfilesFSize(fi, i);
+	uint8_t *b = NULL;
+	ssize_t blen = 0;
+
+	if (!S_ISREG(rpmfilesFMode(fi, i)) || fsize == 0 ||
+		fsize > DICT_SAMPLE_MAX || fsize > budget - total ||
+		(rpmfilesFFlags(fi, i) & RPMFILE_GHOST))
+	    continue;
+	if (rpmioSlurp(dpaths[i], &b, &blen) || blen <= 0) {
+	    free(b);
+	    continue;
+	}
+	samples = xrealloc(samples, total + blen);
+	memcpy(samples + total, b, blen);
+	sizes[nsamples++] = blen;
+	total += blen;
+	free(b);
+    }
+
+    if (nsamples > 0) {
+	dict = xmalloc(capacity);
+	*lenp = rpmioTrainDictionary(dict, capacity, samples, sizes, nsamples);
+	if (*lenp == 0)
+	    dict = _free(dict);
+    }
+    rpmlog(RPMLOG_DEBUG, "payload dictionary: %zu bytes from %u samples\n",
+	   dict ? *lenp : 0, nsamples);
+
+    free(samples);
+    free(sizes);
+    return dict;
+}
+
+/*
+ * Get the dictionary for a zstd payload: %_payload_dict is either a path
+ * to a dictionary file or "train" for training one of up to
+ * %_payload_dict_size bytes on the package contents.
+ */
+static rpmRC getPayloadDict(Package pkg, const char *rpmio_flags,
+			    uint8_t **dictp, size_t *lenp)
+{
+    const char *s = strchr(rpmio_flags, '.');
+    char *dictmode = rpmExpand("%{?_payload_dict}", NULL);
+    rpmRC rc = RPMRC_OK;
+
+    *dictp = NULL;
+    *lenp = 0;
+
+    if (*dictmode == '\0' || s == NULL || !rstreq(s, ".zstdio"))
+	goto exit;
+
+    if (rstreq(dictmode, "train")) {
+	int size = rpmExpandNumeric("%{?_payload_dict_size}");
+	if (size <= 0)
+	    size = 32 * 1024;
+	*dictp = trainDict(pkg->cpioList, pkg->dpaths, size, lenp);
+    } else {
+	ssize_t blen = 0;
+	if (rpmioSlurp(dictmode, dictp, &blen) || blen <= 0) {
+	    rpmlog(RPMLOG_ERR, _("Could not read payload dictionary %s\n"),
+		   dictmode);
+	    *dictp = _free(*dictp);
+	    rc = RPMRC_FAIL;
+	} else {
+	    *lenp = blen;
+	}
+    }
+
+exit:
+    free(dictmode);
+    return rc;
+}
+
 static rpmRC writeRPM(Package pkg, unsigned char ** pkgidp,
 		      const char *fileName, char **cookie,
 		      rpm_time_t buildTime, const char* buildHost)
@@ -455,6 +855,10 @@ static rpmRC writeRPM(Package pkg, unsigned char ** pkgidp,
     uint8_t * MD5 = NULL;
     char * pld = NULL;
     char * upld = NULL;
+    rpm_loff_t * offsets = NULL;
+    uint8_t * dict = NULL;
+    size_t dictlen = 0;
+    int nfiles = rpmfilesFC(pkg->cpioList);
     uint32_t pld_algo = RPM_HASH_SHA256; /* TODO: macro configuration */
     rpmRC rc = RPMRC_FAIL; /* assume failure */
     rpm_loff_t archiveSize = 0;
@@ -481,6 +885,18 @@ static rpmRC writeRPM(Package pkg, unsigned char ** pkgidp,
     headerPutString(pkg->header, RPMTAG_PAYLOADDIGEST, pld);
     headerPutString(pkg->header, RPMTAG_PAYLOADDIGESTALT, pld);
     pld = _free(pld);
+
+    /* Seekable payloads get a file index, use a placeholder of right size */
+    if (isSeekable(rpmio_flags) && nfiles > 0) {
+	offsets = xcalloc(nfiles, sizeof(*offsets));
+	headerPutUint64(pkg->header, RPMTAG_PAYLOADFILEOFFSETS, offsets, nfiles);
+    }
+
+    /* The payload dictionary is needed for reading it, store it in header */
+    if (getPayloadDict(pkg, rpmio_flags, &dict, &dictlen))
+	goto exit;
+    if (dict)
+	headerPutBin(pkg->header, RPMTAG_PAYLOADDICT, dict, dictlen);
     
     /* Check for UTF-8 encoding of string tags, add encoding tag if all good */
     if (checkForEncoding(pkg->header, 1))
@@ -520,15 +936,22 @@ static rpmRC writeRPM(Package pkg, unsigned char ** pkgidp,
 
     /* Write payload section (cpio archive) */
     payloadStart = Ftell(fd);
-    if (cpio_doio(fd, pkg, rpmio_flags, pld_algo, &archiveSize, &upld))
+    struct rpmsw_s pbegin, pend;
+    rpmswNow(&pbegin);
+    if (cpio_doio(fd, pkg, rpmio_flags, pld_algo, offsets, dict, dictlen,
+		  &archiveSize, &upld, &pld))
 	goto exit;
+    rpmswNow(&pend);
+    pkg->stats.payloadUsecs = rpmswDiff(&pend, &pbegin);
     payloadEnd = Ftell(fd);
 
-    /* Re-read payload to calculate compressed digest */
-    fdInitDigestID(fd, pld_algo, RPMTAG_PAYLOADDIGEST, 0);
-    if (fdConsume(fd, payloadStart, payloadEnd - payloadStart))
-	goto exit;
-    fdFiniDigest(fd, RPMTAG_PAYLOADDIGEST, (void **)&pld, NULL, 1);
+    /* Re-read payload for the compressed digest if it wasn't seen */
+    if (pld == NULL) {
+	fdInitDigestID(fd, pld_algo, RPMTAG_PAYLOADDIGEST, 0);
+	if (fdConsume(fd, payloadStart, payloadEnd - payloadStart))
+	    goto exit;
+	fdFiniDigest(fd, RPMTAG_PAYLOADDIGEST, (void **)&pld, NULL, 1);
+    }
 
     /* Insert the payload digests in main header */
     headerDel(pkg->header, RPMTAG_PAYLOADDIGEST);
@@ -536,19 +959,27 @@ static rpmRC writeRPM(Package pkg, unsigned char ** pkgidp,
     headerDel(pkg->header, RPMTAG_PAYLOADDIGESTALT);
     headerPutString(pkg->header, RPMTAG_PAYLOADDIGESTALT, upld);
     pld = _free(pld);
+    if (offsets) {
+	headerDel(pkg->header, RPMTAG_PAYLOADFILEOFFSETS);
+	headerPutUint64(pkg->header, RPMTAG_PAYLOADFILEOFFSETS, offsets, nfiles);
+    }
 
-    /* Write the final header */
+    /*
+     * Write the final header, calculating the digests while writing:
+     * SHA on header, legacy MD5 on header + payload. The payload is
+     * final by now, so MD5 still needs it read back, but only once.
+     */
     if (fdJump(fd, hdrStart))
 	goto exit;
-    if (writeHdr(fd, pkg->header))
-	goto exit;
-
-    /* Calculate digests: SHA on header, legacy MD5 on header + payload */
     fdInitDigestID(fd, RPM_HASH_MD5, RPMTAG_SIGMD5, 0);
     fdInitDigestID(fd, RPM_HASH_SHA1, RPMTAG_SHA1HEADER, 0);
     fdInitDigestID(fd, RPM_HASH_SHA256, RPMTAG_SHA256HEADER, 0);
-    if (fdConsume(fd, hdrStart, payloadStart - hdrStart))
+    if (writeHdr(fd, pkg->header))
 	goto exit;
+    if (Ftell(fd) != payloadStart) {
+	rpmlog(RPMLOG_ERR, _("Header size changed writing %s\n"), fileName);
+	goto exit;
+    }
     fdFiniDigest(fd, RPMTAG_SHA1HEADER, (void **)&SHA1, NULL, 1);
     fdFiniDigest(fd, RPMTAG_SHA256HEADER, (void **)&SHA256, NULL, 1);
 
@@ -567,6 +998,8 @@ static rpmRC writeRPM(Package pkg, unsigned char ** pkgidp,
 
 exit:
     free(rpmio_flags);
+    free(offsets);
+    free(dict);
     free(SHA1);
     free(SHA256);
     free(upld);
@@ -726,6 +1159,14 @@ static rpmRC packageBinary(rpmSpec spec, Package pkg, const char *cookie, int ch
 	    rc = checkPackages(pkgcheck);
 	}
 	free(pkgcheck);
+
+	/* Run the set check on it right away too if it's split up */
+	if (rc == RPMRC_OK && rpmExpandNumeric("%{?_build_pkgcheck_set_split}")) {
+	    pkgcheck = rpmExpand("%{?_build_pkgcheck_set} ", *filename, NULL);
+	    if (pkgcheck[0] != ' ')
+		rc = checkPackages(pkgcheck);
+	    free(pkgcheck);
+	}
     }
     return rc;
 }
@@ -764,13 +1205,42 @@ rpmRC packageBinaries(rpmSpec spec, const char *cookie, int cheating)
     }
     qsort(tasks, npkgs, sizeof(Package), compareBinaries);
 
+    /* Share out the payload compression time budget by package size */
+    int budget = rpmExpandNumeric("%{?_payload_time_budget}");
+    if (budget > 0) {
+	uint64_t total = 0;
+	for (int i = 0; i < npkgs; i++)
+	    total += headerGetNumber(tasks[i]->header, RPMTAG_LONGSIZE);
+	for (int i = 0; i < npkgs; i++) {
+	    uint64_t size = headerGetNumber(tasks[i]->header, RPMTAG_LONGSIZE);
+	    tasks[i]->pldBudget = total ? (double) budget * size / total : budget;
+	}
+    }
+
     #pragma omp parallel
     #pragma omp single
     for (int i = 0; i < npkgs; i++) {
 	Package pkg = tasks[i];
-	#pragma omp task untied priority(i)
+	/*
+	 * Tied, the task's thread has its own macro context for expanding
+	 * without the global lock.
+	 */
+	#pragma omp task priority(i)
 	{
+	rpmMacroContext mc = rpmMacroContextNew(NULL);
+	rpmMacroContext omc = rpmMacroContextSetThread(mc);
+	struct rpmsw_s begin, end;
+	struct timespec cpu0, cpu1;
+	rpmswNow(&begin);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu0);
 	pkg->rc = packageBinary(spec, pkg, cookie, cheating, &pkg->filename);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu1);
+	rpmswNow(&end);
+	pkg->stats.usecs = rpmswDiff(&end, &begin);
+	pkg->stats.cpuUsecs = (cpu1.tv_sec - cpu0.tv_sec) * 1000000 +
+			      (cpu1.tv_nsec - cpu0.tv_nsec) / 1000;
+	rpmMacroContextSetThread(omc);
+	rpmMacroContextFree(mc);
 	rpmlog(RPMLOG_DEBUG,
 		_("Finished binary package job, result %d, filename %s\n"),
 		pkg->rc, pkg->filename);
@@ -783,8 +1253,8 @@ rpmRC packageBinaries(rpmSpec spec, const char *cookie, int cheating)
 	    break;
     }
 
-    /* Now check the package set if enabled */
-    if (rc == RPMRC_OK)
+    /* Now check the package set if enabled, and not done per package */
+    if (rc == RPMRC_OK && !rpmExpandNumeric("%{?_build_pkgcheck_set_split}"))
 	rc = checkPackageSet(spec->packages);
 
     free(tasks);
@@ -126,6 +126,8 @@ rpmRC parseRCPOT(rpmSpec spec, Package pkg, const char *field, rpmTagVal tagN,
     const char *r, *re, *v, *ve;
     char *emsg = NULL;
     char * N = NULL, * EVR = NULL;
+    /* Name and version of each dependency are copied here, no allocations */
+    char * buf = xmalloc(strlen(field) + 2);
     rpmTagVal nametag = RPMTAG_NOT_FOUND;
     rpmsenseFlags Flags;
     rpmRC rc = RPMRC_FAIL; /* assume failure */
@@ -240,7 +242,7 @@ rpmRC parseRCPOT(rpmSpec spec, Package pkg, const char *field, rpmTagVal tagN,
 
 	re = r;
 	SKIPNONWHITE(re);
-	N = xmalloc((re-r) + 1);
+	N = buf;
 	rstrlcpy(N, r, (re-r) + 1);
 
 	/* Parse EVR */
@@ -267,7 +269,7 @@ rpmRC parseRCPOT(rpmSpec spec, Package pkg, const char *field, rpmTagVal tagN,
 		    rasprintf(&emsg, _("Version required"));
 		    goto exit;
 		}
-		EVR = xmalloc((ve-v) + 1);
+		EVR = N + strlen(N) + 1;
 		rstrlcpy(EVR, v, (ve-v) + 1);
 		re = ve;	/* ==> next token after EVR string starts here */
 	    }
@@ -324,9 +326,6 @@ rpmRC parseRCPOT(rpmSpec spec, Package pkg, const char *field, rpmTagVal tagN,
 	    goto exit;
 	}
 
-	N = _free(N);
-	EVR = _free(EVR);
-
     }
     rc = RPMRC_OK;
 
@@ -342,8 +341,7 @@ exit:
 	}
 	free(emsg);
     }
-    _free(N);
-    _free(EVR);
+    free(buf);
 
     return rc;
 }
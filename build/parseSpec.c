@@ -143,6 +143,7 @@ static OFI_t * pushOFI(rpmSpec spec, const char *fn)
     ofi->readBuf[0] = '\0';
     ofi->readPtr = NULL;
     ofi->next = spec->fileStack;
+    argvAdd(&spec->inputFiles, fn);
 
     rpmPushMacroFlags(spec->macros, "__file_name", NULL, fn, RMIL_SPEC, RPMMACRO_LITERAL);
 
@@ -243,6 +244,10 @@ static int expandMacrosInSpecBuf(rpmSpec spec, int strip)
 	    return 0;
     }
 
+    /* Most lines (%changelog, %files, scriptlets) have nothing to expand */
+    if (strchr(spec->lbuf, '%') == NULL)
+	return 0;
+
     if (specExpand(spec, ofi->lineNum, spec->lbuf, &lbuf))
 	return 1;
 
@@ -267,9 +272,16 @@ static int expandMacrosInSpecBuf(rpmSpec spec, int strip)
 		spec->lineNum, bufA);
     }
 
-    free(spec->lbuf);
-    spec->lbuf = lbuf;
-    spec->lbufSize = strlen(spec->lbuf) + 1;
+    /* Keep the line buffer around for the next line if the result fits */
+    size_t len = strlen(lbuf) + 1;
+    if (len <= spec->lbufSize) {
+	memcpy(spec->lbuf, lbuf, len);
+	free(lbuf);
+    } else {
+	free(spec->lbuf);
+	spec->lbuf = lbuf;
+	spec->lbufSize = len;
+    }
 
     return 0;
 }
@@ -279,28 +291,37 @@ static int copyNextLineFromOFI(rpmSpec spec, OFI_t *ofi, int strip)
 {
     /* Expand next line from file into line buffer */
     if (!(spec->nextline && *spec->nextline)) {
-	int pc = 0, bc = 0, xc = 0, nc = 0;
+	int pc = spec->pc, bc = spec->bc, xc = spec->xc, nc = spec->nc;
 	const char *from = ofi->readPtr;
-	char ch = ' ';
-	while (from && *from && ch != '\n') {
-	    ch = spec->lbuf[spec->lbufOff] = *from;
-	    spec->lbufOff++; from++;
-
-	    if (spec->lbufOff >= spec->lbufSize) {
-		spec->lbufSize += BUFSIZ;
-		spec->lbuf = realloc(spec->lbuf, spec->lbufSize);
+	const char *p;
+
+	/* Append the rest of the current input line in one go */
+	if (from && *from) {
+	    const char *end = strchr(from, '\n');
+	    size_t len = end ? (size_t) (end - from + 1) : strlen(from);
+
+	    if (spec->lbufOff + len >= spec->lbufSize) {
+		while (spec->lbufOff + len >= spec->lbufSize)
+		    spec->lbufSize *= 2;
+		spec->lbuf = xrealloc(spec->lbuf, spec->lbufSize);
 	    }
+	    memcpy(spec->lbuf + spec->lbufOff, from, len);
+	    spec->lbufOff += len;
+	    ofi->readPtr = from + len;
 	}
 	spec->lbuf[spec->lbufOff] = '\0';
-	ofi->readPtr = from;
 
-	/* Check if we need another line before expanding the buffer. */
-	for (const char *p = spec->lbuf; *p; p++) {
+	/*
+	 * Check if we need another line before expanding the buffer. Only
+	 * the newly added part needs looking at, long %{lua:...} blocks
+	 * and such would otherwise be rescanned for every line.
+	 */
+	for (p = spec->lbuf + spec->lbufScan; *p; p++) {
 	    switch (*p) {
 		case '\\':
 		    switch (*(p+1)) {
 			case '\n': p++, nc = 1; break;
-			case '\0': break;
+			case '\0': goto pending;
 			default: p++; break;
 		    }
 		    break;
@@ -311,6 +332,7 @@ static int copyNextLineFromOFI(rpmSpec spec, OFI_t *ofi, int strip)
 			case '(': p++, pc++; break;
 			case '[': p++, xc++; break;
 			case '%': p++; break;
+			case '\0': goto pending;
 		    }
 		    break;
 		case '{': if (bc > 0) bc++; break;
@@ -321,13 +343,19 @@ static int copyNextLineFromOFI(rpmSpec spec, OFI_t *ofi, int strip)
 		case ']': if (xc > 0) xc--; break;
 	    }
 	}
-	
+pending:
+	/* An escape at the very end is looked at again with what follows */
+	spec->lbufScan = p - spec->lbuf;
+
 	/* If it doesn't, ask for one more line. */
 	if (pc || bc || xc || nc ) {
+	    spec->pc = pc, spec->bc = bc, spec->xc = xc, spec->nc = nc;
 	    spec->nextline = "";
 	    return 1;
 	}
 	spec->lbufOff = 0;
+	spec->lbufScan = 0;
+	spec->pc = spec->bc = spec->xc = spec->nc = 0;
 
 	if (expandMacrosInSpecBuf(spec, strip))
 	    return -1;
@@ -4,6 +4,8 @@
 #include <rpm/rpmbuild.h>
 #include <rpm/rpmutil.h>
 #include <rpm/rpmstrpool.h>
+#include <rpm/rpmsw.h>
+#include <sys/resource.h>
 #include "build/rpmbuild_misc.h"
 #include "rpmio/rpmlua.h"
 
@@ -18,6 +20,40 @@
 #undef HTKEYTYPE
 #undef HTDATATYPE
 
+typedef struct rpmfcCache_s * rpmfcCache;
+
+/** \ingroup rpmbuild
+ * Time and resource usage of a build stage.
+ */
+struct buildStage_s {
+    char *name;
+    rpmtime_t usecs;		/*!< wall clock time */
+    rpmtime_t utime;		/*!< user CPU time, children included */
+    rpmtime_t stime;		/*!< system CPU time, children included */
+    long maxrss;		/*!< peak RSS so far (kB) */
+    uint64_t rbytes;		/*!< bytes read from storage */
+    uint64_t wbytes;		/*!< bytes written to storage */
+};
+
+/** \ingroup rpmbuild
+ * Start of a measured build stage.
+ */
+struct buildStats_s {
+    struct rpmsw_s begin;
+    struct rusage self;
+    struct rusage children;
+};
+
+/** \ingroup rpmbuild
+ * Time spent on packaging a binary package.
+ */
+struct buildPkgStats_s {
+    rpmtime_t usecs;		/*!< packaging task wall clock time */
+    rpmtime_t cpuUsecs;		/*!< packaging task CPU time */
+    rpmtime_t depgenUsecs;	/*!< dependency generation time */
+    rpmtime_t payloadUsecs;	/*!< payload compression/writing time */
+};
+
 #define ALLOWED_CHARS_NAME ".-_+%{}"
 #define ALLOWED_FIRSTCHARS_NAME "_%"
 #define ALLOWED_CHARS_VERREL "._+%{}~^"
@@ -112,6 +148,8 @@ struct rpmSpec_s {
     char *lbuf;
     size_t lbufSize;
     size_t lbufOff;
+    size_t lbufScan;		/*!< lbuf checked for continuation up to */
+    int pc, bc, xc, nc;		/*!< open %(, %{, %[ and \ so far */
     char nextpeekc;
     char * nextline;
     char * line;
@@ -151,8 +189,25 @@ struct rpmSpec_s {
     StringBuf parsed;		/*!< parsed spec contents */
 
     Package packages;		/*!< Package list. */
+
+    ARGV_t inputFiles;		/*!< Files read by the parser. */
+
+    rpmfcCache fccache;		/*!< File classifications while packaging. */
+
+    struct buildStage_s *stages;	/*!< Measured build stages. */
+    int nstages;
 };
 
+/** \ingroup rpmbuild
+ * Headers of a parsed spec, as needed for queries.
+ */
+typedef struct specCache_s {
+    Header source;		/*!< Source header. */
+    Header *pkgs;		/*!< Package headers. */
+    int *built;			/*!< Would the package be built? */
+    int npkgs;
+} * specCache;
+
 #define PACKAGE_NUM_DEPS 12
 
 /** \ingroup rpmbuild
@@ -195,6 +250,8 @@ struct Package_s {
 
     char *filename;
     rpmRC rc;
+    double pldBudget;		/*!< payload compression time budget (s) */
+    struct buildPkgStats_s stats;
 
     Package next;
 };
@@ -496,6 +553,51 @@ rpmRC processBinaryFiles(rpmSpec spec, rpmBuildPkgFlags pkgFlags,
 RPM_GNUC_INTERNAL
 rpmRC rpmfcGenerateDepends(const rpmSpec spec, Package pkg);
 
+/** \ingroup rpmbuild
+ * Start measuring a build stage.
+ * @param bs		stage start to fill in
+ */
+RPM_GNUC_INTERNAL
+void buildStatsBegin(struct buildStats_s *bs);
+
+/** \ingroup rpmbuild
+ * Record the time and resources used by a build stage since its start.
+ * @param spec		spec file control
+ * @param bs		stage start
+ * @param name		stage name
+ * @param rc		stage result
+ * @return		rc, for wrapping the stage call
+ */
+RPM_GNUC_INTERNAL
+rpmRC buildStatsEnd(rpmSpec spec, struct buildStats_s *bs, const char *name,
+		    rpmRC rc);
+
+/** \ingroup rpmbuild
+ * Report the build statistics: write them in JSON into
+ * %_build_stats_file if set, and print them on stderr if statistics
+ * are enabled (--stats, --stats-format).
+ * @param spec		spec file control
+ */
+RPM_GNUC_INTERNAL
+void buildStatsReport(rpmSpec spec);
+
+/** \ingroup rpmfc
+ * Create a cache of file classifications by content digest.
+ * @param path		file to load it from and store it in (or NULL)
+ * @return		new cache
+ */
+RPM_GNUC_INTERNAL
+rpmfcCache rpmfcCacheNew(const char *path);
+
+/** \ingroup rpmfc
+ * Free a file classification cache, storing it first if it has a file
+ * and was added to.
+ * @param cache		classification cache (or NULL)
+ * @return		NULL always
+ */
+RPM_GNUC_INTERNAL
+rpmfcCache rpmfcCacheFree(rpmfcCache cache);
+
 /** \ingroup rpmfc
  * Return helper output.
  * @param av		helper argv (with possible macros)
@@ -622,6 +724,47 @@ void * specLuaFini(rpmSpec spec);
 
 RPM_GNUC_INTERNAL
 void addLuaSource(const struct Source *p);
+
+/** \ingroup rpmbuild
+ * Calculate the spec cache key of a spec file in the current macro context.
+ * @param specFile	spec file name
+ * @return		key string (malloc'ed) or NULL if caching is disabled
+ */
+RPM_GNUC_INTERNAL
+char * specCacheKey(const char *specFile);
+
+/** \ingroup rpmbuild
+ * Look up parsed spec headers from the cache in %_specparse_cachedir.
+ * Entries whose included files have changed since are ignored.
+ * @param key		cache key
+ * @return		cached headers or NULL if not found
+ */
+RPM_GNUC_INTERNAL
+specCache specCacheRead(const char *key);
+
+/** \ingroup rpmbuild
+ * Store the headers of a parsed spec in the cache.
+ * @param key		cache key, as calculated before parsing
+ * @param spec		parsed spec
+ */
+RPM_GNUC_INTERNAL
+void specCacheWrite(const char *key, rpmSpec spec);
+
+/** \ingroup rpmbuild
+ * Return the query headers of a parsed spec.
+ * @param spec		parsed spec
+ * @return		spec headers
+ */
+RPM_GNUC_INTERNAL
+specCache specCacheFromSpec(rpmSpec spec);
+
+/** \ingroup rpmbuild
+ * Free spec headers.
+ * @param sc		spec headers
+ * @return		NULL always
+ */
+RPM_GNUC_INTERNAL
+specCache specCacheFree(specCache sc);
 #ifdef __cplusplus
 }
 #endif
@@ -22,6 +22,7 @@
 #include <rpm/rpmstrpool.h>
 
 #include "lib/rpmfi_internal.h"		/* rpmfiles stuff for now */
+#include "rpmio/rpmio_internal.h"	/* XXX rpmioSlurp */
 #include "build/rpmbuild_internal.h"
 
 #include "debug.h"
@@ -58,6 +59,39 @@ typedef struct {
 #define HTDATATYPE int
 #include "lib/rpmhash.H"
 #include "lib/rpmhash.C"
+#undef HASHTYPE
+#undef HTKEYTYPE
+#undef HTDATATYPE
+
+#define HASHTYPE fcCacheHash
+#define HTKEYTYPE const char *
+#define HTDATATYPE int
+#include "lib/rpmhash.H"
+#include "lib/rpmhash.C"
+
+#define FCCACHE_MAGIC "RPMFC1"
+
+/** Classification of file contents */
+struct fcCacheEntry_s {
+    char *key;			/*!< digest algorithm, digest and size */
+    char *ftype;		/*!< libmagic description */
+    char *fmime;		/*!< libmagic mime type */
+    int elfcolor;		/*!< getElfColor() result, -1 if not known */
+};
+
+/**
+ * Cache of file classifications by content, shared by the packages of
+ * a build and optionally kept in a file between builds.
+ */
+struct rpmfcCache_s {
+    char *path;			/*!< cache file (or NULL) */
+    char *magic;		/*!< cache file header for this libmagic */
+    struct fcCacheEntry_s *entries;
+    int nentries;
+    int nalloced;
+    int modified;		/*!< entries added since loading? */
+    fcCacheHash hash;		/*!< key -> entry index */
+};
 
 struct rpmfc_s {
     Package pkg;
@@ -84,6 +118,7 @@ struct rpmfc_s {
 
     fattrHash fahash;	/*!< attr:file mapping */
     rpmstrPool pool;	/*!< general purpose string storage */
+    rpmfcCache cache;	/*!< classification cache (or NULL) */
 };
 
 struct rpmfcTokens_s {
@@ -507,7 +542,7 @@ static void rpmfcAddFileDep(rpmfcFileDeps *fileDeps, rpmds ds, int ix)
     fileDeps->data[fileDeps->size++].dep = ds;
 }
 
-static ARGV_t runCmd(const char *name, const char *buildRoot, const char *fn)
+static ARGV_t runCmd(const char *name, const char *buildRoot, ARGV_const_t fns)
 {
     ARGV_t output = NULL;
     ARGV_t av = NULL;
@@ -517,7 +552,8 @@ static ARGV_t runCmd(const char *name, const char *buildRoot, const char *fn)
 
     argvAdd(&av, cmd);
 
-    appendLineStringBuf(sb_stdin, fn);
+    for (ARGV_const_t fn = fns; fn && *fn; fn++)
+	appendLineStringBuf(sb_stdin, *fn);
     if (rpmfcExec(av, sb_stdin, &sb_stdout, 0, buildRoot) == 0) {
 	argvSplit(&output, getStringBuf(sb_stdout), "\n\r");
     }
@@ -554,6 +590,104 @@ static ARGV_t runCall(const char *name, const char *buildRoot, const char *fn)
     return output;
 }
 
+/*
+ * Generator results can be cached in %{_dependency_cachedir}, keyed by
+ * the digest of the file contents, its packaged path, the generator
+ * command line (and the generator itself when it's a file) and the
+ * macros exported to generators.
+ */
+static void digestStr(DIGEST_CTX ctx, const char *str)
+{
+    rpmDigestUpdate(ctx, str, strlen(str) + 1);
+}
+
+static char *depCachePath(rpmfc fc, const char *name, const char *fn)
+{
+    char *cachedir = rpmExpand("%{?_dependency_cachedir}", NULL);
+    char fdigest[2 * 64 + 1];
+    char *path = NULL;
+    char *cmd = NULL;
+    char *env = NULL;
+    char *key = NULL;
+    struct stat sb;
+    DIGEST_CTX ctx;
+
+    /* Only regular files are content-addressable */
+    if (*cachedir != '/' || lstat(fn, &sb) || !S_ISREG(sb.st_mode))
+	goto exit;
+    if (rpmDoDigest(RPM_HASH_SHA256, fn, 1, (unsigned char *)fdigest))
+	goto exit;
+
+    cmd = rpmExpand("%{", name, "} %{?", name, "_opts}", NULL);
+    env = rpmExpand("%{?name}:%{?epoch}:%{?version}:%{?release}", NULL);
+
+    ctx = rpmDigestInit(RPM_HASH_SHA256, RPMDIGEST_NONE);
+    digestStr(ctx, VERSION);
+    digestStr(ctx, cmd);
+    digestStr(ctx, env);
+    digestStr(ctx, fn + fc->brlen);
+    digestStr(ctx, fdigest);
+    if (*cmd == '/') {
+	char *gen = xstrdup(cmd);
+	gen[strcspn(gen, " \t")] = '\0';
+	if (rpmDoDigest(RPM_HASH_SHA256, gen, 1, (unsigned char *)fdigest) == 0)
+	    digestStr(ctx, fdigest);
+	free(gen);
+    }
+    rpmDigestFinal(ctx, (void **)&key, NULL, 1);
+
+    rasprintf(&path, "%s/%.2s/%s", cachedir, key, key + 2);
+
+exit:
+    free(key);
+    free(env);
+    free(cmd);
+    free(cachedir);
+    return path;
+}
+
+static int depCacheGet(const char *path, ARGV_t *output)
+{
+    uint8_t *buf = NULL;
+    ssize_t blen = 0;
+
+    if (rpmioSlurp(path, &buf, &blen))
+	return 0;
+
+    /* An empty entry is a file without dependencies */
+    argvSplit(output, buf ? (char *)buf : "", "\n\r");
+    free(buf);
+    return 1;
+}
+
+static void depCachePut(const char *path, ARGV_const_t output)
+{
+    char *dir = xstrdup(path);
+    char *tmp = rstrscat(NULL, path, ".XXXXXX", NULL);
+    char *data = argvJoin(output, "\n");
+    size_t dlen = strlen(data);
+    int fd;
+
+    *strrchr(dir, '/') = '\0';
+    if (rpmioMkpath(dir, 0755, -1, -1))
+	goto exit;
+
+    /* Write to a temporary and rename to let parallel builds share */
+    if ((fd = mkstemp(tmp)) < 0)
+	goto exit;
+    if (write(fd, data, dlen) != (ssize_t)dlen || close(fd) ||
+		rename(tmp, path)) {
+	rpmlog(RPMLOG_DEBUG, "failed to cache dependencies in %s: %s\n",
+		path, strerror(errno));
+	unlink(tmp);
+    }
+
+exit:
+    free(data);
+    free(tmp);
+    free(dir);
+}
+
 struct addReqProvDataFc {
     rpmfc fc;
     const char *namespace;
@@ -598,6 +732,13 @@ static void exclFini(struct exclreg_s *excl)
     memset(excl, 0, sizeof(*excl));
 }
 
+static int isExcluded(rpmfc fc, int ix, const struct exclreg_s *excl)
+{
+    const char *fn = fc->fn[ix] + fc->brlen;
+    return (regMatch(excl->exclude_from, fn) ||
+	    regMatch(excl->global_exclude_from, fn));
+}
+
 static int rpmfcHelper(rpmfc fc, int ix, const struct exclreg_s *excl,
 		       rpmsenseFlags dsContext, rpmTagVal tagN,
 		       const char *namespace, const char *mname)
@@ -608,16 +749,23 @@ static int rpmfcHelper(rpmfc fc, int ix, const struct exclreg_s *excl,
     int rc = 0;
 
     /* If the entire path is filtered out, there's nothing more to do */
-    if (regMatch(excl->exclude_from, fn+fc->brlen))
-	goto exit;
-
-    if (regMatch(excl->global_exclude_from, fn+fc->brlen))
+    if (isExcluded(fc, ix, excl))
 	goto exit;
 
     if (rpmMacroIsParametric(NULL, mname)) {
 	pav = runCall(mname, fc->buildRoot, fn);
     } else {
-	pav = runCmd(mname, fc->buildRoot, fn);
+	char *cpath = depCachePath(fc, mname, fn);
+
+	if (cpath == NULL || !depCacheGet(cpath, &pav)) {
+	    ARGV_t fns = NULL;
+	    argvAdd(&fns, fn);
+	    pav = runCmd(mname, fc->buildRoot, fns);
+	    argvFree(fns);
+	    if (cpath && pav)
+		depCachePut(cpath, pav);
+	}
+	free(cpath);
     }
 
     if (pav == NULL)
@@ -641,6 +789,89 @@ exit:
     return rc;
 }
 
+/*
+ * Find the batch position of a file named in multifile generator output.
+ * Generators normally report files in the order they were passed, so
+ * start looking from the previous position.
+ */
+static int findBatchFile(rpmfc fc, const int *ixs, int n, int prev,
+			 const char *fn)
+{
+    int start = (prev >= 0) ? prev : 0;
+    for (int i = 0; i < n; i++) {
+	int pos = (start + i) % n;
+	if (rstreq(fc->fn[ixs[pos]], fn))
+	    return pos;
+    }
+    return -1;
+}
+
+/*
+ * Run a generator using the multifile protocol: all the files are passed
+ * on stdin in one go, and the generator prints a ";<path>" line before
+ * the dependencies of each file.
+ */
+static int rpmfcHelperMulti(rpmfc fc, const int *ixs, int n,
+		       const struct exclreg_s *excl,
+		       rpmsenseFlags dsContext, rpmTagVal tagN,
+		       const char *namespace, const char *mname)
+{
+    ARGV_t fns = NULL;
+    ARGV_t pav = NULL;
+    int *bixs = xmalloc(n * sizeof(*bixs));
+    int nb = 0;
+    int cur = -1;
+    int rc = 0;
+
+    for (int i = 0; i < n; i++) {
+	if (isExcluded(fc, ixs[i], excl))
+	    continue;
+	argvAdd(&fns, fc->fn[ixs[i]]);
+	bixs[nb++] = ixs[i];
+    }
+
+    if (nb == 0)
+	goto exit;
+
+    if (_rpmfc_debug)
+	rpmlog(RPMLOG_DEBUG, "Running %s on %d files\n", mname, nb);
+
+    pav = runCmd(mname, fc->buildRoot, fns);
+    if (pav == NULL)
+	goto exit;
+
+    struct addReqProvDataFc data;
+    data.fc = fc;
+    data.namespace = namespace;
+    data.exclude = excl->exclude;
+
+    for (ARGV_const_t p = pav; *p; p++) {
+	if (**p == ';') {
+	    cur = findBatchFile(fc, bixs, nb, cur, *p + 1);
+	    if (cur < 0) {
+		rpmlog(RPMLOG_ERR, _("%s: unknown file in output: %s\n"),
+			mname, *p + 1);
+		rc++;
+	    }
+	    continue;
+	}
+	if (cur < 0) {
+	    rpmlog(RPMLOG_ERR, _("%s: dependency without a file: %s\n"),
+		    mname, *p);
+	    rc++;
+	    continue;
+	}
+	if (parseRCPOT(NULL, fc->pkg, *p, tagN, bixs[cur], dsContext, addReqProvFc, &data))
+	    rc++;
+    }
+
+exit:
+    argvFree(pav);
+    argvFree(fns);
+    free(bixs);
+    return rc;
+}
+
 /* Only used for controlling RPMTAG_FILECLASS inclusion now */
 static const struct rpmfcTokens_s rpmfcTokens[] = {
   { "directory",		RPMFC_INCLUDE },
@@ -1029,11 +1260,22 @@ static int applyAttr(rpmfc fc, int aix, const char *aname,
 
 	if (rpmMacroIsDefined(NULL, mname)) {
 	    char *ns = rpmfcAttrMacro(aname, "namespace", NULL);
-	    for (int i = 0; i < n; i++) {
-		if (rpmfcHelper(fc, ixs[i], excl, dep->type, dep->tag,
+	    char *proto = rpmfcAttrMacro(aname, "protocol", NULL);
+	    int multifile = (proto && rstreq(proto, "multifile") &&
+			     !rpmMacroIsParametric(NULL, mname));
+
+	    if (multifile) {
+		if (rpmfcHelperMulti(fc, ixs, n, excl, dep->type, dep->tag,
 				ns, mname))
 		    rc = 1;
+	    } else {
+		for (int i = 0; i < n; i++) {
+		    if (rpmfcHelper(fc, ixs[i], excl, dep->type, dep->tag,
+				    ns, mname))
+			rc = 1;
+		}
 	    }
+	    free(proto);
 	    free(ns);
 	}
 	free(mname);
@@ -1153,6 +1395,200 @@ static uint32_t getElfColor(const char *fn)
     return color;
 }
 
+static void fcCacheAdd(rpmfcCache cache, char *key, char *ftype, char *fmime,
+		       int elfcolor)
+{
+    struct fcCacheEntry_s *e;
+
+    if (cache->nentries == cache->nalloced) {
+	cache->nalloced = cache->nalloced ? cache->nalloced * 2 : 256;
+	cache->entries = xrealloc(cache->entries,
+				  cache->nalloced * sizeof(*cache->entries));
+    }
+    e = &cache->entries[cache->nentries];
+    e->key = key;
+    e->ftype = ftype;
+    e->fmime = fmime;
+    e->elfcolor = elfcolor;
+    fcCacheHashAddEntry(cache->hash, e->key, cache->nentries);
+    cache->nentries++;
+}
+
+/* Load a cache file: a header line, then key, color, mime, type per line */
+static void fcCacheLoad(rpmfcCache cache)
+{
+    uint8_t *b = NULL;
+    ssize_t blen = 0;
+    char *line, *next;
+    int n = 0;
+
+    if (rpmioSlurp(cache->path, &b, &blen) || b == NULL)
+	goto exit;
+
+    line = (char *) b;
+    if ((next = strchr(line, '\n')) == NULL)
+	goto exit;
+    *next++ = '\0';
+    if (!rstreq(line, cache->magic)) {
+	rpmlog(RPMLOG_DEBUG, "ignoring stale classification cache %s\n",
+		cache->path);
+	goto exit;
+    }
+
+    for (line = next; (next = strchr(line, '\n')) != NULL; line = next) {
+	char *f[4];
+	int i;
+
+	*next++ = '\0';
+	f[0] = line;
+	for (i = 1; i < 4 && (f[i] = strchr(f[i-1], '\t')) != NULL; i++)
+	    *f[i]++ = '\0';
+	if (i < 4 || fcCacheHashHasEntry(cache->hash, f[0]))
+	    continue;
+	fcCacheAdd(cache, xstrdup(f[0]), xstrdup(f[3]), xstrdup(f[2]),
+		   atoi(f[1]));
+	n++;
+    }
+    rpmlog(RPMLOG_DEBUG, "loaded %d file classifications from %s\n",
+	    n, cache->path);
+
+exit:
+    free(b);
+}
+
+static int fcCacheWrite(rpmfcCache cache)
+{
+    char *tmppath = rstrscat(NULL, cache->path, ".XXXXXX", NULL);
+    FILE *fp = NULL;
+    int fd = -1;
+    int rc = -1;
+
+    if ((fd = mkstemp(tmppath)) < 0 || (fp = fdopen(fd, "w")) == NULL)
+	goto exit;
+    (void) fchmod(fd, 0644);
+
+    fprintf(fp, "%s\n", cache->magic);
+    for (int i = 0; i < cache->nentries; i++) {
+	struct fcCacheEntry_s *e = &cache->entries[i];
+	/* There's no quoting, leave out the odd entry that would need it */
+	if (strpbrk(e->ftype, "\t\n") || strpbrk(e->fmime, "\t\n"))
+	    continue;
+	fprintf(fp, "%s\t%d\t%s\t%s\n", e->key, e->elfcolor, e->fmime, e->ftype);
+    }
+
+    rc = fclose(fp);
+    fp = NULL;
+    fd = -1;
+    if (rc == 0)
+	rc = rename(tmppath, cache->path);
+
+exit:
+    if (fp)
+	fclose(fp);
+    else if (fd >= 0)
+	close(fd);
+    if (rc) {
+	rpmlog(RPMLOG_DEBUG, "failed to store classification cache %s: %s\n",
+		cache->path, strerror(errno));
+	(void) unlink(tmppath);
+    }
+    free(tmppath);
+    return rc;
+}
+
+rpmfcCache rpmfcCacheNew(const char *path)
+{
+    rpmfcCache cache = xcalloc(1, sizeof(*cache));
+
+    cache->hash = fcCacheHashCreate(1024, rstrhash, strcmp, NULL, NULL);
+    rasprintf(&cache->magic, "%s %d", FCCACHE_MAGIC, magic_version());
+    if (path && *path) {
+	cache->path = xstrdup(path);
+	fcCacheLoad(cache);
+    }
+    return cache;
+}
+
+rpmfcCache rpmfcCacheFree(rpmfcCache cache)
+{
+    if (cache) {
+	if (cache->path && cache->modified)
+	    (void) fcCacheWrite(cache);
+	for (int i = 0; i < cache->nentries; i++) {
+	    free(cache->entries[i].key);
+	    free(cache->entries[i].ftype);
+	    free(cache->entries[i].fmime);
+	}
+	free(cache->entries);
+	fcCacheHashFree(cache->hash);
+	free(cache->magic);
+	free(cache->path);
+	free(cache);
+    }
+    return NULL;
+}
+
+/* Cache key of a file's contents, NULL if there's no digest for them */
+static char *fcCacheKey(rpmfc fc, int ix)
+{
+    rpmfiles fi = fc->pkg ? fc->pkg->cpioList : NULL;
+    const unsigned char *digest;
+    int algo = 0;
+    size_t dlen = 0;
+    char *hex, *key = NULL;
+
+    if (fi == NULL || ix >= rpmfilesFC(fi))
+	return NULL;
+    digest = rpmfilesFDigest(fi, ix, &algo, &dlen);
+    if (digest == NULL || dlen == 0)
+	return NULL;
+    hex = rpmhex(digest, dlen);
+    rasprintf(&key, "%d:%s:%ju", algo, hex,
+	      (uintmax_t) rpmfilesFSize(fi, ix));
+    free(hex);
+    return key;
+}
+
+/* Look up a classification, the strings stay valid with the cache */
+static int fcCacheGet(rpmfcCache cache, const char *key,
+		      const char **ftype, const char **fmime, int *elfcolor)
+{
+    int found = 0;
+    #pragma omp critical(rpmfccache)
+    {
+    int *ix = NULL;
+    if (fcCacheHashGetEntry(cache->hash, key, &ix, NULL, NULL)) {
+	struct fcCacheEntry_s *e = &cache->entries[ix[0]];
+	*ftype = e->ftype;
+	*fmime = e->fmime;
+	*elfcolor = e->elfcolor;
+	found = 1;
+    }
+    }
+    return found;
+}
+
+/* Add a classification, or the ELF color of a known one */
+static void fcCachePut(rpmfcCache cache, const char *key,
+		       const char *ftype, const char *fmime, int elfcolor)
+{
+    #pragma omp critical(rpmfccache)
+    {
+    int *ix = NULL;
+    if (fcCacheHashGetEntry(cache->hash, key, &ix, NULL, NULL)) {
+	struct fcCacheEntry_s *e = &cache->entries[ix[0]];
+	if (e->elfcolor < 0 && elfcolor >= 0) {
+	    e->elfcolor = elfcolor;
+	    cache->modified = 1;
+	}
+    } else {
+	fcCacheAdd(cache, xstrdup(key), xstrdup(ftype), xstrdup(fmime),
+		   elfcolor);
+	cache->modified = 1;
+    }
+    }
+}
+
 struct skipped_extension_s {
 	const char *extension;
 	const char *magic_ftype;
@@ -1235,6 +1671,9 @@ rpmRC rpmfcClassify(rpmfc fc, ARGV_t argv, rpm_mode_t * fmode)
 	int fcolor = RPMFC_BLACK;
 	rpm_mode_t mode = (fmode ? fmode[ix] : 0);
 	int is_executable = (mode & (S_IXUSR|S_IXGRP|S_IXOTH));
+	char *ckey = NULL;
+	int cached = 0, magicked = 0;
+	int elfcolor = -1;
 
 	switch (mode & S_IFMT) {
 	case S_IFCHR:	ftype = "character special";	break;
@@ -1259,7 +1698,16 @@ rpmRC rpmfcClassify(rpmfc fc, ARGV_t argv, rpm_mode_t * fmode)
 	    if (slen >= fc->brlen+sizeof("/dev/") && rstreqn(s+fc->brlen, "/dev/", sizeof("/dev/")-1))
 		ftype = "";
 	    else if (ftype == NULL) {
-		ftype = magic_file(ms, s);
+		/* Identical contents get classified once */
+		if (fc->cache && S_ISREG(mode))
+		    ckey = fcCacheKey(fc, ix);
+		if (ckey && fcCacheGet(fc->cache, ckey, &ftype, &fmime,
+					&elfcolor)) {
+		    cached = 1;
+		} else {
+		    ftype = magic_file(ms, s);
+		    magicked = (ftype != NULL);
+		}
 		/* Silence errors from immaterial %ghosts */
 		if (ftype == NULL && errno == ENOENT)
 		    ftype = "";
@@ -1280,6 +1728,8 @@ rpmRC rpmfcClassify(rpmfc fc, ARGV_t argv, rpm_mode_t * fmode)
 
 	if (fmime == NULL) { /* not predefined */
 	    fmime = magic_file(mime, s);
+	    if (fmime == NULL)
+		magicked = 0;
 	    /* Silence errors from immaterial %ghosts */
 	    if (fmime == NULL && errno == ENOENT)
 		fmime = "";
@@ -1310,8 +1760,18 @@ rpmRC rpmfcClassify(rpmfc fc, ARGV_t argv, rpm_mode_t * fmode)
 	    fc->ftype[ix] = xstrdup(ftype);
 
 	/* Add ELF colors */
-	if (S_ISREG(mode) && is_executable)
-	    fc->fcolor[ix] = getElfColor(s);
+	if (S_ISREG(mode) && is_executable) {
+	    int known = (elfcolor >= 0);
+	    if (!known)
+		elfcolor = getElfColor(s);
+	    fc->fcolor[ix] = elfcolor;
+	    if (cached && !known)
+		fcCachePut(fc->cache, ckey, ftype, fmime, elfcolor);
+	}
+
+	if (ckey && magicked)
+	    fcCachePut(fc->cache, ckey, ftype, fmime, elfcolor);
+	free(ckey);
     }
 
     if (ms != NULL)
@@ -1599,6 +2059,7 @@ rpmRC rpmfcGenerateDepends(const rpmSpec spec, Package pkg)
     fc->pkg = pkg;
     fc->skipProv = !pkg->autoProv;
     fc->skipReq = !pkg->autoReq;
+    fc->cache = spec->fccache;
 
     if (!fc->skipProv && genConfigDeps) {
 	/* Add config dependency, Provides: config(N) = EVR */
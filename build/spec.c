@@ -269,6 +269,10 @@ rpmSpec rpmSpecFree(rpmSpec spec)
 
     spec->buildRoot = _free(spec->buildRoot);
     spec->specFile = _free(spec->specFile);
+    spec->inputFiles = argvFree(spec->inputFiles);
+    for (int i = 0; i < spec->nstages; i++)
+	free(spec->stages[i].name);
+    spec->stages = _free(spec->stages);
 
     closeSpec(spec);
 
@@ -446,35 +450,48 @@ const char * rpmSpecGetSection(rpmSpec spec, int section)
 int rpmspecQuery(rpmts ts, QVA_t qva, const char * arg)
 {
     rpmSpec spec = NULL;
+    specCache sc = NULL;
+    char *key = NULL;
     int res = 1;
 
     if (qva->qva_showPackage == NULL)
 	goto exit;
 
-    spec = rpmSpecParse(arg, (RPMSPEC_ANYARCH|RPMSPEC_FORCE), NULL);
-    if (spec == NULL) {
-	rpmlog(RPMLOG_ERR,
-	    		_("query of specfile %s failed, can't parse\n"), arg);
-	goto exit;
+    /* The key must be calculated before parsing alters the macros */
+    key = specCacheKey(arg);
+    if (key)
+	sc = specCacheRead(key);
+
+    if (sc == NULL) {
+	spec = rpmSpecParse(arg, (RPMSPEC_ANYARCH|RPMSPEC_FORCE), NULL);
+	if (spec == NULL) {
+	    rpmlog(RPMLOG_ERR,
+			_("query of specfile %s failed, can't parse\n"), arg);
+	    goto exit;
+	}
+	if (key)
+	    specCacheWrite(key, spec);
+	sc = specCacheFromSpec(spec);
     }
 
     if (qva->qva_source == RPMQV_SPECRPMS ||
 	    qva->qva_source == RPMQV_SPECBUILTRPMS) {
 
 	res = 0;
-	for (Package pkg = spec->packages; pkg != NULL; pkg = pkg->next) {
+	for (int i = 0; i < sc->npkgs; i++) {
 
-	    if (qva->qva_source == RPMQV_SPECBUILTRPMS && pkg->fileList == NULL)
+	    if (qva->qva_source == RPMQV_SPECBUILTRPMS && !sc->built[i])
 		continue;
 
-	    res += qva->qva_showPackage(qva, ts, pkg->header);
+	    res += qva->qva_showPackage(qva, ts, sc->pkgs[i]);
 	}
     } else {
-	Package sourcePkg = spec->sourcePackage;
-	res = qva->qva_showPackage(qva, ts, sourcePkg->header);
+	res = qva->qva_showPackage(qva, ts, sc->source);
     }
 
 exit:
+    specCacheFree(sc);
     rpmSpecFree(spec);
+    free(key);
     return res;
 }
@@ -0,0 +1,285 @@
+/** \ingroup rpmbuild
+ * \file build/speccache.c
+ * Cache of parsed spec headers for repeated queries.
+ */
+
+#include "system.h"
+
+#include <errno.h>
+#include <unistd.h>
+
+#include <rpm/header.h>
+#include <rpm/rpmlog.h>
+#include <rpm/rpmfileutil.h>
+#include <rpm/rpmmacro.h>
+#include <rpm/rpmcrypto.h>
+
+#include "rpmio/rpmio_internal.h"	/* rpmioSlurp */
+#include "build/rpmbuild_internal.h"
+
+#include "debug.h"
+
+#define SPECCACHE_MAGIC "rpmspec-cache 1"
+#define SPECCACHE_ALGO PGPHASHALGO_SHA256
+
+/*
+ * The cache file consists of text lines, each header is preceded by a
+ * line giving its size and followed by a newline:
+ *
+ *	rpmspec-cache 1
+ *	file <digest> <path>		(for each file read by the parser)
+ *	src <size>			(source header)
+ *	pkg <built> <size>		(for each package header)
+ *	end
+ */
+
+static char *cachePath(const char *key)
+{
+    char *path = NULL;
+    char *dir = rpmExpand("%{?_specparse_cachedir}", NULL);
+
+    if (*dir)
+	path = rpmGetPath(dir, "/", key, NULL);
+
+    free(dir);
+    return path;
+}
+
+char *specCacheKey(const char *specFile)
+{
+    char *key = NULL;
+    uint8_t *buf = NULL;
+    ssize_t blen = 0;
+    char *macros = NULL;
+    size_t mlen = 0;
+    char *cwd = NULL;
+    FILE *fp;
+    DIGEST_CTX ctx;
+
+    if (!rpmMacroIsDefined(NULL, "_specparse_cachedir"))
+	goto exit;
+
+    if (rpmioSlurp(specFile, &buf, &blen))
+	goto exit;
+
+    /* Everything the parser sees besides the spec is in the macros */
+    if ((fp = open_memstream(&macros, &mlen)) == NULL)
+	goto exit;
+    rpmDumpMacroTable(NULL, fp);
+    fclose(fp);
+
+    cwd = getcwd(NULL, 0);
+    ctx = rpmDigestInit(SPECCACHE_ALGO, RPMDIGEST_NONE);
+    rpmDigestUpdate(ctx, SPECCACHE_MAGIC, sizeof(SPECCACHE_MAGIC));
+    if (cwd)
+	rpmDigestUpdate(ctx, cwd, strlen(cwd) + 1);
+    rpmDigestUpdate(ctx, specFile, strlen(specFile) + 1);
+    rpmDigestUpdate(ctx, buf, blen);
+    rpmDigestUpdate(ctx, macros, mlen);
+    rpmDigestFinal(ctx, (void **)&key, NULL, 1);
+
+exit:
+    free(buf);
+    free(macros);
+    free(cwd);
+    return key;
+}
+
+static char *nextLine(char **bp, char *end)
+{
+    char *line = *bp;
+    char *nl;
+
+    if (line >= end || (nl = memchr(line, '\n', end - line)) == NULL)
+	return NULL;
+    *nl = '\0';
+    *bp = nl + 1;
+    return line;
+}
+
+static Header nextHeader(char **bp, char *end, unsigned long size)
+{
+    Header h = NULL;
+    char *blob = *bp;
+
+    if (size > end - blob || blob[size] != '\n')
+	return NULL;
+
+    h = headerImport(blob, size, HEADERIMPORT_COPY);
+    *bp = blob + size + 1;
+    return h;
+}
+
+/* Check that a file read during the cached parse is still the same */
+static int fileUnchanged(char *line)
+{
+    char digest[2 * 64 + 1] = "";
+    char *path = strchr(line, ' ');
+
+    if (path == NULL)
+	return 0;
+    *path++ = '\0';
+
+    if (rpmDoDigest(SPECCACHE_ALGO, path, 1, (unsigned char *)digest))
+	return 0;
+    return rstreq(line, digest);
+}
+
+specCache specCacheRead(const char *key)
+{
+    specCache sc = NULL;
+    char *path = cachePath(key);
+    uint8_t *buf = NULL;
+    ssize_t blen = 0;
+    char *bp, *end, *line;
+
+    if (path == NULL || rpmioSlurp(path, &buf, &blen))
+	goto exit;
+
+    bp = (char *)buf;
+    end = bp + blen;
+    line = nextLine(&bp, end);
+    if (line == NULL || !rstreq(line, SPECCACHE_MAGIC))
+	goto exit;
+
+    sc = xcalloc(1, sizeof(*sc));
+    while ((line = nextLine(&bp, end)) != NULL) {
+	unsigned long size = 0;
+	int built = 0;
+	Header h;
+
+	if (rstreqn(line, "file ", 5)) {
+	    if (!fileUnchanged(line + 5))
+		goto err;
+	} else if (sscanf(line, "src %lu", &size) == 1) {
+	    if (sc->source || (sc->source = nextHeader(&bp, end, size)) == NULL)
+		goto err;
+	} else if (sscanf(line, "pkg %d %lu", &built, &size) == 2) {
+	    if ((h = nextHeader(&bp, end, size)) == NULL)
+		goto err;
+	    sc->pkgs = xrealloc(sc->pkgs, (sc->npkgs + 1) * sizeof(*sc->pkgs));
+	    sc->built = xrealloc(sc->built, (sc->npkgs + 1) * sizeof(*sc->built));
+	    sc->pkgs[sc->npkgs] = h;
+	    sc->built[sc->npkgs] = built;
+	    sc->npkgs++;
+	} else if (rstreq(line, "end")) {
+	    break;
+	} else {
+	    goto err;
+	}
+    }
+
+    if (line == NULL || sc->source == NULL)
+	goto err;
+
+    rpmlog(RPMLOG_DEBUG, "using cached spec parse %s\n", path);
+
+exit:
+    free(path);
+    free(buf);
+    return sc;
+
+err:
+    sc = specCacheFree(sc);
+    goto exit;
+}
+
+static int writeHeader(FILE *fp, const char *prefix, Header h)
+{
+    unsigned int size = 0;
+    void *blob = headerExport(h, &size);
+    int rc = -1;
+
+    if (blob) {
+	fprintf(fp, "%s %u\n", prefix, size);
+	fwrite(blob, size, 1, fp);
+	rc = (fputc('\n', fp) == EOF) ? -1 : 0;
+	free(blob);
+    }
+    return rc;
+}
+
+void specCacheWrite(const char *key, rpmSpec spec)
+{
+    char *path = cachePath(key);
+    char *dir = rpmExpand("%{?_specparse_cachedir}", NULL);
+    char *tmppath = NULL;
+    FILE *fp = NULL;
+    int fd = -1;
+    int rc = -1;
+
+    if (path == NULL || rpmioMkpath(dir, 0755, -1, -1))
+	goto exit;
+
+    tmppath = rstrscat(NULL, path, ".XXXXXX", NULL);
+    if ((fd = mkstemp(tmppath)) < 0 || (fp = fdopen(fd, "w")) == NULL)
+	goto exit;
+
+    fprintf(fp, "%s\n", SPECCACHE_MAGIC);
+    for (ARGV_const_t fn = spec->inputFiles; fn && *fn; fn++) {
+	char digest[2 * 64 + 1] = "";
+	if (rpmDoDigest(SPECCACHE_ALGO, *fn, 1, (unsigned char *)digest))
+	    goto exit;
+	fprintf(fp, "file %s %s\n", digest, *fn);
+    }
+
+    if (writeHeader(fp, "src", spec->sourcePackage->header))
+	goto exit;
+
+    for (Package pkg = spec->packages; pkg != NULL; pkg = pkg->next) {
+	char *prefix = rstrscat(NULL, "pkg ", pkg->fileList ? "1" : "0", NULL);
+	int xx = writeHeader(fp, prefix, pkg->header);
+	free(prefix);
+	if (xx)
+	    goto exit;
+    }
+    fprintf(fp, "end\n");
+
+    rc = fclose(fp);
+    fp = NULL;
+    fd = -1;
+    if (rc == 0)
+	rc = rename(tmppath, path);
+
+exit:
+    if (fp)
+	fclose(fp);
+    else if (fd >= 0)
+	close(fd);
+    if (rc && tmppath) {
+	rpmlog(RPMLOG_DEBUG, "failed to cache spec parse %s: %s\n",
+		path, strerror(errno));
+	(void) unlink(tmppath);
+    }
+    free(tmppath);
+    free(path);
+    free(dir);
+}
+
+specCache specCacheFromSpec(rpmSpec spec)
+{
+    specCache sc = xcalloc(1, sizeof(*sc));
+
+    sc->source = headerLink(spec->sourcePackage->header);
+    for (Package pkg = spec->packages; pkg != NULL; pkg = pkg->next) {
+	sc->pkgs = xrealloc(sc->pkgs, (sc->npkgs + 1) * sizeof(*sc->pkgs));
+	sc->built = xrealloc(sc->built, (sc->npkgs + 1) * sizeof(*sc->built));
+	sc->pkgs[sc->npkgs] = headerLink(pkg->header);
+	sc->built[sc->npkgs] = (pkg->fileList != NULL);
+	sc->npkgs++;
+    }
+    return sc;
+}
+
+specCache specCacheFree(specCache sc)
+{
+    if (sc) {
+	headerFree(sc->source);
+	for (int i = 0; i < sc->npkgs; i++)
+	    headerFree(sc->pkgs[i]);
+	free(sc->pkgs);
+	free(sc->built);
+	free(sc);
+    }
+    return NULL;
+}
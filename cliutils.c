@@ -1,6 +1,10 @@
 #include "system.h"
 #include <errno.h>
+#include <string.h>
 #include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
 
 #include <rpm/rpmlog.h>
 #include <rpm/rpmlib.h>
@@ -10,6 +14,9 @@
 #include "cliutils.h"
 #include "debug.h"
 
+#define QUERYSOCK_MAXMSG (16 * 1024 * 1024)
+#define QUERYSOCK_MAXFDS 2
+
 static pid_t pipeChild = 0;
 
 RPM_GNUC_NORETURN
@@ -83,3 +90,212 @@ int finishPipe(void)
     }
     return rc;
 }
+
+static int sockWrite(int sock, const char *p, size_t len)
+{
+    while (len > 0) {
+	ssize_t n = send(sock, p, len, MSG_NOSIGNAL);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n <= 0)
+	    return -1;
+	p += n;
+	len -= n;
+    }
+    return 0;
+}
+
+static int sockRead(int sock, char *p, size_t len)
+{
+    while (len > 0) {
+	ssize_t n = read(sock, p, len);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n <= 0)
+	    return -1;
+	p += n;
+	len -= n;
+    }
+    return 0;
+}
+
+int querySockSend(int sock, ARGV_const_t msg, const int *fds, int nfds)
+{
+    union {
+	char buf[CMSG_SPACE(QUERYSOCK_MAXFDS * sizeof(int))];
+	struct cmsghdr align;
+    } cbuf;
+    struct msghdr mh;
+    struct iovec iov;
+    uint32_t len = 0;
+    char *buf, *p;
+    ssize_t n;
+    int rc = -1;
+
+    if (nfds > QUERYSOCK_MAXFDS)
+	return -1;
+
+    for (ARGV_const_t m = msg; m && *m; m++)
+	len += strlen(*m) + 1;
+    buf = xmalloc(sizeof(len) + len);
+    memcpy(buf, &len, sizeof(len));
+    p = buf + sizeof(len);
+    for (ARGV_const_t m = msg; m && *m; m++)
+	p = stpcpy(p, *m) + 1;
+
+    memset(&mh, 0, sizeof(mh));
+    iov.iov_base = buf;
+    iov.iov_len = sizeof(len) + len;
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    if (nfds > 0) {
+	struct cmsghdr *cmsg;
+	memset(&cbuf, 0, sizeof(cbuf));
+	mh.msg_control = cbuf.buf;
+	mh.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+	cmsg = CMSG_FIRSTHDR(&mh);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+    }
+
+    do {
+	n = sendmsg(sock, &mh, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+
+    if (n > 0)
+	rc = sockWrite(sock, buf + n, iov.iov_len - n);
+
+    free(buf);
+    return rc;
+}
+
+int querySockAllowed(int source, ARGV_const_t args)
+{
+    switch (source) {
+    case RPMQV_PACKAGE:
+	/* not installed package file arguments get read in */
+	for (ARGV_const_t arg = args; arg && *arg; arg++) {
+	    if (rpmFileHasSuffix(*arg, ".rpm"))
+		return 0;
+	}
+	break;
+    case RPMQV_WHATPROVIDES:
+    case RPMQV_PATH:
+    case RPMQV_PATH_ALL:
+	/* the server has a different working directory */
+	for (ARGV_const_t arg = args; arg && *arg; arg++) {
+	    if (**arg == '/')
+		continue;
+	    if (source != RPMQV_WHATPROVIDES || **arg == '.')
+		return 0;
+	}
+	break;
+    case RPMQV_ALL:
+    case RPMQV_GROUP:
+    case RPMQV_WHATREQUIRES:
+    case RPMQV_TRIGGEREDBY:
+    case RPMQV_DBOFFSET:
+    case RPMQV_PKGID:
+    case RPMQV_HDRID:
+    case RPMQV_TID:
+    case RPMQV_WHATRECOMMENDS:
+    case RPMQV_WHATSUGGESTS:
+    case RPMQV_WHATSUPPLEMENTS:
+    case RPMQV_WHATENHANCES:
+    case RPMQV_WHATOBSOLETES:
+    case RPMQV_WHATCONFLICTS:
+	break;
+    default:
+	/* package and spec files */
+	return 0;
+    }
+    return 1;
+}
+
+int querySockTimeout(int sock, int enable)
+{
+    struct timeval tv = { 0, 0 };
+
+    if (enable) {
+	tv.tv_sec = rpmExpandNumeric("%{?_query_socket_timeout}");
+	if (tv.tv_sec <= 0)
+	    tv.tv_sec = QUERYSOCK_TIMEOUT;
+    }
+    if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) ||
+	setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)))
+	return -1;
+    return 0;
+}
+
+int querySockRecv(int sock, ARGV_t *msg, int *fds, int nfds)
+{
+    union {
+	char buf[CMSG_SPACE(QUERYSOCK_MAXFDS * sizeof(int))];
+	struct cmsghdr align;
+    } cbuf;
+    struct msghdr mh;
+    struct iovec iov;
+    uint32_t len = 0;
+    char *buf = NULL;
+    ssize_t n;
+    int rc = -1;
+
+    for (int i = 0; i < nfds; i++)
+	fds[i] = -1;
+
+    memset(&mh, 0, sizeof(mh));
+    iov.iov_base = &len;
+    iov.iov_len = sizeof(len);
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = cbuf.buf;
+    mh.msg_controllen = sizeof(cbuf.buf);
+
+    do {
+	n = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0)
+	goto exit;
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh); cmsg;
+			    cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+	int *cfds = (int *) CMSG_DATA(cmsg);
+	int ncfds;
+	if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+	    continue;
+	ncfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+	for (int i = 0; i < ncfds; i++) {
+	    if (i < nfds && fds[i] < 0)
+		fds[i] = cfds[i];
+	    else
+		close(cfds[i]);
+	}
+    }
+
+    if (sockRead(sock, (char *)&len + n, sizeof(len) - n))
+	goto exit;
+    if (len > QUERYSOCK_MAXMSG)
+	goto exit;
+
+    buf = xmalloc(len + 1);
+    if (sockRead(sock, buf, len) || (len && buf[len - 1] != '\0'))
+	goto exit;
+
+    *msg = NULL;
+    for (char *p = buf; p < buf + len; p += strlen(p) + 1)
+	argvAdd(msg, p);
+    rc = 0;
+
+exit:
+    if (rc) {
+	for (int i = 0; i < nfds; i++) {
+	    if (fds[i] >= 0)
+		close(fds[i]);
+	    fds[i] = -1;
+	}
+    }
+    free(buf);
+    return rc;
+}
@@ -9,6 +9,7 @@
 #include <stdio.h>
 #include <popt.h>
 #include <rpm/rpmutil.h>
+#include <rpm/argv.h>
 
 /* "normalized" exit: avoid overflowing and xargs special value 255 */
 #define RETVAL(rc) (((rc) > 254) ? 254 : (rc))
@@ -22,4 +23,36 @@ int initPipe(void);
 
 int finishPipe(void);
 
+/*
+ * Query server protocol (rpmdb --serve). Every message is a native
+ * 32bit length followed by that many bytes of NUL-terminated strings,
+ * file descriptors may ride along with the first byte. A request is
+ * QUERYSOCK_MAGIC, root, dbpath, source, flags, incattr, excattr,
+ * vsflags, log mask, query format and arguments with the client stdout
+ * and stderr attached. The server answers QUERYSOCK_MAGIC when it's ready
+ * to run the query and waits for the client to confirm with the same,
+ * up to then the client can still give up and query by itself. The final
+ * reply is the exit code as a string, -1 for requests the server declines
+ * (instead of getting ready) is also a cue for the client to go it alone.
+ */
+#define QUERYSOCK_MAGIC	"rpmquery 2"
+#define QUERYSOCK_NARGS	10
+
+/* Seconds to wait on the other end, unless %_query_socket_timeout is set */
+#define QUERYSOCK_TIMEOUT	5
+
+int querySockSend(int sock, ARGV_const_t msg, const int *fds, int nfds);
+
+/*
+ * Can a query with this source and arguments be answered from the
+ * database alone, without files read on the client's behalf or paths
+ * relative to the client's working directory? Both ends check this.
+ */
+int querySockAllowed(int source, ARGV_const_t args);
+
+/* Enable or disable the send and receive timeouts on the socket */
+int querySockTimeout(int sock, int enable);
+
+int querySockRecv(int sock, ARGV_t *msg, int *fds, int nfds);
+
 #endif /* _CLIUTIL_H */
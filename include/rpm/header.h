@@ -70,6 +70,20 @@ unsigned int headerSizeof(Header h, int magicp);
  */
 void * headerExport(Header h, unsigned int * bsize);
 
+struct iovec;
+
+/** \ingroup header
+ * Export header to on-disk representation without copying it into a
+ * single blob. The returned segments written out in order make up the
+ * same blob as headerExport() returns, they reference the header's data
+ * and remain valid until the header is modified or freed.
+ * @param h		header (with pointers)
+ * @param[out] niov	number of segments
+ * @param[out] bsize	on-disk header blob size in bytes
+ * @return		array of segments (malloced, free() when done)
+ */
+struct iovec * headerExportIov(Header h, int * niov, unsigned int * bsize);
+
 /** \ingroup header
  * Convert header to on-disk representation, and then reload.
  * This is used to insure that all header data is in one chunk.
@@ -89,6 +103,7 @@ Header headerCopy(Header h);
 enum headerImportFlags_e {
     HEADERIMPORT_COPY		= (1 << 0), /* Make copy of blob on import? */
     HEADERIMPORT_FAST		= (1 << 1), /* Faster but less safe? */
+    HEADERIMPORT_LAZY		= (1 << 2), /* Byte-swap data on first use */
 };
 
 typedef rpmFlags headerImportFlags;
@@ -102,6 +117,17 @@ typedef rpmFlags headerImportFlags;
  */
 Header headerImport(void *blob, unsigned int bsize, headerImportFlags flags);
 
+/** \ingroup header
+ * Import only some of the tags of a header blob. The blob is not
+ * retained, data of the selected tags is copied into the new header.
+ * The resulting header has no immutable region.
+ * @param blob		on-disk header blob (i.e. with offsets)
+ * @param bsize		on-disk header blob size in bytes (0 if unknown)
+ * @param tags		tags to import, terminated by 0
+ * @return		header
+ */
+Header headerImportTags(void *blob, unsigned int bsize, const rpmTagVal * tags);
+
 /** \ingroup header
  * Read (and load) header from file handle.
  * @param fd		file handle
@@ -131,7 +157,9 @@ int headerIsEntry(Header h, rpmTagVal tag);
  * Modifier flags for headerGet() operation.
  * For consistent behavior you'll probably want to use ALLOC to ensure
  * the caller owns the data, but MINMEM is useful for avoiding extra
- * copy of data when you are sure the header wont go away.
+ * copy of data when you are sure the header wont go away. With MINMEM
+ * the pointer table of a string array may belong to the header too, free
+ * it with rpmtdFreeData() only and don't modify it.
  * Most of the time you'll probably want EXT too, but note that extensions 
  * tags don't generally honor the other flags, MINMEM, RAW, ALLOC and ARGV 
  * are only relevant for non-extension data.
@@ -262,6 +290,69 @@ int headerDel(Header h, rpmTagVal tag);
  */
 char * headerFormat(Header h, const char * fmt, errmsg_t * errmsg);
 
+/** \ingroup header
+ * Parse a header format for repeated use with headerFormatApply().
+ * A compiled format must not be used from several threads at once.
+ *
+ * @param fmt		format to use
+ * @param[out] errmsg	error message (if any)
+ * @return		compiled format, NULL on error
+ */
+headerCompiledFormat headerFormatCompile(const char * fmt, errmsg_t * errmsg);
+
+/** \ingroup header
+ * Return formatted output string from header tags using a compiled format.
+ * The returned string must be free()d.
+ *
+ * @param cfmt		compiled format
+ * @param h		header
+ * @param[out] errmsg	error message (if any)
+ * @return		formatted output string (malloc'ed)
+ */
+char * headerFormatApply(headerCompiledFormat cfmt, Header h, errmsg_t * errmsg);
+
+/** \ingroup header
+ * Output sink for headerFormatWrite().
+ *
+ * @param data		caller data
+ * @param buf		formatted output (not '\0' terminated)
+ * @param len		length of output
+ * @return		0 on success, non-zero to fail the write
+ */
+typedef int (*headerFormatSink)(void * data, const char * buf, size_t len);
+
+/** \ingroup header
+ * Format header tags using a compiled format, passing the output to a
+ * sink in pieces as it's produced instead of returning it as one string.
+ * On error, part of the output may already have been written.
+ *
+ * @param cfmt		compiled format
+ * @param h		header
+ * @param sink		output sink
+ * @param data		caller data for the sink
+ * @param[out] errmsg	error message (if any)
+ * @return		0 on success, -1 on error
+ */
+int headerFormatWrite(headerCompiledFormat cfmt, Header h,
+		      headerFormatSink sink, void * data, errmsg_t * errmsg);
+
+/** \ingroup header
+ * Return the tags a compiled format reads from headers. Formats using
+ * tag extensions or iterating over all tags may need any tag, for
+ * those NULL is returned. The returned array must be free()d.
+ *
+ * @param cfmt		compiled format
+ * @return		tags terminated by 0 (malloc'ed), NULL if unknown
+ */
+rpmTagVal * headerFormatTags(headerCompiledFormat cfmt);
+
+/** \ingroup header
+ * Destroy a compiled header format.
+ * @param cfmt		compiled format
+ * @return		NULL always
+ */
+headerCompiledFormat headerFormatFree(headerCompiledFormat cfmt);
+
 /** \ingroup header
  * Duplicate tag values from one header into another.
  * @param headerFrom	source header
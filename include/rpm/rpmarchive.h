@@ -103,6 +103,18 @@ int rpmfiArchiveClose(rpmfi fi);
  */
 rpm_loff_t rpmfiArchiveTell(rpmfi fi);
 
+/** \ingroup payload
+ * Position an archive reader at the file header at offset, as found in
+ * RPMTAG_PAYLOADFILEOFFSETS. Requires a seekable zstd payload, a reader
+ * which can't seek at all is left where it was. The file is then read
+ * with rpmfiNext() as usual, but reaching the end of the archive no longer
+ * tells whether all files were found.
+ * @param fi		archive reader
+ * @param offset	uncompressed payload offset
+ * @return		0 on success, error code otherwise
+ */
+int rpmfiArchiveSeek(rpmfi fi, rpm_loff_t offset);
+
 /** \ingroup payload
  * Write content into current file in archive
  * @param fi		file info
@@ -137,7 +149,9 @@ ssize_t rpmfiArchiveRead(rpmfi fi, void * buf, size_t size);
 int rpmfiArchiveHasContent(rpmfi fi);
 
 /** \ingroup payload
- * Write content from current file in archive to a file
+ * Write content from current file in archive to a file. The content is
+ * read from where the reader is, to get at a single file without reading
+ * the payload up to it position the reader with rpmfiArchiveSeek() first.
  * @param fi		file info
  * @param fd		file descriptor of file to write to
  * @param nodigest	omit checksum check if 1
@@ -28,7 +28,9 @@ typedef enum rpmdbOpX_e {
     RPMDB_OP_DBGET              = 1,
     RPMDB_OP_DBPUT              = 2,
     RPMDB_OP_DBDEL              = 3,
-    RPMDB_OP_MAX		= 4
+    RPMDB_OP_HDRHIT             = 4,
+    RPMDB_OP_HDRMISS            = 5,
+    RPMDB_OP_MAX		= 6
 } rpmdbOpX;
 
 typedef enum rpmdbCtrlOp_e {
@@ -36,7 +38,8 @@ typedef enum rpmdbCtrlOp_e {
     RPMDB_CTRL_UNLOCK_RO       = 2,
     RPMDB_CTRL_LOCK_RW         = 3,
     RPMDB_CTRL_UNLOCK_RW       = 4,
-    RPMDB_CTRL_INDEXSYNC       = 5
+    RPMDB_CTRL_INDEXSYNC       = 5,
+    RPMDB_CTRL_COMPACT         = 6
 } rpmdbCtrlOp;
 
 /** \ingroup rpmdb
@@ -101,6 +104,17 @@ int rpmdbAppendIterator(rpmdbMatchIterator mi,
 int rpmdbSetIteratorRE(rpmdbMatchIterator mi, rpmTagVal tag,
 		rpmMireMode mode, const char * pattern);
 
+/** \ingroup rpmdb
+ * Import only the listed tags from headers retrieved by the iterator.
+ * Tags used by iterator patterns are always included. Headers with
+ * only some of their tags can't be rewritten, setting this on a
+ * rewriting iterator fails and enabling rewrite clears it.
+ * @param mi		rpm database iterator
+ * @param tags		tags to import, terminated by 0 (NULL for all)
+ * @return		0 on success
+ */
+int rpmdbSetIteratorTags(rpmdbMatchIterator mi, const rpmTagVal * tags);
+
 /** \ingroup rpmdb
  * Prepare iterator for lazy writes.
  * @note Must be called before rpmdbNextIterator() with CDB model database.
@@ -139,6 +153,22 @@ int rpmdbSetHdrChk(rpmdbMatchIterator mi, rpmts ts,
 rpmdbMatchIterator rpmdbInitIterator(rpmdb db, rpmDbiTagVal rpmtag,
 			const void * keyp, size_t keylen);
 
+/** \ingroup rpmdb
+ * Return database iterators over the owners of several files. The
+ * paths are looked up together, sharing the index lookups and header
+ * loads of paths with the same basename, which is much faster than an
+ * iterator per path for many paths.
+ * @param db		rpm database
+ * @param rpmtag	RPMDBI_INSTFILENAMES or RPMDBI_BASENAMES
+ * @param paths		file paths
+ * @param npaths	number of paths
+ * @param[out] mis	iterator of each path, NULL if it has no owner
+ * @return		0 on success, -1 on failure
+ */
+int rpmdbInitFileIterators(rpmdb db, rpmDbiTagVal rpmtag,
+			   const char ** paths, int npaths,
+			   rpmdbMatchIterator * mis);
+
 /** \ingroup rpmdb
  * Return next package header from iteration.
  * @param mi		rpm database iterator
@@ -219,6 +249,93 @@ unsigned int rpmdbIndexIteratorTagNum(rpmdbIndexIterator ii, unsigned int nr);
  */
 rpmdbIndexIterator rpmdbIndexIteratorFree(rpmdbIndexIterator ii);
 
+/** \ingroup rpmdb
+ * Compact list of the installed packages, see rpmdbGetPkgList().
+ */
+typedef struct rpmdbPkgList_s * rpmdbPkgList;
+
+/** \ingroup rpmdb
+ * A package of a package list. Strings are offsets for
+ * rpmdbPkgListStr(), dependencies and files are index ranges for
+ * rpmdbPkgListDeps() and rpmdbPkgListFiles().
+ */
+struct rpmdbPkgListPkg_s {
+    uint32_t hdrNum;		/*!< package instance */
+    uint32_t name;
+    uint32_t evr;		/*!< [epoch:]version-release */
+    uint32_t arch;
+    uint32_t deps;		/*!< first dependency */
+    uint32_t ndeps;
+    uint32_t files;		/*!< first file */
+    uint32_t nfiles;
+};
+
+/** \ingroup rpmdb
+ * A dependency of a package list package.
+ */
+struct rpmdbPkgListDep_s {
+    uint32_t tag;		/*!< name tag, eg. RPMTAG_REQUIRENAME */
+    uint32_t name;
+    uint32_t evr;		/*!< empty for unversioned ones */
+    uint32_t flags;		/*!< rpmsenseFlags */
+};
+
+/** \ingroup rpmdb
+ * A file of a package list package.
+ */
+struct rpmdbPkgListFile_s {
+    uint32_t dirname;
+    uint32_t basename;
+};
+
+/** \ingroup rpmdb
+ * Return the names, versions, dependencies and files of all installed
+ * packages as flat tables, for depsolvers to set up their view of the
+ * installed system from without loading every header. Needs
+ * %_db_package_list, the list is then stored next to the database
+ * (Packagelist) and kept up to date with its changes. The list is owned
+ * by db and valid until the database is changed or closed.
+ * @param db		rpm database
+ * @return		package list, NULL if not in use
+ */
+rpmdbPkgList rpmdbGetPkgList(rpmdb db);
+
+/** \ingroup rpmdb
+ * Return the packages of a package list, sorted by instance.
+ * @param pl		package list
+ * @param[out] count	number of packages
+ * @return		first package
+ */
+const struct rpmdbPkgListPkg_s * rpmdbPkgListPkgs(rpmdbPkgList pl,
+						  unsigned int * count);
+
+/** \ingroup rpmdb
+ * Return the dependencies of a package list package, in header order
+ * of provides, requires, conflicts, obsoletes and the weak dependencies.
+ * @param pl		package list
+ * @param pkg		package
+ * @return		first of pkg->ndeps dependencies
+ */
+const struct rpmdbPkgListDep_s * rpmdbPkgListDeps(rpmdbPkgList pl,
+				const struct rpmdbPkgListPkg_s * pkg);
+
+/** \ingroup rpmdb
+ * Return the files of a package list package.
+ * @param pl		package list
+ * @param pkg		package
+ * @return		first of pkg->nfiles files
+ */
+const struct rpmdbPkgListFile_s * rpmdbPkgListFiles(rpmdbPkgList pl,
+				const struct rpmdbPkgListPkg_s * pkg);
+
+/** \ingroup rpmdb
+ * Return a string of a package list.
+ * @param pl		package list
+ * @param off		string offset
+ * @return		string, NULL if off is out of range
+ */
+const char * rpmdbPkgListStr(rpmdbPkgList pl, uint32_t off);
+
 /** \ingroup rpmdb
  * manipulate the rpm database
  * @param db		rpm database
@@ -171,6 +171,14 @@ FD_t fdFree(FD_t fd);
  */
 off_t ufdCopy(FD_t sfd, FD_t tfd);
 
+/** \ingroup rpmio
+ * Limit the total number of threads used by compressing streams in this
+ * process. Streams opened when the budget is exhausted get one thread.
+ * @param nthreads	max. number of compression threads (0 for unlimited)
+ * @return		previous limit
+ */
+int rpmioSetThreadBudget(int nthreads);
+
 /** \ingroup rpmio
  * Identify per-desciptor I/O operation statistics.
  */
@@ -43,6 +43,21 @@ int rpmKeyringAddKey(rpmKeyring keyring, rpmPubkey key);
  */
 rpmRC rpmKeyringVerifySig(rpmKeyring keyring, pgpDigParams sig, DIGEST_CTX ctx);
 
+/** \ingroup rpmkeyring
+ * Perform keyring lookup and verification of several signatures,
+ * spread over up to nthreads threads. Each extra thread works on a
+ * copy of the keyring, so this pays off on larger batches only.
+ * @param keyring	keyring handle
+ * @param nsigs		number of signatures
+ * @param sigs		OpenPGP signature parameters
+ * @param ctxs		signature hash context of each signature
+ * @param[out] rcs	RPMRC_OK / RPMRC_FAIL / RPMRC_NOKEY of each signature
+ * @param nthreads	maximum number of threads (including the caller)
+ * @return		number of signatures not verified ok
+ */
+int rpmKeyringVerifySigs(rpmKeyring keyring, int nsigs, pgpDigParams *sigs,
+			 DIGEST_CTX *ctxs, rpmRC *rcs, int nthreads);
+
 /** \ingroup rpmkeyring
  * Reference a keyring.
  * @param keyring	keyring handle
@@ -182,6 +182,35 @@ void	rpmInitMacros	(rpmMacroContext mc, const char * macrofiles);
  */
 void	rpmFreeMacros	(rpmMacroContext mc);
 
+/** \ingroup rpmmacro
+ * Create a macro context layered on another one, for use by a thread.
+ * Names not defined in the new context are looked up in the parent
+ * without locking it, definitions and undefinitions only affect the new
+ * context. The parent is frozen while it has child contexts: attempts
+ * to change it fail, and expansions in it don't see definitions they make.
+ * Lua is not thread-safe, %{lua:...} expansions are still serialized.
+ * @param parent	parent macro context (NULL uses global context).
+ * @return		new macro context
+ */
+rpmMacroContext rpmMacroContextNew(rpmMacroContext parent);
+
+/** \ingroup rpmmacro
+ * Free a macro context created with rpmMacroContextNew(), unfreezing its
+ * parent once the last child is gone.
+ * @param mc		macro context
+ * @return		NULL always
+ */
+rpmMacroContext rpmMacroContextFree(rpmMacroContext mc);
+
+/** \ingroup rpmmacro
+ * Set the macro context of the calling thread. NULL and
+ * rpmGlobalMacroContext passed to the macro API (including rpmExpand())
+ * from this thread then refer to it.
+ * @param mc		macro context (NULL for the global context)
+ * @return		previous macro context of the thread
+ */
+rpmMacroContext rpmMacroContextSetThread(rpmMacroContext mc);
+
 /** \ingroup rpmmacro
  * Return (malloc'ed) concatenated macro expansion(s).
  * @param arg		macro(s) to expand (NULL terminates list)
@@ -198,6 +227,34 @@ char * rpmExpand	(const char * arg, ...) RPM_GNUC_NULL_TERMINATED;
  */
 int	rpmExpandNumeric (const char * arg);
 
+/** \ingroup rpmmacro
+ * Expansion cache for rpmExpandCached() and rpmExpandNumericCached().
+ * Zero-initialize before first use (static storage is fine).
+ */
+typedef struct rpmMacroCache_s {
+    unsigned int generation;	/*!< global macro context generation */
+    char *value;		/*!< cached expansion */
+} rpmMacroCache;
+
+/** \ingroup rpmmacro
+ * Return (malloc'ed) macro expansion, expanding again only when the
+ * global macro context changed since the cached expansion. Only
+ * suitable for macros whose value depends on other macros alone.
+ * @param cache		expansion cache
+ * @param arg		macro to expand
+ * @return		macro expansion (malloc'ed)
+ */
+char * rpmExpandCached(rpmMacroCache *cache, const char * arg);
+
+/** \ingroup rpmmacro
+ * Return macro expansion as a numeric value like rpmExpandNumeric(),
+ * using an expansion cache like rpmExpandCached().
+ * @param cache		expansion cache
+ * @param arg		macro to expand
+ * @return		numeric value
+ */
+int	rpmExpandNumericCached(rpmMacroCache *cache, const char * arg);
+
 /** \ingroup rpmmacro
  * Return rpm configuration base directory.
  * If RPM_CONFIGDIR environment variable is set, it's value will be used.
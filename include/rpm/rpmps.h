@@ -89,7 +89,8 @@ rpmps rpmpsFree(rpmps ps);
 void rpmpsPrint(FILE *fp, rpmps ps);
 
 /** \ingroup rpmps
- * Append a problem to current set of problems.
+ * Append a problem to current set of problems. Duplicates of problems
+ * already in the set are ignored.
  * @param ps		problem set
  * @param prob		rpmProblem 
  */
@@ -99,7 +100,7 @@ void rpmpsAppendProblem(rpmps ps, rpmProblem prob);
  * Merge problem set into another.
  * @param dest		destination problem set
  * @param src		source problem set
- * @return		number of problems merged
+ * @return		number of new problems merged
  */
 int rpmpsMerge(rpmps dest, rpmps src);
 
@@ -36,6 +36,15 @@ struct rpmSignArgs {
  */
 int rpmPkgSign(const char *path, const struct rpmSignArgs * args);
 
+/** \ingroup rpmsign
+ * Sign packages, several at once if so configured with %_sign_threads.
+ * Messages of packages signed in parallel may be interleaved.
+ * @param paths		paths to packages
+ * @param args		signing parameters (or NULL for defaults)
+ * @return		number of packages that failed to sign
+ */
+int rpmPkgSignArgv(ARGV_const_t paths, const struct rpmSignArgs * args);
+
 /** \ingroup rpmsign
  * Delete signature(s) from a package
  * @param path		path to package
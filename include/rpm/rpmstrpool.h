@@ -40,6 +40,8 @@ rpmstrPool rpmstrPoolLink(rpmstrPool pool);
  * If keephash is 0, memory usage is minimized but string -> id lookups
  * are no longer possible and unfreezing is an expensive operation.
  * Id -> string lookups are always possible on a frozen pool too.
+ * All lookups on a frozen pool are lock-free. Freezing must not happen
+ * concurrently with other operations on the same pool.
  * @param pool		string pool
  * @param keephash	should string -> id hash be kept around?
  */
@@ -116,6 +118,13 @@ int rpmstrPoolStreq(rpmstrPool poolA, rpmsid sidA,
  */
 rpmsid rpmstrPoolNumStr(rpmstrPool pool);
 
+/** \ingroup rpmstrpool
+ * Return the memory used by the pool: strings, ids and the hash.
+ * @param pool		string pool
+ * @return		size in bytes
+ */
+size_t rpmstrPoolMemSize(rpmstrPool pool);
+
 #ifdef __cplusplus
 }
 #endif
@@ -83,6 +83,17 @@ int rpmswEnter(rpmop op, ssize_t rc);
  */
 rpmtime_t rpmswExit(rpmop op, ssize_t rc);
 
+/** \ingroup rpmsw
+ * Account a completed operation started at a caller-supplied time stamp.
+ * Unlike rpmswEnter() + rpmswExit(), this doesn't use the begin stamp
+ * stored in op and is thus safe for concurrent operations on one op.
+ * @param op			operation statistics
+ * @param begin			time stamp from rpmswNow() at operation start
+ * @param rc			per-operation data (e.g. bytes transferred)
+ * @return			cumulative usecs for operation
+ */
+rpmtime_t rpmswAccount(rpmop op, rpmsw begin, ssize_t rc);
+
 /** \ingroup rpmsw
  * Sum statistic counters.
  * @param to			result statistics
@@ -387,6 +387,8 @@ typedef enum rpmTag_e {
     RPMTAG_POSTUNTRANSPROG	= 5106,	/* s[] */
     RPMTAG_PREUNTRANSFLAGS	= 5107, /* i */
     RPMTAG_POSTUNTRANSFLAGS	= 5108, /* i */
+    RPMTAG_PAYLOADFILEOFFSETS	= 5109, /* l[] */
+    RPMTAG_PAYLOADDICT		= 5110, /* x */
 
     RPMTAG_FIRSTFREE_TAG	/*!< internal */
 } rpmTag;
@@ -418,6 +420,7 @@ typedef enum rpmDbiTag_e {
     RPMDBI_SUGGESTNAME		= RPMTAG_SUGGESTNAME,
     RPMDBI_SUPPLEMENTNAME	= RPMTAG_SUPPLEMENTNAME,
     RPMDBI_ENHANCENAME		= RPMTAG_ENHANCENAME,
+    RPMDBI_NVRA			= RPMTAG_NVRA,	/* optional, %_db_label_index */
 } rpmDbiTag;
 
 /** \ingroup signature
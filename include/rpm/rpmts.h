@@ -174,9 +174,23 @@ typedef	enum rpmtsOpX_e {
     RPMTS_OP_DBPUT		= 15,
     RPMTS_OP_DBDEL		= 16,
     RPMTS_OP_VERIFY		= 17,
-    RPMTS_OP_MAX		= 18
+    RPMTS_OP_HDRHIT		= 18,
+    RPMTS_OP_HDRMISS		= 19,
+    RPMTS_OP_HDRLOAD		= 20,
+    RPMTS_OP_FILECMP		= 21,	/*!< overlapping files compared */
+    RPMTS_OP_FILECOLOR		= 22,	/*!< conflicts resolved by color */
+    RPMTS_OP_FILEREAD		= 23,	/*!< files compared on disk */
+    RPMTS_OP_MAX		= 24
 } rpmtsOpX;
 
+/** \ingroup rpmts
+ * Output formats for transaction statistics (values of _rpmts_stats).
+ */
+enum rpmtsStatsFormat_e {
+    RPMTS_STATS_TEXT		= 1,	/*!< human readable (also -1) */
+    RPMTS_STATS_JSON		= 2,	/*!< JSON object */
+};
+
 enum rpmtxnFlags_e {
     RPMTXN_READ		= (1 << 0),
     RPMTXN_WRITE	= (1 << 1),
@@ -244,6 +258,9 @@ int rpmtsOrder(rpmts ts);
  * Additionally, though not required you may want to:
  *
  *    - setup the rpm verify signature flags via rpmtsSetVSFlags().
+ *
+ * Transactions in one process run one at a time, calls from other
+ * threads wait for the running one to finish.
  *       
  * @param ts		transaction set
  * @param okProbs	unused
@@ -312,6 +329,14 @@ int rpmtsRebuildDB(rpmts ts);
  */
 int rpmtsVerifyDB(rpmts ts);
 
+/** \ingroup rpmts
+ * Compact the database used by the transaction. Other processes can
+ * keep reading the database while this runs.
+ * @param ts		transaction set
+ * @return		0 on success
+ */
+int rpmtsCompactDB(rpmts ts);
+
 /** \ingroup rpmts
  * Return transaction database iterator.
  * @param ts		transaction set
@@ -323,6 +348,19 @@ int rpmtsVerifyDB(rpmts ts);
 rpmdbMatchIterator rpmtsInitIterator(const rpmts ts, rpmDbiTagVal rpmtag,
 			const void * keyp, size_t keylen);
 
+/** \ingroup rpmts
+ * Return transaction database iterators over the owners of several files.
+ * @param ts		transaction set
+ * @param rpmtag	RPMDBI_INSTFILENAMES or RPMDBI_BASENAMES
+ * @param paths		file paths
+ * @param npaths	number of paths
+ * @param[out] mis	iterator of each path, NULL if it has no owner
+ * @return		0 on success, -1 on failure
+ */
+int rpmtsInitFileIterators(const rpmts ts, rpmDbiTagVal rpmtag,
+			   const char ** paths, int npaths,
+			   rpmdbMatchIterator * mis);
+
 /** \ingroup rpmts
  * Import a header into the rpmdb
  * @param txn		transaction handle
@@ -591,6 +629,19 @@ rpm_color_t rpmtsSetPrefColor(rpmts ts, rpm_color_t color);
  */
 rpmop rpmtsOp(rpmts ts, rpmtsOpX opx);
 
+/** \ingroup rpmts
+ * Format the operation statistics of a transaction set.
+ * The JSON format has an object "phases" with count, bytes and usecs of
+ * each transaction-wide operation, and an array "packages" with the
+ * same per package for the elements the set has held, if statistics
+ * collection was enabled (_rpmts_stats) at the time. An object "plugins"
+ * holds call count, usecs and p99_usecs of each hook used per plugin.
+ * @param ts		transaction set
+ * @param format	RPMTS_STATS_TEXT or RPMTS_STATS_JSON
+ * @return		formatted statistics (malloced)
+ */
+char * rpmtsFormatStats(rpmts ts, int format);
+
 /** \ingroup rpmts
  * Get the plugins associated with a transaction set
  * @param ts		transaction set
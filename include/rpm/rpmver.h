@@ -17,6 +17,29 @@ extern "C" {
  */
 int rpmvercmp(const char * a, const char * b);
 
+/** \ingroup rpmver
+ * Compute a binary collation key for a version or release string.
+ * Comparing two keys with rpmverkeycmp() gives the same result as
+ * rpmvercmp() on the original strings, which makes repeated
+ * comparisons of the same strings (eg. in sorting) much cheaper.
+ *
+ * @param v		version or release string
+ * @param[out] keylen	length of the key (or NULL)
+ * @return		collation key (malloced)
+ */
+uint8_t *rpmverkey(const char *v, size_t *keylen);
+
+/** \ingroup rpmver
+ * Compare two collation keys from rpmverkey().
+ *
+ * @param a		1st key
+ * @param alen		1st key length
+ * @param b		2nd key
+ * @param blen		2nd key length
+ * @return		+1 if a is "newer", 0 if equal, -1 if b is "newer"
+ */
+int rpmverkeycmp(const uint8_t *a, size_t alen, const uint8_t *b, size_t blen);
+
 /** \ingroup rpmver
  * Parse rpm version handle from evr string
  *
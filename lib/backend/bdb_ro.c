@@ -1,6 +1,8 @@
 #include "system.h"
 
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -25,6 +27,9 @@ struct bdb_kv {
 
 struct bdb_db {
     int fd;			/* file descriptor of database */
+    unsigned char *map;		/* the file mapped (or NULL) */
+    size_t mapsize;
+    int willneed;		/* readahead of the mapping requested? */
     int type;			/* BDB_HASH / BDB_BTREE */
     unsigned int pagesize;
     unsigned int lastpage;
@@ -45,8 +50,9 @@ struct bdb_cur {
     struct bdb_kv val;
 
     unsigned char *page;	/* the page we're looking at */
+    unsigned char *pagebuf;	/* space for pages not used in place */
 
-    unsigned char *ovpage;
+    unsigned char *ovpagebuf;
     struct bdb_kv keyov;	/* space to store oversized keys/values */
     struct bdb_kv valov;
 
@@ -131,11 +137,24 @@ static void bdb_swappage(struct bdb_db *db, unsigned char *page)
     }
 }
 
-static int bdb_getpage(struct bdb_db *db, unsigned char *page, unsigned int pageno)
+/*
+ * Point *pagep to the page. Pages of mapped databases in native byte
+ * order are used in place, others are read (and swapped) into buf.
+ */
+static int bdb_getpage(struct bdb_db *db, unsigned char **pagep, unsigned char *buf, unsigned int pageno)
 {
+    size_t off = (size_t)pageno * db->pagesize;
+    unsigned char *page = buf;
+
+    *pagep = buf;
     if (!pageno || pageno > db->lastpage)
 	return -1;
-    if (pread(db->fd, page, db->pagesize, (off_t)pageno * db->pagesize) != db->pagesize) {
+    if (db->map && off + db->pagesize <= db->mapsize) {
+	if (db->swapped)
+	    memcpy(buf, db->map + off, db->pagesize);
+	else
+	    page = db->map + off;
+    } else if (pread(db->fd, buf, db->pagesize, (off_t)pageno * db->pagesize) != db->pagesize) {
 	rpmlog(RPMLOG_ERR, "pread: %s\n", strerror(errno));
 	return -1;
     }
@@ -143,16 +162,46 @@ static int bdb_getpage(struct bdb_db *db, unsigned char *page, unsigned int page
 	bdb_swappage(db, page);
     if (pageno != *(uint32_t *)(page + 8))
 	return -1;
+    *pagep = page;
     return 0;
 }
 
+/* Full scans walk (nearly) the whole file, have the kernel read ahead */
+static void bdb_willneed(struct bdb_db *db)
+{
+    if (db->map && !db->willneed) {
+	(void) madvise(db->map, db->mapsize, MADV_WILLNEED);
+	db->willneed = 1;
+    }
+}
+
 static void bdb_close(struct bdb_db *db)
 {
+    if (db->map)
+	munmap(db->map, db->mapsize);
     if (db->fd >= 0)
 	close(db->fd);
     free(db);
 }
 
+/* Map the pages, reading them falls back to pread() if this fails */
+static void bdb_map(struct bdb_db *db)
+{
+    struct stat sb;
+    size_t size;
+    void *map;
+
+    if (fstat(db->fd, &sb) || sb.st_size <= 0 || (uintmax_t)sb.st_size > SIZE_MAX)
+	return;
+    size = sb.st_size;
+    map = mmap(NULL, size, PROT_READ, MAP_SHARED, db->fd, 0);
+    if (map == MAP_FAILED)
+	return;
+    (void) madvise(map, size, MADV_RANDOM);
+    db->map = map;
+    db->mapsize = size;
+}
+
 static struct bdb_db *bdb_open(const char *name)
 {
     uint32_t meta[512 / 4];
@@ -205,6 +254,12 @@ static struct bdb_db *bdb_open(const char *name)
 	}
 	db->root = meta[22];
     }
+    if (db->pagesize < 512 || (db->pagesize & (db->pagesize - 1)) != 0) {
+	rpmlog(RPMLOG_ERR, "%s: invalid page size %u\n", name, db->pagesize);
+	bdb_close(db);
+	return NULL;
+    }
+    bdb_map(db);
     return db;
 }
 
@@ -217,6 +272,7 @@ static int ovfl_get(struct bdb_cur *cur, struct bdb_kv *kv, struct bdb_kv *ov, u
     unsigned int len = pagenolen[1];
     unsigned int plen;
     unsigned char *p;
+    unsigned char *ovpage;
 
     if (len == 0)
 	return -1;
@@ -227,21 +283,21 @@ static int ovfl_get(struct bdb_cur *cur, struct bdb_kv *kv, struct bdb_kv *ov, u
 	    ov->kv = xmalloc(len);
 	ov->len = len;
     }
-    if (!cur->ovpage)
-	cur->ovpage = xmalloc(cur->db->pagesize);
+    if (!cur->ovpagebuf)
+	cur->ovpagebuf = xmalloc(cur->db->pagesize);
     p = ov->kv;
     while (len > 0) {
-	if (bdb_getpage(cur->db, cur->ovpage, pageno))
+	if (bdb_getpage(cur->db, &ovpage, cur->ovpagebuf, pageno))
 	    return -1;
-	if (cur->ovpage[25] != 7)
+	if (ovpage[25] != 7)
 	    return -1;
-	plen = *(uint16_t *)(cur->ovpage + 22);
+	plen = *(uint16_t *)(ovpage + 22);
 	if (plen + 26 > cur->db->pagesize || plen > len)
 	    return -1;
-	memcpy(p, cur->ovpage + 26, plen);
+	memcpy(p, ovpage + 26, plen);
 	p += plen;
 	len -= plen;
-	pageno = *(uint32_t *)(cur->ovpage + 16);
+	pageno = *(uint32_t *)(ovpage + 16);
     }
     if (kv) {
 	kv->kv = ov->kv;
@@ -274,7 +330,7 @@ static int hash_lookup(struct bdb_cur *cur, const unsigned char *key, unsigned i
 	bucket &= cur->db->lowmask;
     cur->bucket = bucket;
     pg = hash_bucket_to_page(cur->db, bucket);
-    if (bdb_getpage(cur->db, cur->page, pg))
+    if (bdb_getpage(cur->db, &cur->page, cur->pagebuf, pg))
 	return -1;
     if (cur->page[25] != 8 && cur->page[25] != 13 && cur->page[25] != 2)
 	return -1;
@@ -308,8 +364,11 @@ static int hash_next(struct bdb_cur *cur)
 {
     int pagesize = cur->db->pagesize;
     int koff, klen, voff, vlen;
-    if (!cur->state && hash_lookup(cur, 0, 0))
-	return -1;
+    if (!cur->state) {
+	bdb_willneed(cur->db);
+	if (hash_lookup(cur, 0, 0))
+	    return -1;
+    }
     cur->idx += 2;
     for (;;) {
 	if (cur->idx + 1 >= cur->numidx) {
@@ -321,7 +380,7 @@ static int hash_next(struct bdb_cur *cur)
 		    return 1;
 		pg = hash_bucket_to_page(cur->db, ++cur->bucket);
 	    }
-	    if (bdb_getpage(cur->db, cur->page, pg))
+	    if (bdb_getpage(cur->db, &cur->page, cur->pagebuf, pg))
 		return -1;
 	    if (cur->page[25] != 8 && cur->page[25] != 13 && cur->page[25] != 2)
 		return -1;
@@ -370,7 +429,7 @@ static int btree_lookup(struct bdb_cur *cur, const unsigned char *key, unsigned
     cur->state = -1;
     pg = cur->db->root;
     for (;;) {
-	if (bdb_getpage(cur->db, cur->page, pg))
+	if (bdb_getpage(cur->db, &cur->page, cur->pagebuf, pg))
 	    return -1;
 	if (cur->page[25] == 5)
 	    break;		/* found leaf page */
@@ -440,8 +499,11 @@ static int btree_next(struct bdb_cur *cur)
 {
     int pagesize = cur->db->pagesize;
     int koff, voff;
-    if (!cur->state && btree_lookup(cur, 0, 0))
-	return -1;
+    if (!cur->state) {
+	bdb_willneed(cur->db);
+	if (btree_lookup(cur, 0, 0))
+	    return -1;
+    }
     cur->idx += 2;
     for (;;) {
 	if (cur->idx + 1 >= cur->numidx) {
@@ -450,7 +512,7 @@ static int btree_next(struct bdb_cur *cur)
 	    pg = *(uint32_t *)(cur->page + 16);
 	    if (cur->islookup || !pg)
 	      return 1;
-	    if (bdb_getpage(cur->db, cur->page, pg))
+	    if (bdb_getpage(cur->db, &cur->page, cur->pagebuf, pg))
 		return -1;
 	    if (cur->page[25] != 5)
 		return -1;
@@ -487,16 +549,16 @@ static struct bdb_cur *cur_open(struct bdb_db *db)
 {
     struct bdb_cur *cur = xcalloc(1, sizeof(*cur));
     cur->db = db;
-    cur->page = xmalloc(db->pagesize);
+    cur->page = cur->pagebuf = xmalloc(db->pagesize);
     return cur;
 }
 
 static void cur_close(struct bdb_cur *cur)
 {
-    if (cur->page)
-	free(cur->page);
-    if (cur->ovpage)
-	free(cur->ovpage);
+    if (cur->pagebuf)
+	free(cur->pagebuf);
+    if (cur->ovpagebuf)
+	free(cur->ovpagebuf);
     if (cur->keyov.kv)
 	free(cur->keyov.kv);
     if (cur->valov.kv)
@@ -6,6 +6,8 @@
 
 #include <stdlib.h>
 #include <fcntl.h>
+#include <string.h>
+#include <sys/uio.h>
 #include <rpm/rpmstring.h>
 #include <rpm/rpmmacro.h>
 #include <rpm/rpmlog.h>
@@ -199,6 +201,27 @@ rpmRC pkgdbPut(dbiIndex dbi, dbiCursor dbc, unsigned int *hdrNum, unsigned char
     return dbi->dbi_rpmdb->db_ops->pkgdbPut(dbi, dbc, hdrNum, hdrBlob, hdrLen);
 }
 
+rpmRC pkgdbPutIov(dbiIndex dbi, dbiCursor dbc, unsigned int *hdrNum,
+		  const struct iovec *iov, int niov, unsigned int hdrLen)
+{
+    const struct rpmdbOps_s *ops = dbi->dbi_rpmdb->db_ops;
+    unsigned char *blob, *p;
+    rpmRC rc;
+
+    if (ops->pkgdbPutIov)
+	return ops->pkgdbPutIov(dbi, dbc, hdrNum, iov, niov, hdrLen);
+
+    /* Backends that need the blob in one piece get it gathered */
+    p = blob = xmalloc(hdrLen);
+    for (int i = 0; i < niov; i++) {
+	memcpy(p, iov[i].iov_base, iov[i].iov_len);
+	p += iov[i].iov_len;
+    }
+    rc = ops->pkgdbPut(dbi, dbc, hdrNum, blob, hdrLen);
+    free(blob);
+    return rc;
+}
+
 rpmRC pkgdbDel(dbiIndex dbi, dbiCursor dbc,  unsigned int hdrNum)
 {
     return dbi->dbi_rpmdb->db_ops->pkgdbDel(dbi, dbc, hdrNum);
@@ -214,21 +237,98 @@ unsigned int pkgdbKey(dbiIndex dbi, dbiCursor dbc)
     return dbi->dbi_rpmdb->db_ops->pkgdbKey(dbi, dbc);
 }
 
+int pkgdbTrusted(dbiIndex dbi, dbiCursor dbc)
+{
+    if (dbi->dbi_rpmdb->db_ops->pkgdbTrusted)
+	return dbi->dbi_rpmdb->db_ops->pkgdbTrusted(dbi, dbc);
+    return 0;
+}
+
 rpmRC idxdbGet(dbiIndex dbi, dbiCursor dbc, const char *keyp, size_t keylen, dbiIndexSet *set, int curFlags)
 {
     return dbi->dbi_rpmdb->db_ops->idxdbGet(dbi, dbc, keyp, keylen, set, curFlags);
 }
 
+rpmRC idxdbGetBatch(dbiIndex dbi, dbiCursor dbc, const char **keys,
+		    const size_t *keylens, int nkeys, dbiIndexSet *sets)
+{
+    rpmRC rc = RPMRC_OK;
+
+    if (dbi->dbi_rpmdb->db_ops->idxdbGetBatch)
+	return dbi->dbi_rpmdb->db_ops->idxdbGetBatch(dbi, dbc, keys, keylens,
+						      nkeys, sets);
+
+    for (int i = 0; i < nkeys && rc != RPMRC_FAIL; i++) {
+	rc = idxdbGet(dbi, dbc, keys[i], keylens[i], &sets[i], DBC_NORMAL_SEARCH);
+    }
+    return (rc == RPMRC_FAIL) ? rc : RPMRC_OK;
+}
+
+rpmRC idxdbGetSorted(dbiIndex dbi, dbiCursor dbc, const char **keys,
+		    const size_t *keylens, int nkeys, dbiIndexSet *sets)
+{
+    if (dbi->dbi_rpmdb->db_ops->idxdbGetSorted)
+	return dbi->dbi_rpmdb->db_ops->idxdbGetSorted(dbi, dbc, keys, keylens,
+						       nkeys, sets);
+
+    return idxdbGetBatch(dbi, dbc, keys, keylens, nkeys, sets);
+}
+
+rpmRC idxdbCount(dbiIndex dbi, dbiCursor dbc, const char *keyp, size_t keylen,
+		 unsigned int *count)
+{
+    dbiIndexSet set = NULL;
+    rpmRC rc;
+
+    if (dbi->dbi_rpmdb->db_ops->idxdbCount)
+	return dbi->dbi_rpmdb->db_ops->idxdbCount(dbi, dbc, keyp, keylen, count);
+
+    rc = idxdbGet(dbi, dbc, keyp, keylen, &set, DBC_NORMAL_SEARCH);
+    *count = dbiIndexSetCount(set);
+    dbiIndexSetFree(set);
+    return rc;
+}
+
 rpmRC idxdbPut(dbiIndex dbi, rpmTagVal rpmtag, unsigned int hdrNum, Header h)
 {
     return dbi->dbi_rpmdb->db_ops->idxdbPut(dbi, rpmtag, hdrNum, h);
 }
 
+int idxdbCanPutOne(dbiIndex dbi)
+{
+    return (dbi->dbi_rpmdb->db_ops->idxdbPutOne != NULL);
+}
+
+rpmRC idxdbPutOne(dbiIndex dbi, dbiCursor dbc, const char *keyp, size_t keylen, dbiIndexItem rec)
+{
+    return dbi->dbi_rpmdb->db_ops->idxdbPutOne(dbi, dbc, keyp, keylen, rec);
+}
+
 rpmRC idxdbDel(dbiIndex dbi, rpmTagVal rpmtag, unsigned int hdrNum, Header h)
 {
     return dbi->dbi_rpmdb->db_ops->idxdbDel(dbi, rpmtag, hdrNum, h);
 }
 
+int idxdbCanDelOne(dbiIndex dbi)
+{
+    return (dbi->dbi_rpmdb->db_ops->idxdbDelOne != NULL);
+}
+
+rpmRC idxdbDelOne(dbiIndex dbi, dbiCursor dbc, const char *keyp, size_t keylen, dbiIndexItem rec)
+{
+    return dbi->dbi_rpmdb->db_ops->idxdbDelOne(dbi, dbc, keyp, keylen, rec);
+}
+
+int idxdbCanDelPkg(dbiIndex dbi)
+{
+    return (dbi->dbi_rpmdb->db_ops->idxdbDelPkg != NULL);
+}
+
+rpmRC idxdbDelPkg(dbiIndex dbi, unsigned int hdrNum)
+{
+    return dbi->dbi_rpmdb->db_ops->idxdbDelPkg(dbi, hdrNum);
+}
+
 const void * idxdbKey(dbiIndex dbi, dbiCursor dbc, unsigned int *keylen)
 {
     return dbi->dbi_rpmdb->db_ops->idxdbKey(dbi, dbc, keylen);
@@ -20,7 +20,10 @@ typedef enum dbCtrlOp_e {
     DB_CTRL_UNLOCK_RO		= 2,
     DB_CTRL_LOCK_RW		= 3,
     DB_CTRL_UNLOCK_RW		= 4,
-    DB_CTRL_INDEXSYNC		= 5
+    DB_CTRL_INDEXSYNC		= 5,
+    DB_CTRL_COMPACT		= 6,
+    DB_CTRL_SNAPSHOT		= 7,
+    DB_CTRL_UNSNAPSHOT		= 8
 } dbCtrlOp;
 
 typedef struct dbiIndex_s * dbiIndex;
@@ -31,6 +34,7 @@ struct dbConfig_s {
 };
 
 struct rpmdbOps_s;
+struct iovec;
 
 /** \ingroup rpmdb
  * Describes the collection of index databases used by rpm.
@@ -62,6 +66,27 @@ struct rpmdb_s {
     struct rpmop_s db_getops;
     struct rpmop_s db_putops;
     struct rpmop_s db_delops;
+    struct rpmop_s db_hdrhitops;
+    struct rpmop_s db_hdrmissops;
+
+    struct hdrCache_s * db_hdrcache; /*!< Recently imported headers */
+    char * db_shmdir;		/*!< Shared header cache directory */
+    struct hdrShm_s * db_hdrshm; /*!< Mapped shared header cache */
+    int db_usetrigidx;		/*!< Keep a persistent trigger index? */
+    int db_trigchanged;		/*!< Database changed since index loaded? */
+    struct trigIndex_s * db_trigidx; /*!< Trigger index */
+    int db_usefileflt;		/*!< Paths a lookup builds a file filter at */
+    int db_filefltchecked;	/*!< Looked for a stored file filter? */
+    struct fileFilter_s * db_fileflt; /*!< Basename filter */
+    int db_usepkglist;		/*!< Keep a persistent package list? */
+    int db_pkglistchecked;	/*!< Looked for a stored package list? */
+    int db_pkglistchanged;	/*!< Database changed since list loaded? */
+    struct rpmdbPkgList_s * db_pkglist; /*!< Package list */
+    int db_usepool;		/*!< Share a string pool for our headers? */
+    rpmstrPool db_pool;		/*!< Strings of file and dependency sets */
+
+    struct idxJournal_s ** db_journals; /*!< Deferred index updates */
+    int		db_snapshots;	/*!< Iterators reading from a snapshot */
 
     int nrefs;			/*!< Reference count. */
 };
@@ -76,6 +101,8 @@ enum dbiFlags_e {
     DBI_NONE		= 0,
     DBI_CREATED		= (1 << 0),
     DBI_RDONLY		= (1 << 1),
+    DBI_BLOBSUMS	= (1 << 2),
+    DBI_CLUSTERED	= (1 << 3),
 };
 
 enum dbcFlags_e {
@@ -116,6 +143,9 @@ union _dbswap {
 typedef rpmRC (*idxfunc)(dbiIndex dbi, dbiCursor dbc,
 			const char *keyp, size_t keylen, dbiIndexItem rec);
 
+typedef rpmRC (*keyfunc)(void *data, const char *keyp, size_t keylen,
+			dbiIndexItem rec);
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -124,6 +154,11 @@ RPM_GNUC_INTERNAL
 rpmRC tag2index(dbiIndex dbi, rpmTagVal rpmtag, unsigned int hdrNum, Header h,
 		idxfunc idxupdate);
 
+/* Pass all index keys of rpmtag in header h to keyupdate() */
+RPM_GNUC_INTERNAL
+rpmRC tag2keys(const char *dbiname, rpmTagVal rpmtag, unsigned int hdrNum,
+		Header h, keyfunc keyupdate, void *keydata);
+
 RPM_GNUC_INTERNAL
 /* Globally enable/disable fsync in the backend */
 void dbSetFSync(rpmdb rdb, int enable);
@@ -217,6 +252,10 @@ dbiCursor dbiCursorFree(dbiIndex dbi, dbiCursor dbc);
 RPM_GNUC_INTERNAL
 rpmRC pkgdbPut(dbiIndex dbi, dbiCursor dbc,  unsigned int *hdrNum,
                unsigned char *hdrBlob, unsigned int hdrLen);
+/* Same as pkgdbPut() with the blob in segments, from headerExportIov() */
+RPM_GNUC_INTERNAL
+rpmRC pkgdbPutIov(dbiIndex dbi, dbiCursor dbc, unsigned int *hdrNum,
+               const struct iovec *iov, int niov, unsigned int hdrLen);
 RPM_GNUC_INTERNAL
 rpmRC pkgdbDel(dbiIndex dbi, dbiCursor dbc,  unsigned int hdrNum);
 RPM_GNUC_INTERNAL
@@ -225,21 +264,66 @@ rpmRC pkgdbGet(dbiIndex dbi, dbiCursor dbc, unsigned int hdrNum,
 RPM_GNUC_INTERNAL
 unsigned int pkgdbKey(dbiIndex dbi, dbiCursor dbc);
 
+/* Did the blob last returned on the cursor match the checksum the backend
+ * stored along with it? Such a blob is exactly what rpm wrote. */
+RPM_GNUC_INTERNAL
+int pkgdbTrusted(dbiIndex dbi, dbiCursor dbc);
+
 RPM_GNUC_INTERNAL
 rpmRC idxdbGet(dbiIndex dbi, dbiCursor dbc, const char *keyp, size_t keylen,
                dbiIndexSet *set, int curFlags);
+
+/* Look up nkeys exact keys at once, sets[i] is left NULL when not found */
+RPM_GNUC_INTERNAL
+rpmRC idxdbGetBatch(dbiIndex dbi, dbiCursor dbc, const char **keys,
+               const size_t *keylens, int nkeys, dbiIndexSet *sets);
+
+/* Same as idxdbGetBatch() for unique keys in index order (byte-wise, a
+ * prefix first), done in a single ordered pass if the backend can */
+RPM_GNUC_INTERNAL
+rpmRC idxdbGetSorted(dbiIndex dbi, dbiCursor dbc, const char **keys,
+               const size_t *keylens, int nkeys, dbiIndexSet *sets);
+
+/* Count the items of an exact key without fetching them */
+RPM_GNUC_INTERNAL
+rpmRC idxdbCount(dbiIndex dbi, dbiCursor dbc, const char *keyp, size_t keylen,
+		 unsigned int *count);
 RPM_GNUC_INTERNAL
 rpmRC idxdbPut(dbiIndex dbi, rpmTagVal rpmtag, unsigned int hdrNum, Header h);
 
+/* Add a single precomputed key, only for backends supporting bulk loads */
+RPM_GNUC_INTERNAL
+int idxdbCanPutOne(dbiIndex dbi);
+
+RPM_GNUC_INTERNAL
+rpmRC idxdbPutOne(dbiIndex dbi, dbiCursor dbc, const char *keyp, size_t keylen,
+		  dbiIndexItem rec);
+
 RPM_GNUC_INTERNAL
 rpmRC idxdbDel(dbiIndex dbi, rpmTagVal rpmtag, unsigned int hdrNum, Header h);
 
+/* Remove a single precomputed key, only for backends supporting deferral */
+RPM_GNUC_INTERNAL
+int idxdbCanDelOne(dbiIndex dbi);
+
+RPM_GNUC_INTERNAL
+rpmRC idxdbDelOne(dbiIndex dbi, dbiCursor dbc, const char *keyp, size_t keylen,
+		  dbiIndexItem rec);
+
+/* Remove all items of a package without its header, if the backend can */
+RPM_GNUC_INTERNAL
+int idxdbCanDelPkg(dbiIndex dbi);
+
+RPM_GNUC_INTERNAL
+rpmRC idxdbDelPkg(dbiIndex dbi, unsigned int hdrNum);
+
 RPM_GNUC_INTERNAL
 const void * idxdbKey(dbiIndex dbi, dbiCursor dbc, unsigned int *keylen);
 
 struct rpmdbOps_s {
     const char *name; /* backend name */
     const char *path; /* main database name */
+    int idxrebuild; /* are indexes not synced at a crash rebuilt on open? */
 
     int (*open)(rpmdb rdb, rpmDbiTagVal rpmtag, dbiIndex * dbip, int flags);
     int (*close)(dbiIndex dbi, unsigned int flags);
@@ -252,12 +336,20 @@ struct rpmdbOps_s {
 
     rpmRC (*pkgdbGet)(dbiIndex dbi, dbiCursor dbc, unsigned int hdrNum, unsigned char **hdrBlob, unsigned int *hdrLen);
     rpmRC (*pkgdbPut)(dbiIndex dbi, dbiCursor dbc, unsigned int *hdrNum, unsigned char *hdrBlob, unsigned int hdrLen);
+    rpmRC (*pkgdbPutIov)(dbiIndex dbi, dbiCursor dbc, unsigned int *hdrNum, const struct iovec *iov, int niov, unsigned int hdrLen);
     rpmRC (*pkgdbDel)(dbiIndex dbi, dbiCursor dbc,  unsigned int hdrNum);
     unsigned int (*pkgdbKey)(dbiIndex dbi, dbiCursor dbc);
+    int (*pkgdbTrusted)(dbiIndex dbi, dbiCursor dbc);
 
     rpmRC (*idxdbGet)(dbiIndex dbi, dbiCursor dbc, const char *keyp, size_t keylen, dbiIndexSet *set, int curFlags);
+    rpmRC (*idxdbGetBatch)(dbiIndex dbi, dbiCursor dbc, const char **keys, const size_t *keylens, int nkeys, dbiIndexSet *sets);
+    rpmRC (*idxdbGetSorted)(dbiIndex dbi, dbiCursor dbc, const char **keys, const size_t *keylens, int nkeys, dbiIndexSet *sets);
+    rpmRC (*idxdbCount)(dbiIndex dbi, dbiCursor dbc, const char *keyp, size_t keylen, unsigned int *count);
     rpmRC (*idxdbPut)(dbiIndex dbi, rpmTagVal rpmtag, unsigned int hdrNum, Header h);
+    rpmRC (*idxdbPutOne)(dbiIndex dbi, dbiCursor dbc, const char *keyp, size_t keylen, dbiIndexItem rec);
     rpmRC (*idxdbDel)(dbiIndex dbi, rpmTagVal rpmtag, unsigned int hdrNum, Header h);
+    rpmRC (*idxdbDelOne)(dbiIndex dbi, dbiCursor dbc, const char *keyp, size_t keylen, dbiIndexItem rec);
+    rpmRC (*idxdbDelPkg)(dbiIndex dbi, unsigned int hdrNum);
     const void * (*idxdbKey)(dbiIndex dbi, dbiCursor dbc, unsigned int *keylen);
 };
 
@@ -3,10 +3,12 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <fcntl.h>
+#include <sys/uio.h>
 
 #include "lib/rpmdb_internal.h"
 #include <rpm/rpmstring.h>
 #include <rpm/rpmlog.h>
+#include <rpm/rpmmacro.h>
 
 #include "lib/backend/ndb/rpmpkg.h"
 #include "lib/backend/ndb/rpmxdb.h"
@@ -189,11 +191,16 @@ static int ndb_Open(rpmdb rdb, rpmDbiTagVal rpmtag, dbiIndex * dbip, int flags)
 	    dbi->dbi_flags |= DBI_CREATED;
 	}
 	rpmlog(RPMLOG_DEBUG, "opening  db index       %s tag=%d\n", dbiName(dbi), rpmtag);
-	if (rpmidxOpenXdb(&idxdb, rdb->db_pkgs->dbi_db, ndbenv->xdb, rpmtag, oflags)) {
+	if (rpmidxOpenXdb(&idxdb, rdb->db_pkgs->dbi_db, ndbenv->xdb, rpmtag, oflags,
+			  rpmExpandNumeric("%{?_ndb_index_version}"))) {
 	    perror("rpmidxOpenXdb");
 	    ndb_Close(dbi, 0);
 	    return 1;
 	}
+	if (rpmMacroIsDefined(NULL, "_ndb_index_growth")) {
+	    int growth = rpmExpandNumeric("%{_ndb_index_growth}");
+	    rpmidxSetGrowth(idxdb, growth > 0 ? growth : 0);
+	}
 	dbi->dbi_db = idxdb;
     }
 
@@ -247,6 +254,20 @@ static int indexSync(rpmpkgdb pkgdb, rpmxdb xdb)
     return rc;
 }
 
+/* blob moves per locked compaction step */
+#define PKGDB_COMPACT_STEP	16
+
+/* pack the package blobs in small steps, so that readers get a turn */
+static int ndb_compact(rpmpkgdb pkgdb)
+{
+    int done = 0;
+    while (!done) {
+	if (rpmpkgCompact(pkgdb, PKGDB_COMPACT_STEP, &done))
+	    return 1;
+    }
+    return 0;
+}
+
 static int ndb_Ctrl(rpmdb rdb, dbCtrlOp ctrl)
 {
     struct ndbEnv_s *ndbenv = rdb->db_dbenv;
@@ -272,6 +293,10 @@ static int ndb_Ctrl(rpmdb rdb, dbCtrlOp ctrl)
 	if (!ndbenv)
 	    return 1;
 	return indexSync(ndbenv->pkgdb, ndbenv->xdb);
+    case DB_CTRL_COMPACT:
+	if (!ndbenv)
+	    return 1;
+	return ndb_compact(ndbenv->pkgdb);
     default:
 	break;
     }
@@ -309,7 +334,7 @@ static void setdata(dbiCursor dbc,  unsigned int hdrNum, unsigned char *hdrBlob,
     ndbenv->datalen = hdrLen;
 }
 
-static rpmRC ndb_pkgdbPut(dbiIndex dbi, dbiCursor dbc,  unsigned int *hdrNum, unsigned char *hdrBlob, unsigned int hdrLen)
+static rpmRC ndb_pkgdbPutIov(dbiIndex dbi, dbiCursor dbc, unsigned int *hdrNum, const struct iovec *iov, int niov, unsigned int hdrLen)
 {
     struct ndbEnv_s *ndbenv = dbc->dbi->dbi_rpmdb->db_dbenv;
     unsigned int hnum = *hdrNum;
@@ -322,7 +347,7 @@ static rpmRC ndb_pkgdbPut(dbiIndex dbi, dbiCursor dbc,  unsigned int *hdrNum, un
     }
 
     if (!rc)
-	rc = rpmpkgPut(dbc->dbi->dbi_db, hnum, hdrBlob, hdrLen);
+	rc = rpmpkgPutIov(dbc->dbi->dbi_db, hnum, iov, niov, hdrLen);
 
     if (!rc) {
 	dbc->hdrNum = hnum;
@@ -333,6 +358,12 @@ static rpmRC ndb_pkgdbPut(dbiIndex dbi, dbiCursor dbc,  unsigned int *hdrNum, un
     return rc;
 }
 
+static rpmRC ndb_pkgdbPut(dbiIndex dbi, dbiCursor dbc,  unsigned int *hdrNum, unsigned char *hdrBlob, unsigned int hdrLen)
+{
+    struct iovec iov = { .iov_base = hdrBlob, .iov_len = hdrLen };
+    return ndb_pkgdbPutIov(dbi, dbc, hdrNum, &iov, 1, hdrLen);
+}
+
 static rpmRC ndb_pkgdbDel(dbiIndex dbi, dbiCursor dbc,  unsigned int hdrNum)
 {
     struct ndbEnv_s *ndbenv = dbc->dbi->dbi_rpmdb->db_dbenv;
@@ -399,6 +430,12 @@ static unsigned int ndb_pkgdbKey(dbiIndex dbi, dbiCursor dbc)
     return dbc->hdrNum;
 }
 
+/* Blobs are only ever returned after their adler32 checked out */
+static int ndb_pkgdbTrusted(dbiIndex dbi, dbiCursor dbc)
+{
+    return (dbc->hdrNum != 0);
+}
+
 
 static void addtoset(dbiIndexSet *set, unsigned int *pkglist, unsigned int pkglistn)
 {
@@ -506,6 +543,28 @@ static rpmRC ndb_idxdbGet(dbiIndex dbi, dbiCursor dbc, const char *keyp, size_t
     return rc;
 }
 
+static rpmRC ndb_idxdbGetBatch(dbiIndex dbi, dbiCursor dbc, const char **keys, const size_t *keylens, int nkeys, dbiIndexSet *sets)
+{
+    unsigned int **pkglists = xcalloc(nkeys, sizeof(*pkglists));
+    unsigned int *pkglistns = xcalloc(nkeys, sizeof(*pkglistns));
+    unsigned int *keyls = xmalloc(nkeys * sizeof(*keyls));
+    int i, rc;
+
+    for (i = 0; i < nkeys; i++)
+	keyls[i] = keylens[i];
+    rc = rpmidxGetBatch(dbc->dbi->dbi_db, (const unsigned char **)keys, keyls, nkeys, pkglists, pkglistns);
+    for (i = 0; i < nkeys; i++) {
+	if (!rc && pkglistns[i])
+	    addtoset(&sets[i], pkglists[i], pkglistns[i]);
+	else
+	    free(pkglists[i]);
+    }
+    free(keyls);
+    free(pkglistns);
+    free(pkglists);
+    return rc;
+}
+
 static rpmRC ndb_idxdbPutOne(dbiIndex dbi, dbiCursor dbc, const char *keyp, size_t keylen, dbiIndexItem rec)
 {
     return rpmidxPut(dbc->dbi->dbi_db, (const unsigned char *)keyp, keylen, rec->hdrNum, rec->tagNum);
@@ -538,6 +597,7 @@ static const void * ndb_idxdbKey(dbiIndex dbi, dbiCursor dbc, unsigned int *keyl
 struct rpmdbOps_s ndb_dbops = {
     .name	= "ndb",
     .path	= "Packages.db",
+    .idxrebuild	= 1,
 
     .open	= ndb_Open,
     .close	= ndb_Close,
@@ -549,13 +609,18 @@ struct rpmdbOps_s ndb_dbops = {
     .cursorFree	= ndb_CursorFree,
 
     .pkgdbPut	= ndb_pkgdbPut,
+    .pkgdbPutIov	= ndb_pkgdbPutIov,
     .pkgdbDel	= ndb_pkgdbDel,
     .pkgdbGet	= ndb_pkgdbGet,
     .pkgdbKey	= ndb_pkgdbKey,
+    .pkgdbTrusted	= ndb_pkgdbTrusted,
 
     .idxdbGet	= ndb_idxdbGet,
+    .idxdbGetBatch	= ndb_idxdbGetBatch,
     .idxdbPut	= ndb_idxdbPut,
+    .idxdbPutOne	= ndb_idxdbPutOne,
     .idxdbDel	= ndb_idxdbDel,
+    .idxdbDelOne	= ndb_idxdbDelOne,
     .idxdbKey	= ndb_idxdbKey
 };
 
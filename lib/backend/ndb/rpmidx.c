@@ -12,13 +12,16 @@
 #include <string.h>
 #include <stdlib.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <errno.h>
+#include <stdint.h>
 
 #ifdef __APPLE__
 #include <machine/endian.h>
 #include <libkern/OSByteOrder.h>
 #define htole32(x) OSSwapHostToLittleInt32(x)
 #define le32toh(x) OSSwapLittleToHostInt32(x)
+#define le64toh(x) OSSwapLittleToHostInt64(x)
 #else
 #include <endian.h>
 #endif /* __APPLE__ */
@@ -81,8 +84,12 @@ typedef struct rpmidxdb_s {
     unsigned int xdbtag;
     unsigned int xdbid;
 
+    unsigned int version;		/* IDXDB_VERSION* of the table */
+    unsigned int newversion;		/* version of tables we create */
+
     unsigned char *head_mapped;
     unsigned char *slot_mapped;
+    unsigned char *fp_mapped;		/* key fingerprints (or NULL) */
     unsigned char *key_mapped;
     unsigned int key_size;
     unsigned int file_size;
@@ -99,6 +106,19 @@ typedef struct rpmidxdb_s {
     unsigned int xmask;
 
     unsigned int pagesize;
+    unsigned int growth;		/* key space growth in percent */
+
+    /* statistics, see rpmidxStats */
+    unsigned int nremaps;
+    unsigned int ngrowths;
+    unsigned int nlookups;
+    long minflt;			/* process page faults at open */
+    long majflt;
+
+    /* incremental rebuild in progress (or NULL), see rpmidxCheck */
+    struct rpmidxdb_s *mig;
+    unsigned int mig_next;		/* next slot to copy */
+    unsigned int mig_generation;	/* generation after our last change */
 } * rpmidxdb;
 
 static inline unsigned int le2h(unsigned char *p) 
@@ -130,6 +150,8 @@ static inline void h2lea(unsigned int x, unsigned char *p)
 
 #define IDXDB_MAGIC     ('R' | 'p' << 8 | 'm' << 16 | 'I' << 24)
 #define IDXDB_VERSION	0
+/* 64bit key hash, the upper half stored as fingerprint of every slot */
+#define IDXDB_VERSION_FP	1
 
 #define IDXDB_OFFSET_MAGIC	0
 #define IDXDB_OFFSET_VERSION	4
@@ -143,7 +165,13 @@ static inline void h2lea(unsigned int x, unsigned char *p)
 #define IDXDB_OFFSET_OBSOLETE	36
 
 #define IDXDB_SLOT_OFFSET	64
+/* per slot: key offset, data, overflow data (and fingerprint) */
+#define IDXDB_SLOT_SIZE(idxdb)	((idxdb)->version == IDXDB_VERSION_FP ? 16 : 12)
 #define IDXDB_KEY_CHUNKSIZE	4096
+#define IDXDB_KEY_GROWTH	25	/* default, percent of the key space */
+
+/* slots copied per change during an incremental rebuild */
+#define IDXDB_MIGRATE_STEP	64
 
 /* XDB subids */
 
@@ -155,17 +183,20 @@ static void set_mapped(rpmidxdb idxdb, unsigned char *addr, unsigned int size)
     if (addr) {
 	idxdb->head_mapped = addr;
 	idxdb->slot_mapped = addr + IDXDB_SLOT_OFFSET; 
-	idxdb->key_mapped = addr + IDXDB_SLOT_OFFSET + idxdb->nslots * 12;
-	idxdb->key_size = size - (IDXDB_SLOT_OFFSET + idxdb->nslots * 12);
+	idxdb->fp_mapped = idxdb->version == IDXDB_VERSION_FP ? idxdb->slot_mapped + idxdb->nslots * 12 : 0;
+	idxdb->key_mapped = addr + IDXDB_SLOT_OFFSET + idxdb->nslots * IDXDB_SLOT_SIZE(idxdb);
+	idxdb->key_size = size - (IDXDB_SLOT_OFFSET + idxdb->nslots * IDXDB_SLOT_SIZE(idxdb));
 	idxdb->file_size = size;
     } else {
 	idxdb->head_mapped = idxdb->slot_mapped = idxdb->key_mapped = 0;
+	idxdb->fp_mapped = 0;
 	idxdb->file_size = idxdb->key_size = 0;
     }
 }
 
 /* XDB callbacks */
 static void mapcb(rpmxdb xdb, void *data, void *newaddr, size_t newsize) {
+    ((rpmidxdb)data)->nremaps++;
     set_mapped((rpmidxdb)data, newaddr, (unsigned int)newsize);
 }
 
@@ -177,9 +208,22 @@ static int rpmidxMap(rpmidxdb idxdb)
 	rpmxdbUnmapBlob(idxdb->xdb, idxdb->xdbid);
 	return RPMRC_FAIL;
     }
+    /* lookups hash all over the slots, readahead only hurts */
+    rpmxdbAdviseBlob(idxdb->xdb, idxdb->xdbid, RPMXDB_ADVISE_RANDOM);
     return RPMRC_OK;
 }
 
+/* full scans read the whole mapping, ask for it in one go */
+static void rpmidxScanBegin(rpmidxdb idxdb)
+{
+    rpmxdbAdviseBlob(idxdb->xdb, idxdb->xdbid, RPMXDB_ADVISE_WILLNEED);
+}
+
+static void rpmidxScanEnd(rpmidxdb idxdb)
+{
+    rpmxdbAdviseBlob(idxdb->xdb, idxdb->xdbid, RPMXDB_ADVISE_RANDOM);
+}
+
 static void rpmidxUnmap(rpmidxdb idxdb)
 {
     if (!idxdb->head_mapped)
@@ -205,12 +249,13 @@ static int rpmidxReadHeader(rpmidxdb idxdb)
 	return RPMRC_FAIL;
     }
     version = le2ha(idxdb->head_mapped + IDXDB_OFFSET_VERSION);
-    if (version != IDXDB_VERSION) {
+    if (version != IDXDB_VERSION && version != IDXDB_VERSION_FP) {
 	rpmlog(RPMLOG_ERR, _("rpmidx: Version mismatch. Expected version: %u. "
-	    "Found version: %u\n"), IDXDB_VERSION, version);
+	    "Found version: %u\n"), IDXDB_VERSION_FP, version);
 	rpmidxUnmap(idxdb);
 	return RPMRC_FAIL;
     }
+    idxdb->version = version;
     idxdb->generation = le2ha(idxdb->head_mapped + IDXDB_OFFSET_GENERATION);
     idxdb->nslots     = le2ha(idxdb->head_mapped + IDXDB_OFFSET_NSLOTS);
     idxdb->usedslots  = le2ha(idxdb->head_mapped + IDXDB_OFFSET_USEDSLOTS);
@@ -222,12 +267,13 @@ static int rpmidxReadHeader(rpmidxdb idxdb)
     idxdb->hmask = idxdb->nslots - 1;
 
     /* now that we know nslots we can split between slots and keys */
-    if (idxdb->file_size <= IDXDB_SLOT_OFFSET + idxdb->nslots * 12) {
+    if (idxdb->file_size <= IDXDB_SLOT_OFFSET + idxdb->nslots * IDXDB_SLOT_SIZE(idxdb)) {
 	rpmidxUnmap(idxdb);	/* too small, somthing is wrong */
 	return RPMRC_FAIL;
     }
-    idxdb->key_mapped = idxdb->slot_mapped + idxdb->nslots * 12;
-    idxdb->key_size = idxdb->file_size - (IDXDB_SLOT_OFFSET + idxdb->nslots * 12);
+    idxdb->fp_mapped = idxdb->version == IDXDB_VERSION_FP ? idxdb->slot_mapped + idxdb->nslots * 12 : 0;
+    idxdb->key_mapped = idxdb->slot_mapped + idxdb->nslots * IDXDB_SLOT_SIZE(idxdb);
+    idxdb->key_size = idxdb->file_size - (IDXDB_SLOT_OFFSET + idxdb->nslots * IDXDB_SLOT_SIZE(idxdb));
     return RPMRC_OK;
 }
 
@@ -236,7 +282,7 @@ static int rpmidxWriteHeader(rpmidxdb idxdb)
     if (!idxdb->head_mapped)
 	return RPMRC_FAIL;
     h2lea(IDXDB_MAGIC,       idxdb->head_mapped + IDXDB_OFFSET_MAGIC);
-    h2lea(IDXDB_VERSION,     idxdb->head_mapped + IDXDB_OFFSET_VERSION);
+    h2lea(idxdb->version,    idxdb->head_mapped + IDXDB_OFFSET_VERSION);
     h2lea(idxdb->generation, idxdb->head_mapped + IDXDB_OFFSET_GENERATION);
     h2lea(idxdb->nslots,     idxdb->head_mapped + IDXDB_OFFSET_NSLOTS);
     h2lea(idxdb->usedslots,  idxdb->head_mapped + IDXDB_OFFSET_USEDSLOTS);
@@ -307,6 +353,70 @@ static unsigned int murmurhash(const unsigned char *s, unsigned int l)
     return h;
 }
 
+#define XXH_P1 0x9e3779b185ebca87ULL
+#define XXH_P2 0xc2b2ae3d27d4eb4fULL
+#define XXH_P3 0x165667b19e3779f9ULL
+#define XXH_P4 0x85ebca77c2b2ae63ULL
+#define XXH_P5 0x27d4eb2f165667c5ULL
+
+#define ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+/* xxh64 style hash, eight bytes per round */
+static uint64_t fasthash(const unsigned char *s, unsigned int l)
+{
+    uint64_t h = XXH_P5 + l;
+    uint64_t k;
+    uint32_t k32;
+
+    while (l >= 8) {
+	memcpy(&k, s, 8);
+	k = le64toh(k) * XXH_P2;
+	h ^= ROTL64(k, 31) * XXH_P1;
+	h = ROTL64(h, 27) * XXH_P1 + XXH_P4;
+	s += 8;
+	l -= 8;
+    }
+    if (l >= 4) {
+	memcpy(&k32, s, 4);
+	h ^= (uint64_t)le32toh(k32) * XXH_P1;
+	h = ROTL64(h, 23) * XXH_P2 + XXH_P3;
+	s += 4;
+	l -= 4;
+    }
+    while (l--) {
+	h ^= *s++ * XXH_P5;
+	h = ROTL64(h, 11) * XXH_P1;
+    }
+    h ^= h >> 33;
+    h *= XXH_P2;
+    h ^= h >> 29;
+    h *= XXH_P3;
+    h ^= h >> 32;
+    return h;
+}
+
+/* hash a key the way the table does. The fingerprint is independent of
+ * the returned bits used for the slot position, zero if the table
+ * doesn't store them */
+static inline unsigned int keyhash(rpmidxdb idxdb, const unsigned char *key, unsigned int keyl, unsigned int *fpp)
+{
+    if (idxdb->version == IDXDB_VERSION_FP) {
+	uint64_t h = fasthash(key, keyl);
+	if (fpp)
+	    *fpp = (unsigned int)(h >> 32);
+	return (unsigned int)h;
+    }
+    if (fpp)
+	*fpp = 0;
+    return murmurhash(key, keyl);
+}
+
+/* can the key in slot h have fingerprint fp? */
+static inline int fpmatch(rpmidxdb idxdb, unsigned int h, unsigned int fp)
+{
+    return !idxdb->fp_mapped || le2ha(idxdb->fp_mapped + 4 * h) == fp;
+}
+
 static inline unsigned int decodekeyl(unsigned char *p, unsigned int *hl)
 {
     if (*p != 255) {
@@ -369,11 +479,25 @@ static inline int equalkey(rpmidxdb idxdb, unsigned int off, const unsigned char
     return 1;
 }
 
+/* grow the key space by a chunk or by growth percent of its size,
+ * whichever is more, so that filling a big index doesn't resize (and
+ * remap or move) the blob for every few keys */
 static int addkeypage(rpmidxdb idxdb) {
     unsigned int addsize = idxdb->pagesize > IDXDB_KEY_CHUNKSIZE ? idxdb->pagesize : IDXDB_KEY_CHUNKSIZE;
-
+    unsigned long long geomsize = (unsigned long long)idxdb->key_size * idxdb->growth / 100;
+
+    if (geomsize > addsize) {
+	/* keep the key offsets clear of the hash bits in the slots */
+	unsigned long long maxsize = ~idxdb->xmask;
+	if (idxdb->key_size + geomsize > maxsize)
+	    geomsize = maxsize > idxdb->key_size ? maxsize - idxdb->key_size : 0;
+	geomsize &= ~(unsigned long long)(idxdb->pagesize - 1);
+	if (geomsize > addsize)
+	    addsize = geomsize;
+    }
     if (rpmxdbResizeBlob(idxdb->xdb, idxdb->xdbid, idxdb->file_size + addsize))
 	return RPMRC_FAIL;
+    idxdb->ngrowths++;
     return RPMRC_OK;
 }
 
@@ -431,7 +555,7 @@ static inline unsigned int decodedata(rpmidxdb idxdb, unsigned int data, unsigne
 /*** Rebuild helpers ***/
 
 /* copy a single data entry into the new database */
-static inline void copyentry(rpmidxdb idxdb, unsigned int keyh, unsigned int newkeyoff, unsigned int data, unsigned int ovldata)
+static inline void copyentry(rpmidxdb idxdb, unsigned int keyh, unsigned int fp, unsigned int newkeyoff, unsigned int data, unsigned int ovldata)
 {
     unsigned int h, hh = 7;
     unsigned char *ent;
@@ -450,6 +574,8 @@ static inline void copyentry(rpmidxdb idxdb, unsigned int keyh, unsigned int new
     h2lea(data, ent + 4);
     if (ovldata)
 	h2lea(ovldata, idxdb->slot_mapped + idxdb->nslots * 8 + 4 * h);
+    if (idxdb->fp_mapped)
+	h2lea(fp, idxdb->fp_mapped + 4 * h);
     idxdb->usedslots++;
 }
 
@@ -457,11 +583,13 @@ static inline void copyentry(rpmidxdb idxdb, unsigned int keyh, unsigned int new
 static inline void copykeyentries(const unsigned char *key, unsigned int keyl, rpmidxdb idxdb, unsigned int oldkeyoff, rpmidxdb nidxdb, unsigned int newkeyoff, unsigned char *done)
 {
     unsigned int h, hh;
-    unsigned int keyh = murmurhash(key, keyl);
+    unsigned int keyh = keyhash(idxdb, key, keyl, 0);
+    unsigned int nfp, nkeyh = keyhash(nidxdb, key, keyl, &nfp);
     unsigned int hmask = idxdb->hmask;
 
+    /* the tables may differ in version, and so in hashing */
     oldkeyoff |= keyh & idxdb->xmask;
-    newkeyoff |= keyh & nidxdb->xmask;
+    newkeyoff |= nkeyh & nidxdb->xmask;
     for (h = keyh & hmask, hh = 7; ; h = (h + hh++) & hmask) {
 	unsigned char *ent = idxdb->slot_mapped + 8 * h;
 	unsigned int data, ovldata;
@@ -472,31 +600,23 @@ static inline void copykeyentries(const unsigned char *key, unsigned int keyl, r
 	    continue;
 	data = le2ha(ent + 4);
 	ovldata = (data & 0x80000000) ? le2ha(idxdb->slot_mapped + idxdb->nslots * 8 + 4 * h) : 0;
-	copyentry(nidxdb, keyh, newkeyoff, data, ovldata);
+	copyentry(nidxdb, nkeyh, nfp, newkeyoff, data, ovldata);
 	done[h >> 3] |= 1 << (h & 7);
     }
 }
 
-static int rpmidxRebuildInternal(rpmidxdb idxdb)
+/* create and map an empty table sized for nlive entries */
+static int rpmidxCreateTable(rpmidxdb idxdb, rpmidxdb nidxdb, unsigned int nlive)
 {
-    struct rpmidxdb_s nidxdb_s, *nidxdb;
-    unsigned int i, nslots;
-    unsigned int keyend, keyoff, xmask;
-    unsigned char *done;
-    unsigned char *ent;
-    unsigned int file_size, key_size, xfile_size;
+    unsigned int nslots = nlive;
+    unsigned int xmask;
+    unsigned int file_size, key_size;
 
-    nidxdb = &nidxdb_s;
     memset(nidxdb, 0, sizeof(*nidxdb));
     nidxdb->pagesize = rpmxdbPagesize(idxdb->xdb);
+    nidxdb->growth = idxdb->growth;
+    nidxdb->version = nidxdb->newversion = idxdb->newversion;
 
-    /* calculate nslots the hard way, don't trust usedslots */
-    nslots = 0;
-    for (i = 0, ent = idxdb->slot_mapped; i < idxdb->nslots; i++, ent += 8) {
-	unsigned int x = le2ha(ent);
-	if (x != 0 && x != -1)
-	    nslots++;
-    }
     if (nslots < 256)
 	nslots = 256;
     while (nslots & (nslots - 1))
@@ -510,7 +630,7 @@ static int rpmidxRebuildInternal(rpmidxdb idxdb)
     key_size = idxdb->keyend;
     if (key_size < IDXDB_KEY_CHUNKSIZE)
 	key_size = IDXDB_KEY_CHUNKSIZE;
-    file_size = IDXDB_SLOT_OFFSET + nslots * 12 + key_size;
+    file_size = IDXDB_SLOT_OFFSET + nslots * IDXDB_SLOT_SIZE(nidxdb) + key_size;
 
     /* round file size to multiple of the page size */
     if (file_size & (nidxdb->pagesize - 1)) {
@@ -537,6 +657,58 @@ static int rpmidxRebuildInternal(rpmidxdb idxdb)
     if (rpmidxMap(nidxdb)) {
 	return RPMRC_FAIL;
     }
+    return RPMRC_OK;
+}
+
+/* replace the index with a completely filled new table */
+static int rpmidxSwitchTable(rpmidxdb idxdb, rpmidxdb nidxdb)
+{
+    unsigned int file_size = nidxdb->file_size;
+    unsigned int key_size = nidxdb->key_size;
+    unsigned int xfile_size;
+
+    nidxdb->generation = idxdb->generation + 1;
+    rpmidxWriteHeader(nidxdb);
+    rpmidxUnmap(nidxdb);
+
+    /* shrink if we have allocated excessive key space */
+    xfile_size = file_size - key_size + nidxdb->keyend + IDXDB_KEY_CHUNKSIZE;
+    xfile_size = (xfile_size + nidxdb->pagesize - 1) & ~(nidxdb->pagesize - 1);
+    if (xfile_size < file_size)
+	rpmxdbResizeBlob(nidxdb->xdb, nidxdb->xdbid, xfile_size);
+
+    /* now switch over to new database */
+    rpmidxUnmap(idxdb);
+    if (rpmxdbRenameBlob(nidxdb->xdb, &nidxdb->xdbid, idxdb->xdbtag, IDXDB_XDB_SUBTAG))
+	return RPMRC_FAIL;
+    idxdb->xdbid = nidxdb->xdbid;
+    if (rpmidxReadHeader(idxdb))
+	return RPMRC_FAIL;
+    return RPMRC_OK;
+}
+
+static int rpmidxRebuildInternal(rpmidxdb idxdb)
+{
+    struct rpmidxdb_s nidxdb_s, *nidxdb;
+    unsigned int i, nslots;
+    unsigned int keyend, keyoff;
+    unsigned char *done;
+    unsigned char *ent;
+
+    nidxdb = &nidxdb_s;
+    rpmidxScanBegin(idxdb);
+
+    /* calculate nslots the hard way, don't trust usedslots */
+    nslots = 0;
+    for (i = 0, ent = idxdb->slot_mapped; i < idxdb->nslots; i++, ent += 8) {
+	unsigned int x = le2ha(ent);
+	if (x != 0 && x != -1)
+	    nslots++;
+    }
+    if (rpmidxCreateTable(idxdb, nidxdb, nslots)) {
+	rpmidxScanEnd(idxdb);
+	return RPMRC_FAIL;
+    }
 
     /* copy all entries */
     done = xcalloc(idxdb->nslots / 8 + 1, 1);
@@ -561,26 +733,106 @@ static int rpmidxRebuildInternal(rpmidxdb idxdb)
     }
     free(done);
     nidxdb->keyend = keyend;
-    nidxdb->generation = idxdb->generation + 1;
-    rpmidxWriteHeader(nidxdb);
-    rpmidxUnmap(nidxdb);
+    rpmidxScanEnd(idxdb);
+    return rpmidxSwitchTable(idxdb, nidxdb);
+}
 
-    /* shrink if we have allocated excessive key space */
-    xfile_size = file_size - key_size + keyend + IDXDB_KEY_CHUNKSIZE;
-    xfile_size = (xfile_size + nidxdb->pagesize - 1) & ~(nidxdb->pagesize - 1);
-    if (xfile_size < file_size)
-	rpmxdbResizeBlob(nidxdb->xdb, nidxdb->xdbid, xfile_size);
+static int rpmidxPutSlot(rpmidxdb idxdb, const unsigned char *key, unsigned int keyl, unsigned int pkgidx, unsigned int datidx, unsigned int *slotp);
 
-    /* now switch over to new database */
-    rpmidxUnmap(idxdb);
-    if (rpmxdbRenameBlob(nidxdb->xdb, &nidxdb->xdbid, idxdb->xdbtag, IDXDB_XDB_SUBTAG))
-	return RPMRC_FAIL;
-    idxdb->xdbid = nidxdb->xdbid;
-    if (rpmidxReadHeader(idxdb))
+/*** Incremental rebuild ***/
+
+/* Instead of stalling one change for a complete rebuild, the new table
+ * is filled in steps of IDXDB_MIGRATE_STEP old slots per change. The
+ * old table stays complete for readers until the switch. Changes to
+ * old slots that were already copied are repeated in the new table,
+ * later slots are picked up by the copying itself. */
+
+static void rpmidxMigrateAbort(rpmidxdb idxdb)
+{
+    if (idxdb->mig) {
+	rpmidxUnmap(idxdb->mig);
+	free(idxdb->mig);
+	idxdb->mig = 0;
+    }
+}
+
+static int rpmidxMigrateStart(rpmidxdb idxdb)
+{
+    rpmidxdb mig = xcalloc(1, sizeof(*mig));
+    unsigned int nlive = idxdb->usedslots;
+
+    if (idxdb->dummyslots < nlive)
+	nlive -= idxdb->dummyslots;
+    if (rpmidxCreateTable(idxdb, mig, nlive)) {
+	free(mig);
 	return RPMRC_FAIL;
+    }
+    mig->keyend = 1;
+    rpmidxWriteHeader(mig);
+    idxdb->mig = mig;
+    idxdb->mig_next = 0;
+    idxdb->mig_generation = idxdb->generation;
     return RPMRC_OK;
 }
 
+/* add an entry to the new table, unless that would need another rebuild */
+static int rpmidxMigratePut(rpmidxdb idxdb, const unsigned char *key, unsigned int keyl, unsigned int pkgidx, unsigned int datidx)
+{
+    rpmidxdb mig = idxdb->mig;
+    if (mig->usedslots * 2 > mig->nslots || mig->keyend + keylsize(keyl) + keyl >= ~mig->xmask)
+	return RPMRC_FAIL;
+    return rpmidxPutSlot(mig, key, keyl, pkgidx, datidx, 0);
+}
+
+static int rpmidxMigrateStep(rpmidxdb idxdb, unsigned int n)
+{
+    unsigned int i, end;
+    unsigned char *kbuf = 0;
+    unsigned int kbufl = 0;
+    int rc = RPMRC_OK;
+
+    end = n < idxdb->nslots - idxdb->mig_next ? idxdb->mig_next + n : idxdb->nslots;
+    for (i = idxdb->mig_next; i < end; i++) {
+	unsigned char *ent = idxdb->slot_mapped + 8 * i;
+	unsigned int x = le2ha(ent);
+	unsigned int data, ovldata, pkgidx, datidx, keyl, hl;
+	unsigned char *key;
+
+	if (x == 0 || x == -1)
+	    continue;
+	key = idxdb->key_mapped + (x & ~idxdb->xmask);
+	keyl = decodekeyl(key, &hl);
+	data = le2ha(ent + 4);
+	ovldata = (data & 0x80000000) ? le2ha(idxdb->slot_mapped + idxdb->nslots * 8 + 4 * i) : 0;
+	pkgidx = decodedata(idxdb, data, ovldata, &datidx);
+	/* growing the new table may move the old mapping */
+	if (keyl > kbufl)
+	    kbuf = xrealloc(kbuf, kbufl = keyl);
+	if (keyl)
+	    memcpy(kbuf, key + hl, keyl);
+	if (rpmidxMigratePut(idxdb, kbuf, keyl, pkgidx, datidx)) {
+	    rc = RPMRC_FAIL;
+	    break;
+	}
+    }
+    free(kbuf);
+    if (rc) {
+	rpmidxMigrateAbort(idxdb);
+	return rc;
+    }
+    idxdb->mig_next = end;
+    if (end == idxdb->nslots) {
+	rpmidxdb mig = idxdb->mig;
+	idxdb->mig = 0;
+	rc = rpmidxSwitchTable(idxdb, mig);
+	free(mig);
+    }
+    return rc;
+}
+
+/* repeat a change to an already copied slot in the new table */
+static void rpmidxMigrateMirror(rpmidxdb idxdb, unsigned int slot, int del, const unsigned char *key, unsigned int keyl, unsigned int pkgidx, unsigned int datidx);
+
 /* check if we need to rebuild the index. We need to do this if
  * - there are too many used slot, so hashing is inefficient
  * - there is too much key excess (i.e. holes in the keys)
@@ -588,18 +840,35 @@ static int rpmidxRebuildInternal(rpmidxdb idxdb)
  */
 static int rpmidxCheck(rpmidxdb idxdb)
 {
-    if (idxdb->usedslots * 2 > idxdb->nslots ||
+    int urgent;
+
+    /* somebody else changed the index behind our back */
+    if (idxdb->mig && idxdb->mig_generation != idxdb->generation)
+	rpmidxMigrateAbort(idxdb);
+
+    if (!idxdb->mig && !(idxdb->usedslots * 2 > idxdb->nslots ||
 	(idxdb->keyexcess > 4096 && idxdb->keyexcess * 4 > idxdb->keyend) ||
-	idxdb->keyend >= ~idxdb->xmask) {
-	if (rpmidxRebuildInternal(idxdb))
-	    return RPMRC_FAIL;
+	idxdb->keyend >= ~idxdb->xmask))
+	return RPMRC_OK;
+
+    /* no room for new keys or slots running out: finish now */
+    urgent = idxdb->keyend >= ~idxdb->xmask || idxdb->usedslots * 4 > idxdb->nslots * 3;
+    if (!idxdb->mig && !urgent && !idxdb->rdonly)
+	rpmidxMigrateStart(idxdb);
+    if (idxdb->mig) {
+	if (rpmidxMigrateStep(idxdb, urgent ? idxdb->nslots : IDXDB_MIGRATE_STEP) == RPMRC_OK)
+	    return RPMRC_OK;
+	if (!urgent && !(idxdb->usedslots * 2 > idxdb->nslots))
+	    return RPMRC_OK;
     }
+    if (rpmidxRebuildInternal(idxdb))
+	return RPMRC_FAIL;
     return RPMRC_OK;
 }
 
-static int rpmidxPutInternal(rpmidxdb idxdb, const unsigned char *key, unsigned int keyl, unsigned int pkgidx, unsigned int datidx)
+static int rpmidxPutSlot(rpmidxdb idxdb, const unsigned char *key, unsigned int keyl, unsigned int pkgidx, unsigned int datidx, unsigned int *slotp)
 {
-    unsigned int keyh = murmurhash(key, keyl);
+    unsigned int fp, keyh = keyhash(idxdb, key, keyl, &fp);
     unsigned int keyoff = 0;
     unsigned int freeh = -1;
     unsigned int x, h, hh = 7;
@@ -608,10 +877,8 @@ static int rpmidxPutInternal(rpmidxdb idxdb, const unsigned char *key, unsigned
     unsigned char *ent;
     unsigned int data, ovldata;
 
-    if (datidx >= 0x80000000)
-	return RPMRC_FAIL;
-    if (rpmidxCheck(idxdb))
-	return RPMRC_FAIL;
+    if (slotp)
+	*slotp = -1;
     data = encodedata(idxdb, pkgidx, datidx, &ovldata);
     hmask = idxdb->hmask;
     xmask = idxdb->xmask;
@@ -627,6 +894,8 @@ static int rpmidxPutInternal(rpmidxdb idxdb, const unsigned char *key, unsigned
 	if (!keyoff) {
 	    if (((x ^ keyh) & xmask) != 0)
 		continue;
+	    if (!fpmatch(idxdb, h, fp))
+		continue;
 	    if (!equalkey(idxdb, x & ~xmask, key, keyl))
 		continue;
 	    keyoff = x;
@@ -665,24 +934,40 @@ static int rpmidxPutInternal(rpmidxdb idxdb, const unsigned char *key, unsigned
     h2lea(data, ent + 4);
     if (ovldata)
 	h2lea(ovldata, idxdb->slot_mapped + idxdb->nslots * 8 + 4 * h);
+    if (idxdb->fp_mapped)
+	h2lea(fp, idxdb->fp_mapped + 4 * h);
     bumpGeneration(idxdb);
+    if (slotp)
+	*slotp = h;
     return RPMRC_OK;
 }
 
-static int rpmidxDelInternal(rpmidxdb idxdb, const unsigned char *key, unsigned int keyl, unsigned int pkgidx, unsigned int datidx)
+static int rpmidxPutInternal(rpmidxdb idxdb, const unsigned char *key, unsigned int keyl, unsigned int pkgidx, unsigned int datidx)
+{
+    unsigned int h;
+
+    if (datidx >= 0x80000000)
+	return RPMRC_FAIL;
+    if (rpmidxCheck(idxdb))
+	return RPMRC_FAIL;
+    if (rpmidxPutSlot(idxdb, key, keyl, pkgidx, datidx, &h))
+	return RPMRC_FAIL;
+    rpmidxMigrateMirror(idxdb, h, 0, key, keyl, pkgidx, datidx);
+    return RPMRC_OK;
+}
+
+static int rpmidxDelSlots(rpmidxdb idxdb, const unsigned char *key, unsigned int keyl, unsigned int pkgidx, unsigned int datidx, unsigned int *slotp)
 {
     unsigned int keyoff = 0;
-    unsigned int keyh = murmurhash(key, keyl);
+    unsigned int fp, keyh = keyhash(idxdb, key, keyl, &fp);
     unsigned int hmask;
     unsigned int xmask;
     unsigned int x, h, hh = 7;
     int otherusers = 0;
     unsigned int data, ovldata;
 
-    if (datidx >= 0x80000000)
-	return RPMRC_FAIL;
-    if (rpmidxCheck(idxdb))
-	return RPMRC_FAIL;
+    if (slotp)
+	*slotp = -1;
     data = encodedata(idxdb, pkgidx, datidx, &ovldata);
     hmask = idxdb->hmask;
     xmask = idxdb->xmask;
@@ -696,6 +981,8 @@ static int rpmidxDelInternal(rpmidxdb idxdb, const unsigned char *key, unsigned
 	if (!keyoff) {
 	    if (((x ^ keyh) & xmask) != 0)
 		continue;
+	    if (!fpmatch(idxdb, h, fp))
+		continue;
 	    if (!equalkey(idxdb, x & ~xmask, key, keyl))
 		continue;
 	    keyoff = x;
@@ -718,6 +1005,8 @@ static int rpmidxDelInternal(rpmidxdb idxdb, const unsigned char *key, unsigned
 	    h2lea(0, idxdb->slot_mapped + idxdb->nslots * 8 + 4 * h);
 	idxdb->dummyslots++;
 	updateDummyslots(idxdb);
+	if (slotp && h < *slotp)
+	    *slotp = h;
 	/* continue searching (so that we find other users of the key...) */
     }
     if (keyoff && !otherusers) {
@@ -732,10 +1021,42 @@ static int rpmidxDelInternal(rpmidxdb idxdb, const unsigned char *key, unsigned
     return RPMRC_OK;
 }
 
+static int rpmidxDelInternal(rpmidxdb idxdb, const unsigned char *key, unsigned int keyl, unsigned int pkgidx, unsigned int datidx)
+{
+    unsigned int h;
+
+    if (datidx >= 0x80000000)
+	return RPMRC_FAIL;
+    if (rpmidxCheck(idxdb))
+	return RPMRC_FAIL;
+    if (rpmidxDelSlots(idxdb, key, keyl, pkgidx, datidx, &h))
+	return RPMRC_FAIL;
+    rpmidxMigrateMirror(idxdb, h, 1, key, keyl, pkgidx, datidx);
+    return RPMRC_OK;
+}
+
+static void rpmidxMigrateMirror(rpmidxdb idxdb, unsigned int slot, int del, const unsigned char *key, unsigned int keyl, unsigned int pkgidx, unsigned int datidx)
+{
+    int rc = RPMRC_OK;
+
+    if (!idxdb->mig)
+	return;
+    if (slot != -1 && slot < idxdb->mig_next) {
+	if (del)
+	    rc = rpmidxDelSlots(idxdb->mig, key, keyl, pkgidx, datidx, 0);
+	else
+	    rc = rpmidxMigratePut(idxdb, key, keyl, pkgidx, datidx);
+    }
+    if (rc)
+	rpmidxMigrateAbort(idxdb);
+    else
+	idxdb->mig_generation = idxdb->generation;
+}
+
 static int rpmidxGetInternal(rpmidxdb idxdb, const unsigned char *key, unsigned int keyl, unsigned int **pkgidxlistp, unsigned int *pkgidxnump)
 {
     unsigned int keyoff = 0;
-    unsigned int keyh = murmurhash(key, keyl);
+    unsigned int fp, keyh = keyhash(idxdb, key, keyl, &fp);
     unsigned int hmask = idxdb->hmask;
     unsigned int xmask = idxdb->xmask;
     unsigned int x, h, hh = 7;
@@ -752,6 +1073,8 @@ static int rpmidxGetInternal(rpmidxdb idxdb, const unsigned char *key, unsigned
 	if (!keyoff) {
 	    if (((x ^ keyh) & xmask) != 0)
 		continue;
+	    if (!fpmatch(idxdb, h, fp))
+		continue;
 	    if (!equalkey(idxdb, x & ~xmask, key, keyl))
 		continue;
 	    keyoff = x;
@@ -789,7 +1112,7 @@ static void rpmidxListSort(rpmidxdb idxdb, unsigned int *keylist, unsigned int n
     arr = xmalloc(nkeylist * sizeof(unsigned int));
     for (i = 0; i < nkeylist; i += 2) {
 	arr[i] = i;
-	arr[i + 1] = murmurhash(data + keylist[i], keylist[i + 1]) & idxdb->hmask;
+	arr[i + 1] = keyhash(idxdb, data + keylist[i], keylist[i + 1], 0) & idxdb->hmask;
     }
     qsort(arr, nkeylist / 2, 2 * sizeof(unsigned int), rpmidxListSort_cmp);
     for (i = 0; i < nkeylist; i += 2) {
@@ -808,7 +1131,9 @@ static int rpmidxListInternal(rpmidxdb idxdb, unsigned int **keylistp, unsigned
     unsigned char *data, *terminate, *key, *keyendp;
 
     data = xmalloc(idxdb->keyend + 1);	/* +1 so we can terminate the last key */
+    rpmidxScanBegin(idxdb);
     memcpy(data, idxdb->key_mapped, idxdb->keyend);
+    rpmidxScanEnd(idxdb);
     keylist = xmalloc(16 * sizeof(*keylist));
     terminate = 0;
     for (key = data + 1, keyendp = data + idxdb->keyend; key < keyendp; ) {
@@ -890,10 +1215,11 @@ int rpmidxOpen(rpmidxdb *idxdbp, rpmpkgdb pkgdb, const char *filename, int flags
     return RPMRC_FAIL;
 }
 
-int rpmidxOpenXdb(rpmidxdb *idxdbp, rpmpkgdb pkgdb, rpmxdb xdb, unsigned int xdbtag, int flags)
+int rpmidxOpenXdb(rpmidxdb *idxdbp, rpmpkgdb pkgdb, rpmxdb xdb, unsigned int xdbtag, int flags, unsigned int version)
 {
     rpmidxdb idxdb;
     unsigned int id;
+    struct rusage ru;
     *idxdbp = 0;
     int rc;
     
@@ -916,7 +1242,13 @@ int rpmidxOpenXdb(rpmidxdb *idxdbp, rpmpkgdb pkgdb, rpmxdb xdb, unsigned int xdb
     idxdb->xdbid = id;
     idxdb->pkgdb = pkgdb;
     idxdb->pagesize = rpmxdbPagesize(xdb);
+    idxdb->growth = IDXDB_KEY_GROWTH;
+    idxdb->newversion = version == IDXDB_VERSION_FP ? IDXDB_VERSION_FP : IDXDB_VERSION;
     idxdb->rdonly = (flags & (O_RDONLY|O_RDWR)) == O_RDONLY ? 1 : 0;
+    if (getrusage(RUSAGE_SELF, &ru) == 0) {
+	idxdb->minflt = ru.ru_minflt;
+	idxdb->majflt = ru.ru_majflt;
+    }
     if (!id) {
 	if (rpmidxInit(idxdb)) {
 	    free(idxdb);
@@ -952,10 +1284,25 @@ int rpmidxDelXdb(rpmpkgdb pkgdb, rpmxdb xdb, unsigned int xdbtag)
 
 void rpmidxClose(rpmidxdb idxdb)
 {
+    /* complete a pending incremental rebuild instead of losing it */
+    if (idxdb->mig && rpmidxLockReadHeader(idxdb, 1) == RPMRC_OK) {
+	if (idxdb->mig_generation == idxdb->generation)
+	    rpmidxMigrateStep(idxdb, idxdb->nslots);
+	rpmidxMigrateAbort(idxdb);
+	rpmidxUnlock(idxdb, 1);
+    }
+    rpmidxMigrateAbort(idxdb);
     rpmidxUnmap(idxdb);
     free(idxdb);
 }
 
+void rpmidxSetGrowth(rpmidxdb idxdb, unsigned int percent)
+{
+    idxdb->growth = percent;
+    if (idxdb->mig)
+	idxdb->mig->growth = percent;
+}
+
 int rpmidxPut(rpmidxdb idxdb, const unsigned char *key, unsigned int keyl, unsigned int pkgidx, unsigned int datidx)
 {
     int rc;
@@ -989,11 +1336,60 @@ int rpmidxGet(rpmidxdb idxdb, const unsigned char *key, unsigned int keyl, unsig
     *pkgidxnump = 0;
     if (rpmidxLockReadHeader(idxdb, 0))
 	return RPMRC_FAIL;
+    idxdb->nlookups++;
     rc = rpmidxGetInternal(idxdb, key, keyl, pkgidxlistp, pkgidxnump);
     rpmidxUnlock(idxdb, 0);
     return rc;
 }
 
+struct getbatch_s {
+    unsigned int h;
+    unsigned int ix;
+};
+
+static int getbatch_cmp(const void *a, const void *b)
+{
+    const struct getbatch_s *ga = a, *gb = b;
+    if (ga->h != gb->h)
+	return ga->h < gb->h ? -1 : 1;
+    return ga->ix < gb->ix ? -1 : 1;
+}
+
+/* look up many keys under a single lock, probing in hash slot order so
+ * that neighbouring lookups touch neighbouring pages of the mapping */
+int rpmidxGetBatch(rpmidxdb idxdb, const unsigned char **keys, const unsigned int *keyls, unsigned int nkeys, unsigned int **pkgidxlists, unsigned int *pkgidxnums)
+{
+    struct getbatch_s *order;
+    unsigned int i;
+    int rc;
+
+    for (i = 0; i < nkeys; i++) {
+	pkgidxlists[i] = 0;
+	pkgidxnums[i] = 0;
+    }
+    if (!nkeys)
+	return RPMRC_OK;
+    if (rpmidxLockReadHeader(idxdb, 0))
+	return RPMRC_FAIL;
+    order = xmalloc(nkeys * sizeof(*order));
+    for (i = 0; i < nkeys; i++) {
+	order[i].h = keyhash(idxdb, keys[i], keyls[i], 0) & idxdb->hmask;
+	order[i].ix = i;
+    }
+    qsort(order, nkeys, sizeof(*order), getbatch_cmp);
+    idxdb->nlookups += nkeys;
+    for (i = 0; i < nkeys; i++) {
+	unsigned int ix = order[i].ix;
+	rc = rpmidxGetInternal(idxdb, keys[ix], keyls[ix], pkgidxlists + ix, pkgidxnums + ix);
+	if (rc != RPMRC_OK && rc != RPMRC_NOTFOUND)
+	    break;
+	rc = RPMRC_OK;
+    }
+    free(order);
+    rpmidxUnlock(idxdb, 0);
+    return rc;
+}
+
 int rpmidxList(rpmidxdb idxdb, unsigned int **keylistp, unsigned int *nkeylistp, unsigned char **datap)
 {
     int rc;
@@ -1008,10 +1404,12 @@ int rpmidxList(rpmidxdb idxdb, unsigned int **keylistp, unsigned int *nkeylistp,
 
 int rpmidxStats(rpmidxdb idxdb)
 {
+    struct rusage ru;
     if (rpmidxLockReadHeader(idxdb, 0))
 	return RPMRC_FAIL;
     printf("--- IndexDB Stats\n");
     printf("Xdb tag: %d, id: %d\n", idxdb->xdbtag, idxdb->xdbid);
+    printf("Version: %u\n", idxdb->version);
     printf("Generation: %u\n", idxdb->generation);
     printf("Slots: %u\n", idxdb->nslots);
     printf("Used slots: %u\n", idxdb->usedslots);
@@ -1019,6 +1417,12 @@ int rpmidxStats(rpmidxdb idxdb)
     printf("Key data size: %u, left %u\n", idxdb->keyend, idxdb->key_size - idxdb->keyend);
     printf("Key excess: %u\n", idxdb->keyexcess);
     printf("XMask: 0x%08x\n", idxdb->xmask);
+    printf("Key space growth: %u%%, grown %u times\n", idxdb->growth, idxdb->ngrowths);
+    printf("Remaps: %u\n", idxdb->nremaps);
+    printf("Lookups: %u\n", idxdb->nlookups);
+    if (getrusage(RUSAGE_SELF, &ru) == 0)
+	printf("Page faults since open (process): %ld minor, %ld major\n",
+	       ru.ru_minflt - idxdb->minflt, ru.ru_majflt - idxdb->majflt);
     rpmidxUnlock(idxdb, 0);
     return RPMRC_OK;
 }
@@ -5,7 +5,10 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
@@ -29,6 +32,14 @@ typedef struct pkgslot_s {
     unsigned int slotno;
 } pkgslot;
 
+typedef struct pkgextent_s {
+    unsigned int blkoff;
+    unsigned int blkcnt;
+} pkgextent;
+
+/* free extents are bucketed by the log2 of their size */
+#define EXTENT_BUCKETS 32
+
 typedef struct rpmpkgdb_s {
     int fd;			/* our file descriptor */
 
@@ -49,11 +60,21 @@ typedef struct rpmpkgdb_s {
     unsigned int nslothash;
 
     unsigned int freeslot;	/* first free slot */
+    unsigned int *freeslots;	/* more free slots, highest first */
+    unsigned int nfreeslots;
     int ordered;		/* slots are ordered by the blk offsets */
 
+    /* the holes between the blobs, sorted by size within a bucket */
+    struct pkgextent_s *extents[EXTENT_BUCKETS];
+    unsigned int nextents[EXTENT_BUCKETS];
+    int extents_ok;
+
     char *filename;
     unsigned int fileblks;	/* file size in blks */
     int dofsync;
+
+    unsigned char *mapped;	/* read-only mapping of the file (rdonly) */
+    size_t mapped_size;
 } * rpmpkgdb;
 
 
@@ -107,6 +128,16 @@ static unsigned int update_adler32(unsigned int adler, unsigned char *buf, unsig
 #define PKGDB_OFFSET_SLOTNPAGES 12
 #define PKGDB_OFFSET_NEXTPKGIDX 16
 
+static void rpmpkgFreeSlots(rpmpkgdb pkgdb)
+{
+    pkgdb->slots = _free(pkgdb->slots);
+    pkgdb->freeslots = _free(pkgdb->freeslots);
+    pkgdb->nslots = 0;
+    pkgdb->nfreeslots = 0;
+    pkgdb->freeslot = 0;
+    pkgdb->extents_ok = 0;
+}
+
 static int rpmpkgReadHeader(rpmpkgdb pkgdb)
 {
     unsigned int generation, slotnpages, nextpkgidx, version;
@@ -131,10 +162,8 @@ static int rpmpkgReadHeader(rpmpkgdb pkgdb)
     slotnpages = le2h(header + PKGDB_OFFSET_SLOTNPAGES);
     nextpkgidx = le2h(header + PKGDB_OFFSET_NEXTPKGIDX);
     /* free slots if our internal data no longer matches */
-    if (pkgdb->slots && (pkgdb->generation != generation || pkgdb->slotnpages != slotnpages)) {
-	free(pkgdb->slots);
-	pkgdb->slots = 0;
-    }
+    if (pkgdb->slots && (pkgdb->generation != generation || pkgdb->slotnpages != slotnpages))
+	rpmpkgFreeSlots(pkgdb);
     pkgdb->generation = generation;
     pkgdb->slotnpages = slotnpages;
     pkgdb->nextpkgidx = nextpkgidx;
@@ -228,12 +257,7 @@ static int rpmpkgReadSlots(rpmpkgdb pkgdb)
     pkgslot *slot;
 
     /* free old slot data */
-    if (pkgdb->slots) {
-	free(pkgdb->slots);
-	pkgdb->slots = 0;
-    }
-    pkgdb->nslots = 0;
-    pkgdb->freeslot = 0;
+    rpmpkgFreeSlots(pkgdb);
 
     /* calculate current database size in blks */
     if (fstat(pkgdb->fd, &stb))
@@ -244,6 +268,7 @@ static int rpmpkgReadSlots(rpmpkgdb pkgdb)
 
     /* read (and somewhat verify) all slots */
     pkgdb->slots = xcalloc(slotnpages * (PAGE_SIZE / SLOT_SIZE), sizeof(*pkgdb->slots));
+    pkgdb->freeslots = xcalloc(slotnpages * (PAGE_SIZE / SLOT_SIZE), sizeof(*pkgdb->freeslots));
     i = 0;
     slot = pkgdb->slots;
     minblkoff = slotnpages * (PAGE_SIZE / BLK_SIZE);
@@ -260,7 +285,9 @@ static int rpmpkgReadSlots(rpmpkgdb pkgdb)
 	    }
 	    blkoff = le2h(pp + 8);
 	    if (!blkoff) {
-		if (!freeslot)
+		if (freeslot)
+		    pkgdb->freeslots[pkgdb->nfreeslots++] = slotno;
+		else
 		    freeslot = slotno;
 		continue;
 	    }
@@ -282,9 +309,14 @@ static int rpmpkgReadSlots(rpmpkgdb pkgdb)
     pkgdb->ordered = 0;
     pkgdb->fileblks = fileblks;
     pkgdb->freeslot = freeslot;
+    /* hand out the lowest slots first */
+    for (i = 0; i < pkgdb->nfreeslots / 2; i++) {
+	unsigned int t = pkgdb->freeslots[i];
+	pkgdb->freeslots[i] = pkgdb->freeslots[pkgdb->nfreeslots - 1 - i];
+	pkgdb->freeslots[pkgdb->nfreeslots - 1 - i] = t;
+    }
     if (rpmpkgHashSlots(pkgdb)) {
-	free(pkgdb->slots);
-	pkgdb->slots = 0;
+	rpmpkgFreeSlots(pkgdb);
 	return RPMRC_FAIL;
     }
     return RPMRC_OK;
@@ -318,47 +350,179 @@ static inline pkgslot *rpmpkgFindSlot(rpmpkgdb pkgdb, unsigned int pkgidx)
     return 0;
 }
 
-/* Find an empty space for blkcnt blocks. If dontprepend is true, ignore
-   the space between the slot area and the first blob */
-static int rpmpkgFindEmptyOffset(rpmpkgdb pkgdb, unsigned int pkgidx, unsigned int blkcnt, unsigned *blkoffp, pkgslot **oldslotp, int dontprepend)
+/* insert a slot, keeping the order by blk offset */
+static void rpmpkgInsertSlot(rpmpkgdb pkgdb, unsigned int pkgidx, unsigned int blkoff, unsigned int blkcnt, unsigned int slotno)
+{
+    unsigned int lo = pkgdb->nslots, hi = pkgdb->nslots;
+    pkgslot *slot;
+
+    if (pkgdb->ordered) {
+	lo = 0;
+	while (lo < hi) {
+	    unsigned int mid = (lo + hi) / 2;
+	    if (pkgdb->slots[mid].blkoff < blkoff)
+		lo = mid + 1;
+	    else
+		hi = mid;
+	}
+    }
+    slot = pkgdb->slots + lo;
+    memmove(slot + 1, slot, (pkgdb->nslots - lo) * sizeof(*slot));
+    slot->pkgidx = pkgidx;
+    slot->blkoff = blkoff;
+    slot->blkcnt = blkcnt;
+    slot->slotno = slotno;
+    pkgdb->nslots++;
+    rpmpkgHashSlots(pkgdb);
+}
+
+static void rpmpkgRemoveSlot(rpmpkgdb pkgdb, pkgslot *slot)
+{
+    unsigned int i = slot - pkgdb->slots;
+    memmove(slot, slot + 1, (pkgdb->nslots - i - 1) * sizeof(*slot));
+    pkgdb->nslots--;
+    rpmpkgHashSlots(pkgdb);
+}
+
+/*** Free extent management ***/
+
+static inline unsigned int extentbucket(unsigned int blkcnt)
+{
+    unsigned int b = 0;
+    while (blkcnt >>= 1)
+	b++;
+    return b;
+}
+
+/* position of the first extent not smaller than (blkcnt, blkoff) */
+static unsigned int extentpos(pkgextent *ext, unsigned int n, unsigned int blkoff, unsigned int blkcnt)
+{
+    unsigned int lo = 0, hi = n;
+    while (lo < hi) {
+	unsigned int mid = (lo + hi) / 2;
+	if (ext[mid].blkcnt < blkcnt || (ext[mid].blkcnt == blkcnt && ext[mid].blkoff < blkoff))
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    return lo;
+}
+
+static void rpmpkgAddExtent(rpmpkgdb pkgdb, unsigned int blkoff, unsigned int blkcnt)
+{
+    unsigned int b = extentbucket(blkcnt);
+    unsigned int n = pkgdb->nextents[b];
+    pkgextent *ext;
+    unsigned int i;
+
+    /* grow in chunks of 16 */
+    if ((n & 15) == 0)
+	pkgdb->extents[b] = xrealloc(pkgdb->extents[b], (n + 16) * sizeof(*ext));
+    ext = pkgdb->extents[b];
+    i = extentpos(ext, n, blkoff, blkcnt);
+    memmove(ext + i + 1, ext + i, (n - i) * sizeof(*ext));
+    ext[i].blkoff = blkoff;
+    ext[i].blkcnt = blkcnt;
+    pkgdb->nextents[b]++;
+}
+
+static void rpmpkgDelExtent(rpmpkgdb pkgdb, unsigned int blkoff, unsigned int blkcnt)
+{
+    unsigned int b = extentbucket(blkcnt);
+    unsigned int n = pkgdb->nextents[b];
+    pkgextent *ext = pkgdb->extents[b];
+    unsigned int i = extentpos(ext, n, blkoff, blkcnt);
+
+    if (i == n || ext[i].blkoff != blkoff || ext[i].blkcnt != blkcnt) {
+	pkgdb->extents_ok = 0;		/* out of sync, rebuild */
+	return;
+    }
+    memmove(ext + i, ext + i + 1, (n - i - 1) * sizeof(*ext));
+    pkgdb->nextents[b]--;
+}
+
+/* (re-)create the free extents from the ordered slots */
+static int rpmpkgBuildExtents(rpmpkgdb pkgdb)
 {
     unsigned int i, nslots = pkgdb->nslots;
-    unsigned int bestblkoff = 0;
-    unsigned int freecnt, bestfreecnt = 0;
     unsigned int lastblkend = pkgdb->slotnpages * (PAGE_SIZE / BLK_SIZE);
-    pkgslot *slot, *oldslot = 0;
+    pkgslot *slot;
 
     if (!pkgdb->ordered)
 	rpmpkgOrderSlots(pkgdb);
-
-    if (dontprepend && nslots) {
-	lastblkend = pkgdb->slots[0].blkoff;
-    }
-    /* best fit strategy */
+    for (i = 0; i < EXTENT_BUCKETS; i++)
+	pkgdb->nextents[i] = 0;
+    pkgdb->extents_ok = 1;
     for (i = 0, slot = pkgdb->slots; i < nslots; i++, slot++) {
 	if (slot->blkoff < lastblkend) {
+	    pkgdb->extents_ok = 0;
 	    return RPMRC_FAIL;		/* eek, slots overlap! */
 	}
-	if (slot->pkgidx == pkgidx) {
-	    if (oldslot) {
-		return RPMRC_FAIL;	/* eek, two slots with our pkgid ! */
-	    }
-	    oldslot = slot;
-	}
-	freecnt = slot->blkoff - lastblkend;
-	if (freecnt >= blkcnt) {
-	    if (!bestblkoff || bestfreecnt > freecnt) {
-		bestblkoff = lastblkend;
-		bestfreecnt = freecnt;
-	    }
-	}
+	if (slot->blkoff > lastblkend)
+	    rpmpkgAddExtent(pkgdb, lastblkend, slot->blkoff - lastblkend);
 	lastblkend = slot->blkoff + slot->blkcnt;
     }
-    if (!bestblkoff) {
-	bestblkoff = lastblkend;	/* append to end */
+    return RPMRC_OK;
+}
+
+/* the ordered slot i is going away, merge its area with the neighbour holes */
+static void rpmpkgReleaseExtent(rpmpkgdb pkgdb, unsigned int i)
+{
+    pkgslot *slot = pkgdb->slots + i;
+    unsigned int start, end;
+
+    if (!pkgdb->extents_ok || !pkgdb->ordered)
+	return;
+    start = i ? slot[-1].blkoff + slot[-1].blkcnt : pkgdb->slotnpages * (PAGE_SIZE / BLK_SIZE);
+    end = slot->blkoff + slot->blkcnt;
+    if (slot->blkoff > start)
+	rpmpkgDelExtent(pkgdb, start, slot->blkoff - start);
+    if (i + 1 == pkgdb->nslots)
+	return;		/* merged into the free space at the end */
+    if (slot[1].blkoff > end)
+	rpmpkgDelExtent(pkgdb, end, slot[1].blkoff - end);
+    rpmpkgAddExtent(pkgdb, start, slot[1].blkoff - start);
+}
+
+/* blkcnt blocks at the start of a hole of freecnt blocks got used */
+static void rpmpkgUseExtent(rpmpkgdb pkgdb, unsigned int blkoff, unsigned int blkcnt, unsigned int freecnt)
+{
+    if (!pkgdb->extents_ok || !freecnt)
+	return;
+    rpmpkgDelExtent(pkgdb, blkoff, freecnt);
+    if (freecnt > blkcnt)
+	rpmpkgAddExtent(pkgdb, blkoff + blkcnt, freecnt - blkcnt);
+}
+
+/* Find an empty space for blkcnt blocks. If dontprepend is true, ignore
+   the space between the slot area and the first blob. The size of the
+   hole used is returned in freecntp, zero means append to the end */
+static int rpmpkgFindEmptyOffset(rpmpkgdb pkgdb, unsigned int pkgidx, unsigned int blkcnt, unsigned *blkoffp, unsigned int *freecntp, pkgslot **oldslotp, int dontprepend)
+{
+    unsigned int minblkoff = pkgdb->slotnpages * (PAGE_SIZE / BLK_SIZE);
+    unsigned int b, i;
+
+    if (!pkgdb->extents_ok && rpmpkgBuildExtents(pkgdb))
+	return RPMRC_FAIL;
+
+    if (dontprepend && pkgdb->nslots)
+	minblkoff = pkgdb->slots[0].blkoff;
+    *oldslotp = rpmpkgFindSlot(pkgdb, pkgidx);
+    /* best fit strategy */
+    for (b = extentbucket(blkcnt); b < EXTENT_BUCKETS; b++) {
+	pkgextent *ext = pkgdb->extents[b];
+	unsigned int n = pkgdb->nextents[b];
+	for (i = extentpos(ext, n, 0, blkcnt); i < n; i++) {
+	    if (ext[i].blkoff >= minblkoff) {
+		*blkoffp = ext[i].blkoff;
+		*freecntp = ext[i].blkcnt;
+		return RPMRC_OK;
+	    }
+	}
     }
-    *oldslotp = oldslot;
-    *blkoffp = bestblkoff;
+    /* append to end */
+    *blkoffp = pkgdb->nslots ? pkgdb->slots[pkgdb->nslots - 1].blkoff + pkgdb->slots[pkgdb->nslots - 1].blkcnt : pkgdb->slotnpages * (PAGE_SIZE / BLK_SIZE);
+    *freecntp = 0;
     return RPMRC_OK;
 }
 
@@ -405,7 +569,7 @@ static int rpmpkgWriteslot(rpmpkgdb pkgdb, unsigned int slotno, unsigned int pkg
     if (slotno < SLOT_START)
 	return RPMRC_FAIL;
     if (blkoff && slotno == pkgdb->freeslot)
-	pkgdb->freeslot = 0;
+	pkgdb->freeslot = pkgdb->nfreeslots ? pkgdb->freeslots[--pkgdb->nfreeslots] : 0;
     h2le(SLOT_MAGIC, buf);
     h2le(pkgidx, buf + 4);
     h2le(blkoff, buf + 8);
@@ -524,7 +688,7 @@ static int rpmpkgReadBlob(rpmpkgdb pkgdb, unsigned int pkgidx, unsigned int blko
     unsigned int bloblen, toread, generation;
     off_t fileoff;
     unsigned int adl;
-    int verifyadler = bloblp ? 0 : 1;
+    int verifyadler = 1;
 
     /* sanity */
     if (blkcnt <  (BLOBHEAD_SIZE + BLOBTAIL_SIZE + BLK_SIZE - 1) / BLK_SIZE)
@@ -587,18 +751,98 @@ static int rpmpkgReadBlob(rpmpkgdb pkgdb, unsigned int pkgidx, unsigned int blko
     return RPMRC_OK;
 }
 
+/* Map the file read-only, must be called with a lock and valid slots */
+static int rpmpkgMap(rpmpkgdb pkgdb)
+{
+    size_t size = (size_t)pkgdb->fileblks * BLK_SIZE;
+    void *mapped;
+
+    if (pkgdb->mapped && pkgdb->mapped_size >= size)
+	return RPMRC_OK;
+    if (pkgdb->mapped) {
+	munmap(pkgdb->mapped, pkgdb->mapped_size);
+	pkgdb->mapped = 0;
+	pkgdb->mapped_size = 0;
+    }
+    if (!size)
+	return RPMRC_FAIL;
+    mapped = mmap(0, size, PROT_READ, MAP_SHARED, pkgdb->fd, 0);
+    if (mapped == MAP_FAILED)
+	return RPMRC_FAIL;
+    pkgdb->mapped = mapped;
+    pkgdb->mapped_size = size;
+    return RPMRC_OK;
+}
+
+/* Like rpmpkgReadBlob(), but returns a pointer into the mapping */
+static int rpmpkgMapBlob(rpmpkgdb pkgdb, unsigned int pkgidx, unsigned int blkoff, unsigned int blkcnt, unsigned char **blobp, unsigned int *bloblp)
+{
+    unsigned char *p, *tail;
+    size_t fileoff = (size_t)blkoff * BLK_SIZE;
+    unsigned int bloblen;
+
+    /* sanity */
+    if (blkcnt <  (BLOBHEAD_SIZE + BLOBTAIL_SIZE + BLK_SIZE - 1) / BLK_SIZE)
+	return RPMRC_FAIL;	/* blkcnt too small */
+    if (fileoff + (size_t)blkcnt * BLK_SIZE > pkgdb->mapped_size)
+	return RPMRC_FAIL;	/* outside of mapping */
+    p = pkgdb->mapped + fileoff;
+    if (le2h(p) != BLOBHEAD_MAGIC)
+	return RPMRC_FAIL;	/* bad blob */
+    if (le2h(p + 4) != pkgidx)
+	return RPMRC_FAIL;	/* bad blob */
+    bloblen = le2h(p + 12);
+    if (blkcnt != (BLOBHEAD_SIZE + bloblen + BLOBTAIL_SIZE + BLK_SIZE - 1) / BLK_SIZE)
+	return RPMRC_FAIL;	/* bad blob */
+    /* the trailer is at the end of the blocks, after the padding */
+    tail = p + (size_t)blkcnt * BLK_SIZE - BLOBTAIL_SIZE;
+    if (le2h(tail) != update_adler32(ADLER32_INIT, p, tail - p))
+	return RPMRC_FAIL;	/* bad blob, adler32 mismatch */
+    if (le2h(tail + 4) != bloblen)
+	return RPMRC_FAIL;	/* bad blob, bloblen mismatch */
+    if (le2h(tail + 8) != BLOBTAIL_MAGIC)
+	return RPMRC_FAIL;	/* bad blob */
+    *blobp = p + BLOBHEAD_SIZE;
+    *bloblp = bloblen;
+    return RPMRC_OK;
+}
+
 static int rpmpkgVerifyblob(rpmpkgdb pkgdb, unsigned int pkgidx, unsigned int blkoff, unsigned int blkcnt)
 {
     unsigned char buf[65536];
     return rpmpkgReadBlob(pkgdb, pkgidx, blkoff, blkcnt, buf, 0, 0);
 }
 
-static int rpmpkgWriteBlob(rpmpkgdb pkgdb, unsigned int pkgidx, unsigned int blkoff, unsigned int blkcnt, unsigned char *blob, unsigned int blobl, unsigned int now)
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+/* write out all of the segments at offset */
+static int rpmpkgPwritev(int fd, struct iovec *iov, int niov, off_t off)
 {
-    unsigned char buf[(BLOBHEAD_SIZE > BLOBTAIL_SIZE ? BLOBHEAD_SIZE : BLOBTAIL_SIZE) + BLK_SIZE];
-    unsigned int towrite, pad;
+    while (niov > 0) {
+	int n = niov > IOV_MAX ? IOV_MAX : niov;
+	ssize_t len = 0;
+	for (int i = 0; i < n; i++)
+	    len += iov[i].iov_len;
+	if (pwritev(fd, iov, n, off) != len)
+	    return RPMRC_FAIL;
+	off += len;
+	iov += n;
+	niov -= n;
+    }
+    return RPMRC_OK;
+}
+
+static int rpmpkgWriteBlob(rpmpkgdb pkgdb, unsigned int pkgidx, unsigned int blkoff, unsigned int blkcnt, const struct iovec *blobv, int nblobv, unsigned int blobl, unsigned int now)
+{
+    unsigned char head[BLOBHEAD_SIZE];
+    unsigned char buf[BLOBTAIL_SIZE + BLK_SIZE];
+    unsigned int pad;
     unsigned int adl;
     off_t fileoff;
+    struct iovec *iov;
+    int rc;
 
     /* sanity */
     if (blkcnt <  (BLOBHEAD_SIZE + BLOBTAIL_SIZE + BLK_SIZE - 1) / BLK_SIZE)
@@ -606,26 +850,20 @@ static int rpmpkgWriteBlob(rpmpkgdb pkgdb, unsigned int pkgidx, unsigned int blk
     if (blkcnt != (BLOBHEAD_SIZE + blobl + BLOBTAIL_SIZE + BLK_SIZE - 1) / BLK_SIZE)
 	return RPMRC_FAIL;	/* blkcnt mismatch */
     fileoff = (off_t)blkoff * BLK_SIZE;
-    h2le(BLOBHEAD_MAGIC, buf);
-    h2le(pkgidx, buf + 4);
-    h2le(now, buf + 8);
-    h2le(blobl, buf + 12);
-    if (pwrite(pkgdb->fd, buf, BLOBHEAD_SIZE, fileoff) != BLOBHEAD_SIZE) {
-	return RPMRC_FAIL;	/* write error */
-    }
+    h2le(BLOBHEAD_MAGIC, head);
+    h2le(pkgidx, head + 4);
+    h2le(now, head + 8);
+    h2le(blobl, head + 12);
     adl = ADLER32_INIT;
-    adl = update_adler32(adl, buf, BLOBHEAD_SIZE);
-    /* write in 64K chunks */
-    fileoff += BLOBHEAD_SIZE;
-    for (towrite = blobl; towrite;) {
-	unsigned int chunk = towrite > 65536 ? 65536 : towrite;
-	if (pwrite(pkgdb->fd, blob, chunk, fileoff) != chunk) {
-	    return RPMRC_FAIL;	/* write error */
-	}
-	adl = update_adler32(adl, blob, chunk);
-	blob += chunk;
-	towrite -= chunk;
-	fileoff += chunk;
+    adl = update_adler32(adl, head, BLOBHEAD_SIZE);
+
+    /* head, blob segments and padded tail all go out in one write */
+    iov = xmalloc((nblobv + 2) * sizeof(*iov));
+    iov[0].iov_base = head;
+    iov[0].iov_len = BLOBHEAD_SIZE;
+    for (int i = 0; i < nblobv; i++) {
+	iov[i + 1] = blobv[i];
+	adl = update_adler32(adl, blobv[i].iov_base, blobv[i].iov_len);
     }
     /* pad if needed */
     pad = blkcnt * BLK_SIZE - (BLOBHEAD_SIZE + blobl + BLOBTAIL_SIZE);
@@ -636,9 +874,13 @@ static int rpmpkgWriteBlob(rpmpkgdb pkgdb, unsigned int pkgidx, unsigned int blk
     h2le(adl, buf + (sizeof(buf) - BLOBTAIL_SIZE));
     h2le(blobl, buf + (sizeof(buf) - BLOBTAIL_SIZE) + 4);
     h2le(BLOBTAIL_MAGIC, buf + (sizeof(buf) - BLOBTAIL_SIZE) + 8);
-    if (pwrite(pkgdb->fd, buf + (sizeof(buf) - BLOBTAIL_SIZE) - pad, pad + BLOBTAIL_SIZE, fileoff) != pad + BLOBTAIL_SIZE) {
+    iov[nblobv + 1].iov_base = buf + (sizeof(buf) - BLOBTAIL_SIZE) - pad;
+    iov[nblobv + 1].iov_len = pad + BLOBTAIL_SIZE;
+
+    rc = rpmpkgPwritev(pkgdb->fd, iov, nblobv + 2, fileoff);
+    free(iov);
+    if (rc)
 	return RPMRC_FAIL;	/* write error */
-    }
     /* update file length */
     if (blkoff + blkcnt > pkgdb->fileblks)
 	pkgdb->fileblks = blkoff + blkcnt;
@@ -667,13 +909,16 @@ static int rpmpkgMoveBlob(rpmpkgdb pkgdb, pkgslot *slot, unsigned int newblkoff)
     unsigned int blkcnt = slot->blkcnt;
     unsigned char *blob;
     unsigned int generation, blobl;
+    struct iovec iov;
 
     blob = xmalloc((size_t)blkcnt * BLK_SIZE);
     if (rpmpkgReadBlob(pkgdb, pkgidx, blkoff, blkcnt, blob, &blobl, &generation)) {
 	free(blob);
 	return RPMRC_FAIL;
     }
-    if (rpmpkgWriteBlob(pkgdb, pkgidx, newblkoff, blkcnt, blob, blobl, generation)) {
+    iov.iov_base = blob;
+    iov.iov_len = blobl;
+    if (rpmpkgWriteBlob(pkgdb, pkgidx, newblkoff, blkcnt, &iov, 1, blobl, generation)) {
 	free(blob);
 	return RPMRC_FAIL;
     }
@@ -686,6 +931,7 @@ static int rpmpkgMoveBlob(rpmpkgdb pkgdb, pkgslot *slot, unsigned int newblkoff)
     }
     slot->blkoff = newblkoff;
     pkgdb->ordered = 0;
+    pkgdb->extents_ok = 0;
     return RPMRC_OK;
 }
 
@@ -698,11 +944,11 @@ static int rpmpkgAddSlotPage(rpmpkgdb pkgdb)
 
     /* now move every blob before cutoff */
     while (pkgdb->nslots && pkgdb->slots[0].blkoff < cutoff) {
-	unsigned int newblkoff;
+	unsigned int newblkoff, freecnt;
         pkgslot *slot = pkgdb->slots, *oldslot;
 
 	oldslot = 0;
-	if (rpmpkgFindEmptyOffset(pkgdb, slot->pkgidx, slot->blkcnt, &newblkoff, &oldslot, 1)) {
+	if (rpmpkgFindEmptyOffset(pkgdb, slot->pkgidx, slot->blkcnt, &newblkoff, &freecnt, &oldslot, 1)) {
 	    return RPMRC_FAIL;
 	}
 	if (!oldslot || oldslot != slot) {
@@ -891,13 +1137,17 @@ int rpmpkgOpen(rpmpkgdb *pkgdbp, const char *filename, int flags, int mode)
 
 void rpmpkgClose(rpmpkgdb pkgdb)
 {
+    int i;
+
+    if (pkgdb->mapped)
+	munmap(pkgdb->mapped, pkgdb->mapped_size);
     if (pkgdb->fd >= 0) {
 	close(pkgdb->fd);
 	pkgdb->fd = -1;
     }
-    if (pkgdb->slots)
-	free(pkgdb->slots);
-    pkgdb->slots = 0;
+    rpmpkgFreeSlots(pkgdb);
+    for (i = 0; i < EXTENT_BUCKETS; i++)
+	free(pkgdb->extents[i]);
     if (pkgdb->slothash)
 	free(pkgdb->slothash);
     pkgdb->slothash = 0;
@@ -1074,6 +1324,16 @@ static int rpmpkgGetInternal(rpmpkgdb pkgdb, unsigned int pkgidx, unsigned char
     if (!slot) {
 	return RPMRC_NOTFOUND;
     }
+    /* read-only handles copy straight from the mapping, sparing the preads */
+    if (pkgdb->rdonly && rpmpkgMap(pkgdb) == RPMRC_OK) {
+	unsigned char *mblob;
+	unsigned int mbloblen;
+	if (rpmpkgMapBlob(pkgdb, pkgidx, slot->blkoff, slot->blkcnt, &mblob, &mbloblen))
+	    return RPMRC_FAIL;
+	*blobp = memcpy(xmalloc(mbloblen ? mbloblen : 1), mblob, mbloblen);
+	*bloblp = mbloblen;
+	return RPMRC_OK;
+    }
     blob = xmalloc((size_t)slot->blkcnt * BLK_SIZE);
     if (rpmpkgReadBlob(pkgdb, pkgidx, slot->blkoff, slot->blkcnt, blob, bloblp, (unsigned int *)0)) {
 	free(blob);
@@ -1083,28 +1343,31 @@ static int rpmpkgGetInternal(rpmpkgdb pkgdb, unsigned int pkgidx, unsigned char
     return RPMRC_OK;
 }
 
-static int rpmpkgPutInternal(rpmpkgdb pkgdb, unsigned int pkgidx, unsigned char *blob, unsigned int blobl)
+static int rpmpkgPutInternal(rpmpkgdb pkgdb, unsigned int pkgidx, const struct iovec *iov, int niov, unsigned int blobl)
 {
-    unsigned int blkcnt, blkoff, slotno;
+    unsigned int blkcnt, blkoff, freecnt, slotno;
     pkgslot *oldslot;
+    int newpage = 0;
 
-    /* we always read all slots when writing, just in case */
+    /* the slots stay valid while nobody else changes the database */
     /* this also will set pkgdb->freeslot */
-    if (rpmpkgReadSlots(pkgdb)) {
+    if ((!pkgdb->slots || !pkgdb->freeslots) && rpmpkgReadSlots(pkgdb)) {
 	return RPMRC_FAIL;
     }
     blkcnt = (BLOBHEAD_SIZE + blobl + BLOBTAIL_SIZE + BLK_SIZE - 1) / BLK_SIZE;
     /* find a nice place for the blob */
-    if (rpmpkgFindEmptyOffset(pkgdb, pkgidx, blkcnt, &blkoff, &oldslot, 0)) {
+    if (rpmpkgFindEmptyOffset(pkgdb, pkgidx, blkcnt, &blkoff, &freecnt, &oldslot, 0)) {
 	return RPMRC_FAIL;
     }
     /* create new slot page if we don't have a free slot and can't reuse an old one */
     if (!oldslot && !pkgdb->freeslot) {
 	if (rpmpkgAddSlotPage(pkgdb)) {
+	    rpmpkgFreeSlots(pkgdb);
 	    return RPMRC_FAIL;
 	}
+	newpage = 1;
 	/* redo rpmpkgFindEmptyOffset to get another free area */
-	if (rpmpkgFindEmptyOffset(pkgdb, pkgidx, blkcnt, &blkoff, &oldslot, 0)) {
+	if (rpmpkgFindEmptyOffset(pkgdb, pkgidx, blkcnt, &blkoff, &freecnt, &oldslot, 0)) {
 	    return RPMRC_FAIL;
 	}
     }
@@ -1113,7 +1376,7 @@ static int rpmpkgPutInternal(rpmpkgdb pkgdb, unsigned int pkgidx, unsigned char
 	return RPMRC_FAIL;
     }
     /* write new blob */
-    if (rpmpkgWriteBlob(pkgdb, pkgidx, blkoff, blkcnt, blob, blobl, pkgdb->generation)) {
+    if (rpmpkgWriteBlob(pkgdb, pkgidx, blkoff, blkcnt, iov, niov, blobl, pkgdb->generation)) {
 	return RPMRC_FAIL;
     }
     /* write slot */
@@ -1122,15 +1385,13 @@ static int rpmpkgPutInternal(rpmpkgdb pkgdb, unsigned int pkgidx, unsigned char
 	return RPMRC_FAIL;
     }
     if (rpmpkgWriteslot(pkgdb, slotno, pkgidx, blkoff, blkcnt)) {
-	free(pkgdb->slots);
-	pkgdb->slots = 0;
+	rpmpkgFreeSlots(pkgdb);
 	return RPMRC_FAIL;
     }
     /* erase old blob */
     if (oldslot && oldslot->blkoff) {
 	if (rpmpkgDelBlob(pkgdb, pkgidx, oldslot->blkoff, oldslot->blkcnt)) {
-	    free(pkgdb->slots);
-	    pkgdb->slots = 0;
+	    rpmpkgFreeSlots(pkgdb);
 	    return RPMRC_FAIL;
 	}
     }
@@ -1139,9 +1400,13 @@ static int rpmpkgPutInternal(rpmpkgdb pkgdb, unsigned int pkgidx, unsigned char
 	oldslot->blkoff = blkoff;
 	oldslot->blkcnt = blkcnt;
 	pkgdb->ordered = 0;
+	pkgdb->extents_ok = 0;
+    } else if (newpage) {
+	/* we do not track the free slots of the new page */
+	rpmpkgFreeSlots(pkgdb);
     } else {
-	free(pkgdb->slots);
-	pkgdb->slots = 0;
+	rpmpkgUseExtent(pkgdb, blkoff, blkcnt, freecnt);
+	rpmpkgInsertSlot(pkgdb, pkgidx, blkoff, blkcnt, slotno);
     }
     return RPMRC_OK;
 }
@@ -1151,8 +1416,8 @@ static int rpmpkgDelInternal(rpmpkgdb pkgdb, unsigned int pkgidx)
     pkgslot *slot;
     unsigned int blkoff, blkcnt;
 
-    /* we always read all slots when writing, just in case */
-    if (rpmpkgReadSlots(pkgdb)) {
+    /* the slots stay valid while nobody else changes the database */
+    if ((!pkgdb->slots || !pkgdb->freeslots) && rpmpkgReadSlots(pkgdb)) {
 	return RPMRC_FAIL;
     }
     rpmpkgOrderSlots(pkgdb);
@@ -1161,11 +1426,17 @@ static int rpmpkgDelInternal(rpmpkgdb pkgdb, unsigned int pkgidx)
 	return RPMRC_OK;
     }
     if (rpmpkgWriteslot(pkgdb, slot->slotno, 0, 0, 0)) {
+	rpmpkgFreeSlots(pkgdb);
 	return RPMRC_FAIL;
     }
     if (rpmpkgDelBlob(pkgdb, pkgidx, slot->blkoff, slot->blkcnt)) {
+	rpmpkgFreeSlots(pkgdb);
 	return RPMRC_FAIL;
     }
+    if (pkgdb->freeslot)
+	pkgdb->freeslots[pkgdb->nfreeslots++] = pkgdb->freeslot;
+    pkgdb->freeslot = slot->slotno;
+    rpmpkgReleaseExtent(pkgdb, slot - pkgdb->slots);
     if (pkgdb->nslots > 1 && slot->blkoff < pkgdb->fileblks / 2) {
 	/* we freed a blob in the first half of our data. do some extra work */
 	int i;
@@ -1220,8 +1491,12 @@ static int rpmpkgDelInternal(rpmpkgdb pkgdb, unsigned int pkgidx)
 	    }
 	}
     }
-    free(pkgdb->slots);
-    pkgdb->slots = 0;
+    /* drop the emptied slot from our data */
+    slot = rpmpkgFindSlot(pkgdb, pkgidx);
+    if (slot)
+	rpmpkgRemoveSlot(pkgdb, slot);
+    if (!pkgdb->ordered)
+	pkgdb->extents_ok = 0;
     return RPMRC_OK;
 }
 
@@ -1264,6 +1539,67 @@ static int rpmpkgVerifyInternal(rpmpkgdb pkgdb)
     return RPMRC_OK;
 }
 
+static int compact_pkgidx_cmp(const void *a, const void *b)
+{
+    unsigned int pkgidxa = (*(const pkgslot **)a)->pkgidx;
+    unsigned int pkgidxb = (*(const pkgslot **)b)->pkgidx;
+    return pkgidxa > pkgidxb ? 1 : pkgidxa < pkgidxb ? -1 : 0;
+}
+
+/* Move up to maxmoves blobs towards a layout where all blobs are packed
+ * in pkgidx order right after the slot area */
+static int rpmpkgCompactInternal(rpmpkgdb pkgdb, unsigned int maxmoves, int *donep)
+{
+    unsigned int i, nslots, off, moves;
+    pkgslot **order = 0;
+    int rc = RPMRC_OK;
+
+    if ((!pkgdb->slots || !pkgdb->freeslots) && rpmpkgReadSlots(pkgdb))
+	return RPMRC_FAIL;
+    for (moves = 0; moves < maxmoves; moves++) {
+	pkgslot *slot, *last;
+	unsigned int newblkoff;
+
+	rpmpkgOrderSlots(pkgdb);
+	nslots = pkgdb->nslots;
+	order = xrealloc(order, (nslots + 1) * sizeof(*order));
+	for (i = 0; i < nslots; i++)
+	    order[i] = pkgdb->slots + i;
+	if (nslots > 1)
+	    qsort(order, nslots, sizeof(*order), compact_pkgidx_cmp);
+	/* skip the blobs that are already in place */
+	off = pkgdb->slotnpages * (PAGE_SIZE / BLK_SIZE);
+	for (i = 0; i < nslots && order[i]->blkoff == off; i++)
+	    off += order[i]->blkcnt;
+	if (i == nslots) {
+	    /* all packed, cut off the rest of the file */
+	    if (pkgdb->fileblks > off && !rpmpkgValidateZero(pkgdb, off, pkgdb->fileblks - off)) {
+		if (!ftruncate(pkgdb->fd, (off_t)off * BLK_SIZE))
+		    pkgdb->fileblks = off;
+	    }
+	    *donep = 1;
+	    break;
+	}
+	/* the packed blobs come first in blk order, so this is the next one */
+	slot = pkgdb->slots + i;
+	if (slot->blkoff < off + order[i]->blkcnt) {
+	    /* in the way of order[i] (or order[i] itself): move behind the last blob */
+	    last = pkgdb->slots + nslots - 1;
+	    newblkoff = last->blkoff + last->blkcnt;
+	} else {
+	    slot = order[i];
+	    newblkoff = off;
+	}
+	if (rpmpkgValidateZero(pkgdb, newblkoff, slot->blkcnt) || rpmpkgMoveBlob(pkgdb, slot, newblkoff)) {
+	    rpmpkgFreeSlots(pkgdb);
+	    rc = RPMRC_FAIL;
+	    break;
+	}
+    }
+    free(order);
+    return rc;
+}
+
 int rpmpkgGet(rpmpkgdb pkgdb, unsigned int pkgidx, unsigned char **blobp, unsigned int *bloblp)
 {
     int rc;
@@ -1279,7 +1615,7 @@ int rpmpkgGet(rpmpkgdb pkgdb, unsigned int pkgidx, unsigned char **blobp, unsign
     return rc;
 }
 
-int rpmpkgPut(rpmpkgdb pkgdb, unsigned int pkgidx, unsigned char *blob, unsigned int blobl)
+int rpmpkgPutIov(rpmpkgdb pkgdb, unsigned int pkgidx, const struct iovec *iov, int niov, unsigned int blobl)
 {
     int rc;
 
@@ -1288,11 +1624,17 @@ int rpmpkgPut(rpmpkgdb pkgdb, unsigned int pkgidx, unsigned char *blob, unsigned
     }
     if (rpmpkgLockReadHeader(pkgdb, 1))
 	return RPMRC_FAIL;
-    rc = rpmpkgPutInternal(pkgdb, pkgidx, blob, blobl);
+    rc = rpmpkgPutInternal(pkgdb, pkgidx, iov, niov, blobl);
     rpmpkgUnlock(pkgdb, 1);
     return rc;
 }
 
+int rpmpkgPut(rpmpkgdb pkgdb, unsigned int pkgidx, unsigned char *blob, unsigned int blobl)
+{
+    struct iovec iov = { .iov_base = blob, .iov_len = blobl };
+    return rpmpkgPutIov(pkgdb, pkgidx, &iov, 1, blobl);
+}
+
 int rpmpkgDel(rpmpkgdb pkgdb, unsigned int pkgidx)
 {
     int rc;
@@ -1354,9 +1696,20 @@ int rpmpkgGeneration(rpmpkgdb pkgdb, unsigned int *generationp)
     return RPMRC_OK;
 }
 
+int rpmpkgCompact(rpmpkgdb pkgdb, unsigned int maxmoves, int *donep)
+{
+    int rc;
+    *donep = 0;
+    if (rpmpkgLockReadHeader(pkgdb, 1))
+	return RPMRC_FAIL;
+    rc = rpmpkgCompactInternal(pkgdb, maxmoves, donep);
+    rpmpkgUnlock(pkgdb, 1);
+    return rc;
+}
+
 int rpmpkgStats(rpmpkgdb pkgdb)
 {
-    unsigned int usedblks = 0;
+    unsigned int usedblks = 0, freeblks = 0, maxfreeblks = 0, nextents = 0;
     int i;
 
     if (rpmpkgLockReadHeader(pkgdb, 0))
@@ -1367,6 +1720,15 @@ int rpmpkgStats(rpmpkgdb pkgdb)
     }
     for (i = 0; i < pkgdb->nslots; i++)
 	usedblks += pkgdb->slots[i].blkcnt;
+    rpmpkgBuildExtents(pkgdb);
+    for (i = 0; i < EXTENT_BUCKETS; i++) {
+	unsigned int j, n = pkgdb->nextents[i];
+	for (j = 0; j < n; j++)
+	    freeblks += pkgdb->extents[i][j].blkcnt;
+	if (n && pkgdb->extents[i][n - 1].blkcnt > maxfreeblks)
+	    maxfreeblks = pkgdb->extents[i][n - 1].blkcnt;
+	nextents += n;
+    }
     printf("--- Package DB Stats\n");
     printf("Filename: %s\n", pkgdb->filename);
     printf("Generation: %d\n", pkgdb->generation);
@@ -1375,6 +1737,10 @@ int rpmpkgStats(rpmpkgdb pkgdb)
     printf("Free slots: %d\n", pkgdb->slotnpages * (PAGE_SIZE / SLOT_SIZE) - pkgdb->nslots);
     printf("Blob area size: %d\n", (pkgdb->fileblks - pkgdb->slotnpages * (PAGE_SIZE / BLK_SIZE)) * BLK_SIZE);
     printf("Blob area used: %d\n", usedblks * BLK_SIZE);
+    printf("Free extents: %d\n", nextents);
+    printf("Free extent area: %d\n", freeblks * BLK_SIZE);
+    printf("Largest free extent: %d\n", maxfreeblks * BLK_SIZE);
+    printf("Fragmentation: %d%%\n", freeblks ? 100 - (int)((unsigned long long)maxfreeblks * 100 / freeblks) : 0);
     rpmpkgUnlock(pkgdb, 0);
     return RPMRC_OK;
 }
@@ -1,4 +1,5 @@
 struct rpmpkgdb_s;
+struct iovec;
 typedef struct rpmpkgdb_s *rpmpkgdb;
 
 int rpmpkgOpen(rpmpkgdb *pkgdbp, const char *filename, int flags, int mode);
@@ -11,6 +12,7 @@ int rpmpkgUnlock(rpmpkgdb pkgdb, int excl);
 
 int rpmpkgGet(rpmpkgdb pkgdb, unsigned int pkgidx, unsigned char **blobp, unsigned int *bloblp);
 int rpmpkgPut(rpmpkgdb pkgdb, unsigned int pkgidx, unsigned char *blob, unsigned int blobl);
+int rpmpkgPutIov(rpmpkgdb pkgdb, unsigned int pkgidx, const struct iovec *iov, int niov, unsigned int blobl);
 int rpmpkgDel(rpmpkgdb pkgdb, unsigned int pkgidx);
 int rpmpkgList(rpmpkgdb pkgdb, unsigned int **pkgidxlistp, unsigned int *npkgidxlistp);
 int rpmpkgVerify(rpmpkgdb pkgdb);
@@ -19,4 +21,5 @@ int rpmpkgNextPkgIdx(rpmpkgdb pkgdb, unsigned int *pkgidxp);
 int rpmpkgGeneration(rpmpkgdb pkgdb, unsigned int *generationp);
 
 int rpmpkgStats(rpmpkgdb pkgdb);
+int rpmpkgCompact(rpmpkgdb pkgdb, unsigned int maxmoves, int *donep);
 
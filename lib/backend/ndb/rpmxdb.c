@@ -51,6 +51,7 @@ typedef struct rpmxdb_s {
 	unsigned int subtag;
 	unsigned char *mapped;
 	int mapflags;
+	int advice;		/* RPMXDB_ADVISE_*, reapplied on every (re)map */
 	unsigned int startpage;
 	unsigned int pagecnt;
 	void (*mapcallback)(rpmxdb xdb, void *data, void *newaddr, size_t newsize);
@@ -64,6 +65,11 @@ typedef struct rpmxdb_s {
     unsigned int systempagesize;
     int dofsync;
     unsigned int locked_excl;
+
+    /* mapping statistics, see rpmxdbStats */
+    unsigned int nmaps;
+    unsigned int nremaps;
+    unsigned int nmoves;
 } *rpmxdb;
 
 
@@ -155,6 +161,42 @@ static void unmapheader(rpmxdb xdb)
     xdb->mappedlen = 0;
 }
 
+/* pass the access pattern hint of a slot on to the kernel */
+static void adviseslot(rpmxdb xdb, struct xdb_slot *slot)
+{
+#ifdef POSIX_MADV_RANDOM
+    unsigned char *mapped = slot->mapped;
+    size_t size;
+    int advice;
+
+    if (!mapped || !slot->pagecnt)
+	return;
+    switch (slot->advice) {
+    case RPMXDB_ADVISE_RANDOM:
+	advice = POSIX_MADV_RANDOM;
+	break;
+    case RPMXDB_ADVISE_SEQUENTIAL:
+	advice = POSIX_MADV_SEQUENTIAL;
+	break;
+    case RPMXDB_ADVISE_WILLNEED:
+	advice = POSIX_MADV_WILLNEED;
+	break;
+    default:
+	advice = POSIX_MADV_NORMAL;
+	break;
+    }
+    size = slot->pagecnt * xdb->pagesize;
+    if (xdb->pagesize != xdb->systempagesize) {
+	size_t off = slot->startpage * xdb->pagesize;
+	size_t shift = off & (xdb->systempagesize - 1);
+	size += shift;
+	size = ROUNDTOSYSTEMPAGE(xdb, size);
+	mapped -= shift;
+    }
+    (void) posix_madvise(mapped, size, advice);
+#endif
+}
+
 /* slot mapping functions */
 static int mapslot(rpmxdb xdb, struct xdb_slot *slot)
 {
@@ -176,6 +218,9 @@ static int mapslot(rpmxdb xdb, struct xdb_slot *slot)
     if (mapped == MAP_FAILED)
 	return RPMRC_FAIL;
     slot->mapped = (unsigned char *)mapped + shift;
+    xdb->nmaps++;
+    if (slot->advice)
+	adviseslot(xdb, slot);
     return RPMRC_OK;
 }
 
@@ -219,6 +264,9 @@ static int remapslot(rpmxdb xdb, struct xdb_slot *slot, unsigned int newpagecnt)
 	return RPMRC_FAIL;
     slot->mapped = (unsigned char *)mapped + shift;
     slot->pagecnt = newpagecnt;
+    xdb->nremaps++;
+    if (slot->advice)
+	adviseslot(xdb, slot);
     return RPMRC_OK;
 }
 
@@ -366,6 +414,7 @@ static int rpmxdbReadHeader(rpmxdb xdb, int rw)
 		nslot = slots + i;
 		if (slot->mapcallback) {
 		    nslot->mapflags = slot->mapflags;
+		    nslot->advice = slot->advice;
 		    nslot->mapcallback = slot->mapcallback;
 		    nslot->mapcallbackdata = slot->mapcallbackdata;
 		}
@@ -646,6 +695,7 @@ static int moveblobto(rpmxdb xdb, struct xdb_slot *oldslot, struct xdb_slot *aft
     /* make sure there's enough room */
     if (newpagecnt > nextslot->startpage - newstartpage)
 	return RPMRC_FAIL;
+    xdb->nmoves++;
 
 #if 0
     printf("moveblobto %d %d %d %d, afterslot %d\n", oldslot->startpage, oldslot->pagecnt, newstartpage, newpagecnt, afterslot->slotno);
@@ -1149,6 +1199,27 @@ int rpmxdbUnmapBlob(rpmxdb xdb, unsigned int id)
     slot->mapcallback = 0;
     slot->mapcallbackdata = 0;
     slot->mapflags = 0;
+    slot->advice = 0;
+    rpmxdbUnlock(xdb, 0);
+    return RPMRC_OK;
+}
+
+int rpmxdbAdviseBlob(rpmxdb xdb, unsigned int id, int advice)
+{
+    struct xdb_slot *slot;
+    if (!id)
+	return RPMRC_FAIL;
+    if (rpmxdbLockReadHeader(xdb, 0))
+        return RPMRC_FAIL;
+    if (id >= xdb->nslots) {
+	rpmxdbUnlock(xdb, 0);
+	return RPMRC_FAIL;
+    }
+    slot = xdb->slots + id;
+    if (slot->advice != advice || advice == RPMXDB_ADVISE_WILLNEED) {
+	slot->advice = advice;
+	adviseslot(xdb, slot);
+    }
     rpmxdbUnlock(xdb, 0);
     return RPMRC_OK;
 }
@@ -1289,6 +1360,7 @@ int rpmxdbStats(rpmxdb xdb)
     printf("Blob pages: %d\n", xdb->usedblobpages);
     printf("Free pages: %d\n", xdb->slots[nslots].startpage - xdb->usedblobpages - xdb->slotnpages);
     printf("Pagesize: %d / %d\n", xdb->pagesize, xdb->systempagesize);
+    printf("Maps: %u, remaps: %u, moves: %u\n", xdb->nmaps, xdb->nremaps, xdb->nmoves);
     for (i = 1, slot = xdb->slots + i; i < nslots; i++, slot++) {
 	if (!slot->startpage)
 	    continue;
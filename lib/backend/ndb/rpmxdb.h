@@ -19,6 +19,14 @@ int rpmxdbDelAllBlobs(rpmxdb xdb);
 int rpmxdbMapBlob(rpmxdb xdb, unsigned int id, int flags, void (*mapcallback)(rpmxdb xdb, void *data, void *newaddr, size_t newsize), void *mapcallbackdata);
 int rpmxdbUnmapBlob(rpmxdb xdb, unsigned int id);
 
+/* access pattern hints for mapped blobs */
+#define RPMXDB_ADVISE_NORMAL		0
+#define RPMXDB_ADVISE_RANDOM		1
+#define RPMXDB_ADVISE_SEQUENTIAL	2
+#define RPMXDB_ADVISE_WILLNEED		3
+
+int rpmxdbAdviseBlob(rpmxdb xdb, unsigned int id, int advice);
+
 int rpmxdbResizeBlob(rpmxdb xdb, unsigned int id, size_t newsize);
 int rpmxdbRenameBlob(rpmxdb xdb, unsigned int *idp, unsigned int blobtag, unsigned int subtag);
 
@@ -2,6 +2,7 @@
 
 #include <sqlite3.h>
 #include <fcntl.h>
+#include <zlib.h>
 
 #include <rpm/rpmlog.h>
 #include <rpm/rpmfileutil.h>
@@ -13,13 +14,31 @@
 
 static const int sleep_ms = 50;
 
+/* Maximum number of idle prepared statements kept per connection */
+static const int stmt_cache_max = 32;
+
+struct stmtCacheEntry_s {
+    const char *file;
+    const char *fmt;
+    sqlite3_stmt *stmt;
+    struct stmtCacheEntry_s *next;
+};
+
+/* Idle prepared statements, keyed by table and query shape */
+struct stmtCache_s {
+    struct stmtCacheEntry_s *entries;
+    int nentries;
+};
+
 struct dbiCursor_s {
+    dbiIndex dbi;
     sqlite3 *sdb;
     sqlite3_stmt *stmt;
     const char *fmt;
     int flags;
     rpmTagVal tag;
     int ctype;
+    int trusted;
     struct dbiCursor_s *subc;
 
     const void *key;
@@ -71,18 +90,88 @@ static int dbiCursorResult(dbiCursor dbc)
     return err ? RPMRC_FAIL : RPMRC_OK;
 }
 
+static sqlite3_stmt *stmtCacheGet(rpmdb rdb, const char *file, const char *fmt)
+{
+    struct stmtCache_s *cache = rdb->db_cache;
+    sqlite3_stmt *stmt = NULL;
+
+    if (cache) {
+	struct stmtCacheEntry_s **prev = &cache->entries;
+	for (struct stmtCacheEntry_s *e = cache->entries; e; e = e->next) {
+	    if (e->fmt == fmt && rstreq(e->file, file)) {
+		stmt = e->stmt;
+		*prev = e->next;
+		cache->nentries--;
+		free(e);
+		break;
+	    }
+	    prev = &e->next;
+	}
+    }
+    return stmt;
+}
+
+static void stmtCachePut(rpmdb rdb, const char *file, const char *fmt,
+			 sqlite3_stmt *stmt)
+{
+    struct stmtCache_s *cache = rdb->db_cache;
+
+    if (cache == NULL)
+	cache = rdb->db_cache = xcalloc(1, sizeof(*cache));
+
+    if (fmt == NULL || cache->nentries >= stmt_cache_max) {
+	sqlite3_finalize(stmt);
+    } else {
+	struct stmtCacheEntry_s *e = xmalloc(sizeof(*e));
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+	e->file = file;
+	e->fmt = fmt;
+	e->stmt = stmt;
+	e->next = cache->entries;
+	cache->entries = e;
+	cache->nentries++;
+    }
+}
+
+static void stmtCacheFree(rpmdb rdb)
+{
+    struct stmtCache_s *cache = rdb->db_cache;
+
+    if (cache) {
+	struct stmtCacheEntry_s *e, *next;
+	for (e = cache->entries; e; e = next) {
+	    next = e->next;
+	    sqlite3_finalize(e->stmt);
+	    free(e);
+	}
+	free(cache);
+	rdb->db_cache = NULL;
+    }
+}
+
+/*
+ * Prepare the cursor statement. Statements are cached by their format,
+ * so any varying arguments other than the table name must be bound.
+ */
 static int dbiCursorPrep(dbiCursor dbc, const char *fmt, ...)
 {
     if (dbc->stmt == NULL) {
-	char *cmd = NULL;
-	va_list ap;
+	dbiIndex dbi = dbc->dbi;
 
-	va_start(ap, fmt); 
-	cmd = sqlite3_vmprintf(fmt, ap);
-	va_end(ap);
+	dbc->stmt = stmtCacheGet(dbi->dbi_rpmdb, dbi->dbi_file, fmt);
+	if (dbc->stmt == NULL) {
+	    char *cmd = NULL;
+	    va_list ap;
 
-	sqlite3_prepare_v2(dbc->sdb, cmd, -1, &dbc->stmt, NULL);
-	sqlite3_free(cmd);
+	    va_start(ap, fmt); 
+	    cmd = sqlite3_vmprintf(fmt, ap);
+	    va_end(ap);
+
+	    sqlite3_prepare_v2(dbc->sdb, cmd, -1, &dbc->stmt, NULL);
+	    sqlite3_free(cmd);
+	}
+	dbc->fmt = fmt;
     } else {
 	dbiCursorReset(dbc);
     }
@@ -175,13 +264,27 @@ static int sqlite_init(rpmdb rdb, const char * dbhome)
 	sqlexec(sdb, "PRAGMA secure_delete = OFF");
 	sqlexec(sdb, "PRAGMA case_sensitive_like = ON");
 
+	/* Optional tuning */
+	if (rpmMacroIsDefined(NULL, "_sqlite_mmap_size"))
+	    sqlexec(sdb, "PRAGMA mmap_size = %lld",
+		    (long long) rpmExpandNumeric("%{_sqlite_mmap_size}"));
+	if (rpmMacroIsDefined(NULL, "_sqlite_cache_size"))
+	    sqlexec(sdb, "PRAGMA cache_size = %d",
+		    rpmExpandNumeric("%{_sqlite_cache_size}"));
+	if (rpmMacroIsDefined(NULL, "_sqlite_temp_store"))
+	    sqlexec(sdb, "PRAGMA temp_store = %d",
+		    rpmExpandNumeric("%{_sqlite_temp_store}"));
+
 	if (sqlite3_db_readonly(sdb, NULL) == 0) {
 	    if (sqlexec(sdb, "PRAGMA journal_mode = WAL") == 0) {
 		int one = 1;
+		int ckpt = 10000;
 		/* Annoying but necessary to support non-privileged readers */
 		sqlite3_file_control(sdb, NULL, SQLITE_FCNTL_PERSIST_WAL, &one);
 		/* Sqlite default threshold is way too low for rpmdb */
-		sqlexec(sdb, "PRAGMA wal_autocheckpoint = 10000");
+		if (rpmMacroIsDefined(NULL, "_sqlite_wal_autocheckpoint"))
+		    ckpt = rpmExpandNumeric("%{_sqlite_wal_autocheckpoint}");
+		sqlexec(sdb, "PRAGMA wal_autocheckpoint = %d", ckpt);
 	    }
 	}
 
@@ -194,6 +297,27 @@ exit:
     return rc;
 }
 
+/* Checkpoint mode used on close, TRUNCATE unless configured otherwise */
+static const char *walCheckpointMode(void)
+{
+    static const char * const modes[] = {
+	"PASSIVE", "FULL", "RESTART", "TRUNCATE", NULL
+    };
+    const char *mode = NULL;
+    char *val = rpmExpand("%{?_sqlite_wal_checkpoint}", NULL);
+
+    for (const char * const *m = modes; *val && *m; m++) {
+	if (rstrcasecmp(val, *m) == 0) {
+	    mode = *m;
+	    break;
+	}
+    }
+    if (*val && mode == NULL)
+	rpmlog(RPMLOG_WARNING, _("invalid sqlite checkpoint mode: %s\n"), val);
+    free(val);
+    return mode ? mode : "TRUNCATE";
+}
+
 static int sqlite_fini(rpmdb rdb)
 {
     int rc = 0;
@@ -202,9 +326,15 @@ static int sqlite_fini(rpmdb rdb)
 	if (rdb->db_opens > 1) {
 	    rdb->db_opens--;
 	} else {
+	    stmtCacheFree(rdb);
 	    if (sqlite3_db_readonly(sdb, NULL) == 0) {
 		sqlexec(sdb, "PRAGMA optimize");
-		sqlexec(sdb, "PRAGMA wal_checkpoint = TRUNCATE");
+		/*
+		 * Don't wait for readers holding on to older snapshots,
+		 * the WAL gets checkpointed on a later close then.
+		 */
+		sqlite3_busy_timeout(sdb, 0);
+		sqlexec(sdb, "PRAGMA wal_checkpoint = %s", walCheckpointMode());
 	    }
 	    rdb->db_dbenv = NULL;
 	    int xx = sqlite3_close(sdb);
@@ -251,12 +381,68 @@ static int dbiExists(dbiIndex dbi)
     return (rc == 0);
 }
 
+/*
+ * Blob checksums live in a table of their own, so databases stay usable
+ * by versions not knowing about them. Those don't update the checksums,
+ * which then just fail to match.
+ */
+static int init_sums(dbiIndex dbi)
+{
+    int rc = 0;
+
+    if (sqlite3_db_readonly(dbi->dbi_db, NULL) != 1) {
+	rc = sqlexec(dbi->dbi_db,
+			"CREATE TABLE IF NOT EXISTS 'PackageSums' ("
+			    "hnum INTEGER PRIMARY KEY, "
+			    "sum INTEGER NOT NULL"
+			")");
+    }
+
+    if (!rc && sqlite3_table_column_metadata(dbi->dbi_db, NULL, "PackageSums",
+				"sum", NULL, NULL, NULL, NULL, NULL) == 0) {
+	dbi->dbi_flags |= DBI_BLOBSUMS;
+    }
+    return rc;
+}
+
+static unsigned int blobSum(const void *blob, unsigned int bloblen)
+{
+    return adler32(adler32(0L, Z_NULL, 0), blob, bloblen);
+}
+
+/* Is an index table stored in key order, without a separate key index? */
+static int isClustered(dbiIndex dbi)
+{
+    sqlite3_stmt *stmt = NULL;
+    int clustered = 0;
+
+    if (sqlite3_prepare_v2(dbi->dbi_db,
+		"SELECT sql FROM sqlite_master WHERE type='table' AND name=?",
+		-1, &stmt, NULL) == SQLITE_OK &&
+	    sqlite3_bind_text(stmt, 1, dbi->dbi_file, -1, NULL) == SQLITE_OK &&
+	    sqlite3_step(stmt) == SQLITE_ROW) {
+	const char *sql = (const char *) sqlite3_column_text(stmt, 0);
+	clustered = (sql && strstr(sql, "WITHOUT ROWID") != NULL);
+    }
+    sqlite3_finalize(stmt);
+    return clustered;
+}
+
 static int init_table(dbiIndex dbi, rpmTagVal tag)
 {
     int rc = 0;
 
-    if (dbiExists(dbi))
-	return 0;
+    if (dbi->dbi_type == DBI_PRIMARY)
+	rc = init_sums(dbi);
+
+    if (rc)
+	return rc;
+
+    if (dbiExists(dbi)) {
+	if (dbi->dbi_type == DBI_SECONDARY && isClustered(dbi))
+	    dbi->dbi_flags |= DBI_CLUSTERED;
+	return rc;
+    }
 
     if (dbi->dbi_type == DBI_PRIMARY) {
 	rc = sqlexec(dbi->dbi_db,
@@ -266,6 +452,11 @@ static int init_table(dbiIndex dbi, rpmTagVal tag)
 			")",
 			dbi->dbi_file);
     } else {
+	/*
+	 * Index tables are kept in key order by their primary key, so they
+	 * don't need a key index next to the table. Databases from before
+	 * have rowid tables and a key index, both work.
+	 */
 	const char *keytype = (rpmTagGetClass(tag) == RPM_STRING_CLASS) ?
 				"TEXT" : "BLOB";
 	rc = sqlexec(dbi->dbi_db,
@@ -273,9 +464,12 @@ static int init_table(dbiIndex dbi, rpmTagVal tag)
 			    "key '%q' NOT NULL, "
 			    "hnum INTEGER NOT NULL, "
 			    "idx INTEGER NOT NULL, "
+			    "PRIMARY KEY (key, hnum, idx), "
 			    "FOREIGN KEY (hnum) REFERENCES 'Packages'(hnum)"
-			")",
+			") WITHOUT ROWID",
 			dbi->dbi_file, keytype);
+	if (!rc)
+	    dbi->dbi_flags |= DBI_CLUSTERED;
     }
     if (!rc)
 	dbi->dbi_flags |= DBI_CREATED;
@@ -301,7 +495,7 @@ static int init_index(dbiIndex dbi, rpmTagVal tag)
     if (dbi->dbi_type == DBI_SECONDARY) {
 	int string = (rpmTagGetClass(tag) == RPM_STRING_CLASS);
 	int array = (rpmTagGetReturnType(tag) == RPM_ARRAY_RETURN_TYPE);
-	if (!rc && string)
+	if (!rc && string && !(dbi->dbi_flags & DBI_CLUSTERED))
 	    rc = create_index(dbi->dbi_db, dbi->dbi_file, "key");
 	if (!rc && array)
 	    rc = create_index(dbi->dbi_db, dbi->dbi_file, "hnum");
@@ -395,6 +589,21 @@ static void sqlite_SetFSync(rpmdb rdb, int enable)
 	    "PRAGMA synchronous = %s", enable ? "FULL" : "OFF");
 }
 
+static int walMode(sqlite3 *sdb)
+{
+    sqlite3_stmt *stmt = NULL;
+    int wal = 0;
+
+    if (sqlite3_prepare_v2(sdb, "PRAGMA journal_mode", -1, &stmt, NULL) == 0) {
+	if (sqlite3_step(stmt) == SQLITE_ROW) {
+	    const char *mode = (const char *) sqlite3_column_text(stmt, 0);
+	    wal = (mode && rstrcasecmp(mode, "wal") == 0);
+	}
+	sqlite3_finalize(stmt);
+    }
+    return wal;
+}
+
 static int sqlite_Ctrl(rpmdb rdb, dbCtrlOp ctrl)
 {
     int rc = 0;
@@ -406,6 +615,18 @@ static int sqlite_Ctrl(rpmdb rdb, dbCtrlOp ctrl)
     case DB_CTRL_UNLOCK_RW:
 	rc = sqlexec(rdb->db_dbenv, "RELEASE 'rwlock'");
 	break;
+    case DB_CTRL_SNAPSHOT:
+	/*
+	 * In WAL mode a read transaction sees one snapshot throughout,
+	 * in the other modes it would hold off the writers.
+	 */
+	if (sqlite3_get_autocommit(rdb->db_dbenv) && walMode(rdb->db_dbenv))
+	    rc = sqlexec(rdb->db_dbenv, "BEGIN DEFERRED");
+	break;
+    case DB_CTRL_UNSNAPSHOT:
+	if (!sqlite3_get_autocommit(rdb->db_dbenv))
+	    rc = sqlexec(rdb->db_dbenv, "COMMIT");
+	break;
     default:
 	break;
     }
@@ -416,6 +637,7 @@ static int sqlite_Ctrl(rpmdb rdb, dbCtrlOp ctrl)
 static dbiCursor sqlite_CursorInit(dbiIndex dbi, unsigned int flags)
 {
     dbiCursor dbc = xcalloc(1, sizeof(*dbc));
+    dbc->dbi = dbi;
     dbc->sdb = dbi->dbi_db;
     dbc->flags = flags;
     dbc->tag = rpmTagGetValue(dbi->dbi_file);
@@ -432,7 +654,8 @@ static dbiCursor sqlite_CursorInit(dbiIndex dbi, unsigned int flags)
 static dbiCursor sqlite_CursorFree(dbiIndex dbi, dbiCursor dbc)
 {
     if (dbc) {
-	sqlite3_finalize(dbc->stmt);
+	if (dbc->stmt)
+	    stmtCachePut(dbi->dbi_rpmdb, dbi->dbi_file, dbc->fmt, dbc->stmt);
 	if (dbc->subc)
 	    dbiCursorFree(dbi, dbc->subc);
 	if (dbc->flags & DBC_WRITE)
@@ -470,6 +693,20 @@ static rpmRC sqlite_pkgdbPut(dbiIndex dbi, dbiCursor dbc,  unsigned int *hdrNum,
 
     rc = dbiCursorResult(dbc);
 
+    if (!rc && (dbi->dbi_flags & DBI_BLOBSUMS)) {
+	dbiCursor sc = dbiCursorInit(dbi, 0);
+	rc = dbiCursorPrep(sc, "INSERT OR REPLACE INTO 'PackageSums' "
+				"VALUES(?, ?)");
+	if (!rc)
+	    rc = sqlite3_bind_int(sc->stmt, 1, *hdrNum);
+	if (!rc)
+	    rc = sqlite3_bind_int64(sc->stmt, 2, blobSum(hdrBlob, hdrLen));
+	if (!rc)
+	    while ((rc = sqlite3_step(sc->stmt)) == SQLITE_ROW) {};
+	rc = dbiCursorResult(sc);
+	dbiCursorFree(dbi, sc);
+    }
+
     if (dbwc)
 	dbiCursorFree(dbi, dbwc);
 
@@ -487,26 +724,53 @@ static rpmRC sqlite_pkgdbDel(dbiIndex dbi, dbiCursor dbc,  unsigned int hdrNum)
     if (!rc)
 	while ((rc = sqlite3_step(dbc->stmt)) == SQLITE_ROW) {};
 
-    return dbiCursorResult(dbc);
+    rc = dbiCursorResult(dbc);
+
+    if (!rc && (dbi->dbi_flags & DBI_BLOBSUMS)) {
+	dbiCursor sc = dbiCursorInit(dbi, 0);
+	rc = dbiCursorPrep(sc, "DELETE FROM 'PackageSums' WHERE hnum=?");
+	if (!rc)
+	    rc = dbiCursorBindPkg(sc, hdrNum, NULL, 0);
+	if (!rc)
+	    while ((rc = sqlite3_step(sc->stmt)) == SQLITE_ROW) {};
+	rc = dbiCursorResult(sc);
+	dbiCursorFree(dbi, sc);
+    }
+
+    return rc;
 }
 
 static rpmRC sqlite_stepPkg(dbiCursor dbc, unsigned char **hdrBlob, unsigned int *hdrLen)
 {
     int rc = sqlite3_step(dbc->stmt);
 
+    dbc->trusted = 0;
     if (rc == SQLITE_ROW) {
+	const void *blob = sqlite3_column_blob(dbc->stmt, 1);
+	unsigned int bloblen = sqlite3_column_bytes(dbc->stmt, 1);
+
+	/* The checksum, if any, comes from the joined sums table */
+	if (sqlite3_column_count(dbc->stmt) > 2 &&
+		sqlite3_column_type(dbc->stmt, 2) == SQLITE_INTEGER) {
+	    unsigned int sum = sqlite3_column_int64(dbc->stmt, 2);
+	    dbc->trusted = (sum == blobSum(blob, bloblen));
+	}
 	if (hdrLen)
-	    *hdrLen = sqlite3_column_bytes(dbc->stmt, 1);
+	    *hdrLen = bloblen;
 	if (hdrBlob)
-	    *hdrBlob = (void *) sqlite3_column_blob(dbc->stmt, 1);
+	    *hdrBlob = (void *) blob;
     }
     return rc;
 }
 
 static rpmRC sqlite_pkgdbByKey(dbiIndex dbi, dbiCursor dbc, unsigned int hdrNum, unsigned char **hdrBlob, unsigned int *hdrLen)
 {
-    int rc = dbiCursorPrep(dbc, "SELECT hnum, blob FROM '%q' WHERE hnum=?",
-				dbi->dbi_file);
+    int rc = (dbi->dbi_flags & DBI_BLOBSUMS) ?
+	dbiCursorPrep(dbc, "SELECT hnum, blob, sum FROM '%q' "
+			    "LEFT JOIN 'PackageSums' USING (hnum) WHERE hnum=?",
+			    dbi->dbi_file) :
+	dbiCursorPrep(dbc, "SELECT hnum, blob FROM '%q' WHERE hnum=?",
+			    dbi->dbi_file);
 
     if (!rc)
 	rc = dbiCursorBindPkg(dbc, hdrNum, NULL, 0);
@@ -521,7 +785,11 @@ static rpmRC sqlite_pkgdbIter(dbiIndex dbi, dbiCursor dbc,
 				unsigned char **hdrBlob, unsigned int *hdrLen)
 {
     int rc = RPMRC_OK;
-    if (dbc->stmt == NULL) {
+    if (dbc->stmt == NULL && (dbi->dbi_flags & DBI_BLOBSUMS)) {
+	rc = dbiCursorPrep(dbc, "SELECT hnum, blob, sum FROM '%q' "
+				"LEFT JOIN 'PackageSums' USING (hnum)",
+				dbi->dbi_file);
+    } else if (dbc->stmt == NULL) {
 	rc = dbiCursorPrep(dbc, "SELECT hnum, blob FROM '%q'", dbi->dbi_file);
     }
 
@@ -555,6 +823,11 @@ static unsigned int sqlite_pkgdbKey(dbiIndex dbi, dbiCursor dbc)
     return sqlite3_column_int(dbc->stmt, 0);
 }
 
+static int sqlite_pkgdbTrusted(dbiIndex dbi, dbiCursor dbc)
+{
+    return dbc->trusted;
+}
+
 static rpmRC sqlite_idxdbByKey(dbiIndex dbi, dbiCursor dbc,
 			    const char *keyp, size_t keylen, int searchType,
 			    dbiIndexSet *set)
@@ -563,9 +836,15 @@ static rpmRC sqlite_idxdbByKey(dbiIndex dbi, dbiCursor dbc,
 
     if (searchType == DBC_PREFIX_SEARCH) {
 	rc = dbiCursorPrep(dbc, "SELECT hnum, idx FROM '%q' "
-				"WHERE MATCH(key,'%q',%d) "
+				"WHERE MATCH(key,?,?) "
 				"ORDER BY key",
-				dbi->dbi_file, keyp, keylen);
+				dbi->dbi_file);
+	if (!rc)
+	    rc = sqlite3_bind_blob(dbc->stmt, 1, keyp, keylen, NULL);
+	if (!rc)
+	    rc = sqlite3_bind_int(dbc->stmt, 2, keylen);
+	if (!rc)
+	    rc = dbiCursorResult(dbc);
     } else {
 	rc = dbiCursorPrep(dbc, "SELECT hnum, idx FROM '%q' WHERE key=?",
 			dbi->dbi_file);
@@ -642,9 +921,130 @@ static rpmRC sqlite_idxdbGet(dbiIndex dbi, dbiCursor dbc, const char *keyp, size
     return rc;
 }
 
+static rpmRC sqlite_idxdbCount(dbiIndex dbi, dbiCursor dbc,
+			    const char *keyp, size_t keylen,
+			    unsigned int *count)
+{
+    int rc = dbiCursorPrep(dbc, "SELECT COUNT(*) FROM '%q' WHERE key=?",
+			   dbi->dbi_file);
+
+    *count = 0;
+    if (!rc)
+	rc = dbiCursorBindIdx(dbc, keyp, keylen, NULL);
+    if (!rc) {
+	rc = sqlite3_step(dbc->stmt);
+	if (rc == SQLITE_ROW) {
+	    *count = sqlite3_column_int(dbc->stmt, 0);
+	    rc = (*count > 0) ? RPMRC_OK : RPMRC_NOTFOUND;
+	} else {
+	    rc = dbiCursorResult(dbc);
+	}
+    }
+
+    return rc;
+}
+
+#define Q4	"?,?,?,?"
+#define Q16	Q4 "," Q4 "," Q4 "," Q4
+#define BATCH_KEYS	32
+
+static rpmRC sqlite_idxdbGetBatch(dbiIndex dbi, dbiCursor dbc,
+			    const char **keys, const size_t *keylens,
+			    int nkeys, dbiIndexSet *sets)
+{
+    /* Fixed shape so the statement is cached, unused slots stay NULL */
+    static const char *fmt = "SELECT key, hnum, idx FROM '%q' "
+			     "WHERE key IN (" Q16 "," Q16 ")";
+    dbiCursor bc = dbiCursorInit(dbi, 0);
+    int rc = RPMRC_OK;
+
+    for (int i = 0; i < nkeys && !rc; i += BATCH_KEYS) {
+	int n = (nkeys - i < BATCH_KEYS) ? nkeys - i : BATCH_KEYS;
+
+	rc = dbiCursorPrep(bc, fmt, dbi->dbi_file);
+	for (int j = 0; j < n && !rc; j++) {
+	    if (bc->ctype == SQLITE_TEXT) {
+		rc = sqlite3_bind_text(bc->stmt, j + 1, keys[i + j],
+					keylens[i + j], NULL);
+	    } else {
+		rc = sqlite3_bind_blob(bc->stmt, j + 1, keys[i + j],
+					keylens[i + j], NULL);
+	    }
+	}
+	if (rc) {
+	    rc = dbiCursorResult(bc);
+	    break;
+	}
+
+	while ((rc = sqlite3_step(bc->stmt)) == SQLITE_ROW) {
+	    const void *key = sqlite3_column_blob(bc->stmt, 0);
+	    unsigned int keylen = sqlite3_column_bytes(bc->stmt, 0);
+	    unsigned int hnum = sqlite3_column_int(bc->stmt, 1);
+	    unsigned int tnum = sqlite3_column_int(bc->stmt, 2);
+
+	    for (int j = 0; j < n; j++) {
+		dbiIndexSet *set = &sets[i + j];
+		if (keylens[i + j] != keylen || memcmp(keys[i + j], key, keylen))
+		    continue;
+		if (*set == NULL)
+		    *set = dbiIndexSetNew(5);
+		dbiIndexSetAppendOne(*set, hnum, tnum, 0);
+	    }
+	}
+	rc = (rc == SQLITE_DONE) ? RPMRC_OK : dbiCursorResult(bc);
+    }
+
+    dbiCursorFree(dbi, bc);
+    return rc;
+}
+
+/* Compare keys the way the BINARY collation orders them */
+static int keyCmp(const void *a, size_t alen, const void *b, size_t blen)
+{
+    int rc = memcmp(a, b, (alen < blen) ? alen : blen);
+    if (rc == 0)
+	rc = (alen > blen) - (alen < blen);
+    return rc;
+}
+
+static rpmRC sqlite_idxdbGetSorted(dbiIndex dbi, dbiCursor dbc,
+			    const char **keys, const size_t *keylens,
+			    int nkeys, dbiIndexSet *sets)
+{
+    dbiCursor bc = dbiCursorInit(dbi, 0);
+    int k = 0;
+    int rc = dbiCursorPrep(bc, "SELECT key, hnum, idx FROM '%q' ORDER BY key",
+			    dbi->dbi_file);
+
+    /* Merge-join the index, walked in key order, with the sorted keys */
+    while (!rc && k < nkeys && (rc = sqlite3_step(bc->stmt)) == SQLITE_ROW) {
+	const void *key = sqlite3_column_blob(bc->stmt, 0);
+	unsigned int keylen = sqlite3_column_bytes(bc->stmt, 0);
+	int cmp = 0;
+
+	while (k < nkeys &&
+		(cmp = keyCmp(keys[k], keylens[k], key, keylen)) < 0)
+	    k++;
+
+	if (k < nkeys && cmp == 0) {
+	    unsigned int hnum = sqlite3_column_int(bc->stmt, 1);
+	    unsigned int tnum = sqlite3_column_int(bc->stmt, 2);
+	    if (sets[k] == NULL)
+		sets[k] = dbiIndexSetNew(5);
+	    dbiIndexSetAppendOne(sets[k], hnum, tnum, 0);
+	}
+	rc = 0;
+    }
+    rc = (rc == 0 || rc == SQLITE_DONE) ? RPMRC_OK : dbiCursorResult(bc);
+
+    dbiCursorFree(dbi, bc);
+    return rc;
+}
+
+/* A key can repeat for an item (file triggers), the primary key takes it once */
 static rpmRC sqlite_idxdbPutOne(dbiIndex dbi, dbiCursor dbc, const char *keyp, size_t keylen, dbiIndexItem rec)
 {
-    int rc = dbiCursorPrep(dbc, "INSERT INTO '%q' VALUES(?, ?, ?)",
+    int rc = dbiCursorPrep(dbc, "INSERT OR IGNORE INTO '%q' VALUES(?, ?, ?)",
 			dbi->dbi_file);
 
     if (!rc)
@@ -656,12 +1056,123 @@ static rpmRC sqlite_idxdbPutOne(dbiIndex dbi, dbiCursor dbc, const char *keyp, s
     return dbiCursorResult(dbc);
 }
 
+#define R4	"(?,?,?),(?,?,?),(?,?,?),(?,?,?)"
+#define R16	R4 "," R4 "," R4 "," R4
+#define BATCH_ROWS	32
+
+/* The items of a header, inserted BATCH_ROWS at a time */
+struct putRows_s {
+    dbiIndex dbi;
+    dbiCursor dbc;		/* multi-row insert */
+    dbiCursor onedbc;		/* single row insert for the rest */
+    struct {
+	size_t off;
+	size_t len;
+	struct dbiIndexItem_s rec;
+    } rows[BATCH_ROWS];
+    int nrows;
+    char *keys;
+    size_t keysize;
+    size_t keyalloced;
+    int rc;
+};
+
+static void putRowsFlush(struct putRows_s *pr)
+{
+    /* Fixed shape so the statement is cached */
+    static const char *fmt = "INSERT OR IGNORE INTO '%q' VALUES " R16 "," R16;
+    dbiCursor dbc;
+    int rc = 0;
+
+    if (pr->nrows == BATCH_ROWS) {
+	if (pr->dbc == NULL)
+	    pr->dbc = dbiCursorInit(pr->dbi, DBC_WRITE);
+	dbc = pr->dbc;
+	rc = dbiCursorPrep(dbc, fmt, pr->dbi->dbi_file);
+	for (int i = 0; i < pr->nrows && !rc; i++) {
+	    const char *key = pr->keys + pr->rows[i].off;
+	    int len = pr->rows[i].len;
+	    if (dbc->ctype == SQLITE_TEXT) {
+		rc = sqlite3_bind_text(dbc->stmt, 3 * i + 1, key, len, NULL);
+	    } else {
+		rc = sqlite3_bind_blob(dbc->stmt, 3 * i + 1, key, len, NULL);
+	    }
+	    if (!rc)
+		rc = sqlite3_bind_int(dbc->stmt, 3 * i + 2,
+				      pr->rows[i].rec.hdrNum);
+	    if (!rc)
+		rc = sqlite3_bind_int(dbc->stmt, 3 * i + 3,
+				      pr->rows[i].rec.tagNum);
+	}
+	if (!rc)
+	    while ((rc = sqlite3_step(dbc->stmt)) == SQLITE_ROW) {};
+	rc = dbiCursorResult(dbc);
+    } else if (pr->nrows) {
+	if (pr->onedbc == NULL)
+	    pr->onedbc = dbiCursorInit(pr->dbi, DBC_WRITE);
+	for (int i = 0; i < pr->nrows && !rc; i++) {
+	    rc = sqlite_idxdbPutOne(pr->dbi, pr->onedbc,
+				    pr->keys + pr->rows[i].off,
+				    pr->rows[i].len, &pr->rows[i].rec);
+	}
+    }
+
+    if (rc)
+	pr->rc = RPMRC_FAIL;
+    pr->nrows = 0;
+    pr->keysize = 0;
+}
+
+static rpmRC putRowsAdd(void *data, const char *keyp, size_t keylen,
+			dbiIndexItem rec)
+{
+    struct putRows_s *pr = data;
+
+    if (pr->keysize + keylen > pr->keyalloced) {
+	pr->keyalloced = 2 * (pr->keysize + keylen) + 1024;
+	pr->keys = xrealloc(pr->keys, pr->keyalloced);
+    }
+    memcpy(pr->keys + pr->keysize, keyp, keylen);
+    pr->rows[pr->nrows].off = pr->keysize;
+    pr->rows[pr->nrows].len = keylen;
+    pr->rows[pr->nrows].rec = *rec;
+    pr->keysize += keylen;
+
+    if (++pr->nrows == BATCH_ROWS)
+	putRowsFlush(pr);
+    return RPMRC_OK;
+}
+
 static rpmRC sqlite_idxdbPut(dbiIndex dbi, rpmTagVal rpmtag, unsigned int hdrNum, Header h)
 {
-    return tag2index(dbi, rpmtag, hdrNum, h, sqlite_idxdbPutOne);
+    struct putRows_s pr = { .dbi = dbi };
+    rpmRC rc = tag2keys(dbiName(dbi), rpmtag, hdrNum, h, putRowsAdd, &pr);
+
+    putRowsFlush(&pr);
+    if (pr.dbc)
+	dbiCursorFree(dbi, pr.dbc);
+    if (pr.onedbc)
+	dbiCursorFree(dbi, pr.onedbc);
+    free(pr.keys);
+    return (rc || pr.rc) ? RPMRC_FAIL : RPMRC_OK;
 }
 
-static rpmRC sqlite_idxdbDel(dbiIndex dbi, rpmTagVal rpmtag, unsigned int hdrNum, Header h)
+static rpmRC sqlite_idxdbDelOne(dbiIndex dbi, dbiCursor dbc, const char *keyp, size_t keylen, dbiIndexItem rec)
+{
+    int rc = dbiCursorPrep(dbc, "DELETE FROM '%q' WHERE key=? AND hnum=? AND idx=?",
+			dbi->dbi_file);
+
+    if (!rc)
+	rc = dbiCursorBindIdx(dbc, keyp, keylen, rec);
+
+    if (!rc)
+	while ((rc = sqlite3_step(dbc->stmt)) == SQLITE_ROW) {};
+
+    return dbiCursorResult(dbc);
+}
+
+/* The items of a package are found by the hnum index, no keys needed */
+static rpmRC sqlite_idxdbDelPkg(dbiIndex dbi, unsigned int hdrNum)
 {
     dbiCursor dbc = dbiCursorInit(dbi, DBC_WRITE);
     int rc = dbiCursorPrep(dbc, "DELETE FROM '%q' WHERE hnum=?", dbi->dbi_file);
@@ -677,6 +1188,11 @@ static rpmRC sqlite_idxdbDel(dbiIndex dbi, rpmTagVal rpmtag, unsigned int hdrNum
     return rc;
 }
 
+static rpmRC sqlite_idxdbDel(dbiIndex dbi, rpmTagVal rpmtag, unsigned int hdrNum, Header h)
+{
+    return sqlite_idxdbDelPkg(dbi, hdrNum);
+}
+
 static const void * sqlite_idxdbKey(dbiIndex dbi, dbiCursor dbc, unsigned int *keylen)
 {
     const void *key = NULL;
@@ -707,10 +1223,17 @@ struct rpmdbOps_s sqlite_dbops = {
     .pkgdbDel	= sqlite_pkgdbDel,
     .pkgdbGet	= sqlite_pkgdbGet,
     .pkgdbKey	= sqlite_pkgdbKey,
+    .pkgdbTrusted	= sqlite_pkgdbTrusted,
 
     .idxdbGet	= sqlite_idxdbGet,
+    .idxdbGetBatch	= sqlite_idxdbGetBatch,
+    .idxdbGetSorted	= sqlite_idxdbGetSorted,
+    .idxdbCount	= sqlite_idxdbCount,
     .idxdbPut	= sqlite_idxdbPut,
+    .idxdbPutOne	= sqlite_idxdbPutOne,
     .idxdbDel	= sqlite_idxdbDel,
+    .idxdbDelOne	= sqlite_idxdbDelOne,
+    .idxdbDelPkg	= sqlite_idxdbDelPkg,
     .idxdbKey	= sqlite_idxdbKey
 };
 
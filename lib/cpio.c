@@ -18,12 +18,14 @@
 #endif
 #include <string.h>
 #include <fcntl.h>
+#include <errno.h>
 
 #include <rpm/rpmio.h>
 #include <rpm/rpmlog.h>
 #include <rpm/rpmstring.h>
 #include <rpm/rpmarchive.h>
 
+#include "rpmio/rpmio_internal.h"	/* fdIsPlain */
 #include "lib/cpio.h"
 
 #include "debug.h"
@@ -95,126 +97,159 @@ off_t rpmcpioTell(rpmcpio_t cpio)
     return cpio->offset;
 }
 
+int rpmcpioSeek(rpmcpio_t cpio, off_t offset)
+{
+    if ((cpio->mode & O_ACCMODE) != O_RDONLY)
+	return RPMERR_INTERNAL;
+    if (Fseek(cpio->fd, offset, SEEK_SET))
+	return RPMERR_READ_FAILED;
+    cpio->offset = offset;
+    cpio->fileend = offset;
+    return 0;
+}
+
+
+/*
+ * Hex digit values with bit 4 set, zero for anything that's not a hex
+ * digit. Payloads of many small files spend a surprising amount of time
+ * in header parsing, this avoids strtoul() and its copies per field.
+ */
+#define HX(c, v) [c] = 0x10 | (v)
+static const unsigned char hexval[256] = {
+    HX('0', 0), HX('1', 1), HX('2', 2), HX('3', 3), HX('4', 4),
+    HX('5', 5), HX('6', 6), HX('7', 7), HX('8', 8), HX('9', 9),
+    HX('a', 10), HX('b', 11), HX('c', 12), HX('d', 13), HX('e', 14),
+    HX('f', 15), HX('A', 10), HX('B', 11), HX('C', 12), HX('D', 13),
+    HX('E', 14), HX('F', 15),
+};
+#undef HX
 
 /**
- * Convert string to unsigned integer (with buffer size check).
- * @param str		input string
- * @param[out] endptr	address of 1st character not processed
- * @param base		numerical conversion base
- * @param num		max no. of bytes to read
- * @return		converted integer
+ * Convert an eight digit hex header field to unsigned integer.
+ * @param str		field
+ * @param[out] val	converted integer
+ * @return		0 on success, -1 if not all digits are hex
  */
-static unsigned long strntoul(const char *str,char **endptr, int base, size_t num)
+static int hexField(const char *str, uint32_t *val)
 {
-    char buf[num+1], * end;
-    unsigned long ret;
-
-    strncpy(buf, str, num);
-    buf[num] = '\0';
+    const unsigned char *s = (const unsigned char *) str;
+    unsigned char valid = 0x10;
+    uint32_t v = 0;
+
+    for (int i = 0; i < 8; i++) {
+	unsigned char d = hexval[s[i]];
+	valid &= d;
+	v = (v << 4) | (d & 0x0f);
+    }
+    *val = v;
+    return valid ? 0 : -1;
+}
 
-    ret = strtoul(buf, &end, base);
-    if (*end != '\0')
-	*endptr = ((char *)str) + (end - buf);	/* XXX discards const */
-    else
-	*endptr = ((char *)str) + strlen(buf);
+static void hexFormat(char *str, uint32_t val)
+{
+    static const char digits[] = "0123456789abcdef";
 
-    return ret;
+    for (int i = 7; i >= 0; i--) {
+	str[i] = digits[val & 0x0f];
+	val >>= 4;
+    }
 }
 
+/* Padding needed to get from offset to the next four byte boundary */
+static size_t padLen(off_t offset)
+{
+    return (4 - (offset % 4)) % 4;
+}
 
-static int rpmcpioWritePad(rpmcpio_t cpio, ssize_t modulo)
+static int rpmcpioWriteBuf(rpmcpio_t cpio, const void *buf, size_t size)
 {
-    char buf[modulo];
-    ssize_t left, written;
-    memset(buf, 0, modulo);
-    left = (modulo - ((cpio->offset) % modulo)) % modulo;
-    if (left <= 0)
-        return 0;
-    written = Fwrite(&buf, left, 1, cpio->fd);
-    if (written != left) {
-        return RPMERR_WRITE_FAILED;
-    }
+    size_t written = Fwrite(buf, size, 1, cpio->fd);
     cpio->offset += written;
-    return 0;
+    return (written != size) ? RPMERR_WRITE_FAILED : 0;
 }
 
-static int rpmcpioReadPad(rpmcpio_t cpio)
+
+/* Read exactly size bytes unless at EOF, the payload may be a pipe */
+static ssize_t rpmcpioReadFull(rpmcpio_t cpio, void *buf, size_t size)
 {
-    ssize_t modulo = 4;
-    char buf[4];
-    ssize_t left, read;
-    left = (modulo - (cpio->offset % modulo)) % modulo;
-    if (left <= 0)
-        return 0;
-    read = Fread(&buf, left, 1, cpio->fd);
-    cpio->offset += read;
-    if (read != left) {
-        return RPMERR_READ_FAILED;
+    char *p = buf;
+    size_t total = 0;
+
+    while (total < size) {
+	ssize_t nb = Fread(p + total, size - total, 1, cpio->fd);
+	if (nb < 0 && total == 0)
+	    return nb;
+	if (nb <= 0)
+	    break;
+	total += nb;
     }
-    return 0;
+    return total;
 }
 
 #define GET_NUM_FIELD(phys, log) \
-	\
-	log = strntoul(phys, &end, 16, sizeof(phys)); \
-	\
-	if ( (end - phys) != sizeof(phys) ) return RPMERR_BAD_HEADER;
-#define SET_NUM_FIELD(phys, val, space) \
-	sprintf(space, "%8.8lx", (unsigned long) (val)); \
-	\
-	memcpy(phys, space, 8) \
+	{ \
+	    uint32_t num_; \
+	    if (hexField(phys, &num_)) return RPMERR_BAD_HEADER; \
+	    log = num_; \
+	}
+#define SET_NUM_FIELD(phys, val) \
+	hexFormat(phys, (uint32_t) (val))
+
+/*
+ * Write a header: leading padding to the previous file's data, magic,
+ * fixed part, name and trailing padding all go out in a single write.
+ */
+static int rpmcpioWriteHeader(rpmcpio_t cpio, const char *magic,
+			      const void *hdr, size_t hdrlen,
+			      const char *name, size_t namelen)
+{
+    size_t lead = padLen(cpio->offset);
+    size_t len = lead + 6 + hdrlen + namelen;
+    size_t tail = padLen(cpio->offset + len);
+    char buf[len + tail];
+    char *p = buf;
+
+    memset(p, 0, lead);
+    p += lead;
+    memcpy(p, magic, 6);
+    p += 6;
+    memcpy(p, hdr, hdrlen);
+    p += hdrlen;
+    if (namelen) {
+	memcpy(p, name, namelen);
+	p += namelen;
+    }
+    memset(p, 0, tail);
+
+    return rpmcpioWriteBuf(cpio, buf, len + tail);
+}
 
 static int rpmcpioTrailerWrite(rpmcpio_t cpio)
 {
     struct cpioCrcPhysicalHeader hdr;
-    int rc;
-    size_t written;
 
     if (cpio->fileend != cpio->offset) {
         return RPMERR_WRITE_FAILED;
     }
 
-    rc = rpmcpioWritePad(cpio, 4);
-    if (rc)
-        return rc;
-
     memset(&hdr, '0', PHYS_HDR_SIZE);
     memcpy(&hdr.nlink, "00000001", 8);
     memcpy(&hdr.namesize, "0000000b", 8);
 
-    written = Fwrite(CPIO_NEWC_MAGIC, 6, 1, cpio->fd);
-    cpio->offset += written;
-    if (written != 6) {
-        return RPMERR_WRITE_FAILED;
-    }
-
-    written = Fwrite(&hdr, PHYS_HDR_SIZE, 1, cpio->fd);
-    cpio->offset += written;
-    if (written != PHYS_HDR_SIZE) {
-        return RPMERR_WRITE_FAILED;
-    }
-    written = Fwrite(&CPIO_TRAILER, sizeof(CPIO_TRAILER), 1, cpio->fd);
-    cpio->offset += written;
-    if (written != sizeof(CPIO_TRAILER)) {
-        return RPMERR_WRITE_FAILED;
-    }
-
     /*
      * XXX GNU cpio pads to 512 bytes. This may matter for
      * tape device(s) and/or concatenated cpio archives.
      */
 
-    rc = rpmcpioWritePad(cpio, 4);
-
-    return rc;
+    return rpmcpioWriteHeader(cpio, CPIO_NEWC_MAGIC, &hdr, PHYS_HDR_SIZE,
+			      CPIO_TRAILER, sizeof(CPIO_TRAILER));
 }
 
 int rpmcpioHeaderWrite(rpmcpio_t cpio, char * path, struct stat * st)
 {
     struct cpioCrcPhysicalHeader hdr_s;
     struct cpioCrcPhysicalHeader * hdr = &hdr_s;
-    char field[64];
-    size_t len, written;
+    size_t len;
     dev_t dev;
     int rc = 0;
 
@@ -230,48 +265,26 @@ int rpmcpioHeaderWrite(rpmcpio_t cpio, char * path, struct stat * st)
 	return RPMERR_FILE_SIZE;
     }
 
-    rc = rpmcpioWritePad(cpio, 4);
-    if (rc) {
-        return rc;
-    }
-
-    SET_NUM_FIELD(hdr->inode, st->st_ino, field);
-    SET_NUM_FIELD(hdr->mode, st->st_mode, field);
-    SET_NUM_FIELD(hdr->uid, st->st_uid, field);
-    SET_NUM_FIELD(hdr->gid, st->st_gid, field);
-    SET_NUM_FIELD(hdr->nlink, st->st_nlink, field);
-    SET_NUM_FIELD(hdr->mtime, st->st_mtime, field);
-    SET_NUM_FIELD(hdr->filesize, st->st_size, field);
+    SET_NUM_FIELD(hdr->inode, st->st_ino);
+    SET_NUM_FIELD(hdr->mode, st->st_mode);
+    SET_NUM_FIELD(hdr->uid, st->st_uid);
+    SET_NUM_FIELD(hdr->gid, st->st_gid);
+    SET_NUM_FIELD(hdr->nlink, st->st_nlink);
+    SET_NUM_FIELD(hdr->mtime, st->st_mtime);
+    SET_NUM_FIELD(hdr->filesize, st->st_size);
 
-    dev = major(st->st_dev); SET_NUM_FIELD(hdr->devMajor, dev, field);
-    dev = minor(st->st_dev); SET_NUM_FIELD(hdr->devMinor, dev, field);
-    dev = major(st->st_rdev); SET_NUM_FIELD(hdr->rdevMajor, dev, field);
-    dev = minor(st->st_rdev); SET_NUM_FIELD(hdr->rdevMinor, dev, field);
+    dev = major(st->st_dev); SET_NUM_FIELD(hdr->devMajor, dev);
+    dev = minor(st->st_dev); SET_NUM_FIELD(hdr->devMinor, dev);
+    dev = major(st->st_rdev); SET_NUM_FIELD(hdr->rdevMajor, dev);
+    dev = minor(st->st_rdev); SET_NUM_FIELD(hdr->rdevMinor, dev);
 
     len = strlen(path) + 1;
-    SET_NUM_FIELD(hdr->namesize, len, field);
+    SET_NUM_FIELD(hdr->namesize, len);
 
     memcpy(hdr->checksum, "00000000", 8);
 
-    written = Fwrite(CPIO_NEWC_MAGIC, 6, 1, cpio->fd);
-    cpio->offset += written;
-    if (written != 6) {
-        return RPMERR_WRITE_FAILED;
-    }
-
-    written = Fwrite(hdr, PHYS_HDR_SIZE, 1, cpio->fd);
-    cpio->offset += written;
-    if (written != PHYS_HDR_SIZE) {
-        return RPMERR_WRITE_FAILED;
-    }
-
-    written = Fwrite(path, len, 1, cpio->fd);
-    cpio->offset += written;
-    if (written != len) {
-        return RPMERR_WRITE_FAILED;
-    }
-
-    rc = rpmcpioWritePad(cpio, 4);
+    rc = rpmcpioWriteHeader(cpio, CPIO_NEWC_MAGIC, hdr, PHYS_HDR_SIZE,
+			    path, len);
 
     cpio->fileend = cpio->offset + st->st_size;
 
@@ -282,8 +295,6 @@ int rpmcpioStrippedHeaderWrite(rpmcpio_t cpio, int fx, off_t fsize)
 {
     struct cpioStrippedPhysicalHeader hdr_s;
     struct cpioStrippedPhysicalHeader * hdr = &hdr_s;
-    char field[64];
-    size_t written;
     int rc = 0;
 
     if ((cpio->mode & O_ACCMODE) != O_WRONLY) {
@@ -294,26 +305,10 @@ int rpmcpioStrippedHeaderWrite(rpmcpio_t cpio, int fx, off_t fsize)
         return RPMERR_WRITE_FAILED;
     }
 
-    rc = rpmcpioWritePad(cpio, 4);
-    if (rc) {
-        return rc;
-    }
+    SET_NUM_FIELD(hdr->fx, fx);
 
-    SET_NUM_FIELD(hdr->fx, fx, field);
-
-    written = Fwrite(CPIO_STRIPPED_MAGIC, 6, 1, cpio->fd);
-    cpio->offset += written;
-    if (written != 6) {
-        return RPMERR_WRITE_FAILED;
-    }
-
-    written = Fwrite(hdr, STRIPPED_PHYS_HDR_SIZE, 1, cpio->fd);
-    cpio->offset += written;
-    if (written != STRIPPED_PHYS_HDR_SIZE) {
-        return RPMERR_WRITE_FAILED;
-    }
-
-    rc = rpmcpioWritePad(cpio, 4);
+    rc = rpmcpioWriteHeader(cpio, CPIO_STRIPPED_MAGIC,
+			    hdr, STRIPPED_PHYS_HDR_SIZE, NULL, 0);
 
     cpio->fileend = cpio->offset + fsize;
 
@@ -337,14 +332,23 @@ ssize_t rpmcpioWrite(rpmcpio_t cpio, const void * buf, size_t size)
 }
 
 
+/*
+ * Both header formats start with the magic and an eight digit field,
+ * which with the stripped header's padding makes for 16 bytes that can
+ * always be read in one go. Beyond that, the newc header's fixed part
+ * is read in one go and the name and its padding in another.
+ */
+#define HDR_PREFIX_SIZE	16
+
 int rpmcpioHeaderRead(rpmcpio_t cpio, char ** path, int * fx)
 {
     struct cpioCrcPhysicalHeader hdr;
+    char buf[3 + 6 + PHYS_HDR_SIZE];
+    char *magic;
+    ssize_t lead, rest;
     int nameSize;
-    char * end;
     int rc = 0;
     ssize_t read;
-    char magic[6];
     rpm_loff_t fsize;
 
     if ((cpio->mode & O_ACCMODE) != O_RDONLY) {
@@ -363,27 +367,28 @@ int rpmcpioHeaderRead(rpmcpio_t cpio, char ** path, int * fx)
         }
     }
 
-    rc = rpmcpioReadPad(cpio);
-    if (rc) return rc;
-
-    read = Fread(&magic, 6, 1, cpio->fd);
+    /* Padding after the previous file's data, magic and first field */
+    lead = padLen(cpio->offset);
+    read = rpmcpioReadFull(cpio, buf, lead + HDR_PREFIX_SIZE);
     cpio->offset += read;
-    if (read != 6)
+    if (read < lead)
+	return RPMERR_READ_FAILED;
+    if (read < lead + 6)
 	return RPMERR_BAD_MAGIC;
+    magic = buf + lead;
 
-    /* read stripped header */
+    /* stripped header, the rest of the prefix is its padding */
     if (!strncmp(CPIO_STRIPPED_MAGIC, magic,
                  sizeof(CPIO_STRIPPED_MAGIC)-1)) {
-        struct cpioStrippedPhysicalHeader shdr;
-        read = Fread(&shdr, STRIPPED_PHYS_HDR_SIZE, 1, cpio->fd);
-        cpio->offset += read;
-        if (read != STRIPPED_PHYS_HDR_SIZE)
+        struct cpioStrippedPhysicalHeader *shdr = (void *) (magic + 6);
+        if (read < lead + 6 + STRIPPED_PHYS_HDR_SIZE)
 	    return RPMERR_BAD_HEADER;
+        if (read != lead + HDR_PREFIX_SIZE)
+	    return RPMERR_READ_FAILED;
 
-        GET_NUM_FIELD(shdr.fx, *fx);
-        rc = rpmcpioReadPad(cpio);
+        GET_NUM_FIELD(shdr->fx, *fx);
 
-        if (!rc && *fx == -1)
+        if (*fx == -1)
             rc = RPMERR_ITER_END;
         return rc;
     }
@@ -393,10 +398,14 @@ int rpmcpioHeaderRead(rpmcpio_t cpio, char ** path, int * fx)
 	return RPMERR_BAD_MAGIC;
     }
 
-    read = Fread(&hdr, PHYS_HDR_SIZE, 1, cpio->fd);
+    if (read != lead + HDR_PREFIX_SIZE)
+	return RPMERR_BAD_HEADER;
+    rest = 6 + PHYS_HDR_SIZE - HDR_PREFIX_SIZE;
+    read = rpmcpioReadFull(cpio, buf + lead + HDR_PREFIX_SIZE, rest);
     cpio->offset += read;
-    if (read != PHYS_HDR_SIZE)
+    if (read != rest)
         return RPMERR_BAD_HEADER;
+    memcpy(&hdr, magic + 6, PHYS_HDR_SIZE);
 
     GET_NUM_FIELD(hdr.filesize, fsize);
     GET_NUM_FIELD(hdr.namesize, nameSize);
@@ -404,15 +413,17 @@ int rpmcpioHeaderRead(rpmcpio_t cpio, char ** path, int * fx)
         return RPMERR_BAD_HEADER;
     }
 
-    char name[nameSize + 1];
-    read = Fread(name, nameSize, 1, cpio->fd);
-    name[nameSize] = '\0';
+    /* The name and the padding after it */
+    int namePad = padLen(cpio->offset + nameSize);
+    char name[nameSize + namePad + 1];
+    read = rpmcpioReadFull(cpio, name, nameSize + namePad);
     cpio->offset += read;
-    if (read != nameSize ) {
+    if (read < nameSize)
         return RPMERR_BAD_HEADER;
-    }
+    if (read != nameSize + namePad)
+	rc = RPMERR_READ_FAILED;
+    name[nameSize] = '\0';
 
-    rc = rpmcpioReadPad(cpio);
     cpio->fileend = cpio->offset + fsize;
 
     if (!rc && rstreq(name, CPIO_TRAILER))
@@ -439,11 +450,60 @@ ssize_t rpmcpioRead(rpmcpio_t cpio, void * buf, size_t size)
 
     left = cpio->fileend - cpio->offset;
     size = size > left ? left : size;
-    read = Fread(buf, size, 1, cpio->fd);
+    read = rpmcpioReadFull(cpio, buf, size);
     cpio->offset += read;
     return read;
 }
 
+int rpmcpioCopy(rpmcpio_t cpio, int ofd, size_t size, DIGEST_CTX ctx)
+{
+#ifdef HAVE_COPY_FILE_RANGE
+    int ifd = Fileno(cpio->fd);
+    size_t left = cpio->fileend - cpio->offset;
+    size_t copied = 0;
+    off_t start, pos;
+
+    if ((cpio->mode & O_ACCMODE) != O_RDONLY || size > left)
+	return RPMERR_READ_FAILED;
+    if (!fdIsPlain(cpio->fd) || (start = lseek(ifd, 0, SEEK_CUR)) < 0)
+	return 1;
+
+    pos = start;
+    while (copied < size) {
+	ssize_t nb = copy_file_range(ifd, &pos, ofd, NULL, size - copied, 0);
+	if (nb <= 0) {
+	    /* Not supported between these files, caller can still fall back */
+	    if (nb < 0 && copied == 0 &&
+		    (errno == ENOSYS || errno == EXDEV || errno == EINVAL ||
+		     errno == EOPNOTSUPP || errno == EBADF))
+		return 1;
+	    return RPMERR_COPY_FAILED;
+	}
+	copied += nb;
+    }
+
+    /* Contents bypassed userspace, read them back for the digest */
+    if (ctx) {
+	char buf[BUFSIZ*4];
+	for (pos = start; pos < start + (off_t)size;) {
+	    size_t n = start + size - pos;
+	    ssize_t nb = pread(ifd, buf, n > sizeof(buf) ? sizeof(buf) : n, pos);
+	    if (nb <= 0)
+		return RPMERR_READ_FAILED;
+	    rpmDigestUpdate(ctx, buf, nb);
+	    pos += nb;
+	}
+    }
+
+    if (lseek(ifd, start + size, SEEK_SET) < 0)
+	return RPMERR_READ_FAILED;
+    cpio->offset += size;
+    return 0;
+#else
+    return 1;
+#endif
+}
+
 int rpmcpioClose(rpmcpio_t cpio)
 {
     int rc = 0;
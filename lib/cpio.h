@@ -12,6 +12,8 @@
  *
  */
 
+#include <rpm/rpmcrypto.h>
+
 typedef struct rpmcpio_s * rpmcpio_t;
 
 #ifdef __cplusplus
@@ -30,6 +32,16 @@ int rpmcpioClose(rpmcpio_t cpio);
 
 off_t rpmcpioTell(rpmcpio_t cpio);
 
+/**
+ * Position a cpio archive opened for reading at a header boundary.
+ * This requires a seekable payload stream.
+ * @param cpio		cpio archive
+ * @param offset	uncompressed offset of a cpio header
+ * @return		0 on success
+ */
+RPM_GNUC_INTERNAL
+int rpmcpioSeek(rpmcpio_t cpio, off_t offset);
+
 rpmcpio_t rpmcpioFree(rpmcpio_t cpio);
 
 /**
@@ -72,6 +84,18 @@ void rpmcpioSetExpectedFileSize(rpmcpio_t cpio, off_t fsize);
 
 ssize_t rpmcpioRead(rpmcpio_t cpio, void * buf, size_t size);
 
+/**
+ * Copy file data from an uncompressed archive directly into another file
+ * with copy_file_range(), which lets filesystems share the extents.
+ * @param cpio		cpio archive
+ * @param ofd		file descriptor to write to
+ * @param size		number of bytes to copy
+ * @param ctx		digest context to update with the data (or NULL)
+ * @return		0 on success, 1 if not possible, error code otherwise
+ */
+RPM_GNUC_INTERNAL
+int rpmcpioCopy(rpmcpio_t cpio, int ofd, size_t size, DIGEST_CTX ctx);
+
 #ifdef __cplusplus
 }
 #endif
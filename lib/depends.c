@@ -11,12 +11,15 @@
 #include <rpm/rpmds.h>
 #include <rpm/rpmfi.h>
 #include <rpm/rpmstring.h>
+#include <rpm/rpmmacro.h>
 
 #include "lib/rpmts_internal.h"
 #include "lib/rpmte_internal.h"
 #include "lib/rpmds_internal.h"
 #include "lib/rpmfi_internal.h" /* rpmfiles stuff for now */
 #include "lib/misc.h"
+#include "lib/rpmworkers.h"
+#include "lib/sidecar.h"
 
 #include "lib/backend/dbiset.h"
 
@@ -38,7 +41,7 @@ const int rpmFLAGS = RPMSENSE_EQUAL;
 #define HTKEYTYPE const char *
 #define HTDATATYPE int
 #include "lib/rpmhash.H"
-#include "lib/rpmhash.C"
+#include "lib/rpmhashoa.C"
 #undef HASHTYPE
 #undef HTKEYTYPE
 #undef HTDATATYPE
@@ -55,7 +58,7 @@ const int rpmFLAGS = RPMSENSE_EQUAL;
 #define HTKEYTYPE rpmsid
 #define HTDATATYPE rpmsid
 #include "rpmhash.H"
-#include "rpmhash.C"
+#include "rpmhashoa.C"
 #undef HASHTYPE
 #undef HTKEYTYPE
 #undef HTDATATYPE
@@ -63,7 +66,7 @@ const int rpmFLAGS = RPMSENSE_EQUAL;
 #define HASHTYPE depexistsHash
 #define HTKEYTYPE rpmsid
 #include "lib/rpmhash.H"
-#include "lib/rpmhash.C"
+#include "lib/rpmhashoa.C"
 #undef HASHTYPE
 #undef HTKEYTYPE
 
@@ -141,6 +144,7 @@ static int removePackage(rpmts ts, Header h, rpmte depends)
 	return 1;
 
     packageHashAddEntry(tsmem->removedPackages, dboffset, p);
+    tsmem->removedGen++;
     rpmteSetDependsOn(p, depends);
 
     addElement(tsmem, p, tsmem->orderCount);
@@ -456,6 +460,9 @@ static int addPackage(rpmts ts, Header h,
 	    rpmtsNotifyChange(ts, RPMTS_EVENT_DEL, tsmem->order[oc], p);
 	    rpmalDel(tsmem->addedPackages, tsmem->order[oc]);
 	    tsmem->order[oc] = rpmteFree(tsmem->order[oc]);
+	    /* Provides went away, earlier check results can't be trusted */
+	    tsmem->depcheckValid = 0;
+	    tsmem->orderValid = 0;
 	/* If newer NEVR was already added, we're done */
 	} else if (oc < 0) {
 	    p = rpmteFree(p);
@@ -524,6 +531,141 @@ int rpmtsAddEraseElement(rpmts ts, Header h, int dboffset)
     return removePackage(ts, h, NULL);
 }
 
+void rpmtsFreeDepCache(rpmts ts)
+{
+    tsMembers tsmem = rpmtsMembers(ts);
+    tsmem->depcache = depCacheFree(tsmem->depcache);
+    tsmem->depcacheCookie = _free(tsmem->depcacheCookie);
+}
+
+/*
+ * The rpmdb lookup results only depend on the rpmdb contents and the
+ * erasures pruned from it, so they can be kept across rpmtsCheck() calls
+ * as long as neither of those changes.
+ */
+static depCache rpmtsGetDepCache(rpmts ts, rpmdb rdb, int *dbchanged)
+{
+    tsMembers tsmem = rpmtsMembers(ts);
+    char *cookie = rdb ? rpmdbCookie(rdb) : NULL;
+
+    *dbchanged = 1;
+    if (tsmem->depcache) {
+	if (rstreq(cookie ? cookie : "",
+		   tsmem->depcacheCookie ? tsmem->depcacheCookie : ""))
+	    *dbchanged = 0;
+	if (*dbchanged || tsmem->depcacheGen != tsmem->removedGen)
+	    rpmtsFreeDepCache(ts);
+    }
+
+    if (tsmem->depcache == NULL) {
+	/* XXX FIXME: figure some kind of heuristic for the cache size */
+	tsmem->depcache = depCacheCreate(5001, rstrhash, strcmp,
+					 (depCacheFreeKey)rfree, NULL);
+	tsmem->depcacheCookie = cookie;
+	tsmem->depcacheGen = tsmem->removedGen;
+    } else {
+	free(cookie);
+    }
+    return tsmem->depcache;
+}
+
+struct changedNames_s {
+    rpmstrPool pool;
+    depexistsHash names;
+    int hit;
+};
+
+/* Is the (file) name provided by any of the changed elements? */
+static int isChangedName(struct changedNames_s *cn, const char *n, size_t nl)
+{
+    rpmsid id = rpmstrPoolIdn(cn->pool, n, nl, 0);
+
+    if (id && depexistsHashHasEntry(cn->names, id))
+	return 1;
+    /* files are recorded by basename only */
+    if (nl && n[0] == '/') {
+	const char *bn = n + nl;
+	while (bn[-1] != '/')
+	    bn--;
+	id = rpmstrPoolIdn(cn->pool, bn, n + nl - bn, 0);
+	if (id && depexistsHashHasEntry(cn->names, id))
+	    return 1;
+    }
+    return 0;
+}
+
+static rpmRC changedRichCB(void *cbdata, rpmrichParseType type,
+		const char *n, int nl, const char *e, int el, rpmsenseFlags sense,
+		rpmrichOp op, char **emsg)
+{
+    struct changedNames_s *cn = cbdata;
+    if (type == RPMRICH_PARSE_SIMPLE && isChangedName(cn, n, nl))
+	cn->hit = 1;
+    return RPMRC_OK;
+}
+
+/* Does any name in the dependency set match the changed elements? */
+static int isChangedDS(struct changedNames_s *cn, rpmds ds)
+{
+    ds = rpmdsInit(ds);
+    while (!cn->hit && rpmdsNext(ds) >= 0) {
+	const char *n = rpmdsN(ds);
+	if (rpmdsIsRich(ds)) {
+	    if (rpmrichParse(&n, NULL, changedRichCB, cn) != RPMRC_OK)
+		cn->hit = 1;
+	} else if (isChangedName(cn, n, strlen(n))) {
+	    cn->hit = 1;
+	}
+    }
+    return cn->hit;
+}
+
+/* Record the names an unchecked element adds to or takes from the set */
+static void addChangedNames(struct changedNames_s *cn, rpmte p)
+{
+    rpmds provides = rpmdsInit(rpmteDS(p, RPMTAG_PROVIDENAME));
+    rpmfiles files = rpmteFiles(p);
+    int fc = rpmfilesFC(files);
+
+    depexistsHashAddEntry(cn->names, rpmstrPoolId(cn->pool, rpmteN(p), 1));
+    while (rpmdsNext(provides) >= 0)
+	depexistsHashAddEntry(cn->names, rpmdsNId(provides));
+    for (int i = 0; i < fc; i++)
+	depexistsHashAddEntry(cn->names, rpmfilesBNId(files, i));
+    rpmfilesFree(files);
+}
+
+/*
+ * Elements checked earlier only need a new look if the elements added
+ * since then share a name with their dependencies, provides or files.
+ * Otherwise neither the added set nor the pruned rpmdb can answer any of
+ * their checks differently, and the problems from last time still stand.
+ */
+static int needsCheck(struct changedNames_s *cn, rpmte p)
+{
+    rpmfiles files;
+    int fc;
+
+    if (cn == NULL || !rpmteDepChecked(p))
+	return 1;
+
+    cn->hit = isChangedName(cn, rpmteN(p), strlen(rpmteN(p)));
+    if (isChangedDS(cn, rpmteDS(p, RPMTAG_PROVIDENAME)) ||
+	    isChangedDS(cn, rpmteDS(p, RPMTAG_REQUIRENAME)) ||
+	    isChangedDS(cn, rpmteDS(p, RPMTAG_CONFLICTNAME)) ||
+	    isChangedDS(cn, rpmteDS(p, RPMTAG_OBSOLETENAME)))
+	return 1;
+
+    files = rpmteFiles(p);
+    fc = rpmfilesFC(files);
+    for (int i = 0; i < fc && !cn->hit; i++) {
+	if (depexistsHashHasEntry(cn->names, rpmfilesBNId(files, i)))
+	    cn->hit = 1;
+    }
+    rpmfilesFree(files);
+    return cn->hit;
+}
+
 /* Cached rpmdb provide lookup, returns 0 if satisfied, 1 otherwise */
 static int rpmdbProvides(rpmts ts, depCache dcache, rpmds dep, dbiIndexSet *matches)
 {
@@ -689,9 +831,11 @@ exit:
  * @param ts		transaction set
  * @param dcache	dependency cache
  * @param dep		dependency
+ * @param almatch	added set satisfies dep (1) or not (0), -1 to look up
  * @return		0 if satisfied, 1 if not satisfied
  */
-static int unsatisfiedDepend(rpmts ts, depCache dcache, rpmds dep)
+static int unsatisfiedDepend(rpmts ts, depCache dcache, rpmds dep,
+			     int almatch)
 {
     tsMembers tsmem = rpmtsMembers(ts);
     int rc;
@@ -755,11 +899,11 @@ retry:
 		if (rpmdsParseRichDep(ds2, &ds21, &ds22, &op2, NULL) == RPMRC_OK && op2 == RPMRICHOP_ELSE) {
 		    /* A IF B ELSE C -> (A OR NOT(B)) AND (C OR B) */
 		    /* A UNLESS B ELSE C -> (A AND NOT(B)) OR (C AND B) */
-		    rc = !unsatisfiedDepend(ts, dcache, ds21);	/* NOT(B) */
+		    rc = !unsatisfiedDepend(ts, dcache, ds21, -1);	/* NOT(B) */
 		    if ((rc && op == RPMRICHOP_IF) || (!rc && op == RPMRICHOP_UNLESS)) {
-			rc = unsatisfiedDepend(ts, dcache, ds1);	/* A */
+			rc = unsatisfiedDepend(ts, dcache, ds1, -1);	/* A */
 		    } else {
-			rc = unsatisfiedDepend(ts, dcache, ds22);	/* C */
+			rc = unsatisfiedDepend(ts, dcache, ds22, -1);	/* C */
 		    }
 		    rpmdsFree(ds21);
 		    rpmdsFree(ds22);
@@ -768,13 +912,13 @@ retry:
 		rpmdsFree(ds21);
 		rpmdsFree(ds22);
 	    }
-	    rc = !unsatisfiedDepend(ts, dcache, ds2);	/* NOT(B) */
+	    rc = !unsatisfiedDepend(ts, dcache, ds2, -1);	/* NOT(B) */
 	    if ((rc && op == RPMRICHOP_IF) || (!rc && op == RPMRICHOP_UNLESS))
-		rc = unsatisfiedDepend(ts, dcache, ds1);
+		rc = unsatisfiedDepend(ts, dcache, ds1, -1);
 	} else {
-	    rc = unsatisfiedDepend(ts, dcache, ds1);
+	    rc = unsatisfiedDepend(ts, dcache, ds1, -1);
 	    if ((rc && op == RPMRICHOP_OR) || (!rc && op == RPMRICHOP_AND))
-		rc = unsatisfiedDepend(ts, dcache, ds2);
+		rc = unsatisfiedDepend(ts, dcache, ds2, -1);
 	}
 exitrich:
 	ds1 = rpmdsFree(ds1);
@@ -785,9 +929,12 @@ exitrich:
 
     /* Pretrans dependencies can't be satisfied by added packages. */
     if (!(dsflags & (RPMSENSE_PRETRANS|RPMSENSE_PREUNTRANS))) {
-	rpmte *matches = rpmalAllSatisfiesDepend(tsmem->addedPackages, dep);
-	int match = matches && *matches;
-	_free(matches);
+	int match = almatch;
+	if (match < 0) {
+	    rpmte *matches = rpmalAllSatisfiesDepend(tsmem->addedPackages, dep);
+	    match = matches && *matches;
+	    _free(matches);
+	}
 	if (match)
 	    goto exit;
     }
@@ -802,7 +949,9 @@ exitrich:
 	if (xx == 0)
 	    goto exit;
 	if (xx == -1) {
+	    /* the added set changed, look again */
 	    retrying = 1;
+	    almatch = -1;
 	    goto retry;
 	}
     }
@@ -821,10 +970,123 @@ exit:
     return rc;
 }
 
+static const rpmTagVal alLookupTags[] = {
+    RPMTAG_REQUIRENAME, RPMTAG_CONFLICTNAME, RPMTAG_OBSOLETENAME,
+};
+#define NLOOKUPTAGS (sizeof(alLookupTags) / sizeof(*alLookupTags))
+
+/* Added set lookups for the dependencies of one element */
+struct alLookup_s {
+    rpmte te;
+    int8_t *match[NLOOKUPTAGS];	/*!< 1 satisfied, 0 not, -1 not looked up */
+};
+
+/*
+ * The added set lookups of the elements to check, done up front on
+ * worker threads. They're consumed in element order by the serial
+ * pass, and only trusted while the added set is what it was.
+ */
+struct alLookups_s {
+    tsMembers tsmem;
+    int ocount;			/*!< No. of elements when looked up */
+    struct alLookup_s *items;
+    int nitems;
+    int next;			/*!< Next item for the serial pass */
+    struct alLookup_s *cur;	/*!< Item of the element being checked */
+};
+
+static void alLookupElement(void *data, int ix, int slot)
+{
+    struct alLookups_s *alk = data;
+    struct alLookup_s *item = &alk->items[ix];
+
+    for (int t = 0; t < NLOOKUPTAGS; t++) {
+	rpmds ds = rpmdsInit(rpmteDS(item->te, alLookupTags[t]));
+	int i, count = rpmdsCount(ds);
+
+	if (count <= 0)
+	    continue;
+	item->match[t] = xmalloc(count * sizeof(*item->match[t]));
+	while ((i = rpmdsNext(ds)) >= 0) {
+	    rpmsenseFlags dsflags = rpmdsFlags(ds);
+	    int match = -1;
+	    /* leave the special cases to unsatisfiedDepend() */
+	    if (!(dsflags & (RPMSENSE_RPMLIB|RPMSENSE_PRETRANS|RPMSENSE_PREUNTRANS))
+		    && !rpmdsIsRich(ds)) {
+		rpmte *matches = rpmalAllSatisfiesDepend(alk->tsmem->addedPackages, ds);
+		match = (matches && *matches);
+		free(matches);
+	    }
+	    item->match[t][i] = match;
+	}
+    }
+}
+
+static void alLookupsInit(struct alLookups_s *alk, rpmts ts,
+			  struct changedNames_s *cn)
+{
+    tsMembers tsmem = rpmtsMembers(ts);
+    int nthreads = rpmworkersCount("_depcheck_threads");
+    rpmtsi pi;
+    rpmte p;
+
+    memset(alk, 0, sizeof(*alk));
+    alk->tsmem = tsmem;
+    alk->ocount = tsmem->orderCount;
+
+    /* Debug output would get shuffled, keep it in order */
+    if (nthreads <= 1 || tsmem->addedPackages == NULL || rpmIsDebug())
+	return;
+
+    alk->items = xcalloc(tsmem->orderCount, sizeof(*alk->items));
+    pi = rpmtsiInit(ts);
+    while ((p = rpmtsiNext(pi, TR_ADDED)) != NULL) {
+	if (needsCheck(cn, p))
+	    alk->items[alk->nitems++].te = p;
+    }
+    rpmtsiFree(pi);
+
+    rpmalMakeIndex(tsmem->addedPackages);
+    rpmworkersRun(nthreads, alk->nitems, alLookupElement, alk);
+}
+
+/* Set the lookups for the next element of the serial pass */
+static void alLookupsNext(struct alLookups_s *alk, rpmte p)
+{
+    alk->cur = NULL;
+    if (alk->next < alk->nitems && alk->items[alk->next].te == p)
+	alk->cur = &alk->items[alk->next++];
+}
+
+static int alLookupMatch(const struct alLookups_s *alk, rpmds ds)
+{
+    const struct alLookup_s *item = alk ? alk->cur : NULL;
+
+    /* Elements added or replaced since by a solve callback? */
+    if (item == NULL || !alk->tsmem->depcheckValid ||
+	    alk->tsmem->orderCount != alk->ocount)
+	return -1;
+
+    for (int t = 0; t < NLOOKUPTAGS; t++) {
+	if (alLookupTags[t] == rpmdsTagN(ds))
+	    return item->match[t] ? item->match[t][rpmdsIx(ds)] : -1;
+    }
+    return -1;
+}
+
+static void alLookupsFini(struct alLookups_s *alk)
+{
+    for (int i = 0; i < alk->nitems; i++) {
+	for (int t = 0; t < NLOOKUPTAGS; t++)
+	    free(alk->items[i].match[t]);
+    }
+    free(alk->items);
+}
+
 /* Check a dependency set for problems */
 static void checkDS(rpmts ts, depCache dcache, rpmte te,
 		const char * pkgNEVRA, rpmds ds,
-		rpm_color_t tscolor)
+		rpm_color_t tscolor, const struct alLookups_s *alk)
 {
     rpm_color_t dscolor;
     /* require-problems are unsatisfied, others appear "satisfied" */
@@ -837,7 +1099,7 @@ static void checkDS(rpmts ts, depCache dcache, rpmte te,
 	if (tscolor && dscolor && !(tscolor & dscolor))
 	    continue;
 
-	if (unsatisfiedDepend(ts, dcache, ds) == is_problem)
+	if (unsatisfiedDepend(ts, dcache, ds, alLookupMatch(alk, ds)) == is_problem)
 	    rpmteAddDepProblem(te, pkgNEVRA, ds, NULL);
     }
 }
@@ -881,7 +1143,7 @@ static void checkInstDeps(rpmts ts, depCache dcache, rpmte te,
 	if (depds && !rpmdsIsRich(ds))
 	    match = rpmdsCompare(ds, depds);
 
-	if (match && unsatisfiedDepend(ts, dcache, ds) == is_problem) {
+	if (match && unsatisfiedDepend(ts, dcache, ds, -1) == is_problem) {
 	    char *pkgNEVRA = headerGetAsString(h, RPMTAG_NEVRA);
 	    rpmteAddDepProblem(te, pkgNEVRA, ds, NULL);
 	    free(pkgNEVRA);
@@ -952,35 +1214,240 @@ static void addDepToHash(rpmstrPool pool, depexistsHash hash, char *key, size_t
 	depexistsHashAddEntry(hash, rpmstrPoolIdn(pool, key, keylen, 1));
 }
 
-static void addIndexToDepHashes(rpmts ts, rpmDbiTag tag,
+/*
+ * Persistent copy of the Conflictname and Requirename index keys, stored
+ * next to the rpmdb and only trusted while the rpmdb cookie matches.
+ * Layout (host byte order): magic, version, cookie length, cookie, then
+ * per index: tag, section length and (key length, key) records.
+ */
+#define DEP_CACHE_MAGIC		"rpmdepc"
+#define DEP_CACHE_VERSION	1
+
+/* Cached indexes, in the order rpmtsCheck() reads them */
+static const rpmDbiTag depCacheTags[] = {
+    RPMTAG_CONFLICTNAME,
+    RPMTAG_REQUIRENAME,
+};
+
+struct depIndexCache_s {
+    char *path;			/*!< cache file, NULL if disabled */
+    char *cookie;		/*!< rpmdb cookie */
+    unsigned char *map;		/*!< mapped valid cache, or NULL */
+    size_t mapsize;
+    size_t off;			/*!< read position in map */
+    unsigned char *buf;		/*!< cache contents being built */
+    size_t buflen;
+    size_t bufalloced;
+};
+
+static void depCacheBufAdd(struct depIndexCache_s *c, const void *data, size_t len)
+{
+    if (c->buflen + len > c->bufalloced) {
+	c->bufalloced = (c->buflen + len) * 2;
+	c->buf = xrealloc(c->buf, c->bufalloced);
+    }
+    memcpy(c->buf + c->buflen, data, len);
+    c->buflen += len;
+}
+
+static void depCacheBufAddInt(struct depIndexCache_s *c, uint32_t val)
+{
+    depCacheBufAdd(c, &val, sizeof(val));
+}
+
+static int depCacheGetInt(const unsigned char *map, size_t mapsize,
+			  size_t *off, uint32_t *val)
+{
+    if (mapsize - *off < sizeof(*val))
+	return -1;
+    memcpy(val, map + *off, sizeof(*val));
+    *off += sizeof(*val);
+    return 0;
+}
+
+/* Check the whole file up front so lookups need no further bounds checks */
+static int depCacheValidate(const unsigned char *map, size_t mapsize,
+			    const char *cookie, size_t *dataoff)
+{
+    size_t mlen = sizeof(DEP_CACHE_MAGIC);
+    size_t off = mlen;
+    uint32_t version, len;
+
+    if (mapsize < mlen || memcmp(map, DEP_CACHE_MAGIC, mlen))
+	return -1;
+    if (depCacheGetInt(map, mapsize, &off, &version) ||
+	    version != DEP_CACHE_VERSION)
+	return -1;
+    if (depCacheGetInt(map, mapsize, &off, &len) || len != strlen(cookie) ||
+	    mapsize - off < len || memcmp(map + off, cookie, len))
+	return -1;
+    off += len;
+    *dataoff = off;
+
+    for (int i = 0; i < sizeof(depCacheTags) / sizeof(*depCacheTags); i++) {
+	uint32_t tag, slen;
+	size_t end;
+	if (depCacheGetInt(map, mapsize, &off, &tag) || tag != depCacheTags[i] ||
+		depCacheGetInt(map, mapsize, &off, &slen) ||
+		mapsize - off < slen)
+	    return -1;
+	for (end = off + slen; off < end; off += len) {
+	    if (depCacheGetInt(map, end, &off, &len) || end - off < len)
+		return -1;
+	}
+    }
+    return (off == mapsize) ? 0 : -1;
+}
+
+static void depIndexCacheInit(struct depIndexCache_s *c, rpmdb rdb)
+{
+    size_t dataoff = 0;
+    size_t size = 0;
+    void *map;
+
+    memset(c, 0, sizeof(*c));
+    if (rdb == NULL || rpmExpandNumeric("%{?_dep_cache}") <= 0)
+	return;
+    if ((c->cookie = rpmdbCookie(rdb)) == NULL)
+	return;
+    c->path = rpmGenPath(rpmdbHome(rdb), "depcache", NULL);
+
+    /* Only trusted files are used, like the other database caches */
+    if ((map = sidecarMap(c->path, 1, &size)) == NULL)
+	return;
+    if (depCacheValidate(map, size, c->cookie, &dataoff) == 0) {
+	c->map = map;
+	c->mapsize = size;
+	c->off = dataoff;
+    } else {
+	rpmlog(RPMLOG_DEBUG, "ignoring stale %s\n", c->path);
+	sidecarUnmap(map, size);
+    }
+}
+
+/* Return the cached keys of an index, NULL if they need to be scanned */
+static const unsigned char *depIndexCacheGet(struct depIndexCache_s *c,
+					     rpmDbiTag tag, size_t *len)
+{
+    uint32_t stag, slen;
+
+    if (c->map == NULL)
+	return NULL;
+    if (depCacheGetInt(c->map, c->mapsize, &c->off, &stag) ||
+	    depCacheGetInt(c->map, c->mapsize, &c->off, &slen) || stag != tag) {
+	/* out of step with depCacheTags, don't cache anything this time */
+	sidecarUnmap(c->map, c->mapsize);
+	c->map = NULL;
+	c->path = _free(c->path);
+	return NULL;
+    }
+    *len = slen;
+    c->off += slen;
+    return c->map + c->off - slen;
+}
+
+static int depCacheWrite(FILE *fp, void *data)
+{
+    struct depIndexCache_s *c = data;
+    uint32_t version = DEP_CACHE_VERSION;
+    uint32_t clen = strlen(c->cookie);
+
+    fwrite(DEP_CACHE_MAGIC, sizeof(DEP_CACHE_MAGIC), 1, fp);
+    fwrite(&version, sizeof(version), 1, fp);
+    fwrite(&clen, sizeof(clen), 1, fp);
+    fwrite(c->cookie, 1, clen, fp);
+    fwrite(c->buf, 1, c->buflen, fp);
+    return 0;
+}
+
+/* Concurrent checks each write a file of their own, the last one wins */
+static void depIndexCacheSave(struct depIndexCache_s *c)
+{
+    if (sidecarWrite(c->path, depCacheWrite, c))
+	rpmlog(RPMLOG_DEBUG, "failed to write %s: %m\n", c->path);
+}
+
+static void depIndexCacheFini(struct depIndexCache_s *c)
+{
+    if (c->map)
+	sidecarUnmap(c->map, c->mapsize);
+    else if (c->path && c->buf)
+	depIndexCacheSave(c);
+    free(c->buf);
+    free(c->path);
+    free(c->cookie);
+}
+
+static void addKeyToDepHashes(rpmstrPool pool, char *key, size_t keylen,
+				depexistsHash dephash, filedepHash filehash,
+				depexistsHash depnothash, filedepHash filenothash)
+{
+    if (!key || !keylen)
+	return;
+    if (*key == '!' && keylen > 1) {
+	key++;
+	keylen--;
+	if (*key == '/' && filenothash)
+	    addFileDepToHash(pool, filenothash, key, keylen);
+	if (depnothash)
+	    addDepToHash(pool, depnothash, key, keylen);
+    } else {
+	if (*key == '/' && filehash)
+	    addFileDepToHash(pool, filehash, key, keylen);
+	if (dephash)
+	    addDepToHash(pool, dephash, key, keylen);
+    }
+}
+
+static void addIndexToDepHashes(rpmts ts, struct depIndexCache_s *c,
+				rpmDbiTag tag,
 				depexistsHash dephash, filedepHash filehash,
 				depexistsHash depnothash, filedepHash filenothash)
 {
     rpmstrPool pool = rpmtsPool(ts);
+    const unsigned char *cached;
+    rpmdbIndexIterator ii;
     char *key;
     size_t keylen;
-    rpmdbIndexIterator ii = rpmdbIndexKeyIteratorInit(rpmtsGetRdb(ts), tag);
-
-    if (!ii)
+    size_t len, off, pos;
+
+    if ((cached = depIndexCacheGet(c, tag, &len)) != NULL) {
+	for (off = 0; off < len; off += keylen) {
+	    uint32_t klen;
+	    memcpy(&klen, cached + off, sizeof(klen));
+	    off += sizeof(klen);
+	    keylen = klen;
+	    addKeyToDepHashes(pool, (char *)cached + off, keylen,
+			      dephash, filehash, depnothash, filenothash);
+	}
 	return;
-    while ((rpmdbIndexIteratorNext(ii, (const void**)&key, &keylen)) == 0) {
-	if (!key || !keylen)
-	    continue;
-	if (*key == '!' && keylen > 1) {
-	    key++;
-	    keylen--;
-	    if (*key == '/' && filenothash)
-		addFileDepToHash(pool, filenothash, key, keylen);
-	    if (depnothash)
-		addDepToHash(pool, depnothash, key, keylen);
-	} else {
-	    if (*key == '/' && filehash)
-		addFileDepToHash(pool, filehash, key, keylen);
-	    if (dephash)
-		addDepToHash(pool, dephash, key, keylen);
+    }
+
+    if (c->path) {
+	depCacheBufAddInt(c, tag);
+	depCacheBufAddInt(c, 0);
+    }
+    pos = c->buflen;
+
+    ii = rpmdbIndexKeyIteratorInit(rpmtsGetRdb(ts), tag);
+    if (ii) {
+	while ((rpmdbIndexIteratorNext(ii, (const void**)&key, &keylen)) == 0) {
+	    if (!key || !keylen)
+		continue;
+	    if (c->path) {
+		depCacheBufAddInt(c, keylen);
+		depCacheBufAdd(c, key, keylen);
+	    }
+	    addKeyToDepHashes(pool, key, keylen,
+			      dephash, filehash, depnothash, filenothash);
 	}
+	rpmdbIndexIteratorFree(ii);
+    }
+
+    if (c->path) {
+	uint32_t slen = c->buflen - pos;
+	memcpy(c->buf + pos - sizeof(slen), &slen, sizeof(slen));
     }
-    rpmdbIndexIteratorFree(ii);
 }
 
 static unsigned int sidHash(rpmsid sid)
@@ -1009,7 +1476,17 @@ int rpmtsCheck(rpmts ts)
     depexistsHash reqnothash = NULL;
     fingerPrintCache fpc = NULL;
     rpmdb rdb = NULL;
+    struct depIndexCache_s dic;
+    struct changedNames_s changed;
+    struct changedNames_s *cn = NULL;
+    struct alLookups_s alk;
+    tsMembers tsmem = rpmtsMembers(ts);
+    int ocount = tsmem->orderCount;
+    int dbchanged = 0;
     
+    memset(&dic, 0, sizeof(dic));
+    memset(&changed, 0, sizeof(changed));
+    memset(&alk, 0, sizeof(alk));
     (void) rpmswEnter(rpmtsOp(ts, RPMTS_OP_CHECK), 0);
 
     /* Do lazy, readonly, open of rpm database. */
@@ -1024,15 +1501,33 @@ int rpmtsCheck(rpmts ts)
     if (rdb)
 	rpmdbCtrl(rdb, RPMDB_CTRL_LOCK_RO);
 
-    /* XXX FIXME: figure some kind of heuristic for the cache size */
-    dcache = depCacheCreate(5001, rstrhash, strcmp,
-				     (depCacheFreeKey)rfree, NULL);
+    depIndexCacheInit(&dic, rdb);
+
+    dcache = rpmtsGetDepCache(ts, rdb, &dbchanged);
+
+    /*
+     * With the rpmdb and the added set only grown since the last check,
+     * look at just the elements the newcomers can affect.
+     */
+    if (tsmem->depcheckValid && !dbchanged && tsmem->depcheckColor == tscolor) {
+	changed.pool = rpmtsPool(ts);
+	changed.names = depexistsHashCreate(257, sidHash, sidCmp, NULL);
+	pi = rpmtsiInit(ts);
+	while ((p = rpmtsiNext(pi, 0)) != NULL) {
+	    if (!rpmteDepChecked(p))
+		addChangedNames(&changed, p);
+	}
+	pi = rpmtsiFree(pi);
+	cn = &changed;
+    }
+    tsmem->depcheckValid = 1;
+    tsmem->depcheckColor = tscolor;
 
     /* build hashes of all confilict sdependencies */
     confilehash = filedepHashCreate(257, sidHash, sidCmp, NULL, NULL);
     connothash = depexistsHashCreate(257, sidHash, sidCmp, NULL);
     connotfilehash = filedepHashCreate(257, sidHash, sidCmp, NULL, NULL);
-    addIndexToDepHashes(ts, RPMTAG_CONFLICTNAME, NULL, confilehash, connothash, connotfilehash);
+    addIndexToDepHashes(ts, &dic, RPMTAG_CONFLICTNAME, NULL, confilehash, connothash, connotfilehash);
     if (!filedepHashNumKeys(confilehash))
 	confilehash = filedepHashFree(confilehash);
     if (!depexistsHashNumKeys(connothash))
@@ -1044,7 +1539,7 @@ int rpmtsCheck(rpmts ts)
     reqfilehash = filedepHashCreate(8191, sidHash, sidCmp, NULL, NULL);
     reqnothash = depexistsHashCreate(257, sidHash, sidCmp, NULL);
     reqnotfilehash = filedepHashCreate(257, sidHash, sidCmp, NULL, NULL);
-    addIndexToDepHashes(ts, RPMTAG_REQUIRENAME, NULL, reqfilehash, reqnothash, reqnotfilehash);
+    addIndexToDepHashes(ts, &dic, RPMTAG_REQUIRENAME, NULL, reqfilehash, reqnothash, reqnotfilehash);
     if (!filedepHashNumKeys(reqfilehash))
 	reqfilehash = filedepHashFree(reqfilehash);
     if (!depexistsHashNumKeys(reqnothash))
@@ -1052,23 +1547,34 @@ int rpmtsCheck(rpmts ts)
     if (!filedepHashNumKeys(reqnotfilehash))
 	reqnotfilehash = filedepHashFree(reqnotfilehash);
 
+    depIndexCacheFini(&dic);
+
+    /* Do the added set lookups of the elements in parallel */
+    alLookupsInit(&alk, ts, cn);
+
     /*
      * Look at all of the added packages and make sure their dependencies
      * are satisfied.
      */
     pi = rpmtsiInit(ts);
     while ((p = rpmtsiNext(pi, TR_ADDED)) != NULL) {
-	rpmds provides = rpmdsInit(rpmteDS(p, RPMTAG_PROVIDENAME));
+	rpmds provides;
+
+	if (!needsCheck(cn, p))
+	    continue;
+	rpmteSetDepChecked(p, 1);
+	alLookupsNext(&alk, p);
+	provides = rpmdsInit(rpmteDS(p, RPMTAG_PROVIDENAME));
 
 	rpmlog(RPMLOG_DEBUG, "========== +++ %s %s/%s 0x%x\n",
 		rpmteNEVR(p), rpmteA(p), rpmteO(p), rpmteColor(p));
 
 	checkDS(ts, dcache, p, rpmteNEVRA(p), rpmteDS(p, RPMTAG_REQUIRENAME),
-		tscolor);
+		tscolor, &alk);
 	checkDS(ts, dcache, p, rpmteNEVRA(p), rpmteDS(p, RPMTAG_CONFLICTNAME),
-		tscolor);
+		tscolor, &alk);
 	checkDS(ts, dcache, p, rpmteNEVRA(p), rpmteDS(p, RPMTAG_OBSOLETENAME),
-		tscolor);
+		tscolor, &alk);
 
 	/* Skip obsoletion and provides checks for source packages (ie build) */
 	if (rpmteIsSource(p))
@@ -1105,7 +1611,12 @@ int rpmtsCheck(rpmts ts)
      */
     pi = rpmtsiInit(ts);
     while ((p = rpmtsiNext(pi, TR_REMOVED)) != NULL) {
-	rpmds provides = rpmdsInit(rpmteDS(p, RPMTAG_PROVIDENAME));
+	rpmds provides;
+
+	if (!needsCheck(cn, p))
+	    continue;
+	rpmteSetDepChecked(p, 1);
+	provides = rpmdsInit(rpmteDS(p, RPMTAG_PROVIDENAME));
 
 	rpmlog(RPMLOG_DEBUG, "========== --- %s %s/%s 0x%x\n",
 		rpmteNEVR(p), rpmteA(p), rpmteO(p), rpmteColor(p));
@@ -1134,11 +1645,16 @@ int rpmtsCheck(rpmts ts)
     }
     rpmtsiFree(pi);
 
+    /* Elements added behind our back (eg by a solve callback) */
+    if (tsmem->orderCount != ocount)
+	tsmem->depcheckValid = 0;
+
     if (rdb)
 	rpmdbCtrl(rdb, RPMDB_CTRL_UNLOCK_RO);
 
 exit:
-    depCacheFree(dcache);
+    alLookupsFini(&alk);
+    depexistsHashFree(changed.names);
     filedepHashFree(confilehash);
     filedepHashFree(connotfilehash);
     depexistsHashFree(connothash);
@@ -0,0 +1,200 @@
+#include "system.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rpm/rpmlog.h>
+#include <rpm/rpmstring.h>
+
+#include "lib/filefilter.h"
+#include "lib/sidecar.h"
+
+#include "debug.h"
+
+#define FILEFILTER_MAGIC	"RPMFFLT1"
+#define FILEFILTER_NHASH	7	/* ~1% false positives at 10 bits a key */
+#define FILEFILTER_KEYBITS	10
+#define FILEFILTER_MINBITS	1024
+
+/*
+ * A sidecar file:
+ *	head
+ *	bits[nbits / 8]
+ */
+struct filterHead_s {
+    struct sidecarHead_s sc;
+    uint32_t nbits;		/* power of two */
+    uint32_t nhash;
+    uint32_t count;
+    uint32_t pad;
+};
+
+/*
+ * While being built the filter only collects the key hashes, the bit
+ * array can only be sized once their number is known.
+ */
+struct fileFilter_s {
+    struct hdrShmId_s id;
+    void *map;
+    size_t mapsize;
+    const uint8_t *bits;
+    uint32_t nbits;
+    uint32_t count;
+    uint64_t *hashes;
+    unsigned int alloced;
+};
+
+/* 64-bit FNV-1a, the halves make the two hashes of double hashing */
+static uint64_t keyHash(const char *key, size_t keylen)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < keylen; i++) {
+	h ^= (unsigned char) key[i];
+	h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static void filterFinish(fileFilter ff)
+{
+    uint8_t *bits;
+
+    if (ff->bits)
+	return;
+
+    ff->nbits = FILEFILTER_MINBITS;
+    while (ff->nbits / FILEFILTER_KEYBITS < ff->count && ff->nbits < (1U << 31))
+	ff->nbits <<= 1;
+
+    bits = xcalloc(ff->nbits / 8, 1);
+    for (unsigned int i = 0; i < ff->count; i++) {
+	uint32_t h1 = ff->hashes[i], h2 = (ff->hashes[i] >> 32) | 1;
+	for (unsigned int k = 0; k < FILEFILTER_NHASH; k++) {
+	    uint32_t b = (h1 + k * h2) & (ff->nbits - 1);
+	    bits[b / 8] |= 1 << (b % 8);
+	}
+    }
+    ff->hashes = _free(ff->hashes);
+    ff->alloced = 0;
+    ff->bits = bits;
+}
+
+fileFilter fileFilterNew(const struct hdrShmId_s *id)
+{
+    fileFilter ff = xcalloc(1, sizeof(*ff));
+    ff->id = *id;
+    return ff;
+}
+
+void fileFilterAdd(fileFilter ff, const char *key, size_t keylen)
+{
+    if (ff->bits)
+	return;
+    if (ff->count == ff->alloced) {
+	ff->alloced = ff->alloced ? ff->alloced * 2 : 4096;
+	ff->hashes = xrealloc(ff->hashes, ff->alloced * sizeof(*ff->hashes));
+    }
+    ff->hashes[ff->count++] = keyHash(key, keylen);
+}
+
+int fileFilterHas(fileFilter ff, const char *key, size_t keylen)
+{
+    uint64_t h = keyHash(key, keylen);
+    uint32_t h1 = h, h2 = (h >> 32) | 1;
+
+    filterFinish(ff);
+    for (unsigned int k = 0; k < FILEFILTER_NHASH; k++) {
+	uint32_t b = (h1 + k * h2) & (ff->nbits - 1);
+	if (!(ff->bits[b / 8] & (1 << (b % 8))))
+	    return 0;
+    }
+    return 1;
+}
+
+fileFilter fileFilterLoad(const char *path, const struct hdrShmId_s *id)
+{
+    const struct filterHead_s *head;
+    fileFilter ff = NULL;
+    size_t size = 0;
+    void *map;
+
+    if ((map = sidecarMap(path, sizeof(*head), &size)) == NULL)
+	goto exit;
+
+    head = map;
+    if (!sidecarHeadValid(map, size, FILEFILTER_MAGIC, id) ||
+	    head->nhash != FILEFILTER_NHASH ||
+	    head->nbits < FILEFILTER_MINBITS ||
+	    (head->nbits & (head->nbits - 1)) ||
+	    size != sizeof(*head) + head->nbits / 8) {
+	sidecarUnmap(map, size);
+	goto exit;
+    }
+
+    ff = xcalloc(1, sizeof(*ff));
+    ff->id = *id;
+    ff->map = map;
+    ff->mapsize = size;
+    ff->bits = (const uint8_t *)(head + 1);
+    ff->nbits = head->nbits;
+    ff->count = head->count;
+
+    rpmlog(RPMLOG_DEBUG, "loaded filter of %u basenames from %s\n",
+	   ff->count, path);
+
+exit:
+    return ff;
+}
+
+static int filterWrite(FILE *fp, void *data)
+{
+    fileFilter ff = data;
+    struct filterHead_s head;
+
+    memset(&head, 0, sizeof(head));
+    sidecarHeadInit(&head.sc, FILEFILTER_MAGIC, &ff->id,
+		    sizeof(head) + ff->nbits / 8);
+    head.nbits = ff->nbits;
+    head.nhash = FILEFILTER_NHASH;
+    head.count = ff->count;
+
+    fwrite(&head, sizeof(head), 1, fp);
+    fwrite(ff->bits, 1, ff->nbits / 8, fp);
+    return 0;
+}
+
+int fileFilterWrite(fileFilter ff, const char *path)
+{
+    int rc;
+
+    filterFinish(ff);
+
+    rc = sidecarWrite(path, filterWrite, ff);
+    if (rc) {
+	rpmlog(RPMLOG_DEBUG, "failed to store file filter %s: %s\n",
+		path, strerror(errno));
+    } else {
+	rpmlog(RPMLOG_DEBUG, "stored filter of %u basenames in %s\n",
+		ff->count, path);
+    }
+    return rc;
+}
+
+fileFilter fileFilterFree(fileFilter ff)
+{
+    if (ff) {
+	if (ff->map)
+	    sidecarUnmap(ff->map, ff->mapsize);
+	else
+	    free((void *) ff->bits);
+	free(ff->hashes);
+	free(ff);
+    }
+    return NULL;
+}
+
+int fileFilterMatches(fileFilter ff, const struct hdrShmId_s *id)
+{
+    return (memcmp(&ff->id, id, sizeof(*id)) == 0);
+}
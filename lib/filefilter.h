@@ -0,0 +1,92 @@
+#ifndef FILEFILTER_H
+#define FILEFILTER_H
+
+/** \file lib/filefilter.h
+ * Bloom filter of the file basenames in a rpmdb.
+ *
+ * A basename the filter doesn't have is owned by no package, so lookups
+ * of unowned files can be answered without touching the Basenames index.
+ * The filter is built from the index keys and stored next to the
+ * database, tied to the state of the database file like the trigger
+ * index.
+ */
+
+#include <rpm/rpmtypes.h>
+#include <rpm/rpmutil.h>
+
+#include "lib/hdrshm.h"		/* struct hdrShmId_s */
+
+typedef struct fileFilter_s * fileFilter;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Create an empty file filter.
+ * @param id		identity of the database it's made from
+ * @return		new filter
+ */
+RPM_GNUC_INTERNAL
+fileFilter fileFilterNew(const struct hdrShmId_s *id);
+
+/**
+ * Map the file filter stored for a database in its current state.
+ * @param path		filter file path
+ * @param id		database identity
+ * @return		filter, NULL if there's none or it's stale
+ */
+RPM_GNUC_INTERNAL
+fileFilter fileFilterLoad(const char *path, const struct hdrShmId_s *id);
+
+/**
+ * Store a file filter.
+ * @param ff		file filter
+ * @param path		filter file path
+ * @return		0 on success, -1 on error
+ */
+RPM_GNUC_INTERNAL
+int fileFilterWrite(fileFilter ff, const char *path);
+
+/**
+ * Free a file filter.
+ * @param ff		file filter (or NULL)
+ * @return		NULL always
+ */
+RPM_GNUC_INTERNAL
+fileFilter fileFilterFree(fileFilter ff);
+
+/**
+ * Is the filter made from the database in this state?
+ * @param ff		file filter
+ * @param id		database identity
+ * @return		1 if it is, 0 otherwise
+ */
+RPM_GNUC_INTERNAL
+int fileFilterMatches(fileFilter ff, const struct hdrShmId_s *id);
+
+/**
+ * Add a basename to a filter that's being built.
+ * @param ff		file filter
+ * @param key		basename
+ * @param keylen	basename length
+ */
+RPM_GNUC_INTERNAL
+void fileFilterAdd(fileFilter ff, const char *key, size_t keylen);
+
+/**
+ * Might a basename be in the database? The first lookup or write ends
+ * building the filter.
+ * @param ff		file filter
+ * @param key		basename
+ * @param keylen	basename length
+ * @return		0 if it's certainly not, 1 if it might be
+ */
+RPM_GNUC_INTERNAL
+int fileFilterHas(fileFilter ff, const char *key, size_t keylen);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FILEFILTER_H */
@@ -4,6 +4,7 @@
 
 #include "system.h"
 
+#include <pthread.h>
 #include <rpm/rpmfileutil.h>	/* for rpmCleanPath */
 #include <rpm/rpmstring.h>
 #include <rpm/rpmts.h>
@@ -14,6 +15,7 @@
 #include "lib/rpmte_internal.h"
 #include "lib/fprint.h"
 #include "lib/misc.h"
+#include "lib/rpmworkers.h"
 #include "debug.h"
 #include <libgen.h>
 
@@ -25,7 +27,7 @@
 #define HTKEYTYPE rpmsid
 #define HTDATATYPE const struct fprintCacheEntry_s *
 #include "lib/rpmhash.H"
-#include "lib/rpmhash.C"
+#include "lib/rpmhashoa.C"
 
 /* Create by-fingerprint hash table */
 #undef HASHTYPE
@@ -35,7 +37,17 @@
 #define HTKEYTYPE const fingerPrint *
 #define HTDATATYPE struct rpmffi_s
 #include "lib/rpmhash.H"
-#include "lib/rpmhash.C"
+#include "lib/rpmhashoa.C"
+#undef HASHTYPE
+#undef HTKEYTYPE
+#undef HTDATATYPE
+
+/* Create by-fingerprint symlink target hash table */
+#define HASHTYPE rpmFpLinkHash
+#define HTKEYTYPE const fingerPrint *
+#define HTDATATYPE const char *
+#include "lib/rpmhash.H"
+#include "lib/rpmhashoa.C"
 #undef HASHTYPE
 #undef HTKEYTYPE
 #undef HTDATATYPE
@@ -87,8 +99,10 @@ struct fingerPrint_s {
  */
 struct fprintCache_s {
     rpmFpEntryHash ht;			/*!< hashed by dirName */
-    rpmFpHash fp;			/*!< hashed by fingerprint */
+    rpmFpHash *fp;			/*!< hashed by fingerprint, sharded */
+    int nshards;			/*!< number of fp shards */
     rpmstrPool pool;			/*!< string pool */
+    pthread_mutex_t lock;		/*!< protects ht */
 };
 
 fingerPrintCache fpCacheCreate(int sizeHint, rpmstrPool pool)
@@ -99,6 +113,7 @@ fingerPrintCache fpCacheCreate(int sizeHint, rpmstrPool pool)
     fpc->ht = rpmFpEntryHashCreate(sizeHint, sidHash, sidCmp,
 				   NULL, (rpmFpEntryHashFreeData)free);
     fpc->pool = (pool != NULL) ? rpmstrPoolLink(pool) : rpmstrPoolCreate();
+    pthread_mutex_init(&fpc->lock, NULL);
     return fpc;
 }
 
@@ -106,8 +121,11 @@ fingerPrintCache fpCacheFree(fingerPrintCache cache)
 {
     if (cache) {
 	cache->ht = rpmFpEntryHashFree(cache->ht);
-	cache->fp = rpmFpHashFree(cache->fp);
+	for (int i = 0; i < cache->nshards; i++)
+	    rpmFpHashFree(cache->fp[i]);
+	free(cache->fp);
 	cache->pool = rpmstrPoolFree(cache->pool);
+	pthread_mutex_destroy(&cache->lock);
 	free(cache);
     }
     return NULL;
@@ -123,10 +141,38 @@ static const struct fprintCacheEntry_s * cacheContainsDirectory(
 			    fingerPrintCache cache, rpmsid dirId)
 {
     const struct fprintCacheEntry_s ** data;
+    const struct fprintCacheEntry_s * entry = NULL;
 
+    pthread_mutex_lock(&cache->lock);
     if (rpmFpEntryHashGetEntry(cache->ht, dirId, &data, NULL, NULL))
-	return data[0];
-    return NULL;
+	entry = data[0];
+    pthread_mutex_unlock(&cache->lock);
+    return entry;
+}
+
+/**
+ * Add directory name entry to cache, unless another thread beat us to it.
+ * @param cache		pointer to fingerprint cache
+ * @param newEntry	directory name entry to add
+ * @return pointer to the directory name entry in the cache
+ */
+static const struct fprintCacheEntry_s * cacheAddDirectory(
+			    fingerPrintCache cache,
+			    struct fprintCacheEntry_s * newEntry)
+{
+    const struct fprintCacheEntry_s ** data;
+    const struct fprintCacheEntry_s * entry = newEntry;
+
+    pthread_mutex_lock(&cache->lock);
+    if (rpmFpEntryHashGetEntry(cache->ht, newEntry->dirId, &data, NULL, NULL))
+	entry = data[0];
+    else
+	rpmFpEntryHashAddEntry(cache->ht, newEntry->dirId, newEntry);
+    pthread_mutex_unlock(&cache->lock);
+
+    if (entry != newEntry)
+	free(newEntry);
+    return entry;
 }
 
 static char * canonDir(rpmstrPool pool, rpmsid dirNameId)
@@ -187,9 +233,7 @@ static int doLookupId(fingerPrintCache cache,
 	    newEntry->ino = sb.st_ino;
 	    newEntry->dev = sb.st_dev;
 	    newEntry->dirId = fpId;
-	    fp->entry = newEntry;
-
-	    rpmFpEntryHashAddEntry(cache->ht, fpId, fp->entry);
+	    fp->entry = cacheAddDirectory(cache, newEntry);
 	}
 
         if (fp->entry) {
@@ -247,6 +291,17 @@ int fpLookupId(fingerPrintCache cache,
     return doLookupId(cache, dirNameId, baseNameId, *fp);
 }
 
+fingerPrint * fpLookupNames(fingerPrintCache cache,
+			    const char ** dirNames, const char ** baseNames,
+			    int fileCount)
+{
+    fingerPrint * fps = xmalloc(fileCount * sizeof(*fps));
+
+    for (int i = 0; i < fileCount; i++)
+	doLookup(cache, dirNames[i], baseNames[i], &fps[i]);
+    return fps;
+}
+
 /**
  * Return hash value for a finger print.
  * Hash based on dev and inode only!
@@ -340,13 +395,13 @@ fingerPrint * fpLookupList(fingerPrintCache cache, rpmstrPool pool,
 }
 
 /* Check file for to be installed symlinks in their path and correct their fp */
-static void fpLookupSubdir(rpmFpHash symlinks, fingerPrintCache fpc, fingerPrint *fp)
+static void fpLookupSubdir(rpmFpLinkHash symlinks, fingerPrintCache fpc, fingerPrint *fp)
 {
     struct fingerPrint_s current_fp;
     const char *currentsubdir;
     size_t lensubDir, bnStart, bnEnd;
 
-    struct rpmffi_s * recs;
+    const char ** recs;
     int numRecs;
     int i;
     int symlinkcount = 0;
@@ -373,16 +428,13 @@ static void fpLookupSubdir(rpmFpHash symlinks, fingerPrintCache fpc, fingerPrint
 						    currentsubdir + bnStart,
 						    bnEnd - bnStart, 1);
 
-	    rpmFpHashGetEntry(symlinks, &current_fp, &recs, &numRecs, NULL);
+	    rpmFpLinkHashGetEntry(symlinks, &current_fp, &recs, &numRecs, NULL);
 
 	    for (i = 0; i < numRecs; i++) {
-		rpmfiles foundfi = rpmteFiles(recs[i].p);
-		char const *linktarget = rpmfilesFLink(foundfi, recs[i].fileno);
+		char const *linktarget = recs[i];
 		char *link;
 		rpmsid linkId;
 
-		foundfi = rpmfilesFree(foundfi);
-
 		if (!linktarget || *linktarget == '\0')
 		    continue;
 
@@ -432,102 +484,269 @@ static void fpLookupSubdir(rpmFpHash symlinks, fingerPrintCache fpc, fingerPrint
     }
 }
 
+/*
+ * The shard is picked from the high bits of the mixed hash: the tables
+ * index by the low bits, which must not be the same for all the keys of
+ * a shard.
+ */
+static int hashShard(unsigned int hash, int nshards)
+{
+    return ((hash * 2654435761U) >> 16) % nshards;
+}
+
+int fpCacheShards(fingerPrintCache cache)
+{
+    return cache->nshards;
+}
+
+int fpCacheShard(fingerPrintCache cache, struct fingerPrint_s * fp, int ix)
+{
+    return (cache->nshards > 1) ?
+	    hashShard(fpHashFunction(fp + ix), cache->nshards) : 0;
+}
+
 fingerPrint * fpCacheGetByFp(fingerPrintCache cache,
 			     struct fingerPrint_s * fp, int ix,
 			     struct rpmffi_s ** recs, int * numRecs)
 {
-    if (rpmFpHashGetEntry(cache->fp, fp + ix, recs, numRecs, NULL))
+    unsigned int hash = fpHashFunction(fp + ix);
+    int shard = (cache->nshards > 1) ? hashShard(hash, cache->nshards) : 0;
+
+    if (cache->fp &&
+	rpmFpHashGetHEntry(cache->fp[shard], fp + ix, hash, recs, numRecs, NULL))
 	return fp + ix;
     else
 	return NULL;
 }
 
+/* Per-package state for populating the fingerprint cache */
+struct fpPkg_s {
+    rpmte p;
+    rpmfiles fi;
+    rpmfs fs;
+    int fc;
+};
+
+/* A file to add to a fingerprint hash shard */
+struct fpShardEntry_s {
+    int pkgix;
+    int fileno;
+    unsigned int hash;
+};
+
+struct fpWork_s {
+    fingerPrintCache fpc;
+    rpmFpLinkHash symlinks;
+    struct fpPkg_s *pkgs;
+    int npkgs;
+    unsigned int **hashes;		/* per package file hashes */
+    struct fpShardEntry_s *entries;	/* files grouped by shard */
+    int *shardstart;			/* nshards + 1 offsets in entries */
+};
+
+static void fpPkgLookup(void *data, int ix, int slot)
+{
+    struct fpWork_s *work = data;
+    rpmfilesFpLookup(work->pkgs[ix].fi, work->fpc);
+}
+
+static void fpPkgLookupSubdirs(void *data, int ix, int slot)
+{
+    struct fpWork_s *work = data;
+    struct fpPkg_s *pkg = &work->pkgs[ix];
+    fingerPrint *fpList = rpmfilesFps(pkg->fi);
+    fingerPrint *lastfp = NULL;
+
+    for (int i = 0; i < pkg->fc; i++) {
+	if (XFA_SKIPPING(rpmfsGetAction(pkg->fs, i)))
+	    continue;
+	/* if the entry/subdirid matches the one from the
+	 * last entry we do not need to call fpLookupSubdir */
+	if (!lastfp || lastfp->entry != fpList[i].entry ||
+		lastfp->subDirId != fpList[i].subDirId)
+	    fpLookupSubdir(work->symlinks, work->fpc, fpList + i);
+	lastfp = fpList + i;
+    }
+}
+
+static void fpPkgHash(void *data, int ix, int slot)
+{
+    struct fpWork_s *work = data;
+    struct fpPkg_s *pkg = &work->pkgs[ix];
+    fingerPrint *fpList = rpmfilesFps(pkg->fi);
+    unsigned int *hashes = xmalloc((pkg->fc + 1) * sizeof(*hashes));
+
+    for (int i = 0; i < pkg->fc; i++) {
+	if (!XFA_SKIPPING(rpmfsGetAction(pkg->fs, i)))
+	    hashes[i] = fpHashFunction(fpList + i);
+    }
+    work->hashes[ix] = hashes;
+}
+
+static void fpShardFill(void *data, int shard, int slot)
+{
+    struct fpWork_s *work = data;
+    rpmFpHash ht = work->fpc->fp[shard];
+    int start = work->shardstart[shard];
+    int end = work->shardstart[shard + 1];
+
+    rpmFpHashReserve(ht, rpmFpHashNumKeys(ht) + (end - start));
+    for (int e = start; e < end; e++) {
+	struct fpShardEntry_s *entry = &work->entries[e];
+	struct fpPkg_s *pkg = &work->pkgs[entry->pkgix];
+	struct rpmffi_s ffi = {
+	    .p = pkg->p,
+	    .fileno = entry->fileno,
+	};
+	rpmFpHashAddHEntry(ht, rpmfilesFps(pkg->fi) + entry->fileno,
+			   entry->hash, ffi);
+    }
+}
+
 void fpCachePopulate(fingerPrintCache fpc, rpmts ts, int fileCount)
 {
     rpmtsi pi;
     rpmte p;
-    rpmfs fs;
-    rpmfiles fi;
-    int i, fc;
+    int i, fc = 0;
     int havesymlinks = 0;
+    int nthreads = rpmworkersCount("_fingerprint_threads");
+    struct fpWork_s work = {
+	.fpc = fpc,
+	.pkgs = xcalloc(rpmtsNElements(ts), sizeof(*work.pkgs)),
+    };
+    fingerPrint *linkfps = NULL;
+    int nlinks = 0, linksalloced = 0;
+    int nentries = 0;
+
+    /* Shards are filled, and later probed, independently of each other */
+    if (fpc->fp == NULL) {
+	fpc->nshards = nthreads > 1 ? nthreads * 4 : 1;
+	fpc->fp = xcalloc(fpc->nshards, sizeof(*fpc->fp));
+	for (i = 0; i < fpc->nshards; i++) {
+	    fpc->fp[i] = rpmFpHashCreate(fileCount / fpc->nshards + 16,
+					 fpHashFunction, fpEqual, NULL, NULL);
+	}
+    }
 
-    if (fpc->fp == NULL)
-	fpc->fp = rpmFpHashCreate(fileCount/2 + 10001, fpHashFunction, fpEqual,
-				  NULL, NULL);
-
-    rpmFpHash symlinks = rpmFpHashCreate(fileCount/16+16, fpHashFunction, fpEqual, NULL, NULL);
-
-    /* populate the fingerprints of all packages in the transaction */
-    /* also create a hash of all symlinks in the new packages */
     pi = rpmtsiInit(ts);
     while ((p = rpmtsiNext(pi, 0)) != NULL) {
-	if ((fi = rpmteFiles(p)) == NULL)
+	struct fpPkg_s *pkg = &work.pkgs[work.npkgs];
+	if ((pkg->fi = rpmteFiles(p)) == NULL)
 	    continue;
+	pkg->p = p;
+	pkg->fs = rpmteGetFileStates(p);
+	pkg->fc = rpmfsFC(pkg->fs);
+	fc += pkg->fc;
+	work.npkgs++;
+    }
+    rpmtsiFree(pi);
 
-	(void) rpmswEnter(rpmtsOp(ts, RPMTS_OP_FINGERPRINT), 0);
-	rpmfilesFpLookup(fi, fpc);
-	fs = rpmteGetFileStates(p);
-	fc = rpmfsFC(fs);
+    /* populate the fingerprints of all packages in the transaction */
+    (void) rpmswEnter(rpmtsOp(ts, RPMTS_OP_FINGERPRINT), 0);
+    rpmworkersRun(nthreads, work.npkgs, fpPkgLookup, &work);
 
-	if (rpmteType(p) != TR_REMOVED) {
-	    fingerPrint *fpList = rpmfilesFps(fi);
-	    /* collect symbolic links */
-	    for (i = 0; i < fc; i++) {
-		struct rpmffi_s ffi;
+    /*
+     * Collect the symbolic links of the new packages. The fingerprints
+     * are copied as the originals may get adjusted below, so the results
+     * don't depend on the order packages get processed in.
+     */
+    for (int n = 0; n < work.npkgs; n++) {
+	struct fpPkg_s *pkg = &work.pkgs[n];
+	if (rpmteType(pkg->p) == TR_REMOVED)
+	    continue;
+	for (i = 0; i < pkg->fc; i++) {
+	    char const *linktarget;
+	    if (XFA_SKIPPING(rpmfsGetAction(pkg->fs, i)))
+		continue;
+	    linktarget = rpmfilesFLink(pkg->fi, i);
+	    if (!(linktarget && *linktarget != '\0'))
+		continue;
+	    if (nlinks == linksalloced) {
+		linksalloced = linksalloced ? linksalloced * 2 : 64;
+		linkfps = xrealloc(linkfps, linksalloced * sizeof(*linkfps));
+	    }
+	    linkfps[nlinks++] = rpmfilesFps(pkg->fi)[i];
+	}
+    }
+
+    if (nlinks) {
+	int l = 0;
+	havesymlinks = 1;
+	work.symlinks = rpmFpLinkHashCreate(nlinks, fpHashFunction, fpEqual,
+					    NULL, NULL);
+	for (int n = 0; n < work.npkgs; n++) {
+	    struct fpPkg_s *pkg = &work.pkgs[n];
+	    if (rpmteType(pkg->p) == TR_REMOVED)
+		continue;
+	    for (i = 0; i < pkg->fc; i++) {
 		char const *linktarget;
-		if (XFA_SKIPPING(rpmfsGetAction(fs, i)))
+		if (XFA_SKIPPING(rpmfsGetAction(pkg->fs, i)))
 		    continue;
-		linktarget = rpmfilesFLink(fi, i);
+		linktarget = rpmfilesFLink(pkg->fi, i);
 		if (!(linktarget && *linktarget != '\0'))
 		    continue;
-		ffi.p = p;
-		ffi.fileno = i;
-		rpmFpHashAddEntry(symlinks, fpList + i, ffi);
-		havesymlinks = 1;
+		rpmFpLinkHashAddEntry(work.symlinks, linkfps + l++, linktarget);
 	    }
 	}
-
-	(void) rpmswExit(rpmtsOp(ts, RPMTS_OP_FINGERPRINT), fc);
-	rpmfilesFree(fi);
     }
-    rpmtsiFree(pi);
+
+    /* Adapt the fingerprints if we have symlinks */
+    if (havesymlinks)
+	rpmworkersRun(nthreads, work.npkgs, fpPkgLookupSubdirs, &work);
 
     /* ===============================================
-     * Create the fingerprint -> (p, fileno) hash table
-     * Also adapt the fingerprint if we have symlinks
+     * Create the fingerprint -> (p, fileno) hash table. The files are
+     * grouped by shard in transaction order, so each key gets its
+     * entries in the same order as when adding them one by one.
      */
-    pi = rpmtsiInit(ts);
-    while ((p = rpmtsiNext(pi, 0)) != NULL) {
-	fingerPrint *fpList, *lastfp = NULL;
-
-	if ((fi = rpmteFiles(p)) == NULL)
-	    continue;
-
-	fs = rpmteGetFileStates(p);
-	fc = rpmfsFC(fs);
-	fpList = rpmfilesFps(fi);
-	(void) rpmswEnter(rpmtsOp(ts, RPMTS_OP_FINGERPRINT), 0);
-	for (i = 0; i < fc; i++) {
-	    struct rpmffi_s ffi;
-	    if (XFA_SKIPPING(rpmfsGetAction(fs, i)))
+    work.hashes = xcalloc(work.npkgs + 1, sizeof(*work.hashes));
+    work.shardstart = xcalloc(fpc->nshards + 1, sizeof(*work.shardstart));
+    rpmworkersRun(nthreads, work.npkgs, fpPkgHash, &work);
+
+    for (int n = 0; n < work.npkgs; n++) {
+	struct fpPkg_s *pkg = &work.pkgs[n];
+	for (i = 0; i < pkg->fc; i++) {
+	    if (XFA_SKIPPING(rpmfsGetAction(pkg->fs, i)))
 		continue;
-	    if (havesymlinks) {
-		/* if the entry/subdirid matches the one from the
-		 * last entry we do not need to call fpLookupSubdir */
-		if (!lastfp || lastfp->entry != fpList[i].entry ||
-			lastfp->subDirId != fpList[i].subDirId)
-		    fpLookupSubdir(symlinks, fpc, fpList + i);
+	    work.shardstart[hashShard(work.hashes[n][i], fpc->nshards) + 1]++;
+	    nentries++;
+	}
+    }
+    for (i = 0; i < fpc->nshards; i++)
+	work.shardstart[i + 1] += work.shardstart[i];
+
+    work.entries = xmalloc((nentries + 1) * sizeof(*work.entries));
+    {
+	int *pos = xmalloc(fpc->nshards * sizeof(*pos));
+	memcpy(pos, work.shardstart, fpc->nshards * sizeof(*pos));
+	for (int n = 0; n < work.npkgs; n++) {
+	    struct fpPkg_s *pkg = &work.pkgs[n];
+	    for (i = 0; i < pkg->fc; i++) {
+		unsigned int hash = work.hashes[n][i];
+		struct fpShardEntry_s *entry;
+		if (XFA_SKIPPING(rpmfsGetAction(pkg->fs, i)))
+		    continue;
+		entry = &work.entries[pos[hashShard(hash, fpc->nshards)]++];
+		entry->pkgix = n;
+		entry->fileno = i;
+		entry->hash = hash;
 	    }
-	    ffi.p = p;
-	    ffi.fileno = i;
-	    rpmFpHashAddEntry(fpc->fp, fpList + i, ffi);
-	    lastfp = fpList + i;
 	}
-	(void) rpmswExit(rpmtsOp(ts, RPMTS_OP_FINGERPRINT), 0);
-	rpmfilesFree(fi);
+	free(pos);
     }
-    rpmtsiFree(pi);
 
-    rpmFpHashFree(symlinks);
-}
+    rpmworkersRun(nthreads, fpc->nshards, fpShardFill, &work);
 
+    for (int n = 0; n < work.npkgs; n++) {
+	rpmfilesFree(work.pkgs[n].fi);
+	free(work.hashes[n]);
+    }
+    (void) rpmswExit(rpmtsOp(ts, RPMTS_OP_FINGERPRINT), fc);
+
+    rpmFpLinkHashFree(work.symlinks);
+    free(linkfps);
+    free(work.hashes);
+    free(work.entries);
+    free(work.shardstart);
+    free(work.pkgs);
+}
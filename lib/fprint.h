@@ -48,6 +48,14 @@ fingerPrint * fpCacheGetByFp(fingerPrintCache cache,
 			     struct fingerPrint_s * fp, int ix,
 			     struct rpmffi_s ** recs, int * numRecs);
 
+/* number of shards the fingerprint hash is split into, >= 1 */
+RPM_GNUC_INTERNAL
+int fpCacheShards(fingerPrintCache cache);
+
+/* shard of a fingerprint, equal fingerprints are in the same shard */
+RPM_GNUC_INTERNAL
+int fpCacheShard(fingerPrintCache cache, struct fingerPrint_s * fp, int ix);
+
 RPM_GNUC_INTERNAL
 void fpCachePopulate(fingerPrintCache cache, rpmts ts, int fileCount);
 
@@ -117,6 +125,19 @@ fingerPrint * fpLookupList(fingerPrintCache cache, rpmstrPool pool,
 			   rpmsid * dirNames, rpmsid * baseNames,
 			   const uint32_t * dirIndexes, int fileCount);
 
+/**
+ * Return finger prints of an array of file paths given as strings.
+ * @param cache		pointer to fingerprint cache
+ * @param dirNames	directory names
+ * @param baseNames	file base names
+ * @param fileCount	number of file entries
+ * @return		pointer to array of finger prints
+ */
+RPM_GNUC_INTERNAL
+fingerPrint * fpLookupNames(fingerPrintCache cache,
+			    const char ** dirNames, const char ** baseNames,
+			    int fileCount);
+
 #ifdef __cplusplus
 }
 #endif
@@ -9,9 +9,13 @@
 #include <utime.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #ifdef WITH_CAP
 #include <sys/capability.h>
 #endif
+#ifdef WITH_IO_URING
+#include <liburing.h>
+#endif
 
 #include <rpm/rpmte.h>
 #include <rpm/rpmts.h>
@@ -21,9 +25,12 @@
 #include "rpmio/rpmio_internal.h"	/* fdInit/FiniDigest */
 #include "lib/fsm.h"
 #include "lib/rpmte_internal.h"	/* XXX rpmfs */
+#include "lib/rpmts_internal.h"	/* ts->freshroot */
 #include "lib/rpmfi_internal.h" /* rpmfiSetOnChdir */
 #include "lib/rpmplugins.h"	/* rpm plugins hooks */
 #include "lib/rpmug.h"
+#include "lib/rpmprobes.h"
+#include "lib/rpmworkers.h"
 
 #include "debug.h"
 
@@ -32,6 +39,7 @@ int _fsm_debug = _FSM_DEBUG;
 
 /* XXX Failure to remove is not (yet) cause for failure. */
 static int strict_erasures = 0;
+static pthread_mutex_t tsOpsLock = PTHREAD_MUTEX_INITIALIZER;
 
 #define	SUFFIX_RPMORIG	".rpmorig"
 #define	SUFFIX_RPMSAVE	".rpmsave"
@@ -134,20 +142,31 @@ static int fsmSetFCaps(int fd, int dirfd, const char *path, const char *captxt)
     return rc;
 }
 
+/* %_flush_io policy */
+enum flushio_e {
+    FLUSH_NONE	= 0,
+    FLUSH_FILE	= 1,	/* fsync() each file on close */
+    FLUSH_PKG	= 2,	/* syncfs() touched filesystems before commit */
+};
+
+static int fsmFlushIO(void)
+{
+    static rpmMacroCache cache;
+    int flush_io = rpmExpandNumericCached(&cache, "%{?_flush_io}");
+
+    if (flush_io < FLUSH_NONE || flush_io > FLUSH_PKG)
+	flush_io = FLUSH_NONE;
+    return flush_io;
+}
+
 static int fsmClose(int *wfdp)
 {
     int rc = 0;
     if (wfdp && *wfdp >= 0) {
 	int myerrno = errno;
-	static int oneshot = 0;
-	static int flush_io = 0;
 	int fdno = *wfdp;
 
-	if (!oneshot) {
-	    flush_io = (rpmExpandNumeric("%{?_flush_io}") > 0);
-	    oneshot = 1;
-	}
-	if (flush_io) {
+	if (fsmFlushIO() == FLUSH_FILE) {
 	    fsync(fdno);
 	}
 	if (close(fdno))
@@ -181,13 +200,220 @@ static int fsmOpen(int *wfdp, int dirfd, const char *dest)
     return rc;
 }
 
-static int fsmUnpack(rpmfi fi, int fdno, rpmpsm psm, int nodigest)
+typedef struct fsmuring_s * fsmuring;
+
+#ifdef WITH_IO_URING
+#define URING_DEPTH	8		/* writes in flight per file */
+#define URING_BUFSIZE	(128 * 1024)
+
+struct fsmuring_s {
+    struct io_uring ring;
+    char *buf[URING_DEPTH];
+    size_t len[URING_DEPTH];
+    off_t off[URING_DEPTH];
+    int busy[URING_DEPTH];
+    int inflight;
+};
+
+static fsmuring fsmUringNew(void)
+{
+    static rpmMacroCache cache;
+    fsmuring u = NULL;
+    int xx;
+
+    if (rpmExpandNumericCached(&cache, "%{?_unpack_io_uring}") <= 0)
+	return NULL;
+
+    u = xcalloc(1, sizeof(*u));
+    /* Kernels or sandboxes without io_uring fall back to plain writes */
+    if ((xx = io_uring_queue_init(URING_DEPTH, &u->ring, 0)) < 0) {
+	rpmlog(RPMLOG_DEBUG, "io_uring not available: %s\n", strerror(-xx));
+	free(u);
+	return NULL;
+    }
+    for (int i = 0; i < URING_DEPTH; i++)
+	u->buf[i] = xmalloc(URING_BUFSIZE);
+    rpmlog(RPMLOG_DEBUG, "unpacking files through io_uring\n");
+    return u;
+}
+
+static fsmuring fsmUringFree(fsmuring u)
+{
+    if (u) {
+	io_uring_queue_exit(&u->ring);
+	for (int i = 0; i < URING_DEPTH; i++)
+	    free(u->buf[i]);
+	free(u);
+    }
+    return NULL;
+}
+
+/* Reap one completed write, finishing short writes synchronously */
+static int fsmUringReap(fsmuring u, int fdno)
+{
+    struct io_uring_cqe *cqe = NULL;
+    int rc = 0;
+    int xx = io_uring_wait_cqe(&u->ring, &cqe);
+
+    if (xx < 0) {
+	/* Nothing can be trusted anymore, give up on the in-flight writes */
+	errno = -xx;
+	u->inflight = 0;
+	memset(u->busy, 0, sizeof(u->busy));
+	return RPMERR_WRITE_FAILED;
+    }
+
+    int i = (intptr_t) io_uring_cqe_get_data(cqe);
+    int res = cqe->res;
+    io_uring_cqe_seen(&u->ring, cqe);
+    u->busy[i] = 0;
+    u->inflight--;
+
+    if (res < 0) {
+	errno = -res;
+	rc = RPMERR_WRITE_FAILED;
+    } else {
+	size_t done = res;
+	while (done < u->len[i]) {
+	    ssize_t nw = pwrite(fdno, u->buf[i] + done, u->len[i] - done,
+				u->off[i] + done);
+	    if (nw <= 0) {
+		rc = RPMERR_WRITE_FAILED;
+		break;
+	    }
+	    done += nw;
+	}
+    }
+    return rc;
+}
+
+static int fsmUnpackUring(fsmuring u, rpmfi fi, int fdno, rpmpsm psm,
+			  int nodigest)
+{
+    rpm_loff_t left = rpmfiFSize(fi);
+    const unsigned char *fidigest = NULL;
+    DIGEST_CTX ctx = NULL;
+    size_t diglen = 0;
+    off_t off = 0;
+    int algo = 0;
+    int rc = 0;
+
+    if (!nodigest) {
+	fidigest = rpmfiFDigest(fi, &algo, &diglen);
+	ctx = rpmDigestInit(algo, RPMDIGEST_NONE);
+    }
+
+    while (left && !rc) {
+	struct io_uring_sqe *sqe;
+	int i;
+
+	if (u->inflight == URING_DEPTH && (rc = fsmUringReap(u, fdno)))
+	    break;
+	for (i = 0; u->busy[i]; i++)
+	    ;
+
+	size_t len = (left > URING_BUFSIZE) ? URING_BUFSIZE : left;
+	if (rpmfiArchiveRead(fi, u->buf[i], len) != len) {
+	    rc = RPMERR_READ_FAILED;
+	    break;
+	}
+	if (ctx)
+	    rpmDigestUpdate(ctx, u->buf[i], len);
+
+	sqe = io_uring_get_sqe(&u->ring);
+	io_uring_prep_write(sqe, fdno, u->buf[i], len, off);
+	io_uring_sqe_set_data(sqe, (void *)(intptr_t) i);
+	if (io_uring_submit(&u->ring) < 0) {
+	    rc = RPMERR_WRITE_FAILED;
+	    break;
+	}
+	u->busy[i] = 1;
+	u->len[i] = len;
+	u->off[i] = off;
+	u->inflight++;
+
+	off += len;
+	left -= len;
+	rpmpsmNotify(psm, RPMCALLBACK_INST_PROGRESS, rpmfiArchiveTell(fi));
+    }
+
+    /* All writes must have landed before the file gets closed */
+    while (u->inflight) {
+	int xx = fsmUringReap(u, fdno);
+	if (!rc)
+	    rc = xx;
+    }
+
+    if (ctx) {
+	uint8_t *digest = NULL;
+	rpmDigestFinal(ctx, (void **)&digest, NULL, 0);
+	if (!rc && (fidigest == NULL || memcmp(digest, fidigest, diglen)))
+	    rc = RPMERR_DIGEST_MISMATCH;
+	free(digest);
+    }
+
+    return rc;
+}
+#else
+static fsmuring fsmUringNew(void)
+{
+    return NULL;
+}
+
+static fsmuring fsmUringFree(fsmuring u)
+{
+    return NULL;
+}
+
+static int fsmUnpackUring(fsmuring u, rpmfi fi, int fdno, rpmpsm psm,
+			  int nodigest)
 {
+    return RPMERR_INTERNAL;
+}
+#endif
+
+static int fsmUnpack(rpmfi fi, int fdno, rpmpsm psm, int nodigest,
+		     fsmuring uring)
+{
+    static rpmMacroCache cache;
+    int clone = (rpmExpandNumericCached(&cache, "%{?_unpack_copy_range}") > 0);
+
+    /* Uncompressed payloads can be reflinked/copied within the kernel */
+    if (clone) {
+	int rc = rpmfiArchiveCopyToFile(fi, fdno, nodigest, psm);
+	if (rc <= 0) {
+	    if (_fsm_debug) {
+		rpmlog(RPMLOG_DEBUG, " %8s (%s %" PRIu64 " bytes [%d]) %s\n",
+		       "fsmCopy", rpmfiFN(fi), rpmfiFSize(fi), fdno,
+		       (rc < 0 ? strerror(errno) : ""));
+	    }
+	    return rc;
+	}
+    }
+
+    /* Empty files need the legacy digest quirks, leave them to rpmfi */
+    if (uring && rpmfiFSize(fi) > 0) {
+	int rc = fsmUnpackUring(uring, fi, fdno, psm, nodigest);
+	if (_fsm_debug) {
+	    rpmlog(RPMLOG_DEBUG, " %8s (%s %" PRIu64 " bytes [%d]) %s\n",
+		   "fsmUnpackUring", rpmfiFN(fi), rpmfiFSize(fi), fdno,
+		   (rc < 0 ? strerror(errno) : ""));
+	}
+	return rc;
+    }
+
     FD_t fd = fdDup(fdno);
+    struct rpmsw_s begin, end;
+    rpmswNow(&begin);
     int rc = rpmfiArchiveReadToFilePsm(fi, fd, nodigest, psm);
     if (_fsm_debug) {
-	rpmlog(RPMLOG_DEBUG, " %8s (%s %" PRIu64 " bytes [%d]) %s\n", __func__,
+	/* Throughput of the whole copy, decompression included */
+	rpmtime_t usecs = rpmswDiff(rpmswNow(&end), &begin);
+	uint64_t kbps = usecs ? rpmfiFSize(fi) * 1000 / 1024 * 1000 / usecs : 0;
+	rpmlog(RPMLOG_DEBUG, " %8s (%s %" PRIu64 " bytes [%d] %lu usecs "
+	       "%" PRIu64 " kB/s) %s\n", __func__,
 	       rpmfiFN(fi), rpmfiFSize(fi), Fileno(fd),
+	       (unsigned long) usecs, kbps,
 	       (rc < 0 ? strerror(errno) : ""));
     }
     Fclose(fd);
@@ -195,18 +421,19 @@ static int fsmUnpack(rpmfi fi, int fdno, rpmpsm psm, int nodigest)
 }
 
 static int fsmMkfile(int dirfd, rpmfi fi, struct filedata_s *fp, rpmfiles files,
-		     rpmpsm psm, int nodigest,
+		     rpmpsm psm, int nodigest, fsmuring uring,
 		     struct filedata_s ** firstlink, int *firstlinkfile,
 		     int *firstdir, int *fdp)
 {
     int rc = 0;
     int fd = -1;
 
+    RPM_PROBE3(file_create, rpmfiDN(fi), fp->fpath, fp->sb.st_size);
     if (*firstlink == NULL) {
 	/* First encounter, open file for writing */
 	rc = fsmOpen(&fd, dirfd, fp->fpath);
 	/* If it's a part of a hardlinked set, the content may come later */
-	if (fp->sb.st_nlink > 1) {
+	if (!rc && fp->sb.st_nlink > 1) {
 	    *firstlink = fp;
 	    *firstlinkfile = fd;
 	    *firstdir = dup(dirfd);
@@ -222,7 +449,7 @@ static int fsmMkfile(int dirfd, rpmfi fi, struct filedata_s *fp, rpmfiles files,
     /* If the file has content, unpack it */
     if (rpmfiArchiveHasContent(fi)) {
 	if (!rc)
-	    rc = fsmUnpack(fi, fd, psm, nodigest);
+	    rc = fsmUnpack(fi, fd, psm, nodigest, uring);
 	/* Last file of hardlink set, ensure metadata gets set */
 	if (*firstlink) {
 	    fp->setmeta = 1;
@@ -371,22 +598,160 @@ static int fsmDoMkDir(rpmPlugins plugins, int dirfd, const char *dn,
     return rc;
 }
 
-static int ensureDir(rpmPlugins plugins, const char *p, int owned, int create,
-		    int quiet, int *dirfdp)
+/* Default number of directories kept open by the directory cache */
+#define DIRCACHE_SIZE 64
+
+/*
+ * Directories known to exist during a transaction, with their fds kept
+ * open so that the same prefixes don't get walked for every package.
+ * Entries whose directory got removed are dropped on lookup, everything
+ * is dropped when a scriptlet might have rearranged the tree.
+ */
+struct fsmDirCache_s {
+    pthread_mutex_t lock;
+    int size;			/* max number of entries */
+    int nents;
+    unsigned int clock;		/* for finding the least recently used */
+    struct dirCacheEnt_s {
+	char *path;
+	size_t len;
+	int fd;
+	unsigned int used;
+    } *ents;
+};
+
+fsmDirCache fsmDirCacheNew(void)
+{
+    fsmDirCache dc = NULL;
+    char *s = rpmExpand("%{?_fsm_dircache_size}", NULL);
+    int size = *s ? atoi(s) : DIRCACHE_SIZE;
+
+    if (size > 0) {
+	dc = xcalloc(1, sizeof(*dc));
+	pthread_mutex_init(&dc->lock, NULL);
+	dc->size = size;
+	dc->ents = xcalloc(size, sizeof(*dc->ents));
+    }
+    free(s);
+    return dc;
+}
+
+static void dirCacheDrop(fsmDirCache dc, int i)
+{
+    struct dirCacheEnt_s *e = &dc->ents[i];
+    free(e->path);
+    close(e->fd);
+    *e = dc->ents[--dc->nents];
+}
+
+void fsmDirCacheFlush(fsmDirCache dc)
+{
+    if (dc) {
+	pthread_mutex_lock(&dc->lock);
+	while (dc->nents > 0)
+	    dirCacheDrop(dc, dc->nents - 1);
+	pthread_mutex_unlock(&dc->lock);
+    }
+}
+
+fsmDirCache fsmDirCacheFree(fsmDirCache dc)
+{
+    if (dc) {
+	fsmDirCacheFlush(dc);
+	pthread_mutex_destroy(&dc->lock);
+	free(dc->ents);
+	free(dc);
+    }
+    return NULL;
+}
+
+/* Return a new fd to the directory if known, -1 otherwise */
+static int dirCacheGet(fsmDirCache dc, const char *path, size_t len)
+{
+    int fd = -1;
+
+    pthread_mutex_lock(&dc->lock);
+    for (int i = 0; i < dc->nents; i++) {
+	struct dirCacheEnt_s *e = &dc->ents[i];
+	struct stat sb;
+	if (e->len != len || !rstreqn(e->path, path, len))
+	    continue;
+	/* A removed directory has no links left */
+	if (fstat(e->fd, &sb) || sb.st_nlink == 0) {
+	    dirCacheDrop(dc, i);
+	} else {
+	    e->used = ++dc->clock;
+	    fd = dup(e->fd);
+	}
+	break;
+    }
+    pthread_mutex_unlock(&dc->lock);
+    return fd;
+}
+
+/* Remember the directory, replacing the least recently used one if full */
+static void dirCachePut(fsmDirCache dc, const char *path, size_t len, int fd)
+{
+    int lru = 0;
+
+    pthread_mutex_lock(&dc->lock);
+    for (int i = 0; i < dc->nents; i++) {
+	if (dc->ents[i].len == len && rstreqn(dc->ents[i].path, path, len))
+	    goto exit;
+	if (dc->ents[i].used < dc->ents[lru].used)
+	    lru = i;
+    }
+    if (dc->nents == dc->size)
+	dirCacheDrop(dc, lru);
+
+    if ((fd = dup(fd)) >= 0) {
+	struct dirCacheEnt_s *e = &dc->ents[dc->nents++];
+	e->path = rstrndup(path, len);
+	e->len = len;
+	e->fd = fd;
+	e->used = ++dc->clock;
+    }
+
+exit:
+    pthread_mutex_unlock(&dc->lock);
+}
+
+static int ensureDir(fsmDirCache dc, rpmPlugins plugins, const char *p,
+		    int owned, int create, int quiet, int *dirfdp)
 {
     char *sp = NULL, *bn;
     char *apath = NULL;
     int oflags = O_RDONLY;
     int rc = 0;
+    int dirfd = -1;
 
     if (*dirfdp >= 0)
 	return rc;
 
-    int dirfd = fsmOpenat(-1, "/", oflags, 1);
-    int fd = dirfd; /* special case of "/" */
-
     char *path = xstrdup(p);
     char *dp = path;
+    size_t len = strlen(p);
+    size_t plen;
+
+    while (len > 0 && p[len - 1] == '/')
+	len--;
+
+    /* Start from the closest directory already known to exist */
+    for (plen = len; dc && plen > 0; ) {
+	if ((dirfd = dirCacheGet(dc, p, plen)) >= 0) {
+	    apath = rstrndup(p, plen);
+	    dp = path + plen;
+	    break;
+	}
+	while (plen > 0 && p[plen - 1] != '/')
+	    plen--;
+	while (plen > 0 && p[plen - 1] == '/')
+	    plen--;
+    }
+
+    if (dirfd < 0)
+	dirfd = fsmOpenat(-1, "/", oflags, 1);
+    int fd = dirfd; /* special case of "/" */
 
     while ((bn = strtok_r(dp, "/", &sp)) != NULL) {
 	fd = fsmOpenat(dirfd, bn, oflags, 1);
@@ -396,6 +761,11 @@ static int ensureDir(rpmPlugins plugins, const char *p, int owned, int create,
 	if (fd < 0 && errno == ENOENT && create) {
 	    mode_t mode = S_IFDIR | (_dirPerms & 07777);
 	    rc = fsmDoMkDir(plugins, dirfd, bn, apath, owned, mode, &fd);
+	    /* Lost a race to another package being unpacked concurrently */
+	    if (rc == RPMERR_MKDIR_FAILED && errno == EEXIST) {
+		fd = fsmOpenat(dirfd, bn, oflags, 1);
+		rc = 0;
+	    }
 	}
 
 	fsmClose(&dirfd);
@@ -418,6 +788,8 @@ static int ensureDir(rpmPlugins plugins, const char *p, int owned, int create,
 	fsmClose(&dirfd);
     } else {
 	rc = 0;
+	if (dc && plen < len && dirfd >= 0)
+	    dirCachePut(dc, p, len, dirfd);
     }
     *dirfdp = dirfd;
 
@@ -758,6 +1130,336 @@ static int fsmSetmeta(int fd, int dirfd, const char *path,
     return rc;
 }
 
+/*
+ * Writer pool for unpacking regular files. The transaction thread keeps
+ * reading the payload in order and does all the path-based work (directory
+ * creation, plugin hooks, verify checks) as before, but hands the file
+ * content over to a writer thread which does the write, digest check and
+ * the fd-based metadata calls. Jobs are retired in submission order by the
+ * transaction thread, which also runs the plugin prepare hook and progress
+ * notification for them. Jobs that are already done are retired together,
+ * up to WRITER_BATCH_MAX at a time, so the plugins see them as one batch.
+ * Hardlinked sets and files larger than WRITER_FILE_MAX always take the
+ * direct path.
+ */
+#define WRITER_JOBS_MAX		256
+#define WRITER_BATCH_MAX	64
+#define WRITER_FILE_MAX		(4 * 1024 * 1024)
+#define WRITER_BYTES_MAX	(64 * 1024 * 1024)
+
+struct fsmjob_s {
+    struct filedata_s *fp;
+    int fx;
+    int fd;
+    int nodigest;
+    int nofcaps;
+    const char *fcaps;
+    time_t mtime;
+    int digestalgo;
+    const unsigned char *fidigest;
+    char *buf;
+    size_t len;
+    int done;
+    int rc;
+    int err;
+};
+
+typedef struct fsmwriter_s {
+    pthread_mutex_t lock;
+    pthread_cond_t workcond;
+    pthread_cond_t donecond;
+    pthread_t *threads;
+    int nthreads;
+    int quit;
+    unsigned int head;		/* oldest unretired job */
+    unsigned int work;		/* next job for the writers */
+    unsigned int tail;		/* next free slot */
+    size_t bytes;
+    struct fsmjob_s jobs[WRITER_JOBS_MAX];
+} * fsmwriter;
+
+static int fsmJobDigest(struct fsmjob_s *job)
+{
+    int rc = 0;
+    size_t diglen = rpmDigestLength(job->digestalgo);
+    uint8_t *digest = NULL;
+    DIGEST_CTX ctx = rpmDigestInit(job->digestalgo, RPMDIGEST_NONE);
+
+    rpmDigestUpdate(ctx, job->buf, job->len);
+    rpmDigestFinal(ctx, (void **)&digest, NULL, 0);
+
+    if (digest == NULL || job->fidigest == NULL) {
+	rc = RPMERR_DIGEST_MISMATCH;
+    } else if (memcmp(digest, job->fidigest, diglen)) {
+	rc = RPMERR_DIGEST_MISMATCH;
+	/* ...but in old packages, empty files have zeros for digest */
+	if (job->len == 0 && job->digestalgo == RPM_HASH_MD5) {
+	    uint8_t zeros[diglen];
+	    memset(&zeros, 0, diglen);
+	    if (memcmp(zeros, job->fidigest, diglen) == 0)
+		rc = 0;
+	}
+    }
+    free(digest);
+    return rc;
+}
+
+static void fsmJobRun(struct fsmjob_s *job)
+{
+    struct stat *st = &job->fp->sb;
+    size_t off = 0;
+    int rc = 0;
+
+    while (off < job->len) {
+	ssize_t nb = write(job->fd, job->buf + off, job->len - off);
+	if (nb < 0) {
+	    if (errno == EINTR)
+		continue;
+	    rc = RPMERR_WRITE_FAILED;
+	    break;
+	}
+	off += nb;
+    }
+
+    if (!rc && !job->nodigest)
+	rc = fsmJobDigest(job);
+
+    /* Everything but the plugin hook from fsmSetmeta() */
+    if (!rc && !getuid())
+	rc = fsmChown(job->fd, -1, NULL, st->st_mode, st->st_uid, st->st_gid);
+    if (!rc)
+	rc = fsmChmod(job->fd, -1, NULL, st->st_mode);
+    if (!rc && !job->nofcaps && !getuid())
+	rc = fsmSetFCaps(job->fd, -1, NULL, job->fcaps);
+    if (!rc)
+	rc = fsmUtime(job->fd, -1, NULL, st->st_mode, job->mtime);
+
+    job->rc = rc;
+    job->err = rc ? errno : 0;
+    job->buf = _free(job->buf);
+}
+
+static void *fsmWriterThread(void *arg)
+{
+    fsmwriter w = arg;
+
+    pthread_mutex_lock(&w->lock);
+    while (1) {
+	while (!w->quit && w->work == w->tail)
+	    pthread_cond_wait(&w->workcond, &w->lock);
+	if (w->work == w->tail)
+	    break;
+	struct fsmjob_s *job = &w->jobs[w->work % WRITER_JOBS_MAX];
+	w->work++;
+	pthread_mutex_unlock(&w->lock);
+
+	fsmJobRun(job);
+
+	pthread_mutex_lock(&w->lock);
+	job->done = 1;
+	pthread_cond_broadcast(&w->donecond);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+static fsmwriter fsmWriterNew(void)
+{
+    int nthreads = rpmExpandNumeric("%{?_unpack_writer_threads}");
+    fsmwriter w;
+
+    if (nthreads <= 0)
+	return NULL;
+
+    w = xcalloc(1, sizeof(*w));
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->workcond, NULL);
+    pthread_cond_init(&w->donecond, NULL);
+    w->threads = xcalloc(nthreads, sizeof(*w->threads));
+    for (int i = 0; i < nthreads; i++) {
+	if (pthread_create(&w->threads[i], NULL, fsmWriterThread, w))
+	    break;
+	w->nthreads++;
+    }
+
+    if (w->nthreads == 0) {
+	rpmlog(RPMLOG_DEBUG, "failed to start writer threads, unpacking serially\n");
+	pthread_cond_destroy(&w->donecond);
+	pthread_cond_destroy(&w->workcond);
+	pthread_mutex_destroy(&w->lock);
+	free(w->threads);
+	w = _free(w);
+    }
+    return w;
+}
+
+/*
+ * Wait for the oldest job, and finish it up on the transaction thread
+ * along with any jobs behind it that are already done.
+ */
+static int fsmWriterRetire(fsmwriter w, rpmfi fi, rpmfi mfi, rpmPlugins plugins,
+			   rpmpsm psm, char **failedFile, int rc)
+{
+    struct fsmjob_s *batch[WRITER_BATCH_MAX];
+    int fx[WRITER_BATCH_MAX];
+    int fds[WRITER_BATCH_MAX];
+    const char *paths[WRITER_BATCH_MAX];
+    mode_t modes[WRITER_BATCH_MAX];
+    rpmFsmOp ops[WRITER_BATCH_MAX];
+    int n = 0, nok = 0;
+
+    /* Slots are only reused by fsmWriterSubmit() on this same thread */
+    pthread_mutex_lock(&w->lock);
+    while (!w->jobs[w->head % WRITER_JOBS_MAX].done)
+	pthread_cond_wait(&w->donecond, &w->lock);
+    while (n < WRITER_BATCH_MAX && w->head != w->tail &&
+	   w->jobs[w->head % WRITER_JOBS_MAX].done) {
+	struct fsmjob_s *job = &w->jobs[w->head % WRITER_JOBS_MAX];
+	batch[n++] = job;
+	w->head++;
+	w->bytes -= job->len;
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    /* Only the first error counts, but all jobs need retiring */
+    for (; !rc && nok < n; nok++) {
+	struct fsmjob_s *job = batch[nok];
+	if (job->rc) {
+	    rc = job->rc;
+	    errno = job->err;
+	    rpmfiSetFX(mfi, job->fx);
+	    *failedFile = rstrscat(NULL, rpmfiDN(mfi), job->fp->fpath, NULL);
+	    break;
+	}
+	fx[nok] = job->fx;
+	fds[nok] = job->fd;
+	paths[nok] = job->fp->fpath;
+	modes[nok] = job->fp->sb.st_mode;
+	ops[nok] = job->fp->action;
+    }
+
+    if (nok > 0) {
+	int prc = rpmpluginsCallFsmFilePrepareBatch(plugins, mfi, nok, fx, fds,
+						    paths, modes, ops);
+	if (prc) {
+	    /* The hooks can't tell which file failed, blame the first */
+	    rc = prc;
+	    rpmfiSetFX(mfi, fx[0]);
+	    *failedFile = _free(*failedFile);
+	    *failedFile = rstrscat(NULL, rpmfiDN(mfi), paths[0], NULL);
+	} else {
+	    rpmpsmNotify(psm, RPMCALLBACK_INST_PROGRESS, rpmfiArchiveTell(fi));
+	}
+    }
+
+    for (int i = 0; i < n; i++)
+	fsmClose(&batch[i]->fd);
+
+    return rc;
+}
+
+static int fsmWriterDrain(fsmwriter w, rpmfi fi, rpmfi mfi, rpmPlugins plugins,
+			  rpmpsm psm, char **failedFile, int rc)
+{
+    while (w && w->head != w->tail)
+	rc = fsmWriterRetire(w, fi, mfi, plugins, psm, failedFile, rc);
+    return rc;
+}
+
+/*
+ * Read the file content from payload and queue it for writing. The file
+ * is created here so the open errors and ordering are as on the
+ * direct path and the fd is owned by the job from here on.
+ */
+static int fsmWriterSubmit(fsmwriter w, rpmfi fi, rpmfi mfi,
+			   struct filedata_s *fp, int dirfd,
+			   rpmPlugins plugins, rpmpsm psm, char **failedFile,
+			   int nodigest, int nofcaps)
+{
+    size_t len = rpmfiFSize(fi);
+    struct fsmjob_s *job;
+    int rc = 0;
+    int fd = -1;
+
+    RPM_PROBE3(file_create, rpmfiDN(fi), fp->fpath, fp->sb.st_size);
+    /* Make room: keep the number of jobs and buffered bytes bounded */
+    while (!rc && w->head != w->tail &&
+	    (w->tail - w->head >= WRITER_JOBS_MAX ||
+	     w->bytes + len > WRITER_BYTES_MAX)) {
+	rc = fsmWriterRetire(w, fi, mfi, plugins, psm, failedFile, rc);
+    }
+    if (rc)
+	return rc;
+
+    rc = fsmOpen(&fd, dirfd, fp->fpath);
+    if (rc)
+	return rc;
+
+    char *buf = xmalloc(len ? len : 1);
+    for (size_t off = 0; off < len; ) {
+	size_t chunk = (len - off > BUFSIZ*4) ? BUFSIZ*4 : len - off;
+	if (rpmfiArchiveRead(fi, buf + off, chunk) != chunk) {
+	    rc = RPMERR_READ_FAILED;
+	    break;
+	}
+	off += chunk;
+    }
+
+    if (rc) {
+	free(buf);
+	fsmClose(&fd);
+	return rc;
+    }
+
+    job = &w->jobs[w->tail % WRITER_JOBS_MAX];
+    memset(job, 0, sizeof(*job));
+    job->fp = fp;
+    job->fx = rpmfiFX(fi);
+    job->fd = fd;
+    job->nodigest = nodigest;
+    job->nofcaps = nofcaps;
+    job->fcaps = rpmfiFCaps(fi);
+    job->mtime = rpmfiFMtime(fi);
+    if (!nodigest) {
+	job->digestalgo = rpmfiDigestAlgo(fi);
+	job->fidigest = rpmfiFDigest(fi, NULL, NULL);
+    }
+    job->buf = buf;
+    job->len = len;
+
+    pthread_mutex_lock(&w->lock);
+    w->bytes += len;
+    w->tail++;
+    pthread_cond_signal(&w->workcond);
+    pthread_mutex_unlock(&w->lock);
+
+    return rc;
+}
+
+static int fsmWriterCanTake(fsmwriter w, rpmfi fi, struct filedata_s *fp)
+{
+    return (w != NULL && fp->sb.st_nlink == 1 && fp->action != FA_TOUCH &&
+	    rpmfiArchiveHasContent(fi) && rpmfiFSize(fi) <= WRITER_FILE_MAX);
+}
+
+static fsmwriter fsmWriterFree(fsmwriter w)
+{
+    if (w) {
+	pthread_mutex_lock(&w->lock);
+	w->quit = 1;
+	pthread_cond_broadcast(&w->workcond);
+	pthread_mutex_unlock(&w->lock);
+	for (int i = 0; i < w->nthreads; i++)
+	    pthread_join(w->threads[i], NULL);
+	pthread_cond_destroy(&w->donecond);
+	pthread_cond_destroy(&w->workcond);
+	pthread_mutex_destroy(&w->lock);
+	free(w->threads);
+	free(w);
+    }
+    return NULL;
+}
+
 static int fsmCommit(int dirfd, char **path, rpmfi fi, rpmFileAction action, const char *suffix)
 {
     int rc = 0;
@@ -836,6 +1538,7 @@ static void setFileState(rpmfs fs, int i)
 struct diriter_s {
     int dirfd;
     int firstdir;
+    fsmDirCache dc;
 };
 
 static int onChdir(rpmfi fi, void *data)
@@ -865,6 +1568,62 @@ static rpmfi fsmIterFini(rpmfi fi, struct diriter_s *di)
     return rpmfiFree(fi);
 }
 
+/* Flush every filesystem that got new file contents, once */
+static void fsmSyncFiles(rpmfiles files, struct filedata_s *fdata,
+			 struct diriter_s *di)
+{
+    dev_t *devs = NULL;
+    int *fds = NULL;
+    int ndevs = 0;
+    int fx;
+
+    rpmfi fi = fsmIter(NULL, files, RPMFI_ITER_FWD, di);
+    while ((fx = rpmfiNext(fi)) >= 0) {
+	struct filedata_s *fp = &fdata[fx];
+	struct stat sb;
+	int i;
+
+	if (fp->skip || fp->stage < FILE_UNPACK || !S_ISREG(fp->sb.st_mode))
+	    continue;
+	if (ensureDir(di->dc, NULL, rpmfiDN(fi), 0, 0, 1, &di->dirfd))
+	    continue;
+	if (fstat(di->dirfd, &sb))
+	    continue;
+
+	for (i = 0; i < ndevs; i++) {
+	    if (devs[i] == sb.st_dev)
+		break;
+	}
+	if (i == ndevs) {
+	    devs = xrealloc(devs, (ndevs + 1) * sizeof(*devs));
+	    fds = xrealloc(fds, (ndevs + 1) * sizeof(*fds));
+	    devs[ndevs] = sb.st_dev;
+	    fds[ndevs] = dup(di->dirfd);
+	    ndevs++;
+	}
+    }
+    fi = fsmIterFini(fi, di);
+
+#ifndef HAVE_SYNCFS
+    /* Without syncfs() there's no way to flush a single filesystem */
+    if (ndevs)
+	sync();
+#endif
+    for (int i = 0; i < ndevs; i++) {
+	if (fds[i] < 0)
+	    continue;
+#ifdef HAVE_SYNCFS
+	rpmlog(RPMLOG_DEBUG, "syncing fs of device 0x%jx\n", (uintmax_t)devs[i]);
+	if (syncfs(fds[i]))
+	    rpmlog(RPMLOG_WARNING, _("syncing files failed: %s\n"),
+		   strerror(errno));
+#endif
+	close(fds[i]);
+    }
+    free(devs);
+    free(fds);
+}
+
 int rpmPackageFilesInstall(rpmts ts, rpmte te, rpmfiles files,
               rpmpsm psm, char ** failedFile)
 {
@@ -877,11 +1636,15 @@ int rpmPackageFilesInstall(rpmts ts, rpmte te, rpmfiles files,
     int fc = rpmfilesFC(files);
     int nodigest = (rpmtsFlags(ts) & RPMTRANS_FLAG_NOFILEDIGEST) ? 1 : 0;
     int nofcaps = (rpmtsFlags(ts) & RPMTRANS_FLAG_NOCAPS) ? 1 : 0;
+    int freshroot = ts->freshroot;
     int firstlinkfile = -1;
     char *tid = NULL;
     struct filedata_s *fdata = xcalloc(fc, sizeof(*fdata));
     struct filedata_s *firstlink = NULL;
-    struct diriter_s di = { -1, -1 };
+    struct diriter_s di = { -1, -1, ts->dircache };
+    fsmwriter writer = NULL;
+    fsmuring uring = NULL;
+    rpmfi mfi = NULL;
 
     /* transaction id used for temporary path suffix while installing */
     rasprintf(&tid, ";%08x", (unsigned)rpmtsGetTid(ts));
@@ -895,7 +1658,9 @@ int rpmPackageFilesInstall(rpmts ts, rpmte te, rpmfiles files,
 	else
 	    fp->action = rpmfsGetAction(fs, fx);
 	fp->skip = XFA_SKIPPING(fp->action);
-	if (XFA_CREATING(fp->action) && !S_ISDIR(rpmfiFMode(fi)))
+	/* In a fresh root, new files can go straight to their final name */
+	if (XFA_CREATING(fp->action) && !S_ISDIR(rpmfiFMode(fi)) &&
+		!(freshroot && fp->action == FA_CREATE))
 	    fp->suffix = tid;
 	fp->fpath = fsmFsPath(fi, fp->suffix);
 
@@ -924,6 +1689,11 @@ int rpmPackageFilesInstall(rpmts ts, rpmte te, rpmfiles files,
         goto exit;
     }
 
+    if (payload && (writer = fsmWriterNew()) != NULL)
+	mfi = rpmfilesIter(files, RPMFI_ITER_FWD);
+    if (payload)
+	uring = fsmUringNew();
+
     /* Process the payload */
     while (!rc && (fx = rpmfiNext(fi)) >= 0) {
 	struct filedata_s *fp = &fdata[fx];
@@ -939,7 +1709,8 @@ int rpmPackageFilesInstall(rpmts ts, rpmte te, rpmfiles files,
 
         if (!fp->skip) {
 	    int fd = -1;
-	    rc = ensureDir(plugins, rpmfiDN(fi), 0,
+	    int verified = 0;
+	    rc = ensureDir(di.dc, plugins, rpmfiDN(fi), 0,
 			    (fp->action == FA_CREATE), 0, &di.dirfd);
 
 	    /* Directories replacing something need early backup */
@@ -954,8 +1725,9 @@ int rpmPackageFilesInstall(rpmts ts, rpmte te, rpmfiles files,
 	    if (rc)
 		goto setmeta; /* for error notification */
 
-	    /* Assume file does't exist when tmp suffix is in use */
-	    if (!fp->suffix) {
+	    /* Assume file does't exist when tmp suffix is in use or fresh root */
+	    if (!fp->suffix && !(freshroot && fp->action == FA_CREATE)) {
+		verified = 1;
 		if (fp->action == FA_TOUCH) {
 		    struct stat sb;
 		    rc = fsmStat(di.dirfd, fp->fpath, 1, &sb);
@@ -978,9 +1750,18 @@ int rpmPackageFilesInstall(rpmts ts, rpmte te, rpmfiles files,
 	    if (fp->action == FA_TOUCH)
 		goto setmeta;
 
+create:
             if (S_ISREG(fp->sb.st_mode)) {
-		if (rc == RPMERR_ENOENT) {
-		    rc = fsmMkfile(di.dirfd, fi, fp, files, psm, nodigest,
+		if (rc == RPMERR_ENOENT && fsmWriterCanTake(writer, fi, fp)) {
+		    rc = fsmWriterSubmit(writer, fi, mfi, fp, di.dirfd,
+					 plugins, psm, failedFile,
+					 nodigest, nofcaps);
+		    if (!rc) {
+			fp->stage = FILE_UNPACK;
+			continue;
+		    }
+		} else if (rc == RPMERR_ENOENT) {
+		    rc = fsmMkfile(di.dirfd, fi, fp, files, psm, nodigest, uring,
 				   &firstlink, &firstlinkfile, &di.firstdir,
 				   &fd);
 		}
@@ -1013,6 +1794,16 @@ int rpmPackageFilesInstall(rpmts ts, rpmte te, rpmfiles files,
                     rc = RPMERR_UNKNOWN_FILETYPE;
             }
 
+	    /*
+	     * Only %pretrans or an earlier package in this transaction can
+	     * have created the path in a fresh root, deal with it as usual.
+	     */
+	    if (rc && freshroot && !verified && errno == EEXIST) {
+		verified = 1;
+		rc = fsmVerify(di.dirfd, fp->fpath, fi);
+		goto create;
+	    }
+
 	    if (!rc && fd == -1 && !S_ISLNK(fp->sb.st_mode)) {
 		/* Only follow safe symlinks, and never on temporary files */
 		fd = fsmOpenat(di.dirfd, fp->fpath,
@@ -1033,17 +1824,33 @@ setmeta:
 	}
 
 	/* Notify on success. */
-	if (rc)
-	    *failedFile = rstrscat(NULL, rpmfiDN(fi), fp->fpath, NULL);
-	else
+	if (rc) {
+	    if (*failedFile == NULL)
+		*failedFile = rstrscat(NULL, rpmfiDN(fi), fp->fpath, NULL);
+	} else {
 	    rpmpsmNotify(psm, RPMCALLBACK_INST_PROGRESS, rpmfiArchiveTell(fi));
+	}
 	fp->stage = FILE_UNPACK;
     }
+    rc = fsmWriterDrain(writer, fi, mfi, plugins, psm, failedFile, rc);
+    writer = fsmWriterFree(writer);
+
+    /* Plugins may still be preparing files in the background */
+    if (rpmpluginsCallFsmFilePrepareWait(plugins) && !rc)
+	rc = RPMRC_FAIL;
+    uring = fsmUringFree(uring);
     fi = fsmIterFini(fi, &di);
 
     if (!rc && fx < 0 && fx != RPMERR_ITER_END)
 	rc = fx;
 
+    /*
+     * Make the contents durable in one go before anything gets renamed.
+     * Nothing gets renamed in a fresh root, the transaction syncs at the end.
+     */
+    if (!rc && !freshroot && fsmFlushIO() == FLUSH_PKG)
+	fsmSyncFiles(files, fdata, &di);
+
     /* If all went well, commit files to final destination */
     fi = fsmIter(NULL, files, RPMFI_ITER_FWD, &di);
     while (!rc && (fx = rpmfiNext(fi)) >= 0) {
@@ -1051,7 +1858,7 @@ setmeta:
 
 	if (!fp->skip) {
 	    if (!rc)
-		rc = ensureDir(NULL, rpmfiDN(fi), 0, 0, 0, &di.dirfd);
+		rc = ensureDir(di.dc, NULL, rpmfiDN(fi), 0, 0, 0, &di.dirfd);
 
 	    /* Backup file if needed. Directories are handled earlier */
 	    if (!rc && fp->suffix)
@@ -1059,6 +1866,7 @@ setmeta:
 
 	    if (!rc)
 		rc = fsmCommit(di.dirfd, &fp->fpath, fi, fp->action, fp->suffix);
+	    RPM_PROBE3(file_commit, rpmfiDN(fi), fp->fpath, rc);
 
 	    if (!rc)
 		fp->stage = FILE_COMMIT;
@@ -1079,7 +1887,7 @@ setmeta:
 	    struct filedata_s *fp = &fdata[fx];
 
 	    /* If the directory doesn't exist there's nothing to clean up */
-	    if (ensureDir(NULL, rpmfiDN(fi), 0, 0, 1, &di.dirfd))
+	    if (ensureDir(di.dc, NULL, rpmfiDN(fi), 0, 0, 1, &di.dirfd))
 		continue;
 
 	    if (fp->stage > FILE_NONE && !fp->skip) {
@@ -1088,11 +1896,18 @@ setmeta:
 	}
     }
 
+    /* Packages may be unpacked concurrently, see rpmpsmUnpackAhead() */
+    pthread_mutex_lock(&tsOpsLock);
     rpmswAdd(rpmtsOp(ts, RPMTS_OP_UNCOMPRESS), fdOp(payload, FDSTAT_READ));
     rpmswAdd(rpmtsOp(ts, RPMTS_OP_DIGEST), fdOp(payload, FDSTAT_DIGEST));
+    pthread_mutex_unlock(&tsOpsLock);
+    rpmswAdd(rpmteOp(te, RPMTS_OP_UNCOMPRESS), fdOp(payload, FDSTAT_READ));
+    rpmswAdd(rpmteOp(te, RPMTS_OP_DIGEST), fdOp(payload, FDSTAT_DIGEST));
 
 exit:
     fi = fsmIterFini(fi, &di);
+    fsmUringFree(uring);
+    rpmfiFree(mfi);
     Fclose(payload);
     free(tid);
     for (int i = 0; i < fc; i++)
@@ -1103,28 +1918,143 @@ exit:
 }
 
 
+/* Deal with the result of removing a file, return the final rc */
+static int eraseResult(struct filedata_s *fp, int missingok, int rc, int err)
+{
+    /*
+     * Missing %ghost or %missingok entries are not errors.
+     * XXX: Are non-existent files ever an actual error here? Afterall
+     * that's exactly what we're trying to accomplish here,
+     * and complaining about job already done seems like kinderkarten
+     * level "But it was MY turn!" whining...
+     */
+    if (rc == RPMERR_ENOENT && missingok) {
+	rc = 0;
+    }
+
+    /*
+     * Dont whine on non-empty directories for now. We might be able
+     * to track at least some of the expected failures though,
+     * such as when we knowingly left config file backups etc behind.
+     */
+    if (rc == RPMERR_ENOTEMPTY) {
+	rc = 0;
+    }
+
+    if (rc) {
+	int lvl = strict_erasures ? RPMLOG_ERR : RPMLOG_WARNING;
+	rpmlog(lvl, _("%s %s: remove failed: %s\n"),
+		S_ISDIR(fp->sb.st_mode) ? _("directory") : _("file"),
+		fp->fpath, strerror(err));
+    }
+    return rc;
+}
+
+/* Below this many files in a directory, don't bother with threads */
+#define ERASE_BATCH_MIN 8
+
+struct eraseItem_s {
+    int fx;
+    int missingok;
+    int rc;
+    int err;
+    rpm_loff_t amount;
+};
+
+/* Non-directory removals in the current directory, done in parallel */
+struct eraseBatch_s {
+    struct filedata_s *fdata;
+    struct eraseItem_s *items;
+    int n;
+    int dirfd;
+    int dx;
+    const char *dn;
+};
+
+static void eraseOne(void *data, int ix, int slot)
+{
+    struct eraseBatch_s *b = data;
+    struct eraseItem_s *item = &b->items[ix];
+    struct filedata_s *fp = &b->fdata[item->fx];
+
+    item->rc = fsmUnlink(b->dirfd, fp->fpath);
+    item->err = errno;
+}
+
+static int eraseFlush(struct eraseBatch_s *b, int nthreads, rpmpsm psm,
+		      char **failedFile)
+{
+    int rc = 0;
+
+    if (b->n == 0)
+	return 0;
+
+    rpmworkersRun(b->n >= ERASE_BATCH_MIN ? nthreads : 1, b->n, eraseOne, b);
+
+    /* Report in the original order, plugins have no file hooks here */
+    for (int i = 0; i < b->n; i++) {
+	struct eraseItem_s *item = &b->items[i];
+	struct filedata_s *fp = &b->fdata[item->fx];
+	int xx = eraseResult(fp, item->missingok, item->rc, item->err);
+
+	/* XXX Failure to remove is not (yet) cause for failure. */
+	if (!strict_erasures) xx = 0;
+
+	if (xx) {
+	    if (rc == 0 && *failedFile == NULL)
+		*failedFile = rstrscat(NULL, b->dn, fp->fpath, NULL);
+	    if (rc == 0)
+		rc = xx;
+	} else {
+	    rpmpsmNotify(psm, RPMCALLBACK_UNINST_PROGRESS, item->amount);
+	}
+    }
+
+    fsmClose(&b->dirfd);
+    b->n = 0;
+    return rc;
+}
+
 int rpmPackageFilesRemove(rpmts ts, rpmte te, rpmfiles files,
               rpmpsm psm, char ** failedFile)
 {
-    struct diriter_s di = { -1, -1 };
+    struct diriter_s di = { -1, -1, ts->dircache };
     rpmfi fi = fsmIter(NULL, files, RPMFI_ITER_BACK, &di);
     rpmfs fs = rpmteGetFileStates(te);
     rpmPlugins plugins = rpmtsPlugins(ts);
     int fc = rpmfilesFC(files);
     int fx = -1;
     struct filedata_s *fdata = xcalloc(fc, sizeof(*fdata));
+    int nthreads = rpmworkersCount("_erase_threads");
+    struct eraseBatch_s batch = {
+	.fdata = fdata,
+	.dirfd = -1,
+	.dx = -1,
+    };
     int rc = 0;
 
+    /* Plugin file hooks expect to see each file removed in turn */
+    if (nthreads > 1 && rpmpluginsHaveFileHooks(plugins))
+	nthreads = 1;
+    if (nthreads > 1)
+	batch.items = xcalloc(fc, sizeof(*batch.items));
+
     while (!rc && (fx = rpmfiNext(fi)) >= 0) {
 	struct filedata_s *fp = &fdata[fx];
 	fp->action = rpmfsGetAction(fs, rpmfiFX(fi));
 
+	/* Entering another directory, finish up the previous one */
+	if (batch.n && rpmfiDX(fi) != batch.dx) {
+	    if ((rc = eraseFlush(&batch, nthreads, psm, failedFile)))
+		break;
+	}
+
 	if (XFA_SKIPPING(fp->action))
 	    continue;
 
 	fp->fpath = fsmFsPath(fi, NULL);
 	/* If the directory doesn't exist there's nothing to clean up */
-	if (ensureDir(NULL, rpmfiDN(fi), 0, 0, 1, &di.dirfd))
+	if (ensureDir(di.dc, NULL, rpmfiDN(fi), 0, 0, 1, &di.dirfd))
 	    continue;
 
 	rc = fsmStat(di.dirfd, fp->fpath, 1, &fp->sb);
@@ -1141,34 +2071,29 @@ int rpmPackageFilesRemove(rpmts ts, rpmte te, rpmfiles files,
         if (fp->action == FA_ERASE) {
 	    int missingok = (rpmfiFFlags(fi) & (RPMFILE_MISSINGOK | RPMFILE_GHOST));
 
-	    rc = fsmRemove(di.dirfd, fp->fpath, fp->sb.st_mode);
-
-	    /*
-	     * Missing %ghost or %missingok entries are not errors.
-	     * XXX: Are non-existent files ever an actual error here? Afterall
-	     * that's exactly what we're trying to accomplish here,
-	     * and complaining about job already done seems like kinderkarten
-	     * level "But it was MY turn!" whining...
-	     */
-	    if (rc == RPMERR_ENOENT && missingok) {
-		rc = 0;
+	    /* Queue up files within the directory, they're independent */
+	    if (nthreads > 1 && !S_ISDIR(fp->sb.st_mode)) {
+		if (batch.n == 0)
+		    batch.dirfd = fcntl(di.dirfd, F_DUPFD_CLOEXEC, 0);
+		if (batch.dirfd >= 0) {
+		    struct eraseItem_s *item = &batch.items[batch.n++];
+		    item->fx = fx;
+		    item->missingok = missingok;
+		    item->amount = rpmfiFC(fi) - rpmfiFX(fi);
+		    batch.dx = rpmfiDX(fi);
+		    batch.dn = rpmfiDN(fi);
+		    continue;
+		}
 	    }
 
-	    /*
-	     * Dont whine on non-empty directories for now. We might be able
-	     * to track at least some of the expected failures though,
-	     * such as when we knowingly left config file backups etc behind.
-	     */
-	    if (rc == RPMERR_ENOTEMPTY) {
-		rc = 0;
+	    /* Keep directory removals in order with the queued files */
+	    if (batch.n) {
+		if ((rc = eraseFlush(&batch, nthreads, psm, failedFile)))
+		    break;
 	    }
 
-	    if (rc) {
-		int lvl = strict_erasures ? RPMLOG_ERR : RPMLOG_WARNING;
-		rpmlog(lvl, _("%s %s: remove failed: %s\n"),
-			S_ISDIR(fp->sb.st_mode) ? _("directory") : _("file"),
-			fp->fpath, strerror(errno));
-            }
+	    rc = fsmRemove(di.dirfd, fp->fpath, fp->sb.st_mode);
+	    rc = eraseResult(fp, missingok, rc, errno);
         }
 
 	/* Run fsm file post hook for all plugins */
@@ -1189,9 +2114,17 @@ int rpmPackageFilesRemove(rpmts ts, rpmte te, rpmfiles files,
 	}
     }
 
+    /* Files queued before an error were due for removal anyway */
+    if (batch.n) {
+	int xx = eraseFlush(&batch, nthreads, psm, failedFile);
+	if (rc == 0)
+	    rc = xx;
+    }
+
     for (int i = 0; i < fc; i++)
 	free(fdata[i].fpath);
     free(fdata);
+    free(batch.items);
     fsmIterFini(fi, &di);
 
     return rc;
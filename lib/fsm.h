@@ -13,6 +13,7 @@ extern "C" {
 #endif
 
 typedef struct rpmpsm_s * rpmpsm;
+typedef struct fsmDirCache_s * fsmDirCache;
 
 /**
  * Execute a file actions for package
@@ -33,8 +34,29 @@ int rpmPackageFilesRemove(rpmts ts, rpmte te, rpmfiles files,
 RPM_GNUC_INTERNAL
 int rpmfiArchiveReadToFilePsm(rpmfi fi, FD_t fd, int nodigest, rpmpsm psm);
 
+/*
+ * Copy file content from an uncompressed payload with copy_file_range().
+ * Returns 0 on success, 1 if not possible, error code otherwise.
+ */
+RPM_GNUC_INTERNAL
+int rpmfiArchiveCopyToFile(rpmfi fi, int fdno, int nodigest, rpmpsm psm);
+
 RPM_GNUC_INTERNAL
 void rpmpsmNotify(rpmpsm psm, int what, rpm_loff_t amount);
+
+/*
+ * Create a cache of directories known to exist for a transaction,
+ * %_fsm_dircache_size entries big. Returns NULL when disabled.
+ */
+RPM_GNUC_INTERNAL
+fsmDirCache fsmDirCacheNew(void);
+
+/* Forget all cached directories, eg after running a scriptlet */
+RPM_GNUC_INTERNAL
+void fsmDirCacheFlush(fsmDirCache dc);
+
+RPM_GNUC_INTERNAL
+fsmDirCache fsmDirCacheFree(fsmDirCache dc);
 #ifdef __cplusplus
 }
 #endif
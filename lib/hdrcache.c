@@ -0,0 +1,153 @@
+#include "system.h"
+
+#include <rpm/header.h>
+
+#include "lib/hdrcache.h"
+
+#include "debug.h"
+
+typedef struct hdrCacheEntry_s * hdrCacheEntry;
+struct hdrCacheEntry_s {
+    unsigned int hdrNum;
+    Header h;
+    hdrCacheEntry hnext;	/*!< hash chain (or free list) */
+    hdrCacheEntry prev;		/*!< more recently used */
+    hdrCacheEntry next;		/*!< less recently used */
+};
+
+struct hdrCache_s {
+    int size;
+    int used;
+    int nbuckets;
+    hdrCacheEntry entries;
+    hdrCacheEntry * buckets;
+    hdrCacheEntry freelist;
+    hdrCacheEntry head;		/*!< most recently used */
+    hdrCacheEntry tail;		/*!< least recently used */
+};
+
+static hdrCacheEntry * hcBucket(hdrCache hc, unsigned int hdrNum)
+{
+    return &hc->buckets[(hdrNum * 2654435761U) % hc->nbuckets];
+}
+
+static void hcUnlink(hdrCache hc, hdrCacheEntry e)
+{
+    if (e->prev)
+	e->prev->next = e->next;
+    else
+	hc->head = e->next;
+    if (e->next)
+	e->next->prev = e->prev;
+    else
+	hc->tail = e->prev;
+    e->prev = e->next = NULL;
+}
+
+static void hcPushFront(hdrCache hc, hdrCacheEntry e)
+{
+    e->prev = NULL;
+    e->next = hc->head;
+    if (hc->head)
+	hc->head->prev = e;
+    hc->head = e;
+    if (hc->tail == NULL)
+	hc->tail = e;
+}
+
+static hdrCacheEntry hcFind(hdrCache hc, unsigned int hdrNum,
+			    hdrCacheEntry ** prevp)
+{
+    hdrCacheEntry * ep = hcBucket(hc, hdrNum);
+    for (; *ep; ep = &(*ep)->hnext) {
+	if ((*ep)->hdrNum == hdrNum)
+	    break;
+    }
+    if (prevp)
+	*prevp = ep;
+    return *ep;
+}
+
+static void hcRemove(hdrCache hc, hdrCacheEntry e)
+{
+    hdrCacheEntry *ep = NULL;
+
+    hcFind(hc, e->hdrNum, &ep);
+    *ep = e->hnext;
+    hcUnlink(hc, e);
+    e->h = headerFree(e->h);
+    e->hnext = hc->freelist;
+    hc->freelist = e;
+}
+
+hdrCache hdrCacheNew(int size)
+{
+    hdrCache hc = xcalloc(1, sizeof(*hc));
+    hc->size = size;
+    hc->nbuckets = size * 2 + 1;
+    hc->entries = xcalloc(size, sizeof(*hc->entries));
+    hc->buckets = xcalloc(hc->nbuckets, sizeof(*hc->buckets));
+    return hc;
+}
+
+hdrCache hdrCacheFree(hdrCache hc)
+{
+    if (hc) {
+	for (int i = 0; i < hc->used; i++)
+	    headerFree(hc->entries[i].h);
+	free(hc->entries);
+	free(hc->buckets);
+	free(hc);
+    }
+    return NULL;
+}
+
+Header hdrCacheGet(hdrCache hc, unsigned int hdrNum)
+{
+    hdrCacheEntry e = hc ? hcFind(hc, hdrNum, NULL) : NULL;
+
+    if (e == NULL)
+	return NULL;
+    if (e != hc->head) {
+	hcUnlink(hc, e);
+	hcPushFront(hc, e);
+    }
+    return headerLink(e->h);
+}
+
+void hdrCachePut(hdrCache hc, unsigned int hdrNum, Header h)
+{
+    hdrCacheEntry e, *bp;
+
+    if (hc == NULL || h == NULL)
+	return;
+
+    if ((e = hcFind(hc, hdrNum, NULL)) != NULL)
+	hcRemove(hc, e);
+
+    if (hc->freelist) {
+	e = hc->freelist;
+	hc->freelist = e->hnext;
+    } else if (hc->used < hc->size) {
+	e = &hc->entries[hc->used++];
+    } else {
+	e = hc->tail;
+	hcRemove(hc, e);
+	hc->freelist = e->hnext;
+    }
+
+    e->hdrNum = hdrNum;
+    e->h = headerLink(h);
+    bp = hcBucket(hc, hdrNum);
+    e->hnext = *bp;
+    *bp = e;
+    hcPushFront(hc, e);
+}
+
+void hdrCacheDrop(hdrCache hc, unsigned int hdrNum)
+{
+    hdrCacheEntry e = hc ? hcFind(hc, hdrNum, NULL) : NULL;
+
+    if (e)
+	hcRemove(hc, e);
+}
@@ -0,0 +1,63 @@
+#ifndef HDRCACHE_H
+#define HDRCACHE_H
+
+/** \file lib/hdrcache.h
+ * Bounded LRU cache of imported headers, keyed by package instance.
+ */
+
+#include <rpm/rpmtypes.h>
+#include <rpm/rpmutil.h>
+
+typedef struct hdrCache_s * hdrCache;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Create a header cache.
+ * @param size		max. number of headers to keep
+ * @return		new cache
+ */
+RPM_GNUC_INTERNAL
+hdrCache hdrCacheNew(int size);
+
+/**
+ * Destroy a header cache, releasing all cached headers.
+ * @param hc		header cache (or NULL)
+ * @return		NULL always
+ */
+RPM_GNUC_INTERNAL
+hdrCache hdrCacheFree(hdrCache hc);
+
+/**
+ * Look up a header, marking it most recently used.
+ * @param hc		header cache (or NULL)
+ * @param hdrNum	package instance
+ * @return		new reference to cached header, NULL if not cached
+ */
+RPM_GNUC_INTERNAL
+Header hdrCacheGet(hdrCache hc, unsigned int hdrNum);
+
+/**
+ * Add a header, evicting the least recently used one if full.
+ * @param hc		header cache (or NULL)
+ * @param hdrNum	package instance
+ * @param h		header (a reference is taken)
+ */
+RPM_GNUC_INTERNAL
+void hdrCachePut(hdrCache hc, unsigned int hdrNum, Header h);
+
+/**
+ * Forget a header whose database record changed.
+ * @param hc		header cache (or NULL)
+ * @param hdrNum	package instance
+ */
+RPM_GNUC_INTERNAL
+void hdrCacheDrop(hdrCache hc, unsigned int hdrNum);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HDRCACHE_H */
@@ -0,0 +1,328 @@
+#include "system.h"
+
+#include <sys/stat.h>
+#include <errno.h>
+
+#include <rpm/rpmfileutil.h>
+#include <rpm/rpmlog.h>
+#include <rpm/rpmstring.h>
+
+#include "lib/hdrshm.h"
+#include "lib/sidecar.h"
+
+#include "debug.h"
+
+#define HDRSHM_MAGIC	"RPMHDRS1"
+
+/*
+ * A sidecar file, only shared on the host:
+ *	head
+ *	entries[count]		in scan order
+ *	sorted[count]		entry numbers sorted by hdrNum
+ *	blobs			8 byte aligned
+ */
+struct shmHead_s {
+    struct sidecarHead_s sc;
+    uint32_t count;
+    uint32_t reserved;
+};
+
+struct shmEntry_s {
+    uint32_t hdrNum;
+    uint32_t bloblen;
+    uint64_t offset;
+};
+
+struct hdrShm_s {
+    int nrefs;
+    unsigned char *map;
+    size_t size;
+    const struct shmHead_s *head;
+    const struct shmEntry_s *entries;
+    const uint32_t *sorted;
+};
+
+struct hdrShmBuild_s {
+    struct hdrShmId_s id;
+    struct shmEntry_s *entries;
+    unsigned int count;
+    unsigned int alloced;
+    unsigned char *data;
+    size_t datalen;
+    size_t dataalloced;
+};
+
+static size_t align8(size_t n)
+{
+    return (n + 7) & ~(size_t)7;
+}
+
+static char *shmPath(const char *dir, const struct hdrShmId_s *id)
+{
+    char *path = NULL;
+    rasprintf(&path, "%s/rpmdb-%llx-%llx.hdrs", dir,
+	      (unsigned long long)id->dev, (unsigned long long)id->ino);
+    return path;
+}
+
+static uint64_t statNsec(const struct stat *st)
+{
+    return (uint64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+int hdrShmIdentify(const char *dbfile, struct hdrShmId_s *id)
+{
+    char *wal = rstrscat(NULL, dbfile, "-wal", NULL);
+    struct stat st;
+    int rc = -1;
+
+    memset(id, 0, sizeof(*id));
+    if (stat(dbfile, &st) == 0) {
+	id->dev = st.st_dev;
+	id->ino = st.st_ino;
+	id->size = st.st_size;
+	id->mtime = statNsec(&st);
+	if (stat(wal, &st) == 0) {
+	    id->walsize = st.st_size;
+	    id->walmtime = statNsec(&st);
+	}
+	rc = 0;
+    }
+    free(wal);
+    return rc;
+}
+
+static int idEqual(const struct hdrShmId_s *a, const struct hdrShmId_s *b)
+{
+    return (a->dev == b->dev && a->ino == b->ino &&
+	    a->size == b->size && a->mtime == b->mtime &&
+	    a->walsize == b->walsize && a->walmtime == b->walmtime);
+}
+
+/* Is the mapped file complete and consistent? */
+static int shmValid(hdrShm shm)
+{
+    const struct shmHead_s *head = shm->head;
+    size_t tables;
+
+    tables = sizeof(*head) + head->count * (sizeof(*shm->entries) +
+					    sizeof(*shm->sorted));
+    if (head->count > shm->size / sizeof(*shm->entries) || tables > shm->size)
+	return 0;
+
+    for (unsigned int i = 0; i < head->count; i++) {
+	const struct shmEntry_s *e = &shm->entries[i];
+	if (e->offset < tables || e->offset > shm->size ||
+		e->bloblen > shm->size - e->offset)
+	    return 0;
+	if (shm->sorted[i] >= head->count)
+	    return 0;
+    }
+    return 1;
+}
+
+hdrShm hdrShmAttach(const char *dir, const struct hdrShmId_s *id)
+{
+    char *path = shmPath(dir, id);
+    hdrShm shm = NULL;
+    size_t size = 0;
+    void *map;
+
+    /* The blobs are trusted, they must come from us or root */
+    map = sidecarMap(path, sizeof(struct shmHead_s), &size);
+    if (map == NULL)
+	goto exit;
+
+    shm = xcalloc(1, sizeof(*shm));
+    shm->nrefs = 1;
+    shm->map = map;
+    shm->size = size;
+    shm->head = map;
+    shm->entries = (const struct shmEntry_s *)(shm->head + 1);
+    shm->sorted = (const uint32_t *)(shm->entries + shm->head->count);
+
+    if (!sidecarHeadValid(map, size, HDRSHM_MAGIC, id) || !shmValid(shm)) {
+	shm = hdrShmDetach(shm);
+    } else {
+	rpmlog(RPMLOG_DEBUG, "using %u shared headers from %s\n",
+		shm->head->count, path);
+    }
+
+exit:
+    free(path);
+    return shm;
+}
+
+hdrShm hdrShmLink(hdrShm shm)
+{
+    if (shm)
+	shm->nrefs++;
+    return shm;
+}
+
+hdrShm hdrShmDetach(hdrShm shm)
+{
+    if (shm && --shm->nrefs == 0) {
+	sidecarUnmap(shm->map, shm->size);
+	free(shm);
+    }
+    return NULL;
+}
+
+int hdrShmMatches(hdrShm shm, const struct hdrShmId_s *id)
+{
+    return idEqual(&shm->head->sc.id, id);
+}
+
+void hdrShmRemove(const char *dir, const struct hdrShmId_s *id)
+{
+    char *path = shmPath(dir, id);
+    (void) unlink(path);
+    free(path);
+}
+
+unsigned int hdrShmCount(hdrShm shm)
+{
+    return shm->head->count;
+}
+
+const void *hdrShmBlob(hdrShm shm, unsigned int ix,
+		       unsigned int *hdrNum, unsigned int *bloblen)
+{
+    const struct shmEntry_s *e = &shm->entries[ix];
+    *hdrNum = e->hdrNum;
+    *bloblen = e->bloblen;
+    return shm->map + e->offset;
+}
+
+int hdrShmFind(hdrShm shm, unsigned int hdrNum)
+{
+    unsigned int lo = 0, hi = shm->head->count;
+
+    while (lo < hi) {
+	unsigned int mid = lo + (hi - lo) / 2;
+	unsigned int ix = shm->sorted[mid];
+	unsigned int key = shm->entries[ix].hdrNum;
+	if (key == hdrNum)
+	    return ix;
+	if (key < hdrNum)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    return -1;
+}
+
+hdrShmBuild hdrShmBuildNew(const struct hdrShmId_s *id)
+{
+    hdrShmBuild b = xcalloc(1, sizeof(*b));
+    b->id = *id;
+    return b;
+}
+
+void hdrShmBuildAdd(hdrShmBuild b, unsigned int hdrNum,
+		    const void *blob, unsigned int bloblen)
+{
+    size_t need = b->datalen + align8(bloblen);
+    struct shmEntry_s *e;
+
+    if (b->count == b->alloced) {
+	b->alloced = b->alloced ? b->alloced * 2 : 256;
+	b->entries = xrealloc(b->entries, b->alloced * sizeof(*b->entries));
+    }
+    if (need > b->dataalloced) {
+	b->dataalloced = b->dataalloced ? b->dataalloced * 2 : 1024 * 1024;
+	if (b->dataalloced < need)
+	    b->dataalloced = need;
+	b->data = xrealloc(b->data, b->dataalloced);
+    }
+
+    e = &b->entries[b->count++];
+    e->hdrNum = hdrNum;
+    e->bloblen = bloblen;
+    e->offset = b->datalen;	/* relative to the blobs until written */
+    memcpy(b->data + b->datalen, blob, bloblen);
+    memset(b->data + b->datalen + bloblen, 0, align8(bloblen) - bloblen);
+    b->datalen = need;
+}
+
+struct sortItem_s {
+    uint32_t hdrNum;
+    uint32_t ix;
+};
+
+static int sortItemCmp(const void *a, const void *b)
+{
+    const struct sortItem_s *x = a, *y = b;
+    return (x->hdrNum > y->hdrNum) - (x->hdrNum < y->hdrNum);
+}
+
+struct shmWriter_s {
+    hdrShmBuild b;
+    const struct shmHead_s *head;
+    const uint32_t *sorted;
+    size_t tables;
+};
+
+static int shmWrite(FILE *fp, void *data)
+{
+    struct shmWriter_s *w = data;
+
+    fwrite(w->head, sizeof(*w->head), 1, fp);
+    fwrite(w->b->entries, sizeof(*w->b->entries), w->b->count, fp);
+    fwrite(w->sorted, sizeof(*w->sorted), w->b->count, fp);
+    for (size_t n = ftell(fp); n < w->tables; n++)
+	fputc('\0', fp);
+    fwrite(w->b->data, 1, w->b->datalen, fp);
+    return 0;
+}
+
+int hdrShmBuildWrite(hdrShmBuild b, const char *dir)
+{
+    char *path = shmPath(dir, &b->id);
+    size_t tables = align8(sizeof(struct shmHead_s) +
+			   b->count * (sizeof(*b->entries) + sizeof(uint32_t)));
+    uint32_t *sorted = xmalloc((b->count + 1) * sizeof(*sorted));
+    struct sortItem_s *items = xmalloc((b->count + 1) * sizeof(*items));
+    struct shmHead_s head;
+    struct shmWriter_s w = { b, &head, sorted, tables };
+    int rc = -1;
+
+    for (unsigned int i = 0; i < b->count; i++) {
+	b->entries[i].offset += tables;
+	items[i].hdrNum = b->entries[i].hdrNum;
+	items[i].ix = i;
+    }
+    qsort(items, b->count, sizeof(*items), sortItemCmp);
+    for (unsigned int i = 0; i < b->count; i++)
+	sorted[i] = items[i].ix;
+    free(items);
+
+    memset(&head, 0, sizeof(head));
+    sidecarHeadInit(&head.sc, HDRSHM_MAGIC, &b->id, tables + b->datalen);
+    head.count = b->count;
+
+    if (rpmioMkpath(dir, 0755, -1, -1) == 0)
+	rc = sidecarWrite(path, shmWrite, &w);
+
+    if (rc) {
+	rpmlog(RPMLOG_DEBUG, "failed to store shared headers %s: %s\n",
+		path, strerror(errno));
+    } else {
+	rpmlog(RPMLOG_DEBUG, "stored %u shared headers in %s\n",
+		b->count, path);
+    }
+    free(sorted);
+    free(path);
+    return rc;
+}
+
+hdrShmBuild hdrShmBuildFree(hdrShmBuild b)
+{
+    if (b) {
+	free(b->entries);
+	free(b->data);
+	free(b);
+    }
+    return NULL;
+}
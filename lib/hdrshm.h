@@ -0,0 +1,153 @@
+#ifndef HDRSHM_H
+#define HDRSHM_H
+
+/** \file lib/hdrshm.h
+ * Header blob cache shared by the processes reading the same rpmdb.
+ *
+ * A full scan of the packages stores the checked blobs it read in a
+ * file, which other processes map read-only. The file is tied to the
+ * state of the database file it was made from, any change to the
+ * database makes it stale.
+ */
+
+#include <rpm/rpmtypes.h>
+#include <rpm/rpmutil.h>
+
+typedef struct hdrShm_s * hdrShm;
+typedef struct hdrShmBuild_s * hdrShmBuild;
+
+/** Identity and state of a database file */
+struct hdrShmId_s {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    uint64_t mtime;		/*!< nanoseconds */
+    uint64_t walsize;		/*!< write-ahead log, if any */
+    uint64_t walmtime;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Get the current identity of a database file.
+ * @param dbfile	database file path
+ * @retval id		identity
+ * @return		0 on success, -1 on error
+ */
+RPM_GNUC_INTERNAL
+int hdrShmIdentify(const char *dbfile, struct hdrShmId_s *id);
+
+/**
+ * Map the cache made from a database in its current state.
+ * @param dir		cache directory
+ * @param id		database identity
+ * @return		cache, NULL if there's none or it's stale
+ */
+RPM_GNUC_INTERNAL
+hdrShm hdrShmAttach(const char *dir, const struct hdrShmId_s *id);
+
+/**
+ * Reference a cache.
+ * @param shm		cache (or NULL)
+ * @return		new reference
+ */
+RPM_GNUC_INTERNAL
+hdrShm hdrShmLink(hdrShm shm);
+
+/**
+ * Drop a reference to a cache, unmapping it with the last one.
+ * @param shm		cache (or NULL)
+ * @return		NULL always
+ */
+RPM_GNUC_INTERNAL
+hdrShm hdrShmDetach(hdrShm shm);
+
+/**
+ * Is the cache made from the database in this state?
+ * @param shm		cache
+ * @param id		database identity
+ * @return		1 if it is, 0 otherwise
+ */
+RPM_GNUC_INTERNAL
+int hdrShmMatches(hdrShm shm, const struct hdrShmId_s *id);
+
+/**
+ * Remove the cache of a database, after changing it.
+ * @param dir		cache directory
+ * @param id		database identity
+ */
+RPM_GNUC_INTERNAL
+void hdrShmRemove(const char *dir, const struct hdrShmId_s *id);
+
+/**
+ * Number of cached blobs, in the order of the scan that stored them.
+ * @param shm		cache
+ * @return		number of blobs
+ */
+RPM_GNUC_INTERNAL
+unsigned int hdrShmCount(hdrShm shm);
+
+/**
+ * Get a cached blob by position.
+ * @param shm		cache
+ * @param ix		position
+ * @retval hdrNum	package instance
+ * @retval bloblen	blob length
+ * @return		blob, in the read-only mapping
+ */
+RPM_GNUC_INTERNAL
+const void *hdrShmBlob(hdrShm shm, unsigned int ix,
+		       unsigned int *hdrNum, unsigned int *bloblen);
+
+/**
+ * Find the position of a package instance.
+ * @param shm		cache
+ * @param hdrNum	package instance
+ * @return		position, -1 if not cached
+ */
+RPM_GNUC_INTERNAL
+int hdrShmFind(hdrShm shm, unsigned int hdrNum);
+
+/**
+ * Start collecting the blobs of a full scan.
+ * @param id		database identity before the scan
+ * @return		new collection
+ */
+RPM_GNUC_INTERNAL
+hdrShmBuild hdrShmBuildNew(const struct hdrShmId_s *id);
+
+/**
+ * Add a checked blob to a collection.
+ * @param b		collection
+ * @param hdrNum	package instance
+ * @param blob		header blob
+ * @param bloblen	blob length
+ */
+RPM_GNUC_INTERNAL
+void hdrShmBuildAdd(hdrShmBuild b, unsigned int hdrNum,
+		    const void *blob, unsigned int bloblen);
+
+/**
+ * Store a complete collection as the cache of its database.
+ * @param b		collection
+ * @param dir		cache directory
+ * @return		0 on success, -1 on error
+ */
+RPM_GNUC_INTERNAL
+int hdrShmBuildWrite(hdrShmBuild b, const char *dir);
+
+/**
+ * Free a collection.
+ * @param b		collection (or NULL)
+ * @return		NULL always
+ */
+RPM_GNUC_INTERNAL
+hdrShmBuild hdrShmBuildFree(hdrShmBuild b);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HDRSHM_H */
@@ -12,10 +12,12 @@
 #include <netdb.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <sys/uio.h>
 #include <rpm/rpmtypes.h>
 #include <rpm/rpmstring.h>
 #include "lib/header_internal.h"
 #include "lib/misc.h"			/* tag function proto */
+#include "lib/rpmprobes.h"
 
 #include "debug.h"
 
@@ -73,6 +75,7 @@ enum headerFlags_e {
     HEADERFLAG_ALLOCATED = (1 << 1), /*!< Is 1st header region allocated? */
     HEADERFLAG_LEGACY    = (1 << 2), /*!< Header came from legacy source? */
     HEADERFLAG_DEBUG     = (1 << 3), /*!< Debug this header? */
+    HEADERFLAG_LAZY      = (1 << 4), /*!< Region data left in network order? */
 };
 
 typedef rpmFlags headerFlags;
@@ -86,6 +89,7 @@ struct indexEntry_s {
     rpm_data_t data; 		/*!< Location of tag data. */
     int length;			/*!< No. bytes of data. */
     int rdlen;			/*!< No. bytes of data in region. */
+    rpm_data_t hdata;		/*!< Host order copy (or string table) of region data. */
 };
 
 /** \ingroup header
@@ -100,6 +104,9 @@ struct headerToken_s {
     headerFlags flags;
     int sorted;			/*!< Current sort method */
     int nrefs;			/*!< Reference count. */
+    rpm_data_t * stale;		/*!< Lazy data copies of replaced entries */
+    int nstale;
+    uint16_t * tagmap;		/*!< Index positions (+1) of common tags */
 };
 
 /** \ingroup header
@@ -109,6 +116,18 @@ static const size_t headerMaxbytes = (256*1024*1024);
 
 #define	INDEX_MALLOC_SIZE	8
 
+/*
+ * Tags in these ranges get looked up through a direct-mapped table of
+ * their index positions, built on first lookup in a sorted header of
+ * at least TAGMAP_MIN_ENTRIES entries. Everything else (and the odd
+ * header too big for 16-bit positions) uses a binary search.
+ */
+#define	TAGMAP_BASE1		1000	/* RPMTAG_NAME ... */
+#define	TAGMAP_SIZE1		200
+#define	TAGMAP_BASE2		5000	/* RPMTAG_FILENAMES ... */
+#define	TAGMAP_SIZE2		112
+#define	TAGMAP_MIN_ENTRIES	16
+
 #define	ENTRY_IS_REGION(_e) \
 	(((_e)->info.tag >= RPMTAG_HEADERIMAGE) && ((_e)->info.tag < RPMTAG_HEADERREGIONS))
 #define	ENTRY_IN_REGION(_e)	((_e)->info.offset < 0)
@@ -203,25 +222,22 @@ static uint64_t htonll(uint64_t n)
 }
 #endif
 
+/* Headers can be shared between transactions running in other threads */
 Header headerLink(Header h)
 {
     if (h != NULL)
-	h->nrefs++;
+	__atomic_add_fetch(&h->nrefs, 1, __ATOMIC_RELAXED);
     return h;
 }
 
-static Header headerUnlink(Header h)
+static int headerUnlink(Header h)
 {
-    if (h != NULL)
-	h->nrefs--;
-    return NULL;
+    return __atomic_sub_fetch(&h->nrefs, 1, __ATOMIC_ACQ_REL);
 }
 
 Header headerFree(Header h)
 {
-    (void) headerUnlink(h);
-
-    if (h == NULL || h->nrefs > 0)
+    if (h == NULL || headerUnlink(h) > 0)
 	return NULL;
 
     if (h->index) {
@@ -238,10 +254,15 @@ Header headerFree(Header h)
 		entry->data = _free(entry->data);
 	    }
 	    entry->data = NULL;
+	    entry->hdata = _free(entry->hdata);
 	}
 	h->index = _free(h->index);
     }
+    for (int i = 0; i < h->nstale; i++)
+	free(h->stale[i]);
+    h->stale = _free(h->stale);
     h->blob = _free(h->blob);
+    h->tagmap = _free(h->tagmap);
 
     h = _free(h);
     return NULL;
@@ -343,9 +364,45 @@ static void headerSort(Header h)
     if (!h->sorted) {
 	qsort(h->index, h->indexUsed, sizeof(*h->index), indexCmp);
 	h->sorted = 1;
+	h->tagmap = _free(h->tagmap);
     }
 }
 
+static int tagmapSlot(rpmTagVal tag)
+{
+    if ((unsigned) (tag - TAGMAP_BASE1) < TAGMAP_SIZE1)
+	return tag - TAGMAP_BASE1;
+    if ((unsigned) (tag - TAGMAP_BASE2) < TAGMAP_SIZE2)
+	return TAGMAP_SIZE1 + tag - TAGMAP_BASE2;
+    return -1;
+}
+
+/* Get (or build) the tag map of a sorted header, NULL if not worth it */
+static uint16_t *tagmapGet(Header h)
+{
+    uint16_t *map = __atomic_load_n(&h->tagmap, __ATOMIC_ACQUIRE);
+    uint16_t *prev = NULL;
+
+    if (map || h->indexUsed < TAGMAP_MIN_ENTRIES || h->indexUsed >= UINT16_MAX)
+	return map;
+
+    /* Backwards, so the first of duplicate tags wins */
+    map = xcalloc(TAGMAP_SIZE1 + TAGMAP_SIZE2, sizeof(*map));
+    for (int i = h->indexUsed - 1; i >= 0; i--) {
+	int slot = tagmapSlot(h->index[i].info.tag);
+	if (slot >= 0)
+	    map[slot] = i + 1;
+    }
+
+    /* Concurrent readers may race to build it, only one is kept */
+    if (!__atomic_compare_exchange_n(&h->tagmap, &prev, map, 0,
+				     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+	free(map);
+	map = prev;
+    }
+    return map;
+}
+
 static int offsetCmp(const void * avp, const void * bvp) 
 {
     indexEntry ap = (indexEntry) avp, bp = (indexEntry) bvp;
@@ -507,13 +564,14 @@ static int dataLength(rpm_tagtype_t type, rpm_constdata_t p, rpm_count_t count,
  * @param dataEnd	header data end
  * @param regionid	region offset
  * @param fast		use offsets for data sizes if possible
+ * @param swab		perform endian conversions (or only check sizes)
  * @return		no. bytes of data in region, -1 on error
  */
 static int regionSwab(indexEntry entry, int il, int dl,
 		entryInfo pe,
 		unsigned char * dataStart,
 		const unsigned char * dataEnd,
-		int regionid, int fast)
+		int regionid, int fast, int swab)
 {
     if ((entry != NULL && regionid >= 0) || (entry == NULL && regionid != 0))
 	return -1;
@@ -547,6 +605,7 @@ static int regionSwab(indexEntry entry, int il, int dl,
 	    return -1;
 
 	ie.rdlen = 0;
+	ie.hdata = NULL;
 
 	if (entry) {
 	    ie.info.offset = regionid;
@@ -558,7 +617,7 @@ static int regionSwab(indexEntry entry, int il, int dl,
 	dl += alignDiff(ie.info.type, dl);
 
 	/* Perform endian conversions */
-	switch (ntohl(pe->type)) {
+	switch (swab ? ntohl(pe->type) : RPM_NULL_TYPE) {
 	case RPM_INT64_TYPE:
 	{   uint64_t * it = ie.data;
 	    for (; ie.info.count > 0; ie.info.count--, it += 1) {
@@ -591,19 +650,147 @@ static int regionSwab(indexEntry entry, int il, int dl,
     return dl;
 }
 
-static void * doExport(const struct indexEntry_s *hindex, int indexUsed,
-			headerFlags flags, unsigned int *bsize)
+/* Export output: a vector of segments and the data offset reached */
+struct exportState_s {
+    struct iovec *iov;
+    int niov;
+    unsigned int off;
+};
+
+static void exportAdd(struct exportState_s *es, const void *p, size_t len)
+{
+    struct iovec *last = es->niov ? &es->iov[es->niov - 1] : NULL;
+
+    if (len == 0)
+	return;
+    if (last && (const char *)last->iov_base + last->iov_len == p) {
+	last->iov_len += len;
+    } else {
+	es->iov[es->niov].iov_base = (void *) p;
+	es->iov[es->niov].iov_len = len;
+	es->niov++;
+    }
+    es->off += len;
+}
+
+/* Copy count integers of type from src to dst in network order */
+static size_t exportSwab(char *dst, const char *src, rpm_tagtype_t type,
+			rpm_count_t count)
 {
+    size_t size = typeSizes[type];
+
+    for (rpm_count_t i = 0; i < count; i++, src += size, dst += size) {
+	switch (type) {
+	case RPM_INT64_TYPE:
+	{   uint64_t v;
+	    memcpy(&v, src, sizeof(v));
+	    v = htonll(v);
+	    memcpy(dst, &v, sizeof(v));
+	}   break;
+	case RPM_INT32_TYPE:
+	{   uint32_t v;
+	    memcpy(&v, src, sizeof(v));
+	    v = htonl(v);
+	    memcpy(dst, &v, sizeof(v));
+	}   break;
+	case RPM_INT16_TYPE:
+	{   uint16_t v;
+	    memcpy(&v, src, sizeof(v));
+	    v = htons(v);
+	    memcpy(dst, &v, sizeof(v));
+	}   break;
+	}
+    }
+    return size * count;
+}
+
+static int isIntType(rpm_tagtype_t type)
+{
+    return (type == RPM_INT64_TYPE || type == RPM_INT32_TYPE ||
+	    type == RPM_INT16_TYPE);
+}
+
+struct regionInt_s {
+    unsigned int offset;
+    rpm_tagtype_t type;
+    rpm_count_t count;
+};
+
+static int regionIntCmp(const void *a, const void *b)
+{
+    const struct regionInt_s *ra = a, *rb = b;
+    return (ra->offset > rb->offset) - (ra->offset < rb->offset);
+}
+
+/*
+ * Region data of headers not imported lazily has its integers in host
+ * order. Everything else in there can be referenced in place, only the
+ * integers need converted copies.
+ */
+static int exportRegion(struct exportState_s *es, entryInfo pe, int ril,
+			const char *data, size_t datalen, char **scratch)
+{
+    struct regionInt_s *ints = xmalloc(ril * sizeof(*ints));
+    size_t pos = 0;
+    int nints = 0;
+    int rc = -1;
+
+    for (int i = 0; i < ril; i++) {
+	rpm_tagtype_t type = ntohl(pe[i].type);
+	if (!isIntType(type))
+	    continue;
+	ints[nints].offset = ntohl(pe[i].offset);
+	ints[nints].type = type;
+	ints[nints].count = ntohl(pe[i].count);
+	nints++;
+    }
+    qsort(ints, nints, sizeof(*ints), regionIntCmp);
+
+    for (int i = 0; i < nints; i++) {
+	size_t len = typeSizes[ints[i].type] * (size_t) ints[i].count;
+	if (ints[i].offset < pos || ints[i].offset + len > datalen)
+	    goto exit;
+	exportAdd(es, data + pos, ints[i].offset - pos);
+	exportSwab(*scratch, data + ints[i].offset, ints[i].type,
+		   ints[i].count);
+	exportAdd(es, *scratch, len);
+	*scratch += len;
+	pos = ints[i].offset + len;
+    }
+    exportAdd(es, data + pos, datalen - pos);
+    rc = 0;
+
+exit:
+    free(ints);
+    return rc;
+}
+
+/*
+ * Export the header as a vector of segments, of which the first one is
+ * the (il,dl) intro and the index. Data is referenced in place wherever
+ * it's in on-disk format already, integers outside lazily imported
+ * regions are converted into scratch space allocated along with the
+ * vector. The whole thing is a single allocation.
+ */
+static struct iovec * doExport(const struct indexEntry_s *hindex,
+			int indexUsed, headerFlags flags,
+			int *niov, unsigned int *bsize)
+{
+    struct exportState_s es = { NULL, 0, 0 };
+    static const char zeros[8] = { 0 };
+    struct iovec *iov = NULL;
     int32_t * ei = NULL;
     entryInfo pe;
     char * dataStart;
-    char * te;
+    char * scratch;
     unsigned len, diff;
     int32_t il = 0;
     int32_t dl = 0;
     indexEntry entry; 
     int i;
     int drlen, ndribbles;
+    int nseg = 1;
+    size_t scratchlen = 0;
     size_t ilen = indexUsed * sizeof(struct indexEntry_s);
     indexEntry index = memcpy(xmalloc(ilen), hindex, ilen);
 
@@ -617,9 +804,11 @@ static void * doExport(const struct indexEntry_s *hindex, int indexUsed,
 	    int32_t rdl = -entry->info.offset;	/* negative offset */
 	    int32_t ril = rdl/sizeof(*pe);
 	    int rid = entry->info.offset;
+	    indexEntry region = entry;
 
 	    il += ril;
 	    dl += entry->rdlen + entry->info.count;
+	    nseg += 2 * ril + 2;
 	    /* Reserve space for legacy region tag */
 	    if (i == 0 && (flags & HEADERFLAG_LEGACY))
 		il += 1;
@@ -643,6 +832,13 @@ static void * doExport(const struct indexEntry_s *hindex, int indexUsed,
 	    }
 	    i--;
 	    entry--;
+	    nseg += 2 * ndribbles;
+
+	    /* Legacy regions are converted in scratch space */
+	    if (region == index && (flags & HEADERFLAG_LEGACY))
+		scratchlen += region->rdlen + region->info.count;
+	    else if (!(flags & HEADERFLAG_LAZY))
+		scratchlen += region->rdlen + region->info.count + drlen;
 	    continue;
 	}
 
@@ -655,6 +851,9 @@ static void * doExport(const struct indexEntry_s *hindex, int indexUsed,
 
 	il++;
 	dl += entry->length;
+	nseg += 2;
+	if (isIntType(entry->info.type))
+	    scratchlen += entry->length;
     }
 
     /* Sanity checks on header intro. */
@@ -663,12 +862,19 @@ static void * doExport(const struct indexEntry_s *hindex, int indexUsed,
 
     len = sizeof(il) + sizeof(dl) + (il * sizeof(*pe)) + dl;
 
-    ei = xmalloc(len);
+    iov = xmalloc(nseg * sizeof(*iov) +
+		  sizeof(il) + sizeof(dl) + (il * sizeof(*pe)) + scratchlen);
+    ei = (int32_t *) (iov + nseg);
     ei[0] = htonl(il);
     ei[1] = htonl(dl);
 
     pe = (entryInfo) &ei[2];
-    dataStart = te = (char *) (pe + il);
+    dataStart = scratch = (char *) (pe + il);
+
+    iov[0].iov_base = ei;
+    iov[0].iov_len = dataStart - (char *) ei;
+    es.iov = iov;
+    es.niov = 1;
 
     for (i = 0, entry = index; i < indexUsed; i++, entry++) {
 	const char * src;
@@ -680,7 +886,6 @@ static void * doExport(const struct indexEntry_s *hindex, int indexUsed,
 	if (entry->data == NULL || entry->length <= 0)
 	    continue;
 
-	t = (unsigned char*)te;
 	pe->tag = htonl(entry->info.tag);
 	pe->type = htonl(entry->info.type);
 	pe->count = htonl(entry->info.count);
@@ -697,38 +902,47 @@ static void * doExport(const struct indexEntry_s *hindex, int indexUsed,
 	    if (i == 0 && (flags & HEADERFLAG_LEGACY)) {
 		int32_t stei[4];
 
+		t = (unsigned char *) scratch;
 		memcpy(pe+1, src, rdl);
-		memcpy(te, src + rdl, rdlen);
-		te += rdlen;
+		memcpy(scratch, src + rdl, rdlen);
+		scratch += rdlen;
 
-		pe->offset = htonl(te - dataStart);
+		pe->offset = htonl(es.off + rdlen);
 		stei[0] = pe->tag;
 		stei[1] = pe->type;
 		stei[2] = htonl(-rdl-entry->info.count);
 		stei[3] = pe->count;
-		memcpy(te, stei, entry->info.count);
-		te += entry->info.count;
+		memcpy(scratch, stei, entry->info.count);
+		scratch += entry->info.count;
 		ril++;
 		rdlen += entry->info.count;
 
-		count = regionSwab(NULL, ril, 0, pe, t, NULL, 0, 0);
+		count = regionSwab(NULL, ril, 0, pe, t, NULL, 0, 0,
+				   !(flags & HEADERFLAG_LAZY));
 		if (count != rdlen)
 		    goto errxit;
+		exportAdd(&es, t, rdlen);
 
 	    } else {
+		const char *data = src + (ril * sizeof(*pe));
+		size_t datalen = rdlen + entry->info.count + drlen;
 
 		memcpy(pe+1, src + sizeof(*pe), ((ril-1) * sizeof(*pe)));
-		memcpy(te, src + (ril * sizeof(*pe)), rdlen+entry->info.count+drlen);
-		te += rdlen;
 		{  
 		    entryInfo se = (entryInfo)src;
 		    int off = ntohl(se->offset);
-		    pe->offset = (off) ? htonl(te - dataStart) : htonl(off);
+		    pe->offset = (off) ? htonl(es.off + rdlen) : htonl(off);
 		}
-		te += entry->info.count + drlen;
 
-		count = regionSwab(NULL, ril, 0, pe, t, NULL, 0, 0);
-		if (count != (rdlen + entry->info.count + drlen))
+		/* Only checks the lengths, the data is used as is */
+		count = regionSwab(NULL, ril, 0, pe, (unsigned char *) data,
+				   NULL, 0, 0, 0);
+		if (count != datalen)
+		    goto errxit;
+
+		if (flags & HEADERFLAG_LAZY)
+		    exportAdd(&es, data, datalen);
+		else if (exportRegion(&es, pe, ril, data, datalen, &scratch))
 		    goto errxit;
 	    }
 
@@ -748,50 +962,20 @@ static void * doExport(const struct indexEntry_s *hindex, int indexUsed,
 	    continue;
 
 	/* Alignment */
-	diff = alignDiff(entry->info.type, (te - dataStart));
-	if (diff) {
-	    memset(te, 0, diff);
-	    te += diff;
-	}
-
-	pe->offset = htonl(te - dataStart);
-
-	/* copy data w/ endian conversions */
-	switch (entry->info.type) {
-	case RPM_INT64_TYPE:
-	    count = entry->info.count;
-	    src = entry->data;
-	    while (count--) {
-		*((uint64_t *)te) = htonll(*((uint64_t *)src));
-		te += sizeof(uint64_t);
-		src += sizeof(uint64_t);
-	    }
-	    break;
-
-	case RPM_INT32_TYPE:
-	    count = entry->info.count;
-	    src = entry->data;
-	    while (count--) {
-		*((uint32_t *)te) = htonl(*((uint32_t *)src));
-		te += sizeof(uint32_t);
-		src += sizeof(uint32_t);
-	    }
-	    break;
-
-	case RPM_INT16_TYPE:
-	    count = entry->info.count;
-	    src = entry->data;
-	    while (count--) {
-		*((uint16_t *)te) = htons(*((uint16_t *)src));
-		te += sizeof(uint16_t);
-		src += sizeof(uint16_t);
-	    }
-	    break;
-
-	default:
-	    memcpy(te, entry->data, entry->length);
-	    te += entry->length;
-	    break;
+	diff = alignDiff(entry->info.type, es.off);
+	if (diff)
+	    exportAdd(&es, zeros, diff);
+
+	pe->offset = htonl(es.off);
+
+	/* integers need endian conversions, the rest is used as is */
+	if (isIntType(entry->info.type)) {
+	    exportSwab(scratch, entry->data, entry->info.type,
+		       entry->info.count);
+	    exportAdd(&es, scratch, entry->length);
+	    scratch += entry->length;
+	} else {
+	    exportAdd(&es, entry->data, entry->length);
 	}
 	pe++;
     }
@@ -799,27 +983,50 @@ static void * doExport(const struct indexEntry_s *hindex, int indexUsed,
     /* Insure that there are no memcpy underruns/overruns. */
     if (((char *)pe) != dataStart)
 	goto errxit;
-    if ((((char *)ei)+len) != te)
+    if (es.off != dl)
 	goto errxit;
 
+    if (niov)
+	*niov = es.niov;
     if (bsize)
 	*bsize = len;
 
     free(index);
-    return (void *) ei;
+    return iov;
 
 errxit:
-    free(ei);
+    free(iov);
     free(index);
     return NULL;
 }
 
-void * headerExport(Header h, unsigned int *bsize)
+struct iovec * headerExportIov(Header h, int *niov, unsigned int *bsize)
 {
-    void *blob = NULL;
+    struct iovec *iov = NULL;
 
     if (h) {
-	blob = doExport(h->index, h->indexUsed, h->flags, bsize);
+	iov = doExport(h->index, h->indexUsed, h->flags, niov, bsize);
+    }
+
+    return iov;
+}
+
+void * headerExport(Header h, unsigned int *bsize)
+{
+    unsigned int len = 0;
+    int niov = 0;
+    struct iovec *iov = headerExportIov(h, &niov, &len);
+    char *blob = NULL;
+
+    if (iov) {
+	char *p = blob = xmalloc(len);
+	for (int i = 0; i < niov; i++) {
+	    memcpy(p, iov[i].iov_base, iov[i].iov_len);
+	    p += iov[i].iov_len;
+	}
+	free(iov);
+	if (bsize)
+	    *bsize = len;
     }
 
     return blob;
@@ -837,10 +1044,28 @@ indexEntry findEntry(Header h, rpmTagVal tag, rpm_tagtype_t type)
 {
     indexEntry entry;
     struct indexEntry_s key;
+    uint16_t *map;
+    int slot;
 
     if (h == NULL) return NULL;
     headerSort(h);
 
+    if ((slot = tagmapSlot(tag)) >= 0 && (map = tagmapGet(h)) != NULL) {
+	indexEntry last = h->index + h->indexUsed;
+
+	if (map[slot] == 0)
+	    return NULL;
+	entry = h->index + map[slot] - 1;
+	if (type == RPM_NULL_TYPE)
+	    return entry;
+
+	for (; entry < last && entry->info.tag == tag; entry++) {
+	    if (entry->info.type == type)
+		return entry;
+	}
+	return NULL;
+    }
+
     key.info.tag = tag;
 
     entry = bsearch(&key, h->index, h->indexUsed, sizeof(*h->index), indexCmp);
@@ -860,6 +1085,16 @@ indexEntry findEntry(Header h, rpmTagVal tag, rpm_tagtype_t type)
     return NULL;
 }
 
+/* Callers may still hold the lazy copy of an entry that is going away */
+static void entryRetireHostData(Header h, indexEntry entry)
+{
+    if (entry->hdata) {
+	h->stale = xrealloc(h->stale, (h->nstale + 1) * sizeof(*h->stale));
+	h->stale[h->nstale++] = entry->hdata;
+	entry->hdata = NULL;
+    }
+}
+
 int headerDel(Header h, rpmTagVal tag)
 {
     indexEntry last = h->index + h->indexUsed;
@@ -881,6 +1116,7 @@ int headerDel(Header h, rpmTagVal tag)
 	data = first->data;
 	first->data = NULL;
 	first->length = 0;
+	entryRetireHostData(h, first);
 	if (ENTRY_IN_REGION(first))
 	    continue;
 	free(data);
@@ -892,18 +1128,23 @@ int headerDel(Header h, rpmTagVal tag)
 	ne = last - first;
 	if (ne > 0)
 	    memmove(entry, first, (ne * sizeof(*entry)));
+	h->tagmap = _free(h->tagmap);
     }
 
     return 0;
 }
 
-rpmRC hdrblobImport(hdrblob blob, int fast, Header *hdrp, char **emsg)
+rpmRC hdrblobImport(hdrblob blob, headerImportFlags flags, Header *hdrp, char **emsg)
 {
     Header h = NULL;
     indexEntry entry; 
     int rdlen;
+    int fast = (flags & HEADERIMPORT_FAST);
+    int swab = !(flags & HEADERIMPORT_LAZY);
 
     h = headerCreate(blob->ei, blob->il);
+    if (!swab)
+	h->flags |= HEADERFLAG_LAZY;
 
     entry = h->index;
     if (!(htonl(blob->pe->tag) < RPMTAG_HEADERI18NTABLE)) {
@@ -918,7 +1159,7 @@ rpmRC hdrblobImport(hdrblob blob, int fast, Header *hdrp, char **emsg)
 	entry->length = blob->pvlen - sizeof(blob->il) - sizeof(blob->dl);
 	rdlen = regionSwab(entry+1, blob->il, 0, blob->pe,
 			   blob->dataStart, blob->dataEnd,
-			   entry->info.offset, fast);
+			   entry->info.offset, fast, swab);
 	if (rdlen != blob->dl)
 	    goto errxit;
 	entry->rdlen = rdlen;
@@ -936,7 +1177,7 @@ rpmRC hdrblobImport(hdrblob blob, int fast, Header *hdrp, char **emsg)
 	entry->length = blob->pvlen - sizeof(blob->il) - sizeof(blob->dl);
 	rdlen = regionSwab(entry+1, ril-1, 0, blob->pe+1,
 			   blob->dataStart, blob->dataEnd,
-			   entry->info.offset, fast);
+			   entry->info.offset, fast, swab);
 	if (rdlen < 0)
 	    goto errxit;
 	entry->rdlen = rdlen;
@@ -948,7 +1189,7 @@ rpmRC hdrblobImport(hdrblob blob, int fast, Header *hdrp, char **emsg)
 
 	    /* Load dribble entries from region. */
 	    rdlen = regionSwab(newEntry, ne, rdlen, blob->pe+ril,
-				blob->dataStart, blob->dataEnd, rid, fast);
+				blob->dataStart, blob->dataEnd, rid, fast, swab);
 	    if (rdlen < 0)
 		goto errxit;
 
@@ -1072,22 +1313,114 @@ int headerIsSourceHeuristic(Header h)
     return entry && entry->info.count == 1 && entry->data && !*(const char *)entry->data;
 }
 
+/**
+ * Return entry data in host byte order. Integer data of lazily imported
+ * regions is converted on first use, the copy lives as long as the entry.
+ * Concurrent readers may race to convert, only one copy is kept.
+ * @param h		header (or NULL)
+ * @param entry		header entry
+ * @return		entry data
+ */
+static rpm_data_t entryHostData(Header h, indexEntry entry)
+{
+    rpm_data_t hdata, prev = NULL;
+    rpm_count_t count = entry->info.count;
+
+    if (h == NULL || !(h->flags & HEADERFLAG_LAZY) || !ENTRY_IN_REGION(entry))
+	return entry->data;
+
+    /* String entries keep their pointer table in hdata */
+    if (!isIntType(entry->info.type))
+	return entry->data;
+
+    if ((hdata = __atomic_load_n(&entry->hdata, __ATOMIC_ACQUIRE)) != NULL)
+	return hdata;
+
+    switch (entry->info.type) {
+    case RPM_INT64_TYPE:
+    {   uint64_t * it = memcpy(xmalloc(entry->length), entry->data, entry->length);
+	hdata = it;
+	for (; count > 0; count--, it++)
+	    *it = htonll(*it);
+    }   break;
+    case RPM_INT32_TYPE:
+    {   uint32_t * it = memcpy(xmalloc(entry->length), entry->data, entry->length);
+	hdata = it;
+	for (; count > 0; count--, it++)
+	    *it = htonl(*it);
+    }   break;
+    case RPM_INT16_TYPE:
+    {   uint16_t * it = memcpy(xmalloc(entry->length), entry->data, entry->length);
+	hdata = it;
+	for (; count > 0; count--, it++)
+	    *it = htons(*it);
+    }   break;
+    default:
+	return entry->data;
+    }
+
+    if (!__atomic_compare_exchange_n(&entry->hdata, &prev, hdata, 0,
+				     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+	free(hdata);
+	hdata = prev;
+    }
+    return hdata;
+}
+
+/**
+ * Return a table of pointers to the strings of a region string entry,
+ * NULL terminated so it works as an argv too. Region data never moves,
+ * so the table is built on first use and shared by all callers for the
+ * lifetime of the entry, like the lazy host data.
+ * @param h		header (or NULL)
+ * @param entry		header entry
+ * @return		string table, NULL if not a region entry
+ */
+static const char ** entryStrings(Header h, indexEntry entry)
+{
+    const char **strs, **prev = NULL;
+    const char *t = entry->data;
+
+    if (h == NULL || !ENTRY_IN_REGION(entry))
+	return NULL;
+
+    if ((strs = __atomic_load_n(&entry->hdata, __ATOMIC_ACQUIRE)) != NULL)
+	return strs;
+
+    strs = xmalloc((entry->info.count + 1) * sizeof(*strs));
+    for (rpm_count_t i = 0; i < entry->info.count; i++) {
+	strs[i] = t;
+	t = strchr(t, 0) + 1;
+    }
+    strs[entry->info.count] = NULL;
+
+    if (!__atomic_compare_exchange_n(&entry->hdata, (void **) &prev, strs, 0,
+				     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+	free(strs);
+	strs = prev;
+    }
+    return strs;
+}
+
 /** \ingroup header
  * Retrieve data from header entry.
  * Relevant flags (others are ignored), if neither is set allocation
  * behavior depends on data type(!) 
- *     HEADERGET_MINMEM: return pointers to header memory
+ *     HEADERGET_MINMEM: return pointers to header memory, string
+ *	tables of region entries included
  *     HEADERGET_ALLOC: always return malloced memory, overrides MINMEM
  * 
  * @todo Permit retrieval of regions other than HEADER_IMUTABLE.
+ * @param h		header (or NULL)
  * @param entry		header entry
  * @param td		tag data container
  * @param flags		flags to control memory allocation
  * @return		1 on success, otherwise error.
  */
-static int copyTdEntry(const indexEntry entry, rpmtd td, headerGetFlags flags)
+static int copyTdEntry(Header h, const indexEntry entry, rpmtd td, headerGetFlags flags)
 {
     rpm_count_t count = entry->info.count;
+    rpm_data_t data = entry->data;
     int rc = 1;		/* XXX 1 on success. */
     /* ALLOC overrides MINMEM */
     int allocMem = flags & HEADERGET_ALLOC;
@@ -1130,7 +1463,8 @@ static int copyTdEntry(const indexEntry entry, rpmtd td, headerGetFlags flags)
 
 	    dataStart = (unsigned char *) memcpy(pe + ril, dataStart, rdl);
 
-	    rc = regionSwab(NULL, ril, 0, pe, dataStart, dataStart + rdl, 0, 0);
+	    rc = regionSwab(NULL, ril, 0, pe, dataStart, dataStart + rdl, 0, 0,
+			    !(h && (h->flags & HEADERFLAG_LAZY)));
 	    /* don't return data on failure */
 	    if (rc < 0) {
 		td->data = _free(td->data);
@@ -1156,6 +1490,14 @@ static int copyTdEntry(const indexEntry entry, rpmtd td, headerGetFlags flags)
 	char * t;
 	int i;
 
+	/* Borrowed from the header, nothing to free */
+	if (minMem && (ptrEntry = entryStrings(h, entry)) != NULL) {
+	    data = td->data = ptrEntry;
+	    if (argvArray)
+		td->flags |= RPMTD_ARGV;
+	    break;
+	}
+
 	if (minMem) {
 	    td->data = xmalloc(tableSize);
 	    ptrEntry = (const char **) td->data;
@@ -1182,11 +1524,12 @@ static int copyTdEntry(const indexEntry entry, rpmtd td, headerGetFlags flags)
     case RPM_INT16_TYPE:
     case RPM_INT32_TYPE:
     case RPM_INT64_TYPE:
+	data = entryHostData(h, entry);
 	if (allocMem) {
 	    td->data = xmalloc(entry->length);
-	    memcpy(td->data, entry->data, entry->length);
+	    memcpy(td->data, data, entry->length);
 	} else {
-	    td->data = entry->data;
+	    td->data = data;
 	}
 	break;
     default:
@@ -1199,7 +1542,7 @@ static int copyTdEntry(const indexEntry entry, rpmtd td, headerGetFlags flags)
     td->count = count;
     td->size = entry->length;
 
-    if (td->data && entry->data != td->data) {
+    if (td->data && data != td->data) {
 	td->flags |= RPMTD_ALLOCED;
     }
 
@@ -1345,7 +1688,7 @@ static int intGetTdEntry(Header h, rpmtd td, headerGetFlags flags)
     if (entry->info.type == RPM_I18NSTRING_TYPE && !(flags & HEADERGET_RAW))
 	rc = copyI18NEntry(h, entry, td, flags);
     else
-	rc = copyTdEntry(entry, td, flags);
+	rc = copyTdEntry(h, entry, td, flags);
 
     if (rc == 0)
 	td->flags |= RPMTD_INVALID;
@@ -1461,10 +1804,12 @@ static int intAddEntry(Header h, rpmtd td)
     entry->info.offset = 0;
     entry->data = data;
     entry->length = length;
+    entry->hdata = NULL;
 
     if (h->indexUsed > 0 && td->tag < h->index[h->indexUsed-1].info.tag)
 	h->sorted = 0;
     h->indexUsed++;
+    h->tagmap = _free(h->tagmap);
 
     return 1;
 }
@@ -1490,9 +1835,10 @@ static int intAppendEntry(Header h, rpmtd td)
 
     if (ENTRY_IN_REGION(entry)) {
 	char * t = xmalloc(entry->length + length);
-	memcpy(t, entry->data, entry->length);
+	memcpy(t, entryHostData(h, entry), entry->length);
 	entry->data = t;
 	entry->info.offset = 0;
+	entryRetireHostData(h, entry);
     } else
 	entry->data = xrealloc(entry->data, entry->length + length);
 
@@ -1651,6 +1997,7 @@ int headerAddI18NString(Header h, rpmTagVal tag, const char * string,
 	
 	if (ENTRY_IN_REGION(entry)) {
 	    entry->info.offset = 0;
+	    entryRetireHostData(h, entry);
 	} else
 	    entry->data = _free(entry->data);
 	entry->data = buf;
@@ -1690,6 +2037,7 @@ int headerMod(Header h, rpmtd td)
 
     if (ENTRY_IN_REGION(entry)) {
 	entry->info.offset = 0;
+	entryRetireHostData(h, entry);
     } else
 	free(oldData);
 
@@ -1757,7 +2105,7 @@ int headerNext(HeaderIterator hi, rpmtd td)
     rpmtdReset(td);
     if (entry) {
 	td->tag = entry->info.tag;
-	rc = copyTdEntry(entry, td, HEADERGET_DEFAULT);
+	rc = copyTdEntry(hi->h, entry, td, HEADERGET_DEFAULT);
     }
     return ((rc == 1) ? 1 : 0);
 }
@@ -2057,8 +2405,9 @@ rpmRC hdrblobGet(hdrblob blob, uint32_t tag, rpmtd td)
 	entry.length = dataLength(einfo.type, blob->dataStart + einfo.offset,
 			 einfo.count, 1, blob->dataEnd);
 	entry.rdlen = 0;
+	entry.hdata = NULL;
 	td->tag = einfo.tag;
-	rc = copyTdEntry(&entry, td, HEADERGET_MINMEM) ? RPMRC_OK : RPMRC_FAIL;
+	rc = copyTdEntry(NULL, &entry, td, HEADERGET_MINMEM) ? RPMRC_OK : RPMRC_FAIL;
 	break;
     }
     return rc;
@@ -2081,12 +2430,94 @@ Header headerImport(void * blob, unsigned int bsize, headerImportFlags flags)
 
     /* Sanity checks on header intro. */
     if (hdrblobInit(b, bsize, 0, 0, &hblob, &buf) == RPMRC_OK)
-	hdrblobImport(&hblob, (flags & HEADERIMPORT_FAST), &h, &buf);
+	hdrblobImport(&hblob, (flags & (HEADERIMPORT_FAST|HEADERIMPORT_LAZY)),
+		      &h, &buf);
 
 exit:
     if (h == NULL && b != blob)
 	free(b);
     free(buf);
+    RPM_PROBE3(header_import, bsize, flags, h);
 
     return h;
 }
+
+static int tagWanted(const rpmTagVal * tags, rpmTagVal tag)
+{
+    /* Lookups of i18n strings need the table too, regions are not copied */
+    if (tag <= RPMTAG_HEADERI18NTABLE)
+	return (tag == RPMTAG_HEADERI18NTABLE);
+    for (; *tags; tags++) {
+	if (*tags == tag)
+	    return 1;
+    }
+    return 0;
+}
+
+Header headerImportTags(void * blob, unsigned int bsize, const rpmTagVal * tags)
+{
+    Header h = NULL;
+    struct hdrblob_s hblob;
+    char *buf = NULL;
+
+    if (hdrblobInit(blob, bsize, 0, 0, &hblob, &buf) != RPMRC_OK)
+	goto exit;
+
+    h = headerCreate(NULL, 0);
+    for (int i = 0; i < hblob.il; i++) {
+	struct indexEntry_s ie;
+	const unsigned char * src;
+
+	ei2h(&hblob.pe[i], &ie.info);
+	if (!tagWanted(tags, ie.info.tag))
+	    continue;
+
+	src = hblob.dataStart + ie.info.offset;
+	ie.length = dataLength(ie.info.type, src, ie.info.count, 1,
+			       hblob.dataEnd);
+	if (ie.length < 0) {
+	    h = headerFree(h);
+	    goto exit;
+	}
+
+	ie.data = memcpy(xmalloc(ie.length), src, ie.length);
+	ie.info.offset = 0;
+	ie.rdlen = 0;
+	ie.hdata = NULL;
+
+	switch (ie.info.type) {
+	case RPM_INT64_TYPE:
+	{   uint64_t * it = ie.data;
+	    for (rpm_count_t c = ie.info.count; c > 0; c--, it++)
+		*it = htonll(*it);
+	}   break;
+	case RPM_INT32_TYPE:
+	{   uint32_t * it = ie.data;
+	    for (rpm_count_t c = ie.info.count; c > 0; c--, it++)
+		*it = htonl(*it);
+	}   break;
+	case RPM_INT16_TYPE:
+	{   uint16_t * it = ie.data;
+	    for (rpm_count_t c = ie.info.count; c > 0; c--, it++)
+		*it = htons(*it);
+	}   break;
+	}
+
+	/* Dribble entries replace duplicate region entries. */
+	(void) headerDel(h, ie.info.tag);
+	if (ie.info.tag == RPMTAG_BASENAMES)
+	    (void) headerDel(h, RPMTAG_OLDFILENAMES);
+
+	if (h->indexUsed == h->indexAlloced) {
+	    h->indexAlloced += INDEX_MALLOC_SIZE;
+	    h->index = xrealloc(h->index, h->indexAlloced * sizeof(*h->index));
+	}
+	h->index[h->indexUsed++] = ie; /* struct assignment */
+	h->sorted = 0;
+    }
+    headerSort(h);
+
+exit:
+    free(buf);
+    return h;
+}
@@ -84,9 +84,21 @@ typedef struct headerSprintfArgs_s {
     size_t alloced;
     int numTokens;
     int i;
+    int isxml;
+    int iterate;
     headerGetFlags hgflags;
+    headerFormatSink sink;	/* streaming output, if any */
+    void * sinkdata;
+    int sinkfailed;
 } * headerSprintfArgs;
 
+/* Streamed output is passed on in pieces of about this size */
+#define HSA_CHUNK	(64 * 1024)
+
+struct headerCompiledFormat_s {
+    struct headerSprintfArgs_s hsa;
+};
+
 
 static char escapedChar(const char ch)	
 {
@@ -147,15 +159,8 @@ freeFormat( sprintfToken format, int num)
  */
 static void hsaInit(headerSprintfArgs hsa)
 {
-    sprintfTag tag =
-	(hsa->format->type == PTOK_TAG
-	    ? &hsa->format->u.tag :
-	(hsa->format->type == PTOK_ARRAY
-	    ? &hsa->format->u.array.format->u.tag :
-	NULL));
-
     hsa->i = 0;
-    if (tag != NULL && tag->tag == -2)
+    if (hsa->iterate)
 	hsa->hi = headerInitIterator(hsa->h);
     /* Normally with bells and whistles enabled, but raw dump on iteration. */
     hsa->hgflags = (hsa->hi == NULL) ? HEADERGET_EXT : HEADERGET_RAW;
@@ -208,6 +213,14 @@ static void hsaFini(headerSprintfArgs hsa)
  */
 static char * hsaReserve(headerSprintfArgs hsa, size_t need)
 {
+    /* When streaming, hand the output so far to the sink instead of growing */
+    if (hsa->sink && hsa->vallen > 0 && (hsa->vallen + need) > HSA_CHUNK) {
+	if (!hsa->sinkfailed &&
+		hsa->sink(hsa->sinkdata, hsa->val, hsa->vallen))
+	    hsa->sinkfailed = 1;
+	hsa->vallen = 0;
+	hsa->val[0] = '\0';
+    }
     if ((hsa->vallen + need) >= hsa->alloced) {
 	if (hsa->alloced <= need)
 	    hsa->alloced += need;
@@ -818,69 +831,221 @@ static unsigned int tagId(rpmTagVal tag)
     return tag;
 }
 
-char * headerFormat(Header h, const char * fmt, errmsg_t * errmsg) 
+/* Parse a format once, the token tree is reused for every header */
+static int hsaCompile(headerSprintfArgs hsa, const char * fmt)
 {
-    struct headerSprintfArgs_s hsa;
-    sprintfToken nextfmt;
     sprintfTag tag;
-    char * t, * te;
-    int isxml;
-    size_t need;
- 
-    memset(&hsa, 0, sizeof(hsa));
-    hsa.h = headerLink(h);
-    hsa.fmt = xstrdup(fmt);
-    hsa.errmsg = NULL;
 
-    if (parseFormat(&hsa, hsa.fmt, &hsa.format, &hsa.numTokens, NULL, PARSER_BEGIN))
-	goto exit;
+    memset(hsa, 0, sizeof(*hsa));
+    hsa->fmt = xstrdup(fmt);
+
+    if (parseFormat(hsa, hsa->fmt, &hsa->format, &hsa->numTokens, NULL, PARSER_BEGIN))
+	return -1;
 
-    hsa.cache = tagCacheCreate(128, tagId, tagCmp, NULL, rpmtdFree);
-    hsa.val = xstrdup("");
+    hsa->cache = tagCacheCreate(128, tagId, tagCmp, NULL, rpmtdFree);
 
     tag =
-	(hsa.format->type == PTOK_TAG
-	    ? &hsa.format->u.tag :
-	(hsa.format->type == PTOK_ARRAY
-	    ? &hsa.format->u.array.format->u.tag :
+	(hsa->format->type == PTOK_TAG
+	    ? &hsa->format->u.tag :
+	(hsa->format->type == PTOK_ARRAY
+	    ? &hsa->format->u.array.format->u.tag :
 	NULL));
-    isxml = (tag != NULL && tag->tag == -2 && tag->type != NULL && rstreq(tag->type, "xml"));
+    /* Tag iteration overwrites the token tag, remember it here */
+    hsa->iterate = (tag != NULL && tag->tag == -2);
+    hsa->isxml = (hsa->iterate && tag->type != NULL && rstreq(tag->type, "xml"));
+
+    return 0;
+}
+
+static char * hsaFormat(headerSprintfArgs hsa, Header h)
+{
+    sprintfToken nextfmt;
+    char * t, * te;
+    size_t need;
 
-    if (isxml) {
+    hsa->h = headerLink(h);
+    hsa->errmsg = NULL;
+    rpmHeaderTagCacheOpen(hsa->h);
+    hsa->val = xstrdup("");
+    hsa->vallen = 0;
+    hsa->alloced = 0;
+
+    if (hsa->isxml) {
 	need = sizeof("<rpmHeader>\n") - 1;
-	t = hsaReserve(&hsa, need);
+	t = hsaReserve(hsa, need);
 	te = stpcpy(t, "<rpmHeader>\n");
-	hsa.vallen += (te - t);
+	hsa->vallen += (te - t);
     }
 
-    hsaInit(&hsa);
-    while ((nextfmt = hsaNext(&hsa)) != NULL) {
-	te = singleSprintf(&hsa, nextfmt, 0);
+    hsaInit(hsa);
+    while ((nextfmt = hsaNext(hsa)) != NULL) {
+	te = singleSprintf(hsa, nextfmt, 0);
 	if (te == NULL) {
-	    hsa.val = _free(hsa.val);
+	    hsa->val = _free(hsa->val);
 	    break;
 	}
     }
-    hsaFini(&hsa);
+    hsaFini(hsa);
 
-    if (isxml) {
+    if (hsa->isxml) {
 	need = sizeof("</rpmHeader>\n") - 1;
-	t = hsaReserve(&hsa, need);
+	t = hsaReserve(hsa, need);
 	te = stpcpy(t, "</rpmHeader>\n");
-	hsa.vallen += (te - t);
+	hsa->vallen += (te - t);
     }
 
-    if (hsa.val != NULL && hsa.vallen < hsa.alloced)
-	hsa.val = xrealloc(hsa.val, hsa.vallen+1);	
+    if (hsa->val != NULL && hsa->vallen < hsa->alloced)
+	hsa->val = xrealloc(hsa->val, hsa->vallen+1);	
+
+    /* Keep the cache allocation around, but not the header data */
+    tagCacheEmpty(hsa->cache);
+    rpmHeaderTagCacheClose();
+    hsa->h = headerFree(hsa->h);
+
+    t = hsa->val;
+    hsa->val = NULL;
+    return t;
+}
+
+static void hsaFree(headerSprintfArgs hsa)
+{
+    hsa->cache = tagCacheFree(hsa->cache);
+    hsa->format = freeFormat(hsa->format, hsa->numTokens);
+    hsa->fmt = _free(hsa->fmt);
+}
+
+char * headerFormat(Header h, const char * fmt, errmsg_t * errmsg) 
+{
+    struct headerSprintfArgs_s hsa;
+    char * val = NULL;
 
-    hsa.cache = tagCacheFree(hsa.cache);
-    hsa.format = freeFormat(hsa.format, hsa.numTokens);
+    if (hsaCompile(&hsa, fmt) == 0)
+	val = hsaFormat(&hsa, h);
 
-exit:
     if (errmsg)
 	*errmsg = hsa.errmsg;
-    hsa.h = headerFree(hsa.h);
-    hsa.fmt = _free(hsa.fmt);
-    return hsa.val;
+    hsaFree(&hsa);
+    return val;
+}
+
+headerCompiledFormat headerFormatCompile(const char * fmt, errmsg_t * errmsg)
+{
+    headerCompiledFormat cfmt = xcalloc(1, sizeof(*cfmt));
+
+    if (hsaCompile(&cfmt->hsa, fmt)) {
+	if (errmsg)
+	    *errmsg = cfmt->hsa.errmsg;
+	cfmt = headerFormatFree(cfmt);
+    }
+    return cfmt;
+}
+
+char * headerFormatApply(headerCompiledFormat cfmt, Header h, errmsg_t * errmsg)
+{
+    char * val = NULL;
+
+    if (cfmt) {
+	val = hsaFormat(&cfmt->hsa, h);
+	if (errmsg)
+	    *errmsg = cfmt->hsa.errmsg;
+    }
+    return val;
+}
+
+int headerFormatWrite(headerCompiledFormat cfmt, Header h,
+		      headerFormatSink sink, void * data, errmsg_t * errmsg)
+{
+    headerSprintfArgs hsa;
+    char * val;
+    int rc = -1;
+
+    if (cfmt == NULL || sink == NULL)
+	return rc;
+
+    hsa = &cfmt->hsa;
+    hsa->sink = sink;
+    hsa->sinkdata = data;
+    hsa->sinkfailed = 0;
+
+    /* Whatever is left after the last full chunk */
+    if ((val = hsaFormat(hsa, h)) != NULL) {
+	if (!hsa->sinkfailed && hsa->vallen > 0 &&
+		sink(data, val, hsa->vallen))
+	    hsa->sinkfailed = 1;
+	if (hsa->sinkfailed)
+	    hsaError(hsa, _("error writing formatted output"));
+	else
+	    rc = 0;
+	free(val);
+    }
+    if (errmsg)
+	*errmsg = hsa->errmsg;
+
+    hsa->sink = NULL;
+    hsa->sinkdata = NULL;
+    return rc;
+}
+
+/* Collect the tags used by a format, -1 if extensions are involved */
+static int formatTags(sprintfToken format, int num, rpmTagVal **tags, int *ntags)
+{
+    int rc = 0;
+    for (int i = 0; rc == 0 && i < num; i++) {
+	sprintfTag stag = NULL;
+	switch (format[i].type) {
+	case PTOK_ARRAY:
+	    rc = formatTags(format[i].u.array.format,
+			    format[i].u.array.numTokens, tags, ntags);
+	    break;
+	case PTOK_COND:
+	    stag = &format[i].u.cond.tag;
+	    rc = formatTags(format[i].u.cond.ifFormat,
+			    format[i].u.cond.numIfTokens, tags, ntags);
+	    if (rc == 0)
+		rc = formatTags(format[i].u.cond.elseFormat,
+			    format[i].u.cond.numElseTokens, tags, ntags);
+	    break;
+	case PTOK_TAG:
+	    stag = &format[i].u.tag;
+	    break;
+	case PTOK_NONE:
+	case PTOK_STRING:
+	default:
+	    break;
+	}
+	if (rc || stag == NULL)
+	    continue;
+	if (stag->tag <= RPMTAG_HEADERI18NTABLE ||
+		rpmHeaderTagFunc(stag->tag) != NULL) {
+	    rc = -1;
+	    continue;
+	}
+	*tags = xrealloc(*tags, (*ntags + 2) * sizeof(**tags));
+	(*tags)[(*ntags)++] = stag->tag;
+	(*tags)[*ntags] = 0;
+    }
+    return rc;
 }
 
+rpmTagVal * headerFormatTags(headerCompiledFormat cfmt)
+{
+    rpmTagVal * tags = NULL;
+    int ntags = 0;
+
+    if (cfmt == NULL || cfmt->hsa.iterate)
+	return NULL;
+    if (formatTags(cfmt->hsa.format, cfmt->hsa.numTokens, &tags, &ntags) ||
+	    tags == NULL) {
+	tags = _free(tags);
+    }
+    return tags;
+}
+
+headerCompiledFormat headerFormatFree(headerCompiledFormat cfmt)
+{
+    if (cfmt) {
+	hsaFree(&cfmt->hsa);
+	free(cfmt);
+    }
+    return NULL;
+}
@@ -32,6 +32,18 @@ typedef int (*headerTagTagFunction) (Header h, rpmtd td, headerGetFlags hgflags)
 RPM_GNUC_INTERNAL
 headerTagTagFunction rpmHeaderTagFunc(rpmTagVal tag);
 
+/*
+ * Memoize tag extension results of a header on this thread, until the
+ * matching close. Extension data retrieved from the header meanwhile
+ * is borrowed from the cache and must not be used after the close.
+ * Calls nest, only the outermost header is cached.
+ */
+RPM_GNUC_INTERNAL
+void rpmHeaderTagCacheOpen(Header h);
+
+RPM_GNUC_INTERNAL
+void rpmHeaderTagCacheClose(void);
+
 RPM_GNUC_INTERNAL
 headerFmt rpmHeaderFormatByName(const char *fmt);
 
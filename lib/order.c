@@ -8,12 +8,24 @@
 #include <rpm/rpmmacro.h>
 #include <rpm/rpmlog.h>
 #include <rpm/rpmds.h>
+#include <rpm/rpmfi.h>
 
 #include "lib/rpmte_internal.h"	/* XXX tsortInfo_s */
 #include "lib/rpmts_internal.h"
+#include "lib/rpmds_internal.h"
+#include "lib/rpmfi_internal.h"
+#include "lib/rpmworkers.h"
+#include "lib/rpmarena.h"
 
 #include "debug.h"
 
+#define HASHTYPE orderNames
+#define HTKEYTYPE rpmsid
+#include "lib/rpmhash.H"
+#include "lib/rpmhashoa.C"
+#undef HASHTYPE
+#undef HTKEYTYPE
+
 /*
  * Strongly Connected Components
  * set of packages (indirectly) requiering each other
@@ -48,38 +60,53 @@ struct tsortInfo_s {
     int      tsi_SccLowlink; // used for SCC detection
 };
 
-static void rpmTSIFree(tsortInfo tsi)
-{
-    relation rel;
+/* A relation found for an element, recorded once all are found */
+struct orderRel_s {
+    rpmte q;			/* providing element */
+    rpmsenseFlags dsflags;	/* dependency flags */
+    int reversed;		/* reverse dependency? */
+    int weak;			/* weak dependency? */
+};
 
-    while (tsi->tsi_relations != NULL) {
-	rel = tsi->tsi_relations;
-	tsi->tsi_relations = tsi->tsi_relations->rel_next;
-	free(rel);
-    }
-    while (tsi->tsi_forward_relations != NULL) {
-	rel = tsi->tsi_forward_relations;
-	tsi->tsi_forward_relations = \
-	    tsi->tsi_forward_relations->rel_next;
-	free(rel);
-    }
-}
+/* Relations of one transaction element */
+struct orderRels_s {
+    rpmte p;
+    rpmal al;			/* packages to look up dependencies in */
+    struct orderRel_s *rels;
+    int nrels;
+    int nalloced;
+    int cached;			/* rels from the last ordering? */
+};
 
-static inline int addSingleRelation(rpmte p,
-				    rpmte q,
-				    rpmds dep)
+/* Names provided by the elements added since the last ordering */
+struct newNames_s {
+    rpmstrPool pool;
+    orderNames names;
+    int hit;
+};
+
+static const rpmTagVal ordertags[] = {
+    RPMTAG_REQUIRENAME,
+    RPMTAG_RECOMMENDNAME,
+    RPMTAG_SUGGESTNAME,
+    RPMTAG_SUPPLEMENTNAME,
+    RPMTAG_ENHANCENAME,
+    RPMTAG_ORDERNAME,
+    0,
+};
+
+/* Relations all live in the ordering arena and are freed along with it */
+static inline int addSingleRelation(rpmarena arena, rpmte p,
+				    const struct orderRel_s *orel)
 {
     struct tsortInfo_s *tsi_p, *tsi_q;
     relation rel;
+    rpmte q = orel->q;
     rpmElementType teType = rpmteType(p);
-    rpmsenseFlags dsflags = rpmdsFlags(dep);
-    int reversed = rpmdsIsReverse(dep);
+    rpmsenseFlags dsflags = orel->dsflags;
+    int reversed = orel->reversed;
     rpmsenseFlags flags;
 
-    /* Avoid deps outside this transaction and self dependencies */
-    if (q == NULL || q == p)
-	return 0;
-
     /* Erasures are reversed installs. */
     if (teType == TR_REMOVED) {
 	reversed = ! reversed;
@@ -95,7 +122,7 @@ static inline int addSingleRelation(rpmte p,
     }
 
     /* Avoid loop-breaker inflation from weak dependencies for now */
-    if (rpmdsIsWeak(dep))
+    if (orel->weak)
 	flags = 0;
 
     if (reversed) {
@@ -144,7 +171,7 @@ static inline int addSingleRelation(rpmte p,
     /* bump p predecessor count */
     tsi_p->tsi_count++;
 
-    rel = xcalloc(1, sizeof(*rel));
+    rel = rpmarenaAlloc(arena, sizeof(*rel));
     rel->rel_suc = tsi_p;
     rel->rel_flags = flags;
 
@@ -155,7 +182,7 @@ static inline int addSingleRelation(rpmte p,
     /* bump q successor count */
     tsi_q->tsi_qcnt++;
 
-    rel = xcalloc(1, sizeof(*rel));
+    rel = rpmarenaAlloc(arena, sizeof(*rel));
     rel->rel_suc = tsi_q;
     rel->rel_flags = flags;
 
@@ -166,19 +193,17 @@ static inline int addSingleRelation(rpmte p,
 }
 
 /**
- * Record next "q <- p" relation (i.e. "p" requires "q").
- * @param ts		transaction set
- * @param al		packages list
- * @param p		predecessor (i.e. package that "Requires: q")
+ * Find next "q <- p" relation (i.e. "p" requires "q").
+ * Only looks things up, so elements can be handled in parallel.
+ * @param er		relations of predecessor p (i.e. "Requires: q")
  * @param dep		dependency relation
  * @return		0 always
  */
-static inline int addRelation(rpmts ts,
-			      rpmal al,
-			      rpmte p,
-			      rpmds dep)
+static int findRelation(struct orderRels_s *er, rpmds dep)
 {
+    rpmte p = er->p;
     rpmte q;
+    struct orderRel_s *orel;
 
     /* Avoid dependendencies which are not relevant for ordering */
     if (isUnorderedReq(rpmdsFlags(dep)))
@@ -189,34 +214,174 @@ static inline int addRelation(rpmts ts,
 	rpmrichOp op;
 	if (rpmdsParseRichDep(dep, &ds1, &ds2, &op, NULL) == RPMRC_OK) {
 	    if (op != RPMRICHOP_ELSE)
-		addRelation(ts, al, p, ds1);
+		findRelation(er, ds1);
 	    if (op == RPMRICHOP_IF || op == RPMRICHOP_UNLESS) {
 	      rpmds ds21, ds22;
 	      rpmrichOp op2;
 	      if (rpmdsParseRichDep(dep, &ds21, &ds22, &op2, NULL) == RPMRC_OK && op2 == RPMRICHOP_ELSE) {
-		  addRelation(ts, al, p, ds22);
+		  findRelation(er, ds22);
 	      }
 	      ds21 = rpmdsFree(ds21);
 	      ds22 = rpmdsFree(ds22);
 	    }
 	    if (op == RPMRICHOP_AND || op == RPMRICHOP_OR)
-		addRelation(ts, al, p, ds2);
+		findRelation(er, ds2);
 	    ds1 = rpmdsFree(ds1);
 	    ds2 = rpmdsFree(ds2);
 	}
 	return 0;
     }
-    q = rpmalSatisfiesDepend(al, p, dep);
+    q = rpmalSatisfiesDepend(er->al, p, dep);
 
     /* Avoid deps outside this transaction and self dependencies */
     if (q == NULL || q == p)
 	return 0;
 
-    addSingleRelation(p, q, dep);
+    if (er->nrels == er->nalloced) {
+	er->nalloced = er->nalloced ? er->nalloced * 2 : 16;
+	er->rels = xrealloc(er->rels, er->nalloced * sizeof(*er->rels));
+    }
+    orel = &er->rels[er->nrels++];
+    orel->q = q;
+    orel->dsflags = rpmdsFlags(dep);
+    orel->reversed = rpmdsIsReverse(dep);
+    orel->weak = rpmdsIsWeak(dep);
+
+    return 0;
+}
+
+static void findRelations(void *data, int ix, int slot)
+{
+    struct orderRels_s *er = (struct orderRels_s *)data + ix;
+
+    if (er->cached)
+	return;
+
+    for (int i = 0; ordertags[i]; i++) {
+	rpmds dep = rpmdsInit(rpmteDS(er->p, ordertags[i]));
+	while (rpmdsNext(dep) >= 0)
+	    findRelation(er, dep);
+    }
+}
+
+static unsigned int sidHash(rpmsid sid)
+{
+    return sid;
+}
+
+static int sidCmp(rpmsid a, rpmsid b)
+{
+    return (a != b);
+}
+
+static void addNewNames(struct newNames_s *nn, rpmte p)
+{
+    rpmds provides = rpmdsInit(rpmteDS(p, RPMTAG_PROVIDENAME));
+    rpmfiles files = rpmteFiles(p);
+    int fc = rpmfilesFC(files);
+
+    orderNamesAddEntry(nn->names, rpmstrPoolId(nn->pool, rpmteN(p), 1));
+    while (rpmdsNext(provides) >= 0)
+	orderNamesAddEntry(nn->names, rpmdsNId(provides));
+    for (int i = 0; i < fc; i++)
+	orderNamesAddEntry(nn->names, rpmfilesBNId(files, i));
+    rpmfilesFree(files);
+}
 
+static int isNewName(struct newNames_s *nn, const char *n, size_t nl)
+{
+    rpmsid id = rpmstrPoolIdn(nn->pool, n, nl, 0);
+
+    if (id && orderNamesHasEntry(nn->names, id))
+	return 1;
+    /* files are recorded by basename only */
+    if (nl && n[0] == '/') {
+	const char *bn = n + nl;
+	while (bn[-1] != '/')
+	    bn--;
+	id = rpmstrPoolIdn(nn->pool, bn, n + nl - bn, 0);
+	if (id && orderNamesHasEntry(nn->names, id))
+	    return 1;
+    }
     return 0;
 }
 
+static rpmRC newRichCB(void *cbdata, rpmrichParseType type,
+		const char *n, int nl, const char *e, int el, rpmsenseFlags sense,
+		rpmrichOp op, char **emsg)
+{
+    struct newNames_s *nn = cbdata;
+    if (type == RPMRICH_PARSE_SIMPLE && isNewName(nn, n, nl))
+	nn->hit = 1;
+    return RPMRC_OK;
+}
+
+/* Could any of the newly added elements satisfy a dependency of p? */
+static int dependsOnNew(struct newNames_s *nn, rpmte p)
+{
+    nn->hit = 0;
+    for (int i = 0; ordertags[i] && !nn->hit; i++) {
+	rpmds dep = rpmdsInit(rpmteDS(p, ordertags[i]));
+	while (!nn->hit && rpmdsNext(dep) >= 0) {
+	    const char *n = rpmdsN(dep);
+	    if (rpmdsIsRich(dep)) {
+		if (rpmrichParse(&n, NULL, newRichCB, nn) != RPMRC_OK)
+		    nn->hit = 1;
+	    } else if (isNewName(nn, n, strlen(n))) {
+		nn->hit = 1;
+	    }
+	}
+    }
+    return nn->hit;
+}
+
+/*
+ * Relations found for an element when the transaction was last ordered
+ * still stand if nothing was taken out of it since, and none of the
+ * elements added since provides anything the element depends on. When
+ * much of the transaction is new, just look everything up again.
+ */
+static int reuseRelations(rpmts ts, struct orderRels_s *elemRels, int nrels)
+{
+    tsMembers tsmem = rpmtsMembers(ts);
+    struct newNames_s nn;
+    int nnew = 0, nreused = 0;
+
+    if (!tsmem->orderValid || tsmem->orderColor != rpmtsColor(ts) ||
+	    tsmem->orderPrefColor != rpmtsPrefColor(ts))
+	return 0;
+
+    for (int i = 0; i < nrels; i++) {
+	if (rpmteOrderRels(elemRels[i].p, NULL) < 0)
+	    nnew++;
+    }
+    if (nnew > nrels / 2)
+	return 0;
+
+    nn.pool = rpmtsPool(ts);
+    nn.names = orderNamesCreate(257, sidHash, sidCmp, NULL);
+    for (int i = 0; i < nrels; i++) {
+	if (rpmteOrderRels(elemRels[i].p, NULL) < 0)
+	    addNewNames(&nn, elemRels[i].p);
+    }
+
+    for (int i = 0; i < nrels; i++) {
+	struct orderRels_s *er = &elemRels[i];
+	int n = rpmteOrderRels(er->p, &er->rels);
+
+	if (n >= 0 && (nnew == 0 || !dependsOnNew(&nn, er->p))) {
+	    er->nrels = er->nalloced = n;
+	    er->cached = 1;
+	    nreused++;
+	} else {
+	    er->rels = NULL;
+	}
+    }
+    orderNamesFree(nn.names);
+
+    return nreused;
+}
+
 /**
  * Add element to list sorting by tsi_qcnt.
  * @param p		new element
@@ -274,15 +439,19 @@ typedef struct sccData_s {
     int index;			/* DFS node number counter */
     tsortInfo *stack;		/* Stack of nodes */
     int stackcnt;		/* Stack top counter */
+    struct sccFrame_s *frames;	/* DFS path, instead of recursing */
     scc SCCs;			/* Array of SCC's found */
     int sccCnt;			/* Number of SCC's found */
 } * sccData;
 
-static void tarjan(sccData sd, tsortInfo tsi)
-{
-    tsortInfo tsi_q;
+/* Node on the DFS path and its next relation to consider */
+struct sccFrame_s {
+    tsortInfo tsi;
     relation rel;
+};
 
+static void tarjanVisit(sccData sd, tsortInfo tsi, int *depth)
+{
     /* use negative index numbers */
     sd->index--;
     /* Set the depth index for p */
@@ -290,25 +459,15 @@ static void tarjan(sccData sd, tsortInfo tsi)
     tsi->tsi_SccLowlink = sd->index;
 
     sd->stack[sd->stackcnt++] = tsi;                   /* Push p on the stack */
-    for (rel=tsi->tsi_relations; rel != NULL; rel=rel->rel_next) {
-	/* Consider successors of p */
-	tsi_q = rel->rel_suc;
-	if (tsi_q->tsi_SccIdx > 0)
-	    /* Ignore already found SCCs */
-	    continue;
-	if (tsi_q->tsi_SccIdx == 0){
-	    /* Was successor q not yet visited? */
-	    tarjan(sd, tsi_q);                       /* Recurse */
-	    /* negative index numers: use max as it is closer to 0 */
-	    tsi->tsi_SccLowlink = (
-		tsi->tsi_SccLowlink > tsi_q->tsi_SccLowlink
-		? tsi->tsi_SccLowlink : tsi_q->tsi_SccLowlink);
-	} else {
-	    tsi->tsi_SccLowlink = (
-		tsi->tsi_SccLowlink > tsi_q->tsi_SccIdx
-		? tsi->tsi_SccLowlink : tsi_q->tsi_SccIdx);
-	}
-    }
+    sd->frames[*depth].tsi = tsi;
+    sd->frames[*depth].rel = tsi->tsi_relations;
+    (*depth)++;
+}
+
+static void tarjanFinish(sccData sd, tsortInfo tsi)
+{
+    tsortInfo tsi_q;
+    relation rel;
 
     if (tsi->tsi_SccLowlink == tsi->tsi_SccIdx) {
 	/* v is the root of an SCC? */
@@ -348,13 +507,58 @@ static void tarjan(sccData sd, tsortInfo tsi)
     }
 }
 
+/*
+ * Tarjan's algorithm, with the DFS path kept in sd->frames so deep
+ * dependency chains can't exhaust the C stack.
+ */
+static void tarjan(sccData sd, tsortInfo root)
+{
+    int depth = 0;
+
+    tarjanVisit(sd, root, &depth);
+    while (depth > 0) {
+	struct sccFrame_s *frame = &sd->frames[depth-1];
+	tsortInfo tsi = frame->tsi;
+	tsortInfo tsi_q;
+
+	if (frame->rel == NULL) {
+	    /* All successors done, back to the parent */
+	    tarjanFinish(sd, tsi);
+	    if (--depth > 0) {
+		tsortInfo parent = sd->frames[depth-1].tsi;
+		/* negative index numers: use max as it is closer to 0 */
+		parent->tsi_SccLowlink = (
+		    parent->tsi_SccLowlink > tsi->tsi_SccLowlink
+		    ? parent->tsi_SccLowlink : tsi->tsi_SccLowlink);
+	    }
+	    continue;
+	}
+
+	/* Consider successors of p */
+	tsi_q = frame->rel->rel_suc;
+	frame->rel = frame->rel->rel_next;
+	if (tsi_q->tsi_SccIdx > 0)
+	    /* Ignore already found SCCs */
+	    continue;
+	if (tsi_q->tsi_SccIdx == 0) {
+	    /* Was successor q not yet visited? */
+	    tarjanVisit(sd, tsi_q, &depth);
+	} else {
+	    tsi->tsi_SccLowlink = (
+		tsi->tsi_SccLowlink > tsi_q->tsi_SccIdx
+		? tsi->tsi_SccLowlink : tsi_q->tsi_SccIdx);
+	}
+    }
+}
+
 /* Search for SCCs and return an array last entry has a .size of 0 */
 static scc detectSCCs(tsortInfo orderInfo, int nelem, int debugloops)
 {
     /* Set up data structures needed for the tarjan algorithm */
     scc SCCs = xcalloc(nelem+3, sizeof(*SCCs));
     tsortInfo *stack = xcalloc(nelem, sizeof(*stack));
-    struct sccData_s sd = { 0, stack, 0, SCCs, 2 };
+    struct sccFrame_s *frames = xcalloc(nelem, sizeof(*frames));
+    struct sccData_s sd = { 0, stack, 0, frames, SCCs, 2 };
 
     for (int i = 0; i < nelem; i++) {
 	tsortInfo tsi = &orderInfo[i];
@@ -364,6 +568,7 @@ static scc detectSCCs(tsortInfo orderInfo, int nelem, int debugloops)
     }
 
     free(stack);
+    free(frames);
 
     SCCs = xrealloc(SCCs, (sd.sccCnt+1)*sizeof(struct scc_s));
 
@@ -572,6 +777,11 @@ int rpmtsOrder(rpmts ts)
     scc SCCs;
     int nelem = rpmtsNElements(ts);
     tsortInfo sortInfo = xcalloc(nelem, sizeof(struct tsortInfo_s));
+    struct orderRels_s *elemRels = xcalloc(nelem, sizeof(*elemRels));
+    int nthreads = rpmworkersCount("_order_threads");
+    int nrels = 0;
+    int nreused;
+    rpmarena arena = rpmarenaCreate(0);
 
     (void) rpmswEnter(rpmtsOp(ts, RPMTS_OP_ORDER), 0);
 
@@ -587,27 +797,42 @@ int rpmtsOrder(rpmts ts)
     rpmlog(RPMLOG_DEBUG, "========== recording tsort relations\n");
     pi = rpmtsiInit(ts);
     while ((p = rpmtsiNext(pi, 0)) != NULL) {
-	rpmal al = (rpmteType(p) == TR_REMOVED) ? 
-		   erasedPackages : tsmem->addedPackages;
-	rpmTag ordertags[] = {
-		RPMTAG_REQUIRENAME,
-		RPMTAG_RECOMMENDNAME,
-		RPMTAG_SUGGESTNAME,
-		RPMTAG_SUPPLEMENTNAME,
-		RPMTAG_ENHANCENAME,
-		RPMTAG_ORDERNAME,
-		0,
-	};
-
-	for (int i = 0; ordertags[i]; i++) {
-	    rpmds dep = rpmdsInit(rpmteDS(p, ordertags[i]));
-	    while (rpmdsNext(dep) >= 0)
-		addRelation(ts, al, p, dep);
-	}
+	elemRels[nrels].p = p;
+	elemRels[nrels].al = (rpmteType(p) == TR_REMOVED) ? 
+			     erasedPackages : tsmem->addedPackages;
+	nrels++;
     }
-
     rpmtsiFree(pi);
 
+    /*
+     * Looking up the relations is read-only and done in parallel (except
+     * when debugging, to keep the output in order). Recording them
+     * touches both ends so that's done after, in transaction order.
+     */
+    if (rpmIsDebug())
+	nthreads = 1;
+    if (nthreads > 1) {
+	rpmalMakeIndex(tsmem->addedPackages);
+	rpmalMakeIndex(erasedPackages);
+    }
+    nreused = reuseRelations(ts, elemRels, nrels);
+    rpmlog(RPMLOG_DEBUG, "reusing relations of %d of %d elements\n",
+	   nreused, nrels);
+    rpmworkersRun(nthreads, nrels, findRelations, elemRels);
+
+    /* The elements keep their relations for the next ordering */
+    for (int i = 0; i < nrels; i++) {
+	struct orderRels_s *er = &elemRels[i];
+	for (int j = 0; j < er->nrels; j++)
+	    addSingleRelation(arena, er->p, &er->rels[j]);
+	if (!er->cached)
+	    rpmteSetOrderRels(er->p, er->rels, er->nrels);
+    }
+    free(elemRels);
+    tsmem->orderValid = 1;
+    tsmem->orderColor = rpmtsColor(ts);
+    tsmem->orderPrefColor = prefcolor;
+
     newOrder = xcalloc(tsmem->orderCount, sizeof(*newOrder));
     SCCs = detectSCCs(sortInfo, nelem, (rpmtsFlags(ts) & RPMTRANS_FLAG_DEPLOOPS));
 
@@ -656,12 +881,30 @@ int rpmtsOrder(rpmts ts)
 	}
     }
 
+    /*
+     * Remember the last element each one has to come after, for telling
+     * independent neighbours apart when processing. Relations to later
+     * elements only remain from broken loops. tsi_reqx is free by now.
+     */
+    for (int i = 0; i < newOrderCount; i++)
+	rpmteTSI(newOrder[i])->tsi_reqx = i;
+    for (int i = 0; i < newOrderCount; i++) {
+	tsortInfo tsi = rpmteTSI(newOrder[i]);
+	int after = -1;
+	for (relation rel = tsi->tsi_forward_relations; rel; rel = rel->rel_next) {
+	    int j = rel->rel_suc->tsi_reqx;
+	    if (j < i && j > after)
+		after = j;
+	}
+	rpmteSetOrderAfter(newOrder[i], after);
+    }
+
     /* Clean up tsort data */
     for (int i = 0; i < nelem; i++) {
 	rpmteSetTSI(tsmem->order[i], NULL);
-	rpmTSIFree(&sortInfo[i]);
     }
     free(sortInfo);
+    arena = rpmarenaFree(arena);
 
     assert(newOrderCount == tsmem->orderCount);
 
@@ -0,0 +1,195 @@
+#include "system.h"
+
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rpm/rpmfileutil.h>
+#include <rpm/rpmlog.h>
+#include <rpm/rpmmacro.h>
+#include <rpm/rpmstring.h>
+
+#include "lib/payloadcache.h"
+
+#include "debug.h"
+
+struct cacheEntry_s {
+    char *name;
+    off_t size;
+    time_t mtime;
+};
+
+/* Only hex digests make names, nothing that could point elsewhere */
+static int validDigest(const char *digest)
+{
+    size_t len = digest ? strlen(digest) : 0;
+
+    if (len < 32 || len > 128)
+	return 0;
+    for (const char *s = digest; *s; s++) {
+	if (!risdigit(*s) && !(*s >= 'a' && *s <= 'f'))
+	    return 0;
+    }
+    return 1;
+}
+
+/* The copies are trusted, they must come from us or root */
+static int trusted(const struct stat *st)
+{
+    return S_ISREG(st->st_mode) &&
+	   (st->st_uid == 0 || st->st_uid == geteuid()) &&
+	   (st->st_mode & (S_IWGRP|S_IWOTH)) == 0;
+}
+
+static int entryCmp(const void *a, const void *b)
+{
+    const struct cacheEntry_s *ea = a, *eb = b;
+    if (ea->mtime != eb->mtime)
+	return ea->mtime < eb->mtime ? -1 : 1;
+    return strcmp(ea->name, eb->name);
+}
+
+/* Remove least recently used copies until the cache fits in limit */
+static void cacheEvict(int dirfd, off_t limit, const char *keep)
+{
+    struct cacheEntry_s *entries = NULL;
+    int nentries = 0;
+    off_t total = 0;
+    struct dirent *dent;
+    DIR *dir;
+    int fd;
+
+    if ((fd = dup(dirfd)) < 0)
+	return;
+    if ((dir = fdopendir(fd)) == NULL) {
+	close(fd);
+	return;
+    }
+    rewinddir(dir);
+    while ((dent = readdir(dir)) != NULL) {
+	struct stat st;
+	/* Skips dot entries and copies still being written */
+	if (!validDigest(dent->d_name))
+	    continue;
+	if (fstatat(dirfd, dent->d_name, &st, AT_SYMLINK_NOFOLLOW) ||
+		!S_ISREG(st.st_mode))
+	    continue;
+	entries = xrealloc(entries, (nentries + 1) * sizeof(*entries));
+	entries[nentries].name = xstrdup(dent->d_name);
+	entries[nentries].size = st.st_size;
+	entries[nentries].mtime = st.st_mtime;
+	nentries++;
+	total += st.st_size;
+    }
+    closedir(dir);
+
+    if (total > limit)
+	qsort(entries, nentries, sizeof(*entries), entryCmp);
+    for (int i = 0; i < nentries && total > limit; i++) {
+	if (rstreq(entries[i].name, keep))
+	    continue;
+	if (unlinkat(dirfd, entries[i].name, 0) == 0) {
+	    rpmlog(RPMLOG_DEBUG, "payload cache: removed %s\n",
+		   entries[i].name);
+	    total -= entries[i].size;
+	}
+    }
+
+    for (int i = 0; i < nentries; i++)
+	free(entries[i].name);
+    free(entries);
+}
+
+int payloadCacheOpen(void)
+{
+    char *path = rpmExpand("%{?_payload_cache_dir}", NULL);
+    int dirfd = -1;
+
+    if (*path == '/') {
+	if (rpmioMkpath(path, 0755, -1, -1) == 0)
+	    dirfd = open(path, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (dirfd < 0) {
+	    rpmlog(RPMLOG_WARNING, _("unable to use payload cache %s: %s\n"),
+		   path, strerror(errno));
+	}
+    }
+    free(path);
+    return dirfd;
+}
+
+FD_t payloadCacheGet(int dirfd, const char *digest)
+{
+    struct stat st;
+    FD_t fd = NULL;
+    int cfd;
+
+    if (dirfd < 0 || !validDigest(digest))
+	return NULL;
+
+    cfd = openat(dirfd, digest, O_RDONLY|O_NOFOLLOW|O_CLOEXEC);
+    if (cfd < 0)
+	return NULL;
+    if (fstat(cfd, &st) == 0 && trusted(&st)) {
+	/* The modification time orders the copies for eviction */
+	(void) futimens(cfd, NULL);
+	rpmlog(RPMLOG_DEBUG, "payload cache: using %s\n", digest);
+	fd = Fdopen(fdDup(cfd), "r.ufdio");
+    }
+    close(cfd);
+    return fd;
+}
+
+FD_t payloadCachePut(int dirfd, const char *digest, FD_t payload)
+{
+    static unsigned int seq = 0;
+    char *limitstr = rpmExpand("%{?_payload_cache_size}", NULL);
+    off_t limit = strtoll(limitstr, NULL, 10);
+    char *tmpname = NULL;
+    FD_t out = NULL;
+    FD_t fd = NULL;
+    off_t size;
+    int tfd = -1;
+
+    if (dirfd < 0 || !validDigest(digest) || payload == NULL)
+	goto exit;
+
+    /* The leading dot keeps eviction off the copy until it's complete */
+    rasprintf(&tmpname, ".%s.%d.%u", digest, (int) getpid(),
+	      __atomic_fetch_add(&seq, 1, __ATOMIC_RELAXED));
+    tfd = openat(dirfd, tmpname, O_RDWR|O_CREAT|O_EXCL|O_CLOEXEC, 0644);
+    if (tfd < 0)
+	goto exit;
+
+    out = Fdopen(fdDup(tfd), "w.ufdio");
+    size = ufdCopy(payload, out);
+    if (Fclose(out) || size < 0) {
+	rpmlog(RPMLOG_DEBUG, "payload cache: failed to fill %s\n", digest);
+	unlinkat(dirfd, tmpname, 0);
+	goto exit;
+    }
+    if (renameat(dirfd, tmpname, dirfd, digest)) {
+	unlinkat(dirfd, tmpname, 0);
+	goto exit;
+    }
+    rpmlog(RPMLOG_DEBUG, "payload cache: added %s (%jd bytes)\n",
+	   digest, (intmax_t) size);
+
+    if (limit > 0)
+	cacheEvict(dirfd, limit, digest);
+
+    if (lseek(tfd, 0, SEEK_SET) == 0)
+	fd = Fdopen(fdDup(tfd), "r.ufdio");
+
+exit:
+    if (tfd >= 0)
+	close(tfd);
+    if (payload)
+	Fclose(payload);
+    free(limitstr);
+    free(tmpname);
+    return fd;
+}
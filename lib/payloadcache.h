@@ -0,0 +1,54 @@
+#ifndef PAYLOADCACHE_H
+#define PAYLOADCACHE_H
+
+/** \file lib/payloadcache.h
+ * Cache of decompressed package payloads.
+ *
+ * Installing the same package file again, eg. into many roots, reads the
+ * payload from a plain copy made by the first install instead of
+ * decompressing it again. Used with %_unpack_copy_range, the file data
+ * is then copied (or reflinked) from the copy within the kernel. The
+ * copies are named by the payload digest and the least recently used
+ * ones are removed when the cache grows beyond its size limit.
+ */
+
+#include <rpm/rpmtypes.h>
+#include <rpm/rpmutil.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Open the cache directory configured with %_payload_cache_dir, it
+ * needs to be done before entering the chroot.
+ * @return		directory descriptor, -1 if there's no cache
+ */
+RPM_GNUC_INTERNAL
+int payloadCacheOpen(void);
+
+/**
+ * Open a cached payload, and mark it as recently used.
+ * @param dirfd		cache directory
+ * @param digest	payload digest (hex)
+ * @return		plain payload, NULL if it's not cached
+ */
+RPM_GNUC_INTERNAL
+FD_t payloadCacheGet(int dirfd, const char *digest);
+
+/**
+ * Decompress a payload into the cache and open the copy, making room
+ * for it by removing the least recently used ones.
+ * @param dirfd		cache directory
+ * @param digest	payload digest (hex)
+ * @param payload	decompressing payload (closed)
+ * @return		plain payload, NULL on error
+ */
+RPM_GNUC_INTERNAL
+FD_t payloadCachePut(int dirfd, const char *digest, FD_t payload);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PAYLOADCACHE_H */
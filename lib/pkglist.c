@@ -0,0 +1,515 @@
+#include "system.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <rpm/header.h>
+#include <rpm/rpmds.h>
+#include <rpm/rpmlog.h>
+#include <rpm/rpmstring.h>
+#include <rpm/rpmstrpool.h>
+
+#include "lib/pkglist.h"
+#include "lib/sidecar.h"
+
+#include "debug.h"
+
+#define PKGLIST_MAGIC	"RPMPKGL1"
+
+/*
+ * A sidecar file:
+ *	head
+ *	pkgs[npkgs]		sorted by instance
+ *	deps[ndeps]
+ *	files[nfiles]
+ *	strings[strsize]	nul terminated, each one once
+ */
+struct pkgListHead_s {
+    struct sidecarHead_s sc;
+    uint32_t npkgs;
+    uint32_t ndeps;
+    uint32_t nfiles;
+    uint32_t strsize;
+};
+
+/*
+ * A loaded list stays in the read-only mapping until it's changed, then
+ * the tables are copied to the heap. Strings of removed packages are left
+ * in the table, they're dropped on write.
+ */
+struct rpmdbPkgList_s {
+    struct hdrShmId_s id;
+    void *map;
+    size_t mapsize;
+    struct rpmdbPkgListPkg_s *pkgs;
+    unsigned int npkgs;
+    unsigned int pkgsalloced;
+    struct rpmdbPkgListDep_s *deps;
+    unsigned int ndeps;
+    unsigned int depsalloced;
+    struct rpmdbPkgListFile_s *files;
+    unsigned int nfiles;
+    unsigned int filesalloced;
+    char *strings;
+    size_t strsize;
+    size_t stralloced;
+    int modified;
+};
+
+static const rpmTagVal depTags[] = {
+    RPMTAG_PROVIDENAME,
+    RPMTAG_REQUIRENAME,
+    RPMTAG_CONFLICTNAME,
+    RPMTAG_OBSOLETENAME,
+    RPMTAG_RECOMMENDNAME,
+    RPMTAG_SUGGESTNAME,
+    RPMTAG_SUPPLEMENTNAME,
+    RPMTAG_ENHANCENAME,
+};
+
+static void *tableCopy(const void *table, unsigned int count, size_t size,
+		       unsigned int *alloced)
+{
+    void *copy;
+    *alloced = count ? count : 1;
+    copy = xmalloc(*alloced * size);
+    memcpy(copy, table, count * size);
+    return copy;
+}
+
+/* Move a mapped list to the heap before changing it */
+static void listOwn(rpmdbPkgList pl)
+{
+    if (pl->map) {
+	char *strings;
+
+	pl->pkgs = tableCopy(pl->pkgs, pl->npkgs, sizeof(*pl->pkgs),
+			     &pl->pkgsalloced);
+	pl->deps = tableCopy(pl->deps, pl->ndeps, sizeof(*pl->deps),
+			     &pl->depsalloced);
+	pl->files = tableCopy(pl->files, pl->nfiles, sizeof(*pl->files),
+			      &pl->filesalloced);
+	pl->stralloced = pl->strsize ? pl->strsize : 1;
+	strings = xmalloc(pl->stralloced);
+	memcpy(strings, pl->strings, pl->strsize);
+	pl->strings = strings;
+	sidecarUnmap(pl->map, pl->mapsize);
+	pl->map = NULL;
+	pl->mapsize = 0;
+    }
+    pl->modified = 1;
+}
+
+static uint32_t addString(rpmdbPkgList pl, const char *str)
+{
+    size_t off = pl->strsize;
+    size_t len = strlen(str);
+
+    if (pl->strsize + len + 1 > pl->stralloced) {
+	pl->stralloced = pl->stralloced ? pl->stralloced * 2 : 65536;
+	if (pl->stralloced < pl->strsize + len + 1)
+	    pl->stralloced = pl->strsize + len + 1;
+	pl->strings = xrealloc(pl->strings, pl->stralloced);
+    }
+    memcpy(pl->strings + off, str, len + 1);
+    pl->strsize += len + 1;
+    return off;
+}
+
+rpmdbPkgList pkgListNew(const struct hdrShmId_s *id)
+{
+    rpmdbPkgList pl = xcalloc(1, sizeof(*pl));
+    pl->id = *id;
+    pl->modified = 1;
+    return pl;
+}
+
+/* Is the mapped file complete and consistent? */
+static int listValid(rpmdbPkgList pl, const struct pkgListHead_s *head)
+{
+    size_t tables;
+
+    if (head->npkgs > pl->mapsize ||
+	    head->ndeps > pl->mapsize || head->nfiles > pl->mapsize)
+	return 0;
+    tables = sizeof(*head) + (size_t)head->npkgs * sizeof(*pl->pkgs) +
+	     (size_t)head->ndeps * sizeof(*pl->deps) +
+	     (size_t)head->nfiles * sizeof(*pl->files);
+    if (tables > pl->mapsize || head->strsize != pl->mapsize - tables)
+	return 0;
+    if (pl->strsize && pl->strings[pl->strsize - 1] != '\0')
+	return 0;
+
+    for (unsigned int i = 0; i < head->npkgs; i++) {
+	const struct rpmdbPkgListPkg_s *pkg = &pl->pkgs[i];
+	if (i > 0 && pkg->hdrNum <= (pkg - 1)->hdrNum)
+	    return 0;
+	if (pkg->name >= pl->strsize || pkg->evr >= pl->strsize ||
+		pkg->arch >= pl->strsize)
+	    return 0;
+	if (pkg->deps > pl->ndeps || pkg->ndeps > pl->ndeps - pkg->deps ||
+		pkg->files > pl->nfiles || pkg->nfiles > pl->nfiles - pkg->files)
+	    return 0;
+    }
+    for (unsigned int i = 0; i < head->ndeps; i++) {
+	if (pl->deps[i].name >= pl->strsize || pl->deps[i].evr >= pl->strsize)
+	    return 0;
+    }
+    for (unsigned int i = 0; i < head->nfiles; i++) {
+	if (pl->files[i].dirname >= pl->strsize ||
+		pl->files[i].basename >= pl->strsize)
+	    return 0;
+    }
+    return 1;
+}
+
+rpmdbPkgList pkgListLoad(const char *path, const struct hdrShmId_s *id)
+{
+    const struct pkgListHead_s *head;
+    rpmdbPkgList pl = NULL;
+    size_t size = 0;
+    void *map;
+
+    if ((map = sidecarMap(path, sizeof(*head), &size)) == NULL)
+	goto exit;
+
+    head = map;
+    pl = xcalloc(1, sizeof(*pl));
+    pl->id = *id;
+    pl->map = map;
+    pl->mapsize = size;
+    if (!sidecarHeadValid(map, size, PKGLIST_MAGIC, id))
+	goto stale;
+    pl->pkgs = (struct rpmdbPkgListPkg_s *)(head + 1);
+    pl->npkgs = pl->pkgsalloced = head->npkgs;
+    pl->deps = (struct rpmdbPkgListDep_s *)(pl->pkgs + head->npkgs);
+    pl->ndeps = pl->depsalloced = head->ndeps;
+    pl->files = (struct rpmdbPkgListFile_s *)(pl->deps + head->ndeps);
+    pl->nfiles = pl->filesalloced = head->nfiles;
+    pl->strings = (char *)(pl->files + head->nfiles);
+    pl->strsize = pl->stralloced = head->strsize;
+    if (!listValid(pl, head))
+	goto stale;
+
+    rpmlog(RPMLOG_DEBUG, "loaded %u packages from %s\n", pl->npkgs, path);
+    goto exit;
+
+stale:
+    pl = pkgListFree(pl);
+
+exit:
+    return pl;
+}
+
+/* The string table being written, each string once */
+struct strWriter_s {
+    rpmstrPool pool;
+    uint32_t *offs;		/* offset by pool id */
+    unsigned int noffs;
+    unsigned int offsalloced;
+    char *strings;
+    size_t strsize;
+    size_t stralloced;
+};
+
+static uint32_t writeString(struct strWriter_s *sw, const char *str)
+{
+    rpmsid id = rpmstrPoolId(sw->pool, str, 1);
+    size_t len;
+
+    /* Ids are handed out in sequence, a new one is the next after ours */
+    if (id < sw->noffs)
+	return sw->offs[id];
+
+    len = strlen(str);
+    if (id >= sw->offsalloced) {
+	sw->offsalloced = id * 2 + 1;
+	sw->offs = xrealloc(sw->offs, sw->offsalloced * sizeof(*sw->offs));
+    }
+    sw->noffs = id + 1;
+    sw->offs[id] = sw->strsize;
+    if (sw->strsize + len + 1 > sw->stralloced) {
+	sw->stralloced = sw->stralloced * 2 + len + 1;
+	sw->strings = xrealloc(sw->strings, sw->stralloced);
+    }
+    memcpy(sw->strings + sw->strsize, str, len + 1);
+    sw->strsize += len + 1;
+    return sw->offs[id];
+}
+
+struct listWriter_s {
+    const struct pkgListHead_s *head;
+    const struct rpmdbPkgListPkg_s *pkgs;
+    const struct rpmdbPkgListDep_s *deps;
+    const struct rpmdbPkgListFile_s *files;
+    const char *strings;
+};
+
+static int listWrite(FILE *fp, void *data)
+{
+    struct listWriter_s *w = data;
+
+    fwrite(w->head, sizeof(*w->head), 1, fp);
+    fwrite(w->pkgs, sizeof(*w->pkgs), w->head->npkgs, fp);
+    fwrite(w->deps, sizeof(*w->deps), w->head->ndeps, fp);
+    fwrite(w->files, sizeof(*w->files), w->head->nfiles, fp);
+    fwrite(w->strings, 1, w->head->strsize, fp);
+    return 0;
+}
+
+int pkgListWrite(rpmdbPkgList pl, const char *path,
+		 const struct hdrShmId_s *id)
+{
+    struct rpmdbPkgListPkg_s *pkgs = NULL;
+    struct rpmdbPkgListDep_s *deps = NULL;
+    struct rpmdbPkgListFile_s *files = NULL;
+    struct strWriter_s sw = { .pool = rpmstrPoolCreate() };
+    unsigned int ndeps = 0, nfiles = 0;
+    struct pkgListHead_s head;
+    struct listWriter_s w;
+    int rc;
+
+    /* Write only live strings, each one once, and the tables in order */
+    pkgs = xmalloc((pl->npkgs + 1) * sizeof(*pkgs));
+    deps = xmalloc((pl->ndeps + 1) * sizeof(*deps));
+    files = xmalloc((pl->nfiles + 1) * sizeof(*files));
+#define WSTR(_off) writeString(&sw, pl->strings + (_off))
+    for (unsigned int i = 0; i < pl->npkgs; i++) {
+	const struct rpmdbPkgListPkg_s *pkg = &pl->pkgs[i];
+	pkgs[i] = *pkg;
+	pkgs[i].name = WSTR(pkg->name);
+	pkgs[i].evr = WSTR(pkg->evr);
+	pkgs[i].arch = WSTR(pkg->arch);
+	pkgs[i].deps = ndeps;
+	for (unsigned int j = 0; j < pkg->ndeps; j++) {
+	    const struct rpmdbPkgListDep_s *dep = &pl->deps[pkg->deps + j];
+	    deps[ndeps] = *dep;
+	    deps[ndeps].name = WSTR(dep->name);
+	    deps[ndeps].evr = WSTR(dep->evr);
+	    ndeps++;
+	}
+	pkgs[i].files = nfiles;
+	for (unsigned int j = 0; j < pkg->nfiles; j++) {
+	    const struct rpmdbPkgListFile_s *file = &pl->files[pkg->files + j];
+	    files[nfiles].dirname = WSTR(file->dirname);
+	    files[nfiles].basename = WSTR(file->basename);
+	    nfiles++;
+	}
+    }
+#undef WSTR
+
+    memset(&head, 0, sizeof(head));
+    sidecarHeadInit(&head.sc, PKGLIST_MAGIC, id,
+		    sizeof(head) + pl->npkgs * sizeof(*pkgs) +
+		    ndeps * sizeof(*deps) + nfiles * sizeof(*files) +
+		    sw.strsize);
+    head.npkgs = pl->npkgs;
+    head.ndeps = ndeps;
+    head.nfiles = nfiles;
+    head.strsize = sw.strsize;
+
+    w.head = &head;
+    w.pkgs = pkgs;
+    w.deps = deps;
+    w.files = files;
+    w.strings = sw.strings;
+    rc = sidecarWrite(path, listWrite, &w);
+    if (rc) {
+	rpmlog(RPMLOG_DEBUG, "failed to store package list %s: %s\n",
+		path, strerror(errno));
+    } else {
+	rpmlog(RPMLOG_DEBUG, "stored %u packages in %s\n", pl->npkgs, path);
+	pl->id = *id;
+	pl->modified = 0;
+    }
+    rpmstrPoolFree(sw.pool);
+    free(pkgs);
+    free(deps);
+    free(files);
+    free(sw.offs);
+    free(sw.strings);
+    return rc;
+}
+
+rpmdbPkgList pkgListFree(rpmdbPkgList pl)
+{
+    if (pl) {
+	if (pl->map) {
+	    sidecarUnmap(pl->map, pl->mapsize);
+	} else {
+	    free(pl->pkgs);
+	    free(pl->deps);
+	    free(pl->files);
+	    free(pl->strings);
+	}
+	free(pl);
+    }
+    return NULL;
+}
+
+int pkgListMatches(rpmdbPkgList pl, const struct hdrShmId_s *id)
+{
+    return (memcmp(&pl->id, id, sizeof(*id)) == 0);
+}
+
+int pkgListModified(rpmdbPkgList pl)
+{
+    return pl->modified;
+}
+
+/* Position of a package instance, or where it would go */
+static unsigned int pkgFind(rpmdbPkgList pl, unsigned int hdrNum)
+{
+    unsigned int lo = 0, hi = pl->npkgs;
+
+    while (lo < hi) {
+	unsigned int mid = lo + (hi - lo) / 2;
+	if (pl->pkgs[mid].hdrNum < hdrNum)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    return lo;
+}
+
+static struct rpmdbPkgListDep_s *newDep(rpmdbPkgList pl)
+{
+    if (pl->ndeps == pl->depsalloced) {
+	pl->depsalloced = pl->depsalloced ? pl->depsalloced * 2 : 1024;
+	pl->deps = xrealloc(pl->deps, pl->depsalloced * sizeof(*pl->deps));
+    }
+    return &pl->deps[pl->ndeps++];
+}
+
+static struct rpmdbPkgListFile_s *newFile(rpmdbPkgList pl)
+{
+    if (pl->nfiles == pl->filesalloced) {
+	pl->filesalloced = pl->filesalloced ? pl->filesalloced * 2 : 4096;
+	pl->files = xrealloc(pl->files, pl->filesalloced * sizeof(*pl->files));
+    }
+    return &pl->files[pl->nfiles++];
+}
+
+void pkgListAdd(rpmdbPkgList pl, unsigned int hdrNum, Header h)
+{
+    struct rpmdbPkgListPkg_s pkg;
+    struct rpmtd_s bnames, dnames, dindexes;
+    const char *arch = headerGetString(h, RPMTAG_ARCH);
+    char *evr = headerGetAsString(h, RPMTAG_EVR);
+    unsigned int pos;
+
+    pkgListRemove(pl, hdrNum);
+    listOwn(pl);
+
+    memset(&pkg, 0, sizeof(pkg));
+    pkg.hdrNum = hdrNum;
+    pkg.name = addString(pl, headerGetString(h, RPMTAG_NAME));
+    pkg.evr = addString(pl, evr ? evr : "");
+    pkg.arch = addString(pl, arch ? arch : "");
+
+    pkg.deps = pl->ndeps;
+    for (int t = 0; t < sizeof(depTags) / sizeof(depTags[0]); t++) {
+	rpmds ds = rpmdsInit(rpmdsNew(h, depTags[t], 0));
+	while (rpmdsNext(ds) >= 0) {
+	    struct rpmdbPkgListDep_s *dep = newDep(pl);
+	    const char *EVR = rpmdsEVR(ds);
+	    dep->tag = depTags[t];
+	    dep->name = addString(pl, rpmdsN(ds));
+	    dep->evr = addString(pl, EVR ? EVR : "");
+	    dep->flags = rpmdsFlags(ds);
+	}
+	rpmdsFree(ds);
+    }
+    pkg.ndeps = pl->ndeps - pkg.deps;
+
+    pkg.files = pl->nfiles;
+    if (headerGet(h, RPMTAG_BASENAMES, &bnames, HEADERGET_MINMEM)) {
+	headerGet(h, RPMTAG_DIRNAMES, &dnames, HEADERGET_MINMEM);
+	headerGet(h, RPMTAG_DIRINDEXES, &dindexes, HEADERGET_MINMEM);
+	/* Directories are added once per package */
+	uint32_t *doffs = xcalloc(rpmtdCount(&dnames) + 1, sizeof(*doffs));
+	const char *bn;
+	while ((bn = rpmtdNextString(&bnames)) != NULL) {
+	    uint32_t *dix = rpmtdNextUint32(&dindexes);
+	    const char *dn;
+	    struct rpmdbPkgListFile_s *file;
+	    if (dix == NULL || rpmtdSetIndex(&dnames, *dix) < 0 ||
+		    (dn = rpmtdGetString(&dnames)) == NULL)
+		continue;
+	    if (doffs[*dix] == 0)
+		doffs[*dix] = addString(pl, dn) + 1;
+	    file = newFile(pl);
+	    file->dirname = doffs[*dix] - 1;
+	    file->basename = addString(pl, bn);
+	}
+	free(doffs);
+	rpmtdFreeData(&dindexes);
+	rpmtdFreeData(&dnames);
+	rpmtdFreeData(&bnames);
+    }
+    pkg.nfiles = pl->nfiles - pkg.files;
+
+    if (pl->npkgs == pl->pkgsalloced) {
+	pl->pkgsalloced = pl->pkgsalloced ? pl->pkgsalloced * 2 : 256;
+	pl->pkgs = xrealloc(pl->pkgs, pl->pkgsalloced * sizeof(*pl->pkgs));
+    }
+    pos = pkgFind(pl, hdrNum);
+    memmove(pl->pkgs + pos + 1, pl->pkgs + pos,
+	    (pl->npkgs - pos) * sizeof(*pl->pkgs));
+    pl->pkgs[pos] = pkg;
+    pl->npkgs++;
+    free(evr);
+}
+
+void pkgListRemove(rpmdbPkgList pl, unsigned int hdrNum)
+{
+    unsigned int pos = pkgFind(pl, hdrNum);
+    struct rpmdbPkgListPkg_s pkg;
+
+    if (pos == pl->npkgs || pl->pkgs[pos].hdrNum != hdrNum)
+	return;
+
+    listOwn(pl);
+    pkg = pl->pkgs[pos];
+    memmove(pl->pkgs + pos, pl->pkgs + pos + 1,
+	    (pl->npkgs - pos - 1) * sizeof(*pl->pkgs));
+    pl->npkgs--;
+
+    /* Close the gaps in the dependency and file tables */
+    memmove(pl->deps + pkg.deps, pl->deps + pkg.deps + pkg.ndeps,
+	    (pl->ndeps - pkg.deps - pkg.ndeps) * sizeof(*pl->deps));
+    pl->ndeps -= pkg.ndeps;
+    memmove(pl->files + pkg.files, pl->files + pkg.files + pkg.nfiles,
+	    (pl->nfiles - pkg.files - pkg.nfiles) * sizeof(*pl->files));
+    pl->nfiles -= pkg.nfiles;
+    for (unsigned int i = 0; i < pl->npkgs; i++) {
+	if (pl->pkgs[i].deps > pkg.deps)
+	    pl->pkgs[i].deps -= pkg.ndeps;
+	if (pl->pkgs[i].files > pkg.files)
+	    pl->pkgs[i].files -= pkg.nfiles;
+    }
+}
+
+const struct rpmdbPkgListPkg_s *rpmdbPkgListPkgs(rpmdbPkgList pl,
+						 unsigned int *count)
+{
+    *count = pl ? pl->npkgs : 0;
+    return pl ? pl->pkgs : NULL;
+}
+
+const struct rpmdbPkgListDep_s *rpmdbPkgListDeps(rpmdbPkgList pl,
+				const struct rpmdbPkgListPkg_s *pkg)
+{
+    return pl->deps + pkg->deps;
+}
+
+const struct rpmdbPkgListFile_s *rpmdbPkgListFiles(rpmdbPkgList pl,
+				const struct rpmdbPkgListPkg_s *pkg)
+{
+    return pl->files + pkg->files;
+}
+
+const char *rpmdbPkgListStr(rpmdbPkgList pl, uint32_t off)
+{
+    return (pl && off < pl->strsize) ? pl->strings + off : NULL;
+}
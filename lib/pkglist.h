@@ -0,0 +1,99 @@
+#ifndef PKGLIST_H
+#define PKGLIST_H
+
+/** \file lib/pkglist.h
+ * Compact list of the packages in a rpmdb, for depsolvers.
+ *
+ * Names, versions, dependencies and files of every installed package, as
+ * flat tables indexing one string table. The list is stored next to the
+ * database and mapped read-only by later processes, tied to the state of
+ * the database file like the trigger index. The file format and the
+ * accessors are public in rpmdb.h.
+ */
+
+#include <rpm/rpmtypes.h>
+#include <rpm/rpmutil.h>
+#include <rpm/rpmdb.h>
+
+#include "lib/hdrshm.h"		/* struct hdrShmId_s */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Create an empty package list.
+ * @param id		identity of the database it's made from
+ * @return		new list
+ */
+RPM_GNUC_INTERNAL
+rpmdbPkgList pkgListNew(const struct hdrShmId_s *id);
+
+/**
+ * Map the package list stored for a database in its current state.
+ * @param path		list file path
+ * @param id		database identity
+ * @return		list, NULL if there's none or it's stale
+ */
+RPM_GNUC_INTERNAL
+rpmdbPkgList pkgListLoad(const char *path, const struct hdrShmId_s *id);
+
+/**
+ * Store a package list.
+ * @param pl		package list
+ * @param path		list file path
+ * @param id		identity of the database it now matches
+ * @return		0 on success, -1 on error
+ */
+RPM_GNUC_INTERNAL
+int pkgListWrite(rpmdbPkgList pl, const char *path,
+		 const struct hdrShmId_s *id);
+
+/**
+ * Free a package list.
+ * @param pl		package list (or NULL)
+ * @return		NULL always
+ */
+RPM_GNUC_INTERNAL
+rpmdbPkgList pkgListFree(rpmdbPkgList pl);
+
+/**
+ * Is the list made from the database in this state?
+ * @param pl		package list
+ * @param id		database identity
+ * @return		1 if it is, 0 otherwise
+ */
+RPM_GNUC_INTERNAL
+int pkgListMatches(rpmdbPkgList pl, const struct hdrShmId_s *id);
+
+/**
+ * Does the list need storing, ie was it created or changed since it
+ * was loaded or stored?
+ * @param pl		package list
+ * @return		1 if it has, 0 otherwise
+ */
+RPM_GNUC_INTERNAL
+int pkgListModified(rpmdbPkgList pl);
+
+/**
+ * Add a package.
+ * @param pl		package list
+ * @param hdrNum	package instance
+ * @param h		package header
+ */
+RPM_GNUC_INTERNAL
+void pkgListAdd(rpmdbPkgList pl, unsigned int hdrNum, Header h);
+
+/**
+ * Remove a package.
+ * @param pl		package list
+ * @param hdrNum	package instance
+ */
+RPM_GNUC_INTERNAL
+void pkgListRemove(rpmdbPkgList pl, unsigned int hdrNum);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PKGLIST_H */
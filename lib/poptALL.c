@@ -21,6 +21,7 @@
 #define POPT_UNDEFINE		-994
 #define POPT_PIPE		-993
 #define POPT_LOAD		-992
+#define POPT_STATSFORMAT	-991
 
 static int _debug = 0;
 
@@ -172,6 +173,16 @@ static void rpmcliAllArgCallback( poptContext con,
 	rpmDisplayQueryTags(stdout);
 	exit(EXIT_SUCCESS);
 	break;
+    case POPT_STATSFORMAT:
+	if (rstreq(arg, "json")) {
+	    _rpmts_stats = RPMTS_STATS_JSON;
+	} else if (rstreq(arg, "text")) {
+	    _rpmts_stats = RPMTS_STATS_TEXT;
+	} else {
+	    fprintf(stderr, _("unknown statistics format: %s\n"), arg);
+	    exit(EXIT_FAILURE);
+	}
+	break;
     case POPT_PIPE:
 	if (rpmcliPipeOutput) {
 	    fprintf(stderr,
@@ -276,6 +287,8 @@ struct poptOption rpmcliAllPoptTable[] = {
 	N_("disable user namespace support"), NULL},
  { "stats", '\0', POPT_ARG_VAL|POPT_ARGFLAG_DOC_HIDDEN, &_rpmts_stats, -1,
 	NULL, NULL},
+ { "stats-format", '\0', POPT_ARG_STRING|POPT_ARGFLAG_DOC_HIDDEN, NULL,
+	POPT_STATSFORMAT, NULL, N_("<text|json>")},
 
    POPT_TABLEEND
 };
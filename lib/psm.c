@@ -27,6 +27,9 @@
 #include "lib/rpmscript.h"
 #include "lib/misc.h"
 #include "lib/rpmtriggers.h"
+#include "lib/trigindex.h"
+#include "lib/rpmtrace.h"
+#include "lib/rpmprobes.h"
 
 #include "lib/rpmplugins.h"
 
@@ -41,6 +44,11 @@ struct rpmpsm_s {
     rpmCallbackType what;	/*!< Callback type. */
     rpm_loff_t amount;		/*!< Callback amount. */
     rpm_loff_t total;		/*!< Callback total. */
+    int quiet;			/*!< No callbacks (unpacking ahead) */
+    rpm_loff_t notified;	/*!< Amount of the last progress callback. */
+    struct rpmsw_s notifytime;	/*!< Time of the last progress callback. */
+    rpm_loff_t minbytes;	/*!< Bytes between progress callbacks. */
+    rpmtime_t minusecs;		/*!< Time between progress callbacks. */
 
     int nrefs;			/*!< Reference count. */
 };
@@ -251,7 +259,12 @@ static rpmRC runInstScript(rpmpsm psm, rpmTagVal scriptTag)
 
     if (script) {
 	headerGet(h, RPMTAG_INSTPREFIXES, &pfx, HEADERGET_ALLOC|HEADERGET_ARGV);
-	rc = runScript(psm->ts, psm->te, h, pfx.data, script, psm->scriptArg, -1);
+	if (rpmScriptCoalesceKey(script)) {
+	    rpmtsDeferScript(psm->ts, psm->te, pfx.data, script, psm->scriptArg);
+	    script = NULL;
+	} else {
+	    rc = runScript(psm->ts, psm->te, h, pfx.data, script, psm->scriptArg, -1);
+	}
 	rpmtdFreeData(&pfx);
     }
 
@@ -277,7 +290,9 @@ static rpmRC handleOneTrigger(rpmts ts, rpmte te, rpmsenseFlags sense,
 			Header sourceH, Header trigH, int countCorrection,
 			int arg2, unsigned char * triggersAlreadyRun)
 {
-    rpmds trigger = rpmdsInit(rpmdsNew(trigH, RPMTAG_TRIGGERNAME, 0));
+    rpmds trigger = rpmdsInit(rpmdsNewPool(rpmdbHeaderPool(rpmtsGetRdb(ts),
+							   trigH),
+					   trigH, RPMTAG_TRIGGERNAME, 0));
     struct rpmtd_s pfx;
     const char * sourceName = headerGetString(sourceH, RPMTAG_NAME);
     const char * triggerName = headerGetString(trigH, RPMTAG_NAME);
@@ -357,14 +372,43 @@ static rpmRC runTriggers(rpmpsm psm, rpmsenseFlags sense)
 
     {	Header triggeredH;
 	Header h = rpmteHeader(psm->te);
-	rpmdbMatchIterator mi;
+	rpmdb db = rpmtsGetRdb(ts);
+	trigIndex ti = rpmdbTriggerIndex(db);
+
+	if (ti) {
+	    /* Only load the packages with a trigger of this sense on N */
+	    const struct trigIndexItem_s *items;
+	    unsigned int nitems = trigIndexLookup(ti, RPMSCRIPT_NORMALTRIGGER,
+						  N, &items);
+	    unsigned int *hdrNums = xmalloc((nitems + 1) * sizeof(*hdrNums));
+	    unsigned int npkgs = 0;
+
+	    for (unsigned int i = 0; i < nitems; i++) {
+		if (!(items[i].sense & sense))
+		    continue;
+		if (npkgs && hdrNums[npkgs - 1] == items[i].hdrNum)
+		    continue;
+		hdrNums[npkgs++] = items[i].hdrNum;
+	    }
+	    for (unsigned int i = 0; i < npkgs; i++) {
+		triggeredH = rpmdbGetHeaderAt(db, hdrNums[i]);
+		if (triggeredH == NULL)
+		    continue;
+		nerrors += handleOneTrigger(ts, NULL, sense, h, triggeredH,
+					    0, numPackage, NULL);
+		headerFree(triggeredH);
+	    }
+	    free(hdrNums);
+	} else {
+	    rpmdbMatchIterator mi;
 
-	mi = rpmtsInitIterator(ts, RPMDBI_TRIGGERNAME, N, 0);
-	while ((triggeredH = rpmdbNextIterator(mi)) != NULL) {
-	    nerrors += handleOneTrigger(ts, NULL, sense, h, triggeredH,
-					0, numPackage, NULL);
+	    mi = rpmtsInitIterator(ts, RPMDBI_TRIGGERNAME, N, 0);
+	    while ((triggeredH = rpmdbNextIterator(mi)) != NULL) {
+		nerrors += handleOneTrigger(ts, NULL, sense, h, triggeredH,
+					    0, numPackage, NULL);
+	    }
+	    rpmdbFreeIterator(mi);
 	}
-	rpmdbFreeIterator(mi);
 	headerFree(h);
     }
 
@@ -507,14 +551,37 @@ static rpmpsm rpmpsmNew(rpmts ts, rpmte te, pkgGoal goal)
     if (goal == PKG_INSTALL || goal == PKG_ERASE) {
 	rpmlog(RPMLOG_DEBUG, "%s: %s has %d files\n", pkgGoalString(goal),
 	    rpmteNEVRA(psm->te), rpmfilesFC(psm->files));
+	/* Rate limits for the progress callbacks */
+	psm->minbytes = rpmExpandNumeric("%{?_progress_bytes}");
+	psm->minusecs = 1000 * rpmExpandNumeric("%{?_progress_interval}");
     }
 
     return psm;
 }
 
+/*
+ * Hold back a progress callback until the rate limits have passed since
+ * the last one. The first and last (complete) ones always go through.
+ */
+static int progressLimited(rpmpsm psm)
+{
+    struct rpmsw_s now;
+
+    if (psm->minbytes <= 0 && psm->minusecs <= 0)
+	return 0;
+    if (psm->amount == 0 || psm->amount >= psm->total)
+	return 0;
+    if (psm->minbytes > 0 && psm->amount - psm->notified < psm->minbytes)
+	return 1;
+    if (psm->minusecs > 0 &&
+	    rpmswDiff(rpmswNow(&now), &psm->notifytime) < psm->minusecs)
+	return 1;
+    return 0;
+}
+
 void rpmpsmNotify(rpmpsm psm, int what, rpm_loff_t amount)
 {
-    if (psm) {
+    if (psm && !psm->quiet) {
 	int changed = 0;
 	if (amount > psm->total)
 	    amount = psm->total;
@@ -524,10 +591,19 @@ void rpmpsmNotify(rpmpsm psm, int what, rpm_loff_t amount)
 	}
 	if (what && what != psm->what) {
 	    psm->what = what;
-	    changed = 1;
+	    changed = 2;
+	}
+	/* Other events and changes of event always go through */
+	if (changed == 1 && (psm->what == RPMCALLBACK_INST_PROGRESS ||
+			     psm->what == RPMCALLBACK_UNINST_PROGRESS) &&
+		progressLimited(psm)) {
+	    changed = 0;
 	}
 	if (changed) {
 	   rpmtsNotify(psm->ts, psm->te, psm->what, psm->amount, psm->total);
+	   psm->notified = psm->amount;
+	   if (psm->minusecs > 0)
+		rpmswNow(&psm->notifytime);
 	}
     }
 }
@@ -568,7 +644,11 @@ static rpmRC dbAdd(rpmts ts, rpmte te)
     headerPutUint32(h, RPMTAG_INSTALLCOLOR, &tscolor, 1);
 
     (void) rpmswEnter(rpmtsOp(ts, RPMTS_OP_DBADD), 0);
+    (void) rpmswEnter(rpmteOp(te, RPMTS_OP_DBADD), 0);
+    rpmtraceBegin("rpmdbAdd", rpmteNEVRA(te));
     rc = (rpmdbAdd(rpmtsGetRdb(ts), h) == 0) ? RPMRC_OK : RPMRC_FAIL;
+    rpmtraceEnd("rpmdbAdd", rpmteNEVRA(te));
+    (void) rpmswExit(rpmteOp(te, RPMTS_OP_DBADD), 0);
     (void) rpmswExit(rpmtsOp(ts, RPMTS_OP_DBADD), 0);
 
     if (rc == RPMRC_OK) {
@@ -582,11 +662,18 @@ static rpmRC dbAdd(rpmts ts, rpmte te)
 
 static rpmRC dbRemove(rpmts ts, rpmte te)
 {
+    /* An erased element carries the header of the instance, reuse it */
+    Header h = (rpmteType(te) == TR_REMOVED) ? rpmteHeader(te) : NULL;
     rpmRC rc;
 
     (void) rpmswEnter(rpmtsOp(ts, RPMTS_OP_DBREMOVE), 0);
-    rc = (rpmdbRemove(rpmtsGetRdb(ts), rpmteDBInstance(te)) == 0) ?
+    (void) rpmswEnter(rpmteOp(te, RPMTS_OP_DBREMOVE), 0);
+    rpmtraceBegin("rpmdbRemove", rpmteNEVRA(te));
+    rc = (rpmdbRemove(rpmtsGetRdb(ts), rpmteDBInstance(te), h) == 0) ?
 						RPMRC_OK : RPMRC_FAIL;
+    headerFree(h);
+    rpmtraceEnd("rpmdbRemove", rpmteNEVRA(te));
+    (void) rpmswExit(rpmteOp(te, RPMTS_OP_DBREMOVE), 0);
     (void) rpmswExit(rpmtsOp(ts, RPMTS_OP_DBREMOVE), 0);
 
     if (rc == RPMRC_OK)
@@ -605,10 +692,16 @@ static rpmRC rpmpsmUnpack(rpmpsm psm)
     /* make sure first progress call gets made */
     rpmpsmNotify(psm, RPMCALLBACK_INST_PROGRESS, 0);
 
-    if (!(rpmtsFlags(psm->ts) & RPMTRANS_FLAG_JUSTDB)) {
+    int aheadrc = rpmteUnpacked(psm->te, &failedFile, &saved_errno);
+    if (aheadrc >= 0) {
+	/* already done by rpmpsmUnpackAhead() */
+	fsmrc = aheadrc;
+    } else if (!(rpmtsFlags(psm->ts) & RPMTRANS_FLAG_JUSTDB)) {
 	if (rpmfilesFC(psm->files) > 0) {
+	    rpmtraceBegin("unpack", rpmteNEVRA(psm->te));
 	    fsmrc = rpmPackageFilesInstall(psm->ts, psm->te, psm->files,
 				   psm, &failedFile);
+	    rpmtraceEnd("unpack", rpmteNEVRA(psm->te));
 	    saved_errno = errno;
 	}
     }
@@ -636,6 +729,28 @@ static rpmRC rpmpsmUnpack(rpmpsm psm)
     return rc;
 }
 
+void rpmpsmUnpackAhead(rpmts ts, rpmte te)
+{
+    struct rpmpsm_s psm = {
+	.ts = ts,
+	.te = te,
+	.files = rpmteFiles(te),
+	.quiet = 1,
+    };
+    char *failedFile = NULL;
+    int fsmrc = 0;
+    int saved_errno = 0;
+
+    if (rpmfilesFC(psm.files) > 0) {
+	rpmtraceBegin("unpack", rpmteNEVRA(te));
+	fsmrc = rpmPackageFilesInstall(ts, te, psm.files, &psm, &failedFile);
+	rpmtraceEnd("unpack", rpmteNEVRA(te));
+	saved_errno = errno;
+    }
+    rpmteSetUnpacked(te, fsmrc, failedFile, saved_errno);
+    rpmfilesFree(psm.files);
+}
+
 static rpmRC rpmpsmRemove(rpmpsm psm)
 {
     char *failedFile = NULL;
@@ -648,8 +763,10 @@ static rpmRC rpmpsmRemove(rpmpsm psm)
     /* XXX should't we log errors from here? */
     if (!(rpmtsFlags(psm->ts) & RPMTRANS_FLAG_JUSTDB)) {
 	if (rpmfilesFC(psm->files) > 0) {
+	    rpmtraceBegin("remove", rpmteNEVRA(psm->te));
 	    fsmrc = rpmPackageFilesRemove(psm->ts, psm->te, psm->files,
 					  psm, &failedFile);
+	    rpmtraceEnd("remove", rpmteNEVRA(psm->te));
 	}
     }
     /* XXX make sure progress reaches 100% */
@@ -664,13 +781,18 @@ static rpmRC rpmPackageInstall(rpmts ts, rpmpsm psm)
 {
     rpmRC rc = RPMRC_OK;
     int once = 1;
+    int held = 0;
 
     rpmswEnter(rpmtsOp(psm->ts, RPMTS_OP_INSTALL), 0);
+    rpmswEnter(rpmteOp(psm->te, RPMTS_OP_INSTALL), 0);
     while (once--) {
 	/* HACK: replacepkgs abuses te instance to remove old header */
 	if (rpmtsFilterFlags(psm->ts) & RPMPROB_FILTER_REPLACEPKG)
 	    markReplacedInstance(ts, psm->te);
 
+	/* Stay in the chroot from the first scriptlet to the unpack */
+	rpmChrootHold();
+	held = 1;
 
 	if (!(rpmtsFlags(ts) & RPMTRANS_FLAG_NOTRIGGERPREIN)) {
 	    /* Run triggers in other package(s) this package sets off. */
@@ -693,6 +815,13 @@ static rpmRC rpmPackageInstall(rpmts ts, rpmpsm psm)
 	}
 	if (rc) break;
 
+	/* The database is updated with the real root in effect */
+	held = 0;
+	if (rpmChrootRelease()) {
+	    rc = RPMRC_FAIL;
+	    break;
+	}
+
 	if (!(rpmtsFlags(ts) & RPMTRANS_FLAG_NODB)) {
 	    /*
 	     * If this package has already been installed, remove it from
@@ -707,6 +836,9 @@ static rpmRC rpmPackageInstall(rpmts ts, rpmpsm psm)
 	    if (rc) break;
 	}
 
+	rpmChrootHold();
+	held = 1;
+
 	if (!(rpmtsFlags(ts) & RPMTRANS_FLAG_NOTRIGGERIN)) {
 	    /* Run upper file triggers i. e. with higher priorities */
 	    /* Run file triggers in other package(s) this package sets off. */
@@ -746,9 +878,18 @@ static rpmRC rpmPackageInstall(rpmts ts, rpmpsm psm)
 	    if (rc) break;
 	}
 
+	held = 0;
+	if (rpmChrootRelease()) {
+	    rc = RPMRC_FAIL;
+	    break;
+	}
+
 	rc = markReplacedFiles(psm);
     }
+    if (held)
+	rpmChrootRelease();
 
+    rpmswExit(rpmteOp(psm->te, RPMTS_OP_INSTALL), 0);
     rpmswExit(rpmtsOp(psm->ts, RPMTS_OP_INSTALL), 0);
 
     return rc;
@@ -758,9 +899,14 @@ static rpmRC rpmPackageErase(rpmts ts, rpmpsm psm)
 {
     rpmRC rc = RPMRC_OK;
     int once = 1;
+    int held = 0;
 
     rpmswEnter(rpmtsOp(psm->ts, RPMTS_OP_ERASE), 0);
+    rpmswEnter(rpmteOp(psm->te, RPMTS_OP_ERASE), 0);
     while (once--) {
+	/* Stay in the chroot over the scriptlets and the removal */
+	rpmChrootHold();
+	held = 1;
 
 	if (!(rpmtsFlags(ts) & RPMTRANS_FLAG_NOTRIGGERUN)) {
 	    /* Run file triggers in this package other package(s) set off. */
@@ -827,6 +973,12 @@ static rpmRC rpmPackageErase(rpmts ts, rpmpsm psm)
 	}
 	if (rc) break;
 
+	held = 0;
+	if (rpmChrootRelease()) {
+	    rc = RPMRC_FAIL;
+	    break;
+	}
+
 	if (!(rpmtsFlags(ts) & (RPMTRANS_FLAG_NOPOSTTRANS|RPMTRANS_FLAG_NOTRIGGERPOSTUN))) {
 	    /* Prepare post transaction uninstall triggers */
 	    rpmtriggersPrepPostUnTransFileTrigs(psm->ts, psm->te);
@@ -835,7 +987,10 @@ static rpmRC rpmPackageErase(rpmts ts, rpmpsm psm)
 	if (!(rpmtsFlags(ts) & RPMTRANS_FLAG_NODB))
 	    rc = dbRemove(ts, psm->te);
     }
+    if (held)
+	rpmChrootRelease();
 
+    rpmswExit(rpmteOp(psm->te, RPMTS_OP_ERASE), 0);
     rpmswExit(rpmtsOp(psm->ts, RPMTS_OP_ERASE), 0);
 
     return rc;
@@ -846,6 +1001,7 @@ static rpmRC rpmPackageRestore(rpmts ts, rpmpsm psm)
     rpmRC rc = RPMRC_OK;
 
     rpmswEnter(rpmtsOp(psm->ts, RPMTS_OP_INSTALL), 0);
+    rpmswEnter(rpmteOp(psm->te, RPMTS_OP_INSTALL), 0);
     if ((rc = rpmChrootIn()) == 0) {
 	char *failedFile = NULL;
 	rpmpsmNotify(psm, RPMCALLBACK_INST_START, 0);
@@ -867,6 +1023,7 @@ static rpmRC rpmPackageRestore(rpmts ts, rpmpsm psm)
 	free(failedFile);
 	rpmChrootOut();
     }
+    rpmswExit(rpmteOp(psm->te, RPMTS_OP_INSTALL), 0);
     rpmswExit(rpmtsOp(psm->ts, RPMTS_OP_INSTALL), 0);
 
     return rc;
@@ -937,8 +1094,15 @@ rpmRC rpmpsmRun(rpmts ts, rpmte te, pkgGoal goal)
 	rpmChrootOut();
     }
 
-    if (!rc)
+    if (!rc) {
+	const char *gname = pkgGoalString(goal);
+	gname += strspn(gname, " ");
+	RPM_PROBE2(psm_start, rpmteNEVRA(te), gname);
+	rpmtraceBegin(gname, rpmteNEVRA(te));
 	rc = runGoal(psm, goal);
+	rpmtraceEnd(gname, rpmteNEVRA(te));
+	RPM_PROBE3(psm_done, rpmteNEVRA(te), gname, rc);
+    }
 
     /* Run post transaction element hook for all plugins (even on failure) */
     if (rpmChrootIn() == 0) {
@@ -19,8 +19,10 @@
 #include <rpm/rpmfileutil.h>	/* rpmCleanPath */
 #include <rpm/rpmstring.h>
 
+#include "lib/rpmdb_internal.h"
 #include "lib/rpmgi.h"
 #include "lib/manifest.h"
+#include "lib/rpmworkers.h"
 
 #include "debug.h"
 
@@ -91,23 +93,45 @@ static void printFileInfo(const char * name,
     free(link);
 }
 
+static int queryOutput(void * data, const char * buf, size_t len)
+{
+    rpmlog(RPMLOG_NOTICE, "%.*s", (int) len, buf);
+    return 0;
+}
+
+/*
+ * Query formats are the same for every package, parse them only once.
+ * The output is written as it's formatted, large file lists don't need
+ * to be built up in memory first.
+ */
+static int queryFormat(Header h, const char * qfmt, errmsg_t * errstr)
+{
+    static __thread char *cachedstr = NULL;
+    static __thread headerCompiledFormat cached = NULL;
+
+    if (cached == NULL || !rstreq(cachedstr, qfmt)) {
+	cached = headerFormatFree(cached);
+	cachedstr = _free(cachedstr);
+	if ((cached = headerFormatCompile(qfmt, errstr)) == NULL)
+	    return -1;
+	cachedstr = xstrdup(qfmt);
+    }
+    return headerFormatWrite(cached, h, queryOutput, NULL, errstr);
+}
+
 int showQueryPackage(QVA_t qva, rpmts ts, Header h)
 {
     rpmfi fi = NULL;
-    rpmfiFlags fiflags =  (RPMFI_NOHEADER | RPMFI_FLAGS_QUERY);
+    /* The header outlives the iterator, let rpmfi load arrays on demand */
+    rpmfiFlags fiflags =  (RPMFI_KEEPHEADER | RPMFI_FLAGS_QUERY);
     int rc = 0;		/* XXX FIXME: need real return code */
     time_t now = 0;
 
     if (qva->qva_queryFormat != NULL) {
 	const char *errstr;
-	char *str = headerFormat(h, qva->qva_queryFormat, &errstr);
 
-	if ( str != NULL ) {
-	    rpmlog(RPMLOG_NOTICE, "%s", str);
-	    free(str);
-	} else {
+	if (queryFormat(h, qva->qva_queryFormat, &errstr))
 	    rpmlog(RPMLOG_ERR, _("incorrect format: %s\n"), errstr);
-	}
     }
 
     /* Inclusion flags traditionally imply list mode */
@@ -120,7 +144,8 @@ int showQueryPackage(QVA_t qva, rpmts ts, Header h)
     if (!(qva->qva_flags & QUERY_FOR_DUMPFILES))
 	fiflags |= RPMFI_NOFILEDIGESTS;
 
-    fi = rpmfiNew(ts, h, RPMTAG_BASENAMES, fiflags);
+    fi = rpmfiNewPool(rpmdbHeaderPool(rpmtsGetRdb(ts), h), h,
+		      RPMTAG_BASENAMES, fiflags);
     if (rpmfiFC(fi) <= 0) {
 	rpmlog(RPMLOG_NOTICE, _("(contains no files)\n"));
 	goto exit;
@@ -262,34 +287,149 @@ void rpmDisplayQueryTags(FILE * fp)
     rpmtdFree(names);
 }
 
+/* Headers waiting to be formatted in parallel, output in query order */
+struct queryBatch_s {
+    const char *qfmt;
+    int nthreads;
+    int size;
+    int nhdrs;
+    Header *hdrs;
+    char **strs;
+    char **errs;
+    headerCompiledFormat *cfmts;	/* per worker slot */
+};
+
+/* Only plain query formats are free of per package side effects */
+static int plainQueryFormat(QVA_t qva)
+{
+    return (qva->qva_showPackage == showQueryPackage &&
+	    qva->qva_queryFormat != NULL && !qva->qva_incattr &&
+	    !(qva->qva_flags & QUERY_FOR_LIST));
+}
+
+static struct queryBatch_s *queryBatchNew(QVA_t qva)
+{
+    struct queryBatch_s *qb = NULL;
+    int nthreads;
+
+    if (!plainQueryFormat(qva))
+	return NULL;
+
+    nthreads = rpmworkersCount("_query_threads");
+    if (nthreads > 1) {
+	qb = xcalloc(1, sizeof(*qb));
+	qb->qfmt = qva->qva_queryFormat;
+	qb->nthreads = nthreads;
+	qb->size = nthreads * 16;
+	qb->hdrs = xcalloc(qb->size, sizeof(*qb->hdrs));
+	qb->strs = xcalloc(qb->size, sizeof(*qb->strs));
+	qb->errs = xcalloc(qb->size, sizeof(*qb->errs));
+	qb->cfmts = xcalloc(nthreads, sizeof(*qb->cfmts));
+    }
+    return qb;
+}
+
+static void queryBatchFormat(void *data, int ix, int slot)
+{
+    struct queryBatch_s *qb = data;
+    errmsg_t errstr = NULL;
+
+    if (qb->cfmts[slot] == NULL)
+	qb->cfmts[slot] = headerFormatCompile(qb->qfmt, &errstr);
+    if (qb->cfmts[slot])
+	qb->strs[ix] = headerFormatApply(qb->cfmts[slot], qb->hdrs[ix], &errstr);
+    /* The message buffer is local to the worker thread */
+    if (qb->strs[ix] == NULL)
+	qb->errs[ix] = xstrdup(errstr ? errstr : "");
+}
+
+static void queryBatchFlush(struct queryBatch_s *qb)
+{
+    rpmworkersRun(qb->nthreads, qb->nhdrs, queryBatchFormat, qb);
+
+    for (int i = 0; i < qb->nhdrs; i++) {
+	if (qb->strs[i] != NULL) {
+	    rpmlog(RPMLOG_NOTICE, "%s", qb->strs[i]);
+	} else {
+	    rpmlog(RPMLOG_ERR, _("incorrect format: %s\n"), qb->errs[i]);
+	}
+	qb->hdrs[i] = headerFree(qb->hdrs[i]);
+	qb->strs[i] = _free(qb->strs[i]);
+	qb->errs[i] = _free(qb->errs[i]);
+    }
+    qb->nhdrs = 0;
+}
+
+static void queryBatchAdd(struct queryBatch_s *qb, Header h)
+{
+    qb->hdrs[qb->nhdrs++] = headerLink(h);
+    if (qb->nhdrs == qb->size)
+	queryBatchFlush(qb);
+}
+
+static struct queryBatch_s *queryBatchFree(struct queryBatch_s *qb)
+{
+    if (qb) {
+	queryBatchFlush(qb);
+	for (int i = 0; i < qb->nthreads; i++)
+	    headerFormatFree(qb->cfmts[i]);
+	free(qb->cfmts);
+	free(qb->errs);
+	free(qb->strs);
+	free(qb->hdrs);
+	free(qb);
+    }
+    return NULL;
+}
+
 static int rpmgiShowMatches(QVA_t qva, rpmts ts, rpmgi gi)
 {
+    struct queryBatch_s *qb = queryBatchNew(qva);
     int ec = 0;
     Header h;
 
     while ((h = rpmgiNext(gi)) != NULL) {
 	int rc;
 
-	if ((rc = qva->qva_showPackage(qva, ts, h)) != 0)
+	if (qb) {
+	    queryBatchAdd(qb, h);
+	} else if ((rc = qva->qva_showPackage(qva, ts, h)) != 0)
 	    ec = rc;
 	headerFree(h);
     }
+    queryBatchFree(qb);
     return ec + rpmgiNumErrors(gi);
 }
 
 static int rpmcliShowMatches(QVA_t qva, rpmts ts, rpmdbMatchIterator mi)
 {
+    struct queryBatch_s *qb = NULL;
     Header h;
     int ec = 0;
 
     if (mi == NULL)
 	return 1;
 
+    /* Skip importing what the format is not going to look at */
+    if (plainQueryFormat(qva)) {
+	headerCompiledFormat cfmt = headerFormatCompile(qva->qva_queryFormat,
+							NULL);
+	rpmTagVal *tags = headerFormatTags(cfmt);
+	if (tags)
+	    rpmdbSetIteratorTags(mi, tags);
+	free(tags);
+	headerFormatFree(cfmt);
+    }
+
+    qb = queryBatchNew(qva);
     while ((h = rpmdbNextIterator(mi)) != NULL) {
 	int rc;
-	if ((rc = qva->qva_showPackage(qva, ts, h)) != 0)
+	if (qb) {
+	    queryBatchAdd(qb, h);
+	} else if ((rc = qva->qva_showPackage(qva, ts, h)) != 0)
 	    ec = rc;
     }
+    queryBatchFree(qb);
     return ec;
 }
 
@@ -306,6 +446,82 @@ static rpmdbMatchIterator matchesIterator(rpmts ts, rpmDbiTag dbi,
     return mi;
 }
 
+/* Absolute and clean path of a file argument */
+static char *queryPath(const char *arg)
+{
+    const char *s;
+    char *fn;
+
+    for (s = arg; *s != '\0'; s++)
+	if (!(*s == '.' || *s == '/'))
+	    break;
+
+    if (*s == '\0') {
+	fn = realpath(arg, NULL);
+	if (!fn)
+	    fn = xstrdup(arg);
+    } else if (*arg != '/') {
+	char *curDir = rpmGetCwd();
+	fn = (char *) rpmGetPath(curDir, "/", arg, NULL);
+	free(curDir);
+    } else
+	fn = xstrdup(arg);
+    (void) rpmCleanPath(fn);
+    return fn;
+}
+
+static rpmDbiTagVal pathTag(QVA_t qva)
+{
+    return (qva->qva_source == RPMQV_PATH_ALL) ?
+	    RPMDBI_BASENAMES : RPMDBI_INSTFILENAMES;
+}
+
+/* Try file provides on paths no package has, complain if none has them */
+static rpmdbMatchIterator pathFallback(rpmts ts, const char *fn,
+				       rpmdbMatchIterator mi)
+{
+    if (mi == NULL)
+	mi = rpmtsInitIterator(ts, RPMDBI_PROVIDENAME, fn, 0);
+
+    if (mi == NULL) {
+	struct stat sb;
+	if (lstat(fn, &sb) != 0)
+	    rpmlog(RPMLOG_ERR, _("file %s: %s\n"), fn, strerror(errno));
+	else
+	    rpmlog(RPMLOG_NOTICE,
+		    _("file %s is not owned by any package\n"), fn);
+    }
+    return mi;
+}
+
+/*
+ * Query many paths at once: the owner lookups are done together, then
+ * the results shown in argument order.
+ */
+static int queryPaths(QVA_t qva, rpmts ts, ARGV_const_t argv)
+{
+    int npaths = argvCount(argv);
+    char **fns = xcalloc(npaths, sizeof(*fns));
+    rpmdbMatchIterator *mis = xcalloc(npaths, sizeof(*mis));
+    int ec = 0;
+
+    for (int i = 0; i < npaths; i++)
+	fns[i] = queryPath(argv[i]);
+
+    (void) rpmtsInitFileIterators(ts, pathTag(qva), (const char **) fns,
+				  npaths, mis);
+
+    for (int i = 0; i < npaths; i++) {
+	rpmdbMatchIterator mi = pathFallback(ts, fns[i], mis[i]);
+	ec += rpmcliShowMatches(qva, ts, mi);
+	rpmdbFreeIterator(mi);
+	free(fns[i]);
+    }
+    free(mis);
+    free(fns);
+    return ec;
+}
+
 static rpmdbMatchIterator initQueryIterator(QVA_t qva, rpmts ts, const char * arg)
 {
     const char * s;
@@ -443,40 +659,10 @@ static rpmdbMatchIterator initQueryIterator(QVA_t qva, rpmts ts, const char * ar
 	/* fallthrough on absolute and relative paths */
     case RPMQV_PATH:
     case RPMQV_PATH_ALL:
-    {   char * fn;
-
-	for (s = arg; *s != '\0'; s++)
-	    if (!(*s == '.' || *s == '/'))
-		break;
-
-	if (*s == '\0') {
-	    fn = realpath(arg, NULL);
-	    if (!fn)
-		fn = xstrdup(arg);
-	} else if (*arg != '/') {
-	    char *curDir = rpmGetCwd();
-	    fn = (char *) rpmGetPath(curDir, "/", arg, NULL);
-	    free(curDir);
-	} else
-	    fn = xstrdup(arg);
-	(void) rpmCleanPath(fn);
-
-	rpmDbiTagVal tag = RPMDBI_INSTFILENAMES;
-	if (qva->qva_source == RPMQV_PATH_ALL)
-	    tag = RPMDBI_BASENAMES;
-	mi = rpmtsInitIterator(ts, tag, fn, 0);
-	if (mi == NULL)
-	    mi = rpmtsInitIterator(ts, RPMDBI_PROVIDENAME, fn, 0);
-
-	if (mi == NULL) {
-	    struct stat sb;
-	    if (lstat(fn, &sb) != 0)
-		rpmlog(RPMLOG_ERR, _("file %s: %s\n"), fn, strerror(errno));
-	    else
-		rpmlog(RPMLOG_NOTICE,
-			_("file %s is not owned by any package\n"), fn);
-	}
+    {   char * fn = queryPath(arg);
 
+	mi = rpmtsInitIterator(ts, pathTag(qva), fn, 0);
+	mi = pathFallback(ts, fn, mi);
 	free(fn);
     }	break;
 
@@ -575,6 +761,13 @@ int rpmcliArgIter(rpmts ts, QVA_t qva, ARGV_const_t argv)
 	free(target);
 	break;
     }
+    case RPMQV_PATH:
+    case RPMQV_PATH_ALL:
+	if (argvCount(argv) > 1) {
+	    ec = queryPaths(qva, ts, argv);
+	    break;
+	}
+	/* fallthrough */
     default:
 	for (ARGV_const_t arg = argv; arg && *arg; arg++) {
 	    int ecLocal;
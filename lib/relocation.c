@@ -13,6 +13,18 @@
 
 #include "debug.h"
 
+#undef HASHTYPE
+#undef HTKEYTYPE
+#undef HTDATATYPE
+#define HASHTYPE dirIndexHash
+#define HTKEYTYPE const char *
+#define HTDATATYPE int
+#include "lib/rpmhash.H"
+#include "lib/rpmhashoa.C"
+#undef HASHTYPE
+#undef HTKEYTYPE
+#undef HTDATATYPE
+
 /**
  * Identify a file type.
  * @param ft		file type
@@ -33,13 +45,24 @@ const char * ftstring (rpmFileTypes ft)
     }
 }
 
-static char **duparray(char ** src, int size)
+/*
+ * Replace the string array of td with a private copy of the strings. The
+ * old table may be borrowed from the header (HEADERGET_MINMEM), so it's
+ * only freed when td owns it.
+ */
+static char **duparray(rpmtd td)
 {
+    int size = rpmtdCount(td);
+    char **src = td->data;
     char **dest = xmalloc((size+1) * sizeof(*dest));
     for (int i = 0; i < size; i++) {
 	dest[i] = xstrdup(src[i]);
     }
-    free(src);
+    dest[size] = NULL;
+    if (td->flags & RPMTD_ALLOCED)
+	free(src);
+    td->data = dest;
+    td->flags |= (RPMTD_ALLOCED | RPMTD_PTR_ALLOCED);
     return dest;
 }
 
@@ -118,18 +141,59 @@ static void saveOrig(Header h)
 	rpmtdFreeData(&td);
 }
 
+/*
+ * Return the relocation (the last one, the list is sorted) whose old path
+ * is a parent of the directory, or -1. Directory names end in '/'.
+ */
+static int dirRelocation(rpmRelocation *relocations, const size_t *rlens,
+			 int numRelocations, const char *dn, size_t dnlen)
+{
+    for (int j = numRelocations - 1; j >= 0; j--) {
+	size_t len = rlens[j];
+	if (relocations[j].oldPath == NULL) /* XXX can't happen */
+	    continue;
+	if (len < dnlen && dn[len] == '/' &&
+		rstreqn(relocations[j].oldPath, dn, len))
+	    return j;
+    }
+    return -1;
+}
+
+/* Index of the directory in the (partially relocated) list, or -1 */
+static int findDir(dirIndexHash *dirHash, char **dirNames, int dirCount,
+		   const char *dn)
+{
+    int *idx = NULL;
+
+    if (*dirHash == NULL) {
+	*dirHash = dirIndexHashCreate(dirCount * 2, rstrhash, strcmp,
+				      NULL, NULL);
+	for (int j = 0; j < dirCount; j++) {
+	    if (!dirIndexHashHasEntry(*dirHash, dirNames[j]))
+		dirIndexHashAddEntry(*dirHash, dirNames[j], j);
+	}
+    }
+    if (dirIndexHashGetEntry(*dirHash, dn, &idx, NULL, NULL))
+	return idx[0];
+    return -1;
+}
+
 void rpmRelocateFileList(rpmRelocation *relocations, int numRelocations, 
 			 rpmfs fs, Header h)
 {
     char ** baseNames;
     char ** dirNames;
     uint32_t * dirIndexes;
-    rpm_count_t fileCount, dirCount;
+    rpm_count_t fileCount, dirCount, origDirCount;
     int nrelocated = 0;
     int fileAlloced = 0;
     char * fn = NULL;
     int haveRelocatedBase = 0;
     size_t maxlen = 0;
+    size_t *rlens = NULL;
+    size_t *dlens = NULL;
+    int *dirRelocs = NULL;
+    dirIndexHash dirHash = NULL;
     int i, j;
     struct rpmtd_s bnames, dnames, dindexes, fmodes;
 
@@ -149,7 +213,11 @@ void rpmRelocateFileList(rpmRelocation *relocations, int numRelocations,
 	}
     }
 
+    /* The length of the old paths to match, "/" matches everything */
+    rlens = xcalloc(numRelocations, sizeof(*rlens));
     for (i = 0; i < numRelocations; i++) {
+	if (relocations[i].oldPath && !rstreq(relocations[i].oldPath, "/"))
+	    rlens[i] = strlen(relocations[i].oldPath);
 	if (relocations[i].newPath == NULL) continue;
 	size_t len = strlen(relocations[i].newPath);
 	if (len > maxlen) maxlen = len;
@@ -163,10 +231,22 @@ void rpmRelocateFileList(rpmRelocation *relocations, int numRelocations,
     baseNames = bnames.data;
     dirIndexes = dindexes.data;
     fileCount = rpmtdCount(&bnames);
-    dirCount = rpmtdCount(&dnames);
+    dirCount = origDirCount = rpmtdCount(&dnames);
     /* XXX TODO: use rpmtdDup() instead */
-    dirNames = dnames.data = duparray(dnames.data, dirCount);
-    dnames.flags |= RPMTD_PTR_ALLOCED;
+    dirNames = duparray(&dnames);
+
+    /*
+     * Files mostly get relocated along with their directory, so work out
+     * the relocation applying to each directory just once. That leaves
+     * only the relocations of complete file paths to check per file.
+     */
+    dlens = xmalloc(dirCount * sizeof(*dlens));
+    dirRelocs = xmalloc(dirCount * sizeof(*dirRelocs));
+    for (i = 0; i < dirCount; i++) {
+	dlens[i] = strlen(dirNames[i]);
+	dirRelocs[i] = dirRelocation(relocations, rlens, numRelocations,
+				     dirNames[i], dlens[i]);
+    }
 
     /*
      * For all relocations, we go through sorted file/relocation lists 
@@ -179,64 +259,35 @@ void rpmRelocateFileList(rpmRelocation *relocations, int numRelocations,
     for (i = fileCount - 1; i >= 0; i--) {
 	rpmFileTypes ft;
 	int fnlen;
+	size_t len;
+	uint32_t dx = dirIndexes[i];
+	size_t dnlen = dlens[dx];
+	size_t bnlen = strlen(baseNames[i]);
+
+	/* A later relocation on the complete path takes precedence */
+	for (j = numRelocations - 1; j > dirRelocs[dx]; j--) {
+	    const char *oldPath = relocations[j].oldPath;
+	    if (oldPath == NULL) /* XXX can't happen */
+		continue;
+	    if (rlens[j] == dnlen + bnlen && rstreqn(oldPath, dirNames[dx], dnlen)
+		    && rstreq(oldPath + dnlen, baseNames[i]))
+		break;
+	}
+	if (j < 0) continue;
 
-	size_t len = maxlen +
-		strlen(dirNames[dirIndexes[i]]) + strlen(baseNames[i]) + 1;
+	len = maxlen + dnlen + bnlen + 1;
 	if (len >= fileAlloced) {
 	    fileAlloced = len * 2;
 	    fn = xrealloc(fn, fileAlloced);
 	}
-
-assert(fn != NULL);		/* XXX can't happen */
-	*fn = '\0';
-	fnlen = stpcpy( stpcpy(fn, dirNames[dirIndexes[i]]), baseNames[i]) - fn;
-
-	/*
-	 * See if this file path needs relocating.
-	 */
-	/*
-	 * XXX FIXME: Would a bsearch of the (already sorted) 
-	 * relocation list be a good idea?
-	 */
-	for (j = numRelocations - 1; j >= 0; j--) {
-	    if (relocations[j].oldPath == NULL) /* XXX can't happen */
-		continue;
-	    len = !rstreq(relocations[j].oldPath, "/")
-		? strlen(relocations[j].oldPath)
-		: 0;
-
-	    if (fnlen < len)
-		continue;
-	    /*
-	     * Only subdirectories or complete file paths may be relocated. We
-	     * don't check for '\0' as our directory names all end in '/'.
-	     */
-	    if (!(fn[len] == '/' || fnlen == len))
-		continue;
-
-	    if (!rstreqn(relocations[j].oldPath, fn, len))
-		continue;
-	    break;
-	}
-	if (j < 0) continue;
+	fnlen = stpcpy(stpcpy(fn, dirNames[dx]), baseNames[i]) - fn;
+	len = rlens[j];
 
 	rpmtdSetIndex(&fmodes, i);
 	ft = rpmfiWhatis(rpmtdGetNumber(&fmodes));
 
 	/* On install, a relocate to NULL means skip the path. */
 	if (relocations[j].newPath == NULL) {
-	    if (ft == XDIR) {
-		/* Start with the parent, looking for directory to exclude. */
-		for (j = dirIndexes[i]; j < dirCount; j++) {
-		    len = strlen(dirNames[j]) - 1;
-		    while (len > 0 && dirNames[j][len-1] == '/') len--;
-		    if (fnlen != len)
-			continue;
-		    if (!rstreqn(fn, dirNames[j], fnlen))
-			continue;
-		    break;
-		}
-	    }
 	    rpmfsSetAction(fs, i, FA_SKIPNSTATE);
 	    rpmlog(RPMLOG_DEBUG, "excluding %s %s\n",
 		   ftstring(ft), fn);
@@ -260,8 +311,7 @@ assert(fn != NULL);		/* XXX can't happen */
 	    if (!rstreq(baseNames[i], te)) { /* basename changed too? */
 		if (!haveRelocatedBase) {
 		    /* XXX TODO: use rpmtdDup() instead */
-		    bnames.data = baseNames = duparray(baseNames, fileCount);
-		    bnames.flags |= RPMTD_PTR_ALLOCED;
+		    baseNames = duparray(&bnames);
 		    haveRelocatedBase = 1;
 		}
 		free(baseNames[i]);
@@ -271,15 +321,8 @@ assert(fn != NULL);		/* XXX can't happen */
 	}
 
 	/* Does this directory already exist in the directory list? */
-	for (j = 0; j < dirCount; j++) {
-	    if (fnlen != strlen(dirNames[j]))
-		continue;
-	    if (!rstreqn(fn, dirNames[j], fnlen))
-		continue;
-	    break;
-	}
-	
-	if (j < dirCount) {
+	j = findDir(&dirHash, dirNames, dirCount, fn);
+	if (j >= 0) {
 	    dirIndexes[i] = j;
 	    continue;
 	}
@@ -289,20 +332,24 @@ assert(fn != NULL);		/* XXX can't happen */
 			       sizeof(*dirNames) * (dirCount + 1));
 
 	dirNames[dirCount] = xstrdup(fn);
+	dirIndexHashAddEntry(dirHash, dirNames[dirCount], dirCount);
 	dirIndexes[i] = dirCount;
 	dirCount++;
 	dnames.count++;
     }
+    dirHash = dirIndexHashFree(dirHash);
 
     /* Finish off by relocating directories. */
     for (i = dirCount - 1; i >= 0; i--) {
+	/* Directories nothing applies to can be skipped right away */
+	if (i < origDirCount && dirRelocs[i] < 0)
+	    continue;
+
 	for (j = numRelocations - 1; j >= 0; j--) {
 
 	    if (relocations[j].oldPath == NULL) /* XXX can't happen */
 		continue;
-	    size_t len = !rstreq(relocations[j].oldPath, "/")
-		? strlen(relocations[j].oldPath)
-		: 0;
+	    size_t len = rlens[j];
 
 	    if (len && !rstreqn(relocations[j].oldPath, dirNames[i], len))
 		continue;
@@ -342,6 +389,9 @@ assert(fn != NULL);		/* XXX can't happen */
     rpmtdFreeData(&dnames);
     rpmtdFreeData(&dindexes);
     rpmtdFreeData(&fmodes);
+    free(dirRelocs);
+    free(dlens);
+    free(rlens);
     free(fn);
 }
 
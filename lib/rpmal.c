@@ -9,6 +9,7 @@
 #include <rpm/rpmfi.h>
 #include <rpm/rpmstring.h>
 #include <rpm/rpmstrpool.h>
+#include <rpm/rpmver.h>
 
 #include "lib/rpmal.h"
 #include "lib/misc.h"
@@ -49,6 +50,38 @@ typedef struct availableIndexEntry_s {
 #include "lib/rpmhash.H"
 #include "lib/rpmhash.C"
 
+/** \ingroup rpmdep
+ * A single Provides: dependency of an available package.
+ */
+typedef struct availableProvide_s {
+    rpmalNum pkgNum;	        /*!< Containing package index. */
+    unsigned int entryIx;	/*!< Dependency index. */
+    unsigned int seq;		/*!< Order of addition. */
+    uint8_t *key;		/*!< epoch:version collation key */
+    size_t keylen;
+} * availableProvide;
+
+/** \ingroup rpmdep
+ * All providers of a single name. Versioned (= E:V-R) provides are kept
+ * sorted by epoch:version so lookups can binary search for the matching
+ * range, everything else is compared one by one.
+ */
+typedef struct availableProvides_s {
+    struct availableProvide_s *sorted;
+    struct availableProvide_s *other;
+    int nsorted, nother;
+    int asorted, aother;
+} * availableProvides;
+
+#undef HASHTYPE
+#undef HTKEYTYPE
+#undef HTDATATYPE
+#define HASHTYPE rpmalProvHash
+#define HTKEYTYPE rpmsid
+#define HTDATATYPE availableProvides
+#include "lib/rpmhash.H"
+#include "lib/rpmhash.C"
+
 typedef struct availableIndexFileEntry_s {
     rpmsid dirName;
     rpmalNum pkgNum;	        /*!< Containing package index. */
@@ -70,7 +103,8 @@ typedef struct availableIndexFileEntry_s {
 struct rpmal_s {
     rpmstrPool pool;		/*!< String pool */
     availablePackage list;	/*!< Set of packages. */
-    rpmalDepHash providesHash;
+    rpmalProvHash providesHash;
+    unsigned int provSeq;	/*!< Provides added to index so far. */
     rpmalDepHash obsoletesHash;
     rpmalFileHash fileHash;
     int delta;			/*!< Delta for pkg list reallocation. */
@@ -88,7 +122,7 @@ struct rpmal_s {
  */
 static void rpmalFreeIndex(rpmal al)
 {
-    al->providesHash = rpmalDepHashFree(al->providesHash);
+    al->providesHash = rpmalProvHashFree(al->providesHash);
     al->obsoletesHash = rpmalDepHashFree(al->obsoletesHash);
     al->fileHash = rpmalFileHashFree(al->fileHash);
     al->fpc = fpCacheFree(al->fpc);
@@ -137,6 +171,15 @@ rpmal rpmalFree(rpmal al)
     return NULL;
 }
 
+void rpmalCleanFiles(rpmal al)
+{
+    if (al == NULL)
+	return;
+
+    for (int i = 0; i < al->size; i++)
+	al->list[i].fi = rpmfilesFree(al->list[i].fi);
+}
+
 static unsigned int sidHash(rpmsid sid)
 {
     return sid;
@@ -198,15 +241,119 @@ static void rpmalAddFiles(rpmal al, rpmalNum pkgNum, rpmfiles fi)
     }
 }
 
+static availableProvides provsFree(availableProvides provs)
+{
+    if (provs) {
+	for (int i = 0; i < provs->nsorted; i++)
+	    free(provs->sorted[i].key);
+	free(provs->sorted);
+	free(provs->other);
+	free(provs);
+    }
+    return NULL;
+}
+
+/*
+ * Calculate the epoch:version collation key for an EVR. Only EVRs with
+ * a numeric (or no) epoch can be ordered consistently with rpmvercmp(),
+ * return 0 on anything else.
+ */
+static int provKey(const char *evr, uint8_t **keyp, size_t *keylenp)
+{
+    rpmver rv = rpmverParse(evr);
+    const char *e, *v;
+    uint8_t *ekey, *vkey;
+    size_t elen, vlen;
+
+    if (rv == NULL)
+	return 0;
+
+    e = rpmverE(rv) ? rpmverE(rv) : "0";
+    v = rpmverV(rv);
+    for (const char *s = e; *s; s++) {
+	if (!risdigit(*s)) {
+	    rpmverFree(rv);
+	    return 0;
+	}
+    }
+
+    /* Keys are never prefixes of each other, concatenation sorts ok */
+    ekey = rpmverkey(e, &elen);
+    vkey = rpmverkey(v, &vlen);
+    *keyp = xrealloc(ekey, elen + vlen);
+    memcpy(*keyp + elen, vkey, vlen);
+    *keylenp = elen + vlen;
+
+    free(vkey);
+    rpmverFree(rv);
+    return 1;
+}
+
+/* Find the first sorted provide whose key is > (or >= if !upper) key */
+static int provBound(availableProvides provs, const uint8_t *key,
+		     size_t keylen, int upper)
+{
+    int lo = 0, hi = provs->nsorted;
+    while (lo < hi) {
+	int mid = lo + (hi - lo) / 2;
+	availableProvide prov = &provs->sorted[mid];
+	int cmp = rpmverkeycmp(prov->key, prov->keylen, key, keylen);
+	if (cmp < 0 || (upper && cmp == 0))
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    return lo;
+}
+
+static void rpmalAddProvide(rpmal al, rpmalNum pkgNum, rpmds provides, int ix)
+{
+    struct availableProvide_s prov = {
+	.pkgNum = pkgNum,
+	.entryIx = ix,
+	.seq = al->provSeq++,
+    };
+    rpmsid nameId = rpmdsNIdIndex(provides, ix);
+    rpmsenseFlags flags = rpmdsFlagsIndex(provides, ix) & RPMSENSE_SENSEMASK;
+    const char *evr = rpmdsEVRIndex(provides, ix);
+    availableProvides *provsp = NULL;
+    availableProvides provs;
+
+    if (rpmalProvHashGetEntry(al->providesHash, nameId, &provsp, NULL, NULL)) {
+	provs = provsp[0];
+    } else {
+	provs = xcalloc(1, sizeof(*provs));
+	rpmalProvHashAddEntry(al->providesHash, nameId, provs);
+    }
+
+    if (flags == RPMSENSE_EQUAL && evr && *evr &&
+		provKey(evr, &prov.key, &prov.keylen)) {
+	int pos = provBound(provs, prov.key, prov.keylen, 1);
+	if (provs->nsorted == provs->asorted) {
+	    provs->asorted = provs->asorted ? provs->asorted * 2 : 4;
+	    provs->sorted = xrealloc(provs->sorted,
+				     provs->asorted * sizeof(*provs->sorted));
+	}
+	memmove(provs->sorted + pos + 1, provs->sorted + pos,
+		(provs->nsorted - pos) * sizeof(*provs->sorted));
+	provs->sorted[pos] = prov;
+	provs->nsorted++;
+    } else {
+	if (provs->nother == provs->aother) {
+	    provs->aother = provs->aother ? provs->aother * 2 : 4;
+	    provs->other = xrealloc(provs->other,
+				    provs->aother * sizeof(*provs->other));
+	}
+	provs->other[provs->nother++] = prov;
+    }
+}
+
 static void rpmalAddProvides(rpmal al, rpmalNum pkgNum, rpmds provides)
 {
-    struct availableIndexEntry_s indexEntry;
     rpm_color_t dscolor;
     int skipconf = (al->tsflags & RPMTRANS_FLAG_NOCONFIGS);
     int dc = rpmdsCount(provides);
 
-    indexEntry.pkgNum = pkgNum;
-
     for (int i = 0; i < dc; i++) {
         /* Ignore colored provides not in our rainbow. */
         dscolor = rpmdsColorIndex(provides, i);
@@ -217,9 +364,7 @@ static void rpmalAddProvides(rpmal al, rpmalNum pkgNum, rpmds provides)
 	if (skipconf & (rpmdsFlagsIndex(provides, i) & RPMSENSE_CONFIG))
 	    continue;
 
-	indexEntry.entryIx = i;;
-	rpmalDepHashAddEntry(al->providesHash,
-				  rpmdsNIdIndex(provides, i), indexEntry);
+	rpmalAddProvide(al, pkgNum, provides, i);
     }
 }
 
@@ -303,8 +448,8 @@ static void rpmalMakeProvidesIndex(rpmal al)
 	providesCnt += rpmdsCount(alp->provides);
     }
 
-    al->providesHash = rpmalDepHashCreate(providesCnt/4+128,
-					       sidHash, sidCmp, NULL, NULL);
+    al->providesHash = rpmalProvHashCreate(providesCnt/4+128,
+					       sidHash, sidCmp, NULL, provsFree);
     for (i = 0; i < al->size; i++) {
 	alp = al->list + i;
 	rpmalAddProvides(al, i, alp->provides);
@@ -329,6 +474,19 @@ static void rpmalMakeObsoletesIndex(rpmal al)
     }
 }
 
+void rpmalMakeIndex(rpmal al)
+{
+    if (al == NULL)
+	return;
+    if (al->providesHash == NULL)
+	rpmalMakeProvidesIndex(al);
+    if (al->fileHash == NULL)
+	rpmalMakeFileIndex(al);
+    /* the fingerprint cache itself is thread-safe */
+    if (al->fpc == NULL)
+	al->fpc = fpCacheCreate(1001, al->pool);
+}
+
 rpmte * rpmalAllObsoletes(rpmal al, rpmds ds)
 {
     rpmte * ret = NULL;
@@ -431,17 +589,38 @@ static rpmte * rpmalAllFileSatisfiesDepend(const rpmal al, const char *fileName,
     return ret;
 }
 
+static int provSeqCmp(const void *a, const void *b)
+{
+    const struct availableProvide_s *pa = *(availableProvide *)a;
+    const struct availableProvide_s *pb = *(availableProvide *)b;
+    return (pa->seq > pb->seq) - (pa->seq < pb->seq);
+}
+
+/* Add a range of provides to candidates */
+static void addCands(availableProvide *cands, int *ncands,
+		     availableProvide provs, int n)
+{
+    for (int i = 0; i < n; i++)
+	cands[(*ncands)++] = &provs[i];
+}
+
 rpmte * rpmalAllSatisfiesDepend(const rpmal al, const rpmds ds)
 {
     rpmte * ret = NULL;
     int i, ix, found;
     rpmsid nameId;
     const char *name;
-    availableIndexEntry result;
-    int resultCnt;
+    availableProvides *provsp = NULL;
+    availableProvides provs;
+    availableProvide *cands;
+    int ncands = 0;
     int obsolete;
     rpmTagVal dtag;
     rpmds filterds = NULL;
+    rpmsenseFlags dsflags;
+    const char *dsevr;
+    uint8_t *key = NULL;
+    size_t keylen = 0;
 
     availablePackage alp;
     int rc;
@@ -468,21 +647,53 @@ rpmte * rpmalAllSatisfiesDepend(const rpmal al, const rpmds ds)
     if (al->providesHash == NULL)
 	rpmalMakeProvidesIndex(al);
 
-    rpmalDepHashGetEntry(al->providesHash, nameId, &result,
-			      &resultCnt, NULL);
+    if (!rpmalProvHashGetEntry(al->providesHash, nameId, &provsp, NULL, NULL))
+	return NULL;
+    provs = provsp[0];
+
+    cands = xmalloc((provs->nsorted + provs->nother) * sizeof(*cands));
+    addCands(cands, &ncands, provs->other, provs->nother);
+
+    dsflags = rpmdsFlags(ds) & RPMSENSE_SENSEMASK;
+    dsevr = rpmdsEVR(ds);
+    if (!obsolete && dsflags && dsevr && *dsevr &&
+		provKey(dsevr, &key, &keylen)) {
+	/*
+	 * Versioned lookup: sorted provides with a lower epoch:version
+	 * only match "less" and ones with a higher one only "greater"
+	 * dependencies. Only those with an equal epoch:version need
+	 * checking, the release decides.
+	 */
+	int lo = provBound(provs, key, keylen, 0);
+	int hi = provBound(provs, key, keylen, 1);
+	if (dsflags & RPMSENSE_LESS)
+	    addCands(cands, &ncands, provs->sorted, lo);
+	addCands(cands, &ncands, provs->sorted + lo, hi - lo);
+	if (dsflags & RPMSENSE_GREATER)
+	    addCands(cands, &ncands, provs->sorted + hi, provs->nsorted - hi);
+	free(key);
+    } else {
+	addCands(cands, &ncands, provs->sorted, provs->nsorted);
+    }
+
+    if (ncands == 0) {
+	free(cands);
+	return NULL;
+    }
 
-    if (resultCnt==0) return NULL;
+    /* Preserve the order in which the providers were added */
+    qsort(cands, ncands, sizeof(*cands), provSeqCmp);
 
-    ret = xmalloc((resultCnt+1) * sizeof(*ret));
+    ret = xmalloc((ncands+1) * sizeof(*ret));
 
-    for (found=i=0; i<resultCnt; i++) {
-	alp = al->list + result[i].pkgNum;
+    for (found=i=0; i<ncands; i++) {
+	alp = al->list + cands[i]->pkgNum;
 	if (alp->p == NULL) /* deleted */
 	    continue;
 	/* ignore self-conflicts/obsoletes */
 	if (filterds && rpmteDS(alp->p, rpmdsTagN(filterds)) == filterds)
 	    continue;
-	ix = result[i].entryIx;
+	ix = cands[i]->entryIx;
 
 	if (obsolete) {
 	    /* Obsoletes are on package NEVR only */
@@ -498,6 +709,7 @@ rpmte * rpmalAllSatisfiesDepend(const rpmal al, const rpmds ds)
 	if (rc)
 	    ret[found++] = alp->p;
     }
+    free(cands);
 
     if (found) {
 	rpmdsNotify(ds, "(added provide)", 0);
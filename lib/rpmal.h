@@ -48,6 +48,24 @@ void rpmalDel(rpmal al, rpmte p);
 RPM_GNUC_INTERNAL
 void rpmalAdd(rpmal al, rpmte p);
 
+/**
+ * Drop the file info set references held by the available list.
+ * An already built file index remains valid, otherwise the packages
+ * appear to have no files from here on, same as their elements.
+ * @param al		available list
+ */
+RPM_GNUC_INTERNAL
+void rpmalCleanFiles(rpmal al);
+
+/**
+ * Build the lookup indexes of the available list up front.
+ * Afterwards rpmalAllSatisfiesDepend() can be called from several
+ * threads at once, as long as the list isn't modified meanwhile.
+ * @param al		available list
+ */
+RPM_GNUC_INTERNAL
+void rpmalMakeIndex(rpmal al);
+
 /**
  * Lookup all obsoleters for a dependency in the available list
  * @param al		available list
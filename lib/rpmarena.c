@@ -0,0 +1,87 @@
+#include "system.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "lib/rpmarena.h"
+
+#include "debug.h"
+
+#define ARENA_BLOCKSIZE (64 * 1024)
+
+/* Strictest alignment a plain malloc() would give us */
+union arenaAlign_u {
+    long double ld;
+    long long ll;
+    void *p;
+};
+#define ARENA_ALIGN (sizeof(union arenaAlign_u))
+
+struct arenaBlock_s {
+    struct arenaBlock_s *next;
+    size_t size;		/*!< usable bytes in data */
+    size_t used;		/*!< bytes handed out */
+    union arenaAlign_u data[];
+};
+
+struct rpmarena_s {
+    struct arenaBlock_s *blocks;	/*!< current block first */
+    size_t blocksize;
+};
+
+static struct arenaBlock_s *newBlock(rpmarena arena, size_t size)
+{
+    struct arenaBlock_s *b = xmalloc(sizeof(*b) + size);
+    b->size = size;
+    b->used = 0;
+    b->next = arena->blocks;
+    arena->blocks = b;
+    return b;
+}
+
+rpmarena rpmarenaCreate(size_t blocksize)
+{
+    rpmarena arena = xcalloc(1, sizeof(*arena));
+    arena->blocksize = blocksize ? blocksize : ARENA_BLOCKSIZE;
+    return arena;
+}
+
+void * rpmarenaAlloc(rpmarena arena, size_t size)
+{
+    struct arenaBlock_s *b = arena->blocks;
+    void *ptr;
+
+    size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+    if (b == NULL || b->size - b->used < size) {
+	if (size > arena->blocksize / 4) {
+	    /* Big ones get a block of their own, behind the current one */
+	    b = newBlock(arena, size);
+	    if (b->next) {
+		arena->blocks = b->next;
+		b->next = arena->blocks->next;
+		arena->blocks->next = b;
+	    }
+	} else {
+	    b = newBlock(arena, arena->blocksize);
+	}
+    }
+
+    ptr = (char *)b->data + b->used;
+    b->used += size;
+    memset(ptr, 0, size);
+    return ptr;
+}
+
+rpmarena rpmarenaFree(rpmarena arena)
+{
+    if (arena) {
+	struct arenaBlock_s *b, *next;
+	for (b = arena->blocks; b; b = next) {
+	    next = b->next;
+	    free(b);
+	}
+	free(arena);
+    }
+    return NULL;
+}
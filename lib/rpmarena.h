@@ -0,0 +1,48 @@
+#ifndef RPMARENA_H
+#define RPMARENA_H
+
+/** \file lib/rpmarena.h
+ * Bump allocator for many small objects sharing one lifetime.
+ */
+
+#include <stddef.h>
+#include <rpm/rpmutil.h>
+
+typedef struct rpmarena_s * rpmarena;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Create a new arena.
+ * @param blocksize	allocation granularity (0 for default)
+ * @return		new arena
+ */
+RPM_GNUC_INTERNAL
+rpmarena rpmarenaCreate(size_t blocksize);
+
+/**
+ * Allocate zeroed, suitably aligned memory from an arena.
+ * The memory can't be freed individually, only all at once with
+ * rpmarenaFree(). Arenas are not thread-safe.
+ * @param arena		arena
+ * @param size		number of bytes
+ * @return		pointer to memory
+ */
+RPM_GNUC_INTERNAL
+void * rpmarenaAlloc(rpmarena arena, size_t size);
+
+/**
+ * Free an arena along with all memory allocated from it.
+ * @param arena		arena
+ * @return		NULL always
+ */
+RPM_GNUC_INTERNAL
+rpmarena rpmarenaFree(rpmarena arena);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* RPMARENA_H */
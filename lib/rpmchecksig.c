@@ -21,6 +21,7 @@
 #include "lib/rpmlead.h"
 #include "lib/header_internal.h"
 #include "lib/rpmvs.h"
+#include "lib/rpmworkers.h"
 
 #include "debug.h"
 
@@ -105,16 +106,20 @@ int rpmcliImportPubkeys(rpmts ts, ARGV_const_t argv)
     return res;
 }
 
+/* Payload read size, large reads keep the digest loops busy */
+#define READFILE_BUFSIZ	(256 * 1024)
+
 static int readFile(FD_t fd, char **msg)
 {
-    unsigned char buf[4*BUFSIZ];
+    unsigned char *buf = xmalloc(READFILE_BUFSIZ);
     ssize_t count;
 
     /* Read the payload from the package. */
-    while ((count = Fread(buf, sizeof(buf[0]), sizeof(buf), fd)) > 0) {}
+    while ((count = Fread(buf, sizeof(buf[0]), READFILE_BUFSIZ, fd)) > 0) {}
     if (count < 0)
 	rasprintf(msg, _("Fread failed: %s"), Fstrerror(fd));
 
+    free(buf);
     return (count != 0);
 }
 
@@ -122,6 +127,7 @@ struct vfydata_s {
     int seen;
     int bad;
     int verbose;
+    char *out;		/*!< collected notice output */
 };
 
 static int vfyCb(struct rpmsinfo_s *sinfo, void *cbdata)
@@ -132,7 +138,7 @@ static int vfyCb(struct rpmsinfo_s *sinfo, void *cbdata)
 	vd->bad |= sinfo->type;
     if (vd->verbose) {
 	char *vsmsg = rpmsinfoMsg(sinfo);
-	rpmlog(RPMLOG_NOTICE, "    %s\n", vsmsg);
+	rstrscat(&vd->out, "    ", vsmsg, "\n", NULL);
 	free(vsmsg);
     }
     return 1;
@@ -176,8 +182,9 @@ rpmRC rpmpkgRead(struct rpmvs_s *vs, FD_t fd,
     rpmvsAppendTag(vs, blob, RPMTAG_PAYLOADDIGEST);
     rpmvsAppendTag(vs, blob, RPMTAG_PAYLOADDIGESTALT);
 
-    /* If needed and not explicitly disabled, read the payload as well. */
-    if (rpmvsRange(vs) & RPMSIG_PAYLOAD) {
+    /* If needed and not explicitly disabled (or cached), read the payload. */
+    if ((rpmvsRange(vs) & RPMSIG_PAYLOAD) &&
+		!rpmvsCacheLookup(vs, fd, sigblob, blob)) {
 	/* Initialize digests ranging over the payload only */
 	rpmvsInitRange(vs, RPMSIG_PAYLOAD);
 
@@ -207,18 +214,25 @@ exit:
     return rc;
 }
 
-static int rpmpkgVerifySigs(rpmKeyring keyring, int vfylevel, rpmVSFlags flags,
-			   FD_t fd, const char *fn)
+/*
+ * Verify a package, collecting the notice and error output in out and
+ * err instead of logging it directly so that the results of packages
+ * checked in parallel can be output in order.
+ */
+static int pkgVerifySigs(rpmKeyring keyring, int vfylevel, rpmVSFlags flags,
+			 FD_t fd, const char *fn, char **out, char **err)
 {
     char *msg = NULL;
     struct vfydata_s vd = { .seen = 0,
 			    .bad = 0,
 			    .verbose = rpmIsVerbose(),
+			    .out = NULL,
     };
     int rc;
     struct rpmvs_s *vs = rpmvsCreate(vfylevel, flags, keyring);
 
-    rpmlog(RPMLOG_NOTICE, "%s:%s", fn, vd.verbose ? "\n" : "");
+    rpmvsEnableCache(vs);
+    rstrscat(&vd.out, fn, ":", vd.verbose ? "\n" : "", NULL);
 
     rc = rpmpkgRead(vs, fd, NULL, NULL, &msg);
 
@@ -229,24 +243,46 @@ static int rpmpkgVerifySigs(rpmKeyring keyring, int vfylevel, rpmVSFlags flags,
 
     if (!vd.verbose) {
 	if (vd.seen & RPMSIG_DIGEST_TYPE) {
-	    rpmlog(RPMLOG_NOTICE, " %s", (vd.bad & RPMSIG_DIGEST_TYPE) ?
-					_("DIGESTS") : _("digests"));
+	    rstrscat(&vd.out, " ", (vd.bad & RPMSIG_DIGEST_TYPE) ?
+				    _("DIGESTS") : _("digests"), NULL);
 	}
 	if (vd.seen & RPMSIG_SIGNATURE_TYPE) {
-	    rpmlog(RPMLOG_NOTICE, " %s", (vd.bad & RPMSIG_SIGNATURE_TYPE) ?
-					_("SIGNATURES") : _("signatures"));
+	    rstrscat(&vd.out, " ", (vd.bad & RPMSIG_SIGNATURE_TYPE) ?
+				    _("SIGNATURES") : _("signatures"), NULL);
 	}
-	rpmlog(RPMLOG_NOTICE, " %s\n", rc ? _("NOT OK") : _("OK"));
+	rstrscat(&vd.out, " ", rc ? _("NOT OK") : _("OK"), "\n", NULL);
     }
 
 exit:
     if (rc && msg)
-	rpmlog(RPMLOG_ERR, "%s: %s\n", Fdescr(fd), msg);
+	rasprintf(err, "%s: %s\n", Fdescr(fd), msg);
+    *out = vd.out;
     rpmvsFree(vs);
     free(msg);
     return rc;
 }
 
+static void pkgVerifyOutput(char *out, char *err)
+{
+    if (out)
+	rpmlog(RPMLOG_NOTICE, "%s", out);
+    if (err)
+	rpmlog(RPMLOG_ERR, "%s", err);
+}
+
+static int rpmpkgVerifySigs(rpmKeyring keyring, int vfylevel, rpmVSFlags flags,
+			   FD_t fd, const char *fn)
+{
+    char *out = NULL;
+    char *err = NULL;
+    int rc = pkgVerifySigs(keyring, vfylevel, flags, fd, fn, &out, &err);
+
+    pkgVerifyOutput(out, err);
+    free(out);
+    free(err);
+    return rc;
+}
+
 /* Wrapper around rpmkVerifySigs to preserve API */
 int rpmVerifySignatures(QVA_t qva, rpmts ts, FD_t fd, const char * fn)
 {
@@ -261,13 +297,52 @@ int rpmVerifySignatures(QVA_t qva, rpmts ts, FD_t fd, const char * fn)
     return rc;
 }
 
+struct checksigPkg_s {
+    const char *fn;
+    char *out;
+    char *err;
+    int rc;
+};
+
+struct checksigWork_s {
+    struct checksigPkg_s *pkgs;
+    rpmKeyring *keyrings;	/*!< keyring per worker slot */
+    rpmVSFlags vsflags;
+    int vfylevel;
+};
+
+static void checksigRun(void *data, int ix, int slot)
+{
+    struct checksigWork_s *work = data;
+    struct checksigPkg_s *pkg = &work->pkgs[ix];
+    FD_t fd = Fopen(pkg->fn, "r.ufdio");
+
+    if (fd == NULL || Ferror(fd)) {
+	rasprintf(&pkg->err, _("%s: open failed: %s\n"),
+		  pkg->fn, Fstrerror(fd));
+	pkg->rc = 1;
+    } else {
+	pkg->rc = pkgVerifySigs(work->keyrings[slot], work->vfylevel,
+				work->vsflags, fd, pkg->fn,
+				&pkg->out, &pkg->err);
+    }
+    Fclose(fd);
+}
+
+/*
+ * With %_checksig_threads, packages are checked in batches by a pool of
+ * threads, each with a keyring of its own. Output is collected per
+ * package and logged in argument order once the batch is done.
+ */
 int rpmcliVerifySignatures(rpmts ts, ARGV_const_t argv)
 {
-    const char * arg;
     int res = 0;
-    rpmKeyring keyring = rpmtsGetKeyring(ts, 1);
+    int nthreads = rpmworkersCount("_checksig_threads");
+    int batchsize = (nthreads > 1) ? nthreads * 4 : 1;
+    int nargs = argvCount(argv);
     rpmVSFlags vsflags = rpmtsVfyFlags(ts);
     int vfylevel = rpmtsVfyLevel(ts);
+    struct checksigWork_s work;
 
     vsflags |= rpmcliVSFlags;
     if (rpmcliVfyLevelMask) {
@@ -275,18 +350,41 @@ int rpmcliVerifySignatures(rpmts ts, ARGV_const_t argv)
 	rpmtsSetVfyLevel(ts, vfylevel);
     }
 
-    while ((arg = *argv++) != NULL) {
-	FD_t fd = Fopen(arg, "r.ufdio");
-	if (fd == NULL || Ferror(fd)) {
-	    rpmlog(RPMLOG_ERR, _("%s: open failed: %s\n"), 
-		     arg, Fstrerror(fd));
-	    res++;
-	} else if (rpmpkgVerifySigs(keyring, vfylevel, vsflags, fd, arg)) {
-	    res++;
+    if (nthreads > nargs)
+	nthreads = (nargs > 0) ? nargs : 1;
+
+    work.vsflags = vsflags;
+    work.vfylevel = vfylevel;
+    work.pkgs = xcalloc(batchsize, sizeof(*work.pkgs));
+    work.keyrings = xcalloc(nthreads, sizeof(*work.keyrings));
+    work.keyrings[0] = rpmtsGetKeyring(ts, 1);
+    for (int i = 1; i < nthreads; i++)
+	work.keyrings[i] = rpmKeyringCopy(work.keyrings[0]);
+
+    for (int start = 0; start < nargs; start += batchsize) {
+	int n = nargs - start;
+	if (n > batchsize)
+	    n = batchsize;
+
+	for (int i = 0; i < n; i++)
+	    work.pkgs[i].fn = argv[start + i];
+
+	rpmworkersRun(nthreads, n, checksigRun, &work);
+
+	for (int i = 0; i < n; i++) {
+	    struct checksigPkg_s *pkg = &work.pkgs[i];
+	    pkgVerifyOutput(pkg->out, pkg->err);
+	    if (pkg->rc)
+		res++;
+	    free(pkg->out);
+	    free(pkg->err);
+	    memset(pkg, 0, sizeof(*pkg));
 	}
-
-	Fclose(fd);
     }
-    rpmKeyringFree(keyring);
+
+    for (int i = 0; i < nthreads; i++)
+	rpmKeyringFree(work.keyrings[i]);
+    free(work.keyrings);
+    free(work.pkgs);
     return res;
 }
@@ -1,4 +1,5 @@
 #include "system.h"
+#include <pthread.h>
 #include <sched.h>
 #include <stdlib.h>
 #include <fcntl.h>
@@ -13,16 +14,39 @@ int _rpm_nouserns = 0;
 struct rootState_s {
     char *rootDir;
     int chrootDone;
+    int held;			/* rpmChrootHold() depth */
+    int lingering;		/* left while held, not exited yet */
     int cwd;
+    int owned;			/* claimed by a thread? */
+    pthread_t owner;		/* thread that set rootDir */
 };
 
 /* Process global chroot state */
 static struct rootState_s rootState = {
    .rootDir = NULL,
    .chrootDone = 0,
+   .held = 0,
+   .lingering = 0,
    .cwd = -1,
+   .owned = 0,
 }; 
 
+/*
+ * chroot() and the current directory are per process, so there can only
+ * be one root in effect at a time. A thread setting a root claims the
+ * state until it resets it, others wanting to set theirs wait meanwhile.
+ * rpmtsRun() is serialized as a whole as it changes other process state
+ * as well, this covers the other users of a root such as database
+ * rebuilds and verification from other threads.
+ */
+static pthread_mutex_t rootLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rootFree = PTHREAD_COND_INITIALIZER;
+
+static int ownRoot(void)
+{
+    return rootState.owned && pthread_equal(rootState.owner, pthread_self());
+}
+
 #if defined(HAVE_UNSHARE) && defined(CLONE_NEWUSER)
 /*
  * If setgroups file exists (Linux >= 3.19), we need to write "deny" to it,
@@ -81,15 +105,34 @@ int rpmChrootSet(const char *rootDir)
 {
     int rc = 0;
 
+    pthread_mutex_lock(&rootLock);
+    if (rootState.owned && !ownRoot()) {
+	/* Nothing to reset for a thread that never got the state */
+	if (rootDir == NULL) {
+	    pthread_mutex_unlock(&rootLock);
+	    return 0;
+	}
+	while (rootState.owned)
+	    pthread_cond_wait(&rootFree, &rootLock);
+    }
+
     /* Setting same rootDir again is a no-op and not an error */
-    if (rootDir && rootState.rootDir && rstreq(rootDir, rootState.rootDir))
+    if (rootDir && rootState.rootDir && rstreq(rootDir, rootState.rootDir)) {
+	rootState.owned = 1;
+	rootState.owner = pthread_self();
+	pthread_mutex_unlock(&rootLock);
 	return 0;
+    }
 
     /* Resetting only permitted in neutral state */
-    if (rootState.chrootDone != 0)
+    if (rootState.chrootDone != 0) {
+	pthread_mutex_unlock(&rootLock);
 	return -1;
+    }
 
     rootState.rootDir = _free(rootState.rootDir);
+    /* Cached users and groups are for the old root */
+    rpmugFree();
     if (rootState.cwd >= 0) {
 	close(rootState.cwd);
 	rootState.cwd = -1;
@@ -108,6 +151,29 @@ int rpmChrootSet(const char *rootDir)
 	    rc = -1;
     }
 
+    if (rootDir != NULL && rc == 0) {
+	rootState.owned = 1;
+	rootState.owner = pthread_self();
+    } else if (rootState.owned) {
+	rootState.owned = 0;
+	pthread_cond_broadcast(&rootFree);
+    }
+    pthread_mutex_unlock(&rootLock);
+
+    return rc;
+}
+
+static int exitChroot(void)
+{
+    int rc = 0;
+
+    rpmlog(RPMLOG_DEBUG, "exiting chroot %s\n", rootState.rootDir);
+    if (chroot(".") == 0 && fchdir(rootState.cwd) == 0) {
+	rootState.chrootDone = 0;
+    } else {
+	rpmlog(RPMLOG_ERR, _("Unable to restore root directory: %m\n"));
+	rc = -1;
+    }
     return rc;
 }
 
@@ -123,8 +189,10 @@ int rpmChrootIn(void)
 	return -1;
     }
 
-    /* "refcounted" entry to chroot */
-    if (rootState.chrootDone > 0) {
+    /* "refcounted" entry to chroot, reusing one left while held */
+    if (rootState.lingering) {
+	rootState.lingering = 0;
+    } else if (rootState.chrootDone > 0) {
 	rootState.chrootDone++;
     } else if (rootState.chrootDone == 0) {
 	if (!_rpm_nouserns && getuid())
@@ -155,14 +223,27 @@ int rpmChrootOut(void)
     /* "refcounted" return from chroot */
     if (rootState.chrootDone > 1) {
 	rootState.chrootDone--;
-    } else if (rootState.chrootDone == 1) {
-	rpmlog(RPMLOG_DEBUG, "exiting chroot %s\n", rootState.rootDir);
-	if (chroot(".") == 0 && fchdir(rootState.cwd) == 0) {
-	    rootState.chrootDone = 0;
-	} else {
-	    rpmlog(RPMLOG_ERR, _("Unable to restore root directory: %m\n"));
-	    rc = -1;
-	}
+    } else if (rootState.chrootDone == 1 && !rootState.lingering) {
+	if (rootState.held)
+	    rootState.lingering = 1;
+	else
+	    rc = exitChroot();
+    }
+    return rc;
+}
+
+void rpmChrootHold(void)
+{
+    rootState.held++;
+}
+
+int rpmChrootRelease(void)
+{
+    int rc = 0;
+
+    if (rootState.held > 0 && --rootState.held == 0 && rootState.lingering) {
+	rootState.lingering = 0;
+	rc = exitChroot();
     }
     return rc;
 }
@@ -171,3 +252,8 @@ int rpmChrootDone(void)
 {
     return (rootState.chrootDone > 0);
 }
+
+const char * rpmChrootCurrent(void)
+{
+    return (rootState.chrootDone > 0) ? rootState.rootDir : "/";
+}
@@ -9,7 +9,9 @@ extern "C" {
 
 /** \ingroup rpmchroot
  * Set or clear process-wide chroot directory.
- * Calling this while chrooted is an error.
+ * Calling this while chrooted is an error. The directory belongs to the
+ * calling thread until it resets it, setting one from another thread
+ * meanwhile waits for that.
  * param rootDir	new chroot directory (or NULL to reset)
  * return		-1 on error, 0 on success
  */
@@ -30,6 +32,22 @@ int rpmChrootIn(void);
 /* RPM_GNUC_INTERNAL */
 int rpmChrootOut(void);
 
+/** \ingroup rpmchroot
+ * Hold on to the chroot across consecutive entries. While held, the
+ * outermost rpmChrootOut() leaves the process in the chroot so the next
+ * rpmChrootIn() reuses it, the actual exit is done on release. Code run
+ * in between must be fine with either root, rpmChrootDone() tells which.
+ */
+RPM_GNUC_INTERNAL
+void rpmChrootHold(void);
+
+/** \ingroup rpmchroot
+ * Release the chroot hold, exiting the chroot if it was left meanwhile.
+ * return		-1 on error, 0 on success
+ */
+RPM_GNUC_INTERNAL
+int rpmChrootRelease(void);
+
 /** \ingroup rpmchroot
  * Return chrooted status.
  * return		1 if chrooted, 0 otherwise
@@ -37,6 +55,14 @@ int rpmChrootOut(void);
 /* RPM_GNUC_INTERNAL */
 int rpmChrootDone(void);
 
+/** \ingroup rpmchroot
+ * Return the root directory currently in effect, ie "/" unless inside
+ * the chroot.
+ * @return		root directory
+ */
+RPM_GNUC_INTERNAL
+const char * rpmChrootCurrent(void);
+
 #ifdef __cplusplus
 }
 #endif
@@ -22,6 +22,7 @@
 #include <rpm/rpmmacro.h>
 #include <rpm/rpmsq.h>
 #include <rpm/rpmstring.h>
+#include <rpm/rpmstrpool.h>
 #include <rpm/rpmfileutil.h>
 #include <rpm/rpmds.h>			/* XXX isInstallPreReq macro only */
 #include <rpm/rpmlog.h>
@@ -36,6 +37,13 @@
 #include "lib/backend/dbi.h"
 #include "lib/backend/dbiset.h"
 #include "lib/misc.h"
+#include "lib/rpmworkers.h"
+#include "lib/hdrcache.h"
+#include "lib/hdrshm.h"
+#include "lib/trigindex.h"
+#include "lib/filefilter.h"
+#include "lib/pkglist.h"
+#include "lib/rpmprobes.h"
 #include "debug.h"
 
 #undef HASHTYPE
@@ -50,7 +58,288 @@
 #undef HTKEYTYPE
 #undef HTDATATYPE
 
+struct idxKey_s {
+    unsigned int len;
+    char data[];
+};
+
+#define HASHTYPE idxJournalHash
+#define HTKEYTYPE const struct idxKey_s *
+#define HTDATATYPE int
+#include "lib/rpmhash.H"
+#include "lib/rpmhash.C"
+#undef HASHTYPE
+#undef HTKEYTYPE
+#undef HTDATATYPE
+
+/* A pending secondary index update */
+struct idxJournalOp_s {
+    const struct idxKey_s *key;
+    struct dbiIndexItem_s rec;
+    int del;
+};
+
+/*
+ * Pending updates of one index, ops in the order they were made. Backends
+ * which can remove the items of a package by its number get whole
+ * packages removed instead of their keys, package numbers aren't reused
+ * so any item of those is gone.
+ */
+struct idxJournal_s {
+    idxJournalHash ht;		/*!< key -> indices into ops */
+    struct idxJournalOp_s *ops;
+    int nops;
+    int opsalloced;
+    unsigned int *delpkgs;	/*!< removed packages, sorted */
+    int ndelpkgs;
+};
+
+static unsigned int idxKeyHash(const struct idxKey_s *k)
+{
+    /* Jenkins One-at-a-time hash, like rstrhash() */
+    unsigned int hash = 0xe4721b68;
+
+    for (unsigned int i = 0; i < k->len; i++) {
+	hash += (unsigned char) k->data[i];
+	hash += (hash << 10);
+	hash ^= (hash >> 6);
+    }
+    hash += (hash << 3);
+    hash ^= (hash >> 11);
+    hash += (hash << 15);
+    return hash;
+}
+
+static int idxKeyCmp(const struct idxKey_s *a, const struct idxKey_s *b)
+{
+    return (a->len != b->len || memcmp(a->data, b->data, a->len));
+}
+
+static const struct idxKey_s *idxKeyFree(const struct idxKey_s *k)
+{
+    free((void *) k);
+    return NULL;
+}
+
+static struct idxKey_s *idxKeyNew(const char *keyp, size_t keylen)
+{
+    struct idxKey_s *k = xmalloc(sizeof(*k) + keylen);
+    k->len = keylen;
+    memcpy(k->data, keyp, keylen);
+    return k;
+}
+
+static struct idxJournal_s *idxJournalNew(void)
+{
+    struct idxJournal_s *j = xcalloc(1, sizeof(*j));
+    j->ht = idxJournalHashCreate(1024, idxKeyHash, idxKeyCmp, idxKeyFree, NULL);
+    return j;
+}
+
+static struct idxJournal_s *idxJournalFree(struct idxJournal_s *j)
+{
+    if (j) {
+	idxJournalHashFree(j->ht);
+	free(j->ops);
+	free(j->delpkgs);
+	free(j);
+    }
+    return NULL;
+}
+
+static rpmRC idxJournalAdd(struct idxJournal_s *j, const char *keyp,
+			   size_t keylen, dbiIndexItem rec, int del)
+{
+    struct idxKey_s *k = idxKeyNew(keyp, keylen);
+    const struct idxKey_s *tk = k;
+    struct idxJournalOp_s *op;
+
+    if (j->nops == j->opsalloced) {
+	j->opsalloced = j->opsalloced ? j->opsalloced * 2 : 256;
+	j->ops = xrealloc(j->ops, j->opsalloced * sizeof(*j->ops));
+    }
+
+    /* An already known key frees k and ops refer to the stored one */
+    idxJournalHashGetEntry(j->ht, k, NULL, NULL, &tk);
+    op = &j->ops[j->nops];
+    op->key = tk;
+    op->rec = *rec;
+    op->del = del;
+    idxJournalHashAddEntry(j->ht, k, j->nops);
+    j->nops++;
+
+    return RPMRC_OK;
+}
+
+static void idxJournalDelPkg(struct idxJournal_s *j, unsigned int hdrNum)
+{
+    int i = j->ndelpkgs;
+
+    j->delpkgs = xrealloc(j->delpkgs, (j->ndelpkgs + 1) * sizeof(*j->delpkgs));
+    for (; i > 0 && j->delpkgs[i-1] > hdrNum; i--)
+	j->delpkgs[i] = j->delpkgs[i-1];
+    j->delpkgs[i] = hdrNum;
+    j->ndelpkgs++;
+}
+
+static int hdrNumCmp(const void *one, const void *two)
+{
+    unsigned int a = *(const unsigned int *)one;
+    unsigned int b = *(const unsigned int *)two;
+    return (a > b) - (a < b);
+}
+
+/* Drop the items of removed packages from a lookup result */
+static void idxJournalPrune(struct idxJournal_s *j, dbiIndexSet set)
+{
+    unsigned int to = 0;
+
+    for (unsigned int from = 0; from < set->count; from++) {
+	if (bsearch(&set->recs[from].hdrNum, j->delpkgs, j->ndelpkgs,
+		    sizeof(*j->delpkgs), hdrNumCmp))
+	    continue;
+	set->recs[to++] = set->recs[from];
+    }
+    set->count = to;
+}
+
+static int journalOpCmp(const void *one, const void *two)
+{
+    const struct idxJournalOp_s *a = *(const struct idxJournalOp_s **)one;
+    const struct idxJournalOp_s *b = *(const struct idxJournalOp_s **)two;
+    unsigned int len = (a->key->len < b->key->len) ? a->key->len : b->key->len;
+    int rc = memcmp(a->key->data, b->key->data, len);
+
+    if (rc == 0 && a->key->len != b->key->len)
+	rc = (a->key->len < b->key->len) ? -1 : 1;
+    /* Preserve the original order of operations on a key */
+    if (rc == 0 && a != b)
+	rc = (a < b) ? -1 : 1;
+    return rc;
+}
+
+/* Apply pending updates to the index, sorted by key */
+static int idxJournalApply(dbiIndex dbi, struct idxJournal_s *j)
+{
+    struct idxJournalOp_s **ops;
+    dbiCursor dbc;
+    int rc = 0;
+
+    if (j->nops == 0 && j->ndelpkgs == 0)
+	return 0;
+
+    ops = xmalloc(j->nops * sizeof(*ops));
+    for (int i = 0; i < j->nops; i++)
+	ops[i] = &j->ops[i];
+    qsort(ops, j->nops, sizeof(*ops), journalOpCmp);
+
+    dbc = dbiCursorInit(dbi, DBC_WRITE);
+    for (int i = 0; i < j->nops; i++) {
+	struct idxJournalOp_s *op = ops[i];
+	if (op->del) {
+	    rc += idxdbDelOne(dbi, dbc, op->key->data, op->key->len, &op->rec);
+	} else {
+	    rc += idxdbPutOne(dbi, dbc, op->key->data, op->key->len, &op->rec);
+	}
+    }
+    dbiCursorFree(dbi, dbc);
+    free(ops);
+
+    /* After the key ops, which may have added items of these */
+    for (int i = 0; i < j->ndelpkgs; i++)
+	rc += idxdbDelPkg(dbi, j->delpkgs[i]);
+
+    idxJournalHashEmpty(j->ht);
+    j->nops = 0;
+    j->delpkgs = _free(j->delpkgs);
+    j->ndelpkgs = 0;
+
+    return rc;
+}
+
+static struct idxJournal_s *dbiJournal(dbiIndex dbi)
+{
+    rpmdb db = dbi->dbi_rpmdb;
+
+    if (db->db_journals) {
+	for (int dbix = 0; dbix < db->db_ndbi; dbix++) {
+	    if (db->db_indexes[dbix] == dbi) {
+		if (db->db_journals[dbix] == NULL)
+		    db->db_journals[dbix] = idxJournalNew();
+		return db->db_journals[dbix];
+	    }
+	}
+    }
+    return NULL;
+}
+
+/* Write out pending updates of an index ahead of a non-key lookup */
+static int indexFlush(dbiIndex dbi)
+{
+    struct idxJournal_s *j = dbiJournal(dbi);
+    int rc = 0;
+
+    if (j && (j->nops || j->ndelpkgs)) {
+	rpmdb db = dbi->dbi_rpmdb;
+	rpmsqBlock(SIG_BLOCK);
+	dbCtrl(db, DB_CTRL_LOCK_RW);
+	rc = idxJournalApply(dbi, j);
+	dbCtrl(db, DB_CTRL_UNLOCK_RW);
+	rpmsqBlock(SIG_UNBLOCK);
+    }
+    return rc;
+}
+
+/* Look up a key from the index, overlaid with its pending updates */
+static rpmRC journalGet(dbiIndex dbi, dbiCursor dbc, struct idxJournal_s *j,
+			const char *keyp, size_t keylen, dbiIndexSet *set)
+{
+    struct idxKey_s *k = idxKeyNew(keyp, keylen);
+    dbiIndexSet own = NULL;
+    int *ops = NULL;
+    int nops = 0;
+    rpmRC rc;
+
+    rc = idxdbGet(dbi, dbc, keyp, keylen, &own, DBC_NORMAL_SEARCH);
+
+    if ((rc == RPMRC_OK || rc == RPMRC_NOTFOUND) &&
+	    idxJournalHashGetEntry(j->ht, k, &ops, &nops, NULL)) {
+	if (own == NULL)
+	    own = dbiIndexSetNew(nops);
+	for (int i = 0; i < nops; i++) {
+	    struct idxJournalOp_s *op = &j->ops[ops[i]];
+	    if (op->del) {
+		dbiIndexSetPrune(own, &op->rec, 1, 1);
+	    } else {
+		dbiIndexSetAppendOne(own, op->rec.hdrNum, op->rec.tagNum, 0);
+	    }
+	}
+	rc = dbiIndexSetCount(own) ? RPMRC_OK : RPMRC_NOTFOUND;
+    }
+    free(k);
+
+    if (rc == RPMRC_OK && j->ndelpkgs) {
+	idxJournalPrune(j, own);
+	rc = dbiIndexSetCount(own) ? RPMRC_OK : RPMRC_NOTFOUND;
+    }
+
+    if (rc == RPMRC_OK && set) {
+	if (*set) {
+	    dbiIndexSetAppendSet(*set, own, 0);
+	} else {
+	    *set = own;
+	    own = NULL;
+	}
+    }
+    dbiIndexSetFree(own);
+
+    return rc;
+}
+
 static rpmdb rpmdbUnlink(rpmdb db);
+static int journalUpdate(dbiIndex dbi, struct idxJournal_s *j,
+			 rpmTagVal rpmtag, unsigned int hdrNum, Header h,
+			 int del);
 
 static int buildIndexes(rpmdb db)
 {
@@ -220,12 +509,22 @@ static rpmRC indexGet(dbiIndex dbi, const char *keyp, size_t keylen,
 {
     rpmRC rc = RPMRC_FAIL; /* assume failure */
     if (dbi != NULL) {
-	dbiCursor dbc = dbiCursorInit(dbi, DBC_READ);
+	struct idxJournal_s *j = dbiJournal(dbi);
+	dbiCursor dbc;
+
+	if (j && keyp == NULL)
+	    indexFlush(dbi);
+
+	dbc = dbiCursorInit(dbi, DBC_READ);
 
 	if (keyp) {
 	    if (keylen == 0)
 		keylen = strlen(keyp);
-	    rc = idxdbGet(dbi, dbc, keyp, keylen, set, DBC_NORMAL_SEARCH);
+	    if (j) {
+		rc = journalGet(dbi, dbc, j, keyp, keylen, set);
+	    } else {
+		rc = idxdbGet(dbi, dbc, keyp, keylen, set, DBC_NORMAL_SEARCH);
+	    }
 	} else {
 	    do {
 		rc = idxdbGet(dbi, dbc, NULL, 0, set, DBC_NORMAL_SEARCH);
@@ -241,13 +540,67 @@ static rpmRC indexGet(dbiIndex dbi, const char *keyp, size_t keylen,
     return rc;
 }
 
+static rpmRC indexCount(dbiIndex dbi, const char *keyp, size_t keylen,
+			 unsigned int *count)
+{
+    rpmRC rc = RPMRC_FAIL; /* assume failure */
+    *count = 0;
+    if (dbi != NULL) {
+	struct idxJournal_s *j = dbiJournal(dbi);
+	dbiCursor dbc = dbiCursorInit(dbi, DBC_READ);
+
+	/* Pending updates are only seen by a real lookup */
+	if (j) {
+	    dbiIndexSet set = NULL;
+	    rc = journalGet(dbi, dbc, j, keyp, keylen, &set);
+	    *count = dbiIndexSetCount(set);
+	    dbiIndexSetFree(set);
+	} else {
+	    rc = idxdbCount(dbi, dbc, keyp, keylen, count);
+	}
+
+	dbiCursorFree(dbi, dbc);
+    }
+    return rc;
+}
+
+/* Look up several exact keys at once, sets[i] is NULL for missing keys */
+static rpmRC indexGetBatch(dbiIndex dbi, const char **keys,
+			   const size_t *keylens, int nkeys, dbiIndexSet *sets,
+			   int sorted)
+{
+    rpmRC rc = RPMRC_FAIL; /* assume failure */
+    if (dbi != NULL) {
+	struct idxJournal_s *j = dbiJournal(dbi);
+	dbiCursor dbc = dbiCursorInit(dbi, DBC_READ);
+
+	if (j) {
+	    rc = RPMRC_OK;
+	    for (int i = 0; i < nkeys && rc != RPMRC_FAIL; i++)
+		rc = journalGet(dbi, dbc, j, keys[i], keylens[i], &sets[i]);
+	    if (rc == RPMRC_NOTFOUND)
+		rc = RPMRC_OK;
+	} else if (sorted) {
+	    rc = idxdbGetSorted(dbi, dbc, keys, keylens, nkeys, sets);
+	} else {
+	    rc = idxdbGetBatch(dbi, dbc, keys, keylens, nkeys, sets);
+	}
+
+	dbiCursorFree(dbi, dbc);
+    }
+    return rc;
+}
+
 static rpmRC indexPrefixGet(dbiIndex dbi, const char *pfx, size_t plen,
 			    dbiIndexSet *set)
 {
     rpmRC rc = RPMRC_FAIL; /* assume failure */
 
     if (dbi != NULL && pfx) {
-	dbiCursor dbc = dbiCursorInit(dbi, DBC_READ);
+	dbiCursor dbc;
+
+	indexFlush(dbi);
+	dbc = dbiCursorInit(dbi, DBC_READ);
 
 	if (plen == 0)
 	    plen = strlen(pfx);
@@ -288,7 +641,32 @@ struct rpmdbMatchIterator_s {
     miRE		mi_re;
     rpmts		mi_ts;
     rpmRC (*mi_hdrchk) (rpmts ts, const void * uh, size_t uc, char ** msg);
+    struct miPrefetch_s	*mi_pf;	/* read-ahead of full scans (or NULL) */
+    rpmTagVal		*mi_tags;	/* tags to import (or NULL for all) */
+    int			mi_ntags;
+    hdrShm		mi_shm;		/* shared header cache (or NULL) */
+    unsigned int	mi_shmix;	/* next cached blob of full scans */
+    hdrShmBuild		mi_shmb;	/* blobs of a full scan to share */
+    int			mi_snapshot;	/* holding a read snapshot? */
+};
+
+struct miPrefetchItem_s {
+    unsigned int offset;
+    unsigned char *uh;
+    unsigned int uhlen;
+    Header h;
+    int skip;
+};
 
+struct miPrefetch_s {
+    int nthreads;
+    int size;
+    int nitems;
+    int next;
+    int nread;
+    int eof;
+    const rpmTagVal *tags;
+    struct miPrefetchItem_s *items;
 };
 
 struct rpmdbIndexIterator_s {
@@ -315,6 +693,12 @@ rpmop rpmdbOp(rpmdb rpmdb, rpmdbOpX opx)
     case RPMDB_OP_DBDEL:
 	op = &rpmdb->db_delops;
 	break;
+    case RPMDB_OP_HDRHIT:
+	op = &rpmdb->db_hdrhitops;
+	break;
+    case RPMDB_OP_HDRMISS:
+	op = &rpmdb->db_hdrmissops;
+	break;
     default:
 	break;
     }
@@ -363,6 +747,262 @@ static int dbiForeach(dbiIndex *dbis, int ndbi,
     return rc;
 }
 
+/* Path of a file in the database directory, as seen from the current root */
+static char *dbFilePath(rpmdb db, const char *name)
+{
+    const char *dir = rpmChrootDone() ? db->db_home : db->db_fullpath;
+    return rstrscat(NULL, dir, "/", name, NULL);
+}
+
+static int dbTrigIdentify(rpmdb db, struct hdrShmId_s *id)
+{
+    char *dbfile = dbFilePath(db, db->db_ops->path);
+    int rc = hdrShmIdentify(dbfile, id);
+    free(dbfile);
+    return rc;
+}
+
+/* Collect the triggers of all installed packages */
+static trigIndex dbTrigBuild(rpmdb db, const struct hdrShmId_s *id)
+{
+    static const rpmTagVal tags[] = {
+	RPMTAG_TRIGGERNAME, RPMTAG_TRIGGERFLAGS, RPMTAG_TRIGGERINDEX,
+	RPMTAG_TRIGGERVERSION,
+	RPMTAG_FILETRIGGERNAME, RPMTAG_FILETRIGGERFLAGS,
+	RPMTAG_FILETRIGGERINDEX, RPMTAG_FILETRIGGERVERSION,
+	RPMTAG_FILETRIGGERPRIORITIES,
+	RPMTAG_TRANSFILETRIGGERNAME, RPMTAG_TRANSFILETRIGGERFLAGS,
+	RPMTAG_TRANSFILETRIGGERINDEX, RPMTAG_TRANSFILETRIGGERVERSION,
+	RPMTAG_TRANSFILETRIGGERPRIORITIES,
+	0
+    };
+    trigIndex ti = trigIndexNew(id);
+    rpmdbMatchIterator mi = rpmdbInitIterator(db, RPMDBI_PACKAGES, NULL, 0);
+    Header h;
+
+    rpmdbSetIteratorTags(mi, tags);
+    while ((h = rpmdbNextIterator(mi)) != NULL)
+	trigIndexAdd(ti, rpmdbGetIteratorOffset(mi), h);
+    rpmdbFreeIterator(mi);
+    return ti;
+}
+
+struct trigIndex_s *rpmdbTriggerIndex(rpmdb db)
+{
+    struct hdrShmId_s id;
+
+    if (db == NULL || !db->db_usetrigidx)
+	return NULL;
+
+    /* Unless it's our own doing, the database must not have changed */
+    if (db->db_trigidx && !db->db_trigchanged) {
+	if (dbTrigIdentify(db, &id) || !trigIndexMatches(db->db_trigidx, &id))
+	    db->db_trigidx = trigIndexFree(db->db_trigidx);
+    }
+
+    if (db->db_trigidx == NULL && dbTrigIdentify(db, &id) == 0) {
+	char *path = dbFilePath(db, "Triggerindex");
+	db->db_trigidx = trigIndexLoad(path, &id);
+	if (db->db_trigidx == NULL)
+	    db->db_trigidx = dbTrigBuild(db, &id);
+	db->db_trigchanged = 0;
+	free(path);
+    }
+
+    return db->db_trigidx;
+}
+
+/*
+ * Store a new or changed trigger index on close. One built from an
+ * unchanged database is only valid if nobody else changed it meanwhile.
+ */
+static void dbTrigStore(rpmdb db)
+{
+    struct hdrShmId_s id;
+    trigIndex ti = db->db_trigidx;
+
+    if (ti && trigIndexModified(ti) && dbTrigIdentify(db, &id) == 0 &&
+	    (db->db_trigchanged || trigIndexMatches(ti, &id))) {
+	char *path = dbFilePath(db, "Triggerindex");
+	trigIndexWrite(ti, path, &id);
+	free(path);
+    }
+}
+
+/* Collect the basenames of all installed files from the index keys */
+static fileFilter dbFilterBuild(rpmdb db, const struct hdrShmId_s *id)
+{
+    fileFilter ff = NULL;
+    dbiIndex dbi = NULL;
+    dbiCursor dbc;
+    rpmRC rc;
+
+    if (indexOpen(db, RPMDBI_BASENAMES, 0, &dbi))
+	return NULL;
+
+    indexFlush(dbi);
+    ff = fileFilterNew(id);
+    dbc = dbiCursorInit(dbi, DBC_READ);
+    while ((rc = idxdbGet(dbi, dbc, NULL, 0, NULL,
+			  DBC_NORMAL_SEARCH)) == RPMRC_OK) {
+	unsigned int keylen = 0;
+	const char *key = idxdbKey(dbi, dbc, &keylen);
+	fileFilterAdd(ff, key, keylen);
+    }
+    dbiCursorFree(dbi, dbc);
+
+    /* A partial filter would hide owned files */
+    if (rc != RPMRC_NOTFOUND)
+	ff = fileFilterFree(ff);
+    return ff;
+}
+
+/*
+ * Return the file filter of the database in its current state. A stored
+ * one is looked for once, a missing one is only built (and stored) when
+ * asked to, building takes a pass over the Basenames index.
+ */
+static fileFilter dbFileFilter(rpmdb db, int build)
+{
+    struct hdrShmId_s id;
+
+    if (db == NULL || db->db_usefileflt <= 0)
+	return NULL;
+
+    if (db->db_fileflt) {
+	if (dbTrigIdentify(db, &id) || !fileFilterMatches(db->db_fileflt, &id))
+	    db->db_fileflt = fileFilterFree(db->db_fileflt);
+    }
+
+    if (db->db_fileflt == NULL && (build || !db->db_filefltchecked) &&
+	    dbTrigIdentify(db, &id) == 0) {
+	char *path = dbFilePath(db, "Filefilter");
+	db->db_fileflt = fileFilterLoad(path, &id);
+	db->db_filefltchecked = 1;
+	if (db->db_fileflt == NULL && build) {
+	    db->db_fileflt = dbFilterBuild(db, &id);
+	    if (db->db_fileflt)
+		fileFilterWrite(db->db_fileflt, path);
+	}
+	free(path);
+    }
+
+    return db->db_fileflt;
+}
+
+/* Our own changes make the filter stale, look for a new one next time */
+static void dbFilterDrop(rpmdb db)
+{
+    db->db_fileflt = fileFilterFree(db->db_fileflt);
+    db->db_filefltchecked = 0;
+}
+
+/* Collect the packages of the database */
+static rpmdbPkgList dbPkgListBuild(rpmdb db, const struct hdrShmId_s *id)
+{
+    static const rpmTagVal tags[] = {
+	RPMTAG_NAME, RPMTAG_EPOCH, RPMTAG_VERSION, RPMTAG_RELEASE,
+	RPMTAG_ARCH,
+	RPMTAG_PROVIDENAME, RPMTAG_PROVIDEFLAGS, RPMTAG_PROVIDEVERSION,
+	RPMTAG_REQUIRENAME, RPMTAG_REQUIREFLAGS, RPMTAG_REQUIREVERSION,
+	RPMTAG_CONFLICTNAME, RPMTAG_CONFLICTFLAGS, RPMTAG_CONFLICTVERSION,
+	RPMTAG_OBSOLETENAME, RPMTAG_OBSOLETEFLAGS, RPMTAG_OBSOLETEVERSION,
+	RPMTAG_RECOMMENDNAME, RPMTAG_RECOMMENDFLAGS, RPMTAG_RECOMMENDVERSION,
+	RPMTAG_SUGGESTNAME, RPMTAG_SUGGESTFLAGS, RPMTAG_SUGGESTVERSION,
+	RPMTAG_SUPPLEMENTNAME, RPMTAG_SUPPLEMENTFLAGS,
+	RPMTAG_SUPPLEMENTVERSION,
+	RPMTAG_ENHANCENAME, RPMTAG_ENHANCEFLAGS, RPMTAG_ENHANCEVERSION,
+	RPMTAG_BASENAMES, RPMTAG_DIRNAMES, RPMTAG_DIRINDEXES,
+	0
+    };
+    rpmdbPkgList pl = pkgListNew(id);
+    rpmdbMatchIterator mi = rpmdbInitIterator(db, RPMDBI_PACKAGES, NULL, 0);
+    Header h;
+
+    rpmdbSetIteratorTags(mi, tags);
+    while ((h = rpmdbNextIterator(mi)) != NULL)
+	pkgListAdd(pl, rpmdbGetIteratorOffset(mi), h);
+    rpmdbFreeIterator(mi);
+    return pl;
+}
+
+/*
+ * Return the package list of the database in its current state. A
+ * stored one is looked for once, a missing one is only built when asked
+ * to, it's then stored on close.
+ */
+static rpmdbPkgList dbPkgList(rpmdb db, int build)
+{
+    struct hdrShmId_s id;
+
+    if (db == NULL || !db->db_usepkglist)
+	return NULL;
+
+    /* Unless it's our own doing, the database must not have changed */
+    if (db->db_pkglist && !db->db_pkglistchanged) {
+	if (dbTrigIdentify(db, &id) || !pkgListMatches(db->db_pkglist, &id))
+	    db->db_pkglist = pkgListFree(db->db_pkglist);
+    }
+
+    if (db->db_pkglist == NULL && (build || !db->db_pkglistchecked) &&
+	    dbTrigIdentify(db, &id) == 0) {
+	char *path = dbFilePath(db, "Packagelist");
+	db->db_pkglist = pkgListLoad(path, &id);
+	db->db_pkglistchecked = 1;
+	if (db->db_pkglist == NULL && build)
+	    db->db_pkglist = dbPkgListBuild(db, &id);
+	free(path);
+    }
+
+    return db->db_pkglist;
+}
+
+rpmstrPool rpmdbPool(rpmdb db)
+{
+    if (db == NULL || !db->db_usepool)
+	return NULL;
+    /* Queries format headers in worker threads, create it atomically */
+    if (__atomic_load_n(&db->db_pool, __ATOMIC_ACQUIRE) == NULL) {
+	rpmstrPool pool = rpmstrPoolCreate();
+	rpmstrPool expected = NULL;
+	if (!__atomic_compare_exchange_n(&db->db_pool, &expected, pool, 0,
+					 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+	    rpmstrPoolFree(pool);
+    }
+    return db->db_pool;
+}
+
+rpmstrPool rpmdbHeaderPool(rpmdb db, Header h)
+{
+    return (h && headerGetInstance(h)) ? rpmdbPool(db) : NULL;
+}
+
+rpmdbPkgList rpmdbGetPkgList(rpmdb db)
+{
+    return dbPkgList(db, 1);
+}
+
+/* Follow a change of the database, the list is loaded first if need be */
+static void dbPkgListPrepare(rpmdb db)
+{
+    if (db->db_usepkglist)
+	(void) dbPkgList(db, 0);
+}
+
+/* Store a new or changed package list on close, like the trigger index */
+static void dbPkgListStore(rpmdb db)
+{
+    struct hdrShmId_s id;
+    rpmdbPkgList pl = db->db_pkglist;
+
+    if (pl && pkgListModified(pl) && dbTrigIdentify(db, &id) == 0 &&
+	    (db->db_pkglistchanged || pkgListMatches(pl, &id))) {
+	char *path = dbFilePath(db, "Packagelist");
+	pkgListWrite(pl, path, &id);
+	free(path);
+    }
+}
+
 int rpmdbClose(rpmdb db)
 {
     int rc = 0;
@@ -370,24 +1010,47 @@ int rpmdbClose(rpmdb db)
     if (db == NULL)
 	goto exit;
 
+    /* A database we changed without a list to follow gets a new one */
+    if (db->nrefs == 1 && db->db_usepkglist && db->db_pkglistchanged &&
+	    db->db_pkglist == NULL)
+	(void) rpmdbGetPkgList(db);
+
     (void) rpmdbUnlink(db);
 
     if (db->nrefs > 0)
 	goto exit;
 
+    rc = rpmdbDeferIndexes(db, 0);
+
     /* Always re-enable fsync on close of rw-database */
     if ((db->db_mode & O_ACCMODE) != O_RDONLY)
 	dbSetFSync(db, 1);
 
     if (db->db_pkgs)
-	rc = dbiClose(db->db_pkgs, 0);
+	rc += dbiClose(db->db_pkgs, 0);
     rc += dbiForeach(db->db_indexes, db->db_ndbi, dbiClose, 1);
 
+    /* The identity to store the trigger index with is the one after close */
+    dbTrigStore(db);
+    dbPkgListStore(db);
+
     db->db_root = _free(db->db_root);
     db->db_home = _free(db->db_home);
     db->db_fullpath = _free(db->db_fullpath);
     db->db_checked = dbChkFree(db->db_checked);
+    db->db_hdrcache = hdrCacheFree(db->db_hdrcache);
+    db->db_hdrshm = hdrShmDetach(db->db_hdrshm);
+    db->db_shmdir = _free(db->db_shmdir);
     db->db_indexes = _free(db->db_indexes);
+    db->db_trigidx = trigIndexFree(db->db_trigidx);
+    db->db_fileflt = fileFilterFree(db->db_fileflt);
+    db->db_pkglist = pkgListFree(db->db_pkglist);
+    if (db->db_pool) {
+	rpmlog(RPMLOG_DEBUG, "rpmdb string pool: %u strings, %zu kB\n",
+	       (unsigned) rpmstrPoolNumStr(db->db_pool),
+	       rpmstrPoolMemSize(db->db_pool) / 1024);
+	db->db_pool = rpmstrPoolFree(db->db_pool);
+    }
 
     db = _free(db);
 
@@ -420,6 +1083,7 @@ static rpmdb newRpmdb(const char * root, const char * home,
 	RPMDBI_SUGGESTNAME,
 	RPMDBI_SUPPLEMENTNAME,
 	RPMDBI_ENHANCENAME,
+	RPMDBI_NVRA,		/* optional, keep last */
     };
 
     if (!(db_home && db_home[0] != '%')) {
@@ -441,7 +1105,25 @@ static rpmdb newRpmdb(const char * root, const char * home,
     db->db_fullpath = rpmGenPath(db->db_root, db->db_home, NULL);
     db->db_tags = dbiTags;
     db->db_ndbi = sizeof(dbiTags) / sizeof(rpmDbiTag);
+    if (rpmExpandNumeric("%{?_db_label_index}") <= 0)
+	db->db_ndbi--;
     db->db_indexes = xcalloc(db->db_ndbi, sizeof(*db->db_indexes));
+    {	int ncache = rpmExpandNumeric("%{?_db_header_cache}");
+	if (ncache > 0)
+	    db->db_hdrcache = hdrCacheNew(ncache);
+    }
+    {	char *shmdir = rpmExpand("%{?_db_shared_cache}", NULL);
+	if (*shmdir)
+	    db->db_shmdir = rpmGetPath(shmdir, NULL);
+	free(shmdir);
+    }
+    db->db_usetrigidx = (rpmExpandNumeric("%{?_db_trigger_index}") > 0 &&
+			 !(db->db_flags & RPMDB_FLAG_REBUILD));
+    if (!(db->db_flags & RPMDB_FLAG_REBUILD))
+	db->db_usefileflt = rpmExpandNumeric("%{?_db_file_filter}");
+    db->db_usepkglist = (rpmExpandNumeric("%{?_db_package_list}") > 0 &&
+			 !(db->db_flags & RPMDB_FLAG_REBUILD));
+    db->db_usepool = (rpmExpandNumeric("%{?_db_string_pool}") > 0);
     db->nrefs = 0;
     return rpmdbLink(db);
 }
@@ -538,150 +1220,261 @@ int rpmdbVerify(const char * prefix)
     return rc;
 }
 
-Header rpmdbGetHeaderAt(rpmdb db, unsigned int offset)
-{   
-    rpmdbMatchIterator mi = rpmdbInitIterator(db, RPMDBI_PACKAGES,
-					      &offset, sizeof(offset));
-    Header h = headerLink(rpmdbNextIterator(mi));
-    rpmdbFreeIterator(mi);
-    return h;
+Header rpmdbGetHeaderAt(rpmdb db, unsigned int offset)
+{   
+    rpmdbMatchIterator mi = rpmdbInitIterator(db, RPMDBI_PACKAGES,
+					      &offset, sizeof(offset));
+    Header h = headerLink(rpmdbNextIterator(mi));
+    rpmdbFreeIterator(mi);
+    return h;
+}
+
+/* One path of a file lookup, split for grouping */
+struct fileReq_s {
+    char *dirName;
+    const char *baseName;
+    int ix;			/* position in the lookup */
+};
+
+static int fileReqCmp(const void *a, const void *b)
+{
+    const struct fileReq_s *x = a, *y = b;
+    int rc = strcmp(x->baseName, y->baseName);
+    if (rc == 0)
+	rc = strcmp(x->dirName, y->dirName);
+    return rc;
+}
+
+/* Append the files of a header that are one of the paths looked up */
+static void matchFiles(fingerPrintCache fpc, Header h, int usestate,
+		       dbiIndexSet allMatches, unsigned int *i,
+		       struct fileReq_s *reqs, fingerPrint **fps, int nreqs,
+		       dbiIndexSet *matches)
+{
+    struct rpmtd_s bn, dn, di, fs;
+    const char ** baseNames, ** dirNames;
+    uint32_t * dirIndexes;
+    unsigned int offset = dbiIndexRecordOffset(allMatches, *i);
+    unsigned int prevoff;
+
+    headerGet(h, RPMTAG_BASENAMES, &bn, HEADERGET_MINMEM);
+    headerGet(h, RPMTAG_DIRNAMES, &dn, HEADERGET_MINMEM);
+    headerGet(h, RPMTAG_DIRINDEXES, &di, HEADERGET_MINMEM);
+    baseNames = bn.data;
+    dirNames = dn.data;
+    dirIndexes = di.data;
+    if (usestate)
+	headerGet(h, RPMTAG_FILESTATES, &fs, HEADERGET_MINMEM);
+
+    do {
+	unsigned int num = dbiIndexRecordFileNumber(allMatches, *i);
+	int skip = 0;
+
+	if (usestate) {
+	    rpmtdSetIndex(&fs, num);
+	    if (!RPMFILE_IS_INSTALLED(rpmtdGetNumber(&fs))) {
+		skip = 1;
+	    }
+	}
+
+	/* Paths in the same directory share the fingerprint of the first */
+	for (int r = 0; !skip && r < nreqs; r++) {
+	    const char *dirName = dirNames[dirIndexes[num]];
+	    int d = r;
+	    if (r > 0 && rstreq(reqs[r].dirName, reqs[r-1].dirName))
+		continue;
+	    if (!fpLookupEquals(fpc, fps[r], dirName, baseNames[num]))
+		continue;
+	    do {
+		dbiIndexSet *set = &matches[reqs[d].ix];
+		if (*set == NULL)
+		    *set = dbiIndexSetNew(0);
+		dbiIndexSetAppendOne(*set, offset, num, 0);
+		d++;
+	    } while (d < nreqs && rstreq(reqs[d].dirName, reqs[r].dirName));
+	}
+
+	prevoff = offset;
+	(*i)++;
+	if (*i < allMatches->count)
+	    offset = dbiIndexRecordOffset(allMatches, *i);
+    } while (*i < allMatches->count && offset == prevoff);
+
+    rpmtdFreeData(&bn);
+    rpmtdFreeData(&dn);
+    rpmtdFreeData(&di);
+    if (usestate)
+	rpmtdFreeData(&fs);
 }
 
 /**
- * Find file matches in database.
+ * Find file matches in database. The paths are grouped by basename and
+ * directory, so each basename is looked up and each candidate header
+ * loaded once, and each directory is resolved once.
  * @param db		rpm database
  * @param dbi		index database handle (always RPMDBI_BASENAMES)
- * @param filespec
+ * @param npaths	number of paths
+ * @param filespecs	paths
  * @param usestate	take file state into account?
- * @param[out] matches
- * @return 		RPMRC_OK on match, RPMRC_NOMATCH or RPMRC_FAIL
+ * @param[out] matches	matches of each path, NULL if none
+ * @return 		RPMRC_OK on success, RPMRC_FAIL on error
  */
-static rpmRC rpmdbFindByFile(rpmdb db, dbiIndex dbi, const char *filespec,
-			   int usestate, dbiIndexSet * matches)
+static rpmRC rpmdbFindByFiles(rpmdb db, dbiIndex dbi, int npaths,
+			      const char **filespecs, int usestate,
+			      dbiIndexSet *matches)
 {
-    char * dirName = NULL;
-    const char * baseName;
+    fileFilter ff = dbFileFilter(db, npaths >= db->db_usefileflt);
+    struct fileReq_s *reqs = xcalloc(npaths, sizeof(*reqs));
+    const char **keys = xcalloc(npaths, sizeof(*keys));
+    size_t *keylens = xcalloc(npaths, sizeof(*keylens));
+    int *runs = xcalloc(npaths + 1, sizeof(*runs));
+    dbiIndexSet *sets = NULL;
     fingerPrintCache fpc = NULL;
-    fingerPrint * fp1 = NULL;
-    dbiIndexSet allMatches = NULL;
-    unsigned int i;
-    rpmRC rc = RPMRC_FAIL; /* assume error */
+    int nkeys = 0;
+    rpmRC rc = RPMRC_OK;
+
+    for (int i = 0; i < npaths; i++) {
+	const char *filespec = filespecs[i];
+	const char *baseName = strrchr(filespec, '/');
+
+	matches[i] = NULL;
+	reqs[i].ix = i;
+	if (baseName != NULL) {
+	    reqs[i].dirName = rstrndup(filespec, baseName - filespec + 1);
+	    reqs[i].baseName = baseName + 1;
+	} else {
+	    reqs[i].dirName = xstrdup("");
+	    reqs[i].baseName = filespec;
+	}
+    }
+    qsort(reqs, npaths, sizeof(*reqs), fileReqCmp);
 
-    *matches = NULL;
-    if (filespec == NULL) return rc; /* nothing alloced yet */
+    /* Unique basenames in index order, unless the filter rules them out */
+    for (int i = 0; i < npaths; i++) {
+	const char *baseName = reqs[i].baseName;
+	if (i > 0 && rstreq(baseName, reqs[i-1].baseName))
+	    continue;
+	if (ff && !fileFilterHas(ff, baseName, strlen(baseName)))
+	    continue;
+	runs[nkeys] = i;
+	keys[nkeys] = baseName;
+	keylens[nkeys] = strlen(baseName);
+	nkeys++;
+    }
+    runs[nkeys] = npaths;
+
+    if (nkeys == 0)
+	goto exit;
 
-    if ((baseName = strrchr(filespec, '/')) != NULL) {
-	size_t len = baseName - filespec + 1;
-	dirName = rstrndup(filespec, len);
-	baseName++;
+    sets = xcalloc(nkeys, sizeof(*sets));
+    if (nkeys == 1) {
+	rc = indexGet(dbi, keys[0], keylens[0], &sets[0]);
+	if (rc == RPMRC_NOTFOUND)
+	    rc = RPMRC_OK;
     } else {
-	dirName = xstrdup("");
-	baseName = filespec;
+	rc = indexGetBatch(dbi, keys, keylens, nkeys, sets, 1);
     }
-    if (baseName == NULL)
+    if (rc)
 	goto exit;
 
-    rc = indexGet(dbi, baseName, 0, &allMatches);
-
-    if (rc || allMatches == NULL) goto exit;
+    fpc = fpCacheCreate(npaths, NULL);
+    for (int k = 0; k < nkeys; k++) {
+	struct fileReq_s *run = reqs + runs[k];
+	int nrun;
+	fingerPrint **fps;
+	dbiIndexSet allMatches = sets[k];
+	unsigned int i = 0;
 
-    *matches = dbiIndexSetNew(0);
-    fpc = fpCacheCreate(allMatches->count, NULL);
-    fpLookup(fpc, dirName, baseName, &fp1);
-
-    i = 0;
-    while (i < allMatches->count) {
-	struct rpmtd_s bn, dn, di, fs;
-	const char ** baseNames, ** dirNames;
-	uint32_t * dirIndexes;
-	unsigned int offset = dbiIndexRecordOffset(allMatches, i);
-	unsigned int prevoff;
-	Header h = rpmdbGetHeaderAt(db, offset);
-
-	if (h == NULL) {
-	    i++;
+	if (allMatches == NULL)
 	    continue;
-	}
 
-	headerGet(h, RPMTAG_BASENAMES, &bn, HEADERGET_MINMEM);
-	headerGet(h, RPMTAG_DIRNAMES, &dn, HEADERGET_MINMEM);
-	headerGet(h, RPMTAG_DIRINDEXES, &di, HEADERGET_MINMEM);
-	baseNames = bn.data;
-	dirNames = dn.data;
-	dirIndexes = di.data;
-	if (usestate)
-	    headerGet(h, RPMTAG_FILESTATES, &fs, HEADERGET_MINMEM);
+	/* The run ends at the next looked up basename or a filtered one */
+	for (nrun = 1; run + nrun < reqs + runs[k+1]; nrun++) {
+	    if (!rstreq(run[nrun].baseName, run[0].baseName))
+		break;
+	}
 
-	do {
-	    unsigned int num = dbiIndexRecordFileNumber(allMatches, i);
-	    int skip = 0;
+	fps = xcalloc(nrun, sizeof(*fps));
+	for (int r = 0; r < nrun; r++) {
+	    if (r == 0 || !rstreq(run[r].dirName, run[r-1].dirName))
+		fpLookup(fpc, run[r].dirName, run[r].baseName, &fps[r]);
+	}
 
-	    if (usestate) {
-		rpmtdSetIndex(&fs, num);
-		if (!RPMFILE_IS_INSTALLED(rpmtdGetNumber(&fs))) {
-		    skip = 1;
-		}
-	    }
+	while (i < allMatches->count) {
+	    Header h = rpmdbGetHeaderAt(db, dbiIndexRecordOffset(allMatches, i));
 
-	    if (!skip) {
-		const char *dirName = dirNames[dirIndexes[num]];
-		if (fpLookupEquals(fpc, fp1, dirName, baseNames[num])) {
-		    dbiIndexSetAppendOne(*matches, dbiIndexRecordOffset(allMatches, i),
-					 dbiIndexRecordFileNumber(allMatches, i), 0);
-		}
+	    if (h == NULL) {
+		i++;
+		continue;
 	    }
-
-	    prevoff = offset;
-	    i++;
-	    if (i < allMatches->count)
-		offset = dbiIndexRecordOffset(allMatches, i);
-	} while (i < allMatches->count && offset == prevoff);
-
-	rpmtdFreeData(&bn);
-	rpmtdFreeData(&dn);
-	rpmtdFreeData(&di);
-	if (usestate)
-	    rpmtdFreeData(&fs);
-	headerFree(h);
+	    matchFiles(fpc, h, usestate, allMatches, &i, run, fps, nrun,
+		       matches);
+	    headerFree(h);
+	}
+	for (int r = 0; r < nrun; r++)
+	    free(fps[r]);
+	free(fps);
     }
 
-    free(fp1);
+exit:
+    for (int k = 0; sets && k < nkeys; k++)
+	dbiIndexSetFree(sets[k]);
+    for (int i = 0; i < npaths; i++)
+	free(reqs[i].dirName);
     fpCacheFree(fpc);
+    free(sets);
+    free(runs);
+    free(keylens);
+    free(keys);
+    free(reqs);
+    return rc;
+}
 
-    if ((*matches)->count == 0) {
-	*matches = dbiIndexSetFree(*matches);
-	rc = RPMRC_NOTFOUND;
-    } else {
-	rc = RPMRC_OK;
-    }
+/**
+ * Find file matches in database.
+ * @param db		rpm database
+ * @param dbi		index database handle (always RPMDBI_BASENAMES)
+ * @param filespec
+ * @param usestate	take file state into account?
+ * @param[out] matches
+ * @return 		RPMRC_OK on match, RPMRC_NOMATCH or RPMRC_FAIL
+ */
+static rpmRC rpmdbFindByFile(rpmdb db, dbiIndex dbi, const char *filespec,
+			   int usestate, dbiIndexSet * matches)
+{
+    rpmRC rc = RPMRC_FAIL; /* assume error */
 
-exit:
-    dbiIndexSetFree(allMatches);
-    free(dirName);
+    *matches = NULL;
+    if (filespec == NULL) return rc; /* nothing alloced yet */
+
+    rc = rpmdbFindByFiles(db, dbi, 1, &filespec, usestate, matches);
+    if (rc == RPMRC_OK && *matches == NULL)
+	rc = RPMRC_NOTFOUND;
     return rc;
 }
 
-int rpmdbCountPackages(rpmdb db, const char * name)
+int rpmdbCountIndex(rpmdb db, rpmDbiTagVal rpmtag,
+		    const void * keyp, size_t keylen)
 {
     int count = -1;
     dbiIndex dbi = NULL;
 
-    if (name != NULL && indexOpen(db, RPMDBI_NAME, 0, &dbi) == 0) {
-	dbiIndexSet matches = NULL;
+    if (db != NULL && keyp != NULL && indexOpen(db, rpmtag, 0, &dbi) == 0) {
+	unsigned int n = 0;
+	rpmRC rc = indexCount(dbi, keyp, keylen ? keylen : strlen(keyp), &n);
 
-	rpmRC rc = indexGet(dbi, name, strlen(name), &matches);
-
-	if (rc == RPMRC_OK) {
-	    count = dbiIndexSetCount(matches);
-	} else {
-	    count = (rc == RPMRC_NOTFOUND) ? 0 : -1;
-	}
-	dbiIndexSetFree(matches);
+	if (rc == RPMRC_OK || rc == RPMRC_NOTFOUND)
+	    count = n;
     }
 
     return count;
 }
 
+int rpmdbCountPackages(rpmdb db, const char * name)
+{
+    return rpmdbCountIndex(db, RPMDBI_NAME, name, 0);
+}
+
 /**
  * Attempt partial matches on name[-version[-release]][.arch] strings.
  * @param db		rpmdb handle
@@ -694,6 +1487,48 @@ int rpmdbCountPackages(rpmdb db, const char * name)
  * @param[out] matches	set of header instances that match
  * @return 		RPMRC_OK on match, RPMRC_NOMATCH or RPMRC_FAIL
  */
+/* Does the string match only itself as an iterator pattern? */
+static int isLiteral(const char *s)
+{
+    return (s == NULL || strpbrk(s, "*?[]\\(){}|$") == NULL);
+}
+
+/*
+ * Look up an exact name-version-release[.arch] from the label index.
+ * Returns RPMRC_FAIL when there's no label index to use.
+ */
+static rpmRC labelIndexGet(rpmdb db, const char *name, const char *version,
+			   const char *release, const char *arch,
+			   dbiIndexSet *matches)
+{
+    dbiIndex dbi = NULL;
+    unsigned int gotMatches = 0;
+    char *key = NULL;
+    rpmRC rc;
+
+    if (indexOpen(db, RPMDBI_NVRA, 0, &dbi))
+	return RPMRC_FAIL;
+
+    key = rstrscat(NULL, name, "-", version, "-", release,
+		   arch ? "." : "", arch ? arch : "", NULL);
+    rc = indexGet(dbi, key, strlen(key), matches);
+
+    /* The tag number tells labels with and without the arch apart */
+    if (rc == RPMRC_OK) {
+	for (unsigned int i = 0; i < dbiIndexSetCount(*matches); i++) {
+	    if ((*matches)->recs[i].tagNum == (arch ? 1 : 0))
+		(*matches)->recs[gotMatches++] = (*matches)->recs[i];
+	}
+	(*matches)->count = gotMatches;
+	if (gotMatches == 0) {
+	    *matches = dbiIndexSetFree(*matches);
+	    rc = RPMRC_NOTFOUND;
+	}
+    }
+    free(key);
+    return rc;
+}
+
 static rpmRC dbiFindMatches(rpmdb db, dbiIndex dbi,
 		const char * name,
 		int64_t epoch,
@@ -706,6 +1541,14 @@ static rpmRC dbiFindMatches(rpmdb db, dbiIndex dbi,
     rpmRC rc;
     unsigned int i;
 
+    /* Exact labels without an epoch resolve without loading headers */
+    if (epoch < 0 && version && release &&
+	    isLiteral(version) && isLiteral(release) && isLiteral(arch)) {
+	rc = labelIndexGet(db, name, version, release, arch, matches);
+	if (rc != RPMRC_FAIL)
+	    goto exit;
+    }
+
     rc = indexGet(dbi, name, strlen(name), matches);
 
     /* No matches on the name, anything else wont match either */
@@ -903,6 +1746,25 @@ static rpmRC dbiFindByLabel(rpmdb db, dbiIndex dbi, const char * label,
  * @param dbi		index database handle
  * @return 		0 on success
  */
+static int dbShmIdentify(rpmdb db, struct hdrShmId_s *id)
+{
+    char *dbfile = rstrscat(NULL, db->db_fullpath, "/",
+			    db->db_ops->path, NULL);
+    int rc = hdrShmIdentify(dbfile, id);
+    free(dbfile);
+    return rc;
+}
+
+/* Forget the shared header cache of a database we are changing */
+static void dbShmDrop(rpmdb db)
+{
+    struct hdrShmId_s id;
+
+    if (db->db_shmdir && dbShmIdentify(db, &id) == 0)
+	hdrShmRemove(db->db_shmdir, &id);
+    db->db_hdrshm = hdrShmDetach(db->db_hdrshm);
+}
+
 static int miFreeHeader(rpmdbMatchIterator mi, dbiIndex dbi)
 {
     int rc = 0;
@@ -933,6 +1795,12 @@ static int miFreeHeader(rpmdbMatchIterator mi, dbiIndex dbi)
 	    dbCtrl(mi->mi_db, DB_CTRL_LOCK_RW);
 	    rc = pkgdbPut(dbi, mi->mi_dbc, &mi->mi_prevoffset,
 			  hdrBlob, hdrLen);
+	    hdrCacheDrop(mi->mi_db->db_hdrcache, mi->mi_prevoffset);
+	    dbShmDrop(mi->mi_db);
+	    /* Rewrites don't touch the triggers or the package list */
+	    mi->mi_db->db_trigchanged = 1;
+	    if (mi->mi_db->db_pkglist)
+		mi->mi_db->db_pkglistchanged = 1;
 	    dbCtrl(mi->mi_db, DB_CTRL_INDEXSYNC);
 	    dbCtrl(mi->mi_db, DB_CTRL_UNLOCK_RW);
 	    rpmsqBlock(SIG_UNBLOCK);
@@ -951,6 +1819,27 @@ static int miFreeHeader(rpmdbMatchIterator mi, dbiIndex dbi)
     return rc;
 }
 
+/*
+ * Read-only handles read from a snapshot for the lifetime of each
+ * iterator, shared by the nested ones. A query sees the database as it
+ * was before or after each concurrent write, never in between, without
+ * waiting for the writer. Backends without snapshots ignore this.
+ * Returns 1 if a snapshot was taken (and needs to be dropped).
+ */
+static int dbSnapshot(rpmdb db, int take)
+{
+    if (db == NULL || (db->db_mode & O_ACCMODE) != O_RDONLY)
+	return 0;
+
+    if (take) {
+	if (db->db_snapshots++ == 0)
+	    dbCtrl(db, DB_CTRL_SNAPSHOT);
+    } else if (db->db_snapshots > 0 && --db->db_snapshots == 0) {
+	dbCtrl(db, DB_CTRL_UNSNAPSHOT);
+    }
+    return 1;
+}
+
 rpmdbMatchIterator rpmdbFreeIterator(rpmdbMatchIterator mi)
 {
     dbiIndex dbi = NULL;
@@ -975,8 +1864,23 @@ rpmdbMatchIterator rpmdbFreeIterator(rpmdbMatchIterator mi)
 	}
     }
     mi->mi_re = _free(mi->mi_re);
+    mi->mi_tags = _free(mi->mi_tags);
+
+    if (mi->mi_pf) {
+	struct miPrefetch_s *pf = mi->mi_pf;
+	for (i = pf->next; i < pf->nitems; i++) {
+	    headerFree(pf->items[i].h);
+	    free(pf->items[i].uh);
+	}
+	free(pf->items);
+	mi->mi_pf = _free(mi->mi_pf);
+    }
 
+    mi->mi_shm = hdrShmDetach(mi->mi_shm);
+    mi->mi_shmb = hdrShmBuildFree(mi->mi_shmb);
     mi->mi_set = dbiIndexSetFree(mi->mi_set);
+    if (mi->mi_snapshot)
+	dbSnapshot(mi->mi_db, 0);
     rpmdbClose(mi->mi_db);
     mi->mi_ts = rpmtsFree(mi->mi_ts);
 
@@ -1167,6 +2071,49 @@ static char * mireDup(rpmTagVal tag, rpmMireMode *modep,
     return pat;
 }
 
+static void miAddTag(rpmdbMatchIterator mi, rpmTagVal tag)
+{
+    if (mi->mi_tags == NULL)
+	return;
+    for (int i = 0; i < mi->mi_ntags; i++) {
+	if (mi->mi_tags[i] == tag)
+	    return;
+    }
+    mi->mi_tags = xrealloc(mi->mi_tags,
+			   (mi->mi_ntags + 2) * sizeof(*mi->mi_tags));
+    mi->mi_tags[mi->mi_ntags++] = tag;
+    mi->mi_tags[mi->mi_ntags] = 0;
+}
+
+int rpmdbSetIteratorTags(rpmdbMatchIterator mi, const rpmTagVal * tags)
+{
+    if (mi == NULL)
+	return -1;
+
+    mi->mi_tags = _free(mi->mi_tags);
+    mi->mi_ntags = 0;
+    /* Partial headers must never be written back */
+    if (tags == NULL || (mi->mi_cflags & DBC_WRITE))
+	return (tags == NULL) ? 0 : -1;
+
+    mi->mi_tags = xcalloc(1, sizeof(*mi->mi_tags));
+    miAddTag(mi, RPMTAG_NAME);
+    for (int i = 0; i < mi->mi_nre; i++)
+	miAddTag(mi, mi->mi_re[i].tag);
+    for (; *tags; tags++)
+	miAddTag(mi, *tags);
+    return 0;
+}
+
+/* Projected imports copy what they need, the blob is never retained */
+static Header miImport(const rpmTagVal * tags, unsigned char * uh,
+			unsigned int uhlen, headerImportFlags flags)
+{
+    if (tags)
+	return headerImportTags(uh, uhlen, tags);
+    return headerImport(uh, uhlen, flags);
+}
+
 int rpmdbSetIteratorRE(rpmdbMatchIterator mi, rpmTagVal tag,
 		rpmMireMode mode, const char * pattern)
 {
@@ -1263,6 +2210,8 @@ int rpmdbSetIteratorRE(rpmdbMatchIterator mi, rpmTagVal tag,
     if (mi->mi_nre > 1)
 	qsort(mi->mi_re, mi->mi_nre, sizeof(*mi->mi_re), mireCmp);
 
+    miAddTag(mi, tag);
+
     return rc;
 }
 
@@ -1337,9 +2286,10 @@ int rpmdbSetIteratorRewrite(rpmdbMatchIterator mi, int rewrite)
     if (mi == NULL)
 	return 0;
     rc = (mi->mi_cflags & DBC_WRITE) ? 1 : 0;
-    if (rewrite)
+    if (rewrite) {
 	mi->mi_cflags |= DBC_WRITE;
-    else
+	rpmdbSetIteratorTags(mi, NULL);
+    } else
 	mi->mi_cflags &= ~DBC_WRITE;
     return rc;
 }
@@ -1365,40 +2315,311 @@ int rpmdbSetHdrChk(rpmdbMatchIterator mi, rpmts ts,
     return rc;
 }
 
-static rpmRC miVerifyHeader(rpmdbMatchIterator mi, const void *uh, size_t uhlen)
-{
-    rpmRC rpmrc = RPMRC_NOTFOUND;
+/*
+ * Headers are checked before they're written to the database, a blob
+ * the backend vouches for with its checksum is known to be one of those.
+ * Rebuilds still check everything, they are how damage gets repaired.
+ */
+static rpmRC miVerifyHeader(rpmdbMatchIterator mi, const void *uh, size_t uhlen,
+			    int trusted)
+{
+    rpmRC rpmrc = RPMRC_NOTFOUND;
+
+    if (!(mi->mi_hdrchk && mi->mi_ts))
+	return rpmrc;
+
+    if (trusted && !(mi->mi_db->db_flags & RPMDB_FLAG_REBUILD))
+	return RPMRC_OK;
+
+    /* Don't bother re-checking a previously read header. */
+    if (mi->mi_db->db_checked) {
+	rpmRC *res;
+	if (dbChkGetEntry(mi->mi_db->db_checked, mi->mi_offset,
+			  &res, NULL, NULL)) {
+	    rpmrc = res[0];
+	}
+    }
+
+    /* If blob is unchecked, check blob import consistency now. */
+    if (rpmrc != RPMRC_OK) {
+	char * msg = NULL;
+	int lvl;
+
+	rpmrc = (*mi->mi_hdrchk) (mi->mi_ts, uh, uhlen, &msg);
+	lvl = (rpmrc == RPMRC_FAIL ? RPMLOG_ERR : RPMLOG_DEBUG);
+	rpmlog(lvl, "%s h#%8u %s\n",
+	    (rpmrc == RPMRC_FAIL ? _("rpmdbNextIterator: skipping") : " read"),
+		    mi->mi_offset, (msg ? msg : ""));
+	msg = _free(msg);
+
+	/* Mark header checked. */
+	if (mi->mi_db && mi->mi_db->db_checked) {
+	    dbChkAddEntry(mi->mi_db->db_checked, mi->mi_offset, rpmrc);
+	}
+    }
+    return rpmrc;
+}
+
+/*
+ * Return the literal prefix every name matched by a selector starts with,
+ * NULL if there's none (or it can't be told).
+ */
+static char * mirePrefix(miRE mire)
+{
+    const char * s = mire->pattern;
+    const char * meta = NULL;
+    char * pfx, * t;
+
+    switch (mire->mode) {
+    case RPMMIRE_STRCMP:
+	return xstrdup(s);
+    case RPMMIRE_GLOB:
+	meta = "*?[";
+	break;
+    case RPMMIRE_REGEX:
+	/* Alternatives can match anything, don't bother parsing them */
+	if (*s++ != '^' || strchr(s, '|'))
+	    return NULL;
+	meta = ".[]()*+?{}^$";
+	break;
+    default:
+	return NULL;
+    }
+
+    pfx = t = xmalloc(strlen(s) + 1);
+    while (*s) {
+	const char * c = s;
+	if (*s == '\\') {
+	    if (s[1] == '\0' || (mire->mode == RPMMIRE_REGEX && risalnum(s[1])))
+		break;
+	    c = s + 1;
+	} else if (strchr(meta, *s)) {
+	    break;
+	}
+	s = c + 1;
+	/* An optional atom is not part of the prefix */
+	if (mire->mode == RPMMIRE_REGEX && *s && strchr("*?{", *s))
+	    break;
+	*t++ = *c;
+	if (mire->mode == RPMMIRE_REGEX && *s == '+')
+	    break;
+    }
+    *t = '\0';
+
+    if (*pfx == '\0')
+	pfx = _free(pfx);
+    return pfx;
+}
+
+/*
+ * Narrow full scans with name selectors down to the packages found by
+ * prefix searches of the Name index. The selectors are still applied to
+ * every header, this only avoids loading those that can't match.
+ */
+static void miNarrowByName(rpmdbMatchIterator mi)
+{
+    dbiIndexSet set = NULL;
+    dbiIndex dbi = NULL;
+    int nname = 0;
+
+    if (mi->mi_rpmtag != RPMDBI_PACKAGES || mi->mi_set != NULL)
+	return;
+
+    /* Name selectors are or'ed, all of them need a usable prefix */
+    for (int i = 0; i < mi->mi_nre; i++) {
+	if (mi->mi_re[i].tag != RPMTAG_NAME)
+	    continue;
+	if (mi->mi_re[i].notmatch)
+	    return;
+	nname++;
+    }
+    if (nname == 0 || indexOpen(mi->mi_db, RPMDBI_NAME, 0, &dbi))
+	return;
+
+    set = dbiIndexSetNew(0);
+    for (int i = 0; i < mi->mi_nre; i++) {
+	dbiIndexSet pset = NULL;
+	char * pfx;
+	rpmRC rc;
+
+	if (mi->mi_re[i].tag != RPMTAG_NAME)
+	    continue;
+	if ((pfx = mirePrefix(mi->mi_re + i)) == NULL) {
+	    set = dbiIndexSetFree(set);
+	    break;
+	}
+	rc = indexPrefixGet(dbi, pfx, 0, &pset);
+	if (rc == RPMRC_OK)
+	    dbiIndexSetAppendSet(set, pset, 0);
+	dbiIndexSetFree(pset);
+	free(pfx);
+	if (rc != RPMRC_OK && rc != RPMRC_NOTFOUND) {
+	    set = dbiIndexSetFree(set);
+	    break;
+	}
+    }
+
+    if (set) {
+	mi->mi_set = set;
+	rpmdbSortIterator(mi);
+	rpmdbUniqIterator(mi);
+    }
+}
+
+static struct miPrefetch_s *miPrefetchNew(rpmdbMatchIterator mi)
+{
+    struct miPrefetch_s *pf = NULL;
+    int nthreads;
+
+    /* Only plain read-only sequential traversals are read ahead */
+    if (mi->mi_set || (mi->mi_cflags & DBC_WRITE))
+	return NULL;
+    nthreads = rpmworkersCount("_db_prefetch_threads");
+    if (nthreads > 1) {
+	pf = xcalloc(1, sizeof(*pf));
+	pf->nthreads = nthreads;
+	pf->size = nthreads * 8;
+	pf->items = xcalloc(pf->size, sizeof(*pf->items));
+    }
+    return pf;
+}
+
+static void miPrefetchImport(void *data, int ix, int slot)
+{
+    struct miPrefetch_s *pf = data;
+    struct miPrefetchItem_s *item = &pf->items[ix];
+
+    if (item->uh) {
+	item->h = miImport(pf->tags, item->uh, item->uhlen,
+			   HEADERIMPORT_FAST|HEADERIMPORT_LAZY);
+	if (item->h == NULL || pf->tags)
+	    free(item->uh);
+	item->uh = NULL;
+    }
+}
+
+/*
+ * Read the next batch of blobs in cursor order, verifying them on the
+ * way as the header check callback and db_checked aren't thread safe,
+ * then import them in parallel.
+ */
+static int miPrefetchFill(rpmdbMatchIterator mi, dbiIndex dbi)
+{
+    struct miPrefetch_s *pf = mi->mi_pf;
+
+    pf->nitems = pf->next = 0;
+    pf->tags = mi->mi_tags;
+    while (!pf->eof && pf->nitems < pf->size) {
+	struct miPrefetchItem_s *item;
+	unsigned char *uh = NULL;
+	unsigned int uhlen = 0;
+	unsigned int offset = 0;
+
+	if (pkgdbGet(dbi, mi->mi_dbc, 0, &uh, &uhlen) == 0)
+	    offset = pkgdbKey(dbi, mi->mi_dbc);
+	if (uh == NULL || (offset == 0 && pf->nread)) {
+	    pf->eof = 1;
+	    break;
+	}
+	pf->nread++;
+	if (offset == 0)
+	    continue;
+
+	item = &pf->items[pf->nitems++];
+	memset(item, 0, sizeof(*item));
+	item->offset = offset;
+	mi->mi_offset = offset;
+	if (miVerifyHeader(mi, uh, uhlen,
+			   pkgdbTrusted(dbi, mi->mi_dbc)) == RPMRC_FAIL) {
+	    item->skip = 1;
+	    continue;
+	}
+	item->uh = memcpy(xmalloc(uhlen), uh, uhlen);
+	item->uhlen = uhlen;
+    }
+    rpmworkersRun(pf->nthreads, pf->nitems, miPrefetchImport, pf);
+    return pf->nitems;
+}
+
+static Header miPrefetchNext(rpmdbMatchIterator mi, dbiIndex dbi)
+{
+    struct miPrefetch_s *pf = mi->mi_pf;
+
+    while (1) {
+	struct miPrefetchItem_s *item;
+
+	miFreeHeader(mi, dbi);
+	if (pf->next >= pf->nitems && miPrefetchFill(mi, dbi) == 0)
+	    return NULL;
+
+	item = &pf->items[pf->next++];
+	mi->mi_offset = item->offset;
+	mi->mi_setx++;
+	if (item->skip)
+	    continue;
+
+	mi->mi_h = item->h;
+	item->h = NULL;
+	if (mi->mi_h == NULL || !headerIsEntry(mi->mi_h, RPMTAG_NAME)) {
+	    rpmlog(RPMLOG_ERR,
+		    _("rpmdb: damaged header #%u retrieved -- skipping.\n"),
+		    mi->mi_offset);
+	    continue;
+	}
+
+	if (mireSkip(mi))
+	    continue;
+	headerSetInstance(mi->mi_h, mi->mi_offset);
 
-    if (!(mi->mi_hdrchk && mi->mi_ts))
-	return rpmrc;
+	mi->mi_prevoffset = mi->mi_offset;
+	mi->mi_modified = 0;
 
-    /* Don't bother re-checking a previously read header. */
-    if (mi->mi_db->db_checked) {
-	rpmRC *res;
-	if (dbChkGetEntry(mi->mi_db->db_checked, mi->mi_offset,
-			  &res, NULL, NULL)) {
-	    rpmrc = res[0];
-	}
+	return mi->mi_h;
     }
+}
 
-    /* If blob is unchecked, check blob import consistency now. */
-    if (rpmrc != RPMRC_OK) {
-	char * msg = NULL;
-	int lvl;
+/*
+ * Use the shared header cache if it matches the database, otherwise have
+ * full scans store one. Rewriting iterators and rebuilds read the
+ * database itself.
+ */
+static void miShmInit(rpmdbMatchIterator mi)
+{
+    rpmdb db = mi->mi_db;
+    struct hdrShmId_s id;
+
+    if (db->db_shmdir == NULL || (db->db_flags & RPMDB_FLAG_REBUILD) ||
+	    (mi->mi_cflags & DBC_WRITE) || dbShmIdentify(db, &id))
+	return;
+
+    if (db->db_hdrshm && !hdrShmMatches(db->db_hdrshm, &id))
+	db->db_hdrshm = hdrShmDetach(db->db_hdrshm);
+    if (db->db_hdrshm == NULL)
+	db->db_hdrshm = hdrShmAttach(db->db_shmdir, &id);
+
+    if (db->db_hdrshm)
+	mi->mi_shm = hdrShmLink(db->db_hdrshm);
+    else if (mi->mi_set == NULL)
+	mi->mi_shmb = hdrShmBuildNew(&id);
+}
 
-	rpmrc = (*mi->mi_hdrchk) (mi->mi_ts, uh, uhlen, &msg);
-	lvl = (rpmrc == RPMRC_FAIL ? RPMLOG_ERR : RPMLOG_DEBUG);
-	rpmlog(lvl, "%s h#%8u %s\n",
-	    (rpmrc == RPMRC_FAIL ? _("rpmdbNextIterator: skipping") : " read"),
-		    mi->mi_offset, (msg ? msg : ""));
-	msg = _free(msg);
+/* A full scan ended, share what it read if it got to the end */
+static void miShmStore(rpmdbMatchIterator mi, int complete)
+{
+    if (mi->mi_shmb && complete)
+	hdrShmBuildWrite(mi->mi_shmb, mi->mi_db->db_shmdir);
+    mi->mi_shmb = hdrShmBuildFree(mi->mi_shmb);
+}
 
-	/* Mark header checked. */
-	if (mi->mi_db && mi->mi_db->db_checked) {
-	    dbChkAddEntry(mi->mi_db->db_checked, mi->mi_offset, rpmrc);
-	}
-    }
-    return rpmrc;
+/*
+ * Only complete headers of lookups are cached, full scans would just
+ * cycle the whole database through it. Rewriting iterators may modify
+ * their headers, which must not be shared.
+ */
+static int miCacheable(rpmdbMatchIterator mi)
+{
+    return (mi->mi_db->db_hdrcache && mi->mi_set && mi->mi_tags == NULL &&
+	    !(mi->mi_cflags & DBC_WRITE));
 }
 
 /* FIX: mi->mi_key.data may be NULL */
@@ -1408,7 +2629,9 @@ Header rpmdbNextIterator(rpmdbMatchIterator mi)
     unsigned char * uh;
     unsigned int uhlen;
     int rc;
-    headerImportFlags importFlags = HEADERIMPORT_FAST;
+    int trusted;
+    int shared;
+    headerImportFlags importFlags = HEADERIMPORT_FAST|HEADERIMPORT_LAZY;
 
     if (mi == NULL)
 	return NULL;
@@ -1424,12 +2647,21 @@ Header rpmdbNextIterator(rpmdbMatchIterator mi)
      * iterator on 1st call. If the iteration is to rewrite headers,
      * then the cursor needs to marked with DBC_WRITE as well.
      */
-    if (mi->mi_dbc == NULL)
+    if (mi->mi_dbc == NULL) {
+	miNarrowByName(mi);
 	mi->mi_dbc = dbiCursorInit(dbi, mi->mi_cflags);
+	miShmInit(mi);
+	if (mi->mi_shm == NULL && mi->mi_shmb == NULL)
+	    mi->mi_pf = miPrefetchNew(mi);
+    }
+
+    if (mi->mi_pf)
+	return miPrefetchNext(mi, dbi);
 
 top:
     uh = NULL;
     uhlen = 0;
+    shared = 0;
 
     do {
 	if (mi->mi_set) {
@@ -1437,14 +2669,22 @@ top:
 		return NULL;
 	    mi->mi_offset = dbiIndexRecordOffset(mi->mi_set, mi->mi_setx);
 	    mi->mi_filenum = dbiIndexRecordFileNumber(mi->mi_set, mi->mi_setx);
+	} else if (mi->mi_shm) {
+	    if (!(mi->mi_shmix < hdrShmCount(mi->mi_shm)))
+		return NULL;
+	    uh = (unsigned char *) hdrShmBlob(mi->mi_shm, mi->mi_shmix++,
+					      &mi->mi_offset, &uhlen);
+	    shared = 1;
 	} else {
 	    rc = pkgdbGet(dbi, mi->mi_dbc, 0, &uh, &uhlen);
 	    if (rc == 0)
 		mi->mi_offset = pkgdbKey(dbi, mi->mi_dbc);
 
 	    /* Terminate on error or end of keys */
-	    if (rc || (mi->mi_setx && mi->mi_offset == 0))
+	    if (rc || (mi->mi_setx && mi->mi_offset == 0)) {
+		miShmStore(mi, rc == RPMRC_NOTFOUND);
 		return NULL;
+	    }
 	}
 	mi->mi_setx++;
     } while (mi->mi_offset == 0);
@@ -1453,12 +2693,34 @@ top:
     if (mi->mi_prevoffset && mi->mi_offset == mi->mi_prevoffset)
 	return mi->mi_h;
 
+    /* Verified and imported earlier? */
+    if (uh == NULL && miCacheable(mi)) {
+	Header h = hdrCacheGet(mi->mi_db->db_hdrcache, mi->mi_offset);
+	if (h) {
+	    miFreeHeader(mi, dbi);
+	    mi->mi_h = h;
+	    mi->mi_db->db_hdrhitops.count++;
+	    goto imported;
+	}
+    }
+
+    /* Shared by another process? Those blobs were checked already. */
+    if (uh == NULL && mi->mi_shm) {
+	int ix = hdrShmFind(mi->mi_shm, mi->mi_offset);
+	if (ix >= 0) {
+	    unsigned int hdrNum;
+	    uh = (unsigned char *) hdrShmBlob(mi->mi_shm, ix, &hdrNum, &uhlen);
+	    shared = 1;
+	}
+    }
+
     /* Retrieve next header blob for index iterator. */
     if (uh == NULL) {
 	rc = pkgdbGet(dbi, mi->mi_dbc, mi->mi_offset, &uh, &uhlen);
 	if (rc)
 	    return NULL;
     }
+    trusted = shared || ((uh != NULL) && pkgdbTrusted(dbi, mi->mi_dbc));
 
     /* Rewrite current header (if necessary) and unlink. */
     miFreeHeader(mi, dbi);
@@ -1468,19 +2730,27 @@ top:
 	return NULL;
 
     /* Verify header if enabled, skip damaged and inconsistent headers */
-    if (miVerifyHeader(mi, uh, uhlen) == RPMRC_FAIL) {
+    if (miVerifyHeader(mi, uh, uhlen, trusted) == RPMRC_FAIL) {
 	goto top;
     }
 
     /* Did the header blob load correctly? */
-    mi->mi_h = headerImport(uh, uhlen, importFlags);
+    mi->mi_h = miImport(mi->mi_tags, uh, uhlen, importFlags);
     if (mi->mi_h == NULL || !headerIsEntry(mi->mi_h, RPMTAG_NAME)) {
 	rpmlog(RPMLOG_ERR,
 		_("rpmdb: damaged header #%u retrieved -- skipping.\n"),
 		mi->mi_offset);
 	goto top;
     }
+    if (mi->mi_shmb)
+	hdrShmBuildAdd(mi->mi_shmb, mi->mi_offset, uh, uhlen);
+    if (miCacheable(mi)) {
+	hdrCachePut(mi->mi_db->db_hdrcache, mi->mi_offset, mi->mi_h);
+	mi->mi_db->db_hdrmissops.count++;
+	mi->mi_db->db_hdrmissops.bytes += uhlen;
+    }
 
+imported:
     /*
      * Skip this header if iterator selector (if any) doesn't match.
      */
@@ -1541,6 +2811,57 @@ int rpmdbExtendIterator(rpmdbMatchIterator mi,
     return rc;
 }
 
+static int extendIteratorKeys(rpmdbMatchIterator mi, const char **keys,
+			      const size_t *keylens, int nkeys, int sorted)
+{
+    dbiIndex dbi = NULL;
+    dbiIndexSet *sets;
+    int rc = 1; /* assume failure */
+    int found = 0;
+
+    if (mi == NULL || keys == NULL)
+	return rc;
+
+    if (indexOpen(mi->mi_db, mi->mi_rpmtag, 0, &dbi))
+	return rc;
+
+    sets = xcalloc(nkeys, sizeof(*sets));
+    if (indexGetBatch(dbi, keys, keylens, nkeys, sets, sorted) == RPMRC_OK) {
+	for (int i = 0; i < nkeys; i++) {
+	    if (sets[i] == NULL)
+		continue;
+	    if (mi->mi_set == NULL) {
+		mi->mi_set = sets[i];
+		sets[i] = NULL;
+	    } else {
+		dbiIndexSetAppendSet(mi->mi_set, sets[i], 0);
+	    }
+	    found = 1;
+	}
+	if (found) {
+	    mi->mi_sorted = 0;
+	    rc = 0;
+	}
+    }
+    for (int i = 0; i < nkeys; i++)
+	dbiIndexSetFree(sets[i]);
+    free(sets);
+
+    return rc;
+}
+
+int rpmdbExtendIteratorBatch(rpmdbMatchIterator mi, const char **keys,
+			     const size_t *keylens, int nkeys)
+{
+    return extendIteratorKeys(mi, keys, keylens, nkeys, 0);
+}
+
+int rpmdbExtendIteratorSorted(rpmdbMatchIterator mi, const char **keys,
+			      const size_t *keylens, int nkeys)
+{
+    return extendIteratorKeys(mi, keys, keylens, nkeys, 1);
+}
+
 int rpmdbFilterIterator(rpmdbMatchIterator mi, packageHash hdrNums, int neg)
 {
     if (mi == NULL || hdrNums == NULL)
@@ -1628,6 +2949,8 @@ rpmdbMatchIterator rpmdbNewIterator(rpmdb db, rpmDbiTagVal dbitag)
     mi->mi_filenum = 0;
     mi->mi_nre = 0;
     mi->mi_re = NULL;
+    mi->mi_tags = NULL;
+    mi->mi_ntags = 0;
 
     mi->mi_ts = NULL;
     mi->mi_hdrchk = NULL;
@@ -1708,15 +3031,67 @@ rpmdbMatchIterator rpmdbInitIterator(rpmdb db, rpmDbiTagVal rpmtag,
     rpmdbMatchIterator mi = NULL;
 
     if (db != NULL) {
+	/* The index lookup needs to come from the snapshot too */
+	int snap = dbSnapshot(db, 1);
+
 	if (rpmtag == RPMDBI_PACKAGES)
 	    mi = pkgdbIterInit(db, keyp, keylen);
 	else
 	    mi = indexIterInit(db, rpmtag, keyp, keylen);
+
+	if (mi)
+	    mi->mi_snapshot = snap;
+	else if (snap)
+	    dbSnapshot(db, 0);
     }
 
     return mi;
 }
 
+int rpmdbInitFileIterators(rpmdb db, rpmDbiTagVal rpmtag,
+			   const char ** paths, int npaths,
+			   rpmdbMatchIterator * mis)
+{
+    dbiIndexSet *sets;
+    dbiIndex dbi = NULL;
+    int snap;
+    int rc = -1;
+
+    for (int i = 0; i < npaths; i++)
+	mis[i] = NULL;
+
+    if (db == NULL || paths == NULL || npaths <= 0 ||
+	    (rpmtag != RPMDBI_INSTFILENAMES && rpmtag != RPMDBI_BASENAMES))
+	return rc;
+
+    if (indexOpen(db, RPMDBI_BASENAMES, 0, &dbi))
+	return rc;
+
+    /* The lookup and each of the iterators read the same snapshot */
+    snap = dbSnapshot(db, 1);
+    sets = xcalloc(npaths, sizeof(*sets));
+    if (rpmdbFindByFiles(db, dbi, npaths, paths,
+			 (rpmtag == RPMDBI_INSTFILENAMES), sets) == RPMRC_OK) {
+	for (int i = 0; i < npaths; i++) {
+	    if (sets[i] == NULL)
+		continue;
+	    mis[i] = rpmdbNewIterator(db, RPMDBI_BASENAMES);
+	    mis[i]->mi_set = sets[i];
+	    mis[i]->mi_snapshot = dbSnapshot(db, 1);
+	    rpmdbSortIterator(mis[i]);
+	    sets[i] = NULL;
+	}
+	rc = 0;
+    }
+    for (int i = 0; i < npaths; i++)
+	dbiIndexSetFree(sets[i]);
+    free(sets);
+    if (snap)
+	dbSnapshot(db, 0);
+
+    return rc;
+}
+
 rpmdbMatchIterator rpmdbInitPrefixIterator(rpmdb db, rpmDbiTagVal rpmtag,
 					    const void * pfx, size_t plen)
 {
@@ -1731,15 +3106,19 @@ rpmdbMatchIterator rpmdbInitPrefixIterator(rpmdb db, rpmDbiTagVal rpmtag,
     if (db != NULL && rpmtag != RPMDBI_PACKAGES) {
 
 	if (indexOpen(db, dbtag, 0, &dbi) == 0) {
+	    int snap = dbSnapshot(db, 1);
 	    int rc = 0;
 
 	    rc = indexPrefixGet(dbi, pfx, plen, &set);
 
 	    if (rc)	{
 		set = dbiIndexSetFree(set);
+		if (snap)
+		    dbSnapshot(db, 0);
 	    } else {
 		mi = rpmdbNewIterator(db, dbtag);
 		mi->mi_set = set;
+		mi->mi_snapshot = snap;
 		rpmdbSortIterator(mi);
 	    }
 	}
@@ -1816,6 +3195,8 @@ rpmdbIndexIterator rpmdbIndexIteratorInit(rpmdb db, rpmDbiTag rpmtag)
     if (indexOpen(db, rpmtag, 0, &dbi))
 	return NULL;
 
+    indexFlush(dbi);
+
     ii = xcalloc(1, sizeof(*ii));
     ii->ii_db = rpmdbLink(db);
     ii->ii_rpmtag = rpmtag;
@@ -1973,31 +3354,43 @@ static void logAddRemove(const char *dbiname, int removing, rpmtd tagdata)
     }
 }
 
-int rpmdbRemove(rpmdb db, unsigned int hdrNum)
+int rpmdbRemove(rpmdb db, unsigned int hdrNum, Header h)
 {
     dbiIndex dbi = NULL;
     dbiCursor dbc = NULL;
-    Header h;
     int ret = 0;
 
     if (db == NULL)
 	return 0;
 
-    h = rpmdbGetHeaderAt(db, hdrNum);
+    /* Backends removing index items by package don't need the header */
+    if (h != NULL) {
+	h = headerLink(h);
+    } else if (db->db_ops->idxdbDelPkg == NULL) {
+	h = rpmdbGetHeaderAt(db, hdrNum);
+	if (h == NULL) {
+	    rpmlog(RPMLOG_ERR, _("%s: cannot read header at 0x%x\n"),
+		  "rpmdbRemove", hdrNum);
+	    return 1;
+	}
+    }
 
     if (h == NULL) {
-	rpmlog(RPMLOG_ERR, _("%s: cannot read header at 0x%x\n"),
-	      "rpmdbRemove", hdrNum);
-	return 1;
+	rpmlog(RPMLOG_DEBUG, "  --- h#%8u\n", hdrNum);
+	RPM_PROBE2(db_remove, "", hdrNum);
     } else {
 	char *nevra = headerGetAsString(h, RPMTAG_NEVRA);
 	rpmlog(RPMLOG_DEBUG, "  --- h#%8u %s\n", hdrNum, nevra);
+	RPM_PROBE2(db_remove, nevra, hdrNum);
 	free(nevra);
     }
 
-    if (pkgdbOpen(db, 0, &dbi))
+    if (pkgdbOpen(db, 0, &dbi)) {
+	headerFree(h);
 	return 1;
+    }
 
+    dbPkgListPrepare(db);
     rpmsqBlock(SIG_BLOCK);
     dbCtrl(db, DB_CTRL_LOCK_RW);
 
@@ -2005,20 +3398,42 @@ int rpmdbRemove(rpmdb db, unsigned int hdrNum)
     dbc = dbiCursorInit(dbi, DBC_WRITE);
     ret = pkgdbDel(dbi, dbc, hdrNum);
     dbiCursorFree(dbi, dbc);
+    hdrCacheDrop(db->db_hdrcache, hdrNum);
+    dbShmDrop(db);
+    dbFilterDrop(db);
+    if (ret == 0 && db->db_trigidx) {
+	trigIndexRemove(db->db_trigidx, hdrNum);
+	db->db_trigchanged = 1;
+    }
+    if (ret == 0 && db->db_usepkglist) {
+	if (db->db_pkglist)
+	    pkgListRemove(db->db_pkglist, hdrNum);
+	db->db_pkglistchanged = 1;
+    }
 
     /* Remove associated data from secondary indexes */
     if (ret == 0) {
 	for (int dbix = 0; dbix < db->db_ndbi; dbix++) {
 	    rpmDbiTag rpmtag = db->db_tags[dbix];
 
+	    struct idxJournal_s *j;
+
 	    if (indexOpen(db, rpmtag, 0, &dbi))
 		continue;
 
-	    ret += idxdbDel(dbi, rpmtag, hdrNum, h);
+	    if ((j = dbiJournal(dbi)) == NULL) {
+		ret += idxdbDel(dbi, rpmtag, hdrNum, h);
+	    } else if (idxdbCanDelPkg(dbi)) {
+		idxJournalDelPkg(j, hdrNum);
+	    } else {
+		ret += journalUpdate(dbi, j, rpmtag, hdrNum, h, 1);
+	    }
 	}
     }
 
-    dbCtrl(db, DB_CTRL_INDEXSYNC);
+    /* With deferred updates the indexes are synced when flushed */
+    if (db->db_journals == NULL)
+	dbCtrl(db, DB_CTRL_INDEXSYNC);
     dbCtrl(db, DB_CTRL_UNLOCK_RW);
     rpmsqBlock(SIG_UNBLOCK);
 
@@ -2080,9 +3495,8 @@ static rpmRC updateRichDepCB(void *cbdata, rpmrichParseType type,
     return RPMRC_OK;
 }
 
-static rpmRC updateRichDep(dbiIndex dbi, dbiCursor dbc, const char *str,
-                           struct dbiIndexItem_s *rec,
-                           idxfunc idxupdate)
+static rpmRC updateRichDep(const char *str, struct dbiIndexItem_s *rec,
+                           keyfunc keyupdate, void *keydata)
 {
     int n, i, rc = 0;
     struct updateRichDepData data;
@@ -2102,7 +3516,7 @@ static rpmRC updateRichDep(dbiIndex dbi, dbiCursor dbc, const char *str,
 		    continue;       /* ignore dups */
 		if (*name == ' ')
 		    name++;
-		rc += idxupdate(dbi, dbc, name, strlen(name), rec);
+		rc += keyupdate(keydata, name, strlen(name), rec);
 	    }
 	}
     }
@@ -2111,13 +3525,44 @@ static rpmRC updateRichDep(dbiIndex dbi, dbiCursor dbc, const char *str,
     return rc;
 }
 
-rpmRC tag2index(dbiIndex dbi, rpmTagVal rpmtag,
-		       unsigned int hdrNum, Header h,
-		       idxfunc idxupdate)
+/*
+ * The label index has the name-version-release (tag number 0) and
+ * name-version-release.arch (tag number 1) of each package as keys.
+ */
+static rpmRC label2keys(const char *dbiname, unsigned int hdrNum, Header h,
+			keyfunc keyupdate, void *keydata)
+{
+    static const rpmTagVal labelTags[] = { RPMTAG_NVR, RPMTAG_NVRA };
+    int rc = 0;
+
+    for (int i = 0; i < 2; i++) {
+	struct dbiIndexItem_s rec = { .hdrNum = hdrNum, .tagNum = i };
+	char *key;
+	/* No arch, no label with one (gpg-pubkey) */
+	if (i == 1 && !headerIsEntry(h, RPMTAG_ARCH))
+	    continue;
+	if ((key = headerGetAsString(h, labelTags[i])) == NULL)
+	    continue;
+	if (dbiname) {
+	    rpmlog(RPMLOG_DEBUG, "adding \"%s\" to %s index.\n",
+		   key, dbiname);
+	}
+	rc += keyupdate(keydata, key, strlen(key), &rec);
+	free(key);
+    }
+    return (rc == 0) ? RPMRC_OK : RPMRC_FAIL;
+}
+
+/* Pass all index keys of rpmtag in header h to keyupdate() */
+rpmRC tag2keys(const char *dbiname, rpmTagVal rpmtag,
+		unsigned int hdrNum, Header h,
+		keyfunc keyupdate, void *keydata)
 {
     int i, rc = 0;
     struct rpmtd_s tagdata, reqflags, trig_index;
-    dbiCursor dbc = NULL;
+
+    if (rpmtag == RPMTAG_NVRA)
+	return label2keys(dbiname, hdrNum, h, keyupdate, keydata);
 
     switch (rpmtag) {
     case RPMTAG_REQUIRENAME:
@@ -2142,9 +3587,8 @@ rpmRC tag2index(dbiIndex dbi, rpmTagVal rpmtag,
 	tagdata.count = 1;
     }
 
-    dbc = dbiCursorInit(dbi, DBC_WRITE);
-
-    logAddRemove(dbiName(dbi), 0, &tagdata);
+    if (dbiname)
+	logAddRemove(dbiname, 0, &tagdata);
     while ((i = rpmtdNext(&tagdata)) >= 0) {
 	const void * key = NULL;
 	unsigned int keylen = 0;
@@ -2193,7 +3637,7 @@ rpmRC tag2index(dbiIndex dbi, rpmTagVal rpmtag,
 	if ((key = td2key(&tagdata, &keylen)) == NULL)
 	    continue;
 
-	rc += idxupdate(dbi, dbc, key, keylen, &rec);
+	rc += keyupdate(keydata, key, keylen, &rec);
 
 	if (*(char *)key == '(') {
 	    switch (rpmtag) {
@@ -2204,8 +3648,8 @@ rpmRC tag2index(dbiIndex dbi, rpmTagVal rpmtag,
 	    case RPMTAG_RECOMMENDNAME:
 	    case RPMTAG_ENHANCENAME:
 		if (rpmtdType(&tagdata) == RPM_STRING_ARRAY_TYPE) {
-		    rc += updateRichDep(dbi, dbc, rpmtdGetString(&tagdata),
-			&rec, idxupdate);
+		    rc += updateRichDep(rpmtdGetString(&tagdata),
+			&rec, keyupdate, keydata);
 		}
 	    default:
 		break;
@@ -2213,27 +3657,118 @@ rpmRC tag2index(dbiIndex dbi, rpmTagVal rpmtag,
 	}
     }
 
-    dbiCursorFree(dbi, dbc);
-
 exit:
     rpmtdFreeData(&tagdata);
     return (rc == 0) ? RPMRC_OK : RPMRC_FAIL;
 }
 
+struct idxUpdate_s {
+    dbiIndex dbi;
+    dbiCursor dbc;
+    idxfunc idxupdate;
+};
+
+static rpmRC idxUpdateKey(void *data, const char *keyp, size_t keylen,
+			  dbiIndexItem rec)
+{
+    struct idxUpdate_s *u = data;
+    if (u->dbc == NULL)
+	u->dbc = dbiCursorInit(u->dbi, DBC_WRITE);
+    return u->idxupdate(u->dbi, u->dbc, keyp, keylen, rec);
+}
+
+struct journalUpdate_s {
+    struct idxJournal_s *j;
+    int del;
+};
+
+static rpmRC journalUpdateKey(void *data, const char *keyp, size_t keylen,
+			      dbiIndexItem rec)
+{
+    struct journalUpdate_s *u = data;
+    return idxJournalAdd(u->j, keyp, keylen, rec, u->del);
+}
+
+static int journalUpdate(dbiIndex dbi, struct idxJournal_s *j,
+			 rpmTagVal rpmtag, unsigned int hdrNum, Header h,
+			 int del)
+{
+    struct journalUpdate_s u = { j, del };
+    return tag2keys(dbiName(dbi), rpmtag, hdrNum, h, journalUpdateKey, &u);
+}
+
+rpmRC tag2index(dbiIndex dbi, rpmTagVal rpmtag,
+		       unsigned int hdrNum, Header h,
+		       idxfunc idxupdate)
+{
+    struct idxUpdate_s u = { dbi, NULL, idxupdate };
+    rpmRC rc = tag2keys(dbiName(dbi), rpmtag, hdrNum, h, idxUpdateKey, &u);
+    if (u.dbc)
+	dbiCursorFree(dbi, u.dbc);
+    return rc;
+}
+
+int rpmdbDeferIndexes(rpmdb db, int defer)
+{
+    int rc = 0;
+
+    if (db == NULL)
+	return defer ? 1 : 0;
+
+    if (defer) {
+	dbiIndex dbi = NULL;
+	if (db->db_journals)
+	    return 0;
+	if ((db->db_mode & O_ACCMODE) == O_RDONLY)
+	    return 1;
+	if (pkgdbOpen(db, 0, &dbi) || !idxdbCanPutOne(dbi) || !idxdbCanDelOne(dbi))
+	    return 1;
+	/* A crash mid-batch would leave headers missing from the indexes */
+	if (!db->db_ops->idxrebuild) {
+	    rpmlog(RPMLOG_WARNING,
+		_("%s backend can't defer index updates safely, ignoring\n"),
+		db->db_descr);
+	    return 1;
+	}
+	db->db_journals = xcalloc(db->db_ndbi, sizeof(*db->db_journals));
+	return 0;
+    }
+
+    if (db->db_journals) {
+	rpmsqBlock(SIG_BLOCK);
+	dbCtrl(db, DB_CTRL_LOCK_RW);
+	for (int dbix = 0; dbix < db->db_ndbi; dbix++) {
+	    struct idxJournal_s *j = db->db_journals[dbix];
+	    if (j) {
+		rc += idxJournalApply(db->db_indexes[dbix], j);
+		idxJournalFree(j);
+	    }
+	}
+	db->db_journals = _free(db->db_journals);
+	dbCtrl(db, DB_CTRL_INDEXSYNC);
+	dbCtrl(db, DB_CTRL_UNLOCK_RW);
+	rpmsqBlock(SIG_UNBLOCK);
+    }
+
+    return rc;
+}
+
 int rpmdbAdd(rpmdb db, Header h)
 {
     dbiIndex dbi = NULL;
     dbiCursor dbc = NULL;
     unsigned int hdrNum = 0;
     unsigned int hdrLen = 0;
-    unsigned char *hdrBlob = NULL;
+    struct iovec *hdrIov = NULL;
+    int niov = 0;
     int ret = 0;
 
     if (db == NULL)
 	return 0;
 
-    hdrBlob = headerExport(h, &hdrLen);
-    if (hdrBlob == NULL || hdrLen == 0) {
+    /* The blob segments reference h, which can't change while we're here */
+    hdrIov = headerExportIov(h, &niov, &hdrLen);
+    if (hdrIov == NULL || hdrLen == 0) {
 	ret = -1;
 	goto exit;
     }
@@ -2242,30 +3777,52 @@ int rpmdbAdd(rpmdb db, Header h)
     if (ret)
 	goto exit;
 	
+    dbPkgListPrepare(db);
     rpmsqBlock(SIG_BLOCK);
     dbCtrl(db, DB_CTRL_LOCK_RW);
 
     /* Add header to primary index */
     dbc = dbiCursorInit(dbi, DBC_WRITE);
-    ret = pkgdbPut(dbi, dbc, &hdrNum, hdrBlob, hdrLen);
+    ret = pkgdbPutIov(dbi, dbc, &hdrNum, hdrIov, niov, hdrLen);
     dbiCursorFree(dbi, dbc);
+    hdrCacheDrop(db->db_hdrcache, hdrNum);
+    dbShmDrop(db);
+    dbFilterDrop(db);
+    if (ret == 0 && db->db_trigidx) {
+	trigIndexAdd(db->db_trigidx, hdrNum, h);
+	db->db_trigchanged = 1;
+    }
+    if (ret == 0 && db->db_usepkglist) {
+	if (db->db_pkglist)
+	    pkgListAdd(db->db_pkglist, hdrNum, h);
+	db->db_pkglistchanged = 1;
+    }
 
     /* Add associated data to secondary indexes */
     if (ret == 0) {	
 	for (int dbix = 0; dbix < db->db_ndbi; dbix++) {
 	    rpmDbiTag rpmtag = db->db_tags[dbix];
 
+	    struct idxJournal_s *j;
+
 	    if (indexOpen(db, rpmtag, 0, &dbi))
 		continue;
 
-	    ret += idxdbPut(dbi, rpmtag, hdrNum, h);
+	    if ((j = dbiJournal(dbi)) != NULL) {
+		ret += journalUpdate(dbi, j, rpmtag, hdrNum, h, 0);
+	    } else {
+		ret += idxdbPut(dbi, rpmtag, hdrNum, h);
+	    }
 	}
     }
 
-    dbCtrl(db, DB_CTRL_INDEXSYNC);
+    if (db->db_journals == NULL)
+	dbCtrl(db, DB_CTRL_INDEXSYNC);
     dbCtrl(db, DB_CTRL_UNLOCK_RW);
     rpmsqBlock(SIG_UNBLOCK);
 
+    RPM_PROBE3(db_add, headerGetString(h, RPMTAG_NAME), hdrNum, ret);
+
     /* If everything ok, mark header as installed now */
     if (ret == 0) {
 	headerSetInstance(h, hdrNum);
@@ -2276,7 +3833,7 @@ int rpmdbAdd(rpmdb db, Header h)
     }
 
 exit:
-    free(hdrBlob);
+    free(hdrIov);
 
     return ret;
 }
@@ -2404,6 +3961,203 @@ static int rpmdbSetPermissions(char * src, char * dest)
     return rc;
 }
 
+struct rebuildKey_s {
+    const char *key;
+    size_t keyoff;
+    unsigned int keylen;
+    unsigned int tagNum;
+    int ix;			/* header index in batch */
+};
+
+struct rebuildHdr_s {
+    Header h;
+    unsigned int offset;	/* record number in the old database */
+    unsigned int hdrNum;	/* record number in the new database */
+    unsigned char *blob;
+    unsigned int bloblen;
+    char *keybuf;
+    size_t keyused;
+    size_t keyalloced;
+    struct rebuildKey_s *keys;
+    int nkeys;
+    int keysalloced;
+    int *keyix;			/* first key of each index, db_ndbi + 1 */
+};
+
+struct rebuildBatch_s {
+    rpmdb db;
+    struct rebuildHdr_s *hdrs;
+    int nhdrs;
+};
+
+static rpmRC rebuildAddKey(void *data, const char *keyp, size_t keylen,
+			   dbiIndexItem rec)
+{
+    struct rebuildHdr_s *rh = data;
+    struct rebuildKey_s *k;
+
+    if (rh->nkeys == rh->keysalloced) {
+	rh->keysalloced = rh->keysalloced ? rh->keysalloced * 2 : 64;
+	rh->keys = xrealloc(rh->keys, rh->keysalloced * sizeof(*rh->keys));
+    }
+    if (rh->keyused + keylen > rh->keyalloced) {
+	while (rh->keyused + keylen > rh->keyalloced)
+	    rh->keyalloced = rh->keyalloced ? rh->keyalloced * 2 : 4096;
+	rh->keybuf = xrealloc(rh->keybuf, rh->keyalloced);
+    }
+    k = &rh->keys[rh->nkeys++];
+    /* keys may be transient (rich deps), copy. Pointers are set once done. */
+    memcpy(rh->keybuf + rh->keyused, keyp, keylen);
+    k->key = NULL;
+    k->keyoff = rh->keyused;
+    k->keylen = keylen;
+    k->tagNum = rec->tagNum;
+    k->ix = -1;
+    rh->keyused += keylen;
+    return RPMRC_OK;
+}
+
+/* Export a header and extract its index keys, runs in parallel */
+static void rebuildHdrPrep(void *data, int ix, int slot)
+{
+    struct rebuildBatch_s *batch = data;
+    struct rebuildHdr_s *rh = &batch->hdrs[ix];
+    rpmdb db = batch->db;
+
+    /* Deleted entries are eliminated in legacy headers by copy. */
+    if (headerIsEntry(rh->h, RPMTAG_HEADERIMAGE)) {
+	Header nh = headerReload(headerCopy(rh->h), RPMTAG_HEADERIMAGE);
+	headerFree(rh->h);
+	rh->h = nh;
+    }
+    if (rh->h == NULL)
+	return;
+
+    rh->blob = headerExport(rh->h, &rh->bloblen);
+    if (rh->blob == NULL || rh->bloblen == 0)
+	return;
+
+    rh->keyix = xmalloc((db->db_ndbi + 1) * sizeof(*rh->keyix));
+    for (int dbix = 0; dbix < db->db_ndbi; dbix++) {
+	rh->keyix[dbix] = rh->nkeys;
+	tag2keys(NULL, db->db_tags[dbix], 0, rh->h, rebuildAddKey, rh);
+    }
+    rh->keyix[db->db_ndbi] = rh->nkeys;
+
+    for (int i = 0; i < rh->nkeys; i++) {
+	rh->keys[i].key = rh->keybuf + rh->keys[i].keyoff;
+	rh->keys[i].ix = ix;
+    }
+}
+
+static int rebuildKeyCmp(const void *one, const void *two)
+{
+    const struct rebuildKey_s *a = *(const struct rebuildKey_s **)one;
+    const struct rebuildKey_s *b = *(const struct rebuildKey_s **)two;
+    unsigned int len = (a->keylen < b->keylen) ? a->keylen : b->keylen;
+    int rc = memcmp(a->key, b->key, len);
+
+    if (rc == 0 && a->keylen != b->keylen)
+	rc = (a->keylen < b->keylen) ? -1 : 1;
+    if (rc == 0 && a->ix != b->ix)
+	rc = (a->ix < b->ix) ? -1 : 1;
+    if (rc == 0 && a->tagNum != b->tagNum)
+	rc = (a->tagNum < b->tagNum) ? -1 : 1;
+    return rc;
+}
+
+/*
+ * Write a batch of prepared headers: package blobs sequentially first,
+ * then the keys of each index in sorted order in one pass.
+ */
+static int rebuildBatchWrite(struct rebuildBatch_s *batch)
+{
+    rpmdb db = batch->db;
+    struct rebuildKey_s **keys = NULL;
+    dbiIndex dbi = NULL;
+    dbiCursor dbc = NULL;
+    int nkeys = 0;
+    int rc = 0;
+
+    if (pkgdbOpen(db, 0, &dbi))
+	return 1;
+
+    dbc = dbiCursorInit(dbi, DBC_WRITE);
+    for (int i = 0; i < batch->nhdrs; i++) {
+	struct rebuildHdr_s *rh = &batch->hdrs[i];
+	if (rh->keyix == NULL ||
+		pkgdbPut(dbi, dbc, &rh->hdrNum, rh->blob, rh->bloblen)) {
+	    rpmlog(RPMLOG_ERR, _("cannot add record originally at %u\n"),
+		   rh->offset);
+	    rc = 1;
+	    break;
+	}
+    }
+    dbiCursorFree(dbi, dbc);
+    if (rc)
+	return rc;
+
+    for (int i = 0; i < batch->nhdrs; i++)
+	nkeys += batch->hdrs[i].nkeys;
+    keys = xmalloc((nkeys ? nkeys : 1) * sizeof(*keys));
+
+    for (int dbix = 0; dbix < db->db_ndbi; dbix++) {
+	int n = 0;
+
+	if (indexOpen(db, db->db_tags[dbix], 0, &dbi))
+	    continue;
+
+	for (int i = 0; i < batch->nhdrs; i++) {
+	    struct rebuildHdr_s *rh = &batch->hdrs[i];
+	    for (int k = rh->keyix[dbix]; k < rh->keyix[dbix + 1]; k++)
+		keys[n++] = &rh->keys[k];
+	}
+	if (n == 0)
+	    continue;
+
+	qsort(keys, n, sizeof(*keys), rebuildKeyCmp);
+	dbc = dbiCursorInit(dbi, DBC_WRITE);
+	for (int k = 0; k < n; k++) {
+	    struct dbiIndexItem_s rec;
+	    rec.hdrNum = batch->hdrs[keys[k]->ix].hdrNum;
+	    rec.tagNum = keys[k]->tagNum;
+	    rc += idxdbPutOne(dbi, dbc, keys[k]->key, keys[k]->keylen, &rec);
+	}
+	dbiCursorFree(dbi, dbc);
+    }
+
+    free(keys);
+    return rc;
+}
+
+static void rebuildBatchClear(struct rebuildBatch_s *batch)
+{
+    for (int i = 0; i < batch->nhdrs; i++) {
+	struct rebuildHdr_s *rh = &batch->hdrs[i];
+	headerFree(rh->h);
+	free(rh->blob);
+	free(rh->keybuf);
+	free(rh->keys);
+	free(rh->keyix);
+	memset(rh, 0, sizeof(*rh));
+    }
+    batch->nhdrs = 0;
+}
+
+static int rebuildBatchFlush(struct rebuildBatch_s *batch, int nthreads)
+{
+    int rc;
+
+    rpmworkersRun(nthreads, batch->nhdrs, rebuildHdrPrep, batch);
+
+    rpmsqBlock(SIG_BLOCK);
+    rc = rebuildBatchWrite(batch);
+    rpmsqBlock(SIG_UNBLOCK);
+
+    rebuildBatchClear(batch);
+    return rc;
+}
+
 int rpmdbRebuild(const char * prefix, rpmts ts,
 		rpmRC (*hdrchk) (rpmts ts, const void *uh, size_t uc, char ** msg),
 		int rebuildflags)
@@ -2460,6 +4214,20 @@ int rpmdbRebuild(const char * prefix, rpmts ts,
 
     {	Header h = NULL;
 	rpmdbMatchIterator mi;
+	struct rebuildBatch_s batch = { newdb, NULL, 0 };
+	int nthreads = rpmworkersCount("_rebuilddb_threads");
+	int batchsize = nthreads * 64;
+	dbiIndex dbi = NULL;
+	int bulk = 0;
+
+	/* Bulk load if the backend can take precomputed index keys */
+	if (pkgdbOpen(newdb, 0, &dbi) == 0 && idxdbCanPutOne(dbi)) {
+	    batch.hdrs = xcalloc(batchsize, sizeof(*batch.hdrs));
+	    bulk = 1;
+	}
+
+	/* Load everything within a single transaction */
+	dbCtrl(newdb, DB_CTRL_LOCK_RW);
 
 	mi = rpmdbInitIterator(olddb, RPMDBI_PACKAGES, NULL, 0);
 	if (ts && hdrchk)
@@ -2479,6 +4247,18 @@ int rpmdbRebuild(const char * prefix, rpmts ts,
 		continue;
 	    }
 
+	    if (bulk) {
+		struct rebuildHdr_s *rh = &batch.hdrs[batch.nhdrs++];
+		rh->h = headerLink(h);
+		rh->offset = rpmdbGetIteratorOffset(mi);
+		if (batch.nhdrs == batchsize &&
+			rebuildBatchFlush(&batch, nthreads)) {
+		    failed = 1;
+		    break;
+		}
+		continue;
+	    }
+
 	    /* Deleted entries are eliminated in legacy headers by copy. */
 	    if (headerIsEntry(h, RPMTAG_HEADERIMAGE)) {
 		Header nh = headerReload(headerCopy(h), RPMTAG_HEADERIMAGE);
@@ -2496,8 +4276,14 @@ int rpmdbRebuild(const char * prefix, rpmts ts,
 	    }
 	}
 
-	rpmdbFreeIterator(mi);
+	if (bulk && !failed && batch.nhdrs &&
+		rebuildBatchFlush(&batch, nthreads)) {
+	    failed = 1;
+	}
+	free(batch.hdrs);
 
+	rpmdbFreeIterator(mi);
+	dbCtrl(newdb, DB_CTRL_UNLOCK_RW);
     }
 
     rpmdbClose(olddb);
@@ -2558,6 +4344,9 @@ int rpmdbCtrl(rpmdb db, rpmdbCtrlOp ctrl)
     case RPMDB_CTRL_INDEXSYNC:
 	dbctrl = DB_CTRL_INDEXSYNC;
 	break;
+    case RPMDB_CTRL_COMPACT:
+	dbctrl = DB_CTRL_COMPACT;
+	break;
     }
     return dbctrl ? dbCtrl(db, dbctrl) : 1;
 }
@@ -96,10 +96,35 @@ int rpmdbAdd(rpmdb db, Header h);
  * Remove package header from rpm database and indices.
  * @param db		rpm database
  * @param hdrNum	package instance number in database
+ * @param h		header of the instance if the caller has it (or NULL)
  * @return		0 on success
  */
 RPM_GNUC_INTERNAL
-int rpmdbRemove(rpmdb db, unsigned int hdrNum);
+int rpmdbRemove(rpmdb db, unsigned int hdrNum, Header h);
+
+/** \ingroup rpmdb
+ * Defer secondary index updates of rpmdbAdd() and rpmdbRemove() to
+ * memory, lookups see the indexes overlaid with the pending updates.
+ * Disabling writes out all pending updates, sorted by key.
+ * @param db		rpm database
+ * @param defer		1 to start deferring, 0 to flush and stop
+ * @return		0 on success
+ */
+RPM_GNUC_INTERNAL
+int rpmdbDeferIndexes(rpmdb db, int defer);
+
+/** \ingroup rpmdb
+ * Count the items of an index key, without retrieving them or the
+ * package headers.
+ * @param db		rpm database
+ * @param rpmtag	database index tag
+ * @param keyp		key data
+ * @param keylen	key data length (0 will use strlen(keyp))
+ * @return		number of items, -1 on error
+ */
+RPM_GNUC_INTERNAL
+int rpmdbCountIndex(rpmdb db, rpmDbiTagVal rpmtag,
+		    const void * keyp, size_t keylen);
 
 /** \ingroup rpmdb
  * Return rpmdb home directory (depending on chroot state)
@@ -119,6 +144,32 @@ const char *rpmdbHome(rpmdb db);
 int rpmdbExtendIterator(rpmdbMatchIterator mi,
 			const void * keyp, size_t keylen);
 
+/** \ingroup rpmdb
+ * Extend iterator with the matches of several keys, looked up at once.
+ * @param mi		rpm database iterator
+ * @param keys		array of key data
+ * @param keylens	array of key data lengths
+ * @param nkeys		number of keys
+ * @return		0 if any key matched
+ */
+RPM_GNUC_INTERNAL
+int rpmdbExtendIteratorBatch(rpmdbMatchIterator mi, const char **keys,
+			     const size_t *keylens, int nkeys);
+
+/** \ingroup rpmdb
+ * Extend iterator with the matches of many unique keys in index order
+ * (byte-wise, a prefix before the longer keys), letting the backend
+ * find them all in one sequential pass over the index.
+ * @param mi		rpm database iterator
+ * @param keys		array of sorted key data
+ * @param keylens	array of key data lengths
+ * @param nkeys		number of keys
+ * @return		0 if any key matched
+ */
+RPM_GNUC_INTERNAL
+int rpmdbExtendIteratorSorted(rpmdbMatchIterator mi, const char **keys,
+			      const size_t *keylens, int nkeys);
+
 /** \ingroup rpmdb
  * sort the iterator by (recnum, filenum)
  * Return database iterator.
@@ -217,6 +268,36 @@ unsigned int rpmdbGetIteratorOffsetFor(rpmdbMatchIterator mi, unsigned int ix);
 RPM_GNUC_INTERNAL
 Header rpmdbGetHeaderAt(rpmdb db, unsigned int offset);
 
+/** \ingroup rpmdb
+ * Return the trigger index of the database, if enabled.
+ * The index is kept up to date with the changes made through db, it's
+ * owned by db.
+ * @param db		rpm database
+ * @return		trigger index, NULL if not in use
+ */
+RPM_GNUC_INTERNAL
+struct trigIndex_s *rpmdbTriggerIndex(rpmdb db);
+
+/** \ingroup rpmdb
+ * Return the string pool shared by the file and dependency sets made
+ * from database headers, if enabled (%_db_string_pool). The pool lives
+ * as long as the database, it's owned by db.
+ * @param db		rpm database
+ * @return		string pool, NULL if not in use
+ */
+RPM_GNUC_INTERNAL
+rpmstrPool rpmdbPool(rpmdb db);
+
+/** \ingroup rpmdb
+ * Return the string pool for the file and dependency sets of a header:
+ * the database pool for headers from db, NULL (private pool) otherwise.
+ * @param db		rpm database (or NULL)
+ * @param h		header
+ * @return		string pool, NULL for a private one
+ */
+RPM_GNUC_INTERNAL
+rpmstrPool rpmdbHeaderPool(rpmdb db, Header h);
+
 #ifdef __cplusplus
 }
 #endif
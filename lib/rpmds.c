@@ -3,6 +3,8 @@
  */
 #include "system.h"
 
+#include <pthread.h>
+
 #include <rpm/rpmtypes.h>
 #include <rpm/rpmlib.h>		/* rpmvercmp */
 #include <rpm/rpmstring.h>
@@ -30,6 +32,7 @@ struct rpmds_s {
     rpm_color_t * Color;	/*!< Bit(s) calculated from file color(s). */
     rpmTagVal tagN;		/*!< Header tag. */
     int32_t Count;		/*!< No. of elements */
+    int32_t Alloced;		/*!< Merge capacity of N, EVR, Flags, ti */
     unsigned int instance;	/*!< From rpmdb instance? */
     int i;			/*!< Element index. */
     int nrefs;			/*!< Reference count. */
@@ -823,14 +826,17 @@ int rpmdsMerge(rpmds * dsp, rpmds ods)
     if (ds == NULL)
 	return -1;
 
+    if (ds->Alloced < ds->Count)
+	ds->Alloced = ds->Count;
+
     /* Ensure EVR and Flags exist */
     if (ds->EVR == NULL)
-	ds->EVR = xcalloc(ds->Count, sizeof(*ds->EVR));
+	ds->EVR = xcalloc(ds->Alloced, sizeof(*ds->EVR));
     if (ds->Flags == NULL)
-	ds->Flags = xcalloc(ds->Count, sizeof(*ds->Flags));
+	ds->Flags = xcalloc(ds->Alloced, sizeof(*ds->Flags));
     if (ds->ti == NULL && ods->ti) {
 	int i;
-	ds->ti = xcalloc(ds->Count, sizeof(*ds->ti));
+	ds->ti = xcalloc(ds->Alloced, sizeof(*ds->ti));
 	for (i = 0; i < ds->Count; i++)
 	    ds->ti[i] = -1;
     }
@@ -853,14 +859,23 @@ int rpmdsMerge(rpmds * dsp, rpmds ods)
 	 * Insert new entry. Ensure pool is unfrozen to allow additions.
 	 */
 	rpmstrPoolUnfreeze(ds->pool);
-	ds->N = xrealloc(ds->N, (ds->Count+1) * sizeof(*ds->N));
+
+	/* Grow geometrically, packages can have thousands of provides */
+	if (ds->Count == ds->Alloced) {
+	    ds->Alloced = ds->Alloced ? 2 * ds->Alloced : 8;
+	    ds->N = xrealloc(ds->N, ds->Alloced * sizeof(*ds->N));
+	    ds->EVR = xrealloc(ds->EVR, ds->Alloced * sizeof(*ds->EVR));
+	    ds->Flags = xrealloc(ds->Flags, ds->Alloced * sizeof(*ds->Flags));
+	    if (ds->ti || ods->ti)
+		ds->ti = xrealloc(ds->ti, ds->Alloced * sizeof(*ds->ti));
+	}
+
 	if (u < ds->Count) {
 	    memmove(ds->N + u + 1, ds->N + u,
 		    (ds->Count - u) * sizeof(*ds->N));
 	}
 	ds->N[u] = rpmstrPoolId(ds->pool, rpmdsN(ods), 1);
 
-	ds->EVR = xrealloc(ds->EVR, (ds->Count+1) * sizeof(*ds->EVR));
 	if (u < ds->Count) {
 	    memmove(ds->EVR + u + 1, ds->EVR + u,
 		    (ds->Count - u) * sizeof(*ds->EVR));
@@ -868,7 +883,6 @@ int rpmdsMerge(rpmds * dsp, rpmds ods)
 	OEVR = rpmdsEVR(ods);
 	ds->EVR[u] = rpmstrPoolId(ds->pool, OEVR ? OEVR : "", 1);
 
-	ds->Flags = xrealloc(ds->Flags, (ds->Count+1) * sizeof(*ds->Flags));
 	if (u < ds->Count) {
 	    memmove(ds->Flags + u + 1, ds->Flags + u,
 		    (ds->Count - u) * sizeof(*ds->Flags));
@@ -876,7 +890,6 @@ int rpmdsMerge(rpmds * dsp, rpmds ods)
 	ds->Flags[u] = rpmdsFlags(ods);
 
 	if (ds->ti || ods->ti) {
-	    ds->ti = xrealloc(ds->ti, (ds->Count+1) * sizeof(*ds->ti));
 	    if (u < ds->Count) {
 		memmove(ds->ti + u + 1, ds->ti + u,
 			(ds->Count - u) * sizeof(*ds->ti));
@@ -1559,15 +1572,126 @@ static rpmRC rpmdsParseRichDepCB(void *cbdata, rpmrichParseType type,
 }
 
 
+/* Top-level split of a rich dependency, independent of pool and tag */
+struct richSplitPart_s {
+    char *N;
+    char *EVR;
+    rpmsenseFlags sense;
+};
+
+struct richSplit_s {
+    rpmrichOp op;
+    struct richSplitPart_s part[2];	/* left and right (if any) side */
+};
+
+#undef HASHTYPE
+#undef HTKEYTYPE
+#undef HTDATATYPE
+#define HASHTYPE richCache
+#define HTKEYTYPE const char *
+#define HTDATATYPE struct richSplit_s *
+#include "lib/rpmhash.H"
+#include "lib/rpmhashoa.C"
+#undef HASHTYPE
+#undef HTKEYTYPE
+#undef HTDATATYPE
+
+/* Dropped wholesale when full, rich deps repeat within a transaction */
+#define RICH_CACHE_MAX	16384
+
+static richCache richcache = NULL;
+static pthread_mutex_t richlock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct richSplit_s *richSplitFree(struct richSplit_s *split)
+{
+    if (split) {
+	for (int i = 0; i < 2; i++) {
+	    free(split->part[i].N);
+	    free(split->part[i].EVR);
+	}
+	free(split);
+    }
+    return NULL;
+}
+
+static void richSplitSet(struct richSplitPart_s *part, rpmds ds)
+{
+    if (ds) {
+	part->N = xstrdup(rpmdsN(ds));
+	part->EVR = xstrdup(rpmdsEVR(ds));
+	part->sense = rpmdsFlags(ds) & RPMSENSE_SENSEMASK;
+    }
+}
+
+static rpmds richSplitDS(const struct richSplitPart_s *part, rpmds dep,
+			 rpmsenseFlags depflags)
+{
+    rpmsenseFlags flags = part->sense | depflags;
+
+    if (part->N == NULL)
+	return NULL;
+    if (dep->tagN == RPMTAG_REQUIRENAME && strlen(part->N) > 7 &&
+		rstreqn(part->N, "rpmlib(", sizeof("rpmlib(")-1))
+	flags |= RPMSENSE_RPMLIB;
+    return singleDS(dep->pool, dep->tagN, part->N, part->EVR, flags, 0, 0, 0);
+}
+
+/* Look up a previous split of depstr, creating the sub-deps from it */
+static int richCacheGet(const char *depstr, rpmds dep, rpmsenseFlags depflags,
+			rpmds *leftds, rpmds *rightds, rpmrichOp *op)
+{
+    struct richSplit_s **splits = NULL;
+    int found = 0;
+
+    pthread_mutex_lock(&richlock);
+    if (richcache && richCacheGetEntry(richcache, depstr, &splits, NULL, NULL)) {
+	*leftds = richSplitDS(&splits[0]->part[0], dep, depflags);
+	*rightds = richSplitDS(&splits[0]->part[1], dep, depflags);
+	*op = splits[0]->op;
+	found = 1;
+    }
+    pthread_mutex_unlock(&richlock);
+    return found;
+}
+
+static void richCachePut(const char *depstr, rpmds leftds, rpmds rightds,
+			 rpmrichOp op)
+{
+    struct richSplit_s *split = xcalloc(1, sizeof(*split));
+
+    split->op = op;
+    richSplitSet(&split->part[0], leftds);
+    richSplitSet(&split->part[1], rightds);
+
+    pthread_mutex_lock(&richlock);
+    if (richcache && richCacheNumKeys(richcache) >= RICH_CACHE_MAX)
+	richcache = richCacheFree(richcache);
+    if (richcache == NULL)
+	richcache = richCacheCreate(1024, rstrhash, strcmp,
+				    (richCacheFreeKey)rfree, richSplitFree);
+    if (!richCacheHasEntry(richcache, depstr))
+	richCacheAddEntry(richcache, xstrdup(depstr), split);
+    else
+	split = richSplitFree(split);
+    pthread_mutex_unlock(&richlock);
+}
+
 rpmRC rpmdsParseRichDep(rpmds dep, rpmds *leftds, rpmds *rightds, rpmrichOp *op, char **emsg)
 {
     rpmRC rc;
     struct rpmdsParseRichDepData data;
     const char *depstr = rpmdsN(dep);
+    const char *richstr = depstr;
+    rpmsenseFlags depflags = rpmdsFlags(dep) & ~(RPMSENSE_SENSEMASK | RPMSENSE_MISSINGOK);
+
+    /* Rich deps get evaluated over and over, reuse the earlier parse */
+    if (richCacheGet(richstr, dep, depflags, leftds, rightds, op))
+	return RPMRC_OK;
+
     memset(&data, 0, sizeof(data));
     data.dep = dep;
     data.op = RPMRICHOP_SINGLE;
-    data.depflags = rpmdsFlags(dep) & ~(RPMSENSE_SENSEMASK | RPMSENSE_MISSINGOK);
+    data.depflags = depflags;
     rc = rpmrichParse(&depstr, emsg, rpmdsParseRichDepCB, &data);
     if (rc == RPMRC_OK && *depstr) {
 	if (emsg)
@@ -1578,6 +1702,7 @@ rpmRC rpmdsParseRichDep(rpmds dep, rpmds *leftds, rpmds *rightds, rpmrichOp *op,
 	rpmdsFree(data.leftds);
 	rpmdsFree(data.rightds);
     } else {
+	richCachePut(richstr, data.leftds, data.rightds, data.op);
 	*leftds = data.leftds;
 	*rightds = data.rightds;
 	*op = data.op;
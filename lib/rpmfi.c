@@ -14,6 +14,8 @@
 #include <rpm/rpmbase64.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
 
 #include "lib/rpmfi_internal.h"
 #include "lib/rpmte_internal.h"	/* relocations */
@@ -45,12 +47,21 @@ typedef struct hardlinks_s * hardlinks_t;
 
 typedef int (*iterfunc)(rpmfi fi);
 
+/* Reusable path buffer, the directory part is kept while it doesn't change */
+struct fnbuf_s {
+    char * buf;			/*!< File name buffer. */
+    size_t alloced;		/*!< Allocated size of buf */
+    size_t dlen;		/*!< Length of the directory part in buf */
+    int dx;			/*!< Directory index in buf (if buf set) */
+    int ix;			/*!< File index in buf (if buf set) */
+};
+
 struct rpmfi_s {
     int i;			/*!< Current file index. */
     int j;			/*!< Current directory index. */
     iterfunc next;		/*!< Iterator function. */
-    char * fn;			/*!< File name buffer. */
-    char * ofn;			/*!< Original file name buffer. */
+    struct fnbuf_s fn;		/*!< File name buffer. */
+    struct fnbuf_s ofn;		/*!< Original file name buffer. */
 
     int intervalStart;		/*!< Start of iterating interval. */
     int intervalEnd;		/*!< End of iterating interval. */
@@ -102,6 +113,7 @@ struct rpmfiles_s {
     char * fstates;		/*!< File state(s) (from header) */
 
     rpm_color_t * fcolors;	/*!< File color bits (header) */
+    rpm_color_t colors;		/*!< Union of the file colors */
     char ** fcaps;		/*!< File capability strings (header) */
 
     char ** cdict;		/*!< File class dictionary (header) */
@@ -127,26 +139,37 @@ struct rpmfiles_s {
     unsigned char * veritysigs; /*!< Verity signatures in binary. */
 
     struct nlinkHash_s * nlinks;/*!< Files connected by hardlinks */
+    int lazy;			/*!< Arrays not yet loaded from header */
     rpm_off_t * replacedSizes;	/*!< (TR_ADDED) */
     rpm_loff_t * replacedLSizes;/*!< (TR_ADDED) */
     int magic;
     int nrefs;		/*!< Reference count. */
 };
 
+/*
+ * Arrays that can be materialized from the header on first use when
+ * the header is kept around anyway (RPMFI_KEEPHEADER).
+ */
+enum rpmfiLazy_e {
+    LAZY_FILEMTIMES	= (1 << 0),
+    LAZY_FILERDEVS	= (1 << 1),
+    LAZY_FILECAPS	= (1 << 2),
+    LAZY_FILECLASS	= (1 << 3),
+    LAZY_FILEDEPS	= (1 << 4),
+    LAZY_FILEDIGESTS	= (1 << 5),
+    LAZY_FILESIGNATURES	= (1 << 6),
+    LAZY_VERITYSIGS	= (1 << 7),
+};
+
 static int indexSane(rpmtd xd, rpmtd yd, rpmtd zd);
 static int cmpPoolFn(rpmstrPool pool, rpmfn files, int ix, const char * fn);
+static void rpmfilesLoad(rpmfiles fi, int what);
 
-static rpmfiles rpmfilesUnlink(rpmfiles fi)
-{
-    if (fi)
-	fi->nrefs--;
-    return NULL;
-}
-
+/* File sets are shared with worker threads, keep the refcount atomic */
 rpmfiles rpmfilesLink(rpmfiles fi)
 {
     if (fi)
-	fi->nrefs++;
+	__atomic_add_fetch(&fi->nrefs, 1, __ATOMIC_RELAXED);
     return fi;
 }
 
@@ -557,6 +580,7 @@ const unsigned char * rpmfilesFDigest(rpmfiles fi, int ix, int *algo, size_t *le
 
     if (fi != NULL && ix >= 0 && ix < rpmfilesFC(fi)) {
     	size_t diglen = rpmDigestLength(fi->digestalgo);
+	rpmfilesLoad(fi, LAZY_FILEDIGESTS);
 	if (fi->digests != NULL)
 	    digest = fi->digests + (diglen * ix);
 	if (len) 
@@ -584,6 +608,7 @@ const unsigned char * rpmfilesFSignature(rpmfiles fi, int ix, size_t *len)
 
     if (fi != NULL && ix >= 0 && ix < rpmfilesFC(fi)) {
 	size_t slen = 0;
+	rpmfilesLoad(fi, LAZY_FILESIGNATURES);
 	if (fi->signatures != NULL && fi->signatureoffs != NULL) {
 	    uint32_t off = fi->signatureoffs[ix];
 	    slen = fi->signatureoffs[ix+1] - off;
@@ -602,6 +627,7 @@ const unsigned char * rpmfilesVSignature(rpmfiles fi, int ix, size_t *len,
     const unsigned char *vsignature = NULL;
 
     if (fi != NULL && ix >= 0 && ix < rpmfilesFC(fi)) {
+	rpmfilesLoad(fi, LAZY_VERITYSIGS);
 	if (fi->veritysigs != NULL)
 	    vsignature = fi->veritysigs + (fi->veritysiglength * ix);
 	if (len)
@@ -641,6 +667,7 @@ rpm_rdev_t rpmfilesFRdev(rpmfiles fi, int ix)
     rpm_rdev_t frdev = 0;
 
     if (fi != NULL && ix >= 0 && ix < rpmfilesFC(fi)) {
+	rpmfilesLoad(fi, LAZY_FILERDEVS);
 	if (fi->frdevs != NULL)
 	    frdev = fi->frdevs[ix];
     }
@@ -660,16 +687,7 @@ rpm_ino_t rpmfilesFInode(rpmfiles fi, int ix)
 
 rpm_color_t rpmfilesColor(rpmfiles files)
 {
-    rpm_color_t color = 0;
-
-    if (files != NULL && files->fcolors != NULL) {
-	int fc = rpmfilesFC(files);
-	for (int i = 0; i < fc; i++)
-	    color |= files->fcolors[i];
-	/* XXX ignore all but lsnibble for now. */
-	color &= 0xf;
-    }
-    return color;
+    return (files != NULL) ? files->colors : 0;
 }
 
 rpm_color_t rpmfiColor(rpmfi fi)
@@ -694,6 +712,8 @@ const char * rpmfilesFClass(rpmfiles fi, int ix)
     const char * fclass = NULL;
     int cdictx;
 
+    if (fi != NULL)
+	rpmfilesLoad(fi, LAZY_FILECLASS);
     if (fi != NULL && fi->fcdictx != NULL && ix >= 0 && ix < rpmfilesFC(fi)) {
 	cdictx = fi->fcdictx[ix];
 	if (fi->cdict != NULL && cdictx >= 0 && cdictx < fi->ncdict)
@@ -709,6 +729,7 @@ uint32_t rpmfilesFDepends(rpmfiles fi, int ix, const uint32_t ** fddictp)
     const uint32_t * fddict = NULL;
 
     if (fi != NULL && ix >= 0 && ix < rpmfilesFC(fi)) {
+	rpmfilesLoad(fi, LAZY_FILEDEPS);
 	if (fi->fddictn != NULL)
 	    fddictn = fi->fddictn[ix];
 	if (fddictn > 0 && fi->fddictx != NULL)
@@ -758,6 +779,7 @@ rpm_time_t rpmfilesFMtime(rpmfiles fi, int ix)
     rpm_time_t fmtime = 0;
 
     if (fi != NULL && ix >= 0 && ix < rpmfilesFC(fi)) {
+	rpmfilesLoad(fi, LAZY_FILEMTIMES);
 	if (fi->fmtimes != NULL)
 	    fmtime = fi->fmtimes[ix];
     }
@@ -790,6 +812,7 @@ const char * rpmfilesFCaps(rpmfiles fi, int ix)
 {
     const char *fcaps = NULL;
     if (fi != NULL && ix >= 0 && ix < rpmfilesFC(fi)) {
+	rpmfilesLoad(fi, LAZY_FILECAPS);
 	fcaps = fi->fcaps ? fi->fcaps[ix] : "";
     }
     return fcaps;
@@ -955,13 +978,41 @@ int rpmfilesCompare(rpmfiles afi, int aix, rpmfiles bfi, int bix)
     return 0;
 }
 
+int rpmfilesHeaderEqual(rpmfiles ofi, int oix, rpmfiles nfi, int nix)
+{
+    rpmFileTypes newWhat = rpmfiWhatis(rpmfilesFMode(nfi, nix));
+
+    if (rpmfiWhatis(rpmfilesFMode(ofi, oix)) != newWhat)
+	return 0;
+
+    if (newWhat == REG) {
+	int oalgo, nalgo;
+	size_t odiglen, ndiglen;
+	const unsigned char * odigest, * ndigest;
+
+	if (rpmfilesFSize(ofi, oix) != rpmfilesFSize(nfi, nix))
+	    return 0;
+	odigest = rpmfilesFDigest(ofi, oix, &oalgo, &odiglen);
+	ndigest = rpmfilesFDigest(nfi, nix, &nalgo, &ndiglen);
+	return (oalgo == nalgo && odiglen == ndiglen && odigest && ndigest &&
+		memcmp(odigest, ndigest, ndiglen) == 0);
+    }
+    /* Only the link on disk matters, whatever the old package had */
+    return (newWhat == LINK);
+}
+
 int rpmfileContentsEqual(rpmfiles ofi, int oix, rpmfiles nfi, int nix)
 {
-    char * fn = rpmfilesFN(nfi, nix);
-    rpmFileTypes diskWhat, newWhat, oldWhat;
+    char * fn = NULL;
+    rpmFileTypes diskWhat, newWhat;
     struct stat sb;
     int equal = 0;
 
+    /* The packages must agree before the disk is worth looking at */
+    if (!rpmfilesHeaderEqual(ofi, oix, nfi, nix))
+	goto exit;
+
+    fn = rpmfilesFN(nfi, nix);
     if (fn == NULL || (lstat(fn, &sb))) {
 	goto exit; /* The file doesn't exist on the disk */
     }
@@ -972,25 +1023,17 @@ int rpmfileContentsEqual(rpmfiles ofi, int oix, rpmfiles nfi, int nix)
 
     diskWhat = rpmfiWhatis((rpm_mode_t)sb.st_mode);
     newWhat = rpmfiWhatis(rpmfilesFMode(nfi, nix));
-    oldWhat = rpmfiWhatis(rpmfilesFMode(ofi, oix));
-    if ((diskWhat != newWhat) || (diskWhat != oldWhat)) {
+    if (diskWhat != newWhat) {
 	goto exit;
     }
 
     if (diskWhat == REG) {
-	int oalgo, nalgo;
-	size_t odiglen, ndiglen;
-	const unsigned char * odigest, * ndigest;
+	int nalgo;
+	size_t ndiglen;
+	const unsigned char * ndigest;
 	char buffer[1024];
 
-	odigest = rpmfilesFDigest(ofi, oix, &oalgo, &odiglen);
 	ndigest = rpmfilesFDigest(nfi, nix, &nalgo, &ndiglen);
-	/* See if the file in old pkg is identical to the one in new pkg */
-	if ((oalgo != nalgo) || (odiglen != ndiglen) || (!ndigest) ||
-	    (memcmp(odigest, ndigest, ndiglen) != 0)) {
-	    goto exit;
-	}
-
 	if (rpmDoDigest(nalgo, fn, 0, (unsigned char *)buffer) != 0) {
 	     goto exit;		/* assume file has been removed */
 	}
@@ -1240,8 +1283,8 @@ rpmfiles rpmfilesFree(rpmfiles fi)
 {
     if (fi == NULL) return NULL;
 
-    if (fi->nrefs > 1)
-	return rpmfilesUnlink(fi);
+    if (__atomic_sub_fetch(&fi->nrefs, 1, __ATOMIC_ACQ_REL) > 0)
+	return NULL;
 
     if (rpmfilesFC(fi) > 0) {
 	if (fi->ofndata != &fi->fndata) {
@@ -1258,7 +1301,9 @@ rpmfiles rpmfilesFree(rpmfiles fi)
 	fi->veritysigs = _free(fi->veritysigs);
 	fi->fcaps = _free(fi->fcaps);
 
-	fi->cdict = _free(fi->cdict);
+	/* borrowed from the header with KEEPHEADER, dont free */
+	if (!(fi->fiflags & RPMFI_KEEPHEADER))
+	    fi->cdict = _free(fi->cdict);
 
 	fi->fuser = _free(fi->fuser);
 	fi->fgroup = _free(fi->fgroup);
@@ -1294,7 +1339,6 @@ rpmfiles rpmfilesFree(rpmfiles fi)
 
     fi->nlinks = nlinkHashFree(fi->nlinks);
 
-    (void) rpmfilesUnlink(fi);
     memset(fi, 0, sizeof(*fi));		/* XXX trash and burn */
     fi = _free(fi);
 
@@ -1309,8 +1353,8 @@ rpmfi rpmfiFree(rpmfi fi)
 	return rpmfiUnlink(fi);
 
     fi->files = rpmfilesFree(fi->files);
-    fi->fn = _free(fi->fn);
-    fi->ofn = _free(fi->ofn);
+    free(fi->fn.buf);
+    free(fi->ofn.buf);
     fi->found = _free(fi->found);
     fi->archive = rpmcpioFree(fi->archive);
 
@@ -1484,6 +1528,26 @@ err:
     return;
 }
 
+/* Nibble values of hex digits, anything else decodes as zero like rnibble() */
+static const uint8_t hexval[256] = {
+    ['0'] = 0, ['1'] = 1, ['2'] = 2, ['3'] = 3, ['4'] = 4,
+    ['5'] = 5, ['6'] = 6, ['7'] = 7, ['8'] = 8, ['9'] = 9,
+    ['a'] = 10, ['b'] = 11, ['c'] = 12, ['d'] = 13, ['e'] = 14, ['f'] = 15,
+    ['A'] = 10, ['B'] = 11, ['C'] = 12, ['D'] = 13, ['E'] = 14, ['F'] = 15,
+};
+
+/*
+ * Decode len bytes worth of hex digits. Branch free table lookups let
+ * the compiler unroll and vectorize this, unlike a rnibble() loop.
+ */
+static inline uint8_t *hexdecode(uint8_t *t, const char *s, size_t len)
+{
+    const unsigned char *u = (const unsigned char *) s;
+    for (size_t j = 0; j < len; j++, u += 2)
+	t[j] = (hexval[u[0]] << 4) | hexval[u[1]];
+    return t + len;
+}
+
 /*
  * Convert a tag of variable len hex strings to binary presentation,
  * accessed via offsets to a contiguous binary blob. Empty values
@@ -1513,8 +1577,7 @@ static uint8_t *hex2binv(Header h, rpmTagVal tag, rpm_count_t num,
 		goto exit;
 	    }
 	    offs[i] = t - bin;
-	    for (int j = 0; j < len; j++, t++, s += 2)
-		*t = (rnibble(s[0]) << 4) | rnibble(s[1]);
+	    t = hexdecode(t, s, len);
 	    i++;
 	}
 	offs[i] = t - bin;
@@ -1546,8 +1609,7 @@ static uint8_t *hex2bin(Header h, rpmTagVal tag, rpm_count_t num, size_t len)
 		bin = rfree(bin);
 		break;
 	    }
-	    for (int j = 0; j < len; j++, t++, s += 2)
-		*t = (rnibble(s[0]) << 4) | rnibble(s[1]);
+	    t = hexdecode(t, s, len);
 	}
     }
     rpmtdFreeData(&td);
@@ -1614,6 +1676,75 @@ static uint8_t *base2bin(Header h, rpmTagVal tag, rpm_count_t num, int *len)
     return bin;
 }
 
+/* Load the arrays in "what" from the header, shared by eager and lazy paths */
+static int rpmfilesPopulateLazy(rpmfiles fi, Header h, int what)
+{
+    headerGetFlags scareFlags = (fi->fiflags & RPMFI_KEEPHEADER) ? 
+				HEADERGET_MINMEM : HEADERGET_ALLOC;
+    headerGetFlags defFlags = HEADERGET_ALLOC;
+    struct rpmtd_s td;
+    rpm_count_t totalfc = rpmfilesFC(fi);
+
+    if (what & LAZY_FILECLASS) {
+	_hgfinc(h, RPMTAG_CLASSDICT, &td, scareFlags, fi->cdict);
+	fi->ncdict = rpmtdCount(&td);
+	_hgfi(h, RPMTAG_FILECLASS, &td, scareFlags, fi->fcdictx);
+    }
+    if (what & LAZY_FILEDEPS) {
+	_hgfinc(h, RPMTAG_DEPENDSDICT, &td, scareFlags, fi->ddict);
+	fi->nddict = rpmtdCount(&td);
+	_hgfinc(h, RPMTAG_FILEDEPENDSX, &td, scareFlags, fi->fddictx);
+	_hgfinc(h, RPMTAG_FILEDEPENDSN, &td, scareFlags, fi->fddictn);
+    }
+
+    if (what & LAZY_FILECAPS)
+	_hgfi(h, RPMTAG_FILECAPS, &td, defFlags, fi->fcaps);
+
+    /* grab hex digests from header and store in binary format */
+    if (what & LAZY_FILEDIGESTS) {
+	size_t diglen = rpmDigestLength(fi->digestalgo);
+	fi->digests = hex2bin(h, RPMTAG_FILEDIGESTS, totalfc, diglen);
+    }
+
+    /* grab hex signatures from header and store in binary format */
+    if (what & LAZY_FILESIGNATURES) {
+	fi->signatures = hex2binv(h, RPMTAG_FILESIGNATURES,
+				 totalfc, &fi->signatureoffs);
+    }
+
+    if (what & LAZY_VERITYSIGS) {
+	fi->verityalgo = headerGetNumber(h, RPMTAG_VERITYSIGNATUREALGO);
+	fi->veritysigs = base2bin(h, RPMTAG_VERITYSIGNATURES,
+				  totalfc, &fi->veritysiglength);
+    }
+
+    /* XXX TR_REMOVED doesn;t need fmtimes, frdevs, finodes */
+    if (what & LAZY_FILEMTIMES)
+	_hgfi(h, RPMTAG_FILEMTIMES, &td, scareFlags, fi->fmtimes);
+    if (what & LAZY_FILERDEVS)
+	_hgfi(h, RPMTAG_FILERDEVS, &td, scareFlags, fi->frdevs);
+    return 0;
+ err:
+    return -1;
+}
+
+/* Lazy loading may happen from worker threads sharing the file set */
+static pthread_mutex_t lazyLock = PTHREAD_MUTEX_INITIALIZER;
+
+static void rpmfilesLoad(rpmfiles fi, int what)
+{
+    if (!(__atomic_load_n(&fi->lazy, __ATOMIC_ACQUIRE) & what))
+	return;
+
+    pthread_mutex_lock(&lazyLock);
+    if (fi->lazy & what) {
+	/* Errors were already logged, the array simply stays empty */
+	(void) rpmfilesPopulateLazy(fi, fi->h, what);
+	__atomic_and_fetch(&fi->lazy, ~what, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&lazyLock);
+}
+
 static int rpmfilesPopulate(rpmfiles fi, Header h, rpmfiFlags flags)
 {
     headerGetFlags scareFlags = (flags & RPMFI_KEEPHEADER) ? 
@@ -1621,6 +1752,7 @@ static int rpmfilesPopulate(rpmfiles fi, Header h, rpmfiFlags flags)
     headerGetFlags defFlags = HEADERGET_ALLOC;
     struct rpmtd_s digalgo, td;
     rpm_count_t totalfc = rpmfilesFC(fi);
+    int what = 0;
 
     /* XXX TODO: all these should be sanity checked, ugh... */
     if (!(flags & RPMFI_NOFILEMODES))
@@ -1633,27 +1765,18 @@ static int rpmfilesPopulate(rpmfiles fi, Header h, rpmfiFlags flags)
 	_hgfi(h, RPMTAG_FILESIZES, &td, scareFlags, fi->fsizes);
 	_hgfi(h, RPMTAG_LONGFILESIZES, &td, scareFlags, fi->lfsizes);
     }
-    if (!(flags & RPMFI_NOFILECOLORS))
+    if (!(flags & RPMFI_NOFILECOLORS)) {
 	_hgfi(h, RPMTAG_FILECOLORS, &td, scareFlags, fi->fcolors);
-
-    if (!(flags & RPMFI_NOFILECLASS)) {
-	_hgfinc(h, RPMTAG_CLASSDICT, &td, scareFlags, fi->cdict);
-	fi->ncdict = rpmtdCount(&td);
-	_hgfi(h, RPMTAG_FILECLASS, &td, scareFlags, fi->fcdictx);
-    }
-    if (!(flags & RPMFI_NOFILEDEPS)) {
-	_hgfinc(h, RPMTAG_DEPENDSDICT, &td, scareFlags, fi->ddict);
-	fi->nddict = rpmtdCount(&td);
-	_hgfinc(h, RPMTAG_FILEDEPENDSX, &td, scareFlags, fi->fddictx);
-	_hgfinc(h, RPMTAG_FILEDEPENDSN, &td, scareFlags, fi->fddictn);
+	/* Color conflicts are only possible between sets with colors */
+	for (int i = 0; fi->fcolors && i < totalfc; i++)
+	    fi->colors |= fi->fcolors[i];
+	/* XXX ignore all but lsnibble for now. */
+	fi->colors &= 0xf;
     }
 
     if (!(flags & RPMFI_NOFILESTATES))
 	_hgfi(h, RPMTAG_FILESTATES, &td, defFlags, fi->fstates);
 
-    if (!(flags & RPMFI_NOFILECAPS))
-	_hgfi(h, RPMTAG_FILECAPS, &td, defFlags, fi->fcaps);
-
     if (!(flags & RPMFI_NOFILELINKTOS))
 	fi->flinks = tag2pool(fi->pool, h, RPMTAG_FILELINKTOS, totalfc);
     /* FILELANGS are only interesting when installing */
@@ -1670,32 +1793,32 @@ static int rpmfilesPopulate(rpmfiles fi, Header h, rpmfiFlags flags)
 	}
     }
 
-    fi->digests = NULL;
-    /* grab hex digests from header and store in binary format */
-    if (!(flags & RPMFI_NOFILEDIGESTS)) {
-	size_t diglen = rpmDigestLength(fi->digestalgo);
-	fi->digests = hex2bin(h, RPMTAG_FILEDIGESTS, totalfc, diglen);
-    }
-
-    fi->signatures = NULL;
-    /* grab hex signatures from header and store in binary format */
-    if (!(flags & RPMFI_NOFILESIGNATURES)) {
-	fi->signatures = hex2binv(h, RPMTAG_FILESIGNATURES,
-				 totalfc, &fi->signatureoffs);
-    }
-
-    fi->veritysigs = NULL;
-    if (!(flags & RPMFI_NOVERITYSIGNATURES)) {
-	fi->verityalgo = headerGetNumber(h, RPMTAG_VERITYSIGNATUREALGO);
-	fi->veritysigs = base2bin(h, RPMTAG_VERITYSIGNATURES,
-				  totalfc, &fi->veritysiglength);
-    }
-
-    /* XXX TR_REMOVED doesn;t need fmtimes, frdevs, finodes */
+    if (!(flags & RPMFI_NOFILECLASS))
+	what |= LAZY_FILECLASS;
+    if (!(flags & RPMFI_NOFILEDEPS))
+	what |= LAZY_FILEDEPS;
+    if (!(flags & RPMFI_NOFILECAPS))
+	what |= LAZY_FILECAPS;
+    if (!(flags & RPMFI_NOFILEDIGESTS))
+	what |= LAZY_FILEDIGESTS;
+    if (!(flags & RPMFI_NOFILESIGNATURES))
+	what |= LAZY_FILESIGNATURES;
+    if (!(flags & RPMFI_NOVERITYSIGNATURES))
+	what |= LAZY_VERITYSIGS;
     if (!(flags & RPMFI_NOFILEMTIMES))
-	_hgfi(h, RPMTAG_FILEMTIMES, &td, scareFlags, fi->fmtimes);
+	what |= LAZY_FILEMTIMES;
     if (!(flags & RPMFI_NOFILERDEVS))
-	_hgfi(h, RPMTAG_FILERDEVS, &td, scareFlags, fi->frdevs);
+	what |= LAZY_FILERDEVS;
+
+    /*
+     * With the header kept around, defer the rarely needed arrays until
+     * somebody actually asks for them.
+     */
+    if (flags & RPMFI_KEEPHEADER)
+	fi->lazy = what;
+    else if (rpmfilesPopulateLazy(fi, h, what))
+	goto err;
+
     if (!(flags & RPMFI_NOFILEINODES)) {
 	_hgfi(h, RPMTAG_FILEINODES, &td, scareFlags, fi->finodes);
 	rpmfilesBuildNLink(fi, h);
@@ -1947,27 +2070,61 @@ RPMFI_ITERFUNC(rpm_loff_t, FSize, i)
 RPMFI_ITERFUNC(rpm_color_t, FColor, i)
 RPMFI_ITERFUNC(uint32_t, FNlink, i)
 
+/*
+ * Assemble a path into the iterator's buffer without allocating on
+ * every call. Only the basename gets copied while iterating over files
+ * of the same directory.
+ */
+static const char * iterFN(rpmstrPool pool, rpmfn fndata, int ix,
+			   struct fnbuf_s *fnb)
+{
+    const char *bn, *dn = NULL;
+    size_t blen, need;
+    int dx;
+
+    if (ix < 0 || ix >= rpmfnFC(fndata))
+	return ""; /* preserve behavior on errors */
+    if (fnb->buf && fnb->ix == ix)
+	return fnb->buf;
+
+    dx = rpmfnDI(fndata, ix);
+    if ((bn = rpmfnBN(pool, fndata, ix)) == NULL)
+	bn = "";
+    blen = strlen(bn);
+
+    if (fnb->buf == NULL || fnb->dx != dx) {
+	if ((dn = rpmfnDN(pool, fndata, dx)) == NULL)
+	    dn = "";
+	fnb->dlen = strlen(dn);
+	fnb->dx = dx;
+    }
+
+    need = fnb->dlen + blen + 1;
+    if (need > fnb->alloced) {
+	fnb->alloced = need + 64;
+	fnb->buf = xrealloc(fnb->buf, fnb->alloced);
+    }
+    /* xrealloc() keeps the directory part if it was there already */
+    if (dn)
+	memcpy(fnb->buf, dn, fnb->dlen);
+    memcpy(fnb->buf + fnb->dlen, bn, blen + 1);
+    fnb->ix = ix;
+    return fnb->buf;
+}
+
 const char * rpmfiFN(rpmfi fi)
 {
     const char *fn = ""; /* preserve behavior on errors */
-    if (fi != NULL) {
-	free(fi->fn);
-	fi->fn = rpmfilesFN(fi->files, fi->i);
-	if (fi->fn != NULL)
-	    fn = fi->fn;
-    }
+    if (fi != NULL && fi->files != NULL)
+	fn = iterFN(fi->files->pool, &fi->files->fndata, fi->i, &fi->fn);
     return fn;
 }
 
 const char * rpmfiOFN(rpmfi fi)
 {
     const char *fn = ""; /* preserve behavior on errors */
-    if (fi != NULL) {
-	free(fi->ofn);
-	fi->ofn = rpmfilesOFN(fi->files, fi->i);
-	if (fi->ofn != NULL)
-	    fn = fi->ofn;
-    }
+    if (fi != NULL && fi->files != NULL)
+	fn = iterFN(fi->files->pool, fi->files->ofndata, fi->i, &fi->ofn);
     return fn;
 }
 
@@ -2076,6 +2233,13 @@ rpm_loff_t rpmfiArchiveTell(rpmfi fi)
     return (rpm_loff_t) rpmcpioTell(fi->archive);
 }
 
+int rpmfiArchiveSeek(rpmfi fi, rpm_loff_t offset)
+{
+    if (fi == NULL || fi->archive == NULL)
+	return RPMERR_INTERNAL;
+    return rpmcpioSeek(fi->archive, offset);
+}
+
 static int rpmfiArchiveWriteHeader(rpmfi fi)
 {
     int rc;
@@ -2089,8 +2253,9 @@ static int rpmfiArchiveWriteHeader(rpmfi fi)
     if (files->lfsizes) {
 	return rpmcpioStrippedHeaderWrite(fi->archive, rpmfiFX(fi), st.st_size);
     } else {
+	static rpmMacroCache cache;
 	const char * dn = rpmfiDN(fi);
-	char * path = rstrscat(NULL, (dn[0] == '/' && !rpmExpandNumeric("%{_noPayloadPrefix}")) ? "." : "",
+	char * path = rstrscat(NULL, (dn[0] == '/' && !rpmExpandNumericCached(&cache, "%{_noPayloadPrefix}")) ? "." : "",
 			       dn, rpmfiBN(fi), NULL);
 	rc = rpmcpioHeaderWrite(fi->archive, path, &st);
 	free(path);
@@ -2384,6 +2549,231 @@ ssize_t rpmfiArchiveRead(rpmfi fi, void * buf, size_t size)
     return rpmcpioRead(fi->archive, buf, size);
 }
 
+int rpmfiArchiveCopyToFile(rpmfi fi, int fdno, int nodigest, rpmpsm psm)
+{
+    if (fi == NULL || fi->archive == NULL || fdno < 0)
+	return -1;
+
+    rpm_loff_t size = rpmfiFSize(fi);
+    const unsigned char * fidigest = NULL;
+    int digestalgo = 0;
+    size_t diglen = 0;
+    DIGEST_CTX ctx = NULL;
+    int rc;
+
+    /* Leave the empty file digest quirks to the regular path */
+    if (size == 0)
+	return 1;
+
+    if (!nodigest) {
+	fidigest = rpmfiFDigest(fi, &digestalgo, &diglen);
+	ctx = rpmDigestInit(digestalgo, RPMDIGEST_NONE);
+    }
+
+    rc = rpmcpioCopy(fi->archive, fdno, size, ctx);
+    if (rc == 0)
+	rpmpsmNotify(psm, RPMCALLBACK_INST_PROGRESS, rpmfiArchiveTell(fi));
+
+    if (ctx) {
+	uint8_t *digest = NULL;
+	rpmDigestFinal(ctx, (void **)&digest, NULL, 0);
+	if (rc == 0 && (fidigest == NULL || memcmp(digest, fidigest, diglen)))
+	    rc = RPMERR_DIGEST_MISMATCH;
+	free(digest);
+    }
+    return rc;
+}
+
+static int rpmfiCheckDigest(rpmfi fi, rpmHashAlgo digestalgo,
+			    const void *digest, const unsigned char *fidigest)
+{
+    int rc = 0;
+
+    if (digest != NULL && fidigest != NULL) {
+	size_t diglen = rpmDigestLength(digestalgo);
+	if (memcmp(digest, fidigest, diglen)) {
+	    rc = RPMERR_DIGEST_MISMATCH;
+
+	    /* ...but in old packages, empty files have zeros for digest */
+	    if (rpmfiFSize(fi) == 0 && digestalgo == RPM_HASH_MD5) {
+		uint8_t zeros[diglen];
+		memset(&zeros, 0, diglen);
+		if (memcmp(zeros, fidigest, diglen) == 0)
+		    rc = 0;
+	    }
+	}
+    } else {
+	rc = RPMERR_DIGEST_MISMATCH;
+    }
+    return rc;
+}
+
+#define DIGEST_PIPE_BUFS	4
+#define DIGEST_PIPE_BUFSIZE	(128 * 1024)
+
+/* Ring of buffers hashed on a helper thread while the data gets written */
+struct digestPipe_s {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    DIGEST_CTX ctx;
+    unsigned int head;			/*!< next buffer to hash */
+    unsigned int tail;			/*!< next buffer to fill */
+    size_t lens[DIGEST_PIPE_BUFS];
+    char bufs[DIGEST_PIPE_BUFS][DIGEST_PIPE_BUFSIZE];
+};
+
+static void *digestPipeThread(void *arg)
+{
+    struct digestPipe_s *dp = arg;
+
+    pthread_mutex_lock(&dp->lock);
+    while (1) {
+	while (dp->head == dp->tail)
+	    pthread_cond_wait(&dp->cond, &dp->lock);
+	unsigned int ix = dp->head % DIGEST_PIPE_BUFS;
+	/* zero length buffer marks the end of data */
+	if (dp->lens[ix] == 0)
+	    break;
+	pthread_mutex_unlock(&dp->lock);
+
+	rpmDigestUpdate(dp->ctx, dp->bufs[ix], dp->lens[ix]);
+
+	pthread_mutex_lock(&dp->lock);
+	dp->head++;
+	pthread_cond_broadcast(&dp->cond);
+    }
+    pthread_mutex_unlock(&dp->lock);
+    return NULL;
+}
+
+/* Wait for a free buffer */
+static char *digestPipeGet(struct digestPipe_s *dp)
+{
+    pthread_mutex_lock(&dp->lock);
+    while (dp->tail - dp->head == DIGEST_PIPE_BUFS)
+	pthread_cond_wait(&dp->cond, &dp->lock);
+    pthread_mutex_unlock(&dp->lock);
+    return dp->bufs[dp->tail % DIGEST_PIPE_BUFS];
+}
+
+/* Hand the last buffer from digestPipeGet() to the hasher */
+static void digestPipePut(struct digestPipe_s *dp, size_t len)
+{
+    pthread_mutex_lock(&dp->lock);
+    dp->lens[dp->tail % DIGEST_PIPE_BUFS] = len;
+    dp->tail++;
+    pthread_cond_broadcast(&dp->cond);
+    pthread_mutex_unlock(&dp->lock);
+}
+
+static struct digestPipe_s *digestPipeNew(rpmHashAlgo digestalgo)
+{
+    struct digestPipe_s *dp = xcalloc(1, sizeof(*dp));
+
+    dp->ctx = rpmDigestInit(digestalgo, 0);
+    pthread_mutex_init(&dp->lock, NULL);
+    pthread_cond_init(&dp->cond, NULL);
+    if (dp->ctx == NULL ||
+	    pthread_create(&dp->thread, NULL, digestPipeThread, dp)) {
+	rpmDigestFinal(dp->ctx, NULL, NULL, 0);
+	pthread_cond_destroy(&dp->cond);
+	pthread_mutex_destroy(&dp->lock);
+	dp = _free(dp);
+    }
+    return dp;
+}
+
+/* Wait for the hasher to finish and return the digest */
+static void *digestPipeFree(struct digestPipe_s *dp)
+{
+    void *digest = NULL;
+
+    digestPipeGet(dp);
+    digestPipePut(dp, 0);
+    pthread_join(dp->thread, NULL);
+    rpmDigestFinal(dp->ctx, &digest, NULL, 0);
+    pthread_cond_destroy(&dp->cond);
+    pthread_mutex_destroy(&dp->lock);
+    free(dp);
+    return digest;
+}
+
+/*
+ * Unpack a (large) file while calculating its digest on a helper thread,
+ * overlapping the hashing with the writes.
+ */
+static int rpmfiArchiveReadToFilePipe(rpmfi fi, FD_t fd, rpmpsm psm,
+				      struct digestPipe_s *dp,
+				      rpmHashAlgo digestalgo,
+				      const unsigned char *fidigest)
+{
+    rpm_loff_t left = rpmfiFSize(fi);
+    void *digest;
+    int rc = 0;
+
+    while (left) {
+	size_t len = (left > DIGEST_PIPE_BUFSIZE ? DIGEST_PIPE_BUFSIZE : left);
+	char *buf = digestPipeGet(dp);
+	if (rpmcpioRead(fi->archive, buf, len) != len) {
+	    rc = RPMERR_READ_FAILED;
+	    break;
+	}
+	digestPipePut(dp, len);
+	if ((Fwrite(buf, sizeof(*buf), len, fd) != len) || Ferror(fd)) {
+	    rc = RPMERR_WRITE_FAILED;
+	    break;
+	}
+
+	rpmpsmNotify(psm, RPMCALLBACK_INST_PROGRESS, rpmfiArchiveTell(fi));
+	left -= len;
+    }
+
+    digest = digestPipeFree(dp);
+    if (!rc) {
+	(void) Fflush(fd);
+	rc = rpmfiCheckDigest(fi, digestalgo, digest, fidigest);
+    }
+    free(digest);
+    return rc;
+}
+
+#define ARCHIVE_BUFSIZE_MAX	(1024 * 1024)
+
+/*
+ * Size the copy buffer of a big file by its size, in whole blocks of the
+ * filesystem it's written to, up to ARCHIVE_BUFSIZE_MAX.
+ */
+static size_t archiveBufSize(FD_t fd, rpm_loff_t size)
+{
+    struct stat st;
+    size_t blksize = BUFSIZ;
+    size_t bufsize;
+
+    if (fstat(Fileno(fd), &st) == 0 && st.st_blksize > 0)
+	blksize = st.st_blksize;
+    bufsize = (size < ARCHIVE_BUFSIZE_MAX) ? size : ARCHIVE_BUFSIZE_MAX;
+    bufsize = (bufsize + blksize - 1) / blksize * blksize;
+    return bufsize;
+}
+
+/* Reserve the space of a big file up front to keep it from fragmenting */
+static void archivePreallocate(FD_t fd, rpm_loff_t size)
+{
+#ifdef HAVE_FALLOCATE
+    static rpmMacroCache cache;
+    rpm_loff_t minsize = rpmExpandNumericCached(&cache, "%{?_unpack_preallocate_size}");
+
+    if (minsize > 0 && size >= minsize) {
+	/* Not supported everywhere, and it's only a hint anyway */
+	if (fallocate(Fileno(fd), 0, 0, size) && errno != EOPNOTSUPP) {
+	    rpmlog(RPMLOG_DEBUG, "fallocate %" PRIu64 " bytes failed: %s\n",
+		   size, strerror(errno));
+	}
+    }
+#endif
+}
+
 int rpmfiArchiveReadToFilePsm(rpmfi fi, FD_t fd, int nodigest, rpmpsm psm)
 {
     if (fi == NULL || fi->archive == NULL || fd == NULL)
@@ -2393,17 +2783,40 @@ int rpmfiArchiveReadToFilePsm(rpmfi fi, FD_t fd, int nodigest, rpmpsm psm)
     const unsigned char * fidigest = NULL;
     rpmHashAlgo digestalgo = 0;
     int rc = 0;
-    char buf[BUFSIZ*4];
+    char sbuf[BUFSIZ*4];
+    char *buf = sbuf;
+    size_t bufsize = sizeof(sbuf);
+
+    if (left > sizeof(sbuf))
+	archivePreallocate(fd, left);
 
     if (!nodigest) {
 	digestalgo = rpmfiDigestAlgo(fi);
 	fidigest = rpmfilesFDigest(fi->files, rpmfiFX(fi), NULL, NULL);
+
+	/* Offload hashing of big files to a helper thread if enabled */
+	if (left > sizeof(sbuf)) {
+	    static rpmMacroCache cache;
+	    rpm_loff_t minsize = rpmExpandNumericCached(&cache, "%{?_unpack_digest_thread_size}");
+	    struct digestPipe_s *dp = NULL;
+	    if (minsize > 0 && left >= minsize)
+		dp = digestPipeNew(digestalgo);
+	    if (dp)
+		return rpmfiArchiveReadToFilePipe(fi, fd, psm, dp,
+						  digestalgo, fidigest);
+	}
 	fdInitDigest(fd, digestalgo, 0);
     }
 
+    /* Fewer, bigger writes and digest updates for big files */
+    if (left > sizeof(sbuf)) {
+	bufsize = archiveBufSize(fd, left);
+	buf = xmalloc(bufsize);
+    }
+
     while (left) {
 	size_t len;
-	len = (left > sizeof(buf) ? sizeof(buf) : left);
+	len = (left > bufsize ? bufsize : left);
 	if (rpmcpioRead(fi->archive, buf, len) != len) {
 	    rc = RPMERR_READ_FAILED;
 	    goto exit;
@@ -2422,27 +2835,13 @@ int rpmfiArchiveReadToFilePsm(rpmfi fi, FD_t fd, int nodigest, rpmpsm psm)
 
 	(void) Fflush(fd);
 	fdFiniDigest(fd, digestalgo, &digest, NULL, 0);
-
-	if (digest != NULL && fidigest != NULL) {
-	    size_t diglen = rpmDigestLength(digestalgo);
-	    if (memcmp(digest, fidigest, diglen)) {
-		rc = RPMERR_DIGEST_MISMATCH;
-
-		/* ...but in old packages, empty files have zeros for digest */
-		if (rpmfiFSize(fi) == 0 && digestalgo == RPM_HASH_MD5) {
-		    uint8_t zeros[diglen];
-		    memset(&zeros, 0, diglen);
-		    if (memcmp(zeros, fidigest, diglen) == 0)
-			rc = 0;
-		}
-	    }
-	} else {
-	    rc = RPMERR_DIGEST_MISMATCH;
-	}
+	rc = rpmfiCheckDigest(fi, digestalgo, digest, fidigest);
 	free(digest);
     }
 
 exit:
+    if (buf != sbuf)
+	free(buf);
     return rc;
 }
 
@@ -96,6 +96,19 @@ struct fingerPrint_s *rpmfilesFps(rpmfiles fi);
 RPM_GNUC_INTERNAL
 int rpmfileContentsEqual(rpmfiles ofi, int oix, rpmfiles nfi, int nix);
 
+/** \ingroup rpmfi
+ * Check if the file in old and new package can have the same contents
+ * on disk according to the headers: regular files of the same size and
+ * digest, or symlinks.
+ * @param 	old file info set
+ * @param 	old file index
+ * @param 	new file info set
+ * @param 	new file index
+ * @return	1 if the condition is satisfied, 0 otherwise
+ */
+RPM_GNUC_INTERNAL
+int rpmfilesHeaderEqual(rpmfiles ofi, int oix, rpmfiles nfi, int nix);
+
 
 RPM_GNUC_INTERNAL
 rpmFileAction rpmfilesDecideFate(rpmfiles ofi, int oix,
@@ -124,6 +137,7 @@ rpmfiles rpmfiFiles(rpmfi fi);
  */
 RPM_GNUC_INTERNAL
 rpmfi rpmfilesFindPrefix(rpmfiles fi, const char *pfx);
+
 #ifdef __cplusplus
 }
 #endif
@@ -5,11 +5,17 @@
 #include "lib/rpmfs.h"
 #include "debug.h"
 
+/*
+ * States and actions take a byte per file each. Packing them tighter would
+ * need atomic read-modify-write: the sharded file overlap pass updates
+ * neighbouring files of a package from different threads. The states
+ * array is also stored in the header as RPMTAG_FILESTATES as-is.
+ */
 struct rpmfs_s {
     unsigned int fc;
 
     rpm_fstate_t * states;
-    rpmFileAction * actions;	/*!< File disposition(s). */
+    uint8_t * actions;		/*!< File disposition(s) (rpmFileAction) */
 
     sharedFileInfo replaced;	/*!< (TR_ADDED) to be replaced files in the rpmdb */
     int numReplaced;
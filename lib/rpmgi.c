@@ -5,16 +5,20 @@
 
 #include <errno.h>
 #include <string.h>
+#include <pthread.h>
 
 #include <rpm/rpmtypes.h>
 #include <rpm/rpmlib.h>		/* rpmReadPackageFile */
 #include <rpm/rpmts.h>
 #include <rpm/rpmmacro.h>		/* XXX rpmExpand */
 #include <rpm/rpmfileutil.h>
+#include <rpm/rpmkeyring.h>
 #include <rpm/rpmlog.h>
 
 #include "lib/rpmgi.h"
 #include "lib/manifest.h"
+#include "lib/rpmworkers.h"
+#include "rpmio/rpmio_internal.h"	/* rpmlogDefer */
 
 #include "debug.h"
 
@@ -23,6 +27,35 @@
 RPM_GNUC_INTERNAL
 rpmgiFlags giFlags = RPMGI_NONE;
 
+/** \ingroup rpmgi
+ * Header of an argument read ahead.
+ */
+struct giRead_s {
+    int ix;			/*!< Argument index, -1 if unused. */
+    int done;
+    int opened;			/*!< Could the file be opened? */
+    Header h;
+    rpmlogDefer log;		/*!< Messages from reading it. */
+};
+
+/** \ingroup rpmgi
+ * Threads reading the headers of upcoming arguments, at most window
+ * ahead of the consumer. The arguments must not change while running.
+ */
+struct giPrefetch_s {
+    rpmgi gi;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t *threads;
+    int nthreads;		/*!< Number of threads started. */
+    int window;			/*!< Number of slots in reads. */
+    int next;			/*!< Next argument to read. */
+    int end;			/*!< End of the arguments to read. */
+    int consumed;		/*!< Next argument the consumer takes. */
+    int stop;
+    struct giRead_s *reads;	/*!< Ring of results, by index % window. */
+};
+
 /** \ingroup rpmgi
  */
 struct rpmgi_s {
@@ -38,6 +71,8 @@ struct rpmgi_s {
     int curLvl;			/*!< Current recursion level */
     int	recLvls[MANIFEST_RECURSIONS]; /*!< Reversed end index for given level */
 
+    int nthreads;		/*!< Number of header reading threads. */
+    struct giPrefetch_s *prefetch;
 };
 
 /**
@@ -89,7 +124,8 @@ static rpmRC rpmgiLoadManifest(rpmgi gi, const char * path)
  */
 static int rpmgiReadHeader(rpmgi gi, const char * path, Header * hdrp)
 {
-    FD_t fd = rpmgiOpen(path, "r.ufdio");
+    /* Buffer to avoid a syscall for each of the small reads of a header */
+    FD_t fd = rpmgiOpen(path, "r.bufdio");
     Header h = NULL;
 
     if (fd != NULL) {
@@ -116,6 +152,151 @@ static int rpmgiReadHeader(rpmgi gi, const char * path, Header * hdrp)
     return (fd != NULL);
 }
 
+static void *prefetchThread(void *arg)
+{
+    struct giPrefetch_s *pf = arg;
+
+    pthread_mutex_lock(&pf->lock);
+    while (1) {
+	struct giRead_s *rd;
+	int ix;
+
+	while (!pf->stop && pf->next < pf->end &&
+		pf->next >= pf->consumed + pf->window)
+	    pthread_cond_wait(&pf->cond, &pf->lock);
+	if (pf->stop || pf->next >= pf->end)
+	    break;
+
+	ix = pf->next++;
+	rd = &pf->reads[ix % pf->window];
+	pthread_mutex_unlock(&pf->lock);
+
+	/* Messages are logged when the consumer gets to this argument */
+	rpmlogDeferStart();
+	rd->opened = rpmgiReadHeader(pf->gi, pf->gi->argv[ix], &rd->h);
+	rd->log = rpmlogDeferStop();
+
+	pthread_mutex_lock(&pf->lock);
+	rd->ix = ix;
+	rd->done = 1;
+	pthread_cond_broadcast(&pf->cond);
+    }
+    pthread_mutex_unlock(&pf->lock);
+    return NULL;
+}
+
+static struct giPrefetch_s *prefetchFree(struct giPrefetch_s *pf)
+{
+    if (pf) {
+	pthread_mutex_lock(&pf->lock);
+	pf->stop = 1;
+	pthread_cond_broadcast(&pf->cond);
+	pthread_mutex_unlock(&pf->lock);
+
+	for (int i = 0; i < pf->nthreads; i++)
+	    pthread_join(pf->threads[i], NULL);
+
+	/* Whatever wasn't consumed is dropped, as if never read */
+	for (int i = 0; i < pf->window; i++) {
+	    struct giRead_s *rd = &pf->reads[i];
+	    if (rd->done) {
+		headerFree(rd->h);
+		rpmlogDeferFree(rd->log);
+	    }
+	}
+	pthread_cond_destroy(&pf->cond);
+	pthread_mutex_destroy(&pf->lock);
+	free(pf->threads);
+	free(pf->reads);
+	free(pf);
+    }
+    return NULL;
+}
+
+/*
+ * Start reading the headers of the remaining arguments on
+ * %_pkgread_threads threads. The consumer still gets them, and the
+ * messages from reading them, in argument order.
+ */
+static struct giPrefetch_s *prefetchNew(rpmgi gi)
+{
+    struct giPrefetch_s *pf;
+
+    if (gi->nthreads < 2 || gi->argc - gi->i < 2)
+	return NULL;
+
+    /* Load the keyring up front, it's lazily initialized on first use */
+    rpmKeyringFree(rpmtsGetKeyring(gi->ts, 1));
+
+    pf = xcalloc(1, sizeof(*pf));
+    pf->gi = gi;
+    pthread_mutex_init(&pf->lock, NULL);
+    pthread_cond_init(&pf->cond, NULL);
+    pf->window = gi->nthreads * 4;
+    pf->reads = xcalloc(pf->window, sizeof(*pf->reads));
+    for (int i = 0; i < pf->window; i++)
+	pf->reads[i].ix = -1;
+    pf->next = pf->consumed = gi->i;
+    pf->end = gi->argc;
+
+    pf->threads = xcalloc(gi->nthreads, sizeof(*pf->threads));
+    for (int i = 0; i < gi->nthreads; i++) {
+	if (pthread_create(&pf->threads[pf->nthreads], NULL,
+			   prefetchThread, pf))
+	    break;
+	pf->nthreads++;
+    }
+
+    if (pf->nthreads == 0)
+	pf = prefetchFree(pf);
+    return pf;
+}
+
+/**
+ * Return header of an argument read ahead.
+ * @param pf		read ahead threads (or NULL)
+ * @param ix		argument index
+ * @param[out] hdrp	header (NULL on failure)
+ * @param[out] opened	could the file be opened?
+ * @return		1 if the argument was read ahead, 0 if not
+ */
+static int prefetchTake(struct giPrefetch_s *pf, int ix, Header *hdrp,
+			int *opened)
+{
+    rpmlogDefer log = NULL;
+
+    if (pf == NULL || ix < pf->consumed || ix >= pf->end)
+	return 0;
+
+    pthread_mutex_lock(&pf->lock);
+    while (pf->consumed <= ix) {
+	struct giRead_s *rd = &pf->reads[pf->consumed % pf->window];
+
+	while (!(rd->done && rd->ix == pf->consumed))
+	    pthread_cond_wait(&pf->cond, &pf->lock);
+
+	if (pf->consumed == ix) {
+	    *hdrp = rd->h;
+	    *opened = rd->opened;
+	    log = rd->log;
+	} else {
+	    /* skipped over, shouldn't happen */
+	    headerFree(rd->h);
+	    rpmlogDeferFree(rd->log);
+	}
+	rd->h = NULL;
+	rd->log = NULL;
+	rd->done = 0;
+	rd->ix = -1;
+	pf->consumed++;
+    }
+    pthread_cond_broadcast(&pf->cond);
+    pthread_mutex_unlock(&pf->lock);
+
+    rpmlogDeferFlush(log);
+    return 1;
+}
+
 /**
  * Read next header from package, lazily expanding manifests as found.
  * @todo An empty file read as manifest truncates argv returning RPMRC_NOTFOUND.
@@ -135,7 +316,8 @@ static Header rpmgiLoadReadHeader(rpmgi gi)
 	while (gi->recLvls[gi->curLvl] > gi->argc - gi->i)
 	    gi->curLvl--;
 
-	rc = rpmgiReadHeader(gi, fn, &h);
+	if (!prefetchTake(gi->prefetch, gi->i, &h, &rc))
+	    rc = rpmgiReadHeader(gi, fn, &h);
 
 	if (h != NULL || (gi->flags & RPMGI_NOMANIFEST) || rc == 0)
 	    break;
@@ -148,6 +330,9 @@ static Header rpmgiLoadReadHeader(rpmgi gi)
 	gi->curLvl++;
 	gi->recLvls[gi->curLvl] = gi->argc - gi->i;
 
+	/* The arguments are about to change, restarted on next round */
+	gi->prefetch = prefetchFree(gi->prefetch);
+
 	/* Not a header, so try for a manifest. */
 	gi->argv[gi->i] = NULL;		/* Mark the insertion point */
 	if (rpmgiLoadManifest(gi, fn) != RPMRC_OK) {
@@ -194,6 +379,7 @@ static void rpmgiGlobArgv(rpmgi gi, ARGV_const_t argv)
 rpmgi rpmgiFree(rpmgi gi)
 {
     if (gi != NULL) {
+	gi->prefetch = prefetchFree(gi->prefetch);
 	rpmtsFree(gi->ts);
 	argvFree(gi->argv);
 
@@ -220,6 +406,9 @@ rpmgi rpmgiNew(rpmts ts, rpmgiFlags flags, ARGV_const_t argv)
     gi->curLvl = 0;
     gi->recLvls[gi->curLvl] = 1;
 
+    gi->nthreads = rpmworkersCount("_pkgread_threads");
+    gi->prefetch = NULL;
+
     return gi;
 }
 
@@ -228,6 +417,9 @@ Header rpmgiNext(rpmgi gi)
     Header h = NULL;
 
     if (gi != NULL && ++gi->i >= 0) {
+	if (gi->prefetch == NULL)
+	    gi->prefetch = prefetchNew(gi);
+
 	/* 
  	 * Read next header, lazily expanding manifests as found,
  	 * count + skip errors.
@@ -240,8 +432,10 @@ Header rpmgiNext(rpmgi gi)
         }
 
 	/* Out of things to try, end of iteration */
-	if (h == NULL)
+	if (h == NULL) {
 	    gi->i = -1;
+	    gi->prefetch = prefetchFree(gi->prefetch);
+	}
     }
 
     return h;
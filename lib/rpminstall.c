@@ -15,9 +15,11 @@
 #include <rpm/rpmsq.h>
 #include <rpm/rpmlog.h>
 #include <rpm/rpmfileutil.h>
+#include <rpm/rpmkeyring.h>
 
 #include "lib/rpmgi.h"
 #include "lib/manifest.h"
+#include "lib/rpmworkers.h"
 #include "debug.h"
 
 static int rpmcliPackagesTotal = 0;
@@ -250,6 +252,37 @@ struct rpmEIU {
     char ** argv;
     rpmRelocation * relocations;
     rpmRC rpmrc;
+    struct pkgRead_s * reads;	/* prefetched headers from readbase on */
+    int nreads;
+    int readbase;
+    struct pkgRead_s * fetched;	/* headers read on download, by pkgURL */
+};
+
+/* Result of reading the header of a single package file */
+struct pkgRead_s {
+    const char * fn;
+    Header h;
+    rpmRC rc;
+    char * openerr;		/* open failure message, if any */
+    int done;			/* read already? */
+};
+
+struct pkgReads_s {
+    rpmts ts;
+    struct pkgRead_s * reads;
+};
+
+/* A remote package argument, downloaded ahead */
+struct urlFetch_s {
+    const char * url;
+    char * tfn;			/* local copy */
+    int rc;
+    struct pkgRead_s read;	/* header of the local copy */
+};
+
+struct urlFetches_s {
+    rpmts ts;
+    struct urlFetch_s * fetches;
 };
 
 static int rpmcliTransaction(rpmts ts, struct rpmInstallArguments_s * ia)
@@ -343,27 +376,182 @@ static int tryReadManifest(struct rpmEIU * eiu)
     return rc;
 }
 
+static void readPackage(rpmts ts, struct pkgRead_s * pr)
+{
+    /* Try to read the header from a package file. */
+    FD_t fd = Fopen(pr->fn, "r.ufdio");
+    if (fd == NULL || Ferror(fd)) {
+	pr->openerr = xstrdup(Fstrerror(fd));
+	pr->rc = RPMRC_FAIL;
+	if (fd != NULL)
+	    Fclose(fd);
+	return;
+    }
+
+    /* Read the header, verifying signatures (if present). */
+    pr->rc = rpmReadPackageFile(ts, fd, pr->fn, &pr->h);
+    Fclose(fd);
+}
+
+static void readPackageWorker(void *data, int ix, int slot)
+{
+    struct pkgReads_s * prs = data;
+    if (!prs->reads[ix].done)
+	readPackage(prs->ts, &prs->reads[ix]);
+}
+
+static void freeRead(struct pkgRead_s * pr)
+{
+    headerFree(pr->h);
+    free(pr->openerr);
+    memset(pr, 0, sizeof(*pr));
+}
+
+static void freeReads(struct rpmEIU * eiu)
+{
+    for (int i = 0; i < eiu->nreads; i++)
+	freeRead(&eiu->reads[i]);
+    eiu->reads = _free(eiu->reads);
+    eiu->nreads = 0;
+}
+
+/* Download a remote package argument into a temporary file */
+static int fetchURL(rpmts ts, const char * url, char ** tfnp)
+{
+    char *tfn = NULL;
+    FD_t tfd = rpmMkTempFile(rpmtsRootDir(ts), &tfn);
+    int rc = -1;
+
+    if (tfd && tfn) {
+	Fclose(tfd);
+	rc = urlGetFile(url, tfn);
+    }
+    if (rc)
+	tfn = _free(tfn);
+    *tfnp = tfn;
+    return rc;
+}
+
+static void fetchURLWorker(void *data, int ix, int slot)
+{
+    struct urlFetches_s * ufs = data;
+    struct urlFetch_s * uf = &ufs->fetches[ix];
+
+    uf->rc = fetchURL(ufs->ts, uf->url, &uf->tfn);
+    /* Read the header while the other downloads are still going */
+    if (uf->rc == 0) {
+	uf->read.fn = uf->tfn;
+	readPackage(ufs->ts, &uf->read);
+	uf->read.done = 1;
+    }
+}
+
+/*
+ * Download the remote arguments with up to %_urlfetch_jobs helpers at a
+ * time, reading the header of each as soon as it has arrived. Returns
+ * the results in argument order, NULL when downloading serially.
+ */
+static struct urlFetch_s * fetchURLs(rpmts ts, struct rpmEIU * eiu)
+{
+    int njobs = rpmworkersCount("_urlfetch_jobs");
+    struct urlFetch_s * fetches;
+    int n = 0;
+
+    for (int i = 0; i < eiu->argc; i++) {
+	urltype ut = urlIsURL(eiu->argv[i]);
+	if (ut == URL_IS_HTTPS || ut == URL_IS_HTTP || ut == URL_IS_FTP)
+	    n++;
+    }
+    if (njobs < 2 || n < 2)
+	return NULL;
+
+    /* Load the keyring up front, it's lazily initialized on first use */
+    rpmKeyringFree(rpmtsGetKeyring(ts, 1));
+
+    fetches = xcalloc(n, sizeof(*fetches));
+    n = 0;
+    for (int i = 0; i < eiu->argc; i++) {
+	urltype ut = urlIsURL(eiu->argv[i]);
+	if (ut == URL_IS_HTTPS || ut == URL_IS_HTTP || ut == URL_IS_FTP) {
+	    if (rpmIsVerbose())
+		fprintf(stdout, _("Retrieving %s\n"), eiu->argv[i]);
+	    fetches[n++].url = eiu->argv[i];
+	}
+    }
+
+    struct urlFetches_s ufs = {
+	.ts = ts,
+	.fetches = fetches,
+    };
+    rpmworkersRun(njobs, n, fetchURLWorker, &ufs);
+    return fetches;
+}
+
+/*
+ * Read the headers of the remaining package files on %_pkgread_threads
+ * threads. Everything else, including the error reporting, is still done
+ * in argument order as the results are consumed by tryReadHeader().
+ */
+static void prefetchHeaders(rpmts ts, struct rpmEIU * eiu)
+{
+    int nthreads = rpmworkersCount("_pkgread_threads");
+    char ** fnp = eiu->pkgURL + eiu->prevx;
+    int n = 0;
+
+    freeReads(eiu);
+    while (fnp[n] != NULL)
+	n++;
+    if (nthreads < 2 || n < 2)
+	return;
+
+    /* Load the keyring up front, it's lazily initialized on first use */
+    rpmKeyringFree(rpmtsGetKeyring(ts, 1));
+
+    eiu->reads = xcalloc(n, sizeof(*eiu->reads));
+    eiu->nreads = n;
+    eiu->readbase = eiu->prevx;
+    for (int i = 0; i < n; i++) {
+	struct pkgRead_s *fr = &eiu->fetched[eiu->prevx + i];
+	if (fr->done) {
+	    eiu->reads[i] = *fr;
+	    memset(fr, 0, sizeof(*fr));
+	} else {
+	    eiu->reads[i].fn = fnp[i];
+	}
+    }
+
+    struct pkgReads_s prs = {
+	.ts = ts,
+	.reads = eiu->reads,
+    };
+    rpmworkersRun(nthreads, n, readPackageWorker, &prs);
+}
+
 static int tryReadHeader(rpmts ts, struct rpmEIU * eiu, Header * hdrp)
 {
-   /* Try to read the header from a package file. */
-   FD_t fd = Fopen(*eiu->fnp, "r.ufdio");
-   if (fd == NULL || Ferror(fd)) {
+   struct pkgRead_s local = { .fn = *eiu->fnp, };
+   struct pkgRead_s *pr = &local;
+
+   if (eiu->reads)
+       pr = &eiu->reads[eiu->prevx - eiu->readbase];
+   else if (eiu->fetched[eiu->prevx].done)
+       pr = &eiu->fetched[eiu->prevx];
+   else
+       readPackage(ts, pr);
+
+   if (pr->openerr) {
        rpmlog(RPMLOG_ERR, _("open of %s failed: %s\n"), *eiu->fnp,
-	      Fstrerror(fd));
-       if (fd != NULL) {
-           Fclose(fd);
-	   fd = NULL;
-       }
+	      pr->openerr);
+       pr->openerr = _free(pr->openerr);
        eiu->numFailed++;
        *eiu->fnp = NULL;
        return RPMRC_FAIL;
    }
 
-   /* Read the header, verifying signatures (if present). */
-   eiu->rpmrc = rpmReadPackageFile(ts, fd, *eiu->fnp, hdrp);
-   Fclose(fd);
-   fd = NULL;
-   
+   eiu->rpmrc = pr->rc;
+   *hdrp = pr->h;
+   pr->h = NULL;
+
    /* Honor --nomanifest */
    if (eiu->rpmrc == RPMRC_NOTFOUND && (giFlags & RPMGI_NOMANIFEST))
        eiu->rpmrc = RPMRC_FAIL;
@@ -422,6 +610,8 @@ int rpmInstall(rpmts ts, struct rpmInstallArguments_s * ia, ARGV_t fileArgv)
     struct rpmEIU * eiu = xcalloc(1, sizeof(*eiu));
     rpmRelocation * relocations;
     char * fileURL = NULL;
+    struct urlFetch_s * fetches = NULL;
+    int fx = 0;
     rpmVSFlags vsflags, ovsflags;
     rpmVSFlags ovfyflags;
     int rc;
@@ -491,9 +681,15 @@ restart:
 			(eiu->numPkgs + 1) * sizeof(*eiu->pkgState));
 	memset(eiu->pkgState + eiu->pkgx, 0,
 			((eiu->argc + 1) * sizeof(*eiu->pkgState)));
+	eiu->fetched = xrealloc(eiu->fetched,
+			(eiu->numPkgs + 1) * sizeof(*eiu->fetched));
+	memset(eiu->fetched + eiu->pkgx, 0,
+			((eiu->argc + 1) * sizeof(*eiu->fetched)));
     }
 
     /* Retrieve next set of args, cache on local storage. */
+    fetches = fetchURLs(ts, eiu);
+    fx = 0;
     for (i = 0; i < eiu->argc; i++) {
 	fileURL = _free(fileURL);
 	fileURL = eiu->argv[i];
@@ -504,17 +700,16 @@ restart:
 	case URL_IS_HTTP:
 	case URL_IS_FTP:
 	{   char *tfn = NULL;
-	    FD_t tfd;
 
-	    if (rpmIsVerbose())
-		fprintf(stdout, _("Retrieving %s\n"), fileURL);
-
-	    tfd = rpmMkTempFile(rpmtsRootDir(ts), &tfn);
-	    if (tfd && tfn) {
-		Fclose(tfd);
-	    	rc = urlGetFile(fileURL, tfn);
+	    if (fetches) {
+		struct urlFetch_s *uf = &fetches[fx++];
+		rc = uf->rc;
+		tfn = uf->tfn;
+		eiu->fetched[eiu->pkgx] = uf->read;
 	    } else {
-		rc = -1;
+		if (rpmIsVerbose())
+		    fprintf(stdout, _("Retrieving %s\n"), fileURL);
+		rc = fetchURL(ts, fileURL, &tfn);
 	    }
 
 	    if (rc != 0) {
@@ -540,9 +735,12 @@ restart:
 	}
     }
     fileURL = _free(fileURL);
+    fetches = _free(fetches);
 
     if (eiu->numFailed) goto exit;
 
+    prefetchHeaders(ts, eiu);
+
     /* Continue processing file arguments, building transaction set. */
     for (eiu->fnp = eiu->pkgURL+eiu->prevx;
 	 *eiu->fnp != NULL;
@@ -666,6 +864,7 @@ restart:
 exit:
     if (eiu->pkgURL != NULL) {
         for (i = 0; i < eiu->numPkgs; i++) {
+	    freeRead(&eiu->fetched[i]);
 	    if (eiu->pkgURL[i] == NULL) continue;
 	    if (eiu->pkgState[i] == 1)
 	        (void) unlink(eiu->pkgURL[i]);
@@ -681,9 +880,11 @@ exit:
 	}
     }
     eiu->pkgState = _free(eiu->pkgState);
+    eiu->fetched = _free(eiu->fetched);
     eiu->pkgURL = _free(eiu->pkgURL);
     eiu->sourceURL = _free(eiu->sourceURL);
     eiu->argv = _free(eiu->argv);
+    freeReads(eiu);
     rc = eiu->numFailed;
     free(eiu);
 
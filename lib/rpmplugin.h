@@ -60,6 +60,13 @@ typedef rpmRC (*plugin_fsm_file_prepare_func)(rpmPlugin plugin, rpmfi fi,
 					      int fd, const char* path,
 					      const char *dest,
 					      mode_t file_mode, rpmFsmOp op);
+typedef rpmRC (*plugin_fsm_file_prepare_batch_func)(rpmPlugin plugin,
+					      rpmfi fi, int nfiles,
+					      const int *fx, const int *fds,
+					      const char * const *paths,
+					      const mode_t *file_modes,
+					      const rpmFsmOp *ops);
+typedef rpmRC (*plugin_fsm_file_prepare_wait_func)(rpmPlugin plugin);
 
 typedef struct rpmPluginHooks_s * rpmPluginHooks;
 struct rpmPluginHooks_s {
@@ -80,6 +87,10 @@ struct rpmPluginHooks_s {
     plugin_fsm_file_pre_func		fsm_file_pre;
     plugin_fsm_file_post_func		fsm_file_post;
     plugin_fsm_file_prepare_func	fsm_file_prepare;
+    /* optional batched variant of fsm_file_prepare, used instead of it */
+    plugin_fsm_file_prepare_batch_func	fsm_file_prepare_batch;
+    /* wait for asynchronous prepare work before files get committed */
+    plugin_fsm_file_prepare_wait_func	fsm_file_prepare_wait;
 };
 
 #ifdef __cplusplus
@@ -8,22 +8,101 @@
 #include <rpm/rpmts.h>
 
 #include "lib/rpmplugins.h"
+#include "lib/rpmtrace.h"
 #include <dlfcn.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <time.h>
 
 
 #define STR1(x) #x
 #define STR(x) STR1(x)
 
+extern int _rpmts_stats;
+
 static rpmRC rpmpluginsCallInit(rpmPlugin plugin, rpmts ts);
 
+/* The hooks are all function pointers, index them by their position */
+#define HOOK_INDEX(hook) \
+	(offsetof(struct rpmPluginHooks_s, hook) / sizeof(plugin_init_func))
+#define HOOK_MAX \
+	(sizeof(struct rpmPluginHooks_s) / sizeof(plugin_init_func))
+
+/* In struct rpmPluginHooks_s order */
+static const char * const hookNames[] = {
+    "init", "cleanup", "tsm_pre", "tsm_post", "psm_pre", "psm_post",
+    "scriptlet_pre", "scriptlet_fork_post", "scriptlet_post",
+    "fsm_file_pre", "fsm_file_post", "fsm_file_prepare",
+    "fsm_file_prepare_batch", "fsm_file_prepare_wait",
+};
+
+/* Latency histogram buckets: bucket b counts calls taking < 2^b usecs */
+#define HOOK_BUCKETS	32
+
+struct hookStats_s {
+    unsigned int count;
+    uint64_t usecs;
+    uint64_t max;
+    unsigned int hist[HOOK_BUCKETS];
+    int warned;
+};
+
 struct rpmPlugin_s {
     char *name;
     char *opts;
     void *handle;
     void *priv;
     rpmPluginHooks hooks;
+    struct hookStats_s *stats;	/* per hook call statistics (or NULL) */
+    uint64_t warnusecs;		/* warn about calls taking longer */
 };
 
+static uint64_t hookClock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void hookAccount(rpmPlugin plugin, int hx, uint64_t start)
+{
+    struct hookStats_s *st = &plugin->stats[hx];
+    uint64_t usecs = hookClock() - start;
+    int b = 0;
+
+    while (b < HOOK_BUCKETS - 1 && usecs >= (UINT64_C(1) << b))
+	b++;
+
+    st->count++;
+    st->usecs += usecs;
+    st->hist[b]++;
+    if (usecs > st->max)
+	st->max = usecs;
+
+    if (plugin->warnusecs && usecs > plugin->warnusecs && !st->warned) {
+	rpmlog(RPMLOG_WARNING,
+	       _("Plugin %s: hook %s took %" PRIu64 " ms\n"),
+	       plugin->name, hookNames[hx], usecs / 1000);
+	st->warned = 1;
+    }
+}
+
+/* Upper bound of the 99th percentile latency from the histogram */
+static uint64_t hookP99(const struct hookStats_s *st)
+{
+    unsigned int want = st->count - st->count / 100;
+    unsigned int seen = 0;
+
+    for (int b = 0; b < HOOK_BUCKETS; b++) {
+	seen += st->hist[b];
+	if (seen >= want) {
+	    uint64_t upper = UINT64_C(1) << b;
+	    return (upper < st->max) ? upper : st->max;
+	}
+    }
+    return st->max;
+}
+
 struct rpmPlugins_s {
     rpmPlugin *plugins;
     int count;
@@ -47,6 +126,19 @@ int rpmpluginsPluginAdded(rpmPlugins plugins, const char *name)
     return (rpmpluginsGetPlugin(plugins, name) != NULL);
 }
 
+int rpmpluginsHaveFileHooks(rpmPlugins plugins)
+{
+    for (int i = 0; plugins && i < plugins->count; i++) {
+	rpmPluginHooks hooks = plugins->plugins[i]->hooks;
+	if (hooks && (hooks->psm_pre || hooks->fsm_file_pre ||
+		      hooks->fsm_file_post || hooks->fsm_file_prepare ||
+		      hooks->fsm_file_prepare_batch ||
+		      hooks->fsm_file_prepare_wait))
+	    return 1;
+    }
+    return 0;
+}
+
 rpmPlugins rpmpluginsNew(rpmts ts)
 {
     rpmPlugins plugins = xcalloc(1, sizeof(*plugins));
@@ -84,6 +176,10 @@ static rpmPlugin rpmPluginNew(const char *name, const char *path,
 	plugin->hooks = hooks;
 	if (opts)
 	    plugin->opts = xstrdup(opts);
+	plugin->warnusecs =
+		rpmExpandNumeric("%{?_plugin_warn_threshold}") * 1000;
+	if (_rpmts_stats || plugin->warnusecs)
+	    plugin->stats = xcalloc(HOOK_MAX, sizeof(*plugin->stats));
     }
     free(hooks_name);
 
@@ -99,11 +195,72 @@ static rpmPlugin rpmPluginFree(rpmPlugin plugin)
 	dlclose(plugin->handle);
 	free(plugin->name);
 	free(plugin->opts);
+	free(plugin->stats);
 	free(plugin);
     }
     return NULL;
 }
 
+void rpmpluginsFormatStats(rpmPlugins plugins, int format, char **buf)
+{
+    static const int nhooks = sizeof(hookNames) / sizeof(hookNames[0]);
+    int firstp = 1;
+
+    if (format == RPMTS_STATS_JSON)
+	rstrcat(buf, "{");
+
+    for (int i = 0; plugins && i < plugins->count; i++) {
+	rpmPlugin plugin = plugins->plugins[i];
+	int firsth = 1;
+
+	if (plugin->stats == NULL)
+	    continue;
+
+	for (int hx = 0; hx < HOOK_MAX && hx < nhooks; hx++) {
+	    struct hookStats_s *st = &plugin->stats[hx];
+	    char *s = NULL;
+
+	    if (st->count == 0)
+		continue;
+
+	    if (format == RPMTS_STATS_JSON) {
+		if (firsth) {
+		    rasprintf(&s, "%s\"%s\": {", firstp ? "" : ", ",
+			      plugin->name);
+		    rstrcat(buf, s);
+		    s = _free(s);
+		}
+		rasprintf(&s, "%s\"%s\": {\"count\": %u, \"usecs\": %" PRIu64
+			  ", \"p99_usecs\": %" PRIu64 "}",
+			  firsth ? "" : ", ", hookNames[hx],
+			  st->count, st->usecs, hookP99(st));
+	    } else {
+		if (firsth) {
+		    rasprintf(&s, "   plugin %s:\n", plugin->name);
+		    rstrcat(buf, s);
+		    s = _free(s);
+		}
+		rasprintf(&s, "      %s:%*s %6u %6" PRIu64 ".%06" PRIu64 " secs"
+			  " p99 %" PRIu64 " usecs\n",
+			  hookNames[hx], (int) (22 - strlen(hookNames[hx])), "",
+			  st->count, st->usecs / 1000000, st->usecs % 1000000,
+			  hookP99(st));
+	    }
+	    rstrcat(buf, s);
+	    free(s);
+	    firsth = 0;
+	}
+	if (!firsth) {
+	    if (format == RPMTS_STATS_JSON)
+		rstrcat(buf, "}");
+	    firstp = 0;
+	}
+    }
+
+    if (format == RPMTS_STATS_JSON)
+	rstrcat(buf, "}");
+}
+
 const char *rpmPluginName(rpmPlugin plugin)
 {
     return (plugin != NULL) ? plugin->name : NULL;
@@ -212,6 +369,15 @@ rpmPlugins rpmpluginsFree(rpmPlugins plugins)
 	if (hookFunc) { \
 	    rpmlog(RPMLOG_DEBUG, "Plugin: calling hook %s in %s plugin\n", \
 		   STR(hook), plugin->name); \
+	    rpmtraceBegin("plugin_" STR(hook), plugin->name); \
+	} \
+	uint64_t hookStart = (hookFunc && plugin->stats) ? hookClock() : 0
+
+#define RPMPLUGINS_HOOK_DONE(hook) \
+	if (hookFunc) { \
+	    rpmtraceEnd("plugin_" STR(hook), plugin->name); \
+	    if (hookStart) \
+		hookAccount(plugin, HOOK_INDEX(hook), hookStart); \
 	}
 
 static rpmRC rpmpluginsCallInit(rpmPlugin plugin, rpmts ts)
@@ -224,6 +390,7 @@ static rpmRC rpmpluginsCallInit(rpmPlugin plugin, rpmts ts)
         if (rc != RPMRC_OK && rc != RPMRC_NOTFOUND)
             rpmlog(RPMLOG_ERR, "Plugin %s: hook init failed\n", plugin->name);
     }
+    RPMPLUGINS_HOOK_DONE(init);
     return rc;
 }
 
@@ -240,6 +407,7 @@ rpmRC rpmpluginsCallTsmPre(rpmPlugins plugins, rpmts ts)
 	    rpmlog(RPMLOG_ERR, "Plugin %s: hook tsm_pre failed\n", plugin->name);
 	    rc = RPMRC_FAIL;
 	}
+	RPMPLUGINS_HOOK_DONE(tsm_pre);
     }
 
     return rc;
@@ -257,6 +425,7 @@ rpmRC rpmpluginsCallTsmPost(rpmPlugins plugins, rpmts ts, int res)
 	if (hookFunc && hookFunc(plugin, ts, res) == RPMRC_FAIL) {
 	    rpmlog(RPMLOG_WARNING, "Plugin %s: hook tsm_post failed\n", plugin->name);
 	}
+	RPMPLUGINS_HOOK_DONE(tsm_post);
     }
 
     return rc;
@@ -275,6 +444,7 @@ rpmRC rpmpluginsCallPsmPre(rpmPlugins plugins, rpmte te)
 	    rpmlog(RPMLOG_ERR, "Plugin %s: hook psm_pre failed\n", plugin->name);
 	    rc = RPMRC_FAIL;
 	}
+	RPMPLUGINS_HOOK_DONE(psm_pre);
     }
 
     return rc;
@@ -292,6 +462,7 @@ rpmRC rpmpluginsCallPsmPost(rpmPlugins plugins, rpmte te, int res)
 	if (hookFunc && hookFunc(plugin, te, res) == RPMRC_FAIL) {
 	    rpmlog(RPMLOG_WARNING, "Plugin %s: hook psm_post failed\n", plugin->name);
 	}
+	RPMPLUGINS_HOOK_DONE(psm_post);
     }
 
     return rc;
@@ -310,6 +481,7 @@ rpmRC rpmpluginsCallScriptletPre(rpmPlugins plugins, const char *s_name, int typ
 	    rpmlog(RPMLOG_ERR, "Plugin %s: hook scriplet_pre failed\n", plugin->name);
 	    rc = RPMRC_FAIL;
 	}
+	RPMPLUGINS_HOOK_DONE(scriptlet_pre);
     }
 
     return rc;
@@ -328,6 +500,7 @@ rpmRC rpmpluginsCallScriptletForkPost(rpmPlugins plugins, const char *path, int
 	    rpmlog(RPMLOG_ERR, "Plugin %s: hook scriplet_fork_post failed\n", plugin->name);
 	    rc = RPMRC_FAIL;
 	}
+	RPMPLUGINS_HOOK_DONE(scriptlet_fork_post);
     }
 
     return rc;
@@ -345,6 +518,7 @@ rpmRC rpmpluginsCallScriptletPost(rpmPlugins plugins, const char *s_name, int ty
 	if (hookFunc && hookFunc(plugin, s_name, type, res) == RPMRC_FAIL) {
 	    rpmlog(RPMLOG_WARNING, "Plugin %s: hook scriplet_post failed\n", plugin->name);
 	}
+	RPMPLUGINS_HOOK_DONE(scriptlet_post);
     }
 
     return rc;
@@ -373,6 +547,7 @@ rpmRC rpmpluginsCallFsmFilePre(rpmPlugins plugins, rpmfi fi, const char *path,
 	    rpmlog(RPMLOG_ERR, "Plugin %s: hook fsm_file_pre failed\n", plugin->name);
 	    rc = RPMRC_FAIL;
 	}
+	RPMPLUGINS_HOOK_DONE(fsm_file_pre);
     }
     free(apath);
 
@@ -393,6 +568,7 @@ rpmRC rpmpluginsCallFsmFilePost(rpmPlugins plugins, rpmfi fi, const char *path,
 	if (hookFunc && hookFunc(plugin, fi, apath, file_mode, op, res) == RPMRC_FAIL) {
 	    rpmlog(RPMLOG_WARNING, "Plugin %s: hook fsm_file_post failed\n", plugin->name);
 	}
+	RPMPLUGINS_HOOK_DONE(fsm_file_post);
     }
     free(apath);
 
@@ -415,8 +591,95 @@ rpmRC rpmpluginsCallFsmFilePrepare(rpmPlugins plugins, rpmfi fi,
 	    rpmlog(RPMLOG_ERR, "Plugin %s: hook fsm_file_prepare failed\n", plugin->name);
 	    rc = RPMRC_FAIL;
 	}
+	RPMPLUGINS_HOOK_DONE(fsm_file_prepare);
     }
     free(apath);
 
     return rc;
 }
+
+static rpmRC callFsmFilePrepareEach(rpmPlugin plugin, rpmfi fi, int nfiles,
+				    const int *fx, const int *fds,
+				    const char * const *apaths,
+				    const mode_t *modes, const rpmFsmOp *ops)
+{
+    plugin_fsm_file_prepare_func hookFunc;
+    rpmRC rc = RPMRC_OK;
+
+    RPMPLUGINS_SET_HOOK_FUNC(fsm_file_prepare);
+    for (int j = 0; hookFunc && j < nfiles; j++) {
+	rpmfiSetFX(fi, fx[j]);
+	if (hookFunc(plugin, fi, fds[j], apaths[j], rpmfiFN(fi),
+		     modes[j], ops[j]) == RPMRC_FAIL) {
+	    rpmlog(RPMLOG_ERR, "Plugin %s: hook fsm_file_prepare failed\n", plugin->name);
+	    rc = RPMRC_FAIL;
+	}
+    }
+    RPMPLUGINS_HOOK_DONE(fsm_file_prepare);
+
+    return rc;
+}
+
+rpmRC rpmpluginsCallFsmFilePrepareBatch(rpmPlugins plugins, rpmfi fi,
+					int nfiles, const int *fx,
+					const int *fds,
+					const char * const *paths,
+					const mode_t *modes,
+					const rpmFsmOp *ops)
+{
+    plugin_fsm_file_prepare_batch_func hookFunc;
+    rpmRC rc = RPMRC_OK;
+    char **apaths;
+    int i, j;
+
+    if (plugins->count == 0 || nfiles <= 0)
+	return rc;
+
+    /* Build the absolute paths once for all the plugins */
+    apaths = xmalloc(nfiles * sizeof(*apaths));
+    for (j = 0; j < nfiles; j++) {
+	rpmfiSetFX(fi, fx[j]);
+	apaths[j] = abspath(fi, paths[j]);
+    }
+
+    for (i = 0; i < plugins->count; i++) {
+	rpmPlugin plugin = plugins->plugins[i];
+	RPMPLUGINS_SET_HOOK_FUNC(fsm_file_prepare_batch);
+	if (hookFunc) {
+	    if (hookFunc(plugin, fi, nfiles, fx, fds,
+			 (const char * const *)apaths, modes, ops) == RPMRC_FAIL) {
+		rpmlog(RPMLOG_ERR, "Plugin %s: hook fsm_file_prepare_batch failed\n", plugin->name);
+		rc = RPMRC_FAIL;
+	    }
+	} else if (callFsmFilePrepareEach(plugin, fi, nfiles, fx, fds,
+				(const char * const *)apaths, modes, ops)) {
+	    rc = RPMRC_FAIL;
+	}
+	RPMPLUGINS_HOOK_DONE(fsm_file_prepare_batch);
+    }
+
+    for (j = 0; j < nfiles; j++)
+	free(apaths[j]);
+    free(apaths);
+
+    return rc;
+}
+
+rpmRC rpmpluginsCallFsmFilePrepareWait(rpmPlugins plugins)
+{
+    plugin_fsm_file_prepare_wait_func hookFunc;
+    int i;
+    rpmRC rc = RPMRC_OK;
+
+    for (i = 0; i < plugins->count; i++) {
+	rpmPlugin plugin = plugins->plugins[i];
+	RPMPLUGINS_SET_HOOK_FUNC(fsm_file_prepare_wait);
+	if (hookFunc && hookFunc(plugin) == RPMRC_FAIL) {
+	    rpmlog(RPMLOG_ERR, "Plugin %s: hook fsm_file_prepare_wait failed\n", plugin->name);
+	    rc = RPMRC_FAIL;
+	}
+	RPMPLUGINS_HOOK_DONE(fsm_file_prepare_wait);
+    }
+
+    return rc;
+}
@@ -55,6 +55,27 @@ rpmRC rpmpluginsAddPlugin(rpmPlugins plugins, const char *type, const char *name
 RPM_GNUC_INTERNAL
 int rpmpluginsPluginAdded(rpmPlugins plugins, const char *name);
 
+/** \ingroup rpmplugins
+ * Determine if any plugin hooks into unpacking packages, ie. has a
+ * psm_pre or any of the fsm_file hooks
+ * @param plugins	plugins structure
+ * @return		1 if such a hook exists, 0 otherwise
+ */
+RPM_GNUC_INTERNAL
+int rpmpluginsHaveFileHooks(rpmPlugins plugins);
+
+/** \ingroup rpmplugins
+ * Append the per plugin hook call statistics, collected when transaction
+ * statistics or %_plugin_warn_threshold are enabled, to a buffer.
+ * The JSON format is an object of plugins, with an object of hooks each,
+ * with count, usecs and p99_usecs of the calls.
+ * @param plugins	plugins structure (or NULL)
+ * @param format	RPMTS_STATS_TEXT or RPMTS_STATS_JSON
+ * @param buf		buffer to append to
+ */
+RPM_GNUC_INTERNAL
+void rpmpluginsFormatStats(rpmPlugins plugins, int format, char **buf);
+
 /** \ingroup rpmplugins
  * Call the pre transaction plugin hook
  * @param plugins	plugins structure
@@ -168,6 +189,39 @@ rpmRC rpmpluginsCallFsmFilePrepare(rpmPlugins plugins, rpmfi fi,
                                    int fd, const char *path, const char *dest,
                                    mode_t mode, rpmFsmOp op);
 
+/** \ingroup rpmplugins
+ * Call the fsm file prepare plugin hook for a batch of files. Plugins
+ * implementing fsm_file_prepare_batch get the whole batch in one call,
+ * others get fsm_file_prepare called for each file in turn. The position
+ * of fi is undefined on return.
+ * @param plugins	plugins structure
+ * @param fi		file info iterator
+ * @param nfiles	number of files in the batch
+ * @param fx		file indexes in fi
+ * @param fds		file descriptors (or -1 if not available)
+ * @param paths		file object current paths
+ * @param modes		file object modes
+ * @param ops		file operations + associated flags
+ * @return		RPMRC_OK on success, RPMRC_FAIL otherwise
+ */
+RPM_GNUC_INTERNAL
+rpmRC rpmpluginsCallFsmFilePrepareBatch(rpmPlugins plugins, rpmfi fi,
+                                        int nfiles, const int *fx,
+                                        const int *fds,
+                                        const char * const *paths,
+                                        const mode_t *modes,
+                                        const rpmFsmOp *ops);
+
+/** \ingroup rpmplugins
+ * Call the fsm file prepare wait plugin hook. Called once all the files
+ * of a package have been prepared, before any of them is committed to
+ * its destination path.
+ * @param plugins	plugins structure
+ * @return		RPMRC_OK on success, RPMRC_FAIL otherwise
+ */
+RPM_GNUC_INTERNAL
+rpmRC rpmpluginsCallFsmFilePrepareWait(rpmPlugins plugins);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,26 @@
+#ifndef RPMPROBES_H
+#define RPMPROBES_H
+
+/** \file lib/rpmprobes.h
+ * Static (USDT) probes for systemtap, bpftrace and friends.
+ *
+ * Probes are in the "rpm" provider and compile to a single nop when
+ * built WITH_SDT, and to nothing otherwise. Arguments are evaluated
+ * unconditionally, so only pass values that are already at hand.
+ */
+
+#ifdef WITH_SDT
+#include <sys/sdt.h>
+
+#define RPM_PROBE(name) DTRACE_PROBE(rpm, name)
+#define RPM_PROBE1(name, a1) DTRACE_PROBE1(rpm, name, a1)
+#define RPM_PROBE2(name, a1, a2) DTRACE_PROBE2(rpm, name, a1, a2)
+#define RPM_PROBE3(name, a1, a2, a3) DTRACE_PROBE3(rpm, name, a1, a2, a3)
+#else
+#define RPM_PROBE(name)
+#define RPM_PROBE1(name, a1)
+#define RPM_PROBE2(name, a1, a2)
+#define RPM_PROBE3(name, a1, a2, a3)
+#endif
+
+#endif /* RPMPROBES_H */
@@ -6,16 +6,39 @@
 
 #include <inttypes.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <rpm/rpmstring.h>
+#include <rpm/rpmstrpool.h>
 #include <rpm/rpmps.h>
 
 #include "debug.h"
 
+/*
+ * Problems are stored as compact entries with their strings in a pool,
+ * as a failed transaction can have a very large number of them with the
+ * same package names over and over. The rpmProblem objects are only
+ * created when iterated over, and then kept until the set is freed
+ * as the iterator returns weak references. Duplicates are dropped on
+ * insert through an open addressing hash of the entries.
+ */
+struct psEntry_s {
+    rpmProblemType type;
+    rpmsid pkgNEVR;
+    rpmsid altNEVR;
+    rpmsid str1;
+    fnpyKey key;
+    uint64_t num1;
+};
+
 struct rpmps_s {
     int numProblems;		/*!< Current probs array size. */
     int numProblemsAlloced;	/*!< Allocated probs array size. */
-    rpmProblem *probs;		/*!< Array of pointers to specific problems. */
+    struct psEntry_s *entries;	/*!< Array of problems. */
+    rpmProblem *probs;		/*!< Problem objects made of entries (or NULL). */
+    rpmstrPool pool;		/*!< Problem strings. */
+    unsigned int *slots;	/*!< Entry index + 1 by hash, 0 if free. */
+    unsigned int numSlots;	/*!< Power of two. */
     int nrefs;			/*!< Reference count. */
 };
 
@@ -44,11 +67,26 @@ rpmps rpmpsLink(rpmps ps)
 int rpmpsNumProblems(rpmps ps)
 {
     int numProblems = 0;
-    if (ps && ps->probs)
+    if (ps)
 	numProblems = ps->numProblems;
     return numProblems;
 }
 
+/* Return the problem object of an entry, making it on first use */
+static rpmProblem psGetProblem(rpmps ps, int ix)
+{
+    if (ps->probs == NULL)
+	ps->probs = xcalloc(ps->numProblemsAlloced, sizeof(*ps->probs));
+    if (ps->probs[ix] == NULL) {
+	const struct psEntry_s *e = &ps->entries[ix];
+	ps->probs[ix] = rpmProblemCreate(e->type,
+				rpmstrPoolStr(ps->pool, e->pkgNEVR), e->key,
+				rpmstrPoolStr(ps->pool, e->altNEVR),
+				rpmstrPoolStr(ps->pool, e->str1), e->num1);
+    }
+    return ps->probs[ix];
+}
+
 rpmpsi rpmpsInitIterator(rpmps ps)
 {
     rpmpsi psi = NULL;
@@ -75,7 +113,7 @@ rpmProblem rpmpsiNext(rpmpsi psi)
     if (psi != NULL && psi->ps != NULL && ++psi->ix >= 0) {
 	rpmps ps = psi->ps;
 	if (psi->ix < ps->numProblems) {
-	    p = ps->probs[psi->ix];
+	    p = psGetProblem(ps, psi->ix);
 	} else {
 	    psi->ix = -1;
 	}
@@ -92,7 +130,7 @@ rpmProblem rpmpsGetProblem(rpmpsi psi)
 {
     rpmProblem p = NULL;
     if (psi != NULL && psi->ix >= 0 && psi->ix < rpmpsNumProblems(psi->ps)) {
-	p = psi->ps->probs[psi->ix];
+	p = psGetProblem(psi->ps, psi->ix);
     } 
     return p;
 }
@@ -100,6 +138,7 @@ rpmProblem rpmpsGetProblem(rpmpsi psi)
 rpmps rpmpsCreate(void)
 {
     rpmps ps = xcalloc(1, sizeof(*ps));
+    ps->pool = rpmstrPoolCreate();
     return rpmpsLink(ps);
 }
 
@@ -111,62 +150,142 @@ rpmps rpmpsFree(rpmps ps)
     }
 	
     if (ps->probs) {
-	rpmpsi psi = rpmpsInitIterator(ps);
-	while (rpmpsNextIterator(psi) >= 0) {
-	    rpmProblemFree(rpmpsGetProblem(psi));	
-	}
-	rpmpsFreeIterator(psi);
-	ps->probs = _free(ps->probs);
+	for (int i = 0; i < ps->numProblems; i++)
+	    rpmProblemFree(ps->probs[i]);
+	free(ps->probs);
     }
+    free(ps->entries);
+    free(ps->slots);
+    rpmstrPoolFree(ps->pool);
     ps = _free(ps);
     return NULL;
 }
 
-void rpmpsAppendProblem(rpmps ps, rpmProblem prob)
+static unsigned int entryHash(const struct psEntry_s *e)
 {
-    if (ps == NULL || prob == NULL) return;
+    uint64_t h = e->type;
+    h = h * 31 + e->pkgNEVR;
+    h = h * 31 + e->altNEVR;
+    h = h * 31 + e->str1;
+    h = h * 31 + (uintptr_t) e->key;
+    h = h * 31 + e->num1;
+    return (h ^ (h >> 32)) * 2654435761U;
+}
+
+/* The strings are pooled, equal ids are equal strings */
+static int entryEqual(const struct psEntry_s *a, const struct psEntry_s *b)
+{
+    return (a->type == b->type && a->pkgNEVR == b->pkgNEVR &&
+	    a->altNEVR == b->altNEVR && a->str1 == b->str1 &&
+	    a->key == b->key && a->num1 == b->num1);
+}
+
+static void psRehash(rpmps ps)
+{
+    unsigned int mask;
+
+    free(ps->slots);
+    ps->numSlots = ps->numSlots ? ps->numSlots * 2 : 16;
+    ps->slots = xcalloc(ps->numSlots, sizeof(*ps->slots));
+    mask = ps->numSlots - 1;
+    for (int i = 0; i < ps->numProblems; i++) {
+	unsigned int h = entryHash(&ps->entries[i]) & mask;
+	while (ps->slots[h])
+	    h = (h + 1) & mask;
+	ps->slots[h] = i + 1;
+    }
+}
+
+/* Add an entry unless it's already there */
+static void psAddEntry(rpmps ps, const struct psEntry_s *e)
+{
+    unsigned int mask, h;
+
+    if ((ps->numProblems + 1) * 4 > ps->numSlots * 3)
+	psRehash(ps);
+
+    mask = ps->numSlots - 1;
+    for (h = entryHash(e) & mask; ps->slots[h]; h = (h + 1) & mask) {
+	if (entryEqual(&ps->entries[ps->slots[h] - 1], e))
+	    return;
+    }
 
     if (ps->numProblems == ps->numProblemsAlloced) {
 	if (ps->numProblemsAlloced)
 	    ps->numProblemsAlloced *= 2;
 	else
 	    ps->numProblemsAlloced = 2;
-	ps->probs = xrealloc(ps->probs,
-			ps->numProblemsAlloced * sizeof(*ps->probs));
+	ps->entries = xrealloc(ps->entries,
+			ps->numProblemsAlloced * sizeof(*ps->entries));
+	if (ps->probs) {
+	    ps->probs = xrealloc(ps->probs,
+			    ps->numProblemsAlloced * sizeof(*ps->probs));
+	    memset(ps->probs + ps->numProblems, 0,
+		   (ps->numProblemsAlloced - ps->numProblems) *
+		   sizeof(*ps->probs));
+	}
     }
 
-    ps->probs[ps->numProblems] = rpmProblemLink(prob);
+    ps->entries[ps->numProblems] = *e;
+    ps->slots[h] = ps->numProblems + 1;
     ps->numProblems++;
 }
 
-/*
- * TODO: filter out duplicates while merging. Also horribly inefficient... */
+void rpmpsAppendProblem(rpmps ps, rpmProblem prob)
+{
+    struct psEntry_s e;
+
+    if (ps == NULL || prob == NULL) return;
+
+    e.type = rpmProblemGetType(prob);
+    e.pkgNEVR = rpmstrPoolId(ps->pool, rpmProblemGetPkgNEVR(prob), 1);
+    e.altNEVR = rpmstrPoolId(ps->pool, rpmProblemGetAltNEVR(prob), 1);
+    e.str1 = rpmstrPoolId(ps->pool, rpmProblemGetStr(prob), 1);
+    e.key = rpmProblemGetKey(prob);
+    e.num1 = rpmProblemGetDiskNeed(prob);
+    psAddEntry(ps, &e);
+}
+
 int rpmpsMerge(rpmps dest, rpmps src)
 {
     int rc = 0;
-    if (dest != NULL) {
-	rpmProblem p;
-	rpmpsi spi = rpmpsInitIterator(src);
-	while ((p = rpmpsiNext(spi)) != NULL) {
-	    rpmpsAppendProblem(dest, p);
-	    rc++;
+    if (dest != NULL && src != NULL) {
+	int before = dest->numProblems;
+	for (int i = 0; i < src->numProblems; i++) {
+	    const struct psEntry_s *se = &src->entries[i];
+	    struct psEntry_s e = *se;
+	    e.pkgNEVR = rpmstrPoolId(dest->pool,
+			    rpmstrPoolStr(src->pool, se->pkgNEVR), 1);
+	    e.altNEVR = rpmstrPoolId(dest->pool,
+			    rpmstrPoolStr(src->pool, se->altNEVR), 1);
+	    e.str1 = rpmstrPoolId(dest->pool,
+			    rpmstrPoolStr(src->pool, se->str1), 1);
+	    psAddEntry(dest, &e);
 	}
-	rpmpsFreeIterator(spi);
+	rc = dest->numProblems - before;
     }
     return rc;
 }
 
+/* Format problems one at a time, without keeping the objects around */
 void rpmpsPrint(FILE *fp, rpmps ps)
 {
-    rpmProblem p;
-    rpmpsi psi = rpmpsInitIterator(ps);
     FILE *f = (fp != NULL) ? fp : stderr;
 
-    while ((p = rpmpsiNext(psi))) {
-	char *msg = rpmProblemString(p);
+    for (int i = 0; i < rpmpsNumProblems(ps); i++) {
+	rpmProblem p = ps->probs ? rpmProblemLink(ps->probs[i]) : NULL;
+	char *msg;
+
+	if (p == NULL) {
+	    const struct psEntry_s *e = &ps->entries[i];
+	    p = rpmProblemCreate(e->type,
+				 rpmstrPoolStr(ps->pool, e->pkgNEVR), e->key,
+				 rpmstrPoolStr(ps->pool, e->altNEVR),
+				 rpmstrPoolStr(ps->pool, e->str1), e->num1);
+	}
+	msg = rpmProblemString(p);
 	fprintf(f, "\t%s\n", msg);
 	free(msg);
+	rpmProblemFree(p);
     }
-    rpmpsFreeIterator(psi);
 }
-
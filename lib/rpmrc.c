@@ -117,6 +117,7 @@ typedef struct tableType_s {
 #define RPMVAR_ARCHCOLOR                42
 #define RPMVAR_INCLUDE                  43
 #define RPMVAR_MACROFILES               49
+#define RPMVAR_MACROSNAPSHOT            50
 
 #define RPMVAR_NUM                      55      /* number of RPMVAR entries */
 
@@ -127,6 +128,7 @@ static const struct rpmOption optionTable[] = {
     { "archcolor",		RPMVAR_ARCHCOLOR,               1, 0, 0 },
     { "include",		RPMVAR_INCLUDE,			0, 0, 2 },
     { "macrofiles",		RPMVAR_MACROFILES,		0, 0, 1 },
+    { "macrosnapshot",		RPMVAR_MACROSNAPSHOT,		0, 1, 1 },
     { "optflags",		RPMVAR_OPTFLAGS,		1, 1, 0 },
 };
 
@@ -2,10 +2,13 @@
 
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <lua.h>
 
+#include <rpm/rpmcrypto.h>
 #include <rpm/rpmfileutil.h>
 #include <rpm/rpmmacro.h>
 #include <rpm/rpmio.h>
@@ -18,6 +21,7 @@
 #include "rpmio/rpmio_internal.h"
 
 #include "lib/rpmplugins.h"     /* rpm plugins hooks */
+#include "lib/rpmprobes.h"
 
 #include "debug.h"
 
@@ -36,6 +40,7 @@ struct rpmScript_s {
     char *descr;		/* description for logging */
     rpmscriptFlags flags;	/* flags to control operation */
     struct scriptNextFileFunc_s *nextFileFunc;  /* input function */
+    char *coalesce;		/* digest if allowed to coalesce */
 };
 
 struct scriptInfo_s {
@@ -198,7 +203,7 @@ static rpmRC runLuaScript(rpmPlugins plugins, ARGV_const_t prefixes,
 static const char * const SCRIPT_PATH = "PATH=/sbin:/bin:/usr/sbin:/usr/bin:/usr/X11R6/bin";
 
 static void doScriptExec(ARGV_const_t argv, ARGV_const_t prefixes,
-			FD_t scriptFd, FD_t out)
+			FD_t scriptFd, FD_t out, int statusfd)
 {
     int xx;
     struct sigaction act;
@@ -231,6 +236,14 @@ static void doScriptExec(ARGV_const_t argv, ARGV_const_t prefixes,
 	    xx = Fclose (scriptFd);
     }
 
+    /* the scriptlet helper reports exit statuses on fd 3 */
+    if (statusfd >= 0) {
+	if (statusfd == 3)
+	    xx = fcntl(statusfd, F_SETFD, 0);
+	else
+	    xx = dup2(statusfd, 3);
+    }
+
     {   char *ipath = rpmExpand("%{_install_script_path}", NULL);
 	const char *path = SCRIPT_PATH;
 
@@ -290,6 +303,363 @@ exit:
     return fn;
 }
 
+static FD_t scriptOutFd(FD_t scriptFd)
+{
+    FD_t out = NULL;
+
+    if (scriptFd != NULL) {
+	if (rpmIsVerbose()) {
+	    out = fdDup(Fileno(scriptFd));
+	} else {
+	    out = Fopen("/dev/null", "w.fdio");
+	    if (Ferror(out)) {
+		out = fdDup(Fileno(scriptFd));
+	    }
+	}
+    } else {
+	out = fdDup(STDOUT_FILENO);
+    }
+    return out;
+}
+
+/*
+ * Persistent shell for running plain shell scriptlets without forking
+ * rpm for each one of them. The shell is started once, in the same way
+ * and in the same root as a forked scriptlet would be, and then reads one
+ * command per scriptlet from its stdin. Each scriptlet runs in a subshell
+ * of its own and the exit status is reported back on fd 3.
+ */
+struct scriptHelper_s {
+    pid_t pid;			/* the shell */
+    int cmdfd;			/* commands to the shell */
+    FILE *status;		/* exit statuses from the shell */
+    char *interp;		/* interpreter path */
+    dev_t rootdev;		/* root the shell runs in */
+    ino_t rootino;
+    FD_t scriptFd;		/* output the shell was started with */
+    int verbose;
+};
+
+static struct scriptHelper_s *scriptHelper = NULL;
+
+void rpmScriptHelperStop(void)
+{
+    struct scriptHelper_s *sh = scriptHelper;
+    pid_t reaped;
+    int status;
+
+    if (sh == NULL)
+	return;
+
+    /* EOF on its stdin makes the shell exit */
+    close(sh->cmdfd);
+    if (sh->status)
+	fclose(sh->status);
+    do {
+	reaped = waitpid(sh->pid, &status, 0);
+    } while (reaped == -1 && errno == EINTR);
+
+    rpmlog(RPMLOG_DEBUG, "scriptlet helper %s pid %d done\n",
+	   sh->interp, (unsigned)sh->pid);
+    free(sh->interp);
+    free(sh);
+    scriptHelper = NULL;
+}
+
+/*
+ * Return the digest of a scriptlet if it's on the allow-list the list
+ * macro expands to, NULL otherwise. The digest is a SHA-256 over each
+ * interpreter argument followed by a newline, then the (expanded) body.
+ */
+static char *scriptListed(rpmScript script, const char *list, const char *what)
+{
+    char *allowed = rpmExpand(list, NULL);
+    char *digest = NULL;
+    ARGV_t av = NULL;
+    int found = 0;
+
+    if (*allowed) {
+	DIGEST_CTX ctx = rpmDigestInit(RPM_HASH_SHA256, RPMDIGEST_NONE);
+	if (script->args) {
+	    for (char **arg = script->args; *arg; arg++) {
+		rpmDigestUpdate(ctx, *arg, strlen(*arg));
+		rpmDigestUpdate(ctx, "\n", 1);
+	    }
+	} else {
+	    rpmDigestUpdate(ctx, "/bin/sh\n", 8);
+	}
+	if (script->body)
+	    rpmDigestUpdate(ctx, script->body, strlen(script->body));
+	rpmDigestFinal(ctx, (void **)&digest, NULL, 1);
+
+	argvSplit(&av, allowed, " \t\n,");
+	for (ARGV_const_t d = av; d && *d; d++) {
+	    if (rstreq(*d, digest)) {
+		found = 1;
+		break;
+	    }
+	}
+	/* log the digest either way, it's what needs to be listed */
+	rpmlog(RPMLOG_DEBUG, "%s: %s %s %s\n", script->descr, what,
+	       found ? "yes" : "no", digest);
+	if (!found)
+	    digest = _free(digest);
+    }
+
+    argvFree(av);
+    free(allowed);
+    return digest;
+}
+
+/*
+ * Only scriptlets with a body and nothing to feed on stdin are eligible,
+ * and of those only the ones on the %_script_helper_scriptlets list: a
+ * scriptlet sourced by the helper sees the helper's $0 and environment.
+ */
+static int scriptHelperWanted(rpmScript script, ARGV_const_t args)
+{
+    char *interps = NULL;
+    char *digest = NULL;
+    ARGV_t iv = NULL;
+    int wanted = 0;
+
+    if (script->body == NULL || script->nextFileFunc != NULL ||
+	    argvCount(args) != 1)
+	return 0;
+    if (rpmExpandNumeric("%{?_script_helper}") <= 0)
+	return 0;
+
+    interps = rpmExpand("%{?_script_helper_interpreters}", NULL);
+    argvSplit(&iv, *interps ? interps : "/bin/sh", " \t");
+    for (ARGV_const_t i = iv; i && *i; i++) {
+	if (rstreq(*i, args[0])) {
+	    wanted = 1;
+	    break;
+	}
+    }
+    argvFree(iv);
+    free(interps);
+
+    if (wanted) {
+	digest = scriptListed(script, "%{?_script_helper_scriptlets}", "helper");
+	wanted = (digest != NULL);
+	free(digest);
+    }
+    return wanted;
+}
+
+static struct scriptHelper_s *scriptHelperGet(rpmPlugins plugins,
+					const char *interp, FD_t scriptFd)
+{
+    struct scriptHelper_s *sh = scriptHelper;
+    int verbose = rpmIsVerbose();
+    int cmdsock[2] = { -1, -1 };
+    int statpipe[2] = { -1, -1 };
+    FD_t out = NULL;
+    ARGV_t argv = NULL;
+    struct stat sb;
+    pid_t pid;
+
+    /* The root may be different each time when called from inside chroot */
+    if (stat("/", &sb))
+	return NULL;
+
+    if (sh && rstreq(sh->interp, interp) && sh->scriptFd == scriptFd &&
+	    sh->verbose == verbose &&
+	    sh->rootdev == sb.st_dev && sh->rootino == sb.st_ino)
+	return sh;
+
+    rpmScriptHelperStop();
+
+    /* A socket for the commands lets us write without risking SIGPIPE */
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, cmdsock) < 0 ||
+	    pipe(statpipe) < 0) {
+	rpmlog(RPMLOG_ERR, _("Couldn't create pipe: %s\n"), strerror(errno));
+	goto err;
+    }
+
+    if ((out = scriptOutFd(scriptFd)) == NULL) {
+	rpmlog(RPMLOG_ERR, _("Couldn't duplicate file descriptor: %s: %s\n"),
+	       interp, strerror(errno));
+	goto err;
+    }
+
+    argvAdd(&argv, interp);
+    pid = fork();
+    if (pid == (pid_t) -1) {
+	rpmlog(RPMLOG_ERR, _("Couldn't fork %s: %s\n"),
+		interp, strerror(errno));
+	goto err;
+    } else if (pid == 0) {/* Child */
+	close(cmdsock[1]);
+	close(statpipe[0]);
+	dup2(cmdsock[0], STDIN_FILENO);
+
+	/* Run scriptlet post fork hook for all plugins */
+	if (rpmpluginsCallScriptletForkPost(plugins, interp, RPMSCRIPTLET_FORK | RPMSCRIPTLET_EXEC) != RPMRC_FAIL) {
+	    doScriptExec(argv, NULL, scriptFd, out, statpipe[1]);
+	} else {
+	    _exit(126); /* exit 126 for compatibility with bash(1) */
+	}
+    }
+    close(cmdsock[0]);
+    close(statpipe[1]);
+    fcntl(cmdsock[1], F_SETFD, FD_CLOEXEC);
+    fcntl(statpipe[0], F_SETFD, FD_CLOEXEC);
+    Fclose(out);
+    argvFree(argv);
+
+    rpmlog(RPMLOG_DEBUG, "scriptlet helper %s pid %d started\n",
+	   interp, (unsigned)pid);
+
+    sh = xcalloc(1, sizeof(*sh));
+    sh->pid = pid;
+    sh->cmdfd = cmdsock[1];
+    sh->status = fdopen(statpipe[0], "r");
+    sh->interp = xstrdup(interp);
+    sh->rootdev = sb.st_dev;
+    sh->rootino = sb.st_ino;
+    sh->scriptFd = scriptFd;
+    sh->verbose = verbose;
+    scriptHelper = sh;
+    return sh;
+
+err:
+    for (int i = 0; i < 2; i++) {
+	if (cmdsock[i] >= 0)
+	    close(cmdsock[i]);
+	if (statpipe[i] >= 0)
+	    close(statpipe[i]);
+    }
+    if (out)
+	Fclose(out);
+    argvFree(argv);
+    return NULL;
+}
+
+static void shellQuote(char **buf, const char *s)
+{
+    char *q = xmalloc(4 * strlen(s) + 3);
+    char *t = q;
+
+    *t++ = '\'';
+    for (; *s; s++) {
+	if (*s == '\'') {
+	    t = stpcpy(t, "'\\''");
+	} else {
+	    *t++ = *s;
+	}
+    }
+    *t++ = '\'';
+    *t = '\0';
+    rstrcat(buf, q);
+    free(q);
+}
+
+/**
+ * Run an external shell script in the scriptlet helper.
+ */
+static rpmRC runHelperScript(struct scriptHelper_s *sh, ARGV_const_t prefixes,
+		   const char *sname, rpmlogLvl lvl,
+		   ARGV_t * argvp, const char *script, int arg1, int arg2)
+{
+    char *ipath = rpmExpand("%{_install_script_path}", NULL);
+    const char *path = SCRIPT_PATH + 5;
+    char *fn = NULL;
+    char *cmd = NULL;
+    char *num = NULL;
+    char line[32];
+    size_t len, off = 0;
+    int status;
+    rpmRC rc = RPMRC_FAIL;
+
+    rpmlog(RPMLOG_DEBUG, "%s: scriptlet start\n", sname);
+
+    fn = writeScript(*argvp[0], script);
+    if (fn == NULL) {
+	rpmlog(RPMLOG_ERR,
+	       _("Couldn't create temporary file for %s: %s\n"),
+	       sname, strerror(errno));
+	goto exit;
+    }
+
+    if (ipath && ipath[0] != '%')
+	path = ipath;
+
+    /* Same environment, directory and arguments as a forked scriptlet */
+    rstrcat(&cmd, "(export PATH=");
+    shellQuote(&cmd, path);
+    for (ARGV_const_t pf = prefixes; pf && *pf; pf++) {
+	int n = (pf - prefixes);
+
+	rasprintf(&num, "; export RPM_INSTALL_PREFIX%d=", n);
+	rstrcat(&cmd, num);
+	shellQuote(&cmd, *pf);
+	num = _free(num);
+
+	/* scripts might still be using the old style prefix */
+	if (n == 0) {
+	    rstrcat(&cmd, "; export RPM_INSTALL_PREFIX=");
+	    shellQuote(&cmd, *pf);
+	}
+    }
+    rstrcat(&cmd, "; cd / || exit 127; set --");
+    if (arg1 >= 0) {
+	rasprintf(&num, " %d", arg1);
+	rstrcat(&cmd, num);
+	num = _free(num);
+    }
+    if (arg2 >= 0) {
+	rasprintf(&num, " %d", arg2);
+	rstrcat(&cmd, num);
+	num = _free(num);
+    }
+    rstrcat(&cmd, "; . ");
+    shellQuote(&cmd, fn);
+    rstrcat(&cmd, ") </dev/null 3>&-; echo $? >&3\n");
+
+    rpmlog(RPMLOG_DEBUG, "%s: running in helper pid %d\n",
+	   sname, (unsigned)sh->pid);
+
+    len = strlen(cmd);
+    while (off < len) {
+	ssize_t nw = send(sh->cmdfd, cmd + off, len - off, MSG_NOSIGNAL);
+	if (nw < 0 && errno == EINTR)
+	    continue;
+	if (nw <= 0)
+	    break;
+	off += nw;
+    }
+
+    if (off < len || fgets(line, sizeof(line), sh->status) == NULL) {
+	rpmlog(lvl, _("%s scriptlet failed, helper %d exited\n"),
+	       sname, (unsigned)sh->pid);
+	rpmScriptHelperStop();
+	goto exit;
+    }
+
+    status = atoi(line);
+    rpmlog(RPMLOG_DEBUG, "%s: helper pid %d status %d\n",
+	   sname, (unsigned)sh->pid, status);
+
+    if (status) {
+	rpmlog(lvl, _("%s scriptlet failed, exit status %d\n"),
+	       sname, status);
+    } else {
+	rc = RPMRC_OK;
+    }
+
+exit:
+    if (fn) {
+	if (!rpmIsDebug())
+	    unlink(fn);
+	free(fn);
+    }
+    free(cmd);
+    free(ipath);
+    return rc;
+}
+
 /**
  * Run an external script.
  */
@@ -336,18 +706,7 @@ static rpmRC runExtScript(rpmPlugins plugins, ARGV_const_t prefixes,
     in = fdopen(inpipe[1], "w");
     inpipe[1] = 0;
 
-    if (scriptFd != NULL) {
-	if (rpmIsVerbose()) {
-	    out = fdDup(Fileno(scriptFd));
-	} else {
-	    out = Fopen("/dev/null", "w.fdio");
-	    if (Ferror(out)) {
-		out = fdDup(Fileno(scriptFd));
-	    }
-	}
-    } else {
-	out = fdDup(STDOUT_FILENO);
-    }
+    out = scriptOutFd(scriptFd);
     if (out == NULL) { 
 	rpmlog(RPMLOG_ERR, _("Couldn't duplicate file descriptor: %s: %s\n"),
 	       sname, strerror(errno));
@@ -368,7 +727,7 @@ static rpmRC runExtScript(rpmPlugins plugins, ARGV_const_t prefixes,
 
 	/* Run scriptlet post fork hook for all plugins */
 	if (rpmpluginsCallScriptletForkPost(plugins, *argvp[0], RPMSCRIPTLET_FORK | RPMSCRIPTLET_EXEC) != RPMRC_FAIL) {
-	    doScriptExec(*argvp, prefixes, scriptFd, out);
+	    doScriptExec(*argvp, prefixes, scriptFd, out, -1);
 	} else {
 	    _exit(126); /* exit 126 for compatibility with bash(1) */
 	}
@@ -466,14 +825,25 @@ rpmRC rpmScriptRun(rpmScript script, int arg1, int arg2, FD_t scriptFd,
     /* Run scriptlet pre hook for all plugins */
     rc = rpmpluginsCallScriptletPre(plugins, script->descr, script_type);
 
+    RPM_PROBE2(script_start, script->descr, args[0]);
     if (rc != RPMRC_FAIL) {
-	if (script_type & RPMSCRIPTLET_EXEC) {
+	struct scriptHelper_s *sh = NULL;
+	if ((script_type & RPMSCRIPTLET_EXEC) &&
+		scriptHelperWanted(script, args)) {
+	    sh = scriptHelperGet(plugins, args[0], scriptFd);
+	}
+
+	if (sh) {
+	    rc = runHelperScript(sh, prefixes, script->descr, lvl, &args, script->body, arg1, arg2);
+	} else if (script_type & RPMSCRIPTLET_EXEC) {
 	    rc = runExtScript(plugins, prefixes, script->descr, lvl, scriptFd, &args, script->body, arg1, arg2, script->nextFileFunc);
 	} else {
 	    rc = runLuaScript(plugins, prefixes, script->descr, lvl, scriptFd, &args, script->body, arg1, arg2, script->nextFileFunc);
 	}
     }
 
+    RPM_PROBE2(script_done, script->descr, rc);
+
     /* Run scriptlet post hook for all plugins */
     rpmpluginsCallScriptletPost(plugins, script->descr, script_type, rc);
 
@@ -535,6 +905,12 @@ static rpmScript rpmScriptNew(Header h, rpmTagVal tag, const char *body,
     return script;
 }
 
+/* Return the digest of a scriptlet allowed to coalesce, NULL otherwise */
+static char *scriptCoalesceKey(rpmScript script)
+{
+    return scriptListed(script, "%{?_script_coalesce}", "coalesce");
+}
+
 void rpmScriptSetNextFileFunc(rpmScript script, char *(*func)(void *),
 			    void *param)
 {
@@ -666,6 +1042,9 @@ rpmScript rpmScriptFromTag(Header h, rpmTagVal scriptTag)
 	if (headerGet(h, progTag, &prog, (HEADERGET_ALLOC|HEADERGET_ARGV))) {
 	    script->args = prog.data;
 	}
+
+	if (scriptTag == RPMTAG_POSTIN || scriptTag == RPMTAG_POSTUN)
+	    script->coalesce = scriptCoalesceKey(script);
     }
     return script;
 }
@@ -677,6 +1056,7 @@ rpmScript rpmScriptFree(rpmScript script)
 	free(script->body);
 	free(script->descr);
 	free(script->nextFileFunc);
+	free(script->coalesce);
 	free(script);
     }
     return NULL;
@@ -696,3 +1076,8 @@ rpmscriptFlags rpmScriptFlags(rpmScript script)
 {
     return (script != NULL) ? script->flags : 0;
 }
+
+const char *rpmScriptCoalesceKey(rpmScript script)
+{
+    return (script != NULL) ? script->coalesce : NULL;
+}
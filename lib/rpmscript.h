@@ -71,6 +71,14 @@ RPM_GNUC_INTERNAL
 rpmRC rpmScriptRun(rpmScript script, int arg1, int arg2, FD_t scriptFd,
                    ARGV_const_t prefixes, rpmPlugins plugins);
 
+/* Return the digest of a scriptlet allowed to coalesce, NULL otherwise */
+RPM_GNUC_INTERNAL
+const char *rpmScriptCoalesceKey(rpmScript script);
+
+/* Stop the persistent scriptlet helper shell, if one is running */
+RPM_GNUC_INTERNAL
+void rpmScriptHelperStop(void);
+
 RPM_GNUC_INTERNAL
 rpmTagVal rpmScriptTag(rpmScript script);
 
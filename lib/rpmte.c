@@ -4,6 +4,9 @@
  */
 #include "system.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <rpm/rpmtypes.h>
 #include <rpm/rpmlib.h>		/* RPM_MACHTABLE_* */
 #include <rpm/rpmmacro.h>
@@ -15,12 +18,14 @@
 #include <rpm/rpmlog.h>
 
 #include "lib/misc.h"
+#include "lib/payloadcache.h"
 #include "lib/rpmplugins.h"
 #include "lib/rpmte_internal.h"
 /* strpool-related interfaces */
 #include "lib/rpmfi_internal.h"
 #include "lib/rpmds_internal.h"
 #include "lib/rpmts_internal.h"
+#include "rpmio/rpmio_internal.h"	/* fdSetDictionary */
 
 #include "debug.h"
 
@@ -29,6 +34,7 @@
  */
 struct rpmte_s {
     rpmElementType type;	/*!< Package disposition (installed/removed). */
+    struct rpmop_s ops[RPMTS_OP_MAX];	/*!< Per-package operation stats */
     void *userdata;		/*!< Application private user data. */
 
     Header h;			/*!< Package header. */
@@ -70,22 +76,46 @@ struct rpmte_s {
     int nrelocs;		/*!< (TR_ADDED) No. of relocations. */
     uint8_t *badrelocs;		/*!< (TR_ADDED) Bad relocations (or NULL) */
     FD_t fd;			/*!< (TR_ADDED) Payload file descriptor. */
+    struct prefetch_s *prefetch; /*!< (TR_ADDED) Payload decompressor. */
+    int ahead;			/*!< (TR_ADDED) Opened/unpacked ahead */
+    int aheadrc;		/*!< (TR_ADDED) fsm result of unpack ahead */
+    int aheaderrno;
+    char *aheadfile;		/*!< (TR_ADDED) failed file of unpack ahead */
+    int orderafter;		/*!< Last element in order this depends on */
+    struct orderRel_s *orderrels; /*!< Ordering relations found last time */
+    int norderrels;		/*!< No. of relations, -1 if not looked up */
     int verified;		/*!< (TR_ADDED) Verification status */
+    int depchecked;		/*!< Dependencies checked, problems in probs */
     int addop;			/*!< (TR_ADDED) RPMTE_INSTALL/UPDATE/REINSTALL */
 
 #define RPMTE_HAVE_PRETRANS	(1 << 0)
 #define RPMTE_HAVE_POSTTRANS	(1 << 1)
 #define RPMTE_HAVE_PREUNTRANS	(1 << 2)
 #define RPMTE_HAVE_POSTUNTRANS	(1 << 3)
+#define RPMTE_HAVE_INSTSCRIPTS	(1 << 4)
     int transscripts;		/*!< pre/posttrans script existence */
     int failed;			/*!< (parent) install/erase failed */
 
     rpmfs fs;
 };
 
+/*
+ * Payload prefetch: a thread decompresses the payload into a pipe from the
+ * moment the package is opened, so that the archive is being read while
+ * the scriptlets and other preparations before unpacking run.
+ */
+struct prefetch_s {
+    pthread_t thread;
+    FD_t payload;		/*!< Decompressing reader */
+    int rfd;			/*!< Read end of the pipe */
+    int wfd;			/*!< Write end of the pipe */
+    const char *nevra;
+};
+
 /* forward declarations */
 static void rpmteColorDS(rpmte te, rpmTag tag);
 static int rpmteClose(rpmte te, int reset_fi);
+static FD_t openPayload(rpmte te);
 
 void rpmteCleanDS(rpmte te)
 {
@@ -215,6 +245,17 @@ static int addTE(rpmte p, Header h, fnpyKey key, rpmRelocation * relocs)
     p->transscripts |= (headerIsEntry(h, RPMTAG_POSTUNTRANS) ||
 			 headerIsEntry(h, RPMTAG_POSTUNTRANSPROG)) ?
 			RPMTE_HAVE_POSTUNTRANS : 0;
+    /* Anything else run around unpacking an install */
+    p->transscripts |= (headerIsEntry(h, RPMTAG_PREIN) ||
+			 headerIsEntry(h, RPMTAG_PREINPROG) ||
+			 headerIsEntry(h, RPMTAG_POSTIN) ||
+			 headerIsEntry(h, RPMTAG_POSTINPROG) ||
+			 headerIsEntry(h, RPMTAG_TRIGGERNAME) ||
+			 headerIsEntry(h, RPMTAG_FILETRIGGERNAME) ||
+			 headerIsEntry(h, RPMTAG_TRANSFILETRIGGERNAME)) ?
+			RPMTE_HAVE_INSTSCRIPTS : 0;
+    p->orderafter = INT_MAX;
+    p->norderrels = -1;
 
     rpmteColorDS(p, RPMTAG_PROVIDENAME);
     rpmteColorDS(p, RPMTAG_REQUIRENAME);
@@ -228,6 +269,15 @@ exit:
     return rc;
 }
 
+rpmop rpmteOp(rpmte te, rpmtsOpX opx)
+{
+    rpmop op = NULL;
+
+    if (te != NULL && opx >= 0 && opx < RPMTS_OP_MAX)
+	op = te->ops + opx;
+    return op;
+}
+
 rpmte rpmteFree(rpmte te)
 {
     if (te != NULL) {
@@ -250,6 +300,8 @@ rpmte rpmteFree(rpmte te)
 	free(te->NEVRA);
 
 	fdFree(te->fd);
+	free(te->aheadfile);
+	free(te->orderrels);
 	rpmfilesFree(te->files);
 	headerFree(te->h);
 	rpmfsFree(te->fs);
@@ -584,6 +636,92 @@ static Header rpmteFDHeader(rpmte te)
     return h;
 }
 
+static void *prefetchThread(void *arg)
+{
+    struct prefetch_s *pf = arg;
+    size_t bufsize = 128 * 1024;
+    char *buf = xmalloc(bufsize);
+    ssize_t nr;
+
+    while ((nr = Fread(buf, 1, bufsize, pf->payload)) > 0) {
+	char *b = buf;
+	while (nr > 0) {
+	    ssize_t nw = write(pf->wfd, b, nr);
+	    if (nw < 0 && errno == EINTR)
+		continue;
+	    /* EPIPE when the package was closed without unpacking */
+	    if (nw <= 0)
+		goto exit;
+	    b += nw;
+	    nr -= nw;
+	}
+    }
+    /* A short stream is also caught when unpacking, this just tells why */
+    if (nr < 0 || Ferror(pf->payload)) {
+	rpmlog(RPMLOG_ERR, _("%s: payload read failed: %s\n"),
+	       pf->nevra, Fstrerror(pf->payload));
+    }
+
+exit:
+    close(pf->wfd);
+    free(buf);
+    return NULL;
+}
+
+static void prefetchStart(rpmte te)
+{
+    int size = rpmExpandNumeric("%{?_payload_prefetch}");
+    struct prefetch_s *pf;
+    int pipefd[2];
+
+    /* Cached payloads don't need decompressing */
+    if (size <= 0 || te->ts->payloadcache >= 0)
+	return;
+
+    pf = xcalloc(1, sizeof(*pf));
+    pf->nevra = te->NEVRA;
+    if ((pf->payload = openPayload(te)) == NULL || pipe(pipefd) < 0)
+	goto err;
+    pf->rfd = pipefd[0];
+    pf->wfd = pipefd[1];
+    fcntl(pf->rfd, F_SETFD, FD_CLOEXEC);
+    fcntl(pf->wfd, F_SETFD, FD_CLOEXEC);
+#ifdef F_SETPIPE_SZ
+    /* The pipe is the buffer, the kernel may round this or cap it */
+    (void) fcntl(pf->wfd, F_SETPIPE_SZ, size);
+#endif
+
+    if (pthread_create(&pf->thread, NULL, prefetchThread, pf)) {
+	close(pf->rfd);
+	close(pf->wfd);
+	goto err;
+    }
+    rpmlog(RPMLOG_DEBUG, "%s: prefetching payload\n", te->NEVRA);
+    te->prefetch = pf;
+    return;
+
+err:
+    /* Not fatal, the payload is just read when unpacking */
+    if (pf->payload)
+	Fclose(pf->payload);
+    free(pf);
+}
+
+static void prefetchStop(rpmte te)
+{
+    struct prefetch_s *pf = te->prefetch;
+
+    if (pf == NULL)
+	return;
+
+    /* Closing the read end stops the decompressor if it's not done yet */
+    close(pf->rfd);
+    pthread_join(pf->thread, NULL);
+    Fclose(pf->payload);
+    free(pf);
+    te->prefetch = NULL;
+}
+
 static int rpmteOpen(rpmte te, int reload_fi)
 {
     int rc = 0; /* assume failure */
@@ -591,6 +729,14 @@ static int rpmteOpen(rpmte te, int reload_fi)
     if (te == NULL || te->ts == NULL || rpmteFailed(te))
 	goto exit;
 
+    /* Already opened by rpmteOpenAhead() */
+    if (te->ahead) {
+	rc = 1;
+	goto exit;
+    }
+
+    /* Headers aren't kept between steps, account for the reloads */
+    (void) rpmswEnter(rpmtsOp(te->ts, RPMTS_OP_HDRLOAD), 0);
     switch (rpmteType(te)) {
     case TR_ADDED:
 	h = rpmteDBInstance(te) ? rpmteDBHeader(te) : rpmteFDHeader(te);
@@ -605,6 +751,8 @@ static int rpmteOpen(rpmte te, int reload_fi)
 	h = rpmteDBHeader(te);
     	break;
     }
+    (void) rpmswExit(rpmtsOp(te->ts, RPMTS_OP_HDRLOAD),
+		     h ? headerSizeof(h, HEADER_MAGIC_NO) : 0);
 
     if (h != NULL) {
 	if (reload_fi) {
@@ -617,6 +765,10 @@ static int rpmteOpen(rpmte te, int reload_fi)
 	
 	rpmteSetHeader(te, h);
 	headerFree(h);
+
+	/* Only when actually going to unpack the payload */
+	if (rc && reload_fi && te->type == TR_ADDED && te->fd)
+	    prefetchStart(te);
     }
 
 exit:
@@ -631,7 +783,15 @@ static int rpmteClose(rpmte te, int reset_fi)
 
     switch (te->type) {
     case TR_ADDED:
-	if (te->fd) {
+	prefetchStop(te);
+	if (te->ahead) {
+	    /* The callback closed its end already */
+	    if (te->fd)
+		Fclose(te->fd);
+	    te->fd = NULL;
+	    te->ahead = 0;
+	    te->aheadfile = _free(te->aheadfile);
+	} else if (te->fd) {
 	    rpmtsNotify(te->ts, te, RPMCALLBACK_INST_CLOSE_FILE, 0, 0);
 	    te->fd = NULL;
 	}
@@ -652,18 +812,151 @@ static int rpmteClose(rpmte te, int reset_fi)
     return 1;
 }
 
-FD_t rpmtePayload(rpmte te)
+int rpmteCanUnpackAhead(rpmte te)
+{
+    return (te != NULL && te->type == TR_ADDED && !te->failed &&
+	    te->db_instance == 0 &&
+	    !(te->transscripts & RPMTE_HAVE_INSTSCRIPTS));
+}
+
+int rpmteOpenAhead(rpmte te)
+{
+    FD_t fd;
+
+    if (te->ahead)
+	return 1;
+    if (!rpmteOpen(te, 1))
+	return 0;
+
+    /*
+     * Keep reading through a descriptor of our own and let the callback
+     * close the package right away, callers only expect one open at a time.
+     */
+    if ((fd = fdDup(Fileno(te->fd))) == NULL) {
+	rpmteClose(te, 1);
+	return 0;
+    }
+    rpmtsNotify(te->ts, te, RPMCALLBACK_INST_CLOSE_FILE, 0, 0);
+    te->fd = fd;
+    te->ahead = 1;
+    return 1;
+}
+
+void rpmteSetUnpacked(rpmte te, int fsmrc, char *failedFile, int err)
+{
+    te->ahead = 2;
+    te->aheadrc = fsmrc;
+    te->aheaderrno = err;
+    free(te->aheadfile);
+    te->aheadfile = failedFile;
+}
+
+int rpmteUnpacked(rpmte te, char **failedFile, int *err)
+{
+    if (te == NULL || te->ahead != 2)
+	return -1;
+    *failedFile = te->aheadfile;
+    *err = te->aheaderrno;
+    te->aheadfile = NULL;
+    return te->aheadrc;
+}
+
+void rpmteSetOrderAfter(rpmte te, int ix)
+{
+    te->orderafter = ix;
+}
+
+int rpmteOrderAfter(rpmte te)
+{
+    return (te != NULL) ? te->orderafter : INT_MAX;
+}
+
+void rpmteSetOrderRels(rpmte te, struct orderRel_s *rels, int nrels)
+{
+    if (te->orderrels != rels)
+	free(te->orderrels);
+    te->orderrels = rels;
+    te->norderrels = nrels;
+}
+
+int rpmteOrderRels(rpmte te, struct orderRel_s **rels)
+{
+    if (rels)
+	*rels = te->orderrels;
+    return te->norderrels;
+}
+
+static int payloadIsPlain(int fdno)
+{
+    char magic[6];
+    off_t pos = lseek(fdno, 0, SEEK_CUR);
+    return (pos >= 0 && pread(fdno, magic, sizeof(magic), pos) == sizeof(magic)
+	    && memcmp(magic, "07070", 5) == 0);
+}
+
+static FD_t openPayload(rpmte te)
 {
     FD_t payload = NULL;
     if (te->fd && te->h) {
 	const char *compr = headerGetString(te->h, RPMTAG_PAYLOADCOMPRESSOR);
+	/* Packages without compressor are gzip, unless built with w.ufdio */
+	if (compr == NULL && payloadIsPlain(Fileno(te->fd)))
+	    compr = "ufdio";
 	char *ioflags = rstrscat(NULL, "r.", compr ? compr : "gzip", NULL);
 	payload = Fdopen(fdDup(Fileno(te->fd)), ioflags);
 	free(ioflags);
+
+	struct rpmtd_s dict;
+	if (payload && headerGet(te->h, RPMTAG_PAYLOADDICT, &dict,
+				 HEADERGET_MINMEM)) {
+	    if (fdSetDictionary(payload, dict.data, dict.count)) {
+		rpmlog(RPMLOG_ERR, _("%s: unable to use payload dictionary\n"),
+		       rpmteNEVRA(te));
+		Fclose(payload);
+		payload = NULL;
+	    }
+	    rpmtdFreeData(&dict);
+	}
     }
     return payload;
 }
 
+/* Read the payload from the cache instead of decompressing it again */
+static FD_t cachedPayload(rpmte te)
+{
+    int dirfd = te->ts ? te->ts->payloadcache : -1;
+    const char *digest;
+    FD_t payload = NULL;
+    off_t off;
+
+    if (dirfd < 0 || te->h == NULL || te->fd == NULL)
+	return NULL;
+    digest = headerGetString(te->h, RPMTAG_PAYLOADDIGEST);
+    if ((payload = payloadCacheGet(dirfd, digest)) != NULL || digest == NULL)
+	return payload;
+
+    /* Filling the cache must not cost the payload if it fails */
+    if ((off = lseek(Fileno(te->fd), 0, SEEK_CUR)) < 0)
+	return NULL;
+    payload = payloadCachePut(dirfd, digest, openPayload(te));
+    if (payload == NULL)
+	(void) lseek(Fileno(te->fd), off, SEEK_SET);
+    return payload;
+}
+
+FD_t rpmtePayload(rpmte te)
+{
+    FD_t payload;
+
+    /* A prefetched payload comes already decompressed through the pipe */
+    if (te->prefetch) {
+	return Fdopen(fdDup(te->prefetch->rfd), "r.ufdio");
+    }
+    if ((payload = cachedPayload(te)) != NULL)
+	return payload;
+    return openPayload(te);
+}
+
 static int rpmteMarkFailed(rpmte te)
 {
     te->failed++;
@@ -715,29 +1008,26 @@ void rpmteCleanProblems(rpmte te)
     if (te != NULL && te->probs != NULL) {
 	te->probs = rpmpsFree(te->probs);
     }
+    /* Dependency problems need to be recalculated */
+    if (te != NULL)
+	te->depchecked = 0;
 }
 
 static void appendProblem(rpmte te, rpmProblemType type,
 		fnpyKey key, const char * altNEVR,
 		const char * str, uint64_t number)
 {
-    rpmProblem o;
     rpmProblem p = rpmProblemCreate(type, te->NEVRA, key, altNEVR, str, number);
-    rpmpsi psi = rpmpsInitIterator(te->probs);
+    int nprobs;
 
-    /* Only add new, unique problems to the set */
-    while ((o = rpmpsiNext(psi))) {
-	if (rpmProblemCompare(p, o) == 0)
-	    break;
-    }
-    rpmpsFreeIterator(psi);
+    if (te->probs == NULL)
+	te->probs = rpmpsCreate();
 
-    if (o == NULL) {
-	if (te->probs == NULL)
-	    te->probs = rpmpsCreate();
-	rpmpsAppendProblem(te->probs, p);
+    /* The set only takes new, unique problems */
+    nprobs = rpmpsNumProblems(te->probs);
+    rpmpsAppendProblem(te->probs, p);
+    if (rpmpsNumProblems(te->probs) > nprobs)
 	rpmteMarkFailed(te);
-    }
     rpmProblemFree(p);
 }
 
@@ -806,6 +1096,16 @@ int rpmteVerified(rpmte te)
     return (te != NULL) ? te->verified : 0;
 }
 
+void rpmteSetDepChecked(rpmte te, int checked)
+{
+    te->depchecked = checked;
+}
+
+int rpmteDepChecked(rpmte te)
+{
+    return (te != NULL) ? te->depchecked : 0;
+}
+
 int rpmteAddOp(rpmte te)
 {
     return te->addop;
@@ -831,6 +1131,8 @@ int rpmteProcess(rpmte te, pkgGoal goal, int num)
 
 	failed = rpmpsmRun(te->ts, te, goal);
 	rpmteClose(te, reset_fi);
+    } else if (te->ahead) {
+	rpmteClose(te, reset_fi);
     }
     
     if (failed) {
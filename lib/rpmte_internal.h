@@ -2,6 +2,7 @@
 #define _RPMTE_INTERNAL_H
 
 #include <rpm/rpmte.h>
+#include <rpm/rpmts.h>
 #include <rpm/rpmds.h>
 #include <rpm/rpmtag.h>
 #include "lib/rpmfs.h"
@@ -72,6 +73,39 @@ FD_t rpmtePayload(rpmte te);
 RPM_GNUC_INTERNAL
 int rpmteProcess(rpmte te, pkgGoal goal, int num);
 
+/* Can the element be unpacked ahead of its turn, concurrently with others */
+RPM_GNUC_INTERNAL
+int rpmteCanUnpackAhead(rpmte te);
+
+/* Open the element for unpacking ahead, rpmteProcess() then reuses it */
+RPM_GNUC_INTERNAL
+int rpmteOpenAhead(rpmte te);
+
+/* Record the result of unpacking ahead, takes ownership of failedFile */
+RPM_GNUC_INTERNAL
+void rpmteSetUnpacked(rpmte te, int fsmrc, char *failedFile, int err);
+
+/* Return -1 if not unpacked ahead, otherwise the fsm result */
+RPM_GNUC_INTERNAL
+int rpmteUnpacked(rpmte te, char **failedFile, int *err);
+
+/* Order index of the last element this one has to be processed after */
+RPM_GNUC_INTERNAL
+void rpmteSetOrderAfter(rpmte te, int ix);
+
+RPM_GNUC_INTERNAL
+int rpmteOrderAfter(rpmte te);
+
+/* Relations found for the element when ordering, kept for the next time */
+struct orderRel_s;
+
+RPM_GNUC_INTERNAL
+void rpmteSetOrderRels(rpmte te, struct orderRel_s *rels, int nrels);
+
+/* Return the number of relations, -1 if they're not known */
+RPM_GNUC_INTERNAL
+int rpmteOrderRels(rpmte te, struct orderRel_s **rels);
+
 RPM_GNUC_INTERNAL
 void rpmteAddProblem(rpmte te, rpmProblemType type,
                      const char *altNEVR, const char *str, uint64_t number);
@@ -101,6 +135,13 @@ rpmfs rpmteGetFileStates(rpmte te);
 RPM_GNUC_INTERNAL
 void rpmteSetVerified(rpmte te, int verified);
 
+RPM_GNUC_INTERNAL
+void rpmteSetDepChecked(rpmte te, int checked);
+
+/* Have the dependency problems of the element been calculated? */
+RPM_GNUC_INTERNAL
+int rpmteDepChecked(rpmte te);
+
 /** \ingroup rpmte
  * Retrieve size in bytes of package header.
  * @param te		transaction element
@@ -119,9 +160,23 @@ unsigned int rpmteHeaderSize(rpmte te);
 RPM_GNUC_INTERNAL
 rpmRC rpmpsmRun(rpmts ts, rpmte te, pkgGoal goal);
 
+/* Unpack the files of an element opened with rpmteOpenAhead(), for
+ * rpmpsmRun() to pick up later. Safe to call from a worker thread. */
+RPM_GNUC_INTERNAL
+void rpmpsmUnpackAhead(rpmts ts, rpmte te);
+
 RPM_GNUC_INTERNAL
 int rpmteAddOp(rpmte te);
 
+/** \ingroup rpmte
+ * Retrieve operation statistics of a transaction element.
+ * @param te		transaction element
+ * @param opx		operation statistics index
+ * @return		pointer to operation statistics
+ */
+RPM_GNUC_INTERNAL
+rpmop rpmteOp(rpmte te, rpmtsOpX opx);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,134 @@
+#include "system.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include <rpm/rpmlog.h>
+#include <rpm/rpmmacro.h>
+
+#include "lib/rpmtrace.h"
+
+#include "debug.h"
+
+/*
+ * Events are written as they happen, one JSON object per line, so the
+ * file can be loaded in chrome://tracing or ui.perfetto.dev. Tracing is
+ * off unless a file is configured, the only cost then is a load of
+ * the file pointer per event.
+ */
+static pthread_mutex_t traceLock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *tracefile = NULL;
+static int tracerefs = 0;
+static int nevents = 0;
+
+static int64_t traceNow(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static long traceTid(void)
+{
+#ifdef SYS_gettid
+    return syscall(SYS_gettid);
+#else
+    return getpid();
+#endif
+}
+
+static void traceString(FILE *f, const char *s)
+{
+    fputc('"', f);
+    for (; *s; s++) {
+	unsigned char c = *s;
+	if (c == '"' || c == '\\')
+	    fprintf(f, "\\%c", c);
+	else if (c < 0x20)
+	    fprintf(f, "\\u%04x", c);
+	else
+	    fputc(c, f);
+    }
+    fputc('"', f);
+}
+
+static void traceEvent(const char *name, const char *arg, char ph)
+{
+    FILE *f = __atomic_load_n(&tracefile, __ATOMIC_ACQUIRE);
+    int64_t now;
+
+    if (f == NULL)
+	return;
+
+    now = traceNow();
+    pthread_mutex_lock(&traceLock);
+    if (tracefile) {
+	fprintf(f, "%s{\"name\":", nevents++ ? ",\n" : "");
+	traceString(f, name);
+	fprintf(f, ",\"cat\":\"rpm\",\"ph\":\"%c\",\"ts\":%" PRId64
+		   ",\"pid\":%d,\"tid\":%ld",
+		ph, now, (int) getpid(), traceTid());
+	if (arg) {
+	    fprintf(f, ",\"args\":{\"detail\":");
+	    traceString(f, arg);
+	    fputc('}', f);
+	}
+	fputc('}', f);
+	/* scriptlets fork, don't leave buffered events to the child */
+	fflush(f);
+    }
+    pthread_mutex_unlock(&traceLock);
+}
+
+void rpmtraceOpen(void)
+{
+    pthread_mutex_lock(&traceLock);
+    if (tracerefs++ == 0) {
+	char *fn = rpmExpand("%{?_trace_file}", NULL);
+	if (*fn == '\0' && getenv("RPM_TRACE_FILE")) {
+	    free(fn);
+	    fn = xstrdup(getenv("RPM_TRACE_FILE"));
+	}
+	if (*fn) {
+	    FILE *f = fopen(fn, "we");
+	    if (f) {
+		fprintf(f, "[\n");
+		nevents = 0;
+		__atomic_store_n(&tracefile, f, __ATOMIC_RELEASE);
+	    } else {
+		rpmlog(RPMLOG_WARNING, _("cannot open trace file %s: %s\n"),
+			fn, strerror(errno));
+	    }
+	}
+	free(fn);
+    }
+    pthread_mutex_unlock(&traceLock);
+}
+
+void rpmtraceClose(void)
+{
+    pthread_mutex_lock(&traceLock);
+    if (tracerefs > 0 && --tracerefs == 0 && tracefile) {
+	FILE *f = tracefile;
+	__atomic_store_n(&tracefile, NULL, __ATOMIC_RELEASE);
+	fprintf(f, "\n]\n");
+	fclose(f);
+    }
+    pthread_mutex_unlock(&traceLock);
+}
+
+void rpmtraceBegin(const char *name, const char *arg)
+{
+    traceEvent(name, arg, 'B');
+}
+
+void rpmtraceEnd(const char *name, const char *arg)
+{
+    traceEvent(name, arg, 'E');
+}
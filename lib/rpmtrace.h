@@ -0,0 +1,47 @@
+#ifndef RPMTRACE_H
+#define RPMTRACE_H
+
+/** \file lib/rpmtrace.h
+ * Timeline of transaction phases in Chrome trace event format.
+ */
+
+#include <rpm/rpmutil.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Start tracing if %_trace_file or $RPM_TRACE_FILE names an output file.
+ * Nested calls are reference counted, only the outermost one opens.
+ */
+RPM_GNUC_INTERNAL
+void rpmtraceOpen(void);
+
+/**
+ * Stop tracing, finishing the trace file on the outermost call.
+ */
+RPM_GNUC_INTERNAL
+void rpmtraceClose(void);
+
+/**
+ * Record the beginning of an event on the calling thread.
+ * @param name		event name
+ * @param arg		optional event detail (package NEVRA, plugin name)
+ */
+RPM_GNUC_INTERNAL
+void rpmtraceBegin(const char *name, const char *arg);
+
+/**
+ * Record the end of an event started with rpmtraceBegin().
+ * @param name		event name
+ * @param arg		optional event detail
+ */
+RPM_GNUC_INTERNAL
+void rpmtraceEnd(const char *name, const char *arg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* RPMTRACE_H */
@@ -4,6 +4,7 @@
 #include <rpm/rpmdb.h>
 #include <rpm/rpmds.h>
 #include <rpm/rpmfi.h>
+#include <rpm/rpmstring.h>
 #include <stdlib.h>
 
 #include "lib/rpmtriggers.h"
@@ -13,6 +14,7 @@
 #include "lib/rpmfi_internal.h"
 #include "lib/rpmte_internal.h"
 #include "lib/rpmchroot.h"
+#include "lib/trigindex.h"
 
 #define TRIGGER_PRIORITY_BOUND 10000
 
@@ -102,7 +104,8 @@ static void addTriggers(rpmts ts, Header trigH, rpmsenseFlags filter,
 {
     int tix = 0;
     rpmds ds;
-    rpmds triggers = rpmdsNew(trigH, RPMTAG_TRANSFILETRIGGERNAME, 0);
+    rpmds triggers = rpmdsNewPool(rpmdbHeaderPool(rpmtsGetRdb(ts), trigH),
+				  trigH, RPMTAG_TRANSFILETRIGGERNAME, 0);
 
     while ((ds = rpmdsFilterTi(triggers, tix))) {
 	if ((rpmdsNext(ds) >= 0) && (rpmdsFlags(ds) & filter) &&
@@ -122,15 +125,70 @@ static void addTriggers(rpmts ts, Header trigH, rpmsenseFlags filter,
     rpmdsFree(triggers);
 }
 
+/* Does any installed file of te start with pfx? */
+static int matchInstalledFiles(rpmfiles files, const char *pfx)
+{
+    rpmfi fi = rpmfilesFindPrefix(files, pfx);
+    int rc = 0;
+
+    while (rpmfiNext(fi) >= 0) {
+	if (RPMFILE_IS_INSTALLED(rpmfiFState(fi))) {
+	    rc = 1;
+	    break;
+	}
+    }
+    rpmfiFree(fi);
+    return rc;
+}
+
+/*
+ * Same as addTriggers() over the packages, from the trigger index: the
+ * triggers whose first prefix matches are saved, without the headers.
+ */
+static void prepPostUnFromIndex(rpmts ts, rpmfiles files, trigIndex ti)
+{
+    const struct trigIndexItem_s *items;
+    unsigned int nitems = trigIndexLookup(ti, RPMSCRIPT_TRANSFILETRIGGER,
+					  NULL, &items);
+    unsigned int i = 0;
+
+    while (i < nitems) {
+	const char *pfx = trigIndexKey(ti, &items[i]);
+	unsigned int n = 1;
+
+	while (i + n < nitems && rstreq(trigIndexKey(ti, &items[i + n]), pfx))
+	    n++;
+
+	if (matchInstalledFiles(files, pfx)) {
+	    for (unsigned int j = i; j < i + n; j++) {
+		const struct trigIndexItem_s *item = &items[j];
+		if (item->nth == 0 && (item->sense & RPMSENSE_TRIGGERPOSTUN) &&
+			!(item->flags & TRIGINDEX_NOPRIORITY)) {
+		    rpmtriggersAdd(ts->trigs2run, item->hdrNum,
+				   item->tix, item->priority);
+		}
+	    }
+	}
+	i += n;
+    }
+}
+
 void rpmtriggersPrepPostUnTransFileTrigs(rpmts ts, rpmte te)
 {
     rpmdbIndexIterator ii;
     const void *key;
     size_t keylen;
     rpmfiles files;
+    trigIndex ti = rpmdbTriggerIndex(rpmtsGetRdb(ts));
 
-    ii = rpmdbIndexIteratorInit(rpmtsGetRdb(ts), RPMDBI_TRANSFILETRIGGERNAME);
     files = rpmteFiles(te);
+    if (ti) {
+	prepPostUnFromIndex(ts, files, ti);
+	rpmfilesFree(files);
+	return;
+    }
+
+    ii = rpmdbIndexIteratorInit(rpmtsGetRdb(ts), RPMDBI_TRANSFILETRIGGERNAME);
 
     /* Iterate over file triggers in rpmdb */
     while ((rpmdbIndexIteratorNext(ii, &key, &keylen)) == 0) {
@@ -138,21 +196,16 @@ void rpmtriggersPrepPostUnTransFileTrigs(rpmts ts, rpmte te)
 	memcpy(pfx, key, keylen);
 	pfx[keylen] = '\0';
 	/* Check if file trigger matches any installed file in this te */
-	rpmfi fi = rpmfilesFindPrefix(files, pfx);
-	while (rpmfiNext(fi) >= 0) {
-	    if (RPMFILE_IS_INSTALLED(rpmfiFState(fi))) {
-		unsigned int npkg = rpmdbIndexIteratorNumPkgs(ii);
-		const unsigned int *offs = rpmdbIndexIteratorPkgOffsets(ii);
-		/* Save any postun triggers matching this prefix */
-		for (int i = 0; i < npkg; i++) {
-		    Header h = rpmdbGetHeaderAt(rpmtsGetRdb(ts), offs[i]);
-		    addTriggers(ts, h, RPMSENSE_TRIGGERPOSTUN, pfx);
-		    headerFree(h);
-		}
-		break;
+	if (matchInstalledFiles(files, pfx)) {
+	    unsigned int npkg = rpmdbIndexIteratorNumPkgs(ii);
+	    const unsigned int *offs = rpmdbIndexIteratorPkgOffsets(ii);
+	    /* Save any postun triggers matching this prefix */
+	    for (int i = 0; i < npkg; i++) {
+		Header h = rpmdbGetHeaderAt(rpmtsGetRdb(ts), offs[i]);
+		addTriggers(ts, h, RPMSENSE_TRIGGERPOSTUN, pfx);
+		headerFree(h);
 	    }
 	}
-	rpmfiFree(fi);
     }
     rpmdbIndexIteratorFree(ii);
     rpmfilesFree(files);
@@ -168,7 +221,8 @@ int runPostUnTransFileTrigs(rpmts ts)
     int nerrors = 0;
 
     rpmtriggersSortAndUniq(trigs);
-    /* Iterate over stored triggers */
+    /* Iterate over stored triggers, all in one chroot */
+    rpmChrootHold();
     for (i = 0; i < trigs->count; i++) {
 	/* Get header containing trigger script */
 	trigH = rpmdbGetHeaderAt(rpmtsGetRdb(ts),
@@ -191,6 +245,8 @@ int runPostUnTransFileTrigs(rpmts ts)
 	rpmScriptFree(script);
 	headerFree(trigH);
     }
+    if (rpmChrootRelease())
+	nerrors++;
 
     return nerrors;
 }
@@ -389,7 +445,8 @@ static int runHandleTriggersInPkg(rpmts ts, rpmte te, Header h,
     struct rpmtd_s installPrefixes;
     char *(*inputFunc)(void *);
 
-    rpmdsTriggers = rpmdsNew(h, triggerDsTag(tm), 0);
+    rpmdsTriggers = rpmdsNewPool(rpmdbHeaderPool(rpmtsGetRdb(ts), h), h,
+				 triggerDsTag(tm), 0);
     rpmdsTrigger = rpmdsFilterTi(rpmdsTriggers, ti);
     /*
      * Now rpmdsTrigger contains all dependencies belonging to one trigger
@@ -447,9 +504,92 @@ static int runHandleTriggersInPkg(rpmts ts, rpmte te, Header h,
     return nerrors;
 }
 
+/*
+ * Sorted directory names of all packages installed or removed in the
+ * transaction. Transaction file triggers are matched against this with a
+ * binary search instead of doing an rpmdb prefix lookup per trigger.
+ */
+struct tranDirs_s {
+    rpmfiles *files;		/*!< File sets the names point into */
+    int nfiles;
+    const char **dirs;		/*!< Sorted, unique directory names */
+    int ndirs;
+};
+
+static int dirCmp(const void *a, const void *b)
+{
+    return strcmp(*(const char * const *)a, *(const char * const *)b);
+}
+
+static void tranDirsInit(struct tranDirs_s *td, rpmts ts, rpmsenseFlags sense)
+{
+    packageHash pkgs = (sense & RPMSENSE_TRIGGERIN) ?
+			ts->members->installedPackages :
+			ts->members->removedPackages;
+    rpmstrPool pool = ts->members->pool;
+    int nelem = rpmtsNElements(ts);
+    int dalloced = 0;
+    rpmtsi pi;
+    rpmte p;
+
+    memset(td, 0, sizeof(*td));
+    td->files = xcalloc(nelem ? nelem : 1, sizeof(*td->files));
+
+    pi = rpmtsiInit(ts);
+    while ((p = rpmtsiNext(pi, 0)) != NULL) {
+	unsigned int offset = rpmteDBInstance(p);
+	rpmfiles files;
+
+	if (offset == 0 || !packageHashHasEntry(pkgs, offset))
+	    continue;
+
+	/* Files may have been released already, fall back to rpmdb */
+	files = rpmteFiles(p);
+	if (files == NULL) {
+	    Header h = rpmdbGetHeaderAt(rpmtsGetRdb(ts), offset);
+	    if (h) {
+		files = rpmfilesNew(pool, h, RPMTAG_BASENAMES,
+				    RPMFI_FLAGS_FILETRIGGER);
+		headerFree(h);
+	    }
+	}
+	if (files == NULL)
+	    continue;
+
+	td->files[td->nfiles++] = files;
+	for (int dx = 0; dx < rpmfilesDC(files); dx++) {
+	    if (td->ndirs == dalloced) {
+		dalloced = dalloced ? dalloced * 2 : 64;
+		td->dirs = xrealloc(td->dirs, dalloced * sizeof(*td->dirs));
+	    }
+	    td->dirs[td->ndirs++] = rpmfilesDN(files, dx);
+	}
+    }
+    rpmtsiFree(pi);
+
+    if (td->ndirs > 1) {
+	int to = 1;
+	qsort(td->dirs, td->ndirs, sizeof(*td->dirs), dirCmp);
+	for (int from = 1; from < td->ndirs; from++) {
+	    if (strcmp(td->dirs[to - 1], td->dirs[from]))
+		td->dirs[to++] = td->dirs[from];
+	}
+	td->ndirs = to;
+    }
+}
+
+static void tranDirsFini(struct tranDirs_s *td)
+{
+    for (int i = 0; i < td->nfiles; i++)
+	rpmfilesFree(td->files[i]);
+    free(td->files);
+    free(td->dirs);
+    memset(td, 0, sizeof(*td));
+}
+
 /* Return true if any file in package (te) starts with pfx */
-static int matchFilesInPkg(rpmts ts, rpmte te, const char *pfx,
-			    rpmsenseFlags sense)
+static int matchFilesInPkg(rpmts ts, rpmte te, const struct tranDirs_s *td,
+			    const char *pfx)
 {
     int rc;
     rpmfiles files = rpmteFiles(te);
@@ -461,27 +601,63 @@ static int matchFilesInPkg(rpmts ts, rpmte te, const char *pfx,
     return rc;
 }
 
-/* Return number of added/removed files starting with pfx in transaction */
-static int matchFilesInTran(rpmts ts, rpmte te, const char *pfx,
-			    rpmsenseFlags sense)
+/* Return true if any added/removed directory in transaction starts with pfx */
+static int matchFilesInTran(rpmts ts, rpmte te, const struct tranDirs_s *td,
+			    const char *pfx)
 {
-    int rc = 1;
-    rpmdbMatchIterator pi;
+    size_t plen = strlen(pfx);
+    int l = 0, u = td->ndirs;
+
+    /* Find the first directory not sorting before pfx */
+    while (l < u) {
+	int c = (l + u) / 2;
+	if (strcmp(td->dirs[c], pfx) < 0)
+	    l = c + 1;
+	else
+	    u = c;
+    }
+
+    return (l < td->ndirs && strncmp(td->dirs[l], pfx, plen) == 0);
+}
 
-    /* Get all files from rpmdb starting with pfx */
-    pi = rpmdbInitPrefixIterator(rpmtsGetRdb(ts), RPMDBI_DIRNAMES, pfx, 0);
+/*
+ * Collect the file triggers fired by te or ts from the trigger index,
+ * which has the priorities so the headers aren't needed until the
+ * triggers run.
+ */
+static void collectFromIndex(rpmts ts, rpmte te, const struct tranDirs_s *td,
+		trigIndex ti, rpmscriptTriggerModes tm,
+		int (*matchFunc)(rpmts, rpmte, const struct tranDirs_s *,
+				 const char *),
+		rpmtriggers triggers)
+{
+    const struct trigIndexItem_s *items;
+    unsigned int nitems = trigIndexLookup(ti, tm, NULL, &items);
+    unsigned int i = 0;
 
-    if (sense & RPMSENSE_TRIGGERIN)
-	/* Leave in pi only files installed in ts */
-	rpmdbFilterIterator(pi, ts->members->installedPackages, 0);
-    else
-	/* Leave in pi only files removed in ts */
-	rpmdbFilterIterator(pi, ts->members->removedPackages, 0);
+    while (i < nitems) {
+	const char *pfx = trigIndexKey(ti, &items[i]);
+	unsigned int n = 1;
 
-    rc = rpmdbGetIteratorCount(pi);
-    rpmdbFreeIterator(pi);
+	while (i + n < nitems && rstreq(trigIndexKey(ti, &items[i + n]), pfx))
+	    n++;
 
-    return rc;
+	if (matchFunc(ts, te, td, pfx)) {
+	    for (unsigned int j = i; j < i + n; j++) {
+		unsigned int offset = items[j].hdrNum;
+
+		/* See runFileTriggers() */
+		if (tm == RPMSCRIPT_TRANSFILETRIGGER &&
+		    (packageHashHasEntry(ts->members->removedPackages, offset) ||
+		    packageHashHasEntry(ts->members->installedPackages, offset)))
+		    continue;
+
+		rpmtriggersAdd(triggers, offset, items[j].tix,
+			       items[j].priority);
+	    }
+	}
+	i += n;
+    }
 }
 
 rpmRC runFileTriggers(rpmts ts, rpmte te, rpmsenseFlags sense,
@@ -493,9 +669,11 @@ rpmRC runFileTriggers(rpmts ts, rpmte te, rpmsenseFlags sense,
     char *pfx;
     size_t keylen;
     Header trigH;
-    int (*matchFunc)(rpmts, rpmte, const char*, rpmsenseFlags sense);
+    int (*matchFunc)(rpmts, rpmte, const struct tranDirs_s *, const char*);
     rpmTagVal priorityTag;
     rpmtriggers triggers = rpmtriggersCreate(10);
+    struct tranDirs_s td = { NULL, 0, NULL, 0 };
+    trigIndex ti;
 
     /* Decide if we match triggers against files in te or in whole ts */
     if (tm == RPMSCRIPT_FILETRIGGER) {
@@ -504,6 +682,13 @@ rpmRC runFileTriggers(rpmts ts, rpmte te, rpmsenseFlags sense,
     } else {
 	matchFunc = matchFilesInTran;
 	priorityTag = RPMTAG_TRANSFILETRIGGERPRIORITIES;
+	tranDirsInit(&td, ts, sense);
+    }
+
+    ti = rpmdbTriggerIndex(rpmtsGetRdb(ts));
+    if (ti) {
+	collectFromIndex(ts, te, &td, ti, tm, matchFunc, triggers);
+	goto run;
     }
 
     ii = rpmdbIndexIteratorInit(rpmtsGetRdb(ts), triggerDsTag(tm));
@@ -515,7 +700,7 @@ rpmRC runFileTriggers(rpmts ts, rpmte te, rpmsenseFlags sense,
 	pfx[keylen] = '\0';
 
 	/* Check if file trigger is fired by any file in ts/te */
-	if (matchFunc(ts, te, pfx, sense)) {
+	if (matchFunc(ts, te, &td, pfx)) {
 	    for (i = 0; i < rpmdbIndexIteratorNumPkgs(ii); i++) {
 		struct rpmtd_s priorities;
 		unsigned int priority = 0;
@@ -550,10 +735,14 @@ rpmRC runFileTriggers(rpmts ts, rpmte te, rpmsenseFlags sense,
     }
     rpmdbIndexIteratorFree(ii);
 
+run:
+    tranDirsFini(&td);
+
     /* Sort triggers by priority, offset, trigger index */
     rpmtriggersSortAndUniq(triggers);
 
-    /* Handle stored triggers */
+    /* Handle stored triggers, all in one chroot */
+    rpmChrootHold();
     for (i = 0; i < triggers->count; i++) {
 	if (priorityClass == 1) {
 	    if (triggers->triggerInfo[i].priority < TRIGGER_PRIORITY_BOUND)
@@ -572,6 +761,8 @@ rpmRC runFileTriggers(rpmts ts, rpmte te, rpmsenseFlags sense,
 						triggers->triggerInfo[i].tix);
 	headerFree(trigH);
     }
+    if (rpmChrootRelease())
+	nerrors++;
     rpmtriggersFree(triggers);
 
     return (nerrors == 0) ? RPMRC_OK : RPMRC_FAIL;
@@ -8,6 +8,8 @@
 #include <libgen.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 
 #include <rpm/rpmtypes.h>
 #include <rpm/rpmlib.h>			/* rpmReadPackage etc */
@@ -83,6 +85,10 @@ int rpmtsCloseDB(rpmts ts)
 			rpmdbOp(ts->rdb, RPMDB_OP_DBPUT));
 	(void) rpmswAdd(rpmtsOp(ts, RPMTS_OP_DBDEL),
 			rpmdbOp(ts->rdb, RPMDB_OP_DBDEL));
+	(void) rpmswAdd(rpmtsOp(ts, RPMTS_OP_HDRHIT),
+			rpmdbOp(ts->rdb, RPMDB_OP_HDRHIT));
+	(void) rpmswAdd(rpmtsOp(ts, RPMTS_OP_HDRMISS),
+			rpmdbOp(ts->rdb, RPMDB_OP_HDRMISS));
 	rc = rpmdbClose(ts->rdb);
 	ts->rdb = NULL;
     }
@@ -173,6 +179,18 @@ int rpmtsVerifyDB(rpmts ts)
     return rc;
 }
 
+int rpmtsCompactDB(rpmts ts)
+{
+    int rc = -1;
+    rpmtxn txn = rpmtxnBegin(ts, RPMTXN_WRITE);
+    if (txn) {
+	if (rpmtsOpenDB(ts, O_RDWR) == 0)
+	    rc = rpmdbCtrl(ts->rdb, RPMDB_CTRL_COMPACT);
+	rpmtxnEnd(txn);
+    }
+    return rc;
+}
+
 /* keyp might no be defined. */
 rpmdbMatchIterator rpmtsInitIterator(const rpmts ts, rpmDbiTagVal rpmtag,
 			const void * keyp, size_t keylen)
@@ -251,6 +269,35 @@ exit:
     return mi;
 }
 
+int rpmtsInitFileIterators(const rpmts ts, rpmDbiTagVal rpmtag,
+			   const char ** paths, int npaths,
+			   rpmdbMatchIterator * mis)
+{
+    int rc;
+
+    for (int i = 0; i < npaths; i++)
+	mis[i] = NULL;
+
+    if (ts == NULL)
+	return -1;
+
+    if (ts->rdb == NULL && rpmtsOpenDB(ts, ts->dbmode))
+	return -1;
+
+    if (ts->keyring == NULL)
+	loadKeyring(ts);
+
+    rc = rpmdbInitFileIterators(ts->rdb, rpmtag, paths, npaths, mis);
+
+    /* Verify header signature/digest during retrieve (if not disabled). */
+    for (int i = 0; rc == 0 && i < npaths; i++) {
+	if (mis[i] && !(ts->vsflags & RPMVSF_NOHDRCHK))
+	    (void) rpmdbSetHdrChk(mis[i], ts, headerCheck);
+    }
+
+    return rc;
+}
+
 rpmKeyring rpmtsGetKeyring(rpmts ts, int autoload)
 {
     rpmKeyring keyring = NULL;
@@ -322,14 +369,212 @@ exit:
     return nkeys;
 }
 
+/* Add a key and its subkeys to the keyring, return number of keys added */
+static int keyringAddPkt(rpmKeyring keyring, const uint8_t *pkt, size_t pktlen,
+			 const char *origin)
+{
+    rpmPubkey key = rpmPubkeyNew(pkt, pktlen);
+    int subkeysCount, i;
+    rpmPubkey *subkeys = rpmGetSubkeys(key, &subkeysCount);
+    int nkeys = 0;
+
+    if (rpmKeyringAddKey(keyring, key) == 0) {
+	rpmlog(RPMLOG_DEBUG, "added key %s to keyring\n", origin);
+	nkeys++;
+    }
+    rpmPubkeyFree(key);
+
+    for (i = 0; i < subkeysCount; i++) {
+	rpmPubkey subkey = subkeys[i];
+
+	if (rpmKeyringAddKey(keyring, subkey) == 0) {
+	    rpmlog(RPMLOG_DEBUG,
+		"added subkey %d of main key %s to keyring\n",
+		i, origin);
+	    nkeys++;
+	}
+	rpmPubkeyFree(subkey);
+    }
+    free(subkeys);
+    return nkeys;
+}
+
+/*
+ * Persistent copy of the decoded key packets of the gpg-pubkey headers,
+ * stored next to the rpmdb. It's only trusted while the rpmdb cookie
+ * matches (header numbers are never reused, so any key change changes
+ * the cookie) and nobody but root or the current user can write to it.
+ * Layout (host byte order): magic, version, cookie length, cookie, then
+ * (NVR length, NVR, packet length, packet) records.
+ */
+#define KEYRING_CACHE_MAGIC	"rpmkeyc"
+#define KEYRING_CACHE_VERSION	1
+
+struct keyringCache_s {
+    char *path;			/*!< cache file, NULL if disabled */
+    char *cookie;		/*!< rpmdb cookie */
+    unsigned char *buf;		/*!< cache contents being built */
+    size_t buflen;
+    size_t bufalloced;
+};
+
+static void keyringCacheBufAdd(struct keyringCache_s *c,
+				const void *data, uint32_t len)
+{
+    if (c->buflen + sizeof(len) + len > c->bufalloced) {
+	c->bufalloced = (c->buflen + sizeof(len) + len) * 2;
+	c->buf = xrealloc(c->buf, c->bufalloced);
+    }
+    memcpy(c->buf + c->buflen, &len, sizeof(len));
+    memcpy(c->buf + c->buflen + sizeof(len), data, len);
+    c->buflen += sizeof(len) + len;
+}
+
+static const unsigned char *keyringCacheGet(const unsigned char *map,
+				size_t mapsize, size_t *off, uint32_t *len)
+{
+    if (mapsize - *off < sizeof(*len))
+	return NULL;
+    memcpy(len, map + *off, sizeof(*len));
+    *off += sizeof(*len);
+    if (mapsize - *off < *len)
+	return NULL;
+    *off += *len;
+    return map + *off - *len;
+}
+
+/* Check the whole file up front so loading needs no further checks */
+static int keyringCacheValidate(const unsigned char *map, size_t mapsize,
+				const char *cookie, size_t *dataoff)
+{
+    size_t mlen = sizeof(KEYRING_CACHE_MAGIC);
+    size_t off = mlen;
+    const unsigned char *data;
+    uint32_t version, len;
+
+    if (mapsize < mlen + sizeof(version) ||
+	    memcmp(map, KEYRING_CACHE_MAGIC, mlen))
+	return -1;
+    memcpy(&version, map + off, sizeof(version));
+    off += sizeof(version);
+    if (version != KEYRING_CACHE_VERSION)
+	return -1;
+    data = keyringCacheGet(map, mapsize, &off, &len);
+    if (data == NULL || len != strlen(cookie) || memcmp(data, cookie, len))
+	return -1;
+    *dataoff = off;
+
+    while (off < mapsize) {
+	/* NVR and packet */
+	if (keyringCacheGet(map, mapsize, &off, &len) == NULL ||
+		keyringCacheGet(map, mapsize, &off, &len) == NULL)
+	    return -1;
+    }
+    return 0;
+}
+
+static void keyringCacheInit(struct keyringCache_s *c, rpmdb rdb)
+{
+    memset(c, 0, sizeof(*c));
+    if (rdb == NULL || rpmExpandNumeric("%{?_keyring_cache}") <= 0)
+	return;
+    if ((c->cookie = rpmdbCookie(rdb)) == NULL)
+	return;
+    c->path = rpmGenPath(rpmdbHome(rdb), "keyringcache", NULL);
+}
+
+static int keyringCacheLoad(struct keyringCache_s *c, rpmKeyring keyring)
+{
+    struct stat sb;
+    size_t off = 0;
+    int nkeys = -1;
+    int fd;
+
+    if (c->path == NULL || (fd = open(c->path, O_RDONLY|O_NOFOLLOW)) < 0)
+	return -1;
+
+    if (fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode) && sb.st_size > 0 &&
+	    (sb.st_uid == 0 || sb.st_uid == geteuid()) &&
+	    (sb.st_mode & (S_IWGRP|S_IWOTH)) == 0) {
+	unsigned char *map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE,
+				  fd, 0);
+	if (map != MAP_FAILED) {
+	    if (keyringCacheValidate(map, sb.st_size, c->cookie, &off) == 0) {
+		rpmlog(RPMLOG_DEBUG, "loading keyring from %s\n", c->path);
+		nkeys = 0;
+		while (off < sb.st_size) {
+		    uint32_t nvrlen, pktlen;
+		    const unsigned char *nvr, *pkt;
+		    char *origin;
+		    nvr = keyringCacheGet(map, sb.st_size, &off, &nvrlen);
+		    pkt = keyringCacheGet(map, sb.st_size, &off, &pktlen);
+		    origin = rstrndup((const char *)nvr, nvrlen);
+		    nkeys += keyringAddPkt(keyring, pkt, pktlen, origin);
+		    free(origin);
+		}
+	    } else {
+		rpmlog(RPMLOG_DEBUG, "ignoring stale %s\n", c->path);
+	    }
+	    munmap(map, sb.st_size);
+	}
+    }
+    close(fd);
+    return nkeys;
+}
+
+static void keyringCacheSave(struct keyringCache_s *c)
+{
+    char *tmppath = rstrscat(NULL, c->path, ".new", NULL);
+    size_t mlen = sizeof(KEYRING_CACHE_MAGIC);
+    uint32_t version = KEYRING_CACHE_VERSION;
+    uint32_t clen = strlen(c->cookie);
+    int rc = -1;
+    int fd;
+
+    unlink(tmppath);
+    fd = open(tmppath, O_WRONLY|O_CREAT|O_EXCL|O_NOFOLLOW|O_CLOEXEC, 0644);
+    if (fd >= 0) {
+	if (write(fd, KEYRING_CACHE_MAGIC, mlen) == (ssize_t)mlen &&
+		write(fd, &version, sizeof(version)) == sizeof(version) &&
+		write(fd, &clen, sizeof(clen)) == sizeof(clen) &&
+		write(fd, c->cookie, clen) == (ssize_t)clen &&
+		write(fd, c->buf, c->buflen) == (ssize_t)c->buflen)
+	    rc = 0;
+	if (close(fd))
+	    rc = -1;
+	if (rc == 0)
+	    rc = rename(tmppath, c->path);
+	if (rc)
+	    unlink(tmppath);
+    }
+    if (rc)
+	rpmlog(RPMLOG_DEBUG, "failed to write %s: %m\n", c->path);
+
+    free(tmppath);
+}
+
+static void keyringCacheFini(struct keyringCache_s *c)
+{
+    free(c->buf);
+    free(c->path);
+    free(c->cookie);
+}
+
 static int loadKeyringFromDB(rpmts ts)
 {
     Header h;
     rpmdbMatchIterator mi;
+    struct keyringCache_s cache;
     int nkeys = 0;
 
     rpmlog(RPMLOG_DEBUG, "loading keyring from rpmdb\n");
     mi = rpmtsInitIterator(ts, RPMDBI_NAME, "gpg-pubkey", 0);
+
+    keyringCacheInit(&cache, rpmtsGetRdb(ts));
+    if ((nkeys = keyringCacheLoad(&cache, ts->keyring)) >= 0)
+	goto exit;
+    nkeys = 0;
+
     while ((h = rpmdbNextIterator(mi)) != NULL) {
 	struct rpmtd_s pubkeys;
 	const char *key;
@@ -342,38 +587,24 @@ static int loadKeyringFromDB(rpmts ts)
 	    size_t pktlen;
 
 	    if (rpmBase64Decode(key, (void **) &pkt, &pktlen) == 0) {
-		rpmPubkey key = rpmPubkeyNew(pkt, pktlen);
-		int subkeysCount, i;
-		rpmPubkey *subkeys = rpmGetSubkeys(key, &subkeysCount);
-
-		if (rpmKeyringAddKey(ts->keyring, key) == 0) {
-		    char *nvr = headerGetAsString(h, RPMTAG_NVR);
-		    rpmlog(RPMLOG_DEBUG, "added key %s to keyring\n", nvr);
-		    free(nvr);
-		    nkeys++;
-		}
-		rpmPubkeyFree(key);
-
-		for (i = 0; i < subkeysCount; i++) {
-		    rpmPubkey subkey = subkeys[i];
-
-		    if (rpmKeyringAddKey(ts->keyring, subkey) == 0) {
-			char *nvr = headerGetAsString(h, RPMTAG_NVR);
-			rpmlog(RPMLOG_DEBUG,
-			    "added subkey %d of main key %s to keyring\n",
-			    i, nvr);
-
-			free(nvr);
-			nkeys++;
-		    }
-		    rpmPubkeyFree(subkey);
+		char *nvr = headerGetAsString(h, RPMTAG_NVR);
+		nkeys += keyringAddPkt(ts->keyring, pkt, pktlen, nvr);
+		if (cache.path) {
+		    keyringCacheBufAdd(&cache, nvr, strlen(nvr));
+		    keyringCacheBufAdd(&cache, pkt, pktlen);
 		}
-		free(subkeys);
+		free(nvr);
 		free(pkt);
 	    }
 	}
 	rpmtdFreeData(&pubkeys);
     }
+
+    if (cache.path)
+	keyringCacheSave(&cache);
+
+exit:
+    keyringCacheFini(&cache);
     rpmdbFreeIterator(mi);
 
     return nkeys;
@@ -764,6 +995,180 @@ static unsigned int uintId(unsigned int a)
     return a;
 }
 
+static const struct {
+    const char *name;
+    rpmtsOpX op;
+} tsOps[] = {
+    { "total",		RPMTS_OP_TOTAL },
+    { "check",		RPMTS_OP_CHECK },
+    { "order",		RPMTS_OP_ORDER },
+    { "verify",		RPMTS_OP_VERIFY },
+    { "fingerprint",	RPMTS_OP_FINGERPRINT },
+    { "install",	RPMTS_OP_INSTALL },
+    { "erase",		RPMTS_OP_ERASE },
+    { "scriptlets",	RPMTS_OP_SCRIPTLETS },
+    { "compress",	RPMTS_OP_COMPRESS },
+    { "uncompress",	RPMTS_OP_UNCOMPRESS },
+    { "digest",		RPMTS_OP_DIGEST },
+    { "signature",	RPMTS_OP_SIGNATURE },
+    { "dbadd",		RPMTS_OP_DBADD },
+    { "dbremove",	RPMTS_OP_DBREMOVE },
+    { "dbget",		RPMTS_OP_DBGET },
+    { "dbput",		RPMTS_OP_DBPUT },
+    { "dbdel",		RPMTS_OP_DBDEL },
+    { "hdrhit",		RPMTS_OP_HDRHIT },
+    { "hdrmiss",	RPMTS_OP_HDRMISS },
+    { "hdrload",	RPMTS_OP_HDRLOAD },
+    { "filecmp",	RPMTS_OP_FILECMP },
+    { "filecolor",	RPMTS_OP_FILECOLOR },
+    { "fileread",	RPMTS_OP_FILEREAD },
+};
+static const int numTsOps = sizeof(tsOps) / sizeof(tsOps[0]);
+
+static void jsonString(char **buf, const char *s)
+{
+    rstrcat(buf, "\"");
+    for (; s && *s; s++) {
+	char esc[8];
+	if (*s == '"' || *s == '\\') {
+	    esc[0] = '\\';
+	    esc[1] = *s;
+	    esc[2] = '\0';
+	} else if ((unsigned char) *s < 0x20) {
+	    snprintf(esc, sizeof(esc), "\\u%04x", (unsigned char) *s);
+	} else {
+	    esc[0] = *s;
+	    esc[1] = '\0';
+	}
+	rstrcat(buf, esc);
+    }
+    rstrcat(buf, "\"");
+}
+
+/* Append a JSON object of the operations with a non-zero count */
+static void jsonOps(char **buf, rpmop (*getop)(void *, rpmtsOpX), void *obj)
+{
+    int first = 1;
+
+    rstrcat(buf, "{");
+    for (int i = 0; i < numTsOps; i++) {
+	rpmop op = getop(obj, tsOps[i].op);
+	char *s = NULL;
+	if (op == NULL || op->count <= 0)
+	    continue;
+	rasprintf(&s, "%s\"%s\": {\"count\": %d, \"bytes\": %zu, "
+		  "\"usecs\": %lu}", first ? "" : ", ", tsOps[i].name,
+		  op->count, op->bytes, (unsigned long) op->usecs);
+	rstrcat(buf, s);
+	free(s);
+	first = 0;
+    }
+    rstrcat(buf, "}");
+}
+
+static rpmop getTsOp(void *ts, rpmtsOpX opx)
+{
+    return rpmtsOp(ts, opx);
+}
+
+static rpmop getTeOp(void *te, rpmtsOpX opx)
+{
+    return rpmteOp(te, opx);
+}
+
+/* Remember per-package statistics before the element goes away */
+static void rpmtsSavePkgStats(rpmts ts, rpmte te)
+{
+    char *buf = NULL;
+    int used = 0;
+
+    for (int i = 0; i < numTsOps; i++) {
+	rpmop op = rpmteOp(te, tsOps[i].op);
+	if (op && op->count > 0)
+	    used = 1;
+    }
+    if (!used)
+	return;
+
+    rstrcat(&buf, "{\"nevra\": ");
+    jsonString(&buf, rpmteNEVRA(te));
+    rstrscat(&buf, ", \"type\": \"",
+	     rpmteType(te) == TR_REMOVED ? "erase" : "install",
+	     "\", \"ops\": ", NULL);
+    jsonOps(&buf, getTeOp, te);
+    rstrcat(&buf, "}");
+    argvAdd(&ts->pkgstats, buf);
+    free(buf);
+}
+
+char * rpmtsFormatStats(rpmts ts, int format)
+{
+    static const unsigned int scale = (1000 * 1000);
+    char *buf = NULL;
+    struct rusage ru;
+    long maxrss = 0;
+    size_t tspool, dbpool;
+
+    if (ts == NULL)
+	return NULL;
+
+    /* Peak resident set size of the process so far, in kB */
+    if (getrusage(RUSAGE_SELF, &ru) == 0)
+	maxrss = ru.ru_maxrss;
+    /* Memory of the string pools shared by the file and dependency sets */
+    tspool = rpmstrPoolMemSize(ts->members->pool);
+    dbpool = rpmstrPoolMemSize(rpmdbPool(ts->rdb));
+
+    if (format == RPMTS_STATS_JSON) {
+	char *s = NULL;
+	rstrcat(&buf, "{\"phases\": ");
+	jsonOps(&buf, getTsOp, ts);
+	rasprintf(&s, ", \"maxrss\": %ld", maxrss);
+	rstrcat(&buf, s);
+	free(s);
+	rstrcat(&buf, ", \"packages\": [");
+	for (ARGV_const_t av = ts->pkgstats; av && *av; av++)
+	    rstrscat(&buf, (av != ts->pkgstats) ? ", " : "", *av, NULL);
+	rstrcat(&buf, "], \"plugins\": ");
+	rpmpluginsFormatStats(ts->plugins, format, &buf);
+	rasprintf(&s, ", \"pools\": {\"ts\": %zu, \"db\": %zu}}\n",
+		  tspool, dbpool);
+	rstrcat(&buf, s);
+	free(s);
+	return buf;
+    }
+
+    rstrcat(&buf, "");
+    for (int i = 0; i < numTsOps; i++) {
+	rpmop op = rpmtsOp(ts, tsOps[i].op);
+	char *s = NULL;
+	if (op == NULL || op->count <= 0)
+	    continue;
+	rasprintf(&s, "   %s:%*s %6d %6lu.%06lu MB %6lu.%06lu secs\n",
+		tsOps[i].name, (int) (12 - strlen(tsOps[i].name)), "",
+		op->count,
+		(unsigned long)op->bytes/scale, (unsigned long)op->bytes%scale,
+		op->usecs/scale, op->usecs%scale);
+	rstrcat(&buf, s);
+	free(s);
+    }
+    if (maxrss > 0) {
+	char *s = NULL;
+	rasprintf(&s, "   maxrss:       %6ld kB\n", maxrss);
+	rstrcat(&buf, s);
+	free(s);
+    }
+    if (tspool || dbpool) {
+	char *s = NULL;
+	rasprintf(&s, "   strpools:     %6zu kB (ts) %zu kB (db)\n",
+		  tspool / 1024, dbpool / 1024);
+	rstrcat(&buf, s);
+	free(s);
+    }
+    rpmpluginsFormatStats(ts->plugins, format, &buf);
+    return buf;
+}
+
 void rpmtsEmpty(rpmts ts)
 {
     tsMembers tsmem = rpmtsMembers(ts);
@@ -773,6 +1178,8 @@ void rpmtsEmpty(rpmts ts)
     rpmtsClean(ts);
 
     for (int oc = 0; oc < tsmem->orderCount; oc++) {
+	if (_rpmts_stats)
+	    rpmtsSavePkgStats(ts, tsmem->order[oc]);
 	rpmtsNotifyChange(ts, RPMTS_EVENT_DEL, tsmem->order[oc], NULL);
 	tsmem->order[oc] = rpmteFree(tsmem->order[oc]);
     }
@@ -781,40 +1188,22 @@ void rpmtsEmpty(rpmts ts)
     /* The pool cannot be emptied, there might be references to its contents */
     tsmem->pool = rpmstrPoolFree(tsmem->pool);
     packageHashEmpty(tsmem->removedPackages);
+    tsmem->removedGen++;
+    tsmem->depcheckValid = 0;
+    tsmem->orderValid = 0;
     return;
 }
 
-static void rpmtsPrintStat(const char * name, struct rpmop_s * op)
-{
-    static const unsigned int scale = (1000 * 1000);
-    if (op != NULL && op->count > 0)
-	fprintf(stderr, "   %s %6d %6lu.%06lu MB %6lu.%06lu secs\n",
-		name, op->count,
-		(unsigned long)op->bytes/scale, (unsigned long)op->bytes%scale,
-		op->usecs/scale, op->usecs%scale);
-}
-
 static void rpmtsPrintStats(rpmts ts)
 {
+    char *stats;
+
     (void) rpmswExit(rpmtsOp(ts, RPMTS_OP_TOTAL), 0);
 
-    rpmtsPrintStat("total:       ", rpmtsOp(ts, RPMTS_OP_TOTAL));
-    rpmtsPrintStat("check:       ", rpmtsOp(ts, RPMTS_OP_CHECK));
-    rpmtsPrintStat("order:       ", rpmtsOp(ts, RPMTS_OP_ORDER));
-    rpmtsPrintStat("verify:      ", rpmtsOp(ts, RPMTS_OP_VERIFY));
-    rpmtsPrintStat("fingerprint: ", rpmtsOp(ts, RPMTS_OP_FINGERPRINT));
-    rpmtsPrintStat("install:     ", rpmtsOp(ts, RPMTS_OP_INSTALL));
-    rpmtsPrintStat("erase:       ", rpmtsOp(ts, RPMTS_OP_ERASE));
-    rpmtsPrintStat("scriptlets:  ", rpmtsOp(ts, RPMTS_OP_SCRIPTLETS));
-    rpmtsPrintStat("compress:    ", rpmtsOp(ts, RPMTS_OP_COMPRESS));
-    rpmtsPrintStat("uncompress:  ", rpmtsOp(ts, RPMTS_OP_UNCOMPRESS));
-    rpmtsPrintStat("digest:      ", rpmtsOp(ts, RPMTS_OP_DIGEST));
-    rpmtsPrintStat("signature:   ", rpmtsOp(ts, RPMTS_OP_SIGNATURE));
-    rpmtsPrintStat("dbadd:       ", rpmtsOp(ts, RPMTS_OP_DBADD));
-    rpmtsPrintStat("dbremove:    ", rpmtsOp(ts, RPMTS_OP_DBREMOVE));
-    rpmtsPrintStat("dbget:       ", rpmtsOp(ts, RPMTS_OP_DBGET));
-    rpmtsPrintStat("dbput:       ", rpmtsOp(ts, RPMTS_OP_DBPUT));
-    rpmtsPrintStat("dbdel:       ", rpmtsOp(ts, RPMTS_OP_DBDEL));
+    stats = rpmtsFormatStats(ts, (_rpmts_stats == RPMTS_STATS_JSON) ?
+			     RPMTS_STATS_JSON : RPMTS_STATS_TEXT);
+    fputs(stats, stderr);
+    free(stats);
 }
 
 rpmts rpmtsFree(rpmts ts)
@@ -832,6 +1221,7 @@ rpmts rpmtsFree(rpmts ts)
 
     (void) rpmtsCloseDB(ts);
 
+    rpmtsFreeDepCache(ts);
     tsmem->removedPackages = packageHashFree(tsmem->removedPackages);
     tsmem->installedPackages = packageHashFree(tsmem->installedPackages);
     tsmem->order = _free(tsmem->order);
@@ -839,6 +1229,8 @@ rpmts rpmtsFree(rpmts ts)
 
     ts->dsi = _free(ts->dsi);
 
+    /* The scriptlet helper may still be writing to scriptFd */
+    rpmScriptHelperStop();
     if (ts->scriptFd != NULL) {
 	ts->scriptFd = fdFree(ts->scriptFd);
 	ts->scriptFd = NULL;
@@ -851,12 +1243,13 @@ rpmts rpmtsFree(rpmts ts)
     ts->netsharedPaths = argvFree(ts->netsharedPaths);
     ts->installLangs = argvFree(ts->installLangs);
 
-    ts->plugins = rpmpluginsFree(ts->plugins);
-
     rpmtriggersFree(ts->trigs2run);
 
     if (_rpmts_stats)
 	rpmtsPrintStats(ts);
+    ts->pkgstats = argvFree(ts->pkgstats);
+
+    ts->plugins = rpmpluginsFree(ts->plugins);
 
     (void) rpmtsUnlink(ts);
 
@@ -1260,6 +1653,7 @@ rpmts rpmtsCreate(void)
     ts->vfylevel = vfylevel_init();
 
     ts->nrefs = 0;
+    ts->payloadcache = -1;
 
     ts->plugins = NULL;
 
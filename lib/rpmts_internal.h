@@ -25,6 +25,16 @@ typedef struct tsMembers_s {
     int orderCount;		/*!< No. of transaction elements. */
     int orderAlloced;		/*!< No. of allocated transaction elements. */
     int delta;			/*!< Delta for reallocation. */
+
+    struct depCache_s * depcache;	/*!< Cached rpmdb dependency lookups */
+    char * depcacheCookie;	/*!< rpmdb cookie of the cached lookups */
+    unsigned int removedGen;	/*!< Bumped on erase element set changes */
+    unsigned int depcacheGen;	/*!< removedGen of the cached lookups */
+    int depcheckValid;		/*!< Element check results still valid? */
+    rpm_color_t depcheckColor;	/*!< Transaction color of the last check */
+    int orderValid;		/*!< Element ordering relations still valid? */
+    rpm_color_t orderColor;	/*!< Transaction colors of the last ordering */
+    rpm_color_t orderPrefColor;
 } * tsMembers;
 
 typedef struct tsTrigger_s {
@@ -84,6 +94,7 @@ struct rpmts_s {
     ARGV_t installLangs;	/*!< From %{_install_langs} */
 
     struct rpmop_s ops[RPMTS_OP_MAX];
+    ARGV_t pkgstats;		/*!< Per-package statistics (JSON) */
 
     rpmPlugins plugins;		/*!< Transaction plugins */
 
@@ -91,7 +102,13 @@ struct rpmts_s {
 
     rpmtriggers trigs2run;   /*!< Transaction file triggers */
 
+    struct deferredScript_s *deferred; /*!< Coalesced %post/%postun */
+    int ndeferred;
+
     int min_writes;             /*!< macro minimize_writes used */
+    int freshroot;		/*!< installing into an empty root */
+    struct fsmDirCache_s *dircache; /*!< directories known to exist */
+    int payloadcache;		/*!< payload cache directory (or -1) */
 
     time_t overrideTime;	/*!< Time value used when overriding system clock. */
 };
@@ -123,6 +140,10 @@ rpmdbMatchIterator rpmtsTeIterator(rpmts ts, rpmte te, int prune);
 RPM_GNUC_INTERNAL
 rpmal rpmtsCreateAl(rpmts ts, rpmElementTypes types);
 
+/* Drop the rpmdb dependency lookups cached across rpmtsCheck() calls */
+RPM_GNUC_INTERNAL
+void rpmtsFreeDepCache(rpmts ts);
+
 /* returns -1 for retry, 0 for ignore and 1 for not found */
 RPM_GNUC_INTERNAL
 int rpmtsSolve(rpmts ts, rpmds key);
@@ -134,6 +155,12 @@ RPM_GNUC_INTERNAL
 rpmRC runScript(rpmts ts, rpmte te, Header h, ARGV_const_t prefixes,
 		       rpmScript script, int arg1, int arg2);
 
+/* Queue a coalescing scriptlet to run once after all packages, takes
+ * ownership of script */
+RPM_GNUC_INTERNAL
+void rpmtsDeferScript(rpmts ts, rpmte te, ARGV_const_t prefixes,
+		      rpmScript script, int arg1);
+
 
 RPM_GNUC_INTERNAL
 int rpmtsNotifyChange(rpmts ts, int event, rpmte te, rpmte other);
@@ -8,53 +8,218 @@
 #include <rpm/rpmstring.h>
 
 #include "lib/misc.h"
+#include "lib/rpmchroot.h"
 #include "lib/rpmug.h"
 #include "debug.h"
 
-/* 
- * These really ought to use hash tables. I just made the
- * guess that most files would be owned by root or the same person/group
- * who owned the last file. Those two values are cached, everything else
- * is looked up via getpw() and getgr() functions.  If this performs
- * too poorly I'll have to implement it properly :-(
+#define SKIPSPACE(s)    { while (*(s) &&  risspace(*(s))) (s)++; }
+
+#undef HASHTYPE
+#undef HTKEYTYPE
+#undef HTDATATYPE
+#define HASHTYPE ugNameHash
+#define HTKEYTYPE const char *
+#define HTDATATYPE id_t
+#include "lib/rpmhash.H"
+#include "lib/rpmhash.C"
+
+#undef HASHTYPE
+#undef HTKEYTYPE
+#undef HTDATATYPE
+#define HASHTYPE ugIdHash
+#define HTKEYTYPE id_t
+#define HTDATATYPE const char *
+#include "lib/rpmhash.H"
+#include "lib/rpmhash.C"
+
+/*
+ * Most files are owned by root or the same person/group who owned the
+ * last file, those are remembered as a fast path. Everything else is
+ * cached in per-root hash tables, which are bulk-loaded from /etc/passwd
+ * and /etc/group when nsswitch.conf says those are consulted first,
+ * and otherwise filled from getpw() and getgr() lookups as they happen.
+ * Failed lookups are not cached, scriptlets may add users and groups.
+ * The root directory pointers only change in rpmChrootSet(), which
+ * flushes everything.
  */
+struct ugCache_s {
+    char *root;			/* root directory the cache is for */
+    int loaded;			/* bulk loading done (or skipped)? */
+    ugNameHash unames;
+    ugIdHash uids;
+    ugNameHash gnames;
+    ugIdHash gids;
+};
 
-int rpmugUid(const char * thisUname, uid_t * uid)
+static struct ugCache_s *ugCaches = NULL;
+static int ugNumCaches = 0;
+
+/* Lookups can be done from verify and build worker threads */
+static pthread_mutex_t ugLock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *freeName(const char *name)
+{
+    free((char *)name);
+    return NULL;
+}
+
+static unsigned int idHash(id_t id)
+{
+    return id * 2654435761U;
+}
+
+static int idCmp(id_t a, id_t b)
+{
+    return (a != b);
+}
+
+static void cacheAdd(ugNameHash names, ugIdHash ids, const char *name, id_t id)
+{
+    if (!ugNameHashHasEntry(names, name))
+	ugNameHashAddEntry(names, xstrdup(name), id);
+    if (!ugIdHashHasEntry(ids, id))
+	ugIdHashAddEntry(ids, id, xstrdup(name));
+}
+
+/*
+ * The files are authoritative only if they're looked up first. No
+ * nsswitch.conf means files only.
+ */
+static int filesFirst(const char *db)
+{
+    FILE *f = fopen("/etc/nsswitch.conf", "r");
+    size_t dblen = strlen(db);
+    char line[BUFSIZ];
+    int rc = 1;
+
+    if (f == NULL)
+	return 1;
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+	char *s = line;
+	SKIPSPACE(s);
+	if (!rstreqn(s, db, dblen) || s[dblen] != ':')
+	    continue;
+	s += dblen + 1;
+	SKIPSPACE(s);
+	rc = (rstreqn(s, "files", 5) && (s[5] == '\0' || risspace(s[5])));
+	break;
+    }
+    fclose(f);
+    return rc;
+}
+
+static void loadFiles(struct ugCache_s *c)
+{
+    FILE *f;
+
+    if (filesFirst("passwd") && (f = fopen("/etc/passwd", "r")) != NULL) {
+	struct passwd *pw;
+	while ((pw = fgetpwent(f)) != NULL) {
+	    /* skip NIS compat entries */
+	    if (*pw->pw_name != '+' && *pw->pw_name != '-')
+		cacheAdd(c->unames, c->uids, pw->pw_name, pw->pw_uid);
+	}
+	fclose(f);
+    }
+
+    if (filesFirst("group") && (f = fopen("/etc/group", "r")) != NULL) {
+	struct group *gr;
+	while ((gr = fgetgrent(f)) != NULL) {
+	    if (*gr->gr_name != '+' && *gr->gr_name != '-')
+		cacheAdd(c->gnames, c->gids, gr->gr_name, gr->gr_gid);
+	}
+	fclose(f);
+    }
+
+    rpmlog(RPMLOG_DEBUG, "loaded %d users and %d groups for %s\n",
+	    ugNameHashNumKeys(c->unames), ugNameHashNumKeys(c->gnames),
+	    c->root);
+}
+
+/* Return the cache for the current root directory */
+static struct ugCache_s *getCache(void)
+{
+    const char *root = rpmChrootCurrent();
+    struct ugCache_s *c = NULL;
+
+    for (int i = 0; i < ugNumCaches; i++) {
+	if (rstreq(ugCaches[i].root, root)) {
+	    c = &ugCaches[i];
+	    break;
+	}
+    }
+
+    if (c == NULL) {
+	ugCaches = xrealloc(ugCaches, (ugNumCaches + 1) * sizeof(*ugCaches));
+	c = &ugCaches[ugNumCaches++];
+	c->root = xstrdup(root);
+	c->loaded = 0;
+	c->unames = ugNameHashCreate(256, rstrhash, strcmp, freeName, NULL);
+	c->uids = ugIdHashCreate(256, idHash, idCmp, NULL, freeName);
+	c->gnames = ugNameHashCreate(256, rstrhash, strcmp, freeName, NULL);
+	c->gids = ugIdHashCreate(256, idHash, idCmp, NULL, freeName);
+    }
+
+    if (!c->loaded) {
+	loadFiles(c);
+	c->loaded = 1;
+    }
+
+    return c;
+}
+
+static void freeCaches(void)
+{
+    for (int i = 0; i < ugNumCaches; i++) {
+	struct ugCache_s *c = &ugCaches[i];
+	free(c->root);
+	ugNameHashFree(c->unames);
+	ugIdHashFree(c->uids);
+	ugNameHashFree(c->gnames);
+	ugIdHashFree(c->gids);
+    }
+    ugCaches = _free(ugCaches);
+    ugNumCaches = 0;
+}
+
+static int lookupUid(const char * thisUname, uid_t * uid)
 {
     static char * lastUname = NULL;
-    static size_t lastUnameLen = 0;
-    static size_t lastUnameAlloced;
+    static const char * lastRoot = NULL;
     static uid_t lastUid;
-    struct passwd * pwent;
-    size_t thisUnameLen;
+    const char * root = rpmChrootCurrent();
+    struct ugCache_s *c;
+    id_t *ids = NULL;
 
     if (!thisUname) {
-	lastUnameLen = 0;
+	lastUname = _free(lastUname);
 	return -1;
     } else if (rstreq(thisUname, UID_0_USER)) {
 	*uid = 0;
 	return 0;
     }
 
-    thisUnameLen = strlen(thisUname);
-    if (lastUname == NULL || thisUnameLen != lastUnameLen ||
+    if (lastUname == NULL || root != lastRoot ||
 	!rstreq(thisUname, lastUname))
     {
-	if (lastUnameAlloced < thisUnameLen + 1) {
-	    lastUnameAlloced = thisUnameLen + 10;
-	    lastUname = xrealloc(lastUname, lastUnameAlloced);	/* XXX memory leak */
-	}
-	strcpy(lastUname, thisUname);
-
-	pwent = getpwnam(thisUname);
-	if (pwent == NULL) {
-	    /* FIX: shrug */
-	    endpwent();
-	    pwent = getpwnam(thisUname);
-	    if (pwent == NULL) return -1;
+	c = getCache();
+	if (ugNameHashGetEntry(c->unames, thisUname, &ids, NULL, NULL)) {
+	    lastUid = ids[0];
+	} else {
+	    struct passwd * pwent = getpwnam(thisUname);
+	    if (pwent == NULL) {
+		/* FIX: shrug */
+		endpwent();
+		pwent = getpwnam(thisUname);
+		if (pwent == NULL) return -1;
+	    }
+	    lastUid = pwent->pw_uid;
+	    cacheAdd(c->unames, c->uids, thisUname, lastUid);
 	}
-
-	lastUid = pwent->pw_uid;
+	free(lastUname);
+	lastUname = xstrdup(thisUname);
+	lastRoot = root;
     }
 
     *uid = lastUid;
@@ -62,43 +227,43 @@ int rpmugUid(const char * thisUname, uid_t * uid)
     return 0;
 }
 
-int rpmugGid(const char * thisGname, gid_t * gid)
+static int lookupGid(const char * thisGname, gid_t * gid)
 {
     static char * lastGname = NULL;
-    static size_t lastGnameLen = 0;
-    static size_t lastGnameAlloced;
+    static const char * lastRoot = NULL;
     static gid_t lastGid;
-    size_t thisGnameLen;
-    struct group * grent;
+    const char * root = rpmChrootCurrent();
+    struct ugCache_s *c;
+    id_t *ids = NULL;
 
     if (thisGname == NULL) {
-	lastGnameLen = 0;
+	lastGname = _free(lastGname);
 	return -1;
     } else if (rstreq(thisGname, GID_0_GROUP)) {
 	*gid = 0;
 	return 0;
     }
 
-    thisGnameLen = strlen(thisGname);
-    if (lastGname == NULL || thisGnameLen != lastGnameLen ||
+    if (lastGname == NULL || root != lastRoot ||
 	!rstreq(thisGname, lastGname))
     {
-	if (lastGnameAlloced < thisGnameLen + 1) {
-	    lastGnameAlloced = thisGnameLen + 10;
-	    lastGname = xrealloc(lastGname, lastGnameAlloced);	/* XXX memory leak */
-	}
-	strcpy(lastGname, thisGname);
-
-	grent = getgrnam(thisGname);
-	if (grent == NULL) {
-	    /* FIX: shrug */
-	    endgrent();
-	    grent = getgrnam(thisGname);
+	c = getCache();
+	if (ugNameHashGetEntry(c->gnames, thisGname, &ids, NULL, NULL)) {
+	    lastGid = ids[0];
+	} else {
+	    struct group * grent = getgrnam(thisGname);
 	    if (grent == NULL) {
-		return -1;
+		/* FIX: shrug */
+		endgrent();
+		grent = getgrnam(thisGname);
+		if (grent == NULL) return -1;
 	    }
+	    lastGid = grent->gr_gid;
+	    cacheAdd(c->gnames, c->gids, thisGname, lastGid);
 	}
-	lastGid = grent->gr_gid;
+	free(lastGname);
+	lastGname = xstrdup(thisGname);
+	lastRoot = root;
     }
 
     *gid = lastGid;
@@ -106,66 +271,109 @@ int rpmugGid(const char * thisGname, gid_t * gid)
     return 0;
 }
 
-const char * rpmugUname(uid_t uid)
+static const char * lookupUname(uid_t uid)
 {
     static uid_t lastUid = (uid_t) -1;
-    static char * lastUname = NULL;
-    static size_t lastUnameLen = 0;
+    static const char * lastUname = NULL;
+    static const char * lastRoot = NULL;
+    const char * root = rpmChrootCurrent();
+    struct ugCache_s *c;
+    const char **names = NULL;
 
     if (uid == (uid_t) -1) {
 	lastUid = (uid_t) -1;
+	lastUname = NULL;
 	return NULL;
     } else if (uid == (uid_t) 0) {
 	return UID_0_USER;
-    } else if (uid == lastUid) {
+    } else if (uid == lastUid && root == lastRoot) {
 	return lastUname;
-    } else {
-	struct passwd * pwent = getpwuid(uid);
-	size_t len;
+    }
 
+    c = getCache();
+    if (!ugIdHashGetEntry(c->uids, uid, &names, NULL, NULL)) {
+	struct passwd * pwent = getpwuid(uid);
 	if (pwent == NULL) return NULL;
+	cacheAdd(c->unames, c->uids, pwent->pw_name, uid);
+	ugIdHashGetEntry(c->uids, uid, &names, NULL, NULL);
+    }
 
-	lastUid = uid;
-	len = strlen(pwent->pw_name);
-	if (lastUnameLen < len + 1) {
-	    lastUnameLen = len + 20;
-	    lastUname = xrealloc(lastUname, lastUnameLen);
-	}
-	strcpy(lastUname, pwent->pw_name);
+    /* Names are owned by the cache, valid until rpmugFree() */
+    lastUid = uid;
+    lastUname = names[0];
+    lastRoot = root;
 
-	return lastUname;
-    }
+    return lastUname;
 }
 
-const char * rpmugGname(gid_t gid)
+static const char * lookupGname(gid_t gid)
 {
     static gid_t lastGid = (gid_t) -1;
-    static char * lastGname = NULL;
-    static size_t lastGnameLen = 0;
+    static const char * lastGname = NULL;
+    static const char * lastRoot = NULL;
+    const char * root = rpmChrootCurrent();
+    struct ugCache_s *c;
+    const char **names = NULL;
 
     if (gid == (gid_t) -1) {
 	lastGid = (gid_t) -1;
+	lastGname = NULL;
 	return NULL;
     } else if (gid == (gid_t) 0) {
 	return GID_0_GROUP;
-    } else if (gid == lastGid) {
+    } else if (gid == lastGid && root == lastRoot) {
 	return lastGname;
-    } else {
-	struct group * grent = getgrgid(gid);
-	size_t len;
+    }
 
+    c = getCache();
+    if (!ugIdHashGetEntry(c->gids, gid, &names, NULL, NULL)) {
+	struct group * grent = getgrgid(gid);
 	if (grent == NULL) return NULL;
+	cacheAdd(c->gnames, c->gids, grent->gr_name, gid);
+	ugIdHashGetEntry(c->gids, gid, &names, NULL, NULL);
+    }
 
-	lastGid = gid;
-	len = strlen(grent->gr_name);
-	if (lastGnameLen < len + 1) {
-	    lastGnameLen = len + 20;
-	    lastGname = xrealloc(lastGname, lastGnameLen);
-	}
-	strcpy(lastGname, grent->gr_name);
+    lastGid = gid;
+    lastGname = names[0];
+    lastRoot = root;
 
-	return lastGname;
-    }
+    return lastGname;
+}
+
+int rpmugUid(const char * thisUname, uid_t * uid)
+{
+    int rc;
+    pthread_mutex_lock(&ugLock);
+    rc = lookupUid(thisUname, uid);
+    pthread_mutex_unlock(&ugLock);
+    return rc;
+}
+
+int rpmugGid(const char * thisGname, gid_t * gid)
+{
+    int rc;
+    pthread_mutex_lock(&ugLock);
+    rc = lookupGid(thisGname, gid);
+    pthread_mutex_unlock(&ugLock);
+    return rc;
+}
+
+const char * rpmugUname(uid_t uid)
+{
+    const char *name;
+    pthread_mutex_lock(&ugLock);
+    name = lookupUname(uid);
+    pthread_mutex_unlock(&ugLock);
+    return name;
+}
+
+const char * rpmugGname(gid_t gid)
+{
+    const char *name;
+    pthread_mutex_lock(&ugLock);
+    name = lookupGname(gid);
+    pthread_mutex_unlock(&ugLock);
+    return name;
 }
 
 static void loadLibs(void)
@@ -190,4 +398,8 @@ void rpmugFree(void)
     rpmugGid(NULL, NULL);
     rpmugUname(-1);
     rpmugGname(-1);
+
+    pthread_mutex_lock(&ugLock);
+    freeCaches();
+    pthread_mutex_unlock(&ugLock);
 }
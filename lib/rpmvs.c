@@ -1,11 +1,15 @@
 #include "system.h"
 
 #include <pthread.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 #include <rpm/rpmkeyring.h>
 #include <rpm/rpmmacro.h>
 #include <rpm/rpmlog.h>
 #include "lib/rpmvs.h"
+#include "lib/rpmprobes.h"
 #include "rpmio/rpmpgpval.h"
+#include "rpmio/rpmio_internal.h"	/* rpmKeyringDigest() */
 
 #include "debug.h"
 
@@ -17,6 +21,8 @@ struct rpmvs_s {
     rpmDigestBundle bundle;
     rpmKeyring keyring;
     int vfylevel;
+    char *cachedir;	/*!< verification cache directory (or NULL) */
+    char *cachekey;	/*!< cache entry of the package on miss */
 };
 
 struct vfytag_s {
@@ -366,6 +372,8 @@ void rpmvsInit(struct rpmvs_s *vs, hdrblob blob, rpmDigestBundle bundle)
 struct rpmvs_s *rpmvsFree(struct rpmvs_s *sis)
 {
     if (sis) {
+	free(sis->cachedir);
+	free(sis->cachekey);
 	rpmKeyringFree(sis->keyring);
 	for (int i = 0; i < sis->nsigs; i++) {
 	    rpmsinfoFini(&sis->sigs[i]);
@@ -414,6 +422,102 @@ int rpmvsRange(struct rpmvs_s *vs)
     return range;
 }
 
+/*
+ * The verification cache is a directory with an empty file per package
+ * whose payload signatures and digests verified fine. The file name is
+ * a digest over the identity of the package file (including its ctime,
+ * which can't be set back), both headers, the verification settings
+ * and the keyring, so any change to these misses. Only a directory
+ * nobody else can write to is trusted, entries for stale keyrings or
+ * packages are not cleaned up.
+ */
+static int cacheTrusted(const struct stat *sb)
+{
+    return ((sb->st_uid == 0 || sb->st_uid == geteuid()) &&
+	    (sb->st_mode & (S_IWGRP|S_IWOTH)) == 0);
+}
+
+void rpmvsEnableCache(struct rpmvs_s *vs)
+{
+    char *dir = rpmExpand("%{?_vscache_dir}", NULL);
+    struct stat sb;
+
+    if (*dir && lstat(dir, &sb) == 0 && S_ISDIR(sb.st_mode) &&
+	    cacheTrusted(&sb)) {
+	free(vs->cachedir);
+	vs->cachedir = dir;
+    } else {
+	free(dir);
+    }
+}
+
+static char *cacheKey(struct rpmvs_s *vs, FD_t fd,
+			hdrblob sigblob, hdrblob blob)
+{
+    static const char magic[] = "rpmvscache1";
+    char *key = NULL;
+    struct stat sb;
+    DIGEST_CTX ctx;
+
+    if (Fileno(fd) < 0 || fstat(Fileno(fd), &sb) || !S_ISREG(sb.st_mode))
+	return NULL;
+
+    ctx = rpmDigestInit(RPM_HASH_SHA256, RPMDIGEST_NONE);
+    rpmDigestUpdate(ctx, magic, sizeof(magic));
+    rpmDigestUpdate(ctx, &sb.st_dev, sizeof(sb.st_dev));
+    rpmDigestUpdate(ctx, &sb.st_ino, sizeof(sb.st_ino));
+    rpmDigestUpdate(ctx, &sb.st_size, sizeof(sb.st_size));
+    rpmDigestUpdate(ctx, &sb.st_mtim, sizeof(sb.st_mtim));
+    rpmDigestUpdate(ctx, &sb.st_ctim, sizeof(sb.st_ctim));
+    rpmDigestUpdate(ctx, &vs->vsflags, sizeof(vs->vsflags));
+    rpmDigestUpdate(ctx, &vs->vfylevel, sizeof(vs->vfylevel));
+    rpmKeyringDigest(vs->keyring, ctx);
+    rpmDigestUpdate(ctx, sigblob->ei, sigblob->pvlen);
+    rpmDigestUpdate(ctx, blob->ei, blob->pvlen);
+    rpmDigestFinal(ctx, (void **)&key, NULL, 1);
+
+    return key;
+}
+
+int rpmvsCacheLookup(struct rpmvs_s *vs, FD_t fd, hdrblob sigblob, hdrblob blob)
+{
+    int hit = 0;
+    char *key, *fn;
+    struct stat sb;
+
+    if (vs->cachedir == NULL || (key = cacheKey(vs, fd, sigblob, blob)) == NULL)
+	return 0;
+
+    fn = rstrscat(NULL, vs->cachedir, "/", key, NULL);
+    if (lstat(fn, &sb) == 0 && S_ISREG(sb.st_mode) && cacheTrusted(&sb))
+	hit = 1;
+    free(fn);
+
+    if (hit) {
+	for (int i = 0; i < vs->nsigs; i++) {
+	    struct rpmsinfo_s *sinfo = &vs->sigs[i];
+	    if ((sinfo->range & RPMSIG_PAYLOAD) && sinfo->rc == RPMRC_OK)
+		sinfo->cached = 1;
+	}
+	free(key);
+    } else {
+	free(vs->cachekey);
+	vs->cachekey = key;
+    }
+    return hit;
+}
+
+static void cacheStore(struct rpmvs_s *vs)
+{
+    char *fn = rstrscat(NULL, vs->cachedir, "/", vs->cachekey, NULL);
+    int fd = open(fn, O_WRONLY|O_CREAT|O_EXCL|O_NOFOLLOW|O_CLOEXEC, 0644);
+
+    /* Not being able to write (not root, entry exists) is fine */
+    if (fd >= 0)
+	close(fd);
+    free(fn);
+}
+
 static int sinfoCmp(const void *a, const void *b)
 {
     const struct rpmsinfo_s *sa = a;
@@ -453,6 +557,7 @@ int rpmvsVerify(struct rpmvs_s *sis, int type,
     int cont = 1;
     int range = 0, vfylevel = sis->vfylevel;
     int verified[3] = { 0, 0, 0 };
+    int cacheable = (sis->cachekey != NULL && type == RPMSIG_VERIFIABLE_TYPE);
 
     /* sort for consistency and rough "better comes first" semantics*/
     qsort(sis->sigs, sis->nsigs, sizeof(*sis->sigs), sinfoCmp);
@@ -469,13 +574,21 @@ int rpmvsVerify(struct rpmvs_s *sis, int type,
 
 	    if (sinfo->ctx) {
 		rpmVerifySignature(sis->keyring, sinfo);
+		RPM_PROBE2(vs_verify, sinfo->descr, sinfo->rc);
 		if (sinfo->rc == RPMRC_OK) {
 		    verified[sinfo->type] |= sinfo->range;
 		    verified[sinfo->strength] |= sinfo->range;
 		}
+	    } else if (sinfo->cached) {
+		verified[sinfo->type] |= sinfo->range;
+		verified[sinfo->strength] |= sinfo->range;
 	    }
 	    range |= sinfo->range;
 	}
+	/* Only cache when everything present over the payload verified */
+	if ((sinfo->range & RPMSIG_PAYLOAD) && sinfo->rc != RPMRC_OK &&
+		!(sinfo->rc == RPMRC_NOTFOUND && sinfo->dig == NULL))
+	    cacheable = 0;
     }
 
     /* Unconditionally reject partially signed packages */
@@ -517,6 +630,10 @@ int rpmvsVerify(struct rpmvs_s *sis, int type,
 	    failed = 1;
     }
 
+    if (cacheable && !failed)
+	cacheStore(sis);
+
+    RPM_PROBE2(vs_done, type, failed);
     return failed;
 }
 
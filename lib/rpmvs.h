@@ -33,6 +33,7 @@ struct rpmsinfo_s {
     /* verify results */
     rpmRC rc;
     char *msg;
+    int cached;		/* result known from the verification cache */
 };
 
 /**
@@ -69,6 +70,20 @@ void rpmvsFiniRange(struct rpmvs_s *sis, int range);
 
 int rpmvsRange(struct rpmvs_s *vs);
 
+/*
+ * Use the verification result cache in %_vscache_dir, if configured.
+ * Only for callers that don't need the payload to be read.
+ */
+void rpmvsEnableCache(struct rpmvs_s *vs);
+
+/*
+ * Look up the package (open on fd) in the verification cache. On hit,
+ * the results of the signatures and digests over the payload are known
+ * and the payload needs no reading. On miss, the results are stored
+ * by a later successful rpmvsVerify().
+ */
+int rpmvsCacheLookup(struct rpmvs_s *vs, FD_t fd, hdrblob sigblob, hdrblob blob);
+
 int rpmvsVerify(struct rpmvs_s *sis, int type,
                        rpmsinfoCb cb, void *cbdata);
 
@@ -0,0 +1,95 @@
+#include "system.h"
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include <rpm/rpmlog.h>
+#include <rpm/rpmmacro.h>
+#include <rpm/rpmstring.h>
+
+#include "lib/rpmworkers.h"
+
+#include "debug.h"
+
+struct rpmworkers_s {
+    rpmworkerFn fn;
+    void *data;
+    int nitems;
+    int next;		/*!< next item to hand out */
+};
+
+struct rpmworker_s {
+    struct rpmworkers_s *w;
+    int slot;
+};
+
+int rpmworkersCount(const char *macro)
+{
+    int nthreads = 1;
+    char *mexpr = rstrscat(NULL, "%{?", macro, "}", NULL);
+    char *val = rpmExpand(mexpr, NULL);
+
+    if (*val) {
+	nthreads = rpmExpandNumeric(mexpr);
+	if (nthreads == 0)
+	    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads < 1)
+	    nthreads = 1;
+    }
+    free(val);
+    free(mexpr);
+    return nthreads;
+}
+
+static void *workerThread(void *arg)
+{
+    struct rpmworker_s *worker = arg;
+    struct rpmworkers_s *w = worker->w;
+    int ix;
+
+    while ((ix = __atomic_fetch_add(&w->next, 1, __ATOMIC_RELAXED)) < w->nitems)
+	w->fn(w->data, ix, worker->slot);
+    return NULL;
+}
+
+void rpmworkersRun(int nthreads, int nitems, rpmworkerFn fn, void *data)
+{
+    struct rpmworkers_s w = {
+	.fn = fn,
+	.data = data,
+	.nitems = nitems,
+	.next = 0,
+    };
+    struct rpmworker_s *workers;
+    pthread_t *threads = NULL;
+    int started = 0;
+
+    if (nthreads > nitems)
+	nthreads = nitems;
+    if (nthreads < 1)
+	nthreads = 1;
+    workers = xcalloc(nthreads, sizeof(*workers));
+    for (int i = 0; i < nthreads; i++) {
+	workers[i].w = &w;
+	workers[i].slot = i;
+    }
+    if (nthreads > 1) {
+	threads = xcalloc(nthreads - 1, sizeof(*threads));
+	for (int i = 0; i < nthreads - 1; i++) {
+	    if (pthread_create(&threads[started], NULL, workerThread,
+			       &workers[started + 1]))
+		break;
+	    started++;
+	}
+	if (started < nthreads - 1)
+	    rpmlog(RPMLOG_DEBUG, "started %d of %d worker threads\n",
+		   started, nthreads - 1);
+    }
+
+    workerThread(&workers[0]);
+
+    for (int i = 0; i < started; i++)
+	pthread_join(threads[i], NULL);
+    free(threads);
+    free(workers);
+}
@@ -0,0 +1,44 @@
+#ifndef RPMWORKERS_H
+#define RPMWORKERS_H
+
+/** \file lib/rpmworkers.h
+ * Run independent work items on a set of short-lived threads.
+ */
+
+#include <rpm/rpmutil.h>
+
+typedef void (*rpmworkerFn)(void *data, int ix, int slot);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Return number of worker threads configured in a macro.
+ * Undefined or negative values mean one (ie serial operation), zero
+ * means one per online CPU.
+ * @param macro		name of macro holding the number of threads
+ * @return		number of threads (>= 1)
+ */
+RPM_GNUC_INTERNAL
+int rpmworkersCount(const char *macro);
+
+/**
+ * Call fn on each of nitems items, spread over nthreads threads.
+ * The calling thread participates, items are handed out in ascending
+ * order but may complete in any order. Returns when all items are done.
+ * fn also gets the slot (0 .. nthreads-1) of the calling thread, for
+ * indexing per-thread data. The caller always runs in slot 0.
+ * @param nthreads	number of threads to use (including caller)
+ * @param nitems	number of items
+ * @param fn		function to call for each item
+ * @param data		data passed to fn
+ */
+RPM_GNUC_INTERNAL
+void rpmworkersRun(int nthreads, int nitems, rpmworkerFn fn, void *data);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* RPMWORKERS_H */
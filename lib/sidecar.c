@@ -0,0 +1,130 @@
+#include "system.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rpm/rpmstring.h>
+
+#include "lib/sidecar.h"
+
+#include "debug.h"
+
+int sidecarTrusted(const struct stat *st)
+{
+    return ((st->st_uid == 0 || st->st_uid == geteuid()) &&
+	    (st->st_mode & (S_IWGRP|S_IWOTH)) == 0);
+}
+
+int sidecarDirTrusted(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    char *dir;
+    struct stat st;
+    int trusted;
+
+    if (slash == NULL)
+	dir = xstrdup(".");
+    else if (slash == path)
+	dir = xstrdup("/");
+    else
+	dir = rstrndup(path, slash - path);
+    trusted = (stat(dir, &st) == 0 && S_ISDIR(st.st_mode) &&
+	       sidecarTrusted(&st));
+    free(dir);
+    return trusted;
+}
+
+void *sidecarMap(const char *path, size_t minsize, size_t *sizep)
+{
+    void *map = NULL;
+    struct stat st;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY|O_CLOEXEC|O_NOFOLLOW)) < 0)
+	return NULL;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+	    st.st_size >= minsize && st.st_size > 0 &&
+	    sidecarTrusted(&st) && sidecarDirTrusted(path)) {
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+	    map = NULL;
+	else
+	    *sizep = st.st_size;
+    }
+    close(fd);
+    return map;
+}
+
+void sidecarUnmap(void *map, size_t size)
+{
+    if (map)
+	munmap(map, size);
+}
+
+void sidecarHeadInit(struct sidecarHead_s *head, const char *magic,
+		     const struct hdrShmId_s *id, uint64_t size)
+{
+    memset(head, 0, sizeof(*head));
+    memcpy(head->magic, magic, sizeof(head->magic));
+    head->id = *id;
+    head->size = size;
+}
+
+int sidecarHeadValid(const void *map, size_t size, const char *magic,
+		     const struct hdrShmId_s *id)
+{
+    const struct sidecarHead_s *head = map;
+
+    return (size >= sizeof(*head) &&
+	    memcmp(head->magic, magic, sizeof(head->magic)) == 0 &&
+	    memcmp(&head->id, id, sizeof(*id)) == 0 &&
+	    head->size == size);
+}
+
+int sidecarWrite(const char *path, int (*writefn)(FILE *fp, void *data),
+		 void *data)
+{
+    char *tmppath = rstrscat(NULL, path, ".XXXXXX", NULL);
+    int created = 0;
+    FILE *fp = NULL;
+    int fd = -1;
+    int rc = -1;
+    int saved;
+
+    if (!sidecarDirTrusted(path)) {
+	errno = EPERM;
+	goto exit;
+    }
+    if ((fd = mkstemp(tmppath)) < 0)
+	goto exit;
+    created = 1;
+    if ((fp = fdopen(fd, "w")) == NULL)
+	goto exit;
+    (void) fchmod(fd, 0644);
+
+    rc = writefn(fp, data);
+    if (ferror(fp))
+	rc = -1;
+    if (fclose(fp))
+	rc = -1;
+    fp = NULL;
+    fd = -1;
+    if (rc == 0)
+	rc = rename(tmppath, path);
+
+exit:
+    saved = errno;
+    if (fp)
+	fclose(fp);
+    else if (fd >= 0)
+	close(fd);
+    if (rc && created)
+	(void) unlink(tmppath);
+    errno = saved;
+    free(tmppath);
+    return rc;
+}
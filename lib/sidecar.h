@@ -0,0 +1,110 @@
+#ifndef SIDECAR_H
+#define SIDECAR_H
+
+/** \file lib/sidecar.h
+ * Cache files kept beside the database.
+ *
+ * The caches derived from a rpmdb (trigger index, file filter, package
+ * list, shared headers) are files in native byte order, like the database
+ * they go with. They start with a common head tying them to the magic of
+ * their format and the state of the database file they were made from.
+ * The files are replaced atomically, and mapped only when neither the
+ * file nor its directory can be written by others than root and the user.
+ */
+
+#include <stdio.h>
+#include <sys/stat.h>
+
+#include <rpm/rpmtypes.h>
+#include <rpm/rpmutil.h>
+
+#include "lib/hdrshm.h"		/* struct hdrShmId_s */
+
+/** Common head of the cache files */
+struct sidecarHead_s {
+    char magic[8];
+    struct hdrShmId_s id;
+    uint64_t size;		/*!< size of the complete file */
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Can a cache file or directory be trusted: owned by root or the user,
+ * and not writable by anybody else?
+ * @param st		file status
+ * @return		1 if trusted, 0 otherwise
+ */
+RPM_GNUC_INTERNAL
+int sidecarTrusted(const struct stat *st);
+
+/**
+ * Is the directory of a cache file trusted?
+ * @param path		cache file path
+ * @return		1 if trusted, 0 otherwise
+ */
+RPM_GNUC_INTERNAL
+int sidecarDirTrusted(const char *path);
+
+/**
+ * Map a trusted cache file read-only.
+ * @param path		cache file path
+ * @param minsize	smallest valid file size
+ * @retval sizep	size of the mapping
+ * @return		mapping, NULL if missing, untrusted or too small
+ */
+RPM_GNUC_INTERNAL
+void *sidecarMap(const char *path, size_t minsize, size_t *sizep);
+
+/**
+ * Unmap a cache file.
+ * @param map		mapping (or NULL)
+ * @param size		size of the mapping
+ */
+RPM_GNUC_INTERNAL
+void sidecarUnmap(void *map, size_t size);
+
+/**
+ * Fill in the common head of a cache file.
+ * @retval head		head
+ * @param magic		format magic, 8 bytes
+ * @param id		identity of the database the cache is made from
+ * @param size		size of the complete file
+ */
+RPM_GNUC_INTERNAL
+void sidecarHeadInit(struct sidecarHead_s *head, const char *magic,
+		     const struct hdrShmId_s *id, uint64_t size);
+
+/**
+ * Is a mapped cache file of this format, complete and made from the
+ * database in this state? The contents are up to the callers to check.
+ * @param map		mapping
+ * @param size		size of the mapping
+ * @param magic		format magic, 8 bytes
+ * @param id		database identity
+ * @return		1 if it is, 0 otherwise
+ */
+RPM_GNUC_INTERNAL
+int sidecarHeadValid(const void *map, size_t size, const char *magic,
+		     const struct hdrShmId_s *id);
+
+/**
+ * Replace a cache file atomically: the contents are written to a new
+ * file in the same directory, which is then renamed over the old one.
+ * Nothing is written to an untrusted directory.
+ * @param path		cache file path
+ * @param writefn	function writing the contents, 0 on success
+ * @param data		data passed to writefn
+ * @return		0 on success, -1 on error (with errno set)
+ */
+RPM_GNUC_INTERNAL
+int sidecarWrite(const char *path, int (*writefn)(FILE *fp, void *data),
+		 void *data);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SIDECAR_H */
@@ -19,6 +19,36 @@ struct headerTagFunc_s {
     headerTagTagFunction func;	/*!< Pointer to formatter function. */	
 };
 
+struct extResult_s {
+    int done;
+    int rc;
+    headerGetFlags hgflags;
+    struct rpmtd_s td;
+};
+
+/*
+ * Extension results of the header being formatted, see
+ * rpmHeaderTagCacheOpen(). Formatting is single threaded per header,
+ * worker threads each get their own cache.
+ */
+static __thread struct extCache_s {
+    Header h;			/*!< Header the cache is for. */
+    int depth;			/*!< Nesting of open calls. */
+    rpmfiles files;		/*!< Shared file info of h. */
+    struct extResult_s *results; /*!< Per extension results. */
+} extCache;
+
+/* File iterator for extensions, the file info is shared while cached */
+static rpmfi extFileIter(Header h)
+{
+    if (h != extCache.h)
+	return rpmfiNew(NULL, h, RPMTAG_BASENAMES, RPMFI_NOHEADER);
+
+    if (extCache.files == NULL)
+	extCache.files = rpmfilesNew(NULL, h, RPMTAG_BASENAMES, RPMFI_NOHEADER);
+    return rpmfilesIter(extCache.files, RPMFI_ITER_FWD);
+}
+
 /** \ingroup rpmfi
  * Retrieve file names from header.
  *
@@ -134,7 +164,7 @@ exit:
 
 static int filedepTag(Header h, rpmTag tagN, rpmtd td, headerGetFlags hgflags)
 {
-    rpmfi fi = rpmfiNew(NULL, h, RPMTAG_BASENAMES, RPMFI_NOHEADER);
+    rpmfi fi = extFileIter(h);
     rpmds ds = NULL;
     char **fdeps = NULL;
     int numfiles;
@@ -489,7 +519,7 @@ static char *makeFClass(rpmfi fi)
  */
 static int fileclassTag(Header h, rpmtd td, headerGetFlags hgflags)
 {
-    rpmfi fi = rpmfiNew(NULL, h, RPMTAG_BASENAMES, RPMFI_NOHEADER);
+    rpmfi fi = extFileIter(h);
     int numfiles = rpmfiFC(fi);
 
     if (numfiles > 0) {
@@ -961,7 +991,7 @@ static int conflictnevrsTag(Header h, rpmtd td, headerGetFlags hgflags)
 
 static int filenlinksTag(Header h, rpmtd td, headerGetFlags hgflags)
 {
-    rpmfi fi = rpmfiNew(NULL, h, RPMTAG_BASENAMES, RPMFI_NOHEADER);
+    rpmfi fi = extFileIter(h);
     rpm_count_t fc = rpmfiFC(fi);
 
     if (fc > 0) {
@@ -1022,17 +1052,75 @@ static const struct headerTagFunc_s rpmHeaderTagExtensions[] = {
     { 0, 			NULL }
 };
 
-headerTagTagFunction rpmHeaderTagFunc(rpmTagVal tag)
+#define NEXTENSIONS \
+    (sizeof(rpmHeaderTagExtensions) / sizeof(*rpmHeaderTagExtensions) - 1)
+
+static const struct headerTagFunc_s * findExtension(rpmTagVal tag)
 {
     const struct headerTagFunc_s * ext;
-    headerTagTagFunction func = NULL;
 
     for (ext = rpmHeaderTagExtensions; ext->func != NULL; ext++) {
-	if (ext->tag == tag) {
-	    func = ext->func;
-	    break;
-	}
+	if (ext->tag == tag)
+	    return ext;
+    }
+    return NULL;
+}
+
+/*
+ * Compute an extension only once for the cached header. The results
+ * are handed out borrowed, they live until the cache is closed.
+ */
+static int cachedTagFunc(Header h, rpmtd td, headerGetFlags hgflags)
+{
+    const struct headerTagFunc_s * ext = findExtension(td->tag);
+    struct extResult_s *res;
+
+    if (h != extCache.h)
+	return ext->func(h, td, hgflags);
+
+    if (extCache.results == NULL)
+	extCache.results = xcalloc(NEXTENSIONS, sizeof(*extCache.results));
+    res = &extCache.results[ext - rpmHeaderTagExtensions];
+
+    if (!res->done || res->hgflags != hgflags) {
+	rpmtdFreeData(&res->td);
+	res->td.tag = td->tag;
+	res->rc = ext->func(h, &res->td, hgflags);
+	res->hgflags = hgflags;
+	res->done = 1;
+    }
+
+    *td = res->td;
+    td->flags &= ~(RPMTD_ALLOCED | RPMTD_PTR_ALLOCED);
+    return res->rc;
+}
+
+headerTagTagFunction rpmHeaderTagFunc(rpmTagVal tag)
+{
+    const struct headerTagFunc_s * ext = findExtension(tag);
+
+    if (ext == NULL)
+	return NULL;
+    return (extCache.h != NULL) ? cachedTagFunc : ext->func;
+}
+
+void rpmHeaderTagCacheOpen(Header h)
+{
+    if (extCache.depth++ == 0)
+	extCache.h = headerLink(h);
+}
+
+void rpmHeaderTagCacheClose(void)
+{
+    if (extCache.depth == 0 || --extCache.depth > 0)
+	return;
+
+    if (extCache.results) {
+	for (size_t i = 0; i < NEXTENSIONS; i++)
+	    rpmtdFreeData(&extCache.results[i].td);
+	extCache.results = _free(extCache.results);
     }
-    return func;
+    extCache.files = rpmfilesFree(extCache.files);
+    extCache.h = headerFree(extCache.h);
 }
 
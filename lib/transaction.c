@@ -7,6 +7,8 @@
 #include <inttypes.h>
 #include <libgen.h>
 #include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
 #include <sys/statvfs.h>
 #include <fcntl.h>
 
@@ -30,15 +32,23 @@
 #include <rpm/rpmkeyring.h>
 
 #include "lib/fprint.h"
+#include "lib/fsm.h"
 #include "lib/misc.h"
+#include "lib/payloadcache.h"
+#include "lib/tsrecord.h"
 #include "lib/rpmchroot.h"
+#include "lib/rpmug.h"
 #include "lib/rpmlock.h"
 #include "lib/rpmds_internal.h"
 #include "lib/rpmfi_internal.h"	/* only internal apis */
 #include "lib/rpmte_internal.h"	/* only internal apis */
 #include "lib/rpmts_internal.h"
 #include "lib/rpmvs.h"
+#include "lib/rpmworkers.h"
+#include "lib/rpmtrace.h"
+#include "lib/rpmprobes.h"
 #include "rpmio/rpmhook.h"
+#include "rpmio/rpmio_internal.h"	/* rpmKeyringCopy */
 #include "lib/rpmtriggers.h"
 
 #include "lib/rpmplugins.h"
@@ -221,51 +231,103 @@ static int rpmtsGetDSIRotational(rpmts ts)
     return rc;
 }
 
-static void rpmtsUpdateDSI(const rpmts ts, dev_t dev, const char *dirName,
-		rpm_loff_t fileSize, rpm_loff_t prevSize, rpm_loff_t fixupSize,
-		rpmFileAction action)
-{
+/*
+ * Disk space changes of a group of files on one device, collected
+ * without touching the DSI and applied in one go. The lowest running
+ * totals are tracked too, so the shrink bookkeeping comes out the same
+ * as when updating the DSI for each file.
+ */
+struct dsiDelta_s {
+    dev_t dev;
+    int dsix;			/* index in ts->dsi, -1 if not found (yet) */
+    int64_t bsize;
     int64_t bneeded;
+    int64_t ineeded;
+    int64_t bdelta;
+    int64_t idelta;
+    int64_t bmin;
+    int64_t imin;
+};
+
+static int dsiDeltaInit(rpmts ts, struct dsiDelta_s *d, dev_t dev,
+			const char *dirName)
+{
     rpmDiskSpaceInfo dsi = rpmtsGetDSI(ts, dev, dirName);
-    if (dsi == NULL)
-	return;
 
-    bneeded = BLOCK_ROUND(fileSize, dsi->bsize);
+    memset(d, 0, sizeof(*d));
+    d->dev = dev;
+    d->dsix = dsi ? dsi - ts->dsi : -1;
+    d->bsize = dsi ? dsi->bsize : 0;
+    return d->dsix;
+}
+
+static void dsiDeltaAdd(struct dsiDelta_s *d,
+		rpm_loff_t fileSize, rpm_loff_t prevSize, rpm_loff_t fixupSize,
+		rpmFileAction action)
+{
+    int64_t bneeded = BLOCK_ROUND(fileSize, d->bsize);
 
     switch (action) {
     case FA_BACKUP:
     case FA_SAVE:
     case FA_ALTNAME:
-	dsi->ineeded++;
-	dsi->bneeded += bneeded;
+	d->ineeded++;
+	d->bneeded += bneeded;
 	break;
 
     case FA_CREATE:
-	dsi->bneeded += bneeded;
-	dsi->ineeded++;
+	d->bneeded += bneeded;
+	d->ineeded++;
 	if (prevSize) {
-	    dsi->bdelta += BLOCK_ROUND(prevSize - 1, dsi->bsize);
-	    dsi->idelta++;
+	    d->bdelta += BLOCK_ROUND(prevSize - 1, d->bsize);
+	    d->idelta++;
 	}
 	if (fixupSize) {
-	    dsi->bdelta += BLOCK_ROUND(fixupSize - 1, dsi->bsize);
-	    dsi->idelta++;
+	    d->bdelta += BLOCK_ROUND(fixupSize - 1, d->bsize);
+	    d->idelta++;
 	}
 
 	break;
 
     case FA_ERASE:
-	dsi->ineeded--;
-	dsi->bneeded -= bneeded;
+	d->ineeded--;
+	d->bneeded -= bneeded;
 	break;
 
     default:
 	break;
     }
 
+    if (d->bneeded < d->bmin) d->bmin = d->bneeded;
+    if (d->ineeded < d->imin) d->imin = d->ineeded;
+}
+
+static void dsiDeltaApply(rpmts ts, struct dsiDelta_s *d)
+{
+    rpmDiskSpaceInfo dsi = ts->dsi + d->dsix;
+
     /* adjust bookkeeping when requirements shrink */
-    if (dsi->bneeded < dsi->obneeded) dsi->obneeded = dsi->bneeded;
-    if (dsi->ineeded < dsi->oineeded) dsi->oineeded = dsi->ineeded;
+    if (dsi->bneeded + d->bmin < dsi->obneeded)
+	dsi->obneeded = dsi->bneeded + d->bmin;
+    if (dsi->ineeded + d->imin < dsi->oineeded)
+	dsi->oineeded = dsi->ineeded + d->imin;
+
+    dsi->bneeded += d->bneeded;
+    dsi->ineeded += d->ineeded;
+    dsi->bdelta += d->bdelta;
+    dsi->idelta += d->idelta;
+}
+
+static void rpmtsUpdateDSI(const rpmts ts, dev_t dev, const char *dirName,
+		rpm_loff_t fileSize, rpm_loff_t prevSize, rpm_loff_t fixupSize,
+		rpmFileAction action)
+{
+    struct dsiDelta_s d;
+
+    if (dsiDeltaInit(ts, &d, dev, dirName) < 0)
+	return;
+    dsiDeltaAdd(&d, fileSize, prevSize, fixupSize, action);
+    dsiDeltaApply(ts, &d);
 }
 
 static void rpmtsCheckDSIProblems(const rpmts ts, const rpmte te)
@@ -368,6 +430,15 @@ static int handleRemovalConflict(rpmfiles fi, int fx, rpmfiles ofi, int ofx)
     return rConflicts;
 }
 
+/* Count a file conflict resolution step, from any thread */
+static void fileOpCount(rpmts ts, rpmtsOpX opx, rpm_loff_t bytes)
+{
+    rpmop op = rpmtsOp(ts, opx);
+    __atomic_add_fetch(&op->count, 1, __ATOMIC_RELAXED);
+    if (bytes)
+	__atomic_add_fetch(&op->bytes, bytes, __ATOMIC_RELAXED);
+}
+
 /*
  * Elf files can be "colored", and if enabled in the transaction, the
  * color can be used to resolve conflicts between elf-64bit and elf-32bit
@@ -383,7 +454,8 @@ static int handleColorConflict(rpmts ts,
     int rConflicts = 1;
     rpm_color_t tscolor = rpmtsColor(ts);
 
-    if (tscolor != 0) {
+    /* Most file sets have no colored files at all */
+    if ((rpmfilesColor(fi) & tscolor) && (rpmfilesColor(ofi) & tscolor)) {
 	rpm_color_t fcolor = rpmfilesFColor(fi, fx) & tscolor;
 	rpm_color_t ofcolor = rpmfilesFColor(ofi, ofx) & tscolor;
 
@@ -404,6 +476,9 @@ static int handleColorConflict(rpmts ts,
 	}
     }
 
+    if (rConflicts == 0)
+	fileOpCount(ts, RPMTS_OP_FILECOLOR, 0);
+
     return rConflicts;
 }
 
@@ -416,12 +491,13 @@ static int handleColorConflict(rpmts ts,
  * @param otherHeader	header containing the matching file
  * @param otherFi	matching file info set
  * @param ofx		matching file index
+ * @param onum		matching file index in otherHeader
  * @param beingRemoved  file being removed (installed otherwise)
  */
 /* XXX only ts->{probs,rpmdb} modified */
 static void handleInstInstalledFile(const rpmts ts, rpmte p, rpmfiles fi, int fx,
 				   Header otherHeader, rpmfiles otherFi, int ofx,
-				   int beingRemoved)
+				   int onum, int beingRemoved)
 {
     rpmfs fs = rpmteGetFileStates(p);
     int isCfgFile = ((rpmfilesFFlags(otherFi, ofx) | rpmfilesFFlags(fi, fx)) & RPMFILE_CONFIG);
@@ -435,6 +511,7 @@ static void handleInstInstalledFile(const rpmts ts, rpmte p, rpmfiles fi, int fx
     if (rpmfilesFState(otherFi, ofx) == RPMFILE_STATE_NOTINSTALLED)
 	return;
 
+    fileOpCount(ts, RPMTS_OP_FILECMP, 0);
     if (rpmfilesCompare(otherFi, ofx, fi, fx)) {
 	int rConflicts = 1;
 	char rState = RPMFILE_STATE_REPLACED;
@@ -481,7 +558,7 @@ static void handleInstInstalledFile(const rpmts ts, rpmte p, rpmfiles fi, int fx
 	if ( !(isCfgFile || XFA_SKIPPING(rpmfsGetAction(fs, fx))) ) {
 	    if (!beingRemoved)
 		rpmfsAddReplaced(rpmteGetFileStates(p), fx, rState,
-				 headerGetInstance(otherHeader), ofx);
+				 headerGetInstance(otherHeader), onum);
 	}
     }
 
@@ -508,215 +585,286 @@ static void handleInstInstalledFile(const rpmts ts, rpmte p, rpmfiles fi, int fx
 	if ((!isCfgFile) && (rpmfsGetAction(fs, fx) == FA_UNKNOWN)) {
 	    /* XXX fsm can't handle FA_TOUCH of hardlinked files */
 	    int nolinks = (nlink == 1 && rpmfilesFNlink(fi, fx) == 1);
-	    if (nolinks && rpmfileContentsEqual(otherFi, ofx, fi, fx))
-	       rpmfsSetAction(fs, fx, FA_TOUCH);
+	    /* Only files the headers agree on are worth reading */
+	    if (nolinks && rpmfilesHeaderEqual(otherFi, ofx, fi, fx)) {
+		fileOpCount(ts, RPMTS_OP_FILEREAD, rpmfilesFSize(fi, fx));
+		if (rpmfileContentsEqual(otherFi, ofx, fi, fx))
+		    rpmfsSetAction(fs, fx, FA_TOUCH);
+	    }
 	}
     }
 }
 
+/* Outcome of overlapped file handling, for the serial bookkeeping pass */
+struct overlapFile_s {
+    fingerPrint *fp;		/*!< fingerprint in cache (or NULL) */
+    rpmte conflictTe;		/*!< element with a conflicting file */
+    rpm_loff_t fixupSize;	/*!< size fixup for disk accounting */
+    rpmFileAction action;	/*!< file action after handling */
+    int handled;		/*!< was the file looked at? */
+};
+
 /**
- * Update disk space needs on each partition for this package's files.
+ * Decide the fate of a file against other transaction elements with the
+ * same fingerprint. Only files sharing the fingerprint are accessed, so
+ * files with different fingerprints can be handled concurrently.
  */
-/* XXX only ts->{probs,di} modified */
-static void handleOverlappedFiles(rpmts ts, fingerPrintCache fpc, rpmte p, rpmfiles fi)
+static void handleOverlappedFile(rpmts ts, fingerPrintCache fpc, rpmte p,
+				 rpmfiles fi, int i, struct overlapFile_s *ovl)
 {
     rpm_loff_t fixupSize = 0;
-    int i, j;
+    int j;
     rpmfs fs = rpmteGetFileStates(p);
     rpmfs otherFs;
-    rpm_count_t fc = rpmfilesFC(fi);
     int reportConflicts = !(rpmtsFilterFlags(ts) & RPMPROB_FILTER_REPLACENEWFILES);
     fingerPrint * fpList = rpmfilesFps(fi);
+    int otherPkgNum, otherFileNum;
+    rpmfiles otherFi;
+    rpmte otherTe;
+    rpmfileAttrs FFlags;
+    struct rpmffi_s * recs;
+    int numRecs;
 
-    for (i = 0; i < fc; i++) {
-	struct fingerPrint_s * fiFps;
-	int otherPkgNum, otherFileNum;
-	rpmfiles otherFi;
-	rpmte otherTe;
-	rpmfileAttrs FFlags;
-	struct rpmffi_s * recs;
-	int numRecs;
-	rpm_loff_t fileSize;
-	int nlink;
-	const int *links;
-
-	if (XFA_SKIPPING(rpmfsGetAction(fs, i)))
-	    continue;
-
-	FFlags = rpmfilesFFlags(fi, i);
+    FFlags = rpmfilesFFlags(fi, i);
 
-	fixupSize = 0;
-
-	/*
-	 * Retrieve all records that apply to this file. Note that the
-	 * file info records were built in the same order as the packages
-	 * will be installed and removed so the records for an overlapped
-	 * files will be sorted in exactly the same order.
-	 */
-	fiFps = fpCacheGetByFp(fpc, fpList, i, &recs, &numRecs);
+    /*
+     * Retrieve all records that apply to this file. Note that the
+     * file info records were built in the same order as the packages
+     * will be installed and removed so the records for an overlapped
+     * files will be sorted in exactly the same order.
+     */
+    ovl->fp = fpCacheGetByFp(fpc, fpList, i, &recs, &numRecs);
+    ovl->handled = 1;
 
-	/*
-	 * If this package is being added, look only at other packages
-	 * being added -- removed packages dance to a different tune.
-	 *
-	 * If both this and the other package are being added, overlapped
-	 * files must be identical (or marked as a conflict). The
-	 * disposition of already installed config files leads to
-	 * a small amount of extra complexity.
-	 *
-	 * If this package is being removed, then there are two cases that
-	 * need to be worried about:
-	 * If the other package is being added, then skip any overlapped files
-	 * so that this package removal doesn't nuke the overlapped files
-	 * that were just installed.
-	 * If both this and the other package are being removed, then each
-	 * file removal from preceding packages needs to be skipped so that
-	 * the file removal occurs only on the last occurrence of an overlapped
-	 * file in the transaction set.
-	 *
-	 */
+    /*
+     * If this package is being added, look only at other packages
+     * being added -- removed packages dance to a different tune.
+     *
+     * If both this and the other package are being added, overlapped
+     * files must be identical (or marked as a conflict). The
+     * disposition of already installed config files leads to
+     * a small amount of extra complexity.
+     *
+     * If this package is being removed, then there are two cases that
+     * need to be worried about:
+     * If the other package is being added, then skip any overlapped files
+     * so that this package removal doesn't nuke the overlapped files
+     * that were just installed.
+     * If both this and the other package are being removed, then each
+     * file removal from preceding packages needs to be skipped so that
+     * the file removal occurs only on the last occurrence of an overlapped
+     * file in the transaction set.
+     *
+     */
 
-	/*
-	 * Locate this overlapped file in the set of added/removed packages,
-	 * including the package owning it: a package can have self-conflicting
-	 * files when directory symlinks are present. Don't compare a file
-	 * with itself though...
-	 */
-	for (j = 0; j < numRecs && !(recs[j].p == p && recs[j].fileno == i); j++)
-	    {};
-
-	/* Find what the previous disposition of this file was. */
-	otherFileNum = -1;			/* keep gcc quiet */
-	otherFi = NULL;
-	otherTe = NULL;
-	otherFs = NULL;
-
-	for (otherPkgNum = j - 1; otherPkgNum >= 0; otherPkgNum--) {
-	    otherTe = recs[otherPkgNum].p;
-	    otherFileNum = recs[otherPkgNum].fileno;
-	    otherFs = rpmteGetFileStates(otherTe);
-
-	    /* Added packages need only look at other added packages. */
-	    if (rpmteType(p) == TR_ADDED && rpmteType(otherTe) != TR_ADDED)
-		continue;
+    /*
+     * Locate this overlapped file in the set of added/removed packages,
+     * including the package owning it: a package can have self-conflicting
+     * files when directory symlinks are present. Don't compare a file
+     * with itself though...
+     */
+    for (j = 0; j < numRecs && !(recs[j].p == p && recs[j].fileno == i); j++)
+	{};
+
+    /* Find what the previous disposition of this file was. */
+    otherFileNum = -1;			/* keep gcc quiet */
+    otherFi = NULL;
+    otherTe = NULL;
+    otherFs = NULL;
+
+    for (otherPkgNum = j - 1; otherPkgNum >= 0; otherPkgNum--) {
+	otherTe = recs[otherPkgNum].p;
+	otherFileNum = recs[otherPkgNum].fileno;
+	otherFs = rpmteGetFileStates(otherTe);
+
+	/* Added packages need only look at other added packages. */
+	if (rpmteType(p) == TR_ADDED && rpmteType(otherTe) != TR_ADDED)
+	    continue;
 
-	    /* XXX Happens iff fingerprint for incomplete package install. */
-	    if (rpmfsGetAction(otherFs, otherFileNum) != FA_UNKNOWN) {
-		otherFi = rpmteFiles(otherTe);
-		break;
-	    }
+	/* XXX Happens iff fingerprint for incomplete package install. */
+	if (rpmfsGetAction(otherFs, otherFileNum) != FA_UNKNOWN) {
+	    otherFi = rpmteFiles(otherTe);
+	    break;
 	}
+    }
 
-	switch (rpmteType(p)) {
-	case TR_ADDED:
-	    if (otherPkgNum < 0) {
-		/* XXX is this test still necessary? */
-		rpmFileAction action;
-		if (rpmfsGetAction(fs, i) != FA_UNKNOWN)
-		    break;
-		if (rpmfilesConfigConflict(fi, i)) {
-		    /* Here is a non-overlapped pre-existing config file. */
-		    action = (FFlags & RPMFILE_NOREPLACE) ?
-			      FA_ALTNAME : FA_BACKUP;
-		} else {
-		    action = FA_CREATE;
-		}
-		rpmfsSetAction(fs, i, action);
+    switch (rpmteType(p)) {
+    case TR_ADDED:
+	if (otherPkgNum < 0) {
+	    /* XXX is this test still necessary? */
+	    rpmFileAction action;
+	    if (rpmfsGetAction(fs, i) != FA_UNKNOWN)
 		break;
+	    if (rpmfilesConfigConflict(fi, i)) {
+		/* Here is a non-overlapped pre-existing config file. */
+		action = (FFlags & RPMFILE_NOREPLACE) ?
+			  FA_ALTNAME : FA_BACKUP;
+	    } else {
+		action = FA_CREATE;
 	    }
+	    rpmfsSetAction(fs, i, action);
+	    break;
+	}
 
-assert(otherFi != NULL);
-	    /* Mark added overlapped non-identical files as a conflict. */
-	    if (rpmfilesCompare(otherFi, otherFileNum, fi, i)) {
-		int rConflicts;
+	assert(otherFi != NULL);
+	fileOpCount(ts, RPMTS_OP_FILECMP, 0);
+	/* Mark added overlapped non-identical files as a conflict. */
+	if (rpmfilesCompare(otherFi, otherFileNum, fi, i)) {
+	    int rConflicts;
 
-		/* If enabled, resolve colored conflicts to preferred type */
-		rConflicts = handleColorConflict(ts, fs, fi, i,
-						otherFs, otherFi, otherFileNum);
+	    /* If enabled, resolve colored conflicts to preferred type */
+	    rConflicts = handleColorConflict(ts, fs, fi, i,
+					    otherFs, otherFi, otherFileNum);
 
-		if (rConflicts && reportConflicts) {
-		    char *fn = rpmfilesFN(fi, i);
-		    rpmteAddProblem(p, RPMPROB_NEW_FILE_CONFLICT,
-				    rpmteNEVRA(otherTe), fn, 0);
-		    free(fn);
-		}
-	    } else {
-		/* Skip create on all but the first instance of a shared file */
-		rpmFileAction oaction = rpmfsGetAction(otherFs, otherFileNum);
-		if (oaction != FA_UNKNOWN && !XFA_SKIPPING(oaction)) {
-		    rpmfileAttrs oflags;
-		    /* ...but ghosts aren't really created so... */
-		    oflags = rpmfilesFFlags(otherFi, otherFileNum);
-		    if (!(oflags & RPMFILE_GHOST)) {
-			rpmfsSetAction(fs, i, FA_SKIP);
-		    }
-		/* if the other file is color skipped then skip this file too */
-		} else if (oaction == FA_SKIPCOLOR) {
-		    rpmfsSetAction(fs, i, FA_SKIPCOLOR);
+	    if (rConflicts && reportConflicts)
+		ovl->conflictTe = otherTe;
+	} else {
+	    /* Skip create on all but the first instance of a shared file */
+	    rpmFileAction oaction = rpmfsGetAction(otherFs, otherFileNum);
+	    if (oaction != FA_UNKNOWN && !XFA_SKIPPING(oaction)) {
+		rpmfileAttrs oflags;
+		/* ...but ghosts aren't really created so... */
+		oflags = rpmfilesFFlags(otherFi, otherFileNum);
+		if (!(oflags & RPMFILE_GHOST)) {
+		    rpmfsSetAction(fs, i, FA_SKIP);
 		}
+	    /* if the other file is color skipped then skip this file too */
+	    } else if (oaction == FA_SKIPCOLOR) {
+		rpmfsSetAction(fs, i, FA_SKIPCOLOR);
 	    }
+	}
 
-	    /* Skipped files dont need fixup size or backups, %config or not */
-	    if (XFA_SKIPPING(rpmfsGetAction(fs, i)))
-		break;
+	/* Skipped files dont need fixup size or backups, %config or not */
+	if (XFA_SKIPPING(rpmfsGetAction(fs, i)))
+	    break;
 
-	    /* Try to get the disk accounting correct even if a conflict. */
-	    /* Add one to make sure the size is not zero */
-	    fixupSize = rpmfilesFSize(otherFi, otherFileNum) + 1;
+	/* Try to get the disk accounting correct even if a conflict. */
+	/* Add one to make sure the size is not zero */
+	fixupSize = rpmfilesFSize(otherFi, otherFileNum) + 1;
 
-	    if (rpmfilesConfigConflict(fi, i)) {
-		/* Here is an overlapped  pre-existing config file. */
-		rpmFileAction action;
-		action = (FFlags & RPMFILE_NOREPLACE) ? FA_ALTNAME : FA_SKIP;
-		rpmfsSetAction(fs, i, action);
-	    } else {
-		/* If not decided yet, create it */
-		if (rpmfsGetAction(fs, i) == FA_UNKNOWN)
-		    rpmfsSetAction(fs, i, FA_CREATE);
-	    }
-	    break;
+	if (rpmfilesConfigConflict(fi, i)) {
+	    /* Here is an overlapped  pre-existing config file. */
+	    rpmFileAction action;
+	    action = (FFlags & RPMFILE_NOREPLACE) ? FA_ALTNAME : FA_SKIP;
+	    rpmfsSetAction(fs, i, action);
+	} else {
+	    /* If not decided yet, create it */
+	    if (rpmfsGetAction(fs, i) == FA_UNKNOWN)
+		rpmfsSetAction(fs, i, FA_CREATE);
+	}
+	break;
 
-	case TR_REMOVED:
-	    if (otherPkgNum >= 0) {
-		assert(otherFi != NULL);
-                /* Here is an overlapped added file we don't want to nuke. */
-		if (rpmfsGetAction(otherFs, otherFileNum) != FA_ERASE) {
-		    /* On updates, don't remove files. */
-		    rpmfsSetAction(fs, i, FA_SKIP);
-		    break;
-		}
-		/* Here is an overlapped removed file: skip in previous. */
-		rpmfsSetAction(otherFs, otherFileNum, FA_SKIP);
-	    }
-	    if (XFA_SKIPPING(rpmfsGetAction(fs, i)))
-		break;
-	    if (rpmfilesFState(fi, i) != RPMFILE_STATE_NORMAL) {
+    case TR_REMOVED:
+	if (otherPkgNum >= 0) {
+	    assert(otherFi != NULL);
+	    /* Here is an overlapped added file we don't want to nuke. */
+	    if (rpmfsGetAction(otherFs, otherFileNum) != FA_ERASE) {
+		/* On updates, don't remove files. */
 		rpmfsSetAction(fs, i, FA_SKIP);
 		break;
 	    }
-		
-	    /* Pre-existing modified config files need to be saved. */
-	    if (rpmfilesConfigConflict(fi, i)) {
-		rpmfsSetAction(fs, i, FA_SAVE);
-		break;
-	    }
+	    /* Here is an overlapped removed file: skip in previous. */
+	    rpmfsSetAction(otherFs, otherFileNum, FA_SKIP);
+	}
+	if (XFA_SKIPPING(rpmfsGetAction(fs, i)))
+	    break;
+	if (rpmfilesFState(fi, i) != RPMFILE_STATE_NORMAL) {
+	    rpmfsSetAction(fs, i, FA_SKIP);
+	    break;
+	}
 	
-	    /* Otherwise, we can just erase. */
-	    rpmfsSetAction(fs, i, FA_ERASE);
+	/* Pre-existing modified config files need to be saved. */
+	if (rpmfilesConfigConflict(fi, i)) {
+	    rpmfsSetAction(fs, i, FA_SAVE);
 	    break;
-	case TR_RESTORED:
-	    if (XFA_SKIPPING(rpmfsGetAction(fs, i)))
-		break;
-	    if (rpmfilesFState(fi, i) != RPMFILE_STATE_NORMAL) {
-		rpmfsSetAction(fs, i, FA_SKIP);
-		break;
-	    }
-	    rpmfsSetAction(fs, i, FA_TOUCH);
+	}
+
+	/* Otherwise, we can just erase. */
+	rpmfsSetAction(fs, i, FA_ERASE);
+	break;
+    case TR_RESTORED:
+	if (XFA_SKIPPING(rpmfsGetAction(fs, i)))
 	    break;
-	default:
+	if (rpmfilesFState(fi, i) != RPMFILE_STATE_NORMAL) {
+	    rpmfsSetAction(fs, i, FA_SKIP);
 	    break;
 	}
-	rpmfilesFree(otherFi);
+	rpmfsSetAction(fs, i, FA_TOUCH);
+	break;
+    default:
+	break;
+    }
+    rpmfilesFree(otherFi);
+
+    ovl->fixupSize = fixupSize;
+    ovl->action = rpmfsGetAction(fs, i);
+}
+
+struct overlapPkg_s {
+    rpmte p;
+    rpmfiles fi;
+    struct overlapFile_s *files;
+};
+
+struct overlapWork_s {
+    rpmts ts;
+    fingerPrintCache fpc;
+    struct overlapPkg_s *pkgs;
+    int npkgs;
+    int nshards;
+};
+
+/* Handle all files of the transaction falling into one fingerprint shard */
+static void handleOverlappedShard(void *data, int shard, int slot)
+{
+    struct overlapWork_s *work = data;
+
+    for (int n = 0; n < work->npkgs; n++) {
+	struct overlapPkg_s *pkg = &work->pkgs[n];
+	rpmfs fs = rpmteGetFileStates(pkg->p);
+	fingerPrint *fpList = rpmfilesFps(pkg->fi);
+	int fc = rpmfilesFC(pkg->fi);
+
+	for (int i = 0; i < fc; i++) {
+	    if (XFA_SKIPPING(rpmfsGetAction(fs, i)))
+		continue;
+	    if (work->nshards > 1 &&
+		    fpCacheShard(work->fpc, fpList, i) != shard)
+		continue;
+	    handleOverlappedFile(work->ts, work->fpc, pkg->p, pkg->fi, i,
+				 &pkg->files[i]);
+	}
+    }
+}
+
+/**
+ * Update disk space needs on each partition for this package's files.
+ */
+/* XXX only ts->{probs,di} modified */
+static void handleOverlappedFiles(rpmts ts, fingerPrintCache fpc, rpmte p,
+				  rpmfiles fi, struct overlapFile_s *files)
+{
+    rpm_count_t fc = rpmfilesFC(fi);
+    struct dsiDelta_s *deltas = NULL;
+    int ndeltas = 0;
+    int last = -1;
+
+    for (int i = 0; i < fc; i++) {
+	struct overlapFile_s *ovl = &files[i];
+	rpm_loff_t fileSize, fixupSize = ovl->fixupSize;
+	int nlink;
+	const int *links;
+	dev_t dev;
+
+	if (!ovl->handled)
+	    continue;
+
+	if (ovl->conflictTe) {
+	    char *fn = rpmfilesFN(fi, i);
+	    rpmteAddProblem(p, RPMPROB_NEW_FILE_CONFLICT,
+			    rpmteNEVRA(ovl->conflictTe), fn, 0);
+	    free(fn);
+	}
 
 	fileSize = rpmfilesFSize(fi, i);
 	nlink = rpmfilesFLinks(fi, i, &links);
@@ -725,12 +873,38 @@ assert(otherFi != NULL);
 	    fileSize = 0;
 	    fixupSize = fixupSize ? 1 : 0;
 	}
-	/* Update disk space info for a file. */
-	rpmtsUpdateDSI(ts, fpEntryDev(fpc, fiFps), fpEntryDir(fpc, fiFps),
-		       fileSize, rpmfilesFReplacedSize(fi, i),
-		       fixupSize, rpmfsGetAction(fs, i));
 
+	if (ts->dsi == NULL)
+	    continue;
+
+	/* Collect disk space changes per device, packages rarely span many */
+	dev = fpEntryDev(fpc, ovl->fp);
+	if (last < 0 || deltas[last].dev != dev) {
+	    for (last = 0; last < ndeltas; last++) {
+		if (deltas[last].dev == dev)
+		    break;
+	    }
+	    if (last == ndeltas) {
+		deltas = xrealloc(deltas, (ndeltas + 1) * sizeof(*deltas));
+		deltas[ndeltas].dev = dev;
+		deltas[ndeltas++].dsix = -1;
+	    }
+	}
+	/* Devices whose DSI couldn't be set up are retried from other dirs */
+	if (deltas[last].dsix < 0 &&
+		dsiDeltaInit(ts, &deltas[last], dev, fpEntryDir(fpc, ovl->fp)) < 0)
+	    continue;
+
+	dsiDeltaAdd(&deltas[last], fileSize, rpmfilesFReplacedSize(fi, i),
+		    fixupSize, ovl->action);
     }
+
+    /* Update disk space info once per device */
+    for (int i = 0; i < ndeltas; i++) {
+	if (deltas[i].dsix >= 0)
+	    dsiDeltaApply(ts, &deltas[i]);
+    }
+    free(deltas);
 }
 
 /**
@@ -1008,7 +1182,7 @@ static void skipInstallFiles(const rpmts ts, rpmfiles files, rpmfs fs)
 #define HASHTYPE rpmStringSet
 #define HTKEYTYPE rpmsid
 #include "lib/rpmhash.H"
-#include "lib/rpmhash.C"
+#include "lib/rpmhashoa.C"
 
 static unsigned int sidHash(rpmsid sid)
 {
@@ -1020,6 +1194,69 @@ static int sidCmp(rpmsid a, rpmsid b)
     return (a != b);
 }
 
+/* Number of basenames looked up from the rpmdb at a time */
+#define BASENAME_BATCH 256
+
+/* Default number of unique basenames for scanning the whole index */
+#define BASENAME_MERGEJOIN 20000
+
+struct baseNameKey_s {
+    const char *key;
+    size_t keylen;
+};
+
+/* Order of the rpmdb index keys: byte-wise, a prefix first */
+static int baseNameKeyCmp(const void *a, const void *b)
+{
+    const struct baseNameKey_s *x = a, *y = b;
+    int rc = memcmp(x->key, y->key,
+		    (x->keylen < y->keylen) ? x->keylen : y->keylen);
+    if (rc == 0)
+	rc = (x->keylen > y->keylen) - (x->keylen < y->keylen);
+    return rc;
+}
+
+/*
+ * With lots of basenames, walk the index in key order once instead of
+ * looking each of them up. Undefined or 0 uses the default, a negative
+ * value always looks them up.
+ */
+static int useMergeJoin(int nkeys)
+{
+    int min = rpmExpandNumeric("%{?_basenames_mergejoin}");
+    if (min == 0)
+	min = BASENAME_MERGEJOIN;
+    return (min > 0 && nkeys >= min);
+}
+
+static void extendBaseNames(rpmdbMatchIterator mi,
+			    struct baseNameKey_s *bnkeys, int nkeys)
+{
+    const char **keys = xmalloc((nkeys + 1) * sizeof(*keys));
+    size_t *keylens = xmalloc((nkeys + 1) * sizeof(*keylens));
+    int sorted = useMergeJoin(nkeys);
+
+    if (sorted)
+	qsort(bnkeys, nkeys, sizeof(*bnkeys), baseNameKeyCmp);
+
+    for (int i = 0; i < nkeys; i++) {
+	keys[i] = bnkeys[i].key;
+	keylens[i] = bnkeys[i].keylen;
+    }
+
+    if (sorted) {
+	rpmdbExtendIteratorSorted(mi, keys, keylens, nkeys);
+    } else {
+	for (int i = 0; i < nkeys; i += BASENAME_BATCH) {
+	    int n = (nkeys - i < BASENAME_BATCH) ? nkeys - i : BASENAME_BATCH;
+	    rpmdbExtendIteratorBatch(mi, keys + i, keylens + i, n);
+	}
+    }
+
+    free(keys);
+    free(keylens);
+}
+
 /* Get a rpmdbMatchIterator containing all files in
  * the rpmdb that share the basename with one from
  * the transaction.
@@ -1037,8 +1274,9 @@ rpmdbMatchIterator rpmFindBaseNamesInDB(rpmts ts, uint64_t fileCount)
     rpmfi fi;
     rpmdbMatchIterator mi;
     int oc = 0;
-    const char * baseName;
     rpmsid baseNameId;
+    struct baseNameKey_s *bnkeys = NULL;
+    int nkeys = 0, keysalloced = 0;
 
     rpmStringSet baseNames = rpmStringSetCreate(fileCount, 
 					sidHash, sidCmp, NULL);
@@ -1061,26 +1299,276 @@ rpmdbMatchIterator rpmFindBaseNamesInDB(rpmts ts, uint64_t fileCount)
 		continue;
 
 	    keylen = rpmstrPoolStrlen(tspool, baseNameId);
-	    baseName = rpmstrPoolStr(tspool, baseNameId);
 	    if (keylen == 0)
 		keylen++;	/* XXX "/" fixup. */
-	    rpmdbExtendIterator(mi, baseName, keylen);
+	    if (nkeys == keysalloced) {
+		keysalloced = keysalloced ? keysalloced * 2 : BASENAME_BATCH;
+		bnkeys = xrealloc(bnkeys, keysalloced * sizeof(*bnkeys));
+	    }
+	    bnkeys[nkeys].key = rpmstrPoolStr(tspool, baseNameId);
+	    bnkeys[nkeys].keylen = keylen;
+	    nkeys++;
 	    rpmStringSetAddEntry(baseNames, baseNameId);
 	}
 	rpmfiFree(fi);
 	rpmfilesFree(files);
     }
+    if (nkeys)
+	extendBaseNames(mi, bnkeys, nkeys);
     rpmtsiFree(pi);
     rpmStringSetFree(baseNames);
+    free(bnkeys);
 
     rpmdbSortIterator(mi);
     /* iterator is now sorted by (recnum, filenum) */
     return mi;
 }
 
+/* An installed package with files matching the transaction */
+struct installedPkg_s {
+    Header h;			/*!< installed header */
+    rpmte removedTe;		/*!< element removing it (or NULL) */
+    int nfiles;			/*!< number of matching files */
+    unsigned int *fileNums;	/*!< indexes of matching files */
+    fingerPrint *fps;		/*!< fingerprints of matching files */
+    char *ostates;		/*!< installed states of matching files */
+    int *otherIx;		/*!< index of matching files in otherFi */
+    rpmfiles otherFi;		/*!< file info of installed package */
+};
+
+struct installedWork_s {
+    fingerPrintCache fpc;
+    rpmstrPool pool;		/* database string pool (or NULL) */
+    struct installedPkg_s *pkgs;
+    int npkgs;
+};
+
+/* Copy the elements of a file tag for the given files only */
+static void projectTag(Header h, Header ph, rpmTagVal tag,
+		       const unsigned int *nums, int n)
+{
+    struct rpmtd_s td, ptd;
+    size_t esize = 0;
+
+    if (!headerGet(h, tag, &td, HEADERGET_MINMEM))
+	return;
+
+    switch (td.type) {
+    case RPM_CHAR_TYPE:
+    case RPM_INT8_TYPE:		esize = sizeof(uint8_t);	break;
+    case RPM_INT16_TYPE:	esize = sizeof(uint16_t);	break;
+    case RPM_INT32_TYPE:	esize = sizeof(uint32_t);	break;
+    case RPM_INT64_TYPE:	esize = sizeof(uint64_t);	break;
+    case RPM_STRING_ARRAY_TYPE:	esize = sizeof(char *);		break;
+    default:
+	break;
+    }
+
+    if (esize) {
+	char *data = xmalloc(n * esize);
+	int ok = 1;
+	for (int i = 0; i < n && ok; i++) {
+	    if ((ok = (nums[i] < td.count)))
+		memcpy(data + i * esize, (char *)td.data + nums[i] * esize, esize);
+	}
+	if (ok) {
+	    rpmtdReset(&ptd);
+	    ptd.tag = td.tag;
+	    ptd.type = td.type;
+	    ptd.count = n;
+	    ptd.data = data;
+	    headerPut(ph, &ptd, HEADERPUT_DEFAULT);
+	}
+	free(data);
+    }
+    rpmtdFreeData(&td);
+}
+
+/*
+ * Create the file info of an installed package for the given files only,
+ * with just what deciding their fate against transaction files needs.
+ */
+static rpmfiles projectFiles(rpmstrPool pool, Header h,
+			     const unsigned int *nums, int n)
+{
+    static const rpmTagVal fileTags[] = {
+	RPMTAG_BASENAMES, RPMTAG_DIRINDEXES, RPMTAG_FILEMODES,
+	RPMTAG_FILEFLAGS, RPMTAG_FILESIZES, RPMTAG_LONGFILESIZES,
+	RPMTAG_FILECOLORS, RPMTAG_FILESTATES, RPMTAG_FILELINKTOS,
+	RPMTAG_FILEDIGESTS, RPMTAG_FILEINODES, RPMTAG_FILEDEVICES,
+	RPMTAG_FILEUSERNAME, RPMTAG_FILEGROUPNAME, 0
+    };
+    static const rpmTagVal pkgTags[] = {
+	RPMTAG_DIRNAMES, RPMTAG_FILEDIGESTALGO, 0
+    };
+    Header ph = headerNew();
+    rpmfiles files;
+
+    for (const rpmTagVal *tag = fileTags; *tag; tag++)
+	projectTag(h, ph, *tag, nums, n);
+    for (const rpmTagVal *tag = pkgTags; *tag; tag++) {
+	struct rpmtd_s td;
+	if (headerGet(h, *tag, &td, HEADERGET_MINMEM)) {
+	    headerPut(ph, &td, HEADERPUT_DEFAULT);
+	    rpmtdFreeData(&td);
+	}
+    }
+
+    files = rpmfilesNew(pool, ph, RPMTAG_BASENAMES,
+			(RPMFI_NOFILECLASS | RPMFI_NOFILEDEPS |
+			 RPMFI_NOFILELANGS | RPMFI_NOFILECAPS |
+			 RPMFI_NOFILEMTIMES | RPMFI_NOFILERDEVS |
+			 RPMFI_NOFILEVERIFYFLAGS | RPMFI_NOFILESIGNATURES |
+			 RPMFI_NOVERITYSIGNATURES));
+    headerFree(ph);
+    return files;
+}
+
+/* Look up the fingerprints of the matching files of an installed package */
+static void installedPkgLookup(void *data, int ix, int slot)
+{
+    struct installedWork_s *work = data;
+    struct installedPkg_s *ipkg = &work->pkgs[ix];
+    headerGetFlags hgflags = HEADERGET_MINMEM;
+    struct rpmtd_s bnames, dnames, dindexes, ostates;
+    const char **dirNames, **baseNames;
+    unsigned int *otherNums = NULL;
+    int nother = 0;
+
+    /* For packages being removed we can use its rpmfi to avoid all this */
+    if (ipkg->removedTe) {
+	ipkg->otherFi = rpmteFiles(ipkg->removedTe);
+	return;
+    }
+
+    headerGet(ipkg->h, RPMTAG_BASENAMES, &bnames, hgflags);
+    headerGet(ipkg->h, RPMTAG_DIRNAMES, &dnames, hgflags);
+    headerGet(ipkg->h, RPMTAG_DIRINDEXES, &dindexes, hgflags);
+    headerGet(ipkg->h, RPMTAG_FILESTATES, &ostates, hgflags);
+
+    dirNames = xmalloc(ipkg->nfiles * sizeof(*dirNames));
+    baseNames = xmalloc(ipkg->nfiles * sizeof(*baseNames));
+    ipkg->ostates = xmalloc(ipkg->nfiles * sizeof(*ipkg->ostates));
+    for (int i = 0; i < ipkg->nfiles; i++) {
+	const char *state;
+	rpmtdSetIndex(&bnames, ipkg->fileNums[i]);
+	rpmtdSetIndex(&dindexes, ipkg->fileNums[i]);
+	rpmtdSetIndex(&dnames, *rpmtdGetUint32(&dindexes));
+	rpmtdSetIndex(&ostates, ipkg->fileNums[i]);
+
+	dirNames[i] = rpmtdGetString(&dnames);
+	baseNames[i] = rpmtdGetString(&bnames);
+	state = rpmtdGetChar(&ostates);
+	ipkg->ostates[i] = state ? *state : RPMFILE_STATE_NORMAL;
+    }
+    ipkg->fps = fpLookupNames(work->fpc, dirNames, baseNames, ipkg->nfiles);
+
+    /*
+     * Added packages need the installed file info for comparison, but
+     * only of the files actually overlapping with them.
+     */
+    ipkg->otherIx = xmalloc(ipkg->nfiles * sizeof(*ipkg->otherIx));
+    for (int i = 0; i < ipkg->nfiles; i++) {
+	struct rpmffi_s * recs;
+	int numRecs;
+	ipkg->otherIx[i] = -1;
+	fpCacheGetByFp(work->fpc, ipkg->fps, i, &recs, &numRecs);
+	for (int j = 0; j < numRecs; j++) {
+	    if (rpmteType(recs[j].p) == TR_ADDED) {
+		if (otherNums == NULL)
+		    otherNums = xmalloc(ipkg->nfiles * sizeof(*otherNums));
+		otherNums[nother] = ipkg->fileNums[i];
+		ipkg->otherIx[i] = nother++;
+		break;
+	    }
+	}
+    }
+    /* XXX What to do if this fails? */
+    if (nother)
+	ipkg->otherFi = projectFiles(work->pool, ipkg->h, otherNums, nother);
+
+    free(otherNums);
+    free(dirNames);
+    free(baseNames);
+    rpmtdFreeData(&ostates);
+    rpmtdFreeData(&bnames);
+    rpmtdFreeData(&dnames);
+    rpmtdFreeData(&dindexes);
+}
+
+/* Determine the fate of transaction files matching an installed package */
+static void installedPkgHandle(rpmts ts, fingerPrintCache fpc,
+			       struct installedPkg_s *ipkg)
+{
+    int beingRemoved = (ipkg->removedTe != NULL);
+
+    /* loop over all interesting files in that package */
+    for (int i = 0; i < ipkg->nfiles; i++) {
+	fingerPrint *fpp;
+	int fpIx;
+	struct rpmffi_s * recs;
+	int numRecs;
+	unsigned int fileNum = ipkg->fileNums[i];
+
+	int ofx;
+
+	if (!beingRemoved) {
+	    fpp = ipkg->fps;
+	    fpIx = i;
+	    ofx = ipkg->otherIx[i];
+	} else {
+	    fpp = rpmfilesFps(ipkg->otherFi);
+	    fpIx = fileNum;
+	    ofx = fileNum;
+	}
+
+	/* search for files in the transaction with same finger print */
+	fpCacheGetByFp(fpc, fpp, fpIx, &recs, &numRecs);
+
+	for (int j = 0; j < numRecs; j++) {
+	    rpmte p = recs[j].p;
+	    rpmfiles fi = rpmteFiles(p);
+	    rpmfs fs = rpmteGetFileStates(p);
+
+	    /* Determine the fate of each file. */
+	    switch (rpmteType(p)) {
+	    case TR_ADDED:
+		if (ofx >= 0) {
+		    handleInstInstalledFile(ts, p, fi, recs[j].fileno,
+					    ipkg->h, ipkg->otherFi, ofx,
+					    fileNum, beingRemoved);
+		}
+		break;
+	    case TR_REMOVED:
+		if (!beingRemoved) {
+		    if (ipkg->ostates[i] == RPMFILE_STATE_NORMAL)
+			rpmfsSetAction(fs, recs[j].fileno, FA_SKIP);
+		}
+		break;
+	    default:
+		break;
+	    }
+	    rpmfilesFree(fi);
+	}
+    }
+}
+
+static void installedPkgFree(struct installedPkg_s *ipkg)
+{
+    rpmfilesFree(ipkg->otherFi);
+    free(ipkg->otherIx);
+    free(ipkg->fileNums);
+    free(ipkg->fps);
+    free(ipkg->ostates);
+    headerFree(ipkg->h);
+    memset(ipkg, 0, sizeof(*ipkg));
+}
+
 /* Check files in the transactions against the rpmdb
  * Lookup all files with the same basename in the rpmdb
- * and then check for matching finger prints
+ * and then check for matching finger prints. The fingerprints of
+ * the installed files are looked up in parallel, in batches of
+ * packages, the outcome is decided serially in rpmdb order.
  * @param ts		transaction set
  * @param fpc		global finger print cache
  */
@@ -1088,14 +1576,14 @@ static
 void checkInstalledFiles(rpmts ts, uint64_t fileCount, fingerPrintCache fpc)
 {
     tsMembers tsmem = rpmtsMembers(ts);
-    rpmte p;
-    rpmfiles fi;
-    rpmfs fs;
-    int j;
-    unsigned int fileNum;
-
+    int nthreads = rpmworkersCount("_fingerprint_threads");
+    int batchsize = (nthreads > 1) ? nthreads * 16 : 1;
+    struct installedWork_s work = {
+	.fpc = fpc,
+	.pool = rpmdbPool(rpmtsGetRdb(ts)),
+    };
     rpmdbMatchIterator mi;
-    Header h, newheader;
+    Header h;
 
     rpmlog(RPMLOG_DEBUG, "computing file dispositions\n");
 
@@ -1110,106 +1598,47 @@ void checkInstalledFiles(rpmts ts, uint64_t fileCount, fingerPrintCache fpc)
 	return;
     }
 
+    work.pkgs = xcalloc(batchsize, sizeof(*work.pkgs));
+
     /* Loop over all packages from the rpmdb */
-    h = newheader = rpmdbNextIterator(mi);
+    h = rpmdbNextIterator(mi);
     while (h != NULL) {
-	headerGetFlags hgflags = HEADERGET_MINMEM;
-	struct rpmtd_s bnames, dnames, dindexes, ostates;
-	fingerPrint *fpp = NULL;
-	unsigned int installedPkg;
-	int beingRemoved = 0;
-	rpmfiles otherFi = NULL;
-	rpmte *removedPkg = NULL;
-
-	/* Is this package being removed? */
-	installedPkg = rpmdbGetIteratorOffset(mi);
-	if (packageHashGetEntry(tsmem->removedPackages, installedPkg,
-				&removedPkg, NULL, NULL)) {
-	    beingRemoved = 1;
-	    otherFi = rpmteFiles(removedPkg[0]);
-	}
-
-	h = headerLink(h);
-	/* For packages being removed we can use its rpmfi to avoid all this */
-	if (!beingRemoved) {
-	    headerGet(h, RPMTAG_BASENAMES, &bnames, hgflags);
-	    headerGet(h, RPMTAG_DIRNAMES, &dnames, hgflags);
-	    headerGet(h, RPMTAG_DIRINDEXES, &dindexes, hgflags);
-	    headerGet(h, RPMTAG_FILESTATES, &ostates, hgflags);
-	}
-
-	/* loop over all interesting files in that package */
-	do {
-	    int fpIx;
-	    struct rpmffi_s * recs;
-	    int numRecs;
-	    const char * dirName;
-	    const char * baseName;
-
-	    /* lookup finger print for this file */
-	    fileNum = rpmdbGetIteratorFileNum(mi);
-	    if (!beingRemoved) {
-		rpmtdSetIndex(&bnames, fileNum);
-		rpmtdSetIndex(&dindexes, fileNum);
-		rpmtdSetIndex(&dnames, *rpmtdGetUint32(&dindexes));
-		rpmtdSetIndex(&ostates, fileNum);
-
-		dirName = rpmtdGetString(&dnames);
-		baseName = rpmtdGetString(&bnames);
-
-		fpLookup(fpc, dirName, baseName, &fpp);
-		fpIx = 0;
-	    } else {
-		fpp = rpmfilesFps(otherFi);
-		fpIx = fileNum;
+	/* Collect a batch of packages and their matching files */
+	for (work.npkgs = 0; h != NULL && work.npkgs < batchsize; work.npkgs++) {
+	    struct installedPkg_s *ipkg = &work.pkgs[work.npkgs];
+	    unsigned int installedPkg = rpmdbGetIteratorOffset(mi);
+	    rpmte *removedPkg = NULL;
+	    Header newheader;
+	    int alloced = 0;
+
+	    /* Is this package being removed? */
+	    if (packageHashGetEntry(tsmem->removedPackages, installedPkg,
+				    &removedPkg, NULL, NULL)) {
+		ipkg->removedTe = removedPkg[0];
 	    }
 
-	    /* search for files in the transaction with same finger print */
-	    fpCacheGetByFp(fpc, fpp, fpIx, &recs, &numRecs);
-
-	    for (j = 0; j < numRecs; j++) {
-	        p = recs[j].p;
-		fi = rpmteFiles(p);
-		fs = rpmteGetFileStates(p);
-
-		/* Determine the fate of each file. */
-		switch (rpmteType(p)) {
-		case TR_ADDED:
-		    if (!otherFi) {
-			/* XXX What to do if this fails? */
-		        otherFi = rpmfilesNew(NULL, h, RPMTAG_BASENAMES, RPMFI_KEEPHEADER);
-		    }
-		    handleInstInstalledFile(ts, p, fi, recs[j].fileno,
-					    h, otherFi, fileNum, beingRemoved);
-		    break;
-		case TR_REMOVED:
-		    if (!beingRemoved) {
-			if (*rpmtdGetChar(&ostates) == RPMFILE_STATE_NORMAL)
-			    rpmfsSetAction(fs, recs[j].fileno, FA_SKIP);
-		    }
-		    break;
-		default:
-		    break;
+	    ipkg->h = headerLink(h);
+	    do {
+		if (ipkg->nfiles == alloced) {
+		    alloced = alloced ? alloced * 2 : 16;
+		    ipkg->fileNums = xrealloc(ipkg->fileNums,
+				    alloced * sizeof(*ipkg->fileNums));
 		}
-		rpmfilesFree(fi);
-	    }
-
-	    newheader = rpmdbNextIterator(mi);
+		ipkg->fileNums[ipkg->nfiles++] = rpmdbGetIteratorFileNum(mi);
+		newheader = rpmdbNextIterator(mi);
+	    } while (newheader == h);
+	    h = newheader;
+	}
 
-	} while (newheader==h);
+	rpmworkersRun(nthreads, work.npkgs, installedPkgLookup, &work);
 
-	otherFi = rpmfilesFree(otherFi);
-	if (!beingRemoved) {
-	    rpmtdFreeData(&ostates);
-	    rpmtdFreeData(&bnames);
-	    rpmtdFreeData(&dnames);
-	    rpmtdFreeData(&dindexes);
-	    free(fpp);
+	for (int i = 0; i < work.npkgs; i++) {
+	    installedPkgHandle(ts, fpc, &work.pkgs[i]);
+	    installedPkgFree(&work.pkgs[i]);
 	}
-	headerFree(h);
-	h = newheader;
     }
 
+    free(work.pkgs);
     rpmdbFreeIterator(mi);
 }
 
@@ -1267,60 +1696,139 @@ static int vfyCb(struct rpmsinfo_s *sinfo, void *cbdata)
     return (sinfo->rc == 0);
 }
 
+struct vfyPkg_s {
+    rpmte p;
+    FD_t fd;			/*!< private dup of the package fd */
+    struct vfydata_s vd;
+    rpmRC prc;
+    int done;
+};
+
+struct vfyWork_s {
+    struct vfyPkg_s *pkgs;
+    int npkgs;
+    rpmKeyring *keyrings;	/*!< keyring per worker slot */
+    rpmVSFlags vsflags;
+    int vfylevel;
+};
+
+static void vfyPkgRun(void *data, int ix, int slot)
+{
+    struct vfyWork_s *work = data;
+    struct vfyPkg_s *pkg = &work->pkgs[ix];
+    struct rpmvs_s *vs;
+
+    if (pkg->done)
+	return;
+
+    vs = rpmvsCreate(work->vfylevel, work->vsflags, work->keyrings[slot]);
+    rpmvsEnableCache(vs);
+    pkg->vd.msg = NULL;
+    pkg->vd.type[0] = pkg->vd.type[1] = pkg->vd.type[2] = -1;
+    pkg->vd.vfylevel = work->vfylevel;
+    pkg->prc = RPMRC_FAIL;
+
+    if (pkg->fd != NULL)
+	pkg->prc = rpmpkgRead(vs, pkg->fd, NULL, NULL, &pkg->vd.msg);
+
+    if (pkg->prc == RPMRC_OK)
+	pkg->prc = rpmvsVerify(vs, RPMSIG_VERIFIABLE_TYPE, vfyCb, &pkg->vd);
+
+    rpmvsFree(vs);
+    pkg->done = 1;
+}
+
+/* Record verify result */
+static void vfyPkgFinish(struct vfyPkg_s *pkg)
+{
+    int verified = 0;
+
+    if (pkg->vd.type[RPMSIG_SIGNATURE_TYPE] == RPMRC_OK)
+	verified |= RPMSIG_SIGNATURE_TYPE;
+    if (pkg->vd.type[RPMSIG_DIGEST_TYPE] == RPMRC_OK)
+	verified |= RPMSIG_DIGEST_TYPE;
+    rpmteSetVerified(pkg->p, verified);
+
+    if (pkg->prc)
+	rpmteAddProblem(pkg->p, RPMPROB_VERIFY, NULL, pkg->vd.msg, 0);
+
+    free(pkg->vd.msg);
+    memset(pkg, 0, sizeof(*pkg));
+}
+
+/*
+ * Verify the packages to be installed. With %_pkgverify_threads, the
+ * packages are opened through the callback one by one as before, but
+ * read and verified from a private duplicate of the descriptor by a
+ * pool of threads, each with a keyring of its own.
+ */
 static int verifyPackageFiles(rpmts ts, rpm_loff_t total)
 {
     int rc = 0;
-    rpmKeyring keyring = rpmtsGetKeyring(ts, 0);
+    int nthreads = rpmworkersCount("_pkgverify_threads");
+    int batchsize = (nthreads > 1) ? nthreads * 2 : 1;
     rpmtsi pi = NULL;
     rpmte p;
     rpm_loff_t oc = 0;
-    rpmVSFlags vsflags = rpmtsVfyFlags(ts);
-    int vfylevel = rpmtsVfyLevel(ts);
+    struct vfyWork_s work = {
+	.vsflags = rpmtsVfyFlags(ts),
+	.vfylevel = rpmtsVfyLevel(ts),
+    };
+
+    work.keyrings = xcalloc(nthreads, sizeof(*work.keyrings));
+    work.keyrings[0] = rpmtsGetKeyring(ts, 0);
+    for (int i = 1; i < nthreads; i++)
+	work.keyrings[i] = rpmKeyringCopy(work.keyrings[0]);
+    work.pkgs = xcalloc(batchsize, sizeof(*work.pkgs));
 
     rpmtsNotify(ts, NULL, RPMCALLBACK_VERIFY_START, 0, total);
 
     (void) rpmswEnter(rpmtsOp(ts, RPMTS_OP_VERIFY), 0);
+    rpmtraceBegin("verifyPackageFiles", NULL);
 
     pi = rpmtsiInit(ts);
-    while ((p = rpmtsiNext(pi, TR_ADDED))) {
-	struct rpmvs_s *vs = rpmvsCreate(vfylevel, vsflags, keyring);
-	struct vfydata_s vd = {
-	    .msg = NULL,
-	    .type = { -1, -1, -1, },
-	    .vfylevel = vfylevel,
-	};
-	int verified = 0;
-	rpmRC prc = RPMRC_FAIL;
-
-	rpmtsNotify(ts, p, RPMCALLBACK_VERIFY_PROGRESS, oc++, total);
-	FD_t fd = rpmtsNotify(ts, p, RPMCALLBACK_INST_OPEN_FILE, 0, 0);
-	if (fd != NULL) {
-	    prc = rpmpkgRead(vs, fd, NULL, NULL, &vd.msg);
-	    rpmtsNotify(ts, p, RPMCALLBACK_INST_CLOSE_FILE, 0, 0);
-	}
-
-	if (prc == RPMRC_OK)
-	    prc = rpmvsVerify(vs, RPMSIG_VERIFIABLE_TYPE, vfyCb, &vd);
-
-	/* Record verify result */
-	if (vd.type[RPMSIG_SIGNATURE_TYPE] == RPMRC_OK)
-	    verified |= RPMSIG_SIGNATURE_TYPE;
-	if (vd.type[RPMSIG_DIGEST_TYPE] == RPMRC_OK)
-	    verified |= RPMSIG_DIGEST_TYPE;
-	rpmteSetVerified(p, verified);
-
-	if (prc)
-	    rpmteAddProblem(p, RPMPROB_VERIFY, NULL, vd.msg, 0);
-
-	vd.msg = _free(vd.msg);
-	rpmvsFree(vs);
+    p = rpmtsiNext(pi, TR_ADDED);
+    while (p != NULL) {
+	for (work.npkgs = 0; p && work.npkgs < batchsize; work.npkgs++) {
+	    struct vfyPkg_s *pkg = &work.pkgs[work.npkgs];
+	    pkg->p = p;
+
+	    rpmtsNotify(ts, p, RPMCALLBACK_VERIFY_PROGRESS, oc++, total);
+	    FD_t fd = rpmtsNotify(ts, p, RPMCALLBACK_INST_OPEN_FILE, 0, 0);
+	    if (fd != NULL) {
+		/* The callback can only have one file open at a time */
+		if (nthreads > 1 && Fileno(fd) >= 0)
+		    pkg->fd = fdDup(Fileno(fd));
+		if (pkg->fd == NULL) {
+		    pkg->fd = fd;
+		    vfyPkgRun(&work, work.npkgs, 0);
+		    pkg->fd = NULL;
+		}
+		rpmtsNotify(ts, p, RPMCALLBACK_INST_CLOSE_FILE, 0, 0);
+	    } else {
+		vfyPkgRun(&work, work.npkgs, 0);
+	    }
+	    p = rpmtsiNext(pi, TR_ADDED);
+	}
+
+	rpmworkersRun(nthreads, work.npkgs, vfyPkgRun, &work);
+
+	for (int i = 0; i < work.npkgs; i++) {
+	    if (work.pkgs[i].fd)
+		Fclose(work.pkgs[i].fd);
+	    vfyPkgFinish(&work.pkgs[i]);
+	}
     }
     rpmtsNotify(ts, NULL, RPMCALLBACK_VERIFY_STOP, total, total);
 
+    rpmtraceEnd("verifyPackageFiles", NULL);
     (void) rpmswExit(rpmtsOp(ts, RPMTS_OP_VERIFY), 0);
 
     rpmtsiFree(pi);
-    rpmKeyringFree(keyring);
+    for (int i = 0; i < nthreads; i++)
+	rpmKeyringFree(work.keyrings[i]);
+    free(work.keyrings);
+    free(work.pkgs);
     return rc;
 }
 
@@ -1423,6 +1931,69 @@ exit:
  * param goal	PKG_PRETRANS/PKG_POSTTRANS
  * return	0 on success
  */
+struct deferredScript_s {
+    rpmScript script;		/* last queued instance */
+    rpmte te;			/* ...and its element */
+    ARGV_t prefixes;
+    int arg1;
+    int count;			/* number of instances coalesced */
+};
+
+void rpmtsDeferScript(rpmts ts, rpmte te, ARGV_const_t prefixes,
+		      rpmScript script, int arg1)
+{
+    const char *key = rpmScriptCoalesceKey(script);
+    struct deferredScript_s *ds = NULL;
+
+    /* A %post and a %postun with the same body still run separately */
+    for (int i = 0; i < ts->ndeferred; i++) {
+	rpmScript s = ts->deferred[i].script;
+	if (rpmScriptTag(s) == rpmScriptTag(script) &&
+		rstreq(key, rpmScriptCoalesceKey(s))) {
+	    ds = &ts->deferred[i];
+	    break;
+	}
+    }
+
+    /* Keep the position of the first, run with the details of the last */
+    if (ds) {
+	rpmScriptFree(ds->script);
+	ds->prefixes = argvFree(ds->prefixes);
+    } else {
+	ts->deferred = xrealloc(ts->deferred,
+			(ts->ndeferred + 1) * sizeof(*ts->deferred));
+	ds = &ts->deferred[ts->ndeferred++];
+	ds->count = 0;
+    }
+    ds->script = script;
+    ds->te = te;
+    ds->prefixes = NULL;
+    if (prefixes)
+	argvAppend(&ds->prefixes, prefixes);
+    ds->arg1 = arg1;
+    ds->count++;
+
+    rpmlog(RPMLOG_DEBUG, "%s: deferred scriptlet %s (%d queued)\n",
+	   rpmteNEVRA(te), key, ds->count);
+}
+
+static void runDeferredScripts(rpmts ts)
+{
+    rpmChrootHold();
+    for (int i = 0; i < ts->ndeferred; i++) {
+	struct deferredScript_s *ds = &ts->deferred[i];
+
+	rpmlog(RPMLOG_DEBUG, "%s: running deferred scriptlet %s for %d\n",
+	       rpmteNEVRA(ds->te), rpmScriptCoalesceKey(ds->script), ds->count);
+	runScript(ts, ds->te, NULL, ds->prefixes, ds->script, ds->arg1, -1);
+	rpmScriptFree(ds->script);
+	argvFree(ds->prefixes);
+    }
+    rpmChrootRelease();
+    ts->deferred = _free(ts->deferred);
+    ts->ndeferred = 0;
+}
+
 static int runTransScripts(rpmts ts, pkgGoal goal) 
 {
     int rc = 0;
@@ -1449,6 +2020,76 @@ static int runTransScripts(rpmts ts, pkgGoal goal)
     return rc;
 }
 
+/*
+ * Is the directory empty but for the path to the rpmdb in it, which
+ * opening the database may have just created? Contents of the database
+ * directory itself don't matter, nor does lost+found of a new filesystem.
+ */
+static int isFreshDir(const char *dir, const char *dbpath, int top)
+{
+    DIR *d = opendir(dir);
+    struct dirent *dp;
+    int fresh = (d != NULL);
+    size_t len;
+
+    while (*dbpath == '/')
+	dbpath++;
+    len = strcspn(dbpath, "/");
+
+    while (fresh && (dp = readdir(d)) != NULL) {
+	const char *dn = dp->d_name;
+	if (rstreq(dn, ".") || rstreq(dn, ".."))
+	    continue;
+	if (top && rstreq(dn, "lost+found"))
+	    continue;
+	if (len && strlen(dn) == len && rstreqn(dn, dbpath, len)) {
+	    if (dbpath[len] != '\0') {
+		char *sub = rstrscat(NULL, dir, "/", dn, NULL);
+		fresh = isFreshDir(sub, dbpath + len, 0);
+		free(sub);
+	    }
+	    continue;
+	}
+	fresh = 0;
+    }
+    if (d)
+	closedir(d);
+    return fresh;
+}
+
+/*
+ * Fresh root installs trust that nothing but this transaction puts
+ * files in the root, so verify the root and the database are empty.
+ */
+static int rpmtsFreshRoot(rpmts ts)
+{
+    rpmdbMatchIterator mi;
+    int fresh = 0;
+    char *dbpath;
+
+    if (rpmExpandNumeric("%{?_install_fresh_root}") <= 0)
+	return 0;
+    if (rpmtsFlags(ts) & (RPMTRANS_FLAG_TEST|RPMTRANS_FLAG_JUSTDB))
+	return 0;
+
+    dbpath = rpmGetPath("%{_dbpath}", NULL);
+    mi = rpmdbInitIterator(rpmtsGetRdb(ts), RPMDBI_PACKAGES, NULL, 0);
+    if (rpmdbNextIterator(mi) == NULL)
+	fresh = isFreshDir(rpmtsRootDir(ts), dbpath, 1);
+    rpmdbFreeIterator(mi);
+
+    if (fresh) {
+	rpmlog(RPMLOG_DEBUG, "installing into fresh root %s\n",
+		rpmtsRootDir(ts));
+    } else {
+	rpmlog(RPMLOG_WARNING,
+		_("%s is not a fresh root, installing normally\n"),
+		rpmtsRootDir(ts));
+    }
+    free(dbpath);
+    return fresh;
+}
+
 static int rpmtsSetup(rpmts ts, rpmprobFilterFlags ignoreSet)
 {
     rpm_tid_t tid = (rpm_tid_t) rpmtsGetTime(ts, 0);
@@ -1477,6 +2118,12 @@ static int rpmtsSetup(rpmts ts, rpmprobFilterFlags ignoreSet)
     /* Get available space on mounted file systems. */
     (void) rpmtsInitDSI(ts);
 
+    /* Check before %pretrans gets to put anything in the root */
+    ts->freshroot = rpmtsFreshRoot(ts);
+    ts->dircache = fsmDirCacheNew();
+    /* The cache is shared by all roots, open it from outside of them */
+    ts->payloadcache = payloadCacheOpen();
+
     return 0;
 }
 
@@ -1512,6 +2159,11 @@ static void setSSD(int enable)
 
 static int rpmtsFinish(rpmts ts)
 {
+    ts->dircache = fsmDirCacheFree(ts->dircache);
+    if (ts->payloadcache >= 0) {
+	close(ts->payloadcache);
+	ts->payloadcache = -1;
+    }
     if (rpmtsGetDSIRotational(ts) == 0)
 	setSSD(0);
     rpmtsFreeDSI(ts);
@@ -1529,6 +2181,11 @@ static int rpmtsPrepare(rpmts ts)
     struct stat dbstat;
 
     fingerPrintCache fpc = fpCacheCreate(fileCount/2 + 10001, rpmtsPool(ts));
+    int nthreads = rpmworkersCount("_fingerprint_threads");
+    struct overlapWork_s overlap = {
+	.ts = ts,
+	.fpc = fpc,
+    };
 
     rpmlog(RPMLOG_DEBUG, "computing %" PRIu64 " file fingerprints\n", fileCount);
 
@@ -1558,25 +2215,48 @@ static int rpmtsPrepare(rpmts ts)
     
     rpmtsNotify(ts, NULL, RPMCALLBACK_TRANS_START, 6, tsmem->orderCount);
     /* Add fingerprint for each file not skipped. */
+    rpmtraceBegin("fpCachePopulate", NULL);
     fpCachePopulate(fpc, ts, fileCount);
+    rpmtraceEnd("fpCachePopulate", NULL);
     /* check against files in the rpmdb */
+    rpmtraceBegin("checkInstalledFiles", NULL);
     checkInstalledFiles(ts, fileCount, fpc);
+    rpmtraceEnd("checkInstalledFiles", NULL);
 
     dbhome = rpmdbHome(rpmtsGetRdb(ts));
     /* If we can't stat, ignore db growth. Probably not right but... */
     if (dbhome && stat(dbhome, &dbstat))
 	dbhome = NULL;
 
+    /* check files in ts against each other, sharded by fingerprint */
+    (void) rpmswEnter(rpmtsOp(ts, RPMTS_OP_FINGERPRINT), 0);
+    rpmtraceBegin("handleOverlappedFiles", NULL);
+    overlap.pkgs = xcalloc(rpmtsNElements(ts), sizeof(*overlap.pkgs));
     pi = rpmtsiInit(ts);
     while ((p = rpmtsiNext(pi, 0)) != NULL) {
-	rpmfiles files = rpmteFiles(p);;
-	if (files == NULL)
+	struct overlapPkg_s *pkg = &overlap.pkgs[overlap.npkgs];
+	if ((pkg->fi = rpmteFiles(p)) == NULL)
 	    continue;   /* XXX can't happen */
+	pkg->p = p;
+	pkg->files = xcalloc(rpmfilesFC(pkg->fi), sizeof(*pkg->files));
+	overlap.npkgs++;
+    }
+    rpmtsiFree(pi);
+    /* Each worker probes one shard of the fingerprint hash at a time */
+    overlap.nshards = fpCacheShards(fpc);
+    rpmworkersRun(nthreads, overlap.nshards, handleOverlappedShard, &overlap);
+    rpmtraceEnd("handleOverlappedFiles", NULL);
+    (void) rpmswExit(rpmtsOp(ts, RPMTS_OP_FINGERPRINT), 0);
+
+    for (int n = 0; n < overlap.npkgs; n++) {
+	struct overlapPkg_s *pkg = &overlap.pkgs[n];
+	rpmfiles files = pkg->fi;
+	p = pkg->p;
 
 	(void) rpmswEnter(rpmtsOp(ts, RPMTS_OP_FINGERPRINT), 0);
-	/* check files in ts against each other and update disk space
-	   needs on each partition for this package. */
-	handleOverlappedFiles(ts, fpc, p, files);
+	/* report conflicts and update disk space needs on each partition
+	   for this package. */
+	handleOverlappedFiles(ts, fpc, p, files, pkg->files);
 
 	/* Check added package has sufficient space on each partition used. */
 	if (rpmteType(p) == TR_ADDED) {
@@ -1595,8 +2275,9 @@ static int rpmtsPrepare(rpmts ts)
 	}
 	(void) rpmswExit(rpmtsOp(ts, RPMTS_OP_FINGERPRINT), 0);
 	rpmfilesFree(files);
+	free(pkg->files);
     }
-    rpmtsiFree(pi);
+    free(overlap.pkgs);
     rpmtsNotify(ts, NULL, RPMCALLBACK_TRANS_STOP, 6, tsmem->orderCount);
 
     /* return from chroot if done earlier */
@@ -1610,6 +2291,8 @@ static int rpmtsPrepare(rpmts ts)
 	    rpmteCleanFiles(p);
 	}
 	rpmtsiFree(pi);
+	/* ...and the added package index would otherwise keep them alive */
+	rpmalCleanFiles(tsmem->addedPackages);
     }
 
     if (rpmtsGetDSIRotational(ts) == 0)
@@ -1623,16 +2306,187 @@ exit:
 /*
  * Transaction main loop: install and remove packages
  */
+/*
+ * Unpacking ahead: runs of neighbouring installs that have no ordering
+ * relation to each other, no scriptlets or triggers around the unpack
+ * and no paths in common are opened in order and then unpacked on
+ * worker threads. Everything else, including all callbacks but the
+ * open/close and the rpmdb updates, still happens in order when each
+ * element gets processed.
+ */
+struct aheadPath_s {
+    char *path;
+    int member;
+    int packaged;
+};
+
+struct aheadPaths_s {
+    struct aheadPath_s *paths;
+    int npaths;
+    int nalloced;
+};
+
+struct aheadWork_s {
+    rpmts ts;
+    rpmte *chunk;
+};
+
+static int unpackAheadThreads(rpmts ts)
+{
+    int nthreads = rpmworkersCount("_install_threads");
+
+    if (nthreads > 1) {
+	if ((rpmtsFlags(ts) & (RPMTRANS_FLAG_TEST|RPMTRANS_FLAG_JUSTDB)) ||
+		(rpmtsFilterFlags(ts) & RPMPROB_FILTER_REPLACEPKG) ||
+		rpmpluginsHaveFileHooks(rpmtsPlugins(ts))) {
+	    rpmlog(RPMLOG_DEBUG, "not unpacking packages concurrently\n");
+	    nthreads = 1;
+	}
+    }
+    return nthreads;
+}
+
+static int haveDbTriggers(rpmts ts, rpmte te)
+{
+    return (rpmdbCountIndex(rpmtsGetRdb(ts), RPMDBI_TRIGGERNAME,
+			    rpmteN(te), 0) > 0);
+}
+
+static void addAheadPath(struct aheadPaths_s *ap, char *path,
+			 int member, int packaged)
+{
+    if (ap->npaths == ap->nalloced) {
+	ap->nalloced = ap->nalloced ? ap->nalloced * 2 : 1024;
+	ap->paths = xrealloc(ap->paths, ap->nalloced * sizeof(*ap->paths));
+    }
+    ap->paths[ap->npaths].path = path;
+    ap->paths[ap->npaths].member = member;
+    ap->paths[ap->npaths].packaged = packaged;
+    ap->npaths++;
+}
+
+static int aheadPathCmp(const void *a, const void *b)
+{
+    const struct aheadPath_s *x = a;
+    const struct aheadPath_s *y = b;
+    int rc = strcmp(x->path, y->path);
+    if (rc == 0)
+	rc = x->member - y->member;
+    if (rc == 0)
+	rc = y->packaged - x->packaged;
+    return rc;
+}
+
+/*
+ * Return the number of leading chunk members whose paths don't collide.
+ * A path may be the parent directory of files in several members, but
+ * if packaged in one, no other member may have it as path or parent.
+ */
+static int aheadNoCollisions(rpmte *chunk, int n)
+{
+    struct aheadPaths_s ap = { NULL, 0, 0 };
+    int limit = n;
+
+    for (int m = 0; m < n; m++) {
+	rpmfiles files = rpmteFiles(chunk[m]);
+	int fc = rpmfilesFC(files);
+	int dc = rpmfilesDC(files);
+
+	for (int i = 0; i < fc; i++)
+	    addAheadPath(&ap, rpmfilesFN(files, i), m, 1);
+	for (int i = 0; i < dc; i++) {
+	    const char *dn = rpmfilesDN(files, i);
+	    /* every parent, without the trailing slash */
+	    for (const char *s = dn + 1; (s = strchr(s, '/')) != NULL; s++)
+		addAheadPath(&ap, rstrndup(dn, s - dn), m, 0);
+	}
+	rpmfilesFree(files);
+    }
+
+    qsort(ap.paths, ap.npaths, sizeof(*ap.paths), aheadPathCmp);
+
+    for (int i = 0; i < ap.npaths; ) {
+	int j = i;
+	int packaged = 0;
+	while (j < ap.npaths && rstreq(ap.paths[j].path, ap.paths[i].path)) {
+	    struct aheadPath_s *p = &ap.paths[j];
+	    /* first entry of each member tells if it's packaged there */
+	    if (j > i && p->member != ap.paths[j-1].member &&
+		    (packaged || p->packaged)) {
+		if (p->member < limit)
+		    limit = p->member;
+		break;
+	    }
+	    packaged |= p->packaged;
+	    j++;
+	}
+	while (j < ap.npaths && rstreq(ap.paths[j].path, ap.paths[i].path))
+	    j++;
+	i = j;
+    }
+
+    for (int i = 0; i < ap.npaths; i++)
+	free(ap.paths[i].path);
+    free(ap.paths);
+    return limit;
+}
+
+static void unpackAheadWorker(void *data, int ix, int slot)
+{
+    struct aheadWork_s *work = data;
+    rpmpsmUnpackAhead(work->ts, work->chunk[ix]);
+}
+
+/* Returns the order index up to which elements were looked at */
+static int unpackAhead(rpmts ts, int start, int nthreads)
+{
+    tsMembers tsmem = rpmtsMembers(ts);
+    int max = 4 * nthreads;
+    rpmte *chunk = xcalloc(max, sizeof(*chunk));
+    struct aheadWork_s work = { ts, chunk };
+    int n = 0, end, limit;
+
+    for (end = start; end < tsmem->orderCount && end - start < max; end++) {
+	rpmte te = tsmem->order[end];
+	if (!rpmteCanUnpackAhead(te) || rpmteOrderAfter(te) >= start ||
+		haveDbTriggers(ts, te))
+	    break;
+    }
+
+    if (end - start > 1) {
+	for (int i = start; i < end; i++) {
+	    if (!rpmteOpenAhead(tsmem->order[i]))
+		break;
+	    chunk[n++] = tsmem->order[i];
+	}
+
+	limit = aheadNoCollisions(chunk, n);
+	if (limit > 1 && rpmChrootIn() == 0) {
+	    rpmlog(RPMLOG_DEBUG, "unpacking %d packages concurrently\n", limit);
+	    rpmworkersRun(nthreads, limit, unpackAheadWorker, &work);
+	    rpmChrootOut();
+	}
+    }
+
+    free(chunk);
+    return (n > 0) ? start + n : start + 1;
+}
+
 static int rpmtsProcess(rpmts ts)
 {
     rpmtsi pi;	rpmte p;
     int rc = 0;
     int i = 0;
+    int nthreads = unpackAheadThreads(ts);
+    int aheadEnd = 0;
 
     pi = rpmtsiInit(ts);
     while ((p = rpmtsiNext(pi, 0)) != NULL) {
 	int failed;
 
+	if (nthreads > 1 && i >= aheadEnd)
+	    aheadEnd = unpackAhead(ts, i, nthreads);
+
 	rpmlog(RPMLOG_DEBUG, "========== +++ %s %s-%s 0x%x\n",
 		rpmteNEVR(p), rpmteA(p), rpmteO(p), rpmteColor(p));
 
@@ -1716,8 +2570,14 @@ rpmRC runScript(rpmts ts, rpmte te, Header h, ARGV_const_t prefixes,
 	sfd = rpmtsScriptFd(ts);
 
     rpmswEnter(rpmtsOp(ts, RPMTS_OP_SCRIPTLETS), 0);
+    rpmswEnter(rpmteOp(te, RPMTS_OP_SCRIPTLETS), 0);
+    rpmtraceBegin(rpmTagGetName(stag), rpmteNEVRA(te));
     rc = rpmScriptRun(script, arg1, arg2, sfd,
 		      prefixes, rpmtsPlugins(ts));
+    /* The scriptlet may have moved directories around */
+    fsmDirCacheFlush(ts->dircache);
+    rpmtraceEnd(rpmTagGetName(stag), rpmteNEVRA(te));
+    rpmswExit(rpmteOp(te, RPMTS_OP_SCRIPTLETS), 0);
     rpmswExit(rpmtsOp(ts, RPMTS_OP_SCRIPTLETS), 0);
 
     /* Map warn-only errors to "notfound" for script stop callback */
@@ -1764,6 +2624,13 @@ static void rpmtsSync(rpmts ts)
 #endif
 }
 
+/*
+ * The umask, signal dispositions and the chroot are process-wide, so only
+ * one transaction can run at a time in a process. Setting up transaction
+ * sets, checking and ordering them can still be done in parallel.
+ */
+static pthread_mutex_t tsRunLock = PTHREAD_MUTEX_INITIALIZER;
+
 int rpmtsRun(rpmts ts, rpmps okProbs, rpmprobFilterFlags ignoreSet)
 {
     int rc = -1; /* assume failure */
@@ -1772,15 +2639,24 @@ int rpmtsRun(rpmts ts, rpmps okProbs, rpmprobFilterFlags ignoreSet)
     rpmtxn txn = NULL;
     rpmps tsprobs = NULL;
     int TsmPreDone = 0; /* TsmPre hook hasn't been called */
+    int prepared = 0;
     int nelem = rpmtsNElements(ts);
-    /* Ignore SIGPIPE for the duration of transaction */
     struct sigaction act, oact;
+    mode_t oldmask;
+
+    pthread_mutex_lock(&tsRunLock);
+
+    /* Ignore SIGPIPE for the duration of transaction */
     memset(&act, 0, sizeof(act));
     act.sa_handler = SIG_IGN;
     sigaction(SIGPIPE, &act, &oact);
     
     /* Force default 022 umask during transaction for consistent results */
-    mode_t oldmask = umask(022);
+    oldmask = umask(022);
+
+    RPM_PROBE1(transaction_start, nelem);
+    rpmtraceOpen();
+    rpmtraceBegin("rpmtsRun", NULL);
 
     /* Empty transaction, nothing to do */
     if (nelem <= 0) {
@@ -1800,8 +2676,13 @@ int rpmtsRun(rpmts ts, rpmps okProbs, rpmprobFilterFlags ignoreSet)
 	goto exit;
     }
 
+    /* Optionally leave a copy of the inputs for replaying */
+    tsRecord(ts, ignoreSet);
+
     /* Check package set for problems */
+    rpmtraceBegin("checkProblems", NULL);
     tsprobs = checkProblems(ts);
+    rpmtraceEnd("checkProblems", NULL);
 
     /* Run pre transaction hook for all plugins */
     TsmPreDone = 1;
@@ -1821,7 +2702,10 @@ int rpmtsRun(rpmts ts, rpmps okProbs, rpmprobFilterFlags ignoreSet)
     tsprobs = rpmpsFree(tsprobs);
 
     /* Compute file disposition for each package in transaction set. */
-    if (rpmtsPrepare(ts)) {
+    rpmtraceBegin("rpmtsPrepare", NULL);
+    prepared = (rpmtsPrepare(ts) == 0);
+    rpmtraceEnd("rpmtsPrepare", NULL);
+    if (!prepared) {
 	goto exit;
     }
     /* Check again for problems (now including file conflicts,  duh */
@@ -1857,8 +2741,22 @@ int rpmtsRun(rpmts ts, rpmps okProbs, rpmprobFilterFlags ignoreSet)
 	runTransScripts(ts, PKG_TRANSFILETRIGGERUN);
     }
 
+    /* Optionally batch index updates until all packages are processed */
+    if (rpmExpandNumeric("%{?_db_defer_indexes}") > 0)
+	rpmdbDeferIndexes(rpmtsGetRdb(ts), 1);
+
     /* Actually install and remove packages */
+    rpmtraceBegin("rpmtsProcess", NULL);
     nfailed = rpmtsProcess(ts);
+    rpmtraceEnd("rpmtsProcess", NULL);
+
+    if (rpmdbDeferIndexes(rpmtsGetRdb(ts), 0)) {
+	rpmlog(RPMLOG_ERR, _("failed to update database indexes\n"));
+	nfailed++;
+    }
+
+    /* Run the coalesced %post/%postun scriptlets, once each */
+    runDeferredScripts(ts);
 
     /* Run %posttrans scripts unless disabled */
     if (!(rpmtsFlags(ts) & (RPMTRANS_FLAG_NOPOSTTRANS))) {
@@ -1887,6 +2785,8 @@ int rpmtsRun(rpmts ts, rpmps okProbs, rpmprobFilterFlags ignoreSet)
     rc = nfailed ? -1 : 0;
 
 exit:
+    rpmScriptHelperStop();
+
     /* Run post transaction hook for all plugins */
     if (TsmPreDone) /* If TsmPre hook has been called, call the TsmPost hook */
 	rpmpluginsCallTsmPost(rpmtsPlugins(ts), ts, rc);
@@ -1897,9 +2797,15 @@ exit:
     }
     (void) umask(oldmask);
     (void) rpmtsFinish(ts);
+    /* Scriptlets may have changed users and groups */
+    rpmugFree();
     rpmpsFree(tsprobs);
     rpmtxnEnd(txn);
     /* Restore SIGPIPE *after* unblocking signals in rpmtxnEnd() */
     sigaction(SIGPIPE, &oact, NULL);
+    rpmtraceEnd("rpmtsRun", NULL);
+    rpmtraceClose();
+    RPM_PROBE2(transaction_done, nelem, rc);
+    pthread_mutex_unlock(&tsRunLock);
     return rc;
 }
@@ -0,0 +1,419 @@
+#include "system.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <rpm/header.h>
+#include <rpm/rpmds.h>
+#include <rpm/rpmlog.h>
+#include <rpm/rpmstring.h>
+
+#include "lib/rpmscript.h"
+#include "lib/sidecar.h"
+#include "lib/trigindex.h"
+
+#include "debug.h"
+
+#define TRIGINDEX_MAGIC	"RPMTRIG1"
+
+/*
+ * A sidecar file:
+ *	head
+ *	items[count]		sorted
+ *	strings[strsize]	nul terminated keys
+ */
+struct trigHead_s {
+    struct sidecarHead_s sc;
+    uint32_t count;
+    uint32_t strsize;
+};
+
+/*
+ * A loaded index stays in the read-only mapping until it's changed, then
+ * the items and strings are copied to the heap. Keys of removed items
+ * are left in the strings, they're dropped on write.
+ */
+struct trigIndex_s {
+    struct hdrShmId_s id;
+    void *map;
+    size_t mapsize;
+    struct trigIndexItem_s *items;
+    unsigned int count;
+    unsigned int alloced;
+    char *strings;
+    size_t strsize;
+    size_t stralloced;
+    int sorted;
+    int modified;
+};
+
+static const struct trigTags_s {
+    unsigned int type;
+    rpmTagVal nametag;
+    rpmTagVal priotag;
+} trigTags[] = {
+    { RPMSCRIPT_NORMALTRIGGER, RPMTAG_TRIGGERNAME, 0 },
+    { RPMSCRIPT_FILETRIGGER, RPMTAG_FILETRIGGERNAME,
+      RPMTAG_FILETRIGGERPRIORITIES },
+    { RPMSCRIPT_TRANSFILETRIGGER, RPMTAG_TRANSFILETRIGGERNAME,
+      RPMTAG_TRANSFILETRIGGERPRIORITIES },
+};
+
+static int itemCmp(const struct trigIndexItem_s *a, const char *akey,
+		   const struct trigIndexItem_s *b, const char *bkey)
+{
+    int rc;
+    if (a->type != b->type)
+	return (a->type > b->type) ? 1 : -1;
+    if ((rc = strcmp(akey, bkey)) != 0)
+	return rc;
+    if (a->hdrNum != b->hdrNum)
+	return (a->hdrNum > b->hdrNum) ? 1 : -1;
+    if (a->tix != b->tix)
+	return (a->tix > b->tix) ? 1 : -1;
+    return (a->nth > b->nth) - (a->nth < b->nth);
+}
+
+struct sortItem_s {
+    const char *key;
+    struct trigIndexItem_s item;
+};
+
+static int sortItemCmp(const void *a, const void *b)
+{
+    const struct sortItem_s *x = a, *y = b;
+    return itemCmp(&x->item, x->key, &y->item, y->key);
+}
+
+static void indexSort(trigIndex ti)
+{
+    struct sortItem_s *sitems;
+
+    if (ti->sorted)
+	return;
+
+    sitems = xmalloc((ti->count + 1) * sizeof(*sitems));
+    for (unsigned int i = 0; i < ti->count; i++) {
+	sitems[i].key = ti->strings + ti->items[i].key;
+	sitems[i].item = ti->items[i];
+    }
+    qsort(sitems, ti->count, sizeof(*sitems), sortItemCmp);
+    for (unsigned int i = 0; i < ti->count; i++)
+	ti->items[i] = sitems[i].item;
+    free(sitems);
+    ti->sorted = 1;
+}
+
+/* Move a mapped index to the heap before changing it */
+static void indexOwn(trigIndex ti)
+{
+    if (ti->map) {
+	struct trigIndexItem_s *items;
+	char *strings;
+
+	ti->alloced = ti->count ? ti->count : 1;
+	items = xmalloc(ti->alloced * sizeof(*items));
+	memcpy(items, ti->items, ti->count * sizeof(*items));
+	ti->stralloced = ti->strsize ? ti->strsize : 1;
+	strings = xmalloc(ti->stralloced);
+	memcpy(strings, ti->strings, ti->strsize);
+
+	sidecarUnmap(ti->map, ti->mapsize);
+	ti->map = NULL;
+	ti->mapsize = 0;
+	ti->items = items;
+	ti->strings = strings;
+    }
+    ti->modified = 1;
+}
+
+static uint32_t addString(trigIndex ti, const char *str, size_t len)
+{
+    size_t off = ti->strsize;
+
+    if (ti->strsize + len + 1 > ti->stralloced) {
+	ti->stralloced = ti->stralloced ? ti->stralloced * 2 : 4096;
+	if (ti->stralloced < ti->strsize + len + 1)
+	    ti->stralloced = ti->strsize + len + 1;
+	ti->strings = xrealloc(ti->strings, ti->stralloced);
+    }
+    memcpy(ti->strings + off, str, len);
+    ti->strings[off + len] = '\0';
+    ti->strsize += len + 1;
+    return off;
+}
+
+trigIndex trigIndexNew(const struct hdrShmId_s *id)
+{
+    trigIndex ti = xcalloc(1, sizeof(*ti));
+    ti->id = *id;
+    ti->sorted = 1;
+    ti->modified = 1;
+    return ti;
+}
+
+/* Is the mapped file complete and consistent? */
+static int indexValid(trigIndex ti, const struct trigHead_s *head)
+{
+    size_t tables = sizeof(*head) + (size_t)head->count * sizeof(*ti->items);
+
+    if (head->count > ti->mapsize ||
+	    tables > ti->mapsize || head->strsize != ti->mapsize - tables)
+	return 0;
+
+    for (unsigned int i = 0; i < head->count; i++) {
+	const struct trigIndexItem_s *item = &ti->items[i];
+	if (item->key >= ti->strsize ||
+		item->keylen >= ti->strsize - item->key ||
+		ti->strings[item->key + item->keylen] != '\0')
+	    return 0;
+	if (i > 0 && itemCmp(item - 1, ti->strings + (item - 1)->key,
+			     item, ti->strings + item->key) > 0)
+	    return 0;
+    }
+    return 1;
+}
+
+trigIndex trigIndexLoad(const char *path, const struct hdrShmId_s *id)
+{
+    const struct trigHead_s *head;
+    trigIndex ti = NULL;
+    size_t size = 0;
+    void *map;
+
+    if ((map = sidecarMap(path, sizeof(*head), &size)) == NULL)
+	goto exit;
+
+    head = map;
+    ti = xcalloc(1, sizeof(*ti));
+    ti->id = *id;
+    ti->map = map;
+    ti->mapsize = size;
+    ti->sorted = 1;
+    if (!sidecarHeadValid(map, size, TRIGINDEX_MAGIC, id))
+	goto stale;
+    ti->count = ti->alloced = head->count;
+    ti->items = (struct trigIndexItem_s *)(head + 1);
+    ti->strings = (char *)(ti->items + head->count);
+    ti->strsize = ti->stralloced = head->strsize;
+    if (!indexValid(ti, head))
+	goto stale;
+
+    rpmlog(RPMLOG_DEBUG, "loaded %u triggers from %s\n", ti->count, path);
+    goto exit;
+
+stale:
+    ti->items = NULL;
+    ti->strings = NULL;
+    ti = trigIndexFree(ti);
+
+exit:
+    return ti;
+}
+
+struct trigWriter_s {
+    const struct trigHead_s *head;
+    const struct trigIndexItem_s *items;
+    const char *strings;
+};
+
+static int trigWrite(FILE *fp, void *data)
+{
+    struct trigWriter_s *w = data;
+
+    fwrite(w->head, sizeof(*w->head), 1, fp);
+    fwrite(w->items, sizeof(*w->items), w->head->count, fp);
+    fwrite(w->strings, 1, w->head->strsize, fp);
+    return 0;
+}
+
+int trigIndexWrite(trigIndex ti, const char *path,
+		   const struct hdrShmId_s *id)
+{
+    struct trigIndexItem_s *items = NULL;
+    char *strings = NULL;
+    size_t strsize = 0;
+    struct trigHead_s head;
+    struct trigWriter_s w;
+    int rc;
+
+    indexSort(ti);
+
+    /* Write only live keys, equal ones of adjacent items once */
+    items = xmalloc((ti->count + 1) * sizeof(*items));
+    strings = xmalloc(ti->strsize + 1);
+    for (unsigned int i = 0; i < ti->count; i++) {
+	const char *key = ti->strings + ti->items[i].key;
+	items[i] = ti->items[i];
+	if (i > 0 && items[i].type == items[i-1].type &&
+		rstreq(key, strings + items[i-1].key)) {
+	    items[i].key = items[i-1].key;
+	} else {
+	    items[i].key = strsize;
+	    memcpy(strings + strsize, key, items[i].keylen + 1);
+	    strsize += items[i].keylen + 1;
+	}
+    }
+
+    memset(&head, 0, sizeof(head));
+    sidecarHeadInit(&head.sc, TRIGINDEX_MAGIC, id,
+		    sizeof(head) + ti->count * sizeof(*items) + strsize);
+    head.count = ti->count;
+    head.strsize = strsize;
+
+    w.head = &head;
+    w.items = items;
+    w.strings = strings;
+    rc = sidecarWrite(path, trigWrite, &w);
+    if (rc) {
+	rpmlog(RPMLOG_DEBUG, "failed to store trigger index %s: %s\n",
+		path, strerror(errno));
+    } else {
+	rpmlog(RPMLOG_DEBUG, "stored %u triggers in %s\n", ti->count, path);
+	ti->id = *id;
+	ti->modified = 0;
+    }
+    free(items);
+    free(strings);
+    return rc;
+}
+
+trigIndex trigIndexFree(trigIndex ti)
+{
+    if (ti) {
+	if (ti->map) {
+	    sidecarUnmap(ti->map, ti->mapsize);
+	} else {
+	    free(ti->items);
+	    free(ti->strings);
+	}
+	free(ti);
+    }
+    return NULL;
+}
+
+int trigIndexMatches(trigIndex ti, const struct hdrShmId_s *id)
+{
+    return (memcmp(&ti->id, id, sizeof(*id)) == 0);
+}
+
+int trigIndexModified(trigIndex ti)
+{
+    return ti->modified;
+}
+
+void trigIndexAdd(trigIndex ti, unsigned int hdrNum, Header h)
+{
+    for (int t = 0; t < sizeof(trigTags) / sizeof(trigTags[0]); t++) {
+	const struct trigTags_s *tt = &trigTags[t];
+	rpmds ds = rpmdsInit(rpmdsNew(h, tt->nametag, 0));
+	struct rpmtd_s prios;
+	unsigned int start = ti->count;
+
+	if (ds == NULL)
+	    continue;
+
+	indexOwn(ti);
+	if (tt->priotag)
+	    headerGet(h, tt->priotag, &prios, HEADERGET_MINMEM);
+	else
+	    rpmtdReset(&prios);
+
+	while (rpmdsNext(ds) >= 0) {
+	    struct trigIndexItem_s *item;
+	    const char *N = rpmdsN(ds);
+	    uint32_t *prio;
+
+	    if (ti->count == ti->alloced) {
+		ti->alloced = ti->alloced ? ti->alloced * 2 : 64;
+		ti->items = xrealloc(ti->items,
+				     ti->alloced * sizeof(*ti->items));
+	    }
+	    item = &ti->items[ti->count];
+	    memset(item, 0, sizeof(*item));
+	    item->type = tt->type;
+	    item->keylen = strlen(N);
+	    item->key = addString(ti, N, item->keylen);
+	    item->sense = rpmdsFlags(ds);
+	    item->hdrNum = hdrNum;
+	    item->tix = rpmdsTi(ds);
+	    for (unsigned int i = start; i < ti->count; i++) {
+		if (ti->items[i].tix == item->tix)
+		    item->nth++;
+	    }
+	    if (rpmtdSetIndex(&prios, item->tix) >= 0 &&
+		    (prio = rpmtdGetUint32(&prios)) != NULL) {
+		item->priority = *prio;
+	    } else {
+		item->flags |= TRIGINDEX_NOPRIORITY;
+	    }
+	    ti->count++;
+	    ti->sorted = 0;
+	}
+	rpmtdFreeData(&prios);
+	rpmdsFree(ds);
+    }
+}
+
+void trigIndexRemove(trigIndex ti, unsigned int hdrNum)
+{
+    unsigned int to = 0;
+
+    for (unsigned int i = 0; i < ti->count; i++) {
+	if (ti->items[i].hdrNum == hdrNum)
+	    break;
+	to++;
+    }
+    if (to == ti->count)
+	return;
+
+    indexOwn(ti);
+    for (unsigned int i = to; i < ti->count; i++) {
+	if (ti->items[i].hdrNum != hdrNum)
+	    ti->items[to++] = ti->items[i];
+    }
+    ti->count = to;
+}
+
+unsigned int trigIndexLookup(trigIndex ti, unsigned int type, const char *key,
+			     const struct trigIndexItem_s **items)
+{
+    unsigned int lo = 0, hi, first;
+
+    indexSort(ti);
+
+    /* First item not sorting before (type, key) */
+    hi = ti->count;
+    while (lo < hi) {
+	unsigned int mid = lo + (hi - lo) / 2;
+	const struct trigIndexItem_s *item = &ti->items[mid];
+	int cmp = (item->type != type) ? (item->type > type ? 1 : -1) :
+		  (key ? strcmp(ti->strings + item->key, key) : 0);
+	if (cmp < 0)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    first = lo;
+
+    /* ... and past the last one matching */
+    hi = ti->count;
+    while (lo < hi) {
+	unsigned int mid = lo + (hi - lo) / 2;
+	const struct trigIndexItem_s *item = &ti->items[mid];
+	int cmp = (item->type != type) ? (item->type > type ? 1 : -1) :
+		  (key ? strcmp(ti->strings + item->key, key) : 0);
+	if (cmp <= 0)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+
+    *items = ti->items + first;
+    return lo - first;
+}
+
+const char *trigIndexKey(trigIndex ti, const struct trigIndexItem_s *item)
+{
+    return ti->strings + item->key;
+}
@@ -0,0 +1,142 @@
+#ifndef TRIGINDEX_H
+#define TRIGINDEX_H
+
+/** \file lib/trigindex.h
+ * Compact index of the triggers of the packages in a rpmdb.
+ *
+ * Every trigger dependency of every installed package is one item,
+ * sorted by trigger type and triggering name or file prefix. The items
+ * carry what trigger matching needs besides the name, so finding the
+ * triggers fired by a package or file doesn't need their headers. The
+ * index is stored next to the database and mapped read-only by later
+ * processes, tied to the state of the database file like the shared
+ * header cache.
+ */
+
+#include <rpm/rpmtypes.h>
+#include <rpm/rpmutil.h>
+
+#include "lib/hdrshm.h"		/* struct hdrShmId_s */
+
+typedef struct trigIndex_s * trigIndex;
+
+enum trigIndexFlags_e {
+    TRIGINDEX_NOPRIORITY	= (1 << 0),	/*!< header has no priorities */
+};
+
+/** One trigger dependency of a package */
+struct trigIndexItem_s {
+    uint32_t type;		/*!< RPMSCRIPT_{NORMAL,FILE,TRANSFILE}TRIGGER */
+    uint32_t key;		/*!< name or prefix, in the string table */
+    uint32_t keylen;
+    uint32_t sense;		/*!< dependency flags */
+    uint32_t priority;		/*!< file trigger priority */
+    uint32_t hdrNum;		/*!< package instance */
+    uint32_t tix;		/*!< trigger (script) index */
+    uint16_t nth;		/*!< dependency number within the trigger */
+    uint16_t flags;		/*!< TRIGINDEX_* bits */
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Create an empty trigger index.
+ * @param id		identity of the database it's made from
+ * @return		new index
+ */
+RPM_GNUC_INTERNAL
+trigIndex trigIndexNew(const struct hdrShmId_s *id);
+
+/**
+ * Map the trigger index stored for a database in its current state.
+ * @param path		index file path
+ * @param id		database identity
+ * @return		index, NULL if there's none or it's stale
+ */
+RPM_GNUC_INTERNAL
+trigIndex trigIndexLoad(const char *path, const struct hdrShmId_s *id);
+
+/**
+ * Store a trigger index.
+ * @param ti		trigger index
+ * @param path		index file path
+ * @param id		identity of the database it now matches
+ * @return		0 on success, -1 on error
+ */
+RPM_GNUC_INTERNAL
+int trigIndexWrite(trigIndex ti, const char *path,
+		   const struct hdrShmId_s *id);
+
+/**
+ * Free a trigger index.
+ * @param ti		trigger index (or NULL)
+ * @return		NULL always
+ */
+RPM_GNUC_INTERNAL
+trigIndex trigIndexFree(trigIndex ti);
+
+/**
+ * Is the index made from the database in this state?
+ * @param ti		trigger index
+ * @param id		database identity
+ * @return		1 if it is, 0 otherwise
+ */
+RPM_GNUC_INTERNAL
+int trigIndexMatches(trigIndex ti, const struct hdrShmId_s *id);
+
+/**
+ * Does the index need storing, ie was it created or changed since it
+ * was loaded or stored?
+ * @param ti		trigger index
+ * @return		1 if it has, 0 otherwise
+ */
+RPM_GNUC_INTERNAL
+int trigIndexModified(trigIndex ti);
+
+/**
+ * Add the triggers of a package.
+ * @param ti		trigger index
+ * @param hdrNum	package instance
+ * @param h		package header
+ */
+RPM_GNUC_INTERNAL
+void trigIndexAdd(trigIndex ti, unsigned int hdrNum, Header h);
+
+/**
+ * Remove the triggers of a package.
+ * @param ti		trigger index
+ * @param hdrNum	package instance
+ */
+RPM_GNUC_INTERNAL
+void trigIndexRemove(trigIndex ti, unsigned int hdrNum);
+
+/**
+ * Find the triggers of a type on a name or prefix. The items are
+ * sorted by key, then package instance, trigger index and dependency
+ * number, and stay valid until the index is changed.
+ * @param ti		trigger index
+ * @param type		RPMSCRIPT_{NORMAL,FILE,TRANSFILE}TRIGGER
+ * @param key		name or prefix, NULL for all of the type
+ * @retval items	first item
+ * @return		number of items
+ */
+RPM_GNUC_INTERNAL
+unsigned int trigIndexLookup(trigIndex ti, unsigned int type, const char *key,
+			     const struct trigIndexItem_s **items);
+
+/**
+ * Return the name or prefix of an item.
+ * @param ti		trigger index
+ * @param item		item
+ * @return		key string
+ */
+RPM_GNUC_INTERNAL
+const char *trigIndexKey(trigIndex ti, const struct trigIndexItem_s *item);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TRIGINDEX_H */
@@ -0,0 +1,196 @@
+#include "system.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rpm/header.h>
+#include <rpm/rpmdb.h>
+#include <rpm/rpmfileutil.h>
+#include <rpm/rpmlog.h>
+#include <rpm/rpmmacro.h>
+#include <rpm/rpmcrypto.h>
+#include <rpm/rpmstring.h>
+#include <rpm/rpmts.h>
+
+#include "lib/rpmlead.h"
+#include "lib/rpmte_internal.h"
+#include "lib/signature.h"
+#include "lib/tsrecord.h"
+
+#include "debug.h"
+
+struct dbPos_s {
+    unsigned int hdrNum;
+    unsigned int pos;
+};
+
+static int dbPosCmp(const void *a, const void *b)
+{
+    const struct dbPos_s *pa = a, *pb = b;
+    return (pa->hdrNum > pb->hdrNum) - (pa->hdrNum < pb->hdrNum);
+}
+
+/* Store the installed headers, returning their positions by instance */
+static int writeRpmdb(rpmts ts, const char *path,
+		      struct dbPos_s **posp, unsigned int *nposp)
+{
+    FD_t fd = Fopen(path, "w.ufdio");
+    rpmdbMatchIterator mi;
+    struct dbPos_s *pos = NULL;
+    unsigned int npos = 0;
+    int rc = 0;
+    Header h;
+
+    if (fd == NULL)
+	return -1;
+
+    mi = rpmtsInitIterator(ts, RPMDBI_PACKAGES, NULL, 0);
+    while ((h = rpmdbNextIterator(mi)) != NULL) {
+	if (headerWrite(fd, h, HEADER_MAGIC_YES)) {
+	    rc = -1;
+	    break;
+	}
+	pos = xrealloc(pos, (npos + 1) * sizeof(*pos));
+	pos[npos].hdrNum = rpmdbGetIteratorOffset(mi);
+	pos[npos].pos = npos;
+	npos++;
+    }
+    rpmdbFreeIterator(mi);
+
+    if (Fclose(fd))
+	rc = -1;
+    if (npos > 1)
+	qsort(pos, npos, sizeof(*pos), dbPosCmp);
+    *posp = pos;
+    *nposp = npos;
+    return rc;
+}
+
+/* A package with the header of an added element and no payload */
+static int writePackage(Header h, const char *path)
+{
+    FD_t fd = Fopen(path, "w.ufdio");
+    unsigned int size = 0;
+    void *blob = headerExport(h, &size);
+    char *sha256 = NULL;
+    DIGEST_CTX ctx;
+    int rc = -1;
+
+    if (fd == NULL || blob == NULL)
+	goto exit;
+
+    /* Only the header digest, the payload is missing anyway */
+    ctx = rpmDigestInit(RPM_HASH_SHA256, RPMDIGEST_NONE);
+    rpmDigestUpdate(ctx, rpm_header_magic, sizeof(rpm_header_magic));
+    rpmDigestUpdate(ctx, blob, size);
+    rpmDigestFinal(ctx, (void **) &sha256, NULL, 1);
+
+    if (rpmLeadWrite(fd, h) == RPMRC_OK &&
+	    rpmGenerateSignature(sha256, NULL, NULL,
+				 headerSizeof(h, HEADER_MAGIC_YES), 0,
+				 fd) == RPMRC_OK &&
+	    headerWrite(fd, h, HEADER_MAGIC_YES) == 0)
+	rc = 0;
+
+exit:
+    if (fd && Fclose(fd))
+	rc = -1;
+    free(sha256);
+    free(blob);
+    return rc;
+}
+
+static int writeTransaction(rpmts ts, rpmprobFilterFlags ignoreSet,
+			    const char *dir, const char *path,
+			    const struct dbPos_s *pos, unsigned int npos)
+{
+    FILE *f = fopen(path, "w");
+    rpmtsi pi;
+    rpmte p;
+    int nadded = 0;
+    int rc = 0;
+
+    if (f == NULL)
+	return -1;
+
+    fprintf(f, "flags 0x%x\n", rpmtsFlags(ts));
+    fprintf(f, "probfilter 0x%x\n", ignoreSet);
+    fprintf(f, "vsflags 0x%x\n", rpmtsVSFlags(ts));
+    fprintf(f, "vfyflags 0x%x\n", rpmtsVfyFlags(ts));
+    fprintf(f, "vfylevel %d\n", rpmtsVfyLevel(ts));
+    fprintf(f, "color %u\n", rpmtsColor(ts));
+    fprintf(f, "prefcolor %u\n", rpmtsPrefColor(ts));
+
+    pi = rpmtsiInit(ts);
+    while ((p = rpmtsiNext(pi, 0)) != NULL) {
+	if (rpmteType(p) == TR_ADDED) {
+	    Header h = rpmteHeader(p);
+	    char *fn = NULL;
+	    char *pkgpath;
+
+	    rasprintf(&fn, "added-%d.rpm", nadded++);
+	    pkgpath = rpmGetPath(dir, "/", fn, NULL);
+	    if (h == NULL || writePackage(h, pkgpath))
+		rc = -1;
+	    else
+		fprintf(f, "install %d %s\n", rpmteAddOp(p), fn);
+	    headerFree(h);
+	    free(pkgpath);
+	    free(fn);
+	} else if (rpmteDependsOn(p) == NULL) {
+	    struct dbPos_s key = { .hdrNum = rpmteDBInstance(p) };
+	    struct dbPos_s *dp = bsearch(&key, pos, npos, sizeof(*pos),
+					 dbPosCmp);
+	    if (dp)
+		fprintf(f, "erase %u\n", dp->pos);
+	    else
+		rc = -1;
+	}
+    }
+    rpmtsiFree(pi);
+
+    if (fclose(f))
+	rc = -1;
+    return rc;
+}
+
+void tsRecord(rpmts ts, rpmprobFilterFlags ignoreSet)
+{
+    char *topdir = rpmExpand("%{?_transaction_record_dir}", NULL);
+    struct dbPos_s *pos = NULL;
+    unsigned int npos = 0;
+    char *dir = NULL;
+    char *path;
+    int rc = -1;
+
+    if (*topdir != '/')
+	goto exit;
+
+    dir = rpmGetPath(topdir, "/rpmts-XXXXXX", NULL);
+    if (rpmioMkpath(topdir, 0755, -1, -1) || mkdtemp(dir) == NULL)
+	goto exit;
+
+    path = rpmGetPath(dir, "/rpmdb.hdr", NULL);
+    rc = writeRpmdb(ts, path, &pos, &npos);
+    free(path);
+
+    if (rc == 0) {
+	path = rpmGetPath(dir, "/transaction", NULL);
+	rc = writeTransaction(ts, ignoreSet, dir, path, pos, npos);
+	free(path);
+    }
+
+    if (rc == 0)
+	rpmlog(RPMLOG_DEBUG, "recorded transaction in %s\n", dir);
+
+exit:
+    if (rc && *topdir == '/') {
+	rpmlog(RPMLOG_WARNING, _("unable to record transaction in %s: %s\n"),
+	       dir ? dir : topdir, strerror(errno));
+    }
+    free(pos);
+    free(dir);
+    free(topdir);
+}
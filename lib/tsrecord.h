@@ -0,0 +1,41 @@
+#ifndef TSRECORD_H
+#define TSRECORD_H
+
+/** \file lib/tsrecord.h
+ * Recording of transaction inputs for replaying them later.
+ *
+ * With %_transaction_record_dir set, each transaction leaves a directory
+ * there with everything needed to run it again against a scratch root:
+ *
+ *	transaction	the flags and the elements, one per line
+ *	rpmdb.hdr	the installed package headers, one after another
+ *	added-N.rpm	header-only packages of the added elements
+ *
+ * Added elements are stored as packages without a payload, so they can
+ * be read back with rpmReadPackageFile() but only run in test mode.
+ * Erased elements refer to their position in rpmdb.hdr. Erasures that
+ * come from upgrades are not listed, adding the package again with the
+ * same operation brings them back.
+ */
+
+#include <rpm/rpmtypes.h>
+#include <rpm/rpmprob.h>
+#include <rpm/rpmutil.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Record the inputs of a transaction set, if enabled.
+ * @param ts		transaction set
+ * @param ignoreSet	problem filter passed to rpmtsRun()
+ */
+RPM_GNUC_INTERNAL
+void tsRecord(rpmts ts, rpmprobFilterFlags ignoreSet);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TSRECORD_H */
@@ -22,17 +22,346 @@
 #include <rpm/rpmdb.h>
 #include <rpm/rpmfileutil.h>
 #include <rpm/rpmstring.h>
+#include <rpm/rpmcrypto.h>
+#include <rpm/rpmmacro.h>
 
 #include "lib/misc.h"
 #include "lib/rpmchroot.h"
+#include "lib/rpmdb_internal.h"
+#include "lib/rpmfi_internal.h"
 #include "lib/rpmte_internal.h"	/* rpmteProcess() */
 #include "lib/rpmug.h"
+#include "lib/rpmworkers.h"
 
 #include "debug.h"
 
 #define S_ISDEV(m) (S_ISBLK((m)) || S_ISCHR((m)))
 
-rpmVerifyAttrs rpmfilesVerify(rpmfiles fi, int ix, rpmVerifyAttrs omitMask)
+/*
+ * Persistent cache of file digests calculated by earlier verify runs,
+ * enabled by setting %_verify_cache to a path. A digest is reused as long
+ * as device, inode, size, mtime and ctime of the file are unchanged. The
+ * ctime can't be set back from user space, so restoring the mtime
+ * of a modified file does not hide the change. The cache is
+ * authenticated with a HMAC keyed by a random secret stored alongside,
+ * and discarded whenever the rpmdb cookie changes.
+ */
+#define VC_MAGIC	"RPMVFYC1"
+#define VC_KEYLEN	32
+#define VC_MACLEN	32
+#define VC_BLOCKLEN	64
+
+struct vcEntry_s {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime;
+    int64_t ctime;
+    uint32_t algo;
+    uint32_t diglen;		/*!< 0 if no digest was calculated */
+    unsigned char digest[64];
+};
+
+#define HASHTYPE vcHash
+#define HTKEYTYPE struct vcEntry_s *
+#include "lib/rpmhash.H"
+#include "lib/rpmhashoa.C"
+#undef HASHTYPE
+#undef HTKEYTYPE
+
+typedef struct verifyCache_s {
+    char *path;
+    char *cookie;
+    unsigned char key[VC_KEYLEN];
+    vcHash hash;
+    struct vcEntry_s **entries;
+    int nentries;
+    int nalloced;
+    int dirty;
+} * verifyCache;
+
+/* Cache of the running rpmcliVerify(), if any */
+static verifyCache verifycache = NULL;
+
+static unsigned int vcEntryHash(struct vcEntry_s *e)
+{
+    return (unsigned int) (e->ino ^ (e->ino >> 32) ^ (e->dev * 31));
+}
+
+static int vcEntryCmp(struct vcEntry_s *a, struct vcEntry_s *b)
+{
+    return !(a->ino == b->ino && a->dev == b->dev);
+}
+
+static void vcHmac(const unsigned char *key, const void *data, size_t len,
+		   unsigned char *mac)
+{
+    unsigned char pad[VC_BLOCKLEN];
+    void *ihash = NULL, *ohash = NULL;
+    DIGEST_CTX ctx;
+
+    memset(pad, 0x36, sizeof(pad));
+    for (int i = 0; i < VC_KEYLEN; i++)
+	pad[i] ^= key[i];
+    ctx = rpmDigestInit(RPM_HASH_SHA256, RPMDIGEST_NONE);
+    rpmDigestUpdate(ctx, pad, sizeof(pad));
+    rpmDigestUpdate(ctx, data, len);
+    rpmDigestFinal(ctx, &ihash, NULL, 0);
+
+    memset(pad, 0x5c, sizeof(pad));
+    for (int i = 0; i < VC_KEYLEN; i++)
+	pad[i] ^= key[i];
+    ctx = rpmDigestInit(RPM_HASH_SHA256, RPMDIGEST_NONE);
+    rpmDigestUpdate(ctx, pad, sizeof(pad));
+    rpmDigestUpdate(ctx, ihash, VC_MACLEN);
+    rpmDigestFinal(ctx, &ohash, NULL, 0);
+
+    memcpy(mac, ohash, VC_MACLEN);
+    free(ihash);
+    free(ohash);
+}
+
+static int readFull(int fdno, void *buf, size_t len)
+{
+    unsigned char *b = buf;
+    while (len > 0) {
+	ssize_t nb = read(fdno, b, len);
+	if (nb <= 0)
+	    return -1;
+	b += nb;
+	len -= nb;
+    }
+    return 0;
+}
+
+static int writeFull(int fdno, const void *buf, size_t len)
+{
+    const unsigned char *b = buf;
+    while (len > 0) {
+	ssize_t nb = write(fdno, b, len);
+	if (nb <= 0)
+	    return -1;
+	b += nb;
+	len -= nb;
+    }
+    return 0;
+}
+
+/* Read the HMAC key, generating a new one on first use */
+static int vcLoadKey(verifyCache vc)
+{
+    char *kpath = rstrscat(NULL, vc->path, ".key", NULL);
+    int rc = -1;
+    int fdno = open(kpath, O_RDONLY);
+
+    if (fdno >= 0) {
+	rc = readFull(fdno, vc->key, VC_KEYLEN);
+	close(fdno);
+    } else if (errno == ENOENT) {
+	int rfd = open("/dev/urandom", O_RDONLY);
+	if (rfd >= 0) {
+	    if (readFull(rfd, vc->key, VC_KEYLEN) == 0) {
+		fdno = open(kpath, O_WRONLY|O_CREAT|O_EXCL, 0600);
+		if (fdno >= 0) {
+		    rc = writeFull(fdno, vc->key, VC_KEYLEN);
+		    if (close(fdno))
+			rc = -1;
+		    if (rc)
+			unlink(kpath);
+		}
+	    }
+	    close(rfd);
+	}
+    }
+    free(kpath);
+    return rc;
+}
+
+static void vcAdd(verifyCache vc, const struct vcEntry_s *ent)
+{
+    struct vcEntry_s *e = NULL;
+
+    if (vcHashGetEntry(vc->hash, (struct vcEntry_s *) ent, &e)) {
+	*e = *ent; /* struct assignment */
+    } else {
+	e = xmalloc(sizeof(*e));
+	*e = *ent; /* struct assignment */
+	if (vc->nentries == vc->nalloced) {
+	    vc->nalloced = vc->nalloced ? vc->nalloced * 2 : 256;
+	    vc->entries = xrealloc(vc->entries,
+				   vc->nalloced * sizeof(*vc->entries));
+	}
+	vc->entries[vc->nentries++] = e;
+	vcHashAddEntry(vc->hash, e);
+    }
+    vc->dirty = 1;
+}
+
+static const struct vcEntry_s *vcLookup(verifyCache vc, const struct stat *sb)
+{
+    struct vcEntry_s probe, *e = NULL;
+
+    if (vc == NULL)
+	return NULL;
+
+    probe.dev = sb->st_dev;
+    probe.ino = sb->st_ino;
+    if (!vcHashGetEntry(vc->hash, &probe, &e))
+	return NULL;
+    if (e->size != (uint64_t) sb->st_size || e->mtime != sb->st_mtime ||
+	    e->ctime != sb->st_ctime)
+	return NULL;
+    return e;
+}
+
+/* Load cache contents, an invalid or stale cache is silently ignored */
+static void vcLoad(verifyCache vc)
+{
+    unsigned char *buf = NULL;
+    unsigned char mac[VC_MACLEN];
+    struct stat sb;
+    uint32_t clen, n;
+    size_t off = sizeof(VC_MAGIC) - 1;
+    int fdno = open(vc->path, O_RDONLY);
+
+    if (fdno < 0)
+	return;
+    if (fstat(fdno, &sb) || sb.st_size < (off_t) (off + 8 + VC_MACLEN))
+	goto exit;
+
+    buf = xmalloc(sb.st_size);
+    if (readFull(fdno, buf, sb.st_size))
+	goto exit;
+
+    vcHmac(vc->key, buf, sb.st_size - VC_MACLEN, mac);
+    if (memcmp(mac, buf + sb.st_size - VC_MACLEN, VC_MACLEN) ||
+	    memcmp(buf, VC_MAGIC, off))
+	goto exit;
+
+    memcpy(&clen, buf + off, sizeof(clen));
+    off += sizeof(clen);
+    if (clen > sb.st_size - off - 4 - VC_MACLEN)
+	goto exit;
+    if (clen != strlen(vc->cookie) || memcmp(buf + off, vc->cookie, clen)) {
+	rpmlog(RPMLOG_DEBUG, "verify cache %s is stale\n", vc->path);
+	vc->dirty = 1;
+	goto exit;
+    }
+    off += clen;
+    memcpy(&n, buf + off, sizeof(n));
+    off += sizeof(n);
+    if ((uint64_t) n * sizeof(struct vcEntry_s) != sb.st_size - off - VC_MACLEN)
+	goto exit;
+
+    for (uint32_t i = 0; i < n; i++) {
+	struct vcEntry_s ent;
+	memcpy(&ent, buf + off + i * sizeof(ent), sizeof(ent));
+	vcAdd(vc, &ent);
+    }
+    vc->dirty = 0;
+
+exit:
+    free(buf);
+    close(fdno);
+}
+
+static void vcSave(verifyCache vc)
+{
+    char *tpath = rstrscat(NULL, vc->path, ".tmp", NULL);
+    uint32_t clen = strlen(vc->cookie);
+    uint32_t n = vc->nentries;
+    size_t len = sizeof(VC_MAGIC) - 1 + sizeof(clen) + clen + sizeof(n) +
+		 n * sizeof(struct vcEntry_s);
+    unsigned char *buf = xmalloc(len + VC_MACLEN);
+    unsigned char *b = buf;
+    int fdno, rc = -1;
+
+    memcpy(b, VC_MAGIC, sizeof(VC_MAGIC) - 1);
+    b += sizeof(VC_MAGIC) - 1;
+    memcpy(b, &clen, sizeof(clen));
+    b += sizeof(clen);
+    memcpy(b, vc->cookie, clen);
+    b += clen;
+    memcpy(b, &n, sizeof(n));
+    b += sizeof(n);
+    for (uint32_t i = 0; i < n; i++) {
+	memcpy(b, vc->entries[i], sizeof(*vc->entries[i]));
+	b += sizeof(*vc->entries[i]);
+    }
+    vcHmac(vc->key, buf, len, b);
+
+    fdno = open(tpath, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+    if (fdno >= 0) {
+	rc = writeFull(fdno, buf, len + VC_MACLEN);
+	if (close(fdno))
+	    rc = -1;
+	if (rc == 0)
+	    rc = rename(tpath, vc->path);
+	if (rc)
+	    unlink(tpath);
+    }
+    if (rc) {
+	rpmlog(RPMLOG_DEBUG, "failed to write verify cache %s: %s\n",
+		vc->path, strerror(errno));
+    }
+    free(buf);
+    free(tpath);
+}
+
+static verifyCache verifyCacheNew(rpmts ts)
+{
+    verifyCache vc = NULL;
+    char *path = rpmExpand("%{?_verify_cache}", NULL);
+    char *cookie = NULL;
+
+    if (*path == '\0' || (cookie = rpmdbCookie(rpmtsGetRdb(ts))) == NULL)
+	goto exit;
+
+    vc = xcalloc(1, sizeof(*vc));
+    vc->path = rpmGenPath(rpmtsRootDir(ts), path, NULL);
+    vc->cookie = cookie;
+    vc->hash = vcHashCreate(1024, vcEntryHash, vcEntryCmp, NULL);
+    if (vcLoadKey(vc)) {
+	rpmlog(RPMLOG_DEBUG, "verify cache %s disabled: no key\n", vc->path);
+	free(vc->path);
+	free(vc->cookie);
+	vcHashFree(vc->hash);
+	vc = _free(vc);
+	goto exit;
+    }
+    vcLoad(vc);
+
+exit:
+    free(path);
+    return vc;
+}
+
+static verifyCache verifyCacheFree(verifyCache vc)
+{
+    if (vc) {
+	if (vc->dirty)
+	    vcSave(vc);
+	vcHashFree(vc->hash);
+	for (int i = 0; i < vc->nentries; i++)
+	    free(vc->entries[i]);
+	free(vc->entries);
+	free(vc->path);
+	free(vc->cookie);
+	free(vc);
+    }
+    return NULL;
+}
+
+/*
+ * Verify a single file. With quick set, the content digest of regular
+ * files is only calculated if their size or mtime differs from the metadata.
+ * Digests found in vc are used instead of reading the file, newly
+ * calculated ones are returned in ent (if not NULL) for adding to the cache.
+ * Must be safe to call from multiple threads on the same rpmfiles.
+ */
+static rpmVerifyAttrs verifyFile(rpmfiles fi, int ix, rpmVerifyAttrs omitMask,
+				 int quick, verifyCache vc,
+				 struct vcEntry_s *ent)
 {
     rpmfileAttrs fileAttrs = rpmfilesFFlags(fi, ix);
     rpmVerifyAttrs flags = rpmfilesVFlags(fi, ix);
@@ -101,6 +430,10 @@ rpmVerifyAttrs rpmfilesVerify(rpmfiles fi, int ix, rpmVerifyAttrs omitMask)
     /* Don't verify any features in omitMask. */
     flags &= ~(omitMask | RPMVERIFY_FAILURES);
 
+    /* Assume unchanged content if size and mtime are as expected */
+    if (quick && S_ISREG(sb.st_mode) &&
+	    sb.st_size == fsb.st_size && sb.st_mtime == fsb.st_mtime)
+	flags &= ~RPMVERIFY_FILEDIGEST;
 
     if (flags & RPMVERIFY_FILEDIGEST) {
 	const unsigned char *digest; 
@@ -109,12 +442,26 @@ rpmVerifyAttrs rpmfilesVerify(rpmfiles fi, int ix, rpmVerifyAttrs omitMask)
 
 	if ((digest = rpmfilesFDigest(fi, ix, &algo, &diglen))) {
 	    unsigned char fdigest[diglen];
+	    const struct vcEntry_s *ce = vcLookup(vc, &sb);
 
-	    if (rpmDoDigest(algo, fn, 0, fdigest)) {
+	    if (ce && ce->algo == algo && ce->diglen == diglen) {
+		if (memcmp(ce->digest, digest, diglen))
+		    vfy |= RPMVERIFY_FILEDIGEST;
+	    } else if (rpmDoDigest(algo, fn, 0, fdigest)) {
 		vfy |= (RPMVERIFY_READFAIL|RPMVERIFY_FILEDIGEST);
 	    } else {
 		if (memcmp(fdigest, digest, diglen))
 		    vfy |= RPMVERIFY_FILEDIGEST;
+		if (ent && diglen <= sizeof(ent->digest)) {
+		    ent->dev = sb.st_dev;
+		    ent->ino = sb.st_ino;
+		    ent->size = sb.st_size;
+		    ent->mtime = sb.st_mtime;
+		    ent->ctime = sb.st_ctime;
+		    ent->algo = algo;
+		    ent->diglen = diglen;
+		    memcpy(ent->digest, fdigest, diglen);
+		}
 	    }
 	} else {
 	    vfy |= RPMVERIFY_FILEDIGEST;
@@ -213,6 +560,11 @@ exit:
     return vfy;
 }
 
+rpmVerifyAttrs rpmfilesVerify(rpmfiles fi, int ix, rpmVerifyAttrs omitMask)
+{
+    return verifyFile(fi, ix, omitMask, 0, NULL, NULL);
+}
+
 /**
  * Return exit code from running verify script from header.
  * @param ts		transaction set
@@ -318,6 +670,43 @@ static const char * stateStr(rpmfileState fstate)
     return _("unknown state");
 }
 
+struct verifyResult_s {
+    rpmVerifyAttrs vfy;		/*!< verify result, -1 if file not checked */
+    int err;			/*!< errno after checking the file */
+    struct vcEntry_s ent;	/*!< calculated digest for the cache */
+};
+
+struct verifyFiles_s {
+    rpmfiles files;
+    rpmVerifyAttrs omitMask;
+    rpmfileAttrs incAttrs;
+    rpmfileAttrs skipAttrs;
+    int quick;
+    verifyCache vc;
+    struct verifyResult_s *res;
+};
+
+/* Worker: verify one file, the results are reported in file order later */
+static void verifyFilesOne(void *data, int ix, int slot)
+{
+    struct verifyFiles_s *vf = data;
+    rpmfileAttrs fileAttrs = rpmfilesFFlags(vf->files, ix);
+    struct verifyResult_s *res = &vf->res[ix];
+
+    /* If filtering by inclusion, skip non-matching (eg --configfiles) */
+    /* Skip on attributes (eg from --noghost) */
+    if ((vf->incAttrs && !(vf->incAttrs & fileAttrs)) ||
+	    (vf->skipAttrs & fileAttrs)) {
+	res->vfy = (rpmVerifyAttrs) -1;
+	return;
+    }
+
+    errno = 0;
+    res->vfy = verifyFile(vf->files, ix, vf->omitMask, vf->quick, vf->vc,
+			  vf->vc ? &res->ent : NULL);
+    res->err = errno;
+}
+
 /**
  * Check file info from header against what's actually installed.
  * @param ts		transaction set
@@ -332,27 +721,44 @@ static int verifyHeader(rpmts ts, Header h, rpmVerifyAttrs omitMask,
 {
     rpmVerifyAttrs verifyResult = 0;
     rpmVerifyAttrs verifyAll = 0; /* assume no problems */
-    rpmfi fi = rpmfiNew(ts, h, RPMTAG_BASENAMES, RPMFI_FLAGS_VERIFY);
+    rpmfi fi = rpmfiNewPool(rpmdbHeaderPool(rpmtsGetRdb(ts), h), h,
+			    RPMTAG_BASENAMES, RPMFI_FLAGS_VERIFY);
+    struct verifyFiles_s vf;
+    int fc;
 
     if (fi == NULL)
 	return 1;
 
+    /*
+     * The file checks are dominated by stat() and digest I/O and are
+     * independent of each other, so they can run in parallel. Reporting
+     * (and the rpmdb lookups involved) is done afterwards in file order.
+     */
+    fc = rpmfiFC(fi);
+    vf.files = rpmfiFiles(fi);
+    vf.omitMask = omitMask;
+    vf.incAttrs = incAttrs;
+    vf.skipAttrs = skipAttrs;
+    vf.quick = rpmExpandNumeric("%{?_verify_quick_digest}");
+    vf.vc = verifycache;
+    vf.res = xcalloc(fc ? fc : 1, sizeof(*vf.res));
+    rpmworkersRun(rpmworkersCount("_verify_threads"), fc, verifyFilesOne, &vf);
+
     rpmfiInit(fi, 0);
     while (rpmfiNext(fi) >= 0) {
 	rpmfileAttrs fileAttrs = rpmfiFFlags(fi);
+	struct verifyResult_s *res = &vf.res[rpmfiFX(fi)];
 	char *buf = NULL, *attrFormat;
 	const char *fstate = NULL;
 	char ac;
 
-	/* If filtering by inclusion, skip non-matching (eg --configfiles) */
-	if (incAttrs && !(incAttrs & fileAttrs))
-	    continue;
-
-	/* Skip on attributes (eg from --noghost) */
-	if (skipAttrs & fileAttrs)
+	/* File was filtered out */
+	if (res->vfy == (rpmVerifyAttrs) -1)
 	    continue;
 
-	verifyResult = rpmfiVerify(fi, omitMask);
+	verifyResult = res->vfy;
+	if (res->ent.diglen)
+	    vcAdd(vf.vc, &res->ent);
 
 	/* Filter out timestamp differences of shared files */
 	if (verifyResult & RPMVERIFY_MTIME) {
@@ -373,9 +779,9 @@ static int verifyHeader(rpmts ts, Header h, rpmVerifyAttrs omitMask,
 	    if (!(fileAttrs & (RPMFILE_MISSINGOK|RPMFILE_GHOST)) || rpmIsVerbose()) {
 		rasprintf(&buf, _("missing   %c %s"), ac, rpmfiFN(fi));
 		if ((verifyResult & RPMVERIFY_LSTATFAIL) != 0 &&
-		    errno != ENOENT) {
+		    res->err != ENOENT) {
 		    char *app;
-		    rasprintf(&app, " (%s)", strerror(errno));
+		    rasprintf(&app, " (%s)", strerror(res->err));
 		    rstrcat(&buf, app);
 		    free(app);
 		}
@@ -400,6 +806,7 @@ static int verifyHeader(rpmts ts, Header h, rpmVerifyAttrs omitMask,
 
 	verifyAll |= verifyResult;
     }
+    free(vf.res);
     rpmfiFree(fi);
 	
     return (verifyAll != 0) ? 1 : 0;
@@ -478,6 +885,7 @@ int rpmcliVerify(rpmts ts, QVA_t qva, char * const * argv)
      */
     rpmtsOpenDB(ts, O_RDONLY);
     rpmdbOpenAll(rpmtsGetRdb(ts));
+    verifycache = verifyCacheNew(ts);
     if (rpmChrootSet(rpmtsRootDir(ts)) || rpmChrootIn()) {
 	ec = 1;
 	goto exit;
@@ -505,6 +913,7 @@ int rpmcliVerify(rpmts ts, QVA_t qva, char * const * argv)
 	ec = 1;
 
 exit:
+    verifycache = verifyCacheFree(verifycache);
     Fclose(scriptFd);
 
     return ec;
@@ -1,21 +1,60 @@
 #include "system.h"
 
 #include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
 
 #include <dbus/dbus.h>
 #include <rpm/rpmlog.h>
+#include <rpm/rpmmacro.h>
 #include <rpm/rpmstring.h>
 #include <rpm/rpmts.h>
 #include <rpm/rpmdb.h>
 #include "lib/rpmplugin.h"
 
+/* Default for %_dbus_announce_timeout, in milliseconds */
+#define ANNOUNCE_TIMEOUT	1000
+
+struct announce_msg {
+    struct announce_msg * next;
+    char * name;
+    char * dbcookie;
+    rpm_tid_t tid;
+};
+
+/*
+ * The bus connection is owned by a thread which connects and sends the
+ * queued signals, so a slow bus doesn't hold up the transaction. The
+ * hooks wait for it at most the configured timeout, which also bounds
+ * the time spent flushing each message. If the thread is still stuck at
+ * cleanup it is left to finish on its own and frees the state itself.
+ */
 struct dbus_announce_data {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    int have_thread;
+    struct announce_msg * head;
+    struct announce_msg ** tail;
+    int busy;
+    int quit;
+    int exited;
+    int orphaned;
+    int timeout;
+    int tried_thread;
     DBusConnection * bus;
 };
 
 static rpmRC dbus_announce_init(rpmPlugin plugin, rpmts ts)
 {
     struct dbus_announce_data * state = rcalloc(1, sizeof(*state));
+    pthread_mutex_init(&state->lock, NULL);
+    pthread_cond_init(&state->cond, NULL);
+    state->tail = &state->head;
+    state->timeout = rpmExpandNumeric("%{?_dbus_announce_timeout}");
+    if (state->timeout <= 0)
+	state->timeout = ANNOUNCE_TIMEOUT;
     rpmPluginSetData(plugin, state);
     return RPMRC_OK;
 }
@@ -29,23 +68,25 @@ static void dbus_announce_close_bus(struct dbus_announce_data * state)
     }
 }
 
-static rpmRC open_dbus(rpmPlugin plugin, rpmts ts)
+static void dbus_announce_free(struct dbus_announce_data * state)
+{
+    dbus_announce_close_bus(state);
+    while (state->head) {
+	struct announce_msg * msg = state->head;
+	state->head = msg->next;
+	free(msg->name);
+	free(msg->dbcookie);
+	free(msg);
+    }
+    pthread_cond_destroy(&state->cond);
+    pthread_mutex_destroy(&state->lock);
+    free(state);
+}
+
+static void open_dbus(struct dbus_announce_data * state)
 {
     DBusError err;
     int rc = 0;
-    struct dbus_announce_data * state = rpmPluginGetData(plugin);
-
-    /* Already open */
-    if (state->bus)
-	return RPMRC_OK;
-
-    /* ...don't notify on test transactions */
-    if (rpmtsFlags(ts) & (RPMTRANS_FLAG_TEST|RPMTRANS_FLAG_BUILD_PROBS))
-	return RPMRC_OK;
-
-    /* ...don't notify on chroot transactions */
-    if (!rstreq(rpmtsRootDir(ts), "/"))
-	return RPMRC_OK;
 
     dbus_error_init(&err);
 
@@ -64,77 +105,215 @@ static rpmRC open_dbus(rpmPlugin plugin, rpmts ts)
 	dbus_announce_close_bus(state);
 	goto err;
     }
-    return RPMRC_OK;
+    return;
  err:
     rpmlog(RPMLOG_WARNING,
 	   "dbus_announce plugin: Error connecting to dbus (%s)\n",
 	   err.message);
     dbus_error_free(&err);
-    return RPMRC_OK;
 }
 
-static void dbus_announce_cleanup(rpmPlugin plugin)
+static int64_t now_ms(void)
 {
-    struct dbus_announce_data * state = rpmPluginGetData(plugin);
-    dbus_announce_close_bus(state);
-    free(state);
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
-static rpmRC send_ts_message(rpmPlugin plugin,
-			     const char * name,
-			     rpmts ts,
-			     int res)
+static void send_ts_message(struct dbus_announce_data * state,
+			    struct announce_msg * amsg)
 {
-    struct dbus_announce_data * state = rpmPluginGetData(plugin);
     DBusMessage* msg;
-    char * dbcookie = NULL;
 
     if (!state->bus)
-	return RPMRC_OK;
+	return;
 
     msg = dbus_message_new_signal("/org/rpm/Transaction", /* object name */
 				  "org.rpm.Transaction",  /* interface name */
-				  name);                  /* signal name */
+				  amsg->name);            /* signal name */
     if (msg == NULL)
 	goto err;
 
-    dbcookie = rpmdbCookie(rpmtsGetRdb(ts));
-    rpm_tid_t tid = rpmtsGetTid(ts);
     if (!dbus_message_append_args(msg,
-				  DBUS_TYPE_STRING, &dbcookie,
-				  DBUS_TYPE_UINT32, &tid,
+				  DBUS_TYPE_STRING, &amsg->dbcookie,
+				  DBUS_TYPE_UINT32, &amsg->tid,
 				  DBUS_TYPE_INVALID))
 	goto err;
 
     if (!dbus_connection_send(state->bus, msg, NULL))
 	goto err;
+    dbus_message_unref(msg);
 
-    dbus_connection_flush(state->bus);
-    dbcookie = _free(dbcookie);
-
-    return RPMRC_OK;
+    /* Like dbus_connection_flush() but bounded */
+    int64_t deadline = now_ms() + state->timeout;
+    while (dbus_connection_has_messages_to_send(state->bus)) {
+	int64_t left = deadline - now_ms();
+	if (left <= 0 || !dbus_connection_read_write(state->bus, left)) {
+	    rpmlog(RPMLOG_WARNING,
+		   "dbus_announce plugin: Timeout sending message (%s)\n",
+		   amsg->name);
+	    break;
+	}
+    }
+    return;
 
  err:
+    if (msg)
+	dbus_message_unref(msg);
     rpmlog(RPMLOG_WARNING,
 	   "dbus_announce plugin: Error sending message (%s)\n",
-	   name);
-    dbcookie = _free(dbcookie);
-    return RPMRC_OK;
+	   amsg->name);
 }
 
-static rpmRC dbus_announce_tsm_pre(rpmPlugin plugin, rpmts ts)
+static void process_msg(struct dbus_announce_data * state,
+			struct announce_msg * msg)
 {
-    int rc;
+    if (!state->bus && rstreq(msg->name, "StartTransaction"))
+	open_dbus(state);
+    send_ts_message(state, msg);
+    free(msg->name);
+    free(msg->dbcookie);
+    free(msg);
+}
+
+static void *announce_thread(void *arg)
+{
+    struct dbus_announce_data * state = arg;
+    int orphaned;
+
+    pthread_mutex_lock(&state->lock);
+    while (1) {
+	while (!state->quit && state->head == NULL)
+	    pthread_cond_wait(&state->cond, &state->lock);
+	if (state->head == NULL)
+	    break;
+
+	struct announce_msg * msg = state->head;
+	state->head = msg->next;
+	if (state->head == NULL)
+	    state->tail = &state->head;
+	state->busy = 1;
+	pthread_mutex_unlock(&state->lock);
 
-    rc = open_dbus(plugin, ts);
-    if (rc != RPMRC_OK)
-	return rc;
-    return send_ts_message(plugin, "StartTransaction", ts, RPMRC_OK);
+	process_msg(state, msg);
+
+	pthread_mutex_lock(&state->lock);
+	state->busy = 0;
+	pthread_cond_broadcast(&state->cond);
+    }
+    state->exited = 1;
+    orphaned = state->orphaned;
+    pthread_cond_broadcast(&state->cond);
+    pthread_mutex_unlock(&state->lock);
+
+    if (orphaned)
+	dbus_announce_free(state);
+    return NULL;
+}
+
+/*
+ * Wait at most the timeout for *flag to become want, or with no flag for
+ * the queue to drain. Called locked, returns 0 on timeout.
+ */
+static int wait_for(struct dbus_announce_data * state, int *flag, int want)
+{
+    struct timespec deadline;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += state->timeout / 1000;
+    deadline.tv_nsec += (state->timeout % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+	deadline.tv_sec++;
+	deadline.tv_nsec -= 1000000000L;
+    }
+
+    while ((flag ? (*flag != want) : (state->head || state->busy))) {
+	if (pthread_cond_timedwait(&state->cond, &state->lock,
+				   &deadline) == ETIMEDOUT)
+	    return 0;
+    }
+    return 1;
+}
+
+static void queue_ts_message(rpmPlugin plugin, const char * name, rpmts ts,
+			     int wait)
+{
+    struct dbus_announce_data * state = rpmPluginGetData(plugin);
+    struct announce_msg * msg;
+
+    /* ...don't notify on test transactions */
+    if (rpmtsFlags(ts) & (RPMTRANS_FLAG_TEST|RPMTRANS_FLAG_BUILD_PROBS))
+	return;
+
+    /* ...don't notify on chroot transactions */
+    if (!rstreq(rpmtsRootDir(ts), "/"))
+	return;
+
+    msg = xcalloc(1, sizeof(*msg));
+    msg->name = xstrdup(name);
+    msg->dbcookie = rpmdbCookie(rpmtsGetRdb(ts));
+    msg->tid = rpmtsGetTid(ts);
+
+    if (!state->tried_thread) {
+	state->tried_thread = 1;
+	if (dbus_threads_init_default() &&
+	    pthread_create(&state->thread, NULL, announce_thread, state) == 0)
+	    state->have_thread = 1;
+    }
+
+    if (!state->have_thread) {
+	process_msg(state, msg);
+	return;
+    }
+
+    pthread_mutex_lock(&state->lock);
+    *state->tail = msg;
+    state->tail = &msg->next;
+    pthread_cond_broadcast(&state->cond);
+    if (wait && !wait_for(state, NULL, 0)) {
+	rpmlog(RPMLOG_DEBUG,
+	       "dbus_announce plugin: not waiting for %s to be sent\n", name);
+    }
+    pthread_mutex_unlock(&state->lock);
+}
+
+static void dbus_announce_cleanup(rpmPlugin plugin)
+{
+    struct dbus_announce_data * state = rpmPluginGetData(plugin);
+    int exited = 1;
+
+    if (state->have_thread) {
+	pthread_mutex_lock(&state->lock);
+	state->quit = 1;
+	pthread_cond_broadcast(&state->cond);
+	exited = wait_for(state, &state->exited, 1);
+	if (!exited)
+	    state->orphaned = 1;
+	pthread_mutex_unlock(&state->lock);
+
+	if (exited) {
+	    pthread_join(state->thread, NULL);
+	} else {
+	    rpmlog(RPMLOG_WARNING,
+		   "dbus_announce plugin: giving up on sending messages\n");
+	    pthread_detach(state->thread);
+	}
+    }
+
+    if (exited)
+	dbus_announce_free(state);
+}
+
+static rpmRC dbus_announce_tsm_pre(rpmPlugin plugin, rpmts ts)
+{
+    queue_ts_message(plugin, "StartTransaction", ts, 1);
+    return RPMRC_OK;
 }
 
 static rpmRC dbus_announce_tsm_post(rpmPlugin plugin, rpmts ts, int res)
 {
-    return send_ts_message(plugin, "EndTransaction", ts, res);
+    queue_ts_message(plugin, "EndTransaction", ts, 0);
+    return RPMRC_OK;
 }
 
 struct rpmPluginHooks_s dbus_announce_hooks = {
@@ -7,19 +7,48 @@
 #include <stdlib.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <limits.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <sys/stat.h>
 
+/* Upper limit of messages waiting for the writer thread */
+#define QUEUE_MAX	(1024 * 1024)
+
+/* Messages are sent in whole lines, at most PIPE_BUF at a time */
+struct fapolicyd_msg {
+    struct fapolicyd_msg * next;
+    size_t len;
+    char buf[PIPE_BUF];
+};
+
 struct fapolicyd_data {
     int fd;
     long changed_files;
     const char * fifo_path;
+    /* message being filled by the hooks */
+    struct fapolicyd_msg * cur;
+    /* messages queued for the writer thread */
+    pthread_t writer;
+    int have_writer;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct fapolicyd_msg * head;
+    struct fapolicyd_msg ** tail;
+    size_t queued;
+    int busy;
+    int quit;
 };
 
 static struct fapolicyd_data fapolicyd_state = {
     .fd = -1,
     .changed_files = 0,
     .fifo_path = "/run/fapolicyd/fapolicyd.fifo",
+    .cur = NULL,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .head = NULL,
+    .tail = &fapolicyd_state.head,
 };
 
 static rpmRC open_fifo(struct fapolicyd_data* state)
@@ -75,10 +104,10 @@ static void close_fifo(struct fapolicyd_data* state)
     state->fd = -1;
 }
 
-static rpmRC write_fifo(struct fapolicyd_data* state, const char * str)
+static rpmRC write_fifo(struct fapolicyd_data* state, const char * str,
+                        size_t len)
 {
-    ssize_t len = strlen(str);
-    ssize_t written = 0;
+    size_t written = 0;
     ssize_t n = 0;
 
     while (written < len) {
@@ -97,7 +126,8 @@ static rpmRC write_fifo(struct fapolicyd_data* state, const char * str)
     return RPMRC_FAIL;
 }
 
-static void try_to_write_to_fifo(struct fapolicyd_data* state, const char * str)
+static void try_to_write_to_fifo(struct fapolicyd_data* state, const char * str,
+                                 size_t len)
 {
     int reload = 0;
     int printed = 0;
@@ -119,7 +149,7 @@ static void try_to_write_to_fifo(struct fapolicyd_data* state, const char * str)
         }
 
         if (state->fd >= 0) {
-            if (write_fifo(state, str) == RPMRC_OK) {
+            if (write_fifo(state, str, len) == RPMRC_OK) {
 
                 /* write was successful after few reopens */
                 if (reload)
@@ -144,6 +174,118 @@ static void try_to_write_to_fifo(struct fapolicyd_data* state, const char * str)
 
 }
 
+/*
+ * The messages are written out by a thread so a slow daemon doesn't
+ * hold up the transaction, until the queue fills up that is. The
+ * messages keep their order and the points where the daemon needs to
+ * be up to date wait for the queue to drain.
+ */
+static void *writer_thread(void *arg)
+{
+    struct fapolicyd_data* state = arg;
+
+    pthread_mutex_lock(&state->lock);
+    while (1) {
+        while (!state->quit && state->head == NULL)
+            pthread_cond_wait(&state->cond, &state->lock);
+        if (state->head == NULL)
+            break;
+
+        struct fapolicyd_msg *msg = state->head;
+        state->head = msg->next;
+        if (state->head == NULL)
+            state->tail = &state->head;
+        state->busy = 1;
+        pthread_mutex_unlock(&state->lock);
+
+        try_to_write_to_fifo(state, msg->buf, msg->len);
+
+        pthread_mutex_lock(&state->lock);
+        state->queued -= msg->len;
+        state->busy = 0;
+        free(msg);
+        pthread_cond_broadcast(&state->cond);
+    }
+    pthread_mutex_unlock(&state->lock);
+    return NULL;
+}
+
+static void queue_msg(struct fapolicyd_data* state, struct fapolicyd_msg *msg)
+{
+    if (!state->have_writer) {
+        try_to_write_to_fifo(state, msg->buf, msg->len);
+        free(msg);
+        return;
+    }
+
+    pthread_mutex_lock(&state->lock);
+    while (state->queued >= QUEUE_MAX)
+        pthread_cond_wait(&state->cond, &state->lock);
+    msg->next = NULL;
+    *state->tail = msg;
+    state->tail = &msg->next;
+    state->queued += msg->len;
+    pthread_cond_broadcast(&state->cond);
+    pthread_mutex_unlock(&state->lock);
+}
+
+/* Pass on the buffered messages, optionally wait for them to be written */
+static void flush_fifo(struct fapolicyd_data* state, int wait)
+{
+    if (state->cur) {
+        queue_msg(state, state->cur);
+        state->cur = NULL;
+    }
+
+    if (wait && state->have_writer) {
+        pthread_mutex_lock(&state->lock);
+        while (state->head || state->busy)
+            pthread_cond_wait(&state->cond, &state->lock);
+        pthread_mutex_unlock(&state->lock);
+    }
+}
+
+/* Add a message line to the buffer */
+static void send_fifo(struct fapolicyd_data* state, const char * str)
+{
+    size_t len = strlen(str);
+
+    if (len > PIPE_BUF)
+        len = PIPE_BUF;
+
+    if (state->cur && state->cur->len + len > PIPE_BUF)
+        flush_fifo(state, 0);
+
+    if (state->cur == NULL) {
+        state->cur = xmalloc(sizeof(*state->cur));
+        state->cur->next = NULL;
+        state->cur->len = 0;
+    }
+
+    memcpy(state->cur->buf + state->cur->len, str, len);
+    state->cur->len += len;
+}
+
+static void start_writer(struct fapolicyd_data* state)
+{
+    if (pthread_create(&state->writer, NULL, writer_thread, state) == 0)
+        state->have_writer = 1;
+}
+
+static void stop_writer(struct fapolicyd_data* state)
+{
+    flush_fifo(state, 0);
+
+    if (state->have_writer) {
+        pthread_mutex_lock(&state->lock);
+        state->quit = 1;
+        pthread_cond_broadcast(&state->cond);
+        pthread_mutex_unlock(&state->lock);
+        pthread_join(state->writer, NULL);
+        state->have_writer = 0;
+        state->quit = 0;
+    }
+}
 
 static rpmRC fapolicyd_init(rpmPlugin plugin, rpmts ts)
 {
@@ -153,7 +295,8 @@ static rpmRC fapolicyd_init(rpmPlugin plugin, rpmts ts)
     if (!rstreq(rpmtsRootDir(ts), "/"))
         goto end;
 
-    (void) open_fifo(&fapolicyd_state);
+    if (open_fifo(&fapolicyd_state) == RPMRC_OK)
+        start_writer(&fapolicyd_state);
 
  end:
     return RPMRC_OK;
@@ -161,6 +304,7 @@ static rpmRC fapolicyd_init(rpmPlugin plugin, rpmts ts)
 
 static void fapolicyd_cleanup(rpmPlugin plugin)
 {
+    stop_writer(&fapolicyd_state);
     (void) close_fifo(&fapolicyd_state);
 }
 
@@ -172,9 +316,10 @@ static rpmRC fapolicyd_tsm_post(rpmPlugin plugin, rpmts ts, int res)
     /* we are ready */
     if (fapolicyd_state.fd > 0) {
         /* send a signal that transaction is over */
-        (void) try_to_write_to_fifo(&fapolicyd_state, "1\n");
+        send_fifo(&fapolicyd_state, "1\n");
         /* flush cache */
-        (void) try_to_write_to_fifo(&fapolicyd_state, "2\n");
+        send_fifo(&fapolicyd_state, "2\n");
+        flush_fifo(&fapolicyd_state, 1);
     }
 
  end:
@@ -188,8 +333,9 @@ static rpmRC fapolicyd_scriptlet_pre(rpmPlugin plugin, const char *s_name,
         goto end;
 
     if (fapolicyd_state.changed_files > 0) {
-        /* send signal to flush cache */
-        (void) try_to_write_to_fifo(&fapolicyd_state, "2\n");
+        /* send signal to flush cache, the daemon must have it all now */
+        send_fifo(&fapolicyd_state, "2\n");
+        flush_fifo(&fapolicyd_state, 1);
 
         /* optimize flushing */
         /* flush only when there was an actual change */
@@ -232,7 +378,7 @@ static rpmRC fapolicyd_fsm_file_prepare(rpmPlugin plugin, rpmfi fi,
     char * sha = rpmfiFDigestHex(fi, NULL);
 
     snprintf(buffer, 4096, "%s %lu %64s\n", dest, size, sha);
-    (void) try_to_write_to_fifo(&fapolicyd_state, buffer);
+    send_fifo(&fapolicyd_state, buffer);
 
     free(sha);
 
@@ -240,9 +386,19 @@ static rpmRC fapolicyd_fsm_file_prepare(rpmPlugin plugin, rpmfi fi,
     return RPMRC_OK;
 }
 
+static rpmRC fapolicyd_psm_post(rpmPlugin plugin, rpmte te, int res)
+{
+    /* hand the package's messages over to the writer */
+    if (fapolicyd_state.fd != -1)
+        flush_fifo(&fapolicyd_state, 0);
+
+    return RPMRC_OK;
+}
+
 struct rpmPluginHooks_s fapolicyd_hooks = {
     .init = fapolicyd_init,
     .cleanup = fapolicyd_cleanup,
+    .psm_post = fapolicyd_psm_post,
     .scriptlet_pre = fapolicyd_scriptlet_pre,
     .tsm_post = fapolicyd_tsm_post,
     .fsm_file_prepare = fapolicyd_fsm_file_prepare,
@@ -26,63 +26,35 @@
 
 #include "sign/rpmsignverity.h"
 
+#include "prepqueue.h"
+
 static int sign_config_files = 0;
+static prepqueue queue = NULL;
+
+struct verityjob_s {
+    int fd;
+    uint16_t algo;
+    size_t len;
+    char *path;
+    char *dest;
+    unsigned char signature[];
+};
 
 /*
- * This unconditionally tries to apply the fsverity signature to a file,
- * but fails gracefully if the file system doesn't support it or the
- * verity feature flag isn't enabled in the file system (ext4).
+ * Enable fsverity on the file.
+ * fsverity not supported by file system (ENOTTY) and fsverity not
+ * enabled on file system are expected and not considered
+ * errors. Every other non-zero error code will result in the
+ * installation failing.
  */
-static rpmRC fsverity_fsm_file_prepare(rpmPlugin plugin, rpmfi fi, int fd,
-				       const char *path, const char *dest,
-				       mode_t file_mode, rpmFsmOp op)
+static rpmRC fsverity_enable(int fd, const char *path, const char *dest,
+			     const unsigned char *signature, size_t len,
+			     uint16_t algo)
 {
     struct fsverity_enable_arg arg;
-    const unsigned char * signature = NULL;
-    size_t len;
-    uint16_t algo = 0;
-    int rc = RPMRC_OK;
-    rpmFileAction action = XFO_ACTION(op);
+    rpmRC rc = RPMRC_OK;
     char *buffer;
 
-    /* Ignore skipped files and unowned directories */
-    if (XFA_SKIPPING(action) || (op & FAF_UNOWNED)) {
-	rpmlog(RPMLOG_DEBUG, "fsverity skipping early: path %s dest %s\n",
-	       path, dest);
-	goto exit;
-    }
-
-    /*
-     * Do not install signatures for config files unless the
-     * user explicitly asks for it.
-     */
-    if (rpmfiFFlags(fi) & RPMFILE_CONFIG) {
-	if (!(rpmfiFMode(fi) & (S_IXUSR|S_IXGRP|S_IXOTH)) &&
-	    !sign_config_files) {
-	    rpmlog(RPMLOG_DEBUG, "fsverity skipping: path %s dest %s\n",
-		   path, dest);
-
-	    goto exit;
-	}
-    }
-
-    /*
-     * Right now fsverity doesn't deal with symlinks or directories, so do
-     * not try to install signatures for non regular files.
-     */
-    if (!S_ISREG(rpmfiFMode(fi))) {
-	rpmlog(RPMLOG_DEBUG, "fsverity skipping non regular: path %s dest %s\n",
-	       path, dest);
-	goto exit;
-    }
-
-    signature = rpmfiVSignature(fi, &len, &algo);
-    if (!signature || !len) {
-	rpmlog(RPMLOG_DEBUG, "fsverity no signature for: path %s dest %s\n",
-	       path, dest);
-	goto exit;
-    }
-
     memset(&arg, 0, sizeof(arg));
     arg.version = 1;
     if (algo)
@@ -97,13 +69,6 @@ static rpmRC fsverity_fsm_file_prepare(rpmPlugin plugin, rpmfi fi, int fd,
     rpmlog(RPMLOG_DEBUG, "applying signature: %s\n", buffer);
     free(buffer);
 
-    /*
-     * Enable fsverity on the file.
-     * fsverity not supported by file system (ENOTTY) and fsverity not
-     * enabled on file system are expected and not considered
-     * errors. Every other non-zero error code will result in the
-     * installation failing.
-     */
     if (ioctl(fd, FS_IOC_ENABLE_VERITY, &arg) != 0) {
 	switch(errno) {
 	case EBADMSG:
@@ -155,6 +120,100 @@ static rpmRC fsverity_fsm_file_prepare(rpmPlugin plugin, rpmfi fi, int fd,
 
     rpmlog(RPMLOG_DEBUG, "fsverity enabled signature for: path %s dest %s\n",
 	   path, dest);
+    return rc;
+}
+
+static rpmRC fsverity_job(void *arg)
+{
+    struct verityjob_s *job = arg;
+    rpmRC rc = fsverity_enable(job->fd, job->path, job->dest,
+			       job->signature, job->len, job->algo);
+    close(job->fd);
+    free(job->path);
+    free(job->dest);
+    return rc;
+}
+
+/* Hand the work over to the queue on a private descriptor if we can */
+static int fsverity_queue(int fd, const char *path, const char *dest,
+			  const unsigned char *signature, size_t len,
+			  uint16_t algo)
+{
+    struct verityjob_s *job;
+    int dfd;
+
+    if (queue == NULL || fd < 0)
+	return 0;
+    if ((dfd = fcntl(fd, F_DUPFD_CLOEXEC, 0)) < 0)
+	return 0;
+
+    job = xmalloc(sizeof(*job) + len);
+    job->fd = dfd;
+    job->algo = algo;
+    job->len = len;
+    job->path = xstrdup(path);
+    job->dest = xstrdup(dest);
+    memcpy(job->signature, signature, len);
+    prepqueueAdd(queue, fsverity_job, job);
+    return 1;
+}
+
+/*
+ * This unconditionally tries to apply the fsverity signature to a file,
+ * but fails gracefully if the file system doesn't support it or the
+ * verity feature flag isn't enabled in the file system (ext4).
+ */
+static rpmRC fsverity_fsm_file_prepare(rpmPlugin plugin, rpmfi fi, int fd,
+				       const char *path, const char *dest,
+				       mode_t file_mode, rpmFsmOp op)
+{
+    const unsigned char * signature = NULL;
+    size_t len;
+    uint16_t algo = 0;
+    int rc = RPMRC_OK;
+    rpmFileAction action = XFO_ACTION(op);
+
+    /* Ignore skipped files and unowned directories */
+    if (XFA_SKIPPING(action) || (op & FAF_UNOWNED)) {
+	rpmlog(RPMLOG_DEBUG, "fsverity skipping early: path %s dest %s\n",
+	       path, dest);
+	goto exit;
+    }
+
+    /*
+     * Do not install signatures for config files unless the
+     * user explicitly asks for it.
+     */
+    if (rpmfiFFlags(fi) & RPMFILE_CONFIG) {
+	if (!(rpmfiFMode(fi) & (S_IXUSR|S_IXGRP|S_IXOTH)) &&
+	    !sign_config_files) {
+	    rpmlog(RPMLOG_DEBUG, "fsverity skipping: path %s dest %s\n",
+		   path, dest);
+
+	    goto exit;
+	}
+    }
+
+    /*
+     * Right now fsverity doesn't deal with symlinks or directories, so do
+     * not try to install signatures for non regular files.
+     */
+    if (!S_ISREG(rpmfiFMode(fi))) {
+	rpmlog(RPMLOG_DEBUG, "fsverity skipping non regular: path %s dest %s\n",
+	       path, dest);
+	goto exit;
+    }
+
+    signature = rpmfiVSignature(fi, &len, &algo);
+    if (!signature || !len) {
+	rpmlog(RPMLOG_DEBUG, "fsverity no signature for: path %s dest %s\n",
+	       path, dest);
+	goto exit;
+    }
+
+    if (!fsverity_queue(fd, path, dest, signature, len, algo))
+	rc = fsverity_enable(fd, path, dest, signature, len, algo);
+
 exit:
     return rc;
 }
@@ -162,13 +221,35 @@ exit:
 static rpmRC fsverity_init(rpmPlugin plugin, rpmts ts)
 {
     sign_config_files = rpmExpandNumeric("%{?_fsverity_sign_config_files}");
+    queue = prepqueueNew("fsverity",
+			 rpmExpandNumeric("%{?_fsverity_threads}"));
 
     rpmlog(RPMLOG_DEBUG, "fsverity_init\n");
 
     return RPMRC_OK;
 }
 
+static void fsverity_cleanup(rpmPlugin plugin)
+{
+    queue = prepqueueFree(queue);
+}
+
+static rpmRC fsverity_fsm_file_prepare_wait(rpmPlugin plugin)
+{
+    return prepqueueWait(queue);
+}
+
+static rpmRC fsverity_psm_post(rpmPlugin plugin, rpmte te, int res)
+{
+    /* Normally waited for already, but not if the unpack bailed out */
+    prepqueueWait(queue);
+    return RPMRC_OK;
+}
+
 struct rpmPluginHooks_s fsverity_hooks = {
     .init = fsverity_init,
+    .cleanup = fsverity_cleanup,
+    .psm_post = fsverity_psm_post,
     .fsm_file_prepare = fsverity_fsm_file_prepare,
+    .fsm_file_prepare_wait = fsverity_fsm_file_prepare_wait,
 };
@@ -1,6 +1,7 @@
 #include "system.h"
 
 #include <errno.h>
+#include <fcntl.h>
 #include <sys/xattr.h>
 
 #include <rpm/rpmfi.h>
@@ -15,9 +16,19 @@
 #include "lib/rpmplugin.h"
 #include "lib/rpmte_internal.h"
 
+#include "prepqueue.h"
+
 #define XATTR_NAME_IMA "security.ima"
 
 static int write_signatures_on_config_files = 0;
+static prepqueue queue = NULL;
+
+struct imajob_s {
+	int fd;
+	size_t len;
+	char *path;
+	unsigned char fsig[];
+};
 
 /*
  * check_zero_hdr: Check the signature for a zero header
@@ -42,6 +53,60 @@ static int check_zero_hdr(const unsigned char *fsig, size_t siglen)
 	return (memcmp(fsig, &zero_hdr, sizeof(zero_hdr)) == 0);
 }
 
+static rpmRC ima_apply(int fd, const char *path,
+		       const unsigned char *fsig, size_t len)
+{
+	rpmRC rc = RPMRC_OK;
+	int xx;
+
+	if (fd >= 0)
+	    xx = fsetxattr(fd, XATTR_NAME_IMA, fsig, len, 0);
+	else
+	    xx = lsetxattr(path, XATTR_NAME_IMA, fsig, len, 0);
+	if (xx < 0) {
+	    int is_err = errno != EOPNOTSUPP;
+
+	    rpmlog(is_err?RPMLOG_ERR:RPMLOG_DEBUG,
+		    "ima: could not apply signature on '%s': %s\n",
+		    path, strerror(errno));
+	    if (is_err) {
+		rc = RPMRC_FAIL;
+	    }
+	}
+	return rc;
+}
+
+static rpmRC ima_job(void *arg)
+{
+	struct imajob_s *job = arg;
+	rpmRC rc = ima_apply(job->fd, job->path, job->fsig, job->len);
+
+	close(job->fd);
+	free(job->path);
+	return rc;
+}
+
+/* Hand the work over to the queue on a private descriptor if we can */
+static int ima_queue(int fd, const char *path,
+		     const unsigned char *fsig, size_t len)
+{
+	struct imajob_s *job;
+	int dfd;
+
+	if (queue == NULL || fd < 0)
+	    return 0;
+	if ((dfd = fcntl(fd, F_DUPFD_CLOEXEC, 0)) < 0)
+	    return 0;
+
+	job = xmalloc(sizeof(*job) + len);
+	job->fd = dfd;
+	job->len = len;
+	job->path = xstrdup(path);
+	memcpy(job->fsig, fsig, len);
+	prepqueueAdd(queue, ima_job, job);
+	return 1;
+}
+
 static rpmRC ima_fsm_file_prepare(rpmPlugin plugin, rpmfi fi, int fd,
                                   const char *path,
                                   const char *dest,
@@ -68,21 +133,8 @@ static rpmRC ima_fsm_file_prepare(rpmPlugin plugin, rpmfi fi, int fd,
 
 	fsig = rpmfiFSignature(fi, &len);
 	if (fsig && (check_zero_hdr(fsig, len) == 0)) {
-	    int xx;
-	    if (fd >= 0)
-		xx = fsetxattr(fd, XATTR_NAME_IMA, fsig, len, 0);
-	    else
-		xx = lsetxattr(path, XATTR_NAME_IMA, fsig, len, 0);
-	    if (xx < 0) {
-		int is_err = errno != EOPNOTSUPP;
-
-	        rpmlog(is_err?RPMLOG_ERR:RPMLOG_DEBUG,
-			"ima: could not apply signature on '%s': %s\n",
-			path, strerror(errno));
-		if (is_err) {
-		    rc = RPMRC_FAIL;
-		}
-	    }
+	    if (!ima_queue(fd, path, fsig, len))
+		rc = ima_apply(fd, path, fsig, len);
 	}
 
 exit:
@@ -93,11 +145,32 @@ static rpmRC ima_init(rpmPlugin plugin, rpmts ts)
 {
 	write_signatures_on_config_files =
 	    rpmExpandNumeric("%{?_ima_sign_config_files}");
+	queue = prepqueueNew("ima", rpmExpandNumeric("%{?_ima_threads}"));
+
+	return RPMRC_OK;
+}
 
+static void ima_cleanup(rpmPlugin plugin)
+{
+	queue = prepqueueFree(queue);
+}
+
+static rpmRC ima_fsm_file_prepare_wait(rpmPlugin plugin)
+{
+	return prepqueueWait(queue);
+}
+
+static rpmRC ima_psm_post(rpmPlugin plugin, rpmte te, int res)
+{
+	/* Normally waited for already, but not if the unpack bailed out */
+	prepqueueWait(queue);
 	return RPMRC_OK;
 }
 
 struct rpmPluginHooks_s ima_hooks = {
         .init = ima_init,
+	.cleanup = ima_cleanup,
+	.psm_post = ima_psm_post,
 	.fsm_file_prepare = ima_fsm_file_prepare,
+	.fsm_file_prepare_wait = ima_fsm_file_prepare_wait,
 };
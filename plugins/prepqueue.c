@@ -0,0 +1,138 @@
+#include "system.h"
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <rpm/rpmlog.h>
+
+#include "prepqueue.h"
+
+#include "debug.h"
+
+#define PREPQUEUE_DEPTH	4	/* queued jobs per thread */
+
+struct prepjob_s {
+    prepqueueFunc fn;
+    void *arg;
+};
+
+struct prepqueue_s {
+    pthread_mutex_t lock;
+    pthread_cond_t workcond;	/* work to do or quitting */
+    pthread_cond_t donecond;	/* a job finished */
+    pthread_t *threads;
+    int nthreads;
+    struct prepjob_s *jobs;
+    unsigned int size;
+    unsigned int head;		/* next job to run */
+    unsigned int tail;		/* next free slot */
+    unsigned int running;
+    int failed;
+    int quit;
+};
+
+static void *prepqueueThread(void *arg)
+{
+    prepqueue q = arg;
+
+    pthread_mutex_lock(&q->lock);
+    while (1) {
+	while (!q->quit && q->head == q->tail)
+	    pthread_cond_wait(&q->workcond, &q->lock);
+	if (q->head == q->tail)
+	    break;
+	struct prepjob_s job = q->jobs[q->head % q->size];
+	q->head++;
+	q->running++;
+	/* a slot got free */
+	pthread_cond_broadcast(&q->donecond);
+	pthread_mutex_unlock(&q->lock);
+
+	rpmRC rc = job.fn(job.arg);
+	free(job.arg);
+
+	pthread_mutex_lock(&q->lock);
+	if (rc == RPMRC_FAIL)
+	    q->failed = 1;
+	q->running--;
+	pthread_cond_broadcast(&q->donecond);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return NULL;
+}
+
+prepqueue prepqueueNew(const char *name, int nthreads)
+{
+    prepqueue q;
+
+    if (nthreads <= 0)
+	return NULL;
+
+    q = xcalloc(1, sizeof(*q));
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->workcond, NULL);
+    pthread_cond_init(&q->donecond, NULL);
+    q->size = nthreads * PREPQUEUE_DEPTH;
+    q->jobs = xcalloc(q->size, sizeof(*q->jobs));
+    q->threads = xcalloc(nthreads, sizeof(*q->threads));
+    for (int i = 0; i < nthreads; i++) {
+	if (pthread_create(&q->threads[i], NULL, prepqueueThread, q))
+	    break;
+	q->nthreads++;
+    }
+
+    if (q->nthreads == 0) {
+	rpmlog(RPMLOG_DEBUG, "%s: failed to start worker threads\n", name);
+	q = prepqueueFree(q);
+    }
+    return q;
+}
+
+void prepqueueAdd(prepqueue q, prepqueueFunc fn, void *arg)
+{
+    pthread_mutex_lock(&q->lock);
+    while (q->tail - q->head >= q->size)
+	pthread_cond_wait(&q->donecond, &q->lock);
+    q->jobs[q->tail % q->size].fn = fn;
+    q->jobs[q->tail % q->size].arg = arg;
+    q->tail++;
+    pthread_cond_signal(&q->workcond);
+    pthread_mutex_unlock(&q->lock);
+}
+
+rpmRC prepqueueWait(prepqueue q)
+{
+    rpmRC rc = RPMRC_OK;
+
+    if (q == NULL)
+	return rc;
+
+    pthread_mutex_lock(&q->lock);
+    while (q->head != q->tail || q->running)
+	pthread_cond_wait(&q->donecond, &q->lock);
+    if (q->failed)
+	rc = RPMRC_FAIL;
+    q->failed = 0;
+    pthread_mutex_unlock(&q->lock);
+
+    return rc;
+}
+
+prepqueue prepqueueFree(prepqueue q)
+{
+    if (q) {
+	pthread_mutex_lock(&q->lock);
+	q->quit = 1;
+	pthread_cond_broadcast(&q->workcond);
+	pthread_mutex_unlock(&q->lock);
+	for (int i = 0; i < q->nthreads; i++)
+	    pthread_join(q->threads[i], NULL);
+
+	pthread_cond_destroy(&q->donecond);
+	pthread_cond_destroy(&q->workcond);
+	pthread_mutex_destroy(&q->lock);
+	free(q->threads);
+	free(q->jobs);
+	free(q);
+    }
+    return NULL;
+}
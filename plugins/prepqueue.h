@@ -0,0 +1,36 @@
+#ifndef _PREPQUEUE_H
+#define _PREPQUEUE_H
+
+/*
+ * Bounded worker pool for plugins doing their fsm_file_prepare work
+ * asynchronously. The work is queued from the prepare hook and all of it
+ * is waited for in the fsm_file_prepare_wait hook, which is where any
+ * failures get reported, so a failure still fails the install of the
+ * package before any of its files are committed.
+ */
+
+#include <rpm/rpmtypes.h>
+#include <rpm/rpmutil.h>
+
+typedef struct prepqueue_s * prepqueue;
+
+/* Work function, arg is freed with free() once it returns */
+typedef rpmRC (*prepqueueFunc)(void *arg);
+
+/* Create a queue with nthreads workers, NULL if nthreads <= 0 or on error */
+RPM_GNUC_INTERNAL
+prepqueue prepqueueNew(const char *name, int nthreads);
+
+/* Queue work, blocking while the queue is full */
+RPM_GNUC_INTERNAL
+void prepqueueAdd(prepqueue q, prepqueueFunc fn, void *arg);
+
+/* Wait for all queued work, return RPMRC_FAIL if any of it failed */
+RPM_GNUC_INTERNAL
+rpmRC prepqueueWait(prepqueue q);
+
+/* Wait for all queued work and free the queue */
+RPM_GNUC_INTERNAL
+prepqueue prepqueueFree(prepqueue q);
+
+#endif /* _PREPQUEUE_H */
@@ -1,18 +1,89 @@
 #include "system.h"
 
+#include <ctype.h>
+#include <sys/stat.h>
 #include <selinux/selinux.h>
 #include <selinux/context.h>
 #include <selinux/label.h>
 #include <selinux/avc.h>
+#include <rpm/argv.h>
 #include <rpm/rpmstring.h>
 #include <rpm/rpmlog.h>
+#include <rpm/rpmmacro.h>
 #include <rpm/rpmts.h>
 #include "lib/rpmplugin.h"
 
 #include "debug.h"
 
+struct dirlabels_s;
+
+#undef HASHTYPE
+#undef HTKEYTYPE
+#undef HTDATATYPE
+#define HASHTYPE labelCache
+#define HTKEYTYPE const char *
+#define HTDATATYPE struct dirlabels_s *
+#include "lib/rpmhash.H"
+#include "lib/rpmhashoa.C"
+#undef HASHTYPE
+#undef HTKEYTYPE
+#undef HTDATATYPE
+
 static struct selabel_handle * sehandle = NULL;
 
+/*
+ * Label cache, enabled with %_selinux_label_cache. selabel lookups
+ * evaluate the file_contexts regexes on every call, but for most
+ * directories the spec guarantees that all entries of the same type get
+ * the same label. The specs are read in alongside the selabel handle
+ * and for each directory we work out from the literal prefixes of the
+ * regexes whether the label can depend on the file name at all, and if
+ * only for some literal names, which. Lookups in such directories are
+ * done once per file type and the result reused for the rest.
+ *
+ * Anything that can't be analyzed makes the directories it could cover
+ * uncacheable. The cache lives and dies with the selabel handle, so it
+ * gets flushed whenever the policy is reloaded and at the end of the
+ * transaction.
+ */
+enum speckind_e {
+    SPEC_EXACT,		/* stem only */
+    SPEC_SUBTREE_OPT,	/* stem(/.*)? */
+    SPEC_SUBTREE,	/* stem/.* */
+    SPEC_ALL,		/* stem.* */
+    SPEC_TAIL,		/* ends in a literal last path component */
+    SPEC_OTHER,		/* can depend on anything after the stem */
+    SPEC_ANY,		/* can match anything at all */
+};
+
+struct spec_s {
+    char *stem;		/* literal prefix of the regex */
+    size_t stemlen;
+    char *tail;		/* literal last component for SPEC_TAIL */
+    enum speckind_e kind;
+};
+
+#define MODECLASSES	16
+#define MODECLASS(m)	(((m) & S_IFMT) >> 12)
+
+struct dirlabels_s {
+    int uniform;
+    ARGV_t except;		/* names that may get a different label */
+    unsigned char state[MODECLASSES]; /* 0 unknown, 1 label, 2 no label */
+    char *con[MODECLASSES];
+};
+
+static struct labelcache_s {
+    struct spec_s *specs;
+    int nspecs;
+    ARGV_t subs;		/* local path substitutions, src dst pairs */
+    ARGV_t distsubs;		/* distribution path substitutions */
+    labelCache dirs;
+    unsigned int hits;
+    unsigned int lookups;
+    unsigned int uncached;
+} * labelcache = NULL;
+
 static inline rpmlogLvl loglvl(int iserror)
 {
     return iserror ? RPMLOG_ERR : RPMLOG_DEBUG;
@@ -47,8 +118,399 @@ static int logcb(int type, const char *fmt, ...)
     return 0;
 }
 
+static const char *specmeta = ".^$?*+|[](){}";
+
+/* Parse a literal character, return the char or -1 */
+static int specLiteral(const char **pp)
+{
+    const char *p = *pp;
+    int c;
+
+    if (*p == '\\' && p[1] && !isalnum((unsigned char)p[1])) {
+	c = p[1];
+	p += 2;
+    } else if (*p && *p != '\\' && strchr(specmeta, *p) == NULL) {
+	c = *p;
+	p++;
+    } else {
+	return -1;
+    }
+    /* A quantified char is not literal */
+    if (*p == '?' || *p == '*' || *p == '+' || *p == '{')
+	return -1;
+    *pp = p;
+    return c;
+}
+
+static int specHasAlternation(const char *re)
+{
+    int depth = 0;
+    for (const char *p = re; *p; p++) {
+	if (*p == '\\' && p[1]) {
+	    p++;
+	} else if (*p == '[') {
+	    /* skip the bracket expression, ] first is literal */
+	    p++;
+	    if (*p == '^')
+		p++;
+	    if (*p == ']')
+		p++;
+	    while (*p && *p != ']')
+		p++;
+	    if (*p == '\0')
+		return 1;
+	} else if (*p == '(') {
+	    depth++;
+	} else if (*p == ')') {
+	    depth--;
+	} else if (*p == '|' && depth <= 0) {
+	    return 1;
+	}
+    }
+    return 0;
+}
+
+/* Find a literal last path component at the end of the regex, if any */
+static char *specTail(const char *stem, const char *rest)
+{
+    static const char *anydirs = "(.*/)?";
+    static const char *subtree = "(/.*)?";
+    size_t restlen = strlen(rest);
+    size_t sublen = strlen(subtree);
+    const char *end = rest + restlen;
+    int slash = (*stem && stem[strlen(stem)-1] == '/');
+    char *tail = NULL;
+    size_t tlen = 0;
+
+    if (restlen >= sublen && rstreq(rest + restlen - sublen, subtree))
+	end -= sublen;
+
+    for (const char *p = rest; p < end; ) {
+	int c;
+	if ((size_t)(end - p) >= strlen(anydirs) &&
+		strncmp(p, anydirs, strlen(anydirs)) == 0) {
+	    /* ends in a slash if what came before it did */
+	    p += strlen(anydirs);
+	    tlen = 0;
+	    continue;
+	}
+	if ((c = specLiteral(&p)) >= 0) {
+	    if (c == '/') {
+		slash = 1;
+		tlen = 0;
+	    } else if (slash) {
+		tail = xrealloc(tail, tlen + 2);
+		tail[tlen++] = c;
+		tail[tlen] = '\0';
+	    }
+	} else {
+	    slash = 0;
+	    tlen = 0;
+	    p++;
+	}
+    }
+
+    if (!slash || tlen == 0)
+	tail = _free(tail);
+    return tail;
+}
+
+static void specAdd(struct labelcache_s *lc, const char *re)
+{
+    struct spec_s *spec;
+    const char *p = re;
+    char *stem = xmalloc(strlen(re) + 1);
+    size_t n = 0;
+    int c;
+
+    while ((c = specLiteral(&p)) >= 0)
+	stem[n++] = c;
+    stem[n] = '\0';
+
+    lc->specs = xrealloc(lc->specs, (lc->nspecs + 1) * sizeof(*lc->specs));
+    spec = &lc->specs[lc->nspecs++];
+    spec->stem = stem;
+    spec->stemlen = n;
+    spec->tail = NULL;
+
+    if (specHasAlternation(re)) {
+	spec->kind = SPEC_ANY;
+    } else if (*p == '\0') {
+	spec->kind = SPEC_EXACT;
+    } else if (rstreq(p, "(/.*)?")) {
+	spec->kind = SPEC_SUBTREE_OPT;
+    } else if (rstreq(p, "/.*")) {
+	spec->kind = SPEC_SUBTREE;
+    } else if (rstreq(p, ".*")) {
+	spec->kind = SPEC_ALL;
+    } else if ((spec->tail = specTail(stem, p)) != NULL) {
+	spec->kind = SPEC_TAIL;
+    } else {
+	spec->kind = SPEC_OTHER;
+    }
+}
+
+static int specRead(struct labelcache_s *lc, const char *path, ARGV_t *subs)
+{
+    FILE *f = fopen(path, "r");
+    char *line = NULL;
+    size_t size = 0;
+
+    if (f == NULL)
+	return (errno == ENOENT) ? 0 : -1;
+
+    while (getline(&line, &size, f) >= 0) {
+	char *re = line;
+	while (isspace((unsigned char)*re))
+	    re++;
+	if (*re == '#' || *re == '\0')
+	    continue;
+	char *e = re;
+	while (*e && !isspace((unsigned char)*e))
+	    e++;
+	if (subs) {
+	    char *dst = e;
+	    while (isspace((unsigned char)*dst))
+		dst++;
+	    char *de = dst;
+	    while (*de && !isspace((unsigned char)*de))
+		de++;
+	    *e = *de = '\0';
+	    if (*dst) {
+		argvAdd(subs, re);
+		argvAdd(subs, dst);
+	    }
+	} else {
+	    *e = '\0';
+	    specAdd(lc, re);
+	}
+    }
+    free(line);
+    fclose(f);
+    return 0;
+}
+
+static struct dirlabels_s *dirlabelsFree(struct dirlabels_s *dl)
+{
+    if (dl) {
+	for (int i = 0; i < MODECLASSES; i++)
+	    free(dl->con[i]);
+	argvFree(dl->except);
+	free(dl);
+    }
+    return NULL;
+}
+
+static void labelcache_fini(void)
+{
+    struct labelcache_s *lc = labelcache;
+
+    if (lc == NULL)
+	return;
+
+    rpmlog(RPMLOG_DEBUG, "selinux label cache: %u hits, %u lookups, "
+	   "%u uncacheable\n", lc->hits, lc->lookups, lc->uncached);
+    for (int i = 0; i < lc->nspecs; i++) {
+	free(lc->specs[i].stem);
+	free(lc->specs[i].tail);
+    }
+    free(lc->specs);
+    argvFree(lc->subs);
+    argvFree(lc->distsubs);
+    labelCacheFree(lc->dirs);
+    labelcache = _free(labelcache);
+}
+
+static void labelcache_init(const char *path)
+{
+    struct labelcache_s *lc;
+    const char *sfx[] = { "", ".homedirs", ".local" };
+    const char *subspath = selinux_file_context_subs_path();
+    const char *distsubspath = selinux_file_context_subs_dist_path();
+    int rc = 0;
+
+    if (!rpmExpandNumeric("%{?_selinux_label_cache}"))
+	return;
+
+    lc = xcalloc(1, sizeof(*lc));
+    for (int i = 0; rc == 0 && i < sizeof(sfx) / sizeof(sfx[0]); i++) {
+	char *fn = rstrscat(NULL, path, sfx[i], NULL);
+	/* the main spec file must be there */
+	if (*sfx[i] == '\0' && access(fn, R_OK))
+	    rc = -1;
+	else
+	    rc = specRead(lc, fn, NULL);
+	free(fn);
+    }
+    if (rc == 0 && subspath)
+	rc = specRead(lc, subspath, &lc->subs);
+    if (rc == 0 && distsubspath)
+	rc = specRead(lc, distsubspath, &lc->distsubs);
+    lc->dirs = labelCacheCreate(1024, rstrhash, strcmp,
+				(labelCacheFreeKey)rfree, dirlabelsFree);
+    labelcache = lc;
+
+    if (rc) {
+	rpmlog(RPMLOG_DEBUG, "selinux label cache disabled: "
+	       "failed to read specs from %s\n", path);
+	labelcache_fini();
+    }
+}
+
+/*
+ * Apply the first matching path substitution to dir, as libselinux does
+ * to the looked up paths. An entry of dir that is itself substituted
+ * is another special case.
+ */
+static char *labelcache_subst(ARGV_const_t subs, char *dir, ARGV_t *except)
+{
+    size_t m = strlen(dir);
+
+    for (int i = 0; subs && subs[i] && subs[i+1]; i += 2) {
+	const char *src = subs[i];
+	size_t slen = strlen(src);
+	if (slen < m && strncmp(dir, src, slen) == 0 && dir[slen] == '/') {
+	    char *sdir = rstrscat(NULL, subs[i+1], dir + slen, NULL);
+	    free(dir);
+	    return sdir;
+	}
+	if (slen > m && strncmp(src, dir, m) == 0 && !strchr(src + m, '/'))
+	    argvAdd(except, src + m);
+    }
+    return dir;
+}
+
+/* Check the regexes against dir, as for labelcache_analyze() */
+static int labelcache_specs(struct labelcache_s *lc, const char *dir,
+			    ARGV_t *except)
+{
+    size_t m = strlen(dir);
+
+    for (int i = 0; i < lc->nspecs; i++) {
+	struct spec_s *spec = &lc->specs[i];
+	size_t n = spec->stemlen;
+
+	if (spec->kind == SPEC_ANY)
+	    return -1;
+
+	if (n <= m) {
+	    if (strncmp(dir, spec->stem, n))
+		continue;
+	    switch (spec->kind) {
+	    case SPEC_OTHER:
+		return -1;
+	    case SPEC_TAIL:
+		argvAdd(except, spec->tail);
+		break;
+	    default:
+		/* matches all or none of the entries */
+		break;
+	    }
+	} else {
+	    const char *rem = spec->stem + m;
+	    /* entry names of dir can't contain the slash */
+	    if (strncmp(spec->stem, dir, m) || strchr(rem, '/'))
+		continue;
+	    switch (spec->kind) {
+	    case SPEC_EXACT:
+	    case SPEC_SUBTREE_OPT:
+		argvAdd(except, rem);
+		break;
+	    case SPEC_SUBTREE:
+		break;
+	    default:
+		return -1;
+	    }
+	}
+    }
+    return 0;
+}
+
+/*
+ * Work out whether the labels of the entries in directory dir (with the
+ * trailing slash) can depend on their names. Returns 0 if not, with the
+ * names that are special cased by some regex in except, -1 if they can.
+ */
+static int labelcache_analyze(struct labelcache_s *lc, const char *odir,
+			      ARGV_t *except)
+{
+    char *dir = xstrdup(odir);
+    int rc;
+
+    dir = labelcache_subst(lc->subs, dir, except);
+    dir = labelcache_subst(lc->distsubs, dir, except);
+    rc = labelcache_specs(lc, dir, except);
+    free(dir);
+
+    return rc;
+}
+
+static struct dirlabels_s *labelcache_dir(struct labelcache_s *lc,
+					  const char *dir)
+{
+    struct dirlabels_s **data = NULL;
+    struct dirlabels_s *dl;
+
+    if (labelCacheGetEntry(lc->dirs, dir, &data, NULL, NULL))
+	return data[0];
+
+    dl = xcalloc(1, sizeof(*dl));
+    dl->uniform = (labelcache_analyze(lc, dir, &dl->except) == 0);
+    if (!dl->uniform)
+	dl->except = argvFree(dl->except);
+    else if (dl->except)
+	argvSort(dl->except, NULL);
+    labelCacheAddEntry(lc->dirs, xstrdup(dir), dl);
+    return dl;
+}
+
+/* selabel_lookup_raw() through the label cache */
+static int label_lookup(const char *dest, mode_t mode, char **scon)
+{
+    struct labelcache_s *lc = labelcache;
+    struct dirlabels_s *dl = NULL;
+    const char *bn = strrchr(dest, '/');
+    int mc = MODECLASS(mode);
+    int rc;
+
+    if (lc && bn) {
+	char *dir = rstrndup(dest, bn - dest + 1);
+	dl = labelcache_dir(lc, dir);
+	free(dir);
+	bn++;
+	if (!dl->uniform || (dl->except && argvSearch(dl->except, bn, NULL)))
+	    dl = NULL;
+	if (dl == NULL)
+	    lc->uncached++;
+    }
+
+    if (dl && dl->state[mc]) {
+	lc->hits++;
+	if (dl->state[mc] == 2) {
+	    errno = ENOENT;
+	    return -1;
+	}
+	*scon = xstrdup(dl->con[mc]);
+	return 0;
+    }
+
+    if (lc)
+	lc->lookups++;
+    rc = selabel_lookup_raw(sehandle, scon, dest, mode);
+    if (dl) {
+	if (rc == 0) {
+	    dl->con[mc] = xstrdup(*scon);
+	    dl->state[mc] = 1;
+	} else if (errno == ENOENT) {
+	    dl->state[mc] = 2;
+	}
+    }
+    return rc;
+}
+
 static void sehandle_fini(int close_status)
 {
+    labelcache_fini();
     if (sehandle) {
 	selabel_close(sehandle);
 	sehandle = NULL;
@@ -86,6 +548,9 @@ static rpmRC sehandle_init(int open_status)
     rpmlog(loglvl(sehandle == NULL), "selabel_open: (%s) %s\n",
 	   path, (sehandle == NULL ? strerror(errno) : ""));
 
+    if (sehandle)
+	labelcache_init(path);
+
     return (sehandle != NULL) ? RPMRC_OK : RPMRC_FAIL;
 }
 
@@ -157,7 +622,7 @@ static rpmRC selinux_fsm_file_prepare(rpmPlugin plugin, rpmfi fi, int fd,
 
     if (sehandle && !XFA_SKIPPING(action)) {
 	char *scon = NULL;
-	if (selabel_lookup_raw(sehandle, &scon, dest, file_mode) == 0) {
+	if (label_lookup(dest, file_mode, &scon) == 0) {
 	    int conrc;
 	    if (fd >= 0)
 		conrc = fsetfilecon(fd, scon);
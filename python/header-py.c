@@ -1,4 +1,5 @@
 #include "rpmsystem-py.h"
+#include <sys/uio.h>
 
 #include <rpm/rpmlib.h>		/* rpmvercmp */
 #include <rpm/rpmtag.h>
@@ -158,18 +159,24 @@ static PyObject * hdrKeyList(hdrObject * s)
     return keys;
 }
 
+/* Gather the segments straight into the bytes object, saves a copy */
 static PyObject * hdrAsBytes(hdrObject * s)
 {
     PyObject *res = NULL;
     unsigned int len = 0;
-    char *buf = headerExport(s->h, &len);
+    int niov = 0;
+    struct iovec *iov = headerExportIov(s->h, &niov, &len);
 
-    if (buf == NULL || len == 0) {
+    if (iov == NULL || len == 0) {
 	PyErr_SetString(pyrpmError, "can't unload bad header\n");
-    } else {
-	res = PyBytes_FromStringAndSize(buf, len);
+    } else if ((res = PyBytes_FromStringAndSize(NULL, len)) != NULL) {
+	char *p = PyBytes_AS_STRING(res);
+	for (int i = 0; i < niov; i++) {
+	    memcpy(p, iov[i].iov_base, iov[i].iov_len);
+	    p += iov[i].iov_len;
+	}
     }
-    free(buf);
+    free(iov);
     return res;
 }
 
@@ -178,8 +185,44 @@ static PyObject * hdrUnload(hdrObject * s)
     return hdrAsBytes(s);
 }
 
+/*
+ * Buffer protocol access to the exported header blob, saves the copy
+ * into a bytes object. The blob lives until the buffer is released.
+ */
+static int hdr_getbuffer(hdrObject * s, Py_buffer *view, int flags)
+{
+    unsigned int len = 0;
+    char *buf = headerExport(s->h, &len);
+
+    if (buf == NULL || len == 0) {
+	free(buf);
+	PyErr_SetString(PyExc_BufferError, "can't unload bad header");
+	view->obj = NULL;
+	return -1;
+    }
+    if (PyBuffer_FillInfo(view, (PyObject *) s, buf, len, 1, flags)) {
+	free(buf);
+	return -1;
+    }
+    view->internal = buf;
+    return 0;
+}
+
+static void hdr_releasebuffer(hdrObject * s, Py_buffer *view)
+{
+    free(view->internal);
+}
+
+static PyBufferProcs hdr_as_buffer = {
+    (getbufferproc) hdr_getbuffer,		/* bf_getbuffer */
+    (releasebufferproc) hdr_releasebuffer,	/* bf_releasebuffer */
+};
+
 static PyObject * hdrFormat(hdrObject * s, PyObject * args, PyObject * kwds)
 {
+    /* Loops commonly format every header the same way, protected by GIL */
+    static char * cachedfmt = NULL;
+    static headerCompiledFormat cached = NULL;
     const char * fmt;
     char * r;
     errmsg_t err;
@@ -189,7 +232,15 @@ static PyObject * hdrFormat(hdrObject * s, PyObject * args, PyObject * kwds)
     if (!PyArg_ParseTupleAndKeywords(args, kwds, "s", kwlist, &fmt))
 	return NULL;
 
-    r = headerFormat(s->h, fmt, &err);
+    if (cached == NULL || !rstreq(cachedfmt, fmt)) {
+	cached = headerFormatFree(cached);
+	free(cachedfmt);
+	cachedfmt = NULL;
+	if ((cached = headerFormatCompile(fmt, &err)) != NULL)
+	    cachedfmt = rstrdup(fmt);
+    }
+
+    r = headerFormatApply(cached, s->h, &err);
     if (!r) {
 	PyErr_SetString(pyrpmError, err);
 	return NULL;
@@ -268,7 +319,7 @@ static struct PyMethodDef hdr_methods[] = {
     {"keys",		(PyCFunction) hdrKeyList,	METH_NOARGS,
      "hdr.keys() -- Return a list of the header's rpm tags (int RPMTAG_*)." },
     {"unload",		(PyCFunction) hdrUnload,	METH_NOARGS,
-     "hdr.unload() -- Return binary representation\nof the header." },
+     "hdr.unload() -- Return binary representation\nof the header.\n\nmemoryview(hdr) gives the same without copying it into bytes." },
     {"convert",		(PyCFunction) hdrConvert,	METH_VARARGS|METH_KEYWORDS,
      "hdr.convert(op=-1) -- Convert header - See HEADERCONV_*\nfor possible values of op."},
     {"format",		(PyCFunction) hdrFormat,	METH_VARARGS|METH_KEYWORDS,
@@ -304,8 +355,12 @@ static PyObject *hdr_new(PyTypeObject *subtype, PyObject *args, PyObject *kwds)
     } else if (PyBytes_Check(obj)) {
 	Py_ssize_t len = 0;
 	char *blob = NULL;
-	if (PyBytes_AsStringAndSize(obj, &blob, &len) == 0)
+	if (PyBytes_AsStringAndSize(obj, &blob, &len) == 0) {
+	    /* obj keeps the (immutable) blob alive meanwhile */
+	    Py_BEGIN_ALLOW_THREADS;
 	    h = headerImport(blob, len, HEADERIMPORT_COPY);
+	    Py_END_ALLOW_THREADS;
+	}
     } else if (rpmfdFromPyObject(obj, &fdo)) {
 	Py_BEGIN_ALLOW_THREADS;
 	h = headerRead(rpmfdGetFd(fdo), HEADER_MAGIC_YES);
@@ -666,7 +721,7 @@ PyTypeObject hdr_Type = {
 	0,				/* tp_str */
 	(getattrofunc) hdr_getattro,	/* tp_getattro */
 	(setattrofunc) hdr_setattro,	/* tp_setattro */
-	0,				/* tp_as_buffer */
+	&hdr_as_buffer,			/* tp_as_buffer */
 	Py_TPFLAGS_DEFAULT|Py_TPFLAGS_BASETYPE,	/* tp_flags */
 	hdr_doc,			/* tp_doc */
 	0,				/* tp_traverse */
@@ -225,13 +225,30 @@ static PyObject *rpmfd_tell(rpmfdObject *s)
     
 }
 
+/* Read until buf is full or EOF, returns bytes read or -1 on error */
+static ssize_t fdReadFull(FD_t fd, char *buf, size_t size)
+{
+    size_t total = 0;
+    ssize_t nb = 0;
+
+    Py_BEGIN_ALLOW_THREADS 
+    while (total < size) {
+	nb = Fread(buf + total, 1, size - total, fd);
+	if (nb <= 0)
+	    break;
+	total += nb;
+    }
+    Py_END_ALLOW_THREADS 
+
+    return Ferror(fd) ? -1 : total;
+}
+
 static PyObject *rpmfd_read(rpmfdObject *s, PyObject *args, PyObject *kwds)
 {
     char *kwlist[] = { "size", NULL };
-    char buf[BUFSIZ];
-    ssize_t chunksize = sizeof(buf);
     ssize_t left = -1;
     ssize_t nb = 0;
+    ssize_t alloced, used = 0;
     PyObject *res = NULL;
     
     if (!PyArg_ParseTupleAndKeywords(args, kwds, "|l", kwlist, &left))
@@ -239,30 +256,55 @@ static PyObject *rpmfd_read(rpmfdObject *s, PyObject *args, PyObject *kwds)
 
     if (s->fd == NULL) return err_closed();
 
-    /* ConcatAndDel() doesn't work on NULL string, meh */
-    res = PyBytes_FromStringAndSize(NULL, 0);
+    /* Read straight into the result, growing it as needed */
+    alloced = (left >= 0) ? left : BUFSIZ;
+    if ((res = PyBytes_FromStringAndSize(NULL, alloced)) == NULL)
+	return NULL;
     do {
-	if (left >= 0 && left < chunksize)
-	    chunksize = left;
-
-	Py_BEGIN_ALLOW_THREADS 
-	nb = Fread(buf, 1, chunksize, s->fd);
-	Py_END_ALLOW_THREADS 
-
-	if (nb > 0) {
-	    PyObject *tmp = PyBytes_FromStringAndSize(buf, nb);
-	    PyBytes_ConcatAndDel(&res, tmp);
-	    left -= nb;
+	if (used == alloced) {
+	    if (left >= 0)
+		break;
+	    alloced *= 2;
+	    if (_PyBytes_Resize(&res, alloced))
+		return NULL;
 	}
+	nb = fdReadFull(s->fd, PyBytes_AS_STRING(res) + used, alloced - used);
+	if (nb > 0)
+	    used += nb;
     } while (nb > 0);
 
-    if (Ferror(s->fd)) {
+    if (nb < 0) {
 	PyErr_SetString(PyExc_IOError, Fstrerror(s->fd));
 	Py_XDECREF(res);
 	return NULL;
-    } else {
-	return res;
     }
+    if (used != alloced)
+	_PyBytes_Resize(&res, used);
+    return res;
+}
+
+static PyObject *rpmfd_readinto(rpmfdObject *s, PyObject *args, PyObject *kwds)
+{
+    char *kwlist[] = { "buffer", NULL };
+    Py_buffer view;
+    ssize_t nb;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "w*", kwlist, &view))
+	return NULL;
+
+    if (s->fd == NULL) {
+	PyBuffer_Release(&view);
+	return err_closed();
+    }
+
+    nb = fdReadFull(s->fd, view.buf, view.len);
+    PyBuffer_Release(&view);
+
+    if (nb < 0) {
+	PyErr_SetString(PyExc_IOError, Fstrerror(s->fd));
+	return NULL;
+    }
+    return PyLong_FromSsize_t(nb);
 }
 
 static PyObject *rpmfd_write(rpmfdObject *s, PyObject *args, PyObject *kwds)
@@ -305,6 +347,8 @@ static struct PyMethodDef rpmfd_methods[] = {
 	NULL },
     { "read",	(PyCFunction) rpmfd_read,	METH_VARARGS|METH_KEYWORDS,
 	NULL },
+    { "readinto",	(PyCFunction) rpmfd_readinto,	METH_VARARGS|METH_KEYWORDS,
+	NULL },
     { "seek",	(PyCFunction) rpmfd_seek,	METH_VARARGS|METH_KEYWORDS,
 	NULL },
     { "tell",	(PyCFunction) rpmfd_tell,	METH_NOARGS,
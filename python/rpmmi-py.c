@@ -19,8 +19,15 @@
  * The rpm.mi class conains the following methods:
  * - next() -> hdr		Return the next header that matches.
  *
+ * - fetch(n) -> [hdr, ...]	Return up to n next headers that match.
+ *
+ * - columns(taglist) -> [col, ...]	Return values of the remaining headers
+ *				column by column.
+ *
  * - pattern(tag,mire,pattern) 	Specify secondary match criteria.
  *
+ * - tags(taglist)		Only retrieve the listed tags from headers.
+ *
  * To obtain a rpm.mi object to query the database used by a transaction,
  * the ts.match(tag,key,len) method is used.
  *
@@ -66,19 +73,81 @@ struct rpmmiObject_s {
     rpmdbMatchIterator mi;
 } ;
 
+/*
+ * Fetching and importing headers doesn't touch python objects, let other
+ * threads run meanwhile. As elsewhere, the transaction set and its
+ * iterators must not be used from several threads at once.
+ */
+static Header rpmmi_next(rpmmiObject * s)
+{
+    Header h;
+
+    Py_BEGIN_ALLOW_THREADS
+    h = rpmdbNextIterator(s->mi);
+    Py_END_ALLOW_THREADS
+
+    return (h != NULL) ? headerLink(h) : NULL;
+}
+
 static PyObject *
 rpmmi_iternext(rpmmiObject * s)
 {
     Header h;
 
-    if (s->mi == NULL || (h = rpmdbNextIterator(s->mi)) == NULL) {
+    if (s->mi == NULL || (h = rpmmi_next(s)) == NULL) {
 	s->mi = rpmdbFreeIterator(s->mi);
 	return NULL;
     }
-    headerLink(h);
     return hdr_Wrap(&hdr_Type, h);
 }
 
+static PyObject *
+rpmmi_Fetch(rpmmiObject * s, PyObject * args, PyObject * kwds)
+{
+    Py_ssize_t n, i, nh = 0;
+    Header *hdrs;
+    PyObject *list;
+    char * kwlist[] = {"n", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "n:Fetch", kwlist, &n))
+	return NULL;
+    if (n < 0) {
+	PyErr_SetString(PyExc_ValueError, "count must not be negative");
+	return NULL;
+    }
+    if (s->mi == NULL || n == 0)
+	return PyList_New(0);
+
+    /* Grab all of them in one go without the GIL, wrap afterwards */
+    hdrs = rmalloc(n * sizeof(*hdrs));
+    Py_BEGIN_ALLOW_THREADS
+    for (nh = 0; nh < n; nh++) {
+	Header h = rpmdbNextIterator(s->mi);
+	if (h == NULL)
+	    break;
+	hdrs[nh] = headerLink(h);
+    }
+    Py_END_ALLOW_THREADS
+
+    if (nh < n)
+	s->mi = rpmdbFreeIterator(s->mi);
+
+    list = PyList_New(nh);
+    for (i = 0; i < nh; i++) {
+	if (list) {
+	    PyObject *ho = hdr_Wrap(&hdr_Type, hdrs[i]);
+	    if (ho) {
+		PyList_SET_ITEM(list, i, ho);
+		continue;
+	    }
+	    Py_CLEAR(list);
+	}
+	headerFree(hdrs[i]);
+    }
+    free(hdrs);
+    return list;
+}
+
 static PyObject *
 rpmmi_Instance(rpmmiObject * s, PyObject * unused)
 {
@@ -114,6 +183,192 @@ rpmmi_Pattern(rpmmiObject * s, PyObject * args, PyObject * kwds)
     Py_RETURN_NONE;
 }
 
+static PyObject *
+rpmmi_Tags(rpmmiObject * s, PyObject * args, PyObject * kwds)
+{
+    PyObject *seq, *fast;
+    rpmTagVal *tags;
+    Py_ssize_t i, n;
+    int rc;
+    char * kwlist[] = {"tags", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O:Tags", kwlist, &seq))
+	return NULL;
+
+    if ((fast = PySequence_Fast(seq, "tags must be a sequence")) == NULL)
+	return NULL;
+
+    n = PySequence_Fast_GET_SIZE(fast);
+    tags = rcalloc(n + 1, sizeof(*tags));
+    for (i = 0; i < n; i++) {
+	PyObject *item = PySequence_Fast_GET_ITEM(fast, i);
+	if (!tagNumFromPyObject(item, &tags[i])) {
+	    free(tags);
+	    Py_DECREF(fast);
+	    return NULL;
+	}
+    }
+    Py_DECREF(fast);
+
+    rc = rpmdbSetIteratorTags(s->mi, tags);
+    free(tags);
+    if (rc) {
+	PyErr_SetString(PyExc_ValueError, "cannot restrict tags of iterator");
+	return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+/* One column of values for mi.columns() */
+struct column_s {
+    rpmTagVal tag;
+    int width;		/* bytes per numeric value, 0 for strings */
+    char *data;		/* values or concatenated strings */
+    size_t used;
+    size_t alloced;
+    uint32_t *offs;	/* string start offsets, n+1 entries */
+};
+
+static void columnAppend(struct column_s *col, const void *p, size_t len)
+{
+    if (col->used + len > col->alloced) {
+	col->alloced = (col->used + len) * 2 + 256;
+	col->data = rrealloc(col->data, col->alloced);
+    }
+    memcpy(col->data + col->used, p, len);
+    col->used += len;
+}
+
+static void columnAdd(struct column_s *col, Header h, size_t row)
+{
+    struct rpmtd_s td;
+    int found = headerGet(h, col->tag, &td, HEADERGET_MINMEM|HEADERGET_EXT);
+
+    if (col->width) {
+	uint64_t num = found ? rpmtdGetNumber(&td) : 0;
+	uint8_t u8 = num;
+	uint16_t u16 = num;
+	uint32_t u32 = num;
+	switch (col->width) {
+	case 1:	columnAppend(col, &u8, 1); break;
+	case 2:	columnAppend(col, &u16, 2); break;
+	case 4:	columnAppend(col, &u32, 4); break;
+	default: columnAppend(col, &num, 8); break;
+	}
+    } else {
+	const char *str = found ? rpmtdGetString(&td) : NULL;
+	col->offs = rrealloc(col->offs, (row + 2) * sizeof(*col->offs));
+	col->offs[row] = col->used;
+	if (str)
+	    columnAppend(col, str, strlen(str));
+	col->offs[row + 1] = col->used;
+    }
+    rpmtdFreeData(&td);
+}
+
+static PyObject *columnView(const void *data, size_t len, const char *fmt)
+{
+    PyObject *b = PyBytes_FromStringAndSize(data, len);
+    PyObject *mv = b ? PyMemoryView_FromObject(b) : NULL;
+    PyObject *res = mv ? PyObject_CallMethod(mv, "cast", "s", fmt) : NULL;
+    Py_XDECREF(mv);
+    Py_XDECREF(b);
+    return res;
+}
+
+static PyObject *
+rpmmi_Columns(rpmmiObject * s, PyObject * args, PyObject * kwds)
+{
+    PyObject *seq, *fast, *list = NULL;
+    struct column_s *cols;
+    Py_ssize_t i, ncols;
+    size_t nrows = 0;
+    char * kwlist[] = {"tags", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O:Columns", kwlist, &seq))
+	return NULL;
+
+    if ((fast = PySequence_Fast(seq, "tags must be a sequence")) == NULL)
+	return NULL;
+
+    ncols = PySequence_Fast_GET_SIZE(fast);
+    cols = rcalloc(ncols + 1, sizeof(*cols));
+    for (i = 0; i < ncols; i++) {
+	PyObject *item = PySequence_Fast_GET_ITEM(fast, i);
+	struct column_s *col = &cols[i];
+
+	if (!tagNumFromPyObject(item, &col->tag))
+	    goto exit;
+	if (rpmTagGetReturnType(col->tag) != RPM_SCALAR_RETURN_TYPE) {
+	    PyErr_Format(PyExc_ValueError, "not a scalar tag: %s",
+			 rpmTagGetName(col->tag));
+	    goto exit;
+	}
+	switch (rpmTagGetTagType(col->tag)) {
+	case RPM_CHAR_TYPE:
+	case RPM_INT8_TYPE:	col->width = 1; break;
+	case RPM_INT16_TYPE:	col->width = 2; break;
+	case RPM_INT32_TYPE:	col->width = 4; break;
+	case RPM_INT64_TYPE:	col->width = 8; break;
+	case RPM_STRING_TYPE:
+	case RPM_I18NSTRING_TYPE:
+	    col->width = 0;
+	    col->offs = rcalloc(1, sizeof(*col->offs));
+	    break;
+	default:
+	    PyErr_Format(PyExc_ValueError, "unsupported tag type: %s",
+			 rpmTagGetName(col->tag));
+	    goto exit;
+	}
+    }
+
+    /* The whole pass only deals with C data */
+    if (s->mi) {
+	Py_BEGIN_ALLOW_THREADS
+	Header h;
+	while ((h = rpmdbNextIterator(s->mi)) != NULL) {
+	    for (i = 0; i < ncols; i++)
+		columnAdd(&cols[i], h, nrows);
+	    nrows++;
+	}
+	Py_END_ALLOW_THREADS
+	s->mi = rpmdbFreeIterator(s->mi);
+    }
+
+    list = PyList_New(ncols);
+    for (i = 0; list && i < ncols; i++) {
+	struct column_s *col = &cols[i];
+	PyObject *o = NULL;
+	if (col->width) {
+	    static const char *fmts[] = { NULL, "B", "H", NULL, "I",
+					  NULL, NULL, NULL, "Q" };
+	    o = columnView(col->data, col->used, fmts[col->width]);
+	} else {
+	    PyObject *offs = columnView(col->offs,
+				(nrows + 1) * sizeof(*col->offs), "I");
+	    if (offs) {
+		o = Py_BuildValue("(y#N)", col->data ? col->data : "",
+				  (Py_ssize_t) col->used, offs);
+	    }
+	}
+	if (o == NULL) {
+	    Py_CLEAR(list);
+	    break;
+	}
+	PyList_SET_ITEM(list, i, o);
+    }
+
+exit:
+    for (i = 0; i < ncols; i++) {
+	free(cols[i].data);
+	free(cols[i].offs);
+    }
+    free(cols);
+    Py_DECREF(fast);
+    return list;
+}
+
 static struct PyMethodDef rpmmi_methods[] = {
     {"instance",    (PyCFunction) rpmmi_Instance,	METH_NOARGS,
      "mi.instance() -- Return the number (db key) of the current header."},
@@ -122,6 +377,18 @@ static struct PyMethodDef rpmmi_methods[] = {
     {"pattern",	    (PyCFunction) rpmmi_Pattern,	METH_VARARGS|METH_KEYWORDS,
 "mi.pattern(TagN, mire_type, pattern)\n\
 - Set a secondary match pattern on tags from retrieved header.\n" },
+    {"tags",	    (PyCFunction) rpmmi_Tags,		METH_VARARGS|METH_KEYWORDS,
+"mi.tags(taglist)\n\
+- Only retrieve the given tags (and those used in patterns) from headers.\n" },
+    {"fetch",	    (PyCFunction) rpmmi_Fetch,		METH_VARARGS|METH_KEYWORDS,
+"mi.fetch(n) -> [hdr, ...]\n\
+- Return a list of up to n next matching headers, empty when exhausted.\n" },
+    {"columns",	    (PyCFunction) rpmmi_Columns,	METH_VARARGS|METH_KEYWORDS,
+"mi.columns(taglist) -> [col, ...]\n\
+- Consume the iterator and return one column per (scalar) tag, in\n\
+  order. Numeric columns are memoryviews of native integers, string\n\
+  columns (data, offsets) tuples of the concatenated bytes and a\n\
+  memoryview of n+1 start offsets. Missing values are 0 or empty.\n" },
     {NULL,		NULL}		/* sentinel */
 };
 
@@ -1,8 +1,12 @@
 #include "system.h"
 
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <rpm/rpmcli.h>
 #include <rpm/rpmlib.h>			/* RPMSIGTAG, rpmReadPackageFile .. */
 #include <rpm/rpmlog.h>
+#include <rpm/rpmmacro.h>
 #include <rpm/rpmps.h>
 #include <rpm/rpmstring.h>
 #include <rpm/rpmts.h>
@@ -60,6 +64,128 @@ static struct poptOption optionsTable[] = {
    POPT_TABLEEND
 };
 
+/*
+ * Options changing the configuration, which the query server doesn't get
+ * to see. Defining the query socket itself is fine of course.
+ */
+static int localConfig(int argc, char *argv[])
+{
+    static const char * const opts[] = {
+	"--define", "-D", "--undefine", "--predefine", "--macros",
+	"--rcfile", "--load", "--target", NULL
+    };
+
+    for (int i = 1; i < argc && !rstreq(argv[i], "--"); i++) {
+	for (const char * const *o = opts; *o; o++) {
+	    size_t olen = strlen(*o);
+	    const char *val = NULL;
+
+	    if (!rstreqn(argv[i], *o, olen))
+		continue;
+	    if (argv[i][olen] == '\0')
+		val = (i + 1 < argc) ? argv[i + 1] : "";
+	    else if (argv[i][olen] == '=' || olen == 2)
+		val = argv[i] + olen + (argv[i][olen] == '=');
+	    else
+		continue;
+
+	    if ((rstreq(*o, "--define") || rstreq(*o, "-D")) &&
+		rstreqn(val, "_query_socket", 13) && risspace(val[13]))
+		continue;
+	    return 1;
+	}
+    }
+    return 0;
+}
+
+/* Can the query be answered from the installed packages alone? */
+static int serverQuery(QVA_t qva, int argc, char *argv[], ARGV_const_t args)
+{
+    return querySockAllowed(qva->qva_source, args) && !localConfig(argc, argv);
+}
+
+/*
+ * Pass the query to the server on %_query_socket. Returns 0 if it was
+ * handled there, otherwise the query needs to be done here.
+ */
+static int queryServer(rpmts ts, QVA_t qva, int argc, char *argv[],
+			ARGV_const_t args, int *ec)
+{
+    char *path = rpmExpand("%{?_query_socket}", NULL);
+    char *dbpath = NULL;
+    struct sockaddr_un sun;
+    ARGV_t req = NULL;
+    ARGV_t reply = NULL;
+    char *start[] = { QUERYSOCK_MAGIC, NULL };
+    int fds[2] = { STDOUT_FILENO, STDERR_FILENO };
+    int sock = -1;
+    int rc = -1;
+
+    if (*path == '\0' || strlen(path) >= sizeof(sun.sun_path) ||
+	    !serverQuery(qva, argc, argv, args))
+	goto exit;
+
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path, path);
+    /* A busy or stuck server is no better than none */
+    if ((sock = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0)) < 0 ||
+	    querySockTimeout(sock, 1) ||
+	    connect(sock, (struct sockaddr *) &sun, sizeof(sun))) {
+	rpmlog(RPMLOG_DEBUG, "query server %s: %m\n", path);
+	goto exit;
+    }
+
+    dbpath = rpmGetPath("%{_dbpath}", NULL);
+    argvAdd(&req, QUERYSOCK_MAGIC);
+    argvAdd(&req, rpmtsRootDir(ts));
+    argvAdd(&req, dbpath);
+    argvAddNum(&req, qva->qva_source);
+    argvAddNum(&req, qva->qva_flags);
+    argvAddNum(&req, qva->qva_incattr);
+    argvAddNum(&req, qva->qva_excattr);
+    argvAddNum(&req, rpmcliVSFlags);
+    argvAddNum(&req, rpmlogSetMask(0));
+    argvAdd(&req, qva->qva_queryFormat ? qva->qva_queryFormat : "");
+    argvAppend(&req, args);
+
+    fflush(stdout);
+    fflush(stderr);
+    if (querySockSend(sock, req, fds, 2))
+	goto exit;
+
+    if (querySockRecv(sock, &reply, NULL, 0) || argvCount(reply) != 1 ||
+	    !rstreq(reply[0], QUERYSOCK_MAGIC)) {
+	rpmlog(RPMLOG_DEBUG, "query server %s declined\n", path);
+	goto exit;
+    }
+    reply = argvFree(reply);
+    if (querySockSend(sock, start, NULL, 0))
+	goto exit;
+
+    /* The query may be producing output already, no going back now */
+    rc = 0;
+    querySockTimeout(sock, 0);
+    if (querySockRecv(sock, &reply, NULL, 0) || argvCount(reply) != 1) {
+	rpmlog(RPMLOG_ERR, _("query server %s failed\n"), path);
+	*ec = EXIT_FAILURE;
+    } else if ((*ec = atoi(reply[0])) < 0) {
+	rpmlog(RPMLOG_DEBUG, "query server %s declined\n", path);
+	rc = -1;
+    } else {
+	rpmlog(RPMLOG_DEBUG, "query answered by %s\n", path);
+    }
+
+exit:
+    if (sock >= 0)
+	close(sock);
+    argvFree(req);
+    argvFree(reply);
+    free(dbpath);
+    free(path);
+    return rc;
+}
+
 int main(int argc, char *argv[])
 {
     rpmts ts = NULL;
@@ -277,7 +403,9 @@ int main(int argc, char *argv[])
 	if (!poptPeekArg(optCon) && !(qva->qva_source == RPMQV_ALL))
 	    argerror(_("no arguments given for query"));
 
-	ec = rpmcliQuery(ts, qva, (ARGV_const_t) poptGetArgs(optCon));
+	if (queryServer(ts, qva, argc, argv,
+			(ARGV_const_t) poptGetArgs(optCon), &ec))
+	    ec = rpmcliQuery(ts, qva, (ARGV_const_t) poptGetArgs(optCon));
 	break;
 
     case MODE_VERIFY:
@@ -3,12 +3,15 @@
 #include "system.h"
 
 #include <rpm/rpmlib.h>		/* rpmReadPackageFile .. */
+#include <rpm/argv.h>
+#include <rpm/rpmarchive.h>
 #include <rpm/rpmfi.h>
 #include <rpm/rpmstring.h>
 #include <rpm/rpmtag.h>
 #include <rpm/rpmio.h>
 #include <rpm/rpmurl.h>
 #include <rpm/rpmts.h>
+#include <rpm/rpmmacro.h>
 
 #include <popt.h>
 
@@ -16,16 +19,47 @@
 #include <archive_entry.h>
 #include <unistd.h>
 
+#include "rpmio/rpmio_internal.h"	/* fdSetDictionary */
 #include "debug.h"
 
 #define BUFSIZE (128*1024)
 
 int compress = 1;
+static char * compression = NULL;
+static int nthreads = -1;
+static ARGV_t wantedPaths = NULL;
+
+struct compressor_s {
+    const char * name;
+    const char * suffix;
+    int (*add)(struct archive *);
+    int threaded;		/* supports the threads filter option */
+};
+
+static const struct compressor_s compressors[] = {
+    { "gzip",	".tgz",		archive_write_add_filter_gzip,	0 },
+    { "zstd",	".tar.zst",	archive_write_add_filter_zstd,	1 },
+    { "xz",	".tar.xz",	archive_write_add_filter_xz,	1 },
+    { "none",	".tar",		NULL,				0 },
+};
+
+static const struct compressor_s * compressor = &compressors[0];
 
 static struct poptOption optionsTable[] = {
     { "nocompression", 'n', POPT_ARG_VAL, &compress, 0,
         N_("create uncompressed tar file"),
         NULL },
+    { "compression", 'C', POPT_ARG_STRING, &compression, 0,
+        N_("compress the tar file with gzip (default), zstd, xz or none"),
+        N_("<compressor>") },
+    { "threads", 'T', POPT_ARG_INT, &nthreads, 0,
+        N_("number of threads for compressing the tar file and "
+	   "decompressing the payload, 0 for one per CPU"),
+        N_("<N>") },
+    { "file", 'f', POPT_ARG_STRING, NULL, 'f',
+        N_("only put the file with the given path in the archive, "
+	   "can be given several times"),
+        N_("<path>") },
     POPT_AUTOHELP
     POPT_TABLEEND
 };
@@ -72,6 +106,83 @@ static void write_file_content(struct archive * a, char * buf, rpmfi fi)
     }
 }
 
+/*
+ * Write the wanted files of the hardlink set of the current entry, once
+ * the content of the set comes along. Returns the number written.
+ */
+static int write_wanted(struct archive * a, struct archive_entry * entry,
+			char * buf, rpmfi fi, char * wanted)
+{
+    int fx = rpmfiFX(fi);
+    const int * links = NULL;
+    int nlink = rpmfiFLinks(fi, &links);
+    char * hardlink = NULL;
+    int n = 0;
+
+    if (nlink > 1 && !rpmfiArchiveHasContent(fi))
+	return 0;
+    if (nlink <= 1 || links == NULL) {
+	links = &fx;
+	nlink = 1;
+    }
+
+    for (int i = 0; i < nlink; i++) {
+	int lx = links[i];
+	if (!wanted[lx])
+	    continue;
+	wanted[lx] = 0;
+	rpmfiSetFX(fi, lx);
+	fill_archive_entry(entry, fi);
+	if (hardlink)
+	    archive_entry_set_hardlink(entry, hardlink);
+	archive_write_header(a, entry);
+	if (hardlink == NULL) {
+	    if (S_ISREG(rpmfiFMode(fi)))
+		write_file_content(a, buf, fi);
+	    hardlink = xstrdup(archive_entry_pathname(entry));
+	}
+	n++;
+    }
+    rpmfiSetFX(fi, fx);
+    free(hardlink);
+    return n;
+}
+
+/*
+ * Jump straight to the wanted files with the file offsets of a seekable
+ * payload. Returns -1 right away if the payload can't seek, nothing has
+ * been read then.
+ */
+static int seek_wanted(struct archive * a, struct archive_entry * entry,
+		       char * buf, rpmfi fi, rpmfiles files,
+		       const uint64_t * offsets, char * wanted, int nwanted)
+{
+    int fc = rpmfilesFC(files);
+    int first = 1;
+
+    for (int fx = 0; fx < fc && nwanted > 0; fx++) {
+	const int * links = NULL;
+	int nlink = rpmfilesFLinks(files, fx, &links);
+	int cx = (nlink > 1 && links) ? links[nlink - 1] : fx;
+
+	if (!wanted[fx])
+	    continue;
+	if (rpmfiArchiveSeek(fi, offsets[cx])) {
+	    if (first)
+		return -1;
+	    fprintf(stderr, _("cannot seek in payload\n"));
+	    return 1;
+	}
+	if (rpmfiNext(fi) != cx) {
+	    fprintf(stderr, "Error reading file from rpm payload\n");
+	    return 1;
+	}
+	nwanted -= write_wanted(a, entry, buf, fi, wanted);
+	first = 0;
+    }
+    return 0;
+}
+
 static int process_package(rpmts ts, const char * filename)
 {
     FD_t fdi;
@@ -126,16 +237,54 @@ static int process_package(rpmts ts, const char * filename)
 	exit(EXIT_FAILURE);
     }
 
+    struct rpmtd_s dict;
+    if (headerGet(h, RPMTAG_PAYLOADDICT, &dict, HEADERGET_MINMEM)) {
+	if (fdSetDictionary(gzdi, dict.data, dict.count)) {
+	    fprintf(stderr, _("cannot use payload dictionary\n"));
+	    exit(EXIT_FAILURE);
+	}
+	rpmtdFreeData(&dict);
+    }
+
     rpmfiles files = rpmfilesNew(NULL, h, 0, RPMFI_KEEPHEADER);
-    rpmfi fi = rpmfiNewArchiveReader(gzdi, files, RPMFI_ITER_READ_ARCHIVE_CONTENT_FIRST);
+    int fc = rpmfilesFC(files);
+    char * wanted = NULL;
+    int nwanted = 0;
+
+    /* With selected files, the content of hardlinks comes with the last */
+    if (wantedPaths) {
+	wanted = xcalloc(fc + 1, sizeof(*wanted));
+	for (ARGV_const_t p = wantedPaths; *p; p++) {
+	    int fx = rpmfilesFindFN(files, *p);
+	    if (fx < 0) {
+		fprintf(stderr, _("%s: no such file in package: %s\n"),
+			filename, *p);
+		exit(EXIT_FAILURE);
+	    }
+	    if (!wanted[fx])
+		nwanted++;
+	    wanted[fx] = 1;
+	}
+    }
+    rpmfi fi = rpmfiNewArchiveReader(gzdi, files, wanted ?
+				     RPMFI_ITER_READ_ARCHIVE :
+				     RPMFI_ITER_READ_ARCHIVE_CONTENT_FIRST);
 
     /* create archive */
     a = archive_write_new();
-    if (compress) {
-	if (archive_write_add_filter_gzip(a) != ARCHIVE_OK) {
+    if (compressor->add) {
+	if (compressor->add(a) != ARCHIVE_OK) {
 	    fprintf(stderr, "%s\n", archive_error_string(a));
 	    exit(EXIT_FAILURE);
 	}
+	if (compressor->threaded && nthreads >= 0) {
+	    char threads[16];
+	    snprintf(threads, sizeof(threads), "%d", nthreads);
+	    if (archive_write_set_filter_option(a, NULL, "threads",
+						threads) != ARCHIVE_OK) {
+		fprintf(stderr, "Warning: %s\n", archive_error_string(a));
+	    }
+	}
     }
     if (archive_write_set_format_pax_restricted(a) != ARCHIVE_OK) {
 	fprintf(stderr, "Error: Format pax restricted is not supported\n");
@@ -160,11 +309,7 @@ static int process_package(rpmts ts, const char * filename)
 	} else {
 	    outname = rstrscat(NULL, filename, NULL);
 	}
-	if (compress) {
-	    outname = rstrscat(&outname, ".tgz", NULL);
-	} else {
-	    outname = rstrscat(&outname, ".tar", NULL);
-	}
+	outname = rstrscat(&outname, compressor->suffix, NULL);
 	if (archive_write_open_filename(a, outname) != ARCHIVE_OK) {
 	    fprintf(stderr, "Error: Can't open output file: %s\n", outname);
 	    exit(EXIT_FAILURE);
@@ -178,7 +323,31 @@ static int process_package(rpmts ts, const char * filename)
     char * hardlink = NULL;
 
     rc = 0;
-    while (rc >= 0) {
+    if (wanted) {
+	struct rpmtd_s offsets;
+	rc = -1;
+	if (headerGet(h, RPMTAG_PAYLOADFILEOFFSETS, &offsets, HEADERGET_MINMEM)) {
+	    if (rpmtdCount(&offsets) == fc)
+		rc = seek_wanted(a, entry, buf, fi, files, offsets.data,
+				 wanted, nwanted);
+	    rpmtdFreeData(&offsets);
+	}
+	/* Not seekable, read through the payload until all are found */
+	if (rc < 0) {
+	    while (nwanted > 0 && (rc = rpmfiNext(fi)) != RPMERR_ITER_END) {
+		if (rc < 0) {
+		    fprintf(stderr, "Error reading file from rpm payload\n");
+		    break;
+		}
+		nwanted -= write_wanted(a, entry, buf, fi, wanted);
+	    }
+	    if (nwanted > 0 && rc == RPMERR_ITER_END)
+		fprintf(stderr, _("%s: file missing from payload\n"), filename);
+	    rc = (nwanted > 0) ? 1 : 0;
+	}
+    }
+
+    while (rc >= 0 && !wanted) {
 	rc = rpmfiNext(fi);
 	if (rc == RPMERR_ITER_END) {
 	    break;
@@ -210,6 +379,7 @@ static int process_package(rpmts ts, const char * filename)
     }
 
     _free(hardlink);
+    _free(wanted);
 
     Fclose(gzdi);	/* XXX gzdi == fdi */
     archive_entry_free(entry);
@@ -227,17 +397,55 @@ int main(int argc, const char *argv[])
     int rc = 0;
     poptContext optCon;
     const char *fn;
+    int arg;
 
     xsetprogname(argv[0]);	/* Portability call -- see system.h */
     rpmReadConfigFiles(NULL, NULL);
 
     optCon = poptGetContext(NULL, argc, argv, optionsTable, 0);
     poptSetOtherOptionHelp(optCon, "[OPTIONS]* <FILES>");
-    if (argc < 2 || poptGetNextOpt(optCon) == 0) {
+    while ((arg = poptGetNextOpt(optCon)) > 0) {
+	if (arg == 'f') {
+	    char * path = poptGetOptArg(optCon);
+	    argvAdd(&wantedPaths, path);
+	    free(path);
+	}
+    }
+    if (argc < 2 || arg < -1) {
 	poptPrintUsage(optCon, stderr, 0);
 	exit(EXIT_FAILURE);
     }
 
+    if (compression) {
+	compressor = NULL;
+	for (int i = 0; i < sizeof(compressors) / sizeof(*compressors); i++) {
+	    if (rstreq(compression, compressors[i].name))
+		compressor = &compressors[i];
+	}
+	if (compressor == NULL) {
+	    fprintf(stderr, _("unknown compression: %s\n"), compression);
+	    exit(EXIT_FAILURE);
+	}
+    }
+    if (!compress)
+	compressor = &compressors[3];	/* none */
+
+    /*
+     * Decompress the payload on separate threads too, so that decoding,
+     * tar writing and compression form a pipeline. For zstd payloads any
+     * value gives a read-ahead decoder thread.
+     */
+    if (nthreads >= 0) {
+	if (nthreads == 0)
+	    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (!rpmMacroIsDefined(NULL, "_decompress_threads")) {
+	    char threads[16];
+	    snprintf(threads, sizeof(threads), "%d", nthreads);
+	    rpmPushMacro(NULL, "_decompress_threads", NULL, threads,
+			 RMIL_CMDLINE);
+	}
+    }
+
     rpmts ts = rpmtsCreate();
     rpmVSFlags vsflags = 0;
 
@@ -262,6 +470,7 @@ int main(int argc, const char *argv[])
 
  exit:
     poptFreeContext(optCon);
+    argvFree(wantedPaths);
     (void) rpmtsFree(ts);
     return rc;
 }
@@ -10,8 +10,17 @@
 #include <rpm/rpmts.h>
 #include <unistd.h>
 
+#include "rpmio/rpmio_internal.h"	/* fdSetDictionary */
 #include "debug.h"
 
+static int payloadIsPlain(int fdno)
+{
+    char magic[6];
+    off_t pos = lseek(fdno, 0, SEEK_CUR);
+    return (pos >= 0 && pread(fdno, magic, sizeof(magic), pos) == sizeof(magic)
+	    && memcmp(magic, "07070", 5) == 0);
+}
+
 int main(int argc, char *argv[])
 {
     FD_t fdi, fdo;
@@ -20,27 +29,35 @@ int main(int argc, char *argv[])
     int rc;
     off_t payload_size;
     FD_t gzdi;
+    int raw = 0;
+    const char *fn = NULL;
     
     xsetprogname(argv[0]); /* Portability call -- see system.h */
 
     rpmReadConfigFiles(NULL, NULL);
-    if (argc == 1)
-	fdi = fdDup(STDIN_FILENO);
-    else {
-	if (rstreq(argv[1], "-h") || rstreq(argv[1], "--help")) {
-	    fprintf(stderr, "Usage: rpm2cpio file.rpm\n");
+    for (int i = 1; i < argc; i++) {
+	if (rstreq(argv[i], "-h") || rstreq(argv[i], "--help") || fn) {
+	    fprintf(stderr, "Usage: rpm2cpio [--raw] file.rpm\n");
 	    exit(EXIT_FAILURE);
+	} else if (rstreq(argv[i], "-r") || rstreq(argv[i], "--raw")) {
+	    raw = 1;
+	} else {
+	    fn = argv[i];
 	}
-	fdi = Fopen(argv[1], "r.ufdio");
     }
+    if (fn == NULL || rstreq(fn, "-"))
+	fdi = fdDup(STDIN_FILENO);
+    else
+	fdi = Fopen(fn, "r.ufdio");
 
     if (Ferror(fdi)) {
 	fprintf(stderr, "%s: %s: %s\n", argv[0],
-		(argc == 1 ? "<stdin>" : argv[1]), Fstrerror(fdi));
+		(fn == NULL ? "<stdin>" : fn), Fstrerror(fdi));
 	exit(EXIT_FAILURE);
     }
     if (isatty(STDOUT_FILENO)) {
-	fprintf(stderr, "Error: refusing to output cpio data to a terminal.\n");
+	fprintf(stderr, "Error: refusing to output %s data to a terminal.\n",
+		raw ? "payload" : "cpio");
 	exit(EXIT_FAILURE);
     }
     fdo = fdDup(STDOUT_FILENO);
@@ -75,6 +92,15 @@ int main(int argc, char *argv[])
 	break;
     }
 
+    /* Pass the payload through as is, straight from the kernel if possible */
+    if (raw) {
+	rc = (ufdCopy(fdi, fdo) >= 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+	headerFree(h);
+	Fclose(fdo);
+	Fclose(fdi);
+	return rc;
+    }
+
     if (headerIsEntry(h, RPMTAG_LONGFILESIZES)) {
 	fprintf(stderr, _("files over 4GB not supported by cpio, use rpm2archive instead\n"));
 	exit(EXIT_FAILURE);
@@ -82,6 +108,9 @@ int main(int argc, char *argv[])
 
     /* Retrieve payload size and compression type. */
     {	const char *compr = headerGetString(h, RPMTAG_PAYLOADCOMPRESSOR);
+	/* Packages without compressor are gzip, unless built with w.ufdio */
+	if (compr == NULL && payloadIsPlain(Fileno(fdi)))
+	    compr = "ufdio";
 	rpmio_flags = rstrscat(NULL, "r.", compr ? compr : "gzip", NULL);
 	payload_size = headerGetNumber(h, RPMTAG_LONGARCHIVESIZE);
     }
@@ -94,6 +123,15 @@ int main(int argc, char *argv[])
 	exit(EXIT_FAILURE);
     }
 
+    struct rpmtd_s dict;
+    if (headerGet(h, RPMTAG_PAYLOADDICT, &dict, HEADERGET_MINMEM)) {
+	if (fdSetDictionary(gzdi, dict.data, dict.count)) {
+	    fprintf(stderr, _("cannot use payload dictionary\n"));
+	    exit(EXIT_FAILURE);
+	}
+	rpmtdFreeData(&dict);
+    }
+
     rc = (ufdCopy(gzdi, fdo) == payload_size) ? EXIT_SUCCESS : EXIT_FAILURE;
 
     headerFree(h);
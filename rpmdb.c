@@ -1,8 +1,19 @@
 #include "system.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <popt.h>
 #include <rpm/rpmcli.h>
 #include <rpm/rpmdb.h>
+#include <rpm/rpmlog.h>
+#include <rpm/rpmmacro.h>
+#include <rpm/rpmstring.h>
+#include <rpm/rpmts.h>
 #include "cliutils.h"
 #include "debug.h"
 
@@ -13,9 +24,13 @@ enum modes {
     MODE_EXPORTDB	= (1 << 3),
     MODE_IMPORTDB	= (1 << 4),
     MODE_SALVAGEDB	= (1 << 5),
+    MODE_COMPACTDB	= (1 << 6),
+    MODE_SERVE		= (1 << 7),
 };
 
 static int mode = 0;
+static char *servePath = NULL;
+static volatile sig_atomic_t serveDone = 0;
 
 static struct poptOption dbOptsTable[] = {
     { "initdb", '\0', (POPT_ARG_VAL|POPT_ARGFLAG_OR), &mode, MODE_INITDB,
@@ -27,12 +42,16 @@ static struct poptOption dbOptsTable[] = {
 	&mode, MODE_VERIFYDB, N_("verify database files"), NULL},
     { "salvagedb", '\0', (POPT_ARG_VAL|POPT_ARGFLAG_OR|POPT_ARGFLAG_DOC_HIDDEN),
 	&mode, MODE_SALVAGEDB, N_("salvage database"), NULL},
+    { "compactdb", '\0', (POPT_ARG_VAL|POPT_ARGFLAG_OR), &mode, MODE_COMPACTDB,
+	N_("compact database package storage"), NULL},
     { "exportdb", '\0', (POPT_ARG_VAL|POPT_ARGFLAG_OR), &mode, MODE_EXPORTDB,
 	N_("export database to stdout header list"),
 	NULL},
     { "importdb", '\0', (POPT_ARG_VAL|POPT_ARGFLAG_OR), &mode, MODE_IMPORTDB,
 	N_("import database from stdin header list"),
 	NULL},
+    { "serve", '\0', POPT_ARG_STRING, &servePath, 0,
+	N_("answer queries on a local socket"), N_("<socket>") },
     POPT_TABLEEND
 };
 
@@ -88,6 +107,231 @@ static int importDB(rpmts ts)
     return rc;
 }
 
+static void serveSignal(int signum)
+{
+    serveDone = 1;
+}
+
+static int serveOpen(const char *path)
+{
+    struct sockaddr_un sun;
+    int probe, sock = -1;
+    int sockmode, failed;
+    mode_t omask;
+
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(sun.sun_path)) {
+	rpmlog(RPMLOG_ERR, _("socket path too long: %s\n"), path);
+	return -1;
+    }
+    strcpy(sun.sun_path, path);
+
+    /* A socket nobody answers on is left over from an earlier server */
+    if ((probe = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0)) >= 0) {
+	int xx = connect(probe, (struct sockaddr *) &sun, sizeof(sun));
+	int err = errno;
+	close(probe);
+	if (xx == 0) {
+	    rpmlog(RPMLOG_ERR, _("%s is already being served\n"), path);
+	    return -1;
+	}
+	if (err == ECONNREFUSED)
+	    (void) unlink(path);
+    }
+
+    /* Bind with no access at all, whatever the umask, then open it up */
+    sockmode = rpmExpandNumeric("%{?_query_socket_mode}");
+    if (sockmode <= 0)
+	sockmode = 0666;
+    omask = umask(0777);
+    sock = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+    failed = (sock < 0 || bind(sock, (struct sockaddr *) &sun, sizeof(sun)));
+    umask(omask);
+
+    if (failed || chmod(path, sockmode & 0777) || listen(sock, 16)) {
+	rpmlog(RPMLOG_ERR, _("cannot serve queries on %s: %m\n"), path);
+	if (sock >= 0) {
+	    if (!failed)
+		(void) unlink(path);
+	    close(sock);
+	}
+	sock = -1;
+    }
+    return sock;
+}
+
+/* (Re)open the database if it changed since the last request */
+static void serveReload(rpmts ts, char **cookie)
+{
+    rpmdb db = rpmtsGetRdb(ts);
+    char *c = db ? rpmdbCookie(db) : NULL;
+
+    if (c == NULL || *cookie == NULL || !rstreq(c, *cookie)) {
+	if (db) {
+	    rpmlog(RPMLOG_DEBUG, "database changed, reopening\n");
+	    rpmtsCloseDB(ts);
+	}
+	c = _free(c);
+	if (rpmtsOpenDB(ts, O_RDONLY) == 0)
+	    c = rpmdbCookie(rpmtsGetRdb(ts));
+    }
+    free(*cookie);
+    *cookie = c;
+}
+
+/*
+ * Log mask for the peer on the socket, the debug output tells about the
+ * server's environment so it's only for root and the server's own user.
+ * Returns 0 if the peer can't be determined.
+ */
+static int servePeerMask(int sock)
+{
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) ||
+	    len != sizeof(cred))
+	return 0;
+
+    rpmlog(RPMLOG_DEBUG, "query from pid %d uid %d\n",
+	   (int) cred.pid, (int) cred.uid);
+    if (cred.uid == 0 || cred.uid == geteuid())
+	return RPMLOG_UPTO(RPMLOG_DEBUG);
+    return RPMLOG_UPTO(RPMLOG_INFO);
+}
+
+/* Tell the client we're ready, it may have given up waiting already */
+static int serveStart(int sock)
+{
+    char *start[] = { QUERYSOCK_MAGIC, NULL };
+    ARGV_t reply = NULL;
+    int rc = -1;
+
+    if (querySockSend(sock, start, NULL, 0) == 0 &&
+	    querySockRecv(sock, &reply, NULL, 0) == 0 &&
+	    argvCount(reply) == 1 && rstreq(reply[0], QUERYSOCK_MAGIC))
+	rc = 0;
+    argvFree(reply);
+    return rc;
+}
+
+static void serveRequest(rpmts ts, int sock, char **cookie)
+{
+    struct rpmQVKArguments_s qva;
+    ARGV_t req = NULL;
+    char *dbpath = NULL;
+    char *ecstr = NULL;
+    char *reply[2] = { NULL, NULL };
+    int fds[2];
+    int ec = -1;
+    int peermask = servePeerMask(sock);
+
+    if (querySockRecv(sock, &req, fds, 2))
+	goto exit;
+
+    /* Don't take the client's word for what it may ask for */
+    dbpath = rpmGetPath("%{_dbpath}", NULL);
+    if (peermask && argvCount(req) >= QUERYSOCK_NARGS &&
+	fds[0] >= 0 && fds[1] >= 0 &&
+	rstreq(req[0], QUERYSOCK_MAGIC) &&
+	rstreq(req[1], rpmtsRootDir(ts)) && rstreq(req[2], dbpath) &&
+	querySockAllowed(atoi(req[3]), req + QUERYSOCK_NARGS) &&
+	serveStart(sock) == 0)
+    {
+	rpmVSFlags ovsflags = rpmcliVSFlags;
+	int omask = rpmlogSetMask(0);
+	int saved[2];
+
+	serveReload(ts, cookie);
+
+	memset(&qva, 0, sizeof(qva));
+	qva.qva_mode = 'q';
+	qva.qva_source = atoi(req[3]);
+	qva.qva_flags = strtoul(req[4], NULL, 10);
+	qva.qva_incattr = strtoul(req[5], NULL, 10);
+	qva.qva_excattr = strtoul(req[6], NULL, 10);
+	qva.qva_queryFormat = *req[9] ? xstrdup(req[9]) : NULL;
+	/* The client may ask for more checks but not for less */
+	rpmcliVSFlags = ovsflags & strtoul(req[7], NULL, 10);
+	rpmlogSetMask(atoi(req[8]) & peermask);
+
+	/* Run the query with the client stdout and stderr */
+	fflush(stdout);
+	fflush(stderr);
+	saved[0] = dup(STDOUT_FILENO);
+	saved[1] = dup(STDERR_FILENO);
+	dup2(fds[0], STDOUT_FILENO);
+	dup2(fds[1], STDERR_FILENO);
+
+	ec = rpmcliQuery(ts, &qva, req + QUERYSOCK_NARGS);
+
+	fflush(stdout);
+	fflush(stderr);
+	dup2(saved[0], STDOUT_FILENO);
+	dup2(saved[1], STDERR_FILENO);
+	close(saved[0]);
+	close(saved[1]);
+
+	rpmlogSetMask(omask);
+	rpmcliVSFlags = ovsflags;
+	free(qva.qva_queryFormat);
+	/* Don't let the log records pile up */
+	rpmlogClose();
+    }
+
+    rasprintf(&ecstr, "%d", ec);
+    reply[0] = ecstr;
+    (void) querySockSend(sock, reply, NULL, 0);
+
+exit:
+    if (fds[0] >= 0)
+	close(fds[0]);
+    if (fds[1] >= 0)
+	close(fds[1]);
+    argvFree(req);
+    free(dbpath);
+    free(ecstr);
+}
+
+static int serveQueries(rpmts ts, const char *path)
+{
+    struct sigaction sa;
+    char *cookie = NULL;
+    int sock = serveOpen(path);
+
+    if (sock < 0)
+	return EXIT_FAILURE;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = serveSignal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    serveReload(ts, &cookie);
+    rpmlog(RPMLOG_DEBUG, "serving queries on %s\n", path);
+
+    while (!serveDone) {
+	int client = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+	if (client < 0) {
+	    if (errno == EINTR || errno == ECONNABORTED)
+		continue;
+	    rpmlog(RPMLOG_ERR, _("cannot serve queries on %s: %m\n"), path);
+	    break;
+	}
+	/* One client at a time, don't let a stuck one hold up the rest */
+	if (querySockTimeout(client, 1) == 0)
+	    serveRequest(ts, client, &cookie);
+	close(client);
+    }
+
+    close(sock);
+    (void) unlink(path);
+    free(cookie);
+    return serveDone ? 0 : EXIT_FAILURE;
+}
+
 int main(int argc, char *argv[])
 {
     int ec = EXIT_FAILURE;
@@ -95,6 +339,8 @@ int main(int argc, char *argv[])
     rpmts ts = NULL;
 
     optCon = rpmcliInit(argc, argv, optionsTable);
+    if (servePath)
+	mode |= MODE_SERVE;
 
     if (argc < 2 || poptPeekArg(optCon)) {
 	printUsage(optCon, stderr, 0);
@@ -120,12 +366,18 @@ int main(int argc, char *argv[])
     case MODE_VERIFYDB:
 	ec = rpmtsVerifyDB(ts);
 	break;
+    case MODE_COMPACTDB:
+	ec = rpmtsCompactDB(ts);
+	break;
     case MODE_EXPORTDB:
 	ec = exportDB(ts);
 	break;
     case MODE_IMPORTDB:
 	ec = importDB(ts);
 	break;
+    case MODE_SERVE:
+	ec = serveQueries(ts, servePath);
+	break;
     default:
 	argerror(_("only one major mode may be specified"));
     }
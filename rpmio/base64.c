@@ -2,57 +2,67 @@
  * by Chris Venter */
 
 #include <arpa/inet.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
 
 #include <rpm/rpmbase64.h>
 
 
-static char base64_encode_value(char value_in)
-{
-	static const char encoding[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-	if (value_in > 63) return '=';
-	return encoding[(int)value_in];
-}
+static const char encoding[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/*
+ * Code values of all bytes, -1 for bytes outside of the alphabet and
+ * -2 for the '=' padding.
+ */
+#define X -1
+static const signed char decoding[256] = {
+	X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+	X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+	X, X, X, X, X, X, X, X, X, X, X,62, X, X, X,63,
+	52,53,54,55,56,57,58,59,60,61, X, X, X,-2, X, X,
+	X, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9,10,11,12,13,14,
+	15,16,17,18,19,20,21,22,23,24,25, X, X, X, X, X,
+	X,26,27,28,29,30,31,32,33,34,35,36,37,38,39,40,
+	41,42,43,44,45,46,47,48,49,50,51, X, X, X, X, X,
+	X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+	X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+	X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+	X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+	X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+	X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+	X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+	X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+};
+#undef X
 
-static char *base64_encode_block(const char *plaintext_in, int length_in, char *codechar)
+/* Encode whole 3 byte groups four code values at a time, pad the tail */
+static char *base64_encode_block(const char *plaintext_in, size_t length_in, char *codechar)
 {
-	const char *plainchar = plaintext_in;
-	const char *const plaintextend = plaintext_in + length_in;
-	char result;
-	char fragment;
-	
-	while (1) {
-		if (plainchar == plaintextend) {
-			return codechar;
-		}
-		fragment = *plainchar++;
-		result = (fragment & 0x0fc) >> 2;
-		*codechar++ = base64_encode_value(result);
-		result = (fragment & 0x003) << 4;
-		if (plainchar == plaintextend)
-		{
-			*codechar++ = base64_encode_value(result);
-			*codechar++ = '=';
-			*codechar++ = '=';
-			return codechar;
-		}
-		fragment = *plainchar++;
-		result |= (fragment & 0x0f0) >> 4;
-		*codechar++ = base64_encode_value(result);
-		result = (fragment & 0x00f) << 2;
-		if (plainchar == plaintextend)
-		{
-			*codechar++ = base64_encode_value(result);
-			*codechar++ = '=';
-			return codechar;
-		}
-		fragment = *plainchar++;
-		result |= (fragment & 0x0c0) >> 6;
-		*codechar++ = base64_encode_value(result);
-		result  = (fragment & 0x03f) >> 0;
-		*codechar++ = base64_encode_value(result);
+	const unsigned char *p = (const unsigned char *)plaintext_in;
+	const unsigned char *const end = p + length_in;
+
+	for (; end - p >= 3; p += 3) {
+		uint32_t v = (p[0] << 16) | (p[1] << 8) | p[2];
+		codechar[0] = encoding[v >> 18];
+		codechar[1] = encoding[(v >> 12) & 0x3f];
+		codechar[2] = encoding[(v >> 6) & 0x3f];
+		codechar[3] = encoding[v & 0x3f];
+		codechar += 4;
+	}
+
+	if (end - p == 1) {
+		*codechar++ = encoding[p[0] >> 2];
+		*codechar++ = encoding[(p[0] & 0x03) << 4];
+		*codechar++ = '=';
+		*codechar++ = '=';
+	} else if (end - p == 2) {
+		*codechar++ = encoding[p[0] >> 2];
+		*codechar++ = encoding[((p[0] & 0x03) << 4) | (p[1] >> 4)];
+		*codechar++ = encoding[(p[1] & 0x0f) << 2];
+		*codechar++ = '=';
 	}
-	/* control should not reach here */
 	return codechar;
 }
 
@@ -100,101 +110,99 @@ char *rpmBase64Encode(const void *data, size_t len, int linelen)
 	return output;
 }
 
-static int base64_decode_value(unsigned char value_in)
+/*
+ * Decode and validate in one pass. Runs of four code values, which is
+ * everything but line ends and the padding, are decoded a group at a
+ * time, the rest one value at a time. ASCII control characters and
+ * space are skipped as whitespace, as is anything not in the alphabet
+ * that doesn't compare greater than 32 as a char. The '=' padding
+ * is counted for the length check but otherwise ignored.
+ * Returns the number of code values seen or -1 on an invalid one.
+ */
+static ssize_t base64_decode_block(const char *code_in, unsigned char *plaintext_out, size_t *outlen)
 {
-	static const int decoding[] = {62,-1,-1,-1,63,52,53,54,55,56,57,58,59,60,61,-1,-1,-1,-2,-1,-1,-1,0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16,17,18,19,20,21,22,23,24,25,-1,-1,-1,-1,-1,-1,26,27,28,29,30,31,32,33,34,35,36,37,38,39,40,41,42,43,44,45,46,47,48,49,50,51};
-	value_in -= 43;
-	if (value_in >= sizeof(decoding)/sizeof(int))
-		return -1;
-	return decoding[value_in];
-}
+	const unsigned char *c = (const unsigned char *)code_in;
+	unsigned char *out = plaintext_out;
+	uint32_t v = 0;
+	size_t nvals = 0;	/* code values (without padding) decoded */
+	size_t ncodes = 0;	/* code values and padding seen */
 
-static size_t base64_decode_block(const char *code_in, const size_t length_in, char *plaintext_out)
-{
-	const char *codechar = code_in;
-	char *plainchar = plaintext_out;
-	int fragment;
-	
-	*plainchar = 0;
-	
-	while (1)
-	{
-		do {
-			if (codechar == code_in+length_in)
-			{
-				return plainchar - plaintext_out;
-			}
-			fragment = base64_decode_value(*codechar++);
-		} while (fragment < 0);
-		*plainchar    = (char)((fragment & 0x03f) << 2);
-
-		do {
-			if (codechar == code_in+length_in)
-			{
-				return plainchar - plaintext_out;
+	while (*c != '\0') {
+		if ((nvals & 3) == 0) {
+			int a, b, d, e;
+			while ((a = decoding[c[0]]) >= 0 && (b = decoding[c[1]]) >= 0 &&
+			       (d = decoding[c[2]]) >= 0 && (e = decoding[c[3]]) >= 0) {
+				v = (a << 18) | (b << 12) | (d << 6) | e;
+				out[0] = v >> 16;
+				out[1] = v >> 8;
+				out[2] = v;
+				out += 3;
+				c += 4;
+				nvals += 4;
+				ncodes += 4;
 			}
-			fragment = base64_decode_value(*codechar++);
-		} while (fragment < 0);
-		*plainchar++ |= (char)((fragment & 0x030) >> 4);
-		*plainchar    = (char)((fragment & 0x00f) << 4);
-
-		do {
-			if (codechar == code_in+length_in)
-			{
-				return plainchar - plaintext_out;
-			}
-			fragment = base64_decode_value(*codechar++);
-		} while (fragment < 0);
-		*plainchar++ |= (char)((fragment & 0x03c) >> 2);
-		*plainchar    = (char)((fragment & 0x003) << 6);
-
-		do {
-			if (codechar == code_in+length_in)
-			{
-				return plainchar - plaintext_out;
+			if (*c == '\0')
+				break;
+		}
+
+		int val = decoding[*c];
+		if (val >= 0) {
+			v = (v << 6) | val;
+			switch (++nvals & 3) {
+			case 2:
+				*out++ = v >> 4;
+				break;
+			case 3:
+				*out++ = v >> 2;
+				break;
+			case 0:
+				*out++ = v;
+				break;
 			}
-			fragment = base64_decode_value(*codechar++);
-		} while (fragment < 0);
-		*plainchar++   |= (char)(fragment & 0x03f);
+			ncodes++;
+		} else if (val == -2) {
+			ncodes++;
+		} else if (*(const char *)c > 32) {
+			return -1;
+		}
+		c++;
 	}
-	/* control should not reach here */
-	return plainchar - plaintext_out;
+	*outlen = out - plaintext_out;
+	return ncodes;
 }
 
 int rpmBase64Decode(const char *in, void **out, size_t *outlen)
 {
-	size_t outcnt = 0;
-	const char *inptr = in;
+	size_t len, declen;
+	ssize_t ncodes;
+	unsigned char *dec;
 
 	*out = NULL;
 
 	if (in == NULL) {
 		return 1;
 	}
+
+	/* every four input characters make at most three bytes */
+	len = strlen(in);
+	dec = malloc((len / 4) * 3 + 3);
 	
-	while (*inptr != '\0') {
-		/* assume all ASCII control chars as whitespace */
-		if (*inptr > 32) {
-			if (base64_decode_value(*inptr) != -1) {
-				++outcnt;
-			} else {
-				return 3;
-			}
-		}
-		++inptr;
+	if (dec == NULL)
+		return 4;
+
+	ncodes = base64_decode_block(in, dec, &declen);
+	if (ncodes < 0) {
+		free(dec);
+		return 3;
 	}
 	
-	if (outcnt % 4 != 0)
+	if (ncodes % 4 != 0) {
+		free(dec);
 		return 2;
-	
-	outcnt = (outcnt / 4) * 3;
-	
-	*out = malloc(outcnt + 1); /* base64_decode_block can write one extra character */
-	
-	if (*out == NULL)
-		return 4;
-	
-	*outlen = base64_decode_block(in, inptr - in, *out);
+	}
+
+	*out = dec;
+	*outlen = declen;
 
 	return 0;
 }
@@ -4,18 +4,128 @@
 
 #include "system.h"
 
+#include <pthread.h>
+#include <rpm/rpmmacro.h>
+
 #include "rpmio/rpmpgp_internal.h"
 
 #include "debug.h"
 
 #define DIGESTS_MAX 12
+
+/* Helper thread hashing part of the bundle members */
+struct bundleWorker_s {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    rpmDigestBundle bundle;
+    const void *data;			/*!< buffer to hash (NULL when idle) */
+    size_t len;
+    int rc;
+    int quit;
+};
+
 struct rpmDigestBundle_s {
     int index_max;			/*!< Largest index of active digest */
     off_t nbytes;			/*!< Length of total input data */
     DIGEST_CTX digests[DIGESTS_MAX];	/*!< Digest contexts identified by id */
     int ids[DIGESTS_MAX];		/*!< Digest ID (arbitrary non-zero) */
+    size_t splitsize;			/*!< Min. update size for splitting */
+    struct bundleWorker_s *worker;	/*!< Helper thread (or NULL) */
 };
 
+/*
+ * Hash every other active member of the bundle, starting from the first
+ * (part 0) or the second (part 1) one.
+ */
+static int bundleUpdatePart(rpmDigestBundle bundle, int part,
+			    const void *data, size_t len)
+{
+    int rc = 0;
+    int n = 0;
+    for (int i = 0; i <= bundle->index_max; i++) {
+	if (bundle->ids[i] > 0 && (n++ % 2) == part)
+	    rc += rpmDigestUpdate(bundle->digests[i], data, len);
+    }
+    return rc;
+}
+
+static void *bundleWorkerThread(void *arg)
+{
+    struct bundleWorker_s *w = arg;
+
+    pthread_mutex_lock(&w->lock);
+    while (1) {
+	while (!w->quit && w->data == NULL)
+	    pthread_cond_wait(&w->cond, &w->lock);
+	if (w->quit)
+	    break;
+	pthread_mutex_unlock(&w->lock);
+
+	int rc = bundleUpdatePart(w->bundle, 1, w->data, w->len);
+
+	pthread_mutex_lock(&w->lock);
+	w->rc = rc;
+	w->data = NULL;
+	pthread_cond_broadcast(&w->cond);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+static struct bundleWorker_s *bundleWorkerNew(rpmDigestBundle bundle)
+{
+    struct bundleWorker_s *w = xcalloc(1, sizeof(*w));
+
+    w->bundle = bundle;
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->cond, NULL);
+    if (pthread_create(&w->thread, NULL, bundleWorkerThread, w)) {
+	pthread_cond_destroy(&w->cond);
+	pthread_mutex_destroy(&w->lock);
+	w = _free(w);
+    }
+    return w;
+}
+
+static void bundleWorkerFree(struct bundleWorker_s *w)
+{
+    if (w) {
+	pthread_mutex_lock(&w->lock);
+	w->quit = 1;
+	pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+	pthread_join(w->thread, NULL);
+	pthread_cond_destroy(&w->cond);
+	pthread_mutex_destroy(&w->lock);
+	free(w);
+    }
+}
+
+/* Split the members over the caller and the helper thread */
+static int bundleUpdateSplit(rpmDigestBundle bundle,
+			     const void *data, size_t len)
+{
+    struct bundleWorker_s *w = bundle->worker;
+    int rc;
+
+    pthread_mutex_lock(&w->lock);
+    w->data = data;
+    w->len = len;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+
+    rc = bundleUpdatePart(bundle, 0, data, len);
+
+    pthread_mutex_lock(&w->lock);
+    while (w->data != NULL)
+	pthread_cond_wait(&w->cond, &w->lock);
+    rc += w->rc;
+    pthread_mutex_unlock(&w->lock);
+
+    return rc;
+}
+
 static int findID(rpmDigestBundle bundle, int id)
 {
     int ix = -1;
@@ -30,15 +140,29 @@ static int findID(rpmDigestBundle bundle, int id)
     return ix;
 }
 
+/* Bundles are created per package read, only expand the macro once */
+static pthread_once_t splitSizeOnce = PTHREAD_ONCE_INIT;
+static size_t splitSize = 0;
+
+static void splitSizeInit(void)
+{
+    int splitsize = rpmExpandNumeric("%{?_digest_split_size}");
+    if (splitsize > 0)
+	splitSize = splitsize;
+}
+
 rpmDigestBundle rpmDigestBundleNew(void)
 {
     rpmDigestBundle bundle = xcalloc(1, sizeof(*bundle));
+    pthread_once(&splitSizeOnce, splitSizeInit);
+    bundle->splitsize = splitSize;
     return bundle;
 }
 
 rpmDigestBundle rpmDigestBundleFree(rpmDigestBundle bundle)
 {
     if (bundle) {
+	bundleWorkerFree(bundle->worker);
 	for (int i = 0; i <= bundle->index_max ; i++) {
 	    if (bundle->digests[i] == NULL)
 		continue;
@@ -79,9 +203,21 @@ int rpmDigestBundleUpdate(rpmDigestBundle bundle, const void *data, size_t len)
 {
     int rc = 0;
     if (bundle && data && len > 0) {
-	for (int i = 0; i <= bundle->index_max; i++) {
-	    if (bundle->ids[i] > 0)
-		rc += rpmDigestUpdate(bundle->digests[i], data, len);
+	int nactive = 0;
+	if (bundle->splitsize && len >= bundle->splitsize) {
+	    for (int i = 0; i <= bundle->index_max; i++)
+		nactive += (bundle->ids[i] > 0);
+	    if (nactive > 1 && bundle->worker == NULL)
+		bundle->worker = bundleWorkerNew(bundle);
+	}
+
+	if (nactive > 1 && bundle->worker) {
+	    rc = bundleUpdateSplit(bundle, data, len);
+	} else {
+	    for (int i = 0; i <= bundle->index_max; i++) {
+		if (bundle->ids[i] > 0)
+		    rc += rpmDigestUpdate(bundle->digests[i], data, len);
+	    }
 	}
 	bundle->nbytes += len;
     }
@@ -136,6 +136,24 @@ DIGEST_CTX rpmDigestDup(DIGEST_CTX octx)
 }
 
 
+/*
+ * The public key s-expression of a key is the same for every signature,
+ * it's built on first use and kept with the key. Keyrings can be used
+ * from several threads at once, only one copy is kept.
+ */
+static gcry_sexp_t keySexpCache(gcry_sexp_t *cache, gcry_sexp_t sexp)
+{
+    gcry_sexp_t prev = NULL;
+
+    if (sexp && !__atomic_compare_exchange_n(cache, &prev, sexp, 0,
+					     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+	gcry_sexp_release(sexp);
+	sexp = prev;
+    }
+    return sexp;
+}
+
+
 /****************************** RSA **************************************/
 
 struct pgpDigSigRSA_s {
@@ -145,6 +163,7 @@ struct pgpDigSigRSA_s {
 struct pgpDigKeyRSA_s {
     gcry_mpi_t n;
     gcry_mpi_t e;
+    gcry_sexp_t sexp;	/* Prepared public key */
 };
 
 static int pgpSetSigMpiRSA(pgpDigAlg pgpsig, int num, const uint8_t *p)
@@ -201,12 +220,14 @@ static int pgpVerifySigRSA(pgpDigAlg pgpkey, pgpDigAlg pgpsig, uint8_t *hash, si
     hash_algo_name = gcry_md_algo_name(hashalgo2gcryalgo(hash_algo));
     gcry_sexp_build(&sexp_sig, NULL, "(sig-val (rsa (s %M)))", sig->s);
     gcry_sexp_build(&sexp_data, NULL, "(data (flags pkcs1) (hash %s %b))", hash_algo_name, (int)hashlen, (const char *)hash);
-    gcry_sexp_build(&sexp_pkey, NULL, "(public-key (rsa (n %M) (e %M)))", key->n, key->e);
+    if (!(sexp_pkey = __atomic_load_n(&key->sexp, __ATOMIC_ACQUIRE))) {
+	gcry_sexp_build(&sexp_pkey, NULL, "(public-key (rsa (n %M) (e %M)))", key->n, key->e);
+	sexp_pkey = keySexpCache(&key->sexp, sexp_pkey);
+    }
     if (sexp_sig && sexp_data && sexp_pkey)
 	rc = gcry_pk_verify(sexp_sig, sexp_data, sexp_pkey) == 0 ? 0 : 1;
     gcry_sexp_release(sexp_sig);
     gcry_sexp_release(sexp_data);
-    gcry_sexp_release(sexp_pkey);
     return rc;
 }
 
@@ -225,6 +246,7 @@ static void pgpFreeKeyRSA(pgpDigAlg pgpkey)
     if (key) {
         gcry_mpi_release(key->n);
         gcry_mpi_release(key->e);
+	gcry_sexp_release(key->sexp);
 	pgpkey->data = _free(key);
     }
 }
@@ -242,6 +264,7 @@ struct pgpDigKeyDSA_s {
     gcry_mpi_t q;
     gcry_mpi_t g;
     gcry_mpi_t y;
+    gcry_sexp_t sexp;	/* Prepared public key */
 };
 
 static int pgpSetSigMpiDSA(pgpDigAlg pgpsig, int num, const uint8_t *p)
@@ -314,12 +337,14 @@ static int pgpVerifySigDSA(pgpDigAlg pgpkey, pgpDigAlg pgpsig, uint8_t *hash, si
 	hashlen = qlen;		/* dsa2: truncate hash to qlen */
     gcry_sexp_build(&sexp_sig, NULL, "(sig-val (dsa (r %M) (s %M)))", sig->r, sig->s);
     gcry_sexp_build(&sexp_data, NULL, "(data (flags raw) (value %b))", (int)hashlen, (const char *)hash);
-    gcry_sexp_build(&sexp_pkey, NULL, "(public-key (dsa (p %M) (q %M) (g %M) (y %M)))", key->p, key->q, key->g, key->y);
+    if (!(sexp_pkey = __atomic_load_n(&key->sexp, __ATOMIC_ACQUIRE))) {
+	gcry_sexp_build(&sexp_pkey, NULL, "(public-key (dsa (p %M) (q %M) (g %M) (y %M)))", key->p, key->q, key->g, key->y);
+	sexp_pkey = keySexpCache(&key->sexp, sexp_pkey);
+    }
     if (sexp_sig && sexp_data && sexp_pkey)
 	rc = gcry_pk_verify(sexp_sig, sexp_data, sexp_pkey) == 0 ? 0 : 1;
     gcry_sexp_release(sexp_sig);
     gcry_sexp_release(sexp_data);
-    gcry_sexp_release(sexp_pkey);
     return rc;
 }
 
@@ -341,6 +366,7 @@ static void pgpFreeKeyDSA(pgpDigAlg pgpkey)
         gcry_mpi_release(key->q);
         gcry_mpi_release(key->g);
         gcry_mpi_release(key->y);
+	gcry_sexp_release(key->sexp);
 	pgpkey->data = _free(key);
     }
 }
@@ -355,6 +381,7 @@ struct pgpDigSigEDDSA_s {
 
 struct pgpDigKeyEDDSA_s {
     gcry_mpi_t q;
+    gcry_sexp_t sexp;	/* Prepared public key */
 };
 
 static int pgpSetSigMpiEDDSA(pgpDigAlg pgpsig, int num, const uint8_t *p)
@@ -426,12 +453,14 @@ static int pgpVerifySigEDDSA(pgpDigAlg pgpkey, pgpDigAlg pgpsig, uint8_t *hash,
 	return rc;
     gcry_sexp_build(&sexp_sig, NULL, "(sig-val (eddsa (r %b) (s %b)))", 32, (const char *)buf_r, 32, (const char *)buf_s, 32);
     gcry_sexp_build(&sexp_data, NULL, "(data (flags eddsa) (hash-algo sha512) (value %b))", (int)hashlen, (const char *)hash);
-    gcry_sexp_build(&sexp_pkey, NULL, "(public-key (ecc (curve \"Ed25519\") (flags eddsa) (q %M)))", key->q);
+    if (!(sexp_pkey = __atomic_load_n(&key->sexp, __ATOMIC_ACQUIRE))) {
+	gcry_sexp_build(&sexp_pkey, NULL, "(public-key (ecc (curve \"Ed25519\") (flags eddsa) (q %M)))", key->q);
+	sexp_pkey = keySexpCache(&key->sexp, sexp_pkey);
+    }
     if (sexp_sig && sexp_data && sexp_pkey)
 	rc = gcry_pk_verify(sexp_sig, sexp_data, sexp_pkey) == 0 ? 0 : 1;
     gcry_sexp_release(sexp_sig);
     gcry_sexp_release(sexp_data);
-    gcry_sexp_release(sexp_pkey);
     return rc;
 }
 
@@ -450,6 +479,7 @@ static void pgpFreeKeyEDDSA(pgpDigAlg pgpkey)
     struct pgpDigKeyEDDSA_s *key = pgpkey->data;
     if (key) {
 	gcry_mpi_release(key->q);
+	gcry_sexp_release(key->sexp);
 	pgpkey->data = _free(key);
     }
 }
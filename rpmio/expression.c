@@ -185,6 +185,7 @@ typedef struct _parseState {
     int nextToken;	/*!< current lookahead token */
     Value tokenValue;	/*!< valid when TOK_INTEGER or TOK_STRING */
     int flags;		/*!< parser flags */
+    int called;		/*!< function calls seen? */
 } *ParseState;
 
 static void exprErr(const struct _parseState *state, const char *msg,
@@ -490,6 +491,7 @@ static int rdToken(ParseState state)
 	v = valueMakeString(rstrndup(p, pe - p));
 	p = pe;
 	token = TOK_FUNCTION;
+	state->called = 1;
 	break;
       } 
       exprErr(state, _("bare words are no longer supported, please use \"...\""), p+1);
@@ -992,19 +994,18 @@ err:
   return NULL;
 }
 
-int rpmExprBoolFlags(const char *expr, int flags)
+/* Parse and evaluate an expression, NULL on error */
+static Value exprEval(const char *expr, int flags, int *pure)
 {
   struct _parseState state;
-  int result = -1;
   Value v = NULL;
 
-  DEBUG(printf("parseExprBoolean(?, '%s')\n", expr));
-
   /* Initialize the expression parser state. */
   state.p = state.str = xstrdup(expr);
   state.nextToken = 0;
   state.tokenValue = NULL;
   state.flags = flags;
+  state.called = 0;
   if (rdToken(&state))
     goto exit;
 
@@ -1016,47 +1017,23 @@ int rpmExprBoolFlags(const char *expr, int flags)
   /* If the next token is not TOK_EOF, we have a syntax error. */
   if (state.nextToken != TOK_EOF) {
     exprErr(&state, _("syntax error in expression"), state.p);
+    valueFree(v);
+    v = NULL;
     goto exit;
   }
 
-  DEBUG(valueDump("parseExprBoolean:", v, stdout));
-
-  result = boolifyValue(v);
+  DEBUG(valueDump("exprEval:", v, stdout));
 
 exit:
+  /* Without macros to expand or functions to call, only the string counts */
+  *pure = !(flags & RPMEXPR_EXPAND) && !state.called;
   state.str = _free(state.str);
-  valueFree(v);
-  return result;
+  return v;
 }
 
-char *rpmExprStrFlags(const char *expr, int flags)
+static char *valueStr(Value v)
 {
-  struct _parseState state;
   char *result = NULL;
-  Value v = NULL;
-
-  DEBUG(printf("parseExprString(?, '%s')\n", expr));
-
-  /* Initialize the expression parser state. */
-  state.p = state.str = xstrdup(expr);
-  state.nextToken = 0;
-  state.tokenValue = NULL;
-  state.flags = flags;
-  if (rdToken(&state))
-    goto exit;
-
-  /* Parse the expression. */
-  v = doTernary(&state);
-  if (!v)
-    goto exit;
-
-  /* If the next token is not TOK_EOF, we have a syntax error. */
-  if (state.nextToken != TOK_EOF) {
-    exprErr(&state, _("syntax error in expression"), state.p);
-    goto exit;
-  }
-
-  DEBUG(valueDump("parseExprString:", v, stdout));
 
   switch (v->type) {
   case VALUE_TYPE_INTEGER: {
@@ -1071,9 +1048,82 @@ char *rpmExprStrFlags(const char *expr, int flags)
   default:
     break;
   }
+  return result;
+}
+
+/*
+ * Spec conditionals are expanded before they're evaluated, and the same
+ * few tend to come up over and over again (per subpackage, in loops).
+ * Remember the results of the ones that depend on nothing but their
+ * string. Errors are not cached, they get reported every time.
+ */
+#define EXPR_CACHE_SIZE	256
+
+struct exprCache_s {
+    char *expr;
+    int b;		/*!< boolean result */
+    char *s;		/*!< string result */
+};
+
+static __thread struct exprCache_s exprCache[EXPR_CACHE_SIZE];
+
+static struct exprCache_s *exprCacheGet(const char *expr)
+{
+    struct exprCache_s *ec = &exprCache[rstrhash(expr) % EXPR_CACHE_SIZE];
+    return (ec->expr && rstreq(ec->expr, expr)) ? ec : NULL;
+}
+
+static void exprCachePut(const char *expr, Value v)
+{
+    struct exprCache_s *ec = &exprCache[rstrhash(expr) % EXPR_CACHE_SIZE];
+
+    free(ec->expr);
+    free(ec->s);
+    ec->expr = xstrdup(expr);
+    ec->b = boolifyValue(v);
+    ec->s = valueStr(v);
+}
+
+int rpmExprBoolFlags(const char *expr, int flags)
+{
+  struct exprCache_s *ec = NULL;
+  int result = -1;
+  int pure = 0;
+  Value v = NULL;
+
+  DEBUG(printf("parseExprBoolean(?, '%s')\n", expr));
+
+  if (flags == 0 && (ec = exprCacheGet(expr)) != NULL)
+    return ec->b;
+
+  if ((v = exprEval(expr, flags, &pure)) != NULL) {
+    result = boolifyValue(v);
+    if (pure)
+      exprCachePut(expr, v);
+  }
+
+  valueFree(v);
+  return result;
+}
+
+char *rpmExprStrFlags(const char *expr, int flags)
+{
+  struct exprCache_s *ec = NULL;
+  char *result = NULL;
+  int pure = 0;
+  Value v = NULL;
+
+  DEBUG(printf("parseExprString(?, '%s')\n", expr));
+
+  if (flags == 0 && (ec = exprCacheGet(expr)) != NULL)
+    return xstrdup(ec->s);
+
+  if ((v = exprEval(expr, flags, &pure)) != NULL) {
+    result = valueStr(v);
+    if (pure)
+      exprCachePut(expr, v);
+  }
 
-exit:
-  state.str = _free(state.str);
   valueFree(v);
   return result;
 }
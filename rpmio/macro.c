@@ -6,6 +6,8 @@
 #include <stdarg.h>
 #include <pthread.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #ifdef HAVE_SCHED_GETAFFINITY
 #include <sched.h>
 #endif
@@ -36,6 +38,7 @@ enum macroFlags_e {
     ME_LITERAL	= (1 << 2),
     ME_PARSE	= (1 << 3),
     ME_FUNC	= (1 << 4),
+    ME_UNDEF	= (1 << 5),
 };
 
 typedef struct MacroBuf_s *MacroBuf;
@@ -54,12 +57,23 @@ struct rpmMacroEntry_s {
     char arena[];   	/*!< String arena. */
 };
 
+/*! A slot of the macro name hash. */
+struct macroSlot_s {
+    unsigned int hv;	/*!< Hash value of the name. */
+    int i;		/*!< Table index + 1, 0 for empty slots. */
+};
+
 /*! The structure used to store the set of macros in a context. */
 struct rpmMacroContext_s {
-    rpmMacroEntry *tab;  /*!< Macro entry table (array of pointers). */
+    rpmMacroEntry *tab;  /*!< Macro entry table (array of pointers, unordered). */
     int n;      /*!< No. of macros. */
+    unsigned int generation; /*!< Bumped on every change. */
+    struct macroSlot_s *hash; /*!< Name hash of table entries (linear probing). */
+    int nhash;		 /*!< Hash size (power of 2). */
     int depth;		 /*!< Depth tracking when recursing from Lua  */
     int level;		 /*!< Scope level tracking when recursing from Lua  */
+    rpmMacroContext parent; /*!< Frozen context to fall back to (or NULL) */
+    int nchildren;	 /*!< No. of contexts layered on this one */
     pthread_mutex_t lock;
     pthread_mutexattr_t lockattr;
 };
@@ -82,18 +96,37 @@ rpmMacroContext rpmCLIMacroContext = &rpmCLIMacroContext_s;
  */
 static pthread_once_t locksInitialized = PTHREAD_ONCE_INIT;
 
+static void initLock(rpmMacroContext mc)
+{
+    pthread_mutexattr_init(&mc->lockattr);
+    pthread_mutexattr_settype(&mc->lockattr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&mc->lock, &mc->lockattr);
+}
+
 static void initLocks(void)
 {
     rpmMacroContext mcs[] = { rpmGlobalMacroContext, rpmCLIMacroContext, NULL };
 
-    for (rpmMacroContext *mcp = mcs; *mcp; mcp++) {
-	rpmMacroContext mc = *mcp;
-	pthread_mutexattr_init(&mc->lockattr);
-	pthread_mutexattr_settype(&mc->lockattr, PTHREAD_MUTEX_RECURSIVE);
-	pthread_mutex_init(&mc->lock, &mc->lockattr);
-    }
+    for (rpmMacroContext *mcp = mcs; *mcp; mcp++)
+	initLock(*mcp);
 }
 
+/*
+ * Child contexts let threads expand macros without serializing on the
+ * global context: a child has its own table and lock, and looks up names
+ * it doesn't define in its parent, lock-free. That's only safe as long
+ * as the parent doesn't change, so a context with children is frozen.
+ * Changing it is refused, and expansions in it (which push and pop
+ * argument macros) run in a scratch child instead. Undefining a name
+ * of the parent in a child copies the rest of its stack to the child,
+ * on top of an ME_UNDEF entry which hides the parent's definitions.
+ * Lua has a single global state, it runs under the global context lock.
+ *
+ * A thread can make a child its current context, NULL and
+ * rpmGlobalMacroContext passed to the API then resolve to it.
+ */
+static __thread rpmMacroContext threadMacroContext = NULL;
+
 /**
  * Macro expansion state.
  */
@@ -140,8 +173,8 @@ static int loadMacroFile(rpmMacroContext mc, const char * fn);
 
 static rpmMacroContext rpmmctxAcquire(rpmMacroContext mc)
 {
-    if (mc == NULL)
-	mc = rpmGlobalMacroContext;
+    if (mc == NULL || mc == rpmGlobalMacroContext)
+	mc = threadMacroContext ? threadMacroContext : rpmGlobalMacroContext;
     pthread_once(&locksInitialized, initLocks);
     pthread_mutex_lock(&mc->lock);
     return mc;
@@ -153,67 +186,221 @@ static rpmMacroContext rpmmctxRelease(rpmMacroContext mc)
     return NULL;
 }
 
+static inline unsigned int macroNameHash(const char *name, size_t namelen)
+{
+    /* Jenkins One-at-a-time hash */
+    unsigned int hash = 0xe4721b68;
+    for (size_t i = 0; i < namelen; i++) {
+	hash += (unsigned char)name[i];
+	hash += (hash << 10);
+	hash ^= (hash >> 6);
+    }
+    hash += (hash << 3);
+    hash ^= (hash >> 11);
+    hash += (hash << 15);
+    return hash;
+}
+
+/**
+ * Find the hash slot of a table entry.
+ * @param mc		macro context
+ * @param hv		hash value of the entry name
+ * @param pos		table position of the entry
+ * @return		hash slot index
+ */
+static unsigned int
+findSlot(rpmMacroContext mc, unsigned int hv, size_t pos)
+{
+    unsigned int mask = mc->nhash - 1;
+    unsigned int h = hv & mask;
+    while (mc->hash[h].i != pos + 1)
+	h = (h + 1) & mask;
+    return h;
+}
+
+static void
+insertSlot(rpmMacroContext mc, unsigned int hv, size_t pos)
+{
+    unsigned int mask = mc->nhash - 1;
+    unsigned int h = hv & mask;
+    while (mc->hash[h].i)
+	h = (h + 1) & mask;
+    mc->hash[h].hv = hv;
+    mc->hash[h].i = pos + 1;
+}
+
 /**
  * Find entry in macro table.
  * @param mc		macro context
  * @param name		macro name
  * @param namelen	no. of bytes
- * @param pos		found/insert position
+ * @param pos		found position
  * @return		address of slot in macro table with name (or NULL)
  */
 static rpmMacroEntry *
 findEntry(rpmMacroContext mc, const char *name, size_t namelen, size_t *pos)
 {
-    /* bsearch */
-    int cmp = 1;
-    size_t l = 0;
-    size_t u = mc->n;
-    size_t i = 0;
-    while (l < u) {
-	i = (l + u) / 2;
-	rpmMacroEntry me = mc->tab[i];
-	if (namelen == 0)
-	    cmp = strcmp(me->name, name);
-	else {
-	    cmp = strncmp(me->name, name, namelen);
-	    /* longer me->name compares greater */
-	    if (cmp == 0)
-		cmp = (me->name[namelen] != '\0');
+    unsigned int hv, h, mask;
+
+    if (mc->n == 0)
+	return NULL;
+    if (namelen == 0)
+	namelen = strlen(name);
+    hv = macroNameHash(name, namelen);
+    mask = mc->nhash - 1;
+    for (h = hv & mask; mc->hash[h].i; h = (h + 1) & mask) {
+	rpmMacroEntry *mep = &mc->tab[mc->hash[h].i - 1];
+	if (mc->hash[h].hv == hv && strncmp((*mep)->name, name, namelen) == 0 &&
+		(*mep)->name[namelen] == '\0') {
+	    if (pos)
+		*pos = mc->hash[h].i - 1;
+	    return mep;
 	}
-	if (cmp < 0)
-	    l = i + 1;
-	else if (cmp > 0)
-	    u = i;
-	else
-	    break;
     }
+    return NULL;
+}
 
-    if (pos)
-	*pos = (cmp < 0) ? i + 1 : i;
-    if (cmp == 0)
-	return &mc->tab[i];
+/**
+ * Look up a macro definition in a context and the ones it is layered on.
+ * @param mc		macro context
+ * @param name		macro name
+ * @param namelen	no. of bytes
+ * @param local		set if the definition is in mc itself (or NULL)
+ * @return		macro definition (or NULL)
+ */
+static rpmMacroEntry
+lookupEntry(rpmMacroContext mc, const char *name, size_t namelen, int *local)
+{
+    for (rpmMacroContext c = mc; c; c = c->parent) {
+	rpmMacroEntry *mep = findEntry(c, name, namelen, NULL);
+	if (mep) {
+	    if (local)
+		*local = (c == mc);
+	    return ((*mep)->flags & ME_UNDEF) ? NULL : *mep;
+	}
+    }
     return NULL;
 }
 
+static int isFrozen(rpmMacroContext mc)
+{
+    return __atomic_load_n(&mc->nchildren, __ATOMIC_ACQUIRE) > 0;
+}
+
+/* Refuse to change a context others are layered on */
+static int checkFrozen(rpmMacroContext mc)
+{
+    if (isFrozen(mc)) {
+	rpmlog(RPMLOG_ERR,
+	    _("macro context has child contexts, it cannot be changed\n"));
+	return 1;
+    }
+    return 0;
+}
+
+static void initChild(rpmMacroContext mc, rpmMacroContext parent)
+{
+    memset(mc, 0, sizeof(*mc));
+    mc->parent = parent;
+    initLock(mc);
+}
+
+/* Free all definitions of a context at once */
+static void clearEntries(rpmMacroContext mc)
+{
+    for (int i = 0; i < mc->n; i++) {
+	rpmMacroEntry me = mc->tab[i];
+	while (me) {
+	    rpmMacroEntry prev = me->prev;
+	    free(me);
+	    me = prev;
+	}
+    }
+    mc->tab = _free(mc->tab);
+    mc->hash = _free(mc->hash);
+    mc->n = 0;
+    mc->nhash = 0;
+    mc->generation++;
+}
+
+static void freeChild(rpmMacroContext mc)
+{
+    clearEntries(mc);
+    pthread_mutex_destroy(&mc->lock);
+    pthread_mutexattr_destroy(&mc->lockattr);
+}
+
 /**
- * Create a new entry in the macro table.
+ * Create a new entry at the end of the macro table.
  * @param mc		macro context
- * @param pos		insert position
+ * @param name		macro name
  * @return		address of slot in macro table
  */
 static rpmMacroEntry *
-newEntry(rpmMacroContext mc, size_t pos)
+newEntry(rpmMacroContext mc, const char *name)
 {
     /* extend macro table */
     const int delta = 256;
     if (mc->n % delta == 0)
 	mc->tab = xrealloc(mc->tab, sizeof(rpmMacroEntry) * (mc->n + delta));
-    /* shift pos+ entries to the right */
-    memmove(mc->tab + pos + 1, mc->tab + pos, sizeof(rpmMacroEntry) * (mc->n - pos));
-    mc->n++;
+    /* keep the hash at most half full */
+    if ((mc->n + 1) * 2 > mc->nhash) {
+	struct macroSlot_s *ohash = mc->hash;
+	int onhash = mc->nhash;
+	mc->nhash = onhash ? onhash * 2 : 1024;
+	mc->hash = xcalloc(mc->nhash, sizeof(*mc->hash));
+	for (int i = 0; i < onhash; i++) {
+	    if (ohash[i].i)
+		insertSlot(mc, ohash[i].hv, ohash[i].i - 1);
+	}
+	free(ohash);
+    }
+    insertSlot(mc, macroNameHash(name, strlen(name)), mc->n);
     /* make slot */
-    mc->tab[pos] = NULL;
-    return &mc->tab[pos];
+    mc->tab[mc->n] = NULL;
+    return &mc->tab[mc->n++];
+}
+
+/**
+ * Remove an entry from the macro table, the last entry takes its place.
+ * @param mc		macro context
+ * @param name		macro name
+ * @param pos		table position
+ */
+static void
+delEntry(rpmMacroContext mc, const char *name, size_t pos)
+{
+    unsigned int mask = mc->nhash - 1;
+    unsigned int h = findSlot(mc, macroNameHash(name, strlen(name)), pos);
+    unsigned int j = h;
+
+    /* backward shift deletion keeps the probe sequences intact */
+    mc->hash[h].i = 0;
+    for (j = (j + 1) & mask; mc->hash[j].i; j = (j + 1) & mask) {
+	unsigned int k = mc->hash[j].hv & mask;
+	if (h <= j ? (h < k && k <= j) : (h < k || k <= j))
+	    continue;
+	mc->hash[h] = mc->hash[j];
+	mc->hash[j].i = 0;
+	h = j;
+    }
+    mc->n--;
+    if (pos != mc->n) {
+	rpmMacroEntry last = mc->tab[mc->n];
+	h = findSlot(mc, macroNameHash(last->name, strlen(last->name)), mc->n);
+	mc->hash[h].i = pos + 1;
+	mc->tab[pos] = last;
+    }
+    if (mc->n == 0) {
+	mc->tab = _free(mc->tab);
+	mc->hash = _free(mc->hash);
+	mc->nhash = 0;
+    }
+}
+
+static int compareEntries(const void *a, const void *b)
+{
+    return strcmp((*(const rpmMacroEntry *)a)->name, (*(const rpmMacroEntry *)b)->name);
 }
 
 /* =============================================================== */
@@ -503,29 +690,40 @@ static void mbFini(MacroBuf mb, rpmMacroEntry me, MacroExpansionData *med)
     mb->expand_trace = med->expand_trace;
 }
 
-static void mbAppend(MacroBuf mb, char c)
+/* make room for len more bytes, doubling the buffer to keep appends cheap */
+static inline void mbGrow(MacroBuf mb, size_t len)
 {
-    if (mb->nb < 1) {
-	mb->buf = xrealloc(mb->buf, mb->tpos + MACROBUFSIZ + 1);
-	mb->nb += MACROBUFSIZ;
+    if (len > mb->nb) {
+	size_t size = 2 * (mb->tpos + mb->nb);
+	if (size < mb->tpos + len + MACROBUFSIZ)
+	    size = mb->tpos + len + MACROBUFSIZ;
+	mb->buf = xrealloc(mb->buf, size + 1);
+	mb->nb = size - mb->tpos;
     }
+}
+
+static void mbAppend(MacroBuf mb, char c)
+{
+    mbGrow(mb, 1);
     mb->buf[mb->tpos++] = c;
     mb->buf[mb->tpos] = '\0';
     mb->nb--;
 }
 
-static void mbAppendStr(MacroBuf mb, const char *str)
+static void mbAppendLen(MacroBuf mb, const char *str, size_t len)
 {
-    size_t len = strlen(str);
-    if (len > mb->nb) {
-	mb->buf = xrealloc(mb->buf, mb->tpos + mb->nb + MACROBUFSIZ + len + 1);
-	mb->nb += MACROBUFSIZ + len;
-    }
-    memcpy(mb->buf+mb->tpos, str, len + 1);
+    mbGrow(mb, len);
+    memcpy(mb->buf+mb->tpos, str, len);
     mb->tpos += len;
+    mb->buf[mb->tpos] = '\0';
     mb->nb -= len;
 }
 
+static void mbAppendStr(MacroBuf mb, const char *str)
+{
+    mbAppendLen(mb, str, strlen(str));
+}
+
 static void doDnl(MacroBuf mb, rpmMacroEntry me, ARGV_t argv, size_t *parsed)
 {
     const char *se = argv[1];
@@ -549,7 +747,6 @@ doShellEscape(MacroBuf mb, const char * cmd, size_t clen)
 {
     char *buf = NULL;
     FILE *shf;
-    int c;
 
     if (expandThis(mb, cmd, clen, &buf))
 	goto exit;
@@ -561,8 +758,10 @@ doShellEscape(MacroBuf mb, const char * cmd, size_t clen)
     }
 
     size_t tpos = mb->tpos;
-    while ((c = fgetc(shf)) != EOF) {
-	mbAppend(mb, c);
+    size_t nr;
+    char rbuf[BUFSIZ];
+    while ((nr = fread(rbuf, 1, sizeof(rbuf), shf)) > 0) {
+	mbAppendLen(mb, rbuf, nr);
     }
     (void) pclose(shf);
 
@@ -617,7 +816,7 @@ static unsigned int getncpus(void)
 static int
 validName(MacroBuf mb, const char *name, size_t namelen, const char *action)
 {
-    rpmMacroEntry *mep;
+    rpmMacroEntry me;
     int rc = 0;
     int c;
 
@@ -627,8 +826,8 @@ validName(MacroBuf mb, const char *name, size_t namelen, const char *action)
 	goto exit;
     }
 
-    mep = findEntry(mb->mc, name, namelen, NULL);
-    if (mep && (*mep)->flags & (ME_FUNC|ME_AUTO)) {
+    me = lookupEntry(mb->mc, name, namelen, NULL);
+    if (me && me->flags & (ME_FUNC|ME_AUTO)) {
 	mbErr(mb, 1, _("Macro %%%s is a built-in (%s)\n"), name, action);
 	goto exit;
     }
@@ -937,7 +1136,7 @@ freeArgs(MacroBuf mb)
 	    me->flags |= ME_USED;
 	}
 
-	/* compensate if the slot is to go away */
+	/* compensate if the slot is to go away (the last entry moves here) */
 	if (me->prev == NULL)
 	    i--;
 	popMacro(mc, me->name);
@@ -1041,9 +1240,9 @@ grabArgs(MacroBuf mb, const rpmMacroEntry me, ARGV_t *argvp,
 static void doBody(MacroBuf mb, rpmMacroEntry me, ARGV_t argv, size_t *parsed)
 {
     if (*argv[1]) {
-	rpmMacroEntry *mep = findEntry(mb->mc, argv[1], 0, NULL);
-	if (mep) {
-	    mbAppendStr(mb, (*mep)->body);
+	rpmMacroEntry body = lookupEntry(mb->mc, argv[1], 0, NULL);
+	if (body) {
+	    mbAppendStr(mb, body->body);
 	} else {
 	    mbErr(mb, 1, _("no such macro: '%s'\n"), argv[1]);
 	}
@@ -1082,6 +1281,8 @@ static void doLua(MacroBuf mb,  rpmMacroEntry me, ARGV_t argv, size_t *parsed)
 	    args = mb->args;
     }
 
+    if (mc->parent)
+	pthread_mutex_lock(&rpmGlobalMacroContext->lock);
     rpmluaPushPrintBuffer(lua);
     mc->depth = mb->depth;
     mc->level = mb->level;
@@ -1090,6 +1291,8 @@ static void doLua(MacroBuf mb,  rpmMacroEntry me, ARGV_t argv, size_t *parsed)
     mc->depth = odepth;
     mc->level = olevel;
     printbuf = rpmluaPopPrintBuffer(lua);
+    if (mc->parent)
+	pthread_mutex_unlock(&rpmGlobalMacroContext->lock);
     if (printbuf) {
 	mbAppendStr(mb, printbuf);
 	free(printbuf);
@@ -1108,10 +1311,14 @@ static void doString(MacroBuf mb, rpmMacroEntry me, ARGV_t argv, size_t *parsed)
     char *s = rstrscat(NULL,
 		"return (string.", argv[0], "(table.unpack(arg)))", NULL);
 
+    if (mb->mc->parent)
+	pthread_mutex_lock(&rpmGlobalMacroContext->lock);
     rpmluaPushPrintBuffer(lua);
     if (rpmluaRunScript(lua, s, argv[0], NULL, argv+1) == -1)
 	mb->error = 1;
     printbuf = rpmluaPopPrintBuffer(lua);
+    if (mb->mc->parent)
+	pthread_mutex_unlock(&rpmGlobalMacroContext->lock);
 
     if (printbuf) {
 	mbAppendStr(mb, printbuf);
@@ -1386,8 +1593,8 @@ exit:
 static int
 expandMacro(MacroBuf mb, const char *src, size_t slen)
 {
-    rpmMacroEntry *mep;
     rpmMacroEntry me = NULL;
+    int local = 0;
     const char *s = src, *se;
     const char *f, *fe;
     const char *g, *ge;
@@ -1423,10 +1630,15 @@ expandMacro(MacroBuf mb, const char *src, size_t slen)
 		    break;
 		s++;	/* skip first % in %% */
 	    }
-	default:
 	    mbAppend(mb, c);
 	    continue;
-	    break;
+	default:
+	    /* the whole literal run at once */
+	    if ((se = strchr(s, '%')) == NULL)
+		se = s + strlen(s);
+	    mbAppendLen(mb, s - 1, se - s + 1);
+	    s = se;
+	    continue;
 	}
 
 	/* Expand next macro */
@@ -1500,14 +1712,13 @@ expandMacro(MacroBuf mb, const char *src, size_t slen)
 	    printMacro(mb, s, se);
 
 	/* Expand defined macros */
-	mep = findEntry(mb->mc, f, fn, NULL);
-	me = (mep ? *mep : NULL);
+	me = lookupEntry(mb->mc, f, fn, &local);
 
 	if (me) {
 	    if ((me->flags & ME_AUTO) && mb->level > me->level) {
 		/* Ignore out-of-scope automatic macros */
 		me = NULL;
-	    } else {
+	    } else if (local) {
 		/* If we looked up a macro, consider it used */
 		me->flags |= ME_USED;
 	    }
@@ -1624,12 +1835,27 @@ exit:
 
 /* =============================================================== */
 
+/* Use a scratch child for the expansion if the context is frozen */
+static rpmMacroContext expansionContext(rpmMacroContext mc,
+					rpmMacroContext scratch)
+{
+    if (!isFrozen(mc))
+	return mc;
+    initChild(scratch, mc);
+    scratch->depth = mc->depth;
+    scratch->level = mc->level;
+    return scratch;
+}
+
 static int doExpandMacros(rpmMacroContext mc, const char *src, int flags,
 			char **target)
 {
-    MacroBuf mb = mbCreate(mc, flags);
+    struct rpmMacroContext_s scratch;
+    MacroBuf mb;
     int rc = 0;
 
+    mc = expansionContext(mc, &scratch);
+    mb = mbCreate(mc, flags);
     rc = expandMacro(mb, src, 0);
 
     mb->buf[mb->tpos] = '\0';	/* XXX just in case */
@@ -1637,6 +1863,8 @@ static int doExpandMacros(rpmMacroContext mc, const char *src, int flags,
     *target = xrealloc(mb->buf, mb->tpos + 1);
 
     _free(mb);
+    if (mc == &scratch)
+	freeChild(&scratch);
     return rc;
 }
 
@@ -1653,8 +1881,7 @@ static void pushMacroAny(rpmMacroContext mc,
     size_t blen = b ? strlen(b) : 0;
     size_t mesize = sizeof(*me) + blen + 1 + (olen ? olen + 1 : 0);
 
-    size_t pos;
-    rpmMacroEntry *mep = findEntry(mc, n, 0, &pos);
+    rpmMacroEntry *mep = findEntry(mc, n, 0, NULL);
     if (mep) {
 	/* entry with shared name */
 	me = xmalloc(mesize);
@@ -1664,7 +1891,7 @@ static void pushMacroAny(rpmMacroContext mc,
     }
     else {
 	/* entry with new name */
-	mep = newEntry(mc, pos);
+	mep = newEntry(mc, n);
 	size_t nlen = strlen(n);
 	me = xmalloc(mesize + nlen + 1);
 	p = me->arena;
@@ -1694,6 +1921,7 @@ static void pushMacroAny(rpmMacroContext mc,
     /* push over previous definition */
     me->prev = *mep;
     *mep = me;
+    mc->generation++;
 }
 
 static void pushMacro(rpmMacroContext mc,
@@ -1702,26 +1930,54 @@ static void pushMacro(rpmMacroContext mc,
     return pushMacroAny(mc, n, o, b, NULL, 0, level, flags);
 }
 
+/*
+ * Undefine a macro of the parent in a child: copy the rest of the stack
+ * (bottom first) over an entry hiding the parent's definitions.
+ */
+static void popParentMacro(rpmMacroContext mc, const char * n)
+{
+    rpmMacroEntry me = lookupEntry(mc->parent, n, 0, NULL);
+    rpmMacroEntry *stack = NULL;
+    int nstack = 0;
+
+    if (me == NULL)
+	return;
+
+    for (rpmMacroEntry prev = me->prev; prev; prev = prev->prev) {
+	stack = xrealloc(stack, (nstack + 1) * sizeof(*stack));
+	stack[nstack++] = prev;
+    }
+
+    pushMacroAny(mc, n, NULL, NULL, NULL, 0, RMIL_BUILTIN, ME_UNDEF);
+    for (int i = nstack - 1; i >= 0; i--) {
+	rpmMacroEntry e = stack[i];
+	pushMacroAny(mc, n, e->opts, e->body, e->func, e->nargs,
+			e->level, e->flags);
+    }
+    free(stack);
+}
+
 static void popMacro(rpmMacroContext mc, const char * n)
 {
     size_t pos;
     rpmMacroEntry *mep = findEntry(mc, n, 0, &pos);
-    if (mep == NULL)
+    if (mep == NULL) {
+	if (mc->parent)
+	    popParentMacro(mc, n);
 	return;
+    }
     /* parting entry */
     rpmMacroEntry me = *mep;
     assert(me);
+    /* nothing to pop below the hiding entry */
+    if (me->flags & ME_UNDEF)
+	return;
     /* detach/pop definition */
     mc->tab[pos] = me->prev;
+    mc->generation++;
     /* shrink macro table */
-    if (me->prev == NULL) {
-	mc->n--;
-	/* move pos+ elements to the left */
-	memmove(mc->tab + pos, mc->tab + pos + 1, sizeof(me) * (mc->n - pos));
-	/* deallocate */
-	if (mc->n == 0)
-	    mc->tab = _free(mc->tab);
-    }
+    if (me->prev == NULL)
+	delEntry(mc, me->name, pos);
     /* comes in a single chunk */
     free(me);
 }
@@ -1815,18 +2071,22 @@ int rpmExpandMacros(rpmMacroContext mc, const char * sbuf, char ** obuf, int fla
 
 int rpmExpandThisMacro(rpmMacroContext mc, const char *n,  ARGV_const_t args, char ** obuf, int flags)
 {
-    rpmMacroEntry *mep;
+    rpmMacroEntry me;
     char *target = NULL;
     int rc = 1; /* assume failure */
 
     mc = rpmmctxAcquire(mc);
-    mep = findEntry(mc, n, 0, NULL);
-    if (mep) {
-	MacroBuf mb = mbCreate(mc, flags);
-	rc = expandThisMacro(mb, *mep, args, flags);
+    me = lookupEntry(mc, n, 0, NULL);
+    if (me) {
+	struct rpmMacroContext_s scratch;
+	rpmMacroContext emc = expansionContext(mc, &scratch);
+	MacroBuf mb = mbCreate(emc, flags);
+	rc = expandThisMacro(mb, me, args, flags);
 	mb->buf[mb->tpos] = '\0';	/* XXX just in case */
 	target = xrealloc(mb->buf, mb->tpos + 1);
 	_free(mb);
+	if (emc == &scratch)
+	    freeChild(&scratch);
     }
     rpmmctxRelease(mc);
     if (rc) {
@@ -1845,8 +2105,24 @@ rpmDumpMacroTable(rpmMacroContext mc, FILE * fp)
     if (fp == NULL) fp = stderr;
     
     fprintf(fp, "========================\n");
-    for (int i = 0; i < mc->n; i++) {
-	rpmMacroEntry me = mc->tab[i];
+    /* the tables are unordered, dump visible definitions sorted by name */
+    rpmMacroEntry *tab = NULL;
+    int n = 0;
+    for (rpmMacroContext c = mc; c; c = c->parent) {
+	for (int i = 0; i < c->n; i++) {
+	    rpmMacroEntry me = c->tab[i];
+	    if (c != mc && lookupEntry(mc, me->name, 0, NULL) != me)
+		continue;
+	    if (me->flags & ME_UNDEF)
+		continue;
+	    tab = xrealloc(tab, (n + 1) * sizeof(*tab));
+	    tab[n++] = me;
+	}
+    }
+    if (n)
+	qsort(tab, n, sizeof(*tab), compareEntries);
+    for (int i = 0; i < n; i++) {
+	rpmMacroEntry me = tab[i];
 	assert(me);
 	fprintf(fp, "%3d%c %s", me->level,
 		    ((me->flags & ME_USED) ? '=' : ':'), me->name);
@@ -1857,7 +2133,8 @@ rpmDumpMacroTable(rpmMacroContext mc, FILE * fp)
 	fprintf(fp, "\n");
     }
     fprintf(fp, _("======================== active %d empty %d\n"),
-		mc->n, 0);
+		n, 0);
+    free(tab);
     rpmmctxRelease(mc);
 }
 
@@ -1865,10 +2142,14 @@ int rpmPushMacroFlags(rpmMacroContext mc,
 	      const char * n, const char * o, const char * b,
 	      int level, rpmMacroFlags flags)
 {
+    int rc = 0;
     mc = rpmmctxAcquire(mc);
-    pushMacro(mc, n, o, b, level, flags & RPMMACRO_LITERAL ? ME_LITERAL : ME_NONE);
+    if (checkFrozen(mc))
+	rc = -1;
+    else
+	pushMacro(mc, n, o, b, level, flags & RPMMACRO_LITERAL ? ME_LITERAL : ME_NONE);
     rpmmctxRelease(mc);
-    return 0;
+    return rc;
 }
 
 int rpmPushMacro(rpmMacroContext mc,
@@ -1879,18 +2160,23 @@ int rpmPushMacro(rpmMacroContext mc,
 
 int rpmPopMacro(rpmMacroContext mc, const char * n)
 {
+    int rc = 0;
     mc = rpmmctxAcquire(mc);
-    popMacro(mc, n);
+    if (checkFrozen(mc))
+	rc = -1;
+    else
+	popMacro(mc, n);
     rpmmctxRelease(mc);
-    return 0;
+    return rc;
 }
 
 int
 rpmDefineMacro(rpmMacroContext mc, const char * macro, int level)
 {
-    int rc;
+    int rc = -1;
     mc = rpmmctxAcquire(mc);
-    rc = defineMacro(mc, macro, level);
+    if (!checkFrozen(mc))
+	rc = defineMacro(mc, macro, level);
     rpmmctxRelease(mc);
     return rc;
 }
@@ -1899,7 +2185,7 @@ int rpmMacroIsDefined(rpmMacroContext mc, const char *n)
 {
     int defined = 0;
     if ((mc = rpmmctxAcquire(mc)) != NULL) {
-	if (findEntry(mc, n, 0, NULL))
+	if (lookupEntry(mc, n, 0, NULL))
 	    defined = 1;
 	rpmmctxRelease(mc);
     }
@@ -1910,8 +2196,8 @@ int rpmMacroIsParametric(rpmMacroContext mc, const char *n)
 {
     int parametric = 0;
     if ((mc = rpmmctxAcquire(mc)) != NULL) {
-	rpmMacroEntry *mep = findEntry(mc, n, 0, NULL);
-	if (mep && (*mep)->opts)
+	rpmMacroEntry me = lookupEntry(mc, n, 0, NULL);
+	if (me && me->opts)
 	    parametric = 1;
 	rpmmctxRelease(mc);
     }
@@ -1928,7 +2214,8 @@ rpmLoadMacros(rpmMacroContext mc, int level)
     gmc = rpmmctxAcquire(NULL);
     mc = rpmmctxAcquire(mc);
 
-    copyMacros(mc, gmc, level);
+    if (!checkFrozen(gmc))
+	copyMacros(mc, gmc, level);
 
     rpmmctxRelease(mc);
     rpmmctxRelease(gmc);
@@ -1937,21 +2224,221 @@ rpmLoadMacros(rpmMacroContext mc, int level)
 int
 rpmLoadMacroFile(rpmMacroContext mc, const char * fn)
 {
-    int rc;
+    int rc = -1;
 
     mc = rpmmctxAcquire(mc);
-    rc = loadMacroFile(mc, fn);
+    if (!checkFrozen(mc))
+	rc = loadMacroFile(mc, fn);
     rpmmctxRelease(mc);
 
     return rc;
 }
 
+/* =============================================================== */
+/* Snapshot of the macros defined by the macro files */
+
+#define SNAPSHOT_MAGIC	"RPMMSNP1"
+#define SNAPSHOT_HDRSIZE	16	/* magic, size, checksum */
+
+struct snapbuf_s {
+    char *buf;
+    size_t len;
+    size_t alloced;
+};
+
+static void snapAppend(struct snapbuf_s *sb, const void *data, size_t len)
+{
+    if (sb->len + len > sb->alloced) {
+	sb->alloced = (sb->len + len) * 2;
+	sb->buf = xrealloc(sb->buf, sb->alloced);
+    }
+    memcpy(sb->buf + sb->len, data, len);
+    sb->len += len;
+}
+
+static void snapAppendStr(struct snapbuf_s *sb, const char *str)
+{
+    snapAppend(sb, str, strlen(str) + 1);
+}
+
+/* The files, their identities and the rpm version the snapshot is for */
+static char *snapshotKey(ARGV_const_t files)
+{
+    char *key = NULL;
+    rstrscat(&key, VERSION, "\n", NULL);
+    for (ARGV_const_t f = files; f && *f; f++) {
+	struct stat sb;
+	char *line = NULL;
+	if (stat(*f, &sb)) {
+	    rasprintf(&line, "%s -\n", *f);
+	} else {
+	    rasprintf(&line, "%s %llu %llu %llu %lld.%09ld %lld.%09ld\n", *f,
+		(unsigned long long)sb.st_dev, (unsigned long long)sb.st_ino,
+		(unsigned long long)sb.st_size,
+		(long long)sb.st_mtim.tv_sec, sb.st_mtim.tv_nsec,
+		(long long)sb.st_ctim.tv_sec, sb.st_ctim.tv_nsec);
+	}
+	rstrcat(&key, line);
+	free(line);
+    }
+    return key;
+}
+
+/* Owned by root or us and not writable by anybody else */
+static int snapshotTrusted(const struct stat *sb)
+{
+    return ((sb->st_uid == 0 || sb->st_uid == geteuid()) &&
+	    (sb->st_mode & (S_IWGRP|S_IWOTH)) == 0);
+}
+
+/* Others must not be able to replace the snapshot in its directory either */
+static int snapshotDirTrusted(const char *fn)
+{
+    const char *slash = strrchr(fn, '/');
+    char *dir;
+    struct stat sb;
+    int trusted;
+
+    if (slash == NULL)
+	dir = xstrdup(".");
+    else if (slash == fn)
+	dir = xstrdup("/");
+    else
+	dir = rstrndup(fn, slash - fn);
+    trusted = (stat(dir, &sb) == 0 && S_ISDIR(sb.st_mode) &&
+	       snapshotTrusted(&sb));
+    free(dir);
+    return trusted;
+}
+
+/* Load the snapshot if it's valid for key, return 0 on success */
+static int loadMacroSnapshot(rpmMacroContext mc, const char *fn, const char *key)
+{
+    struct stat sb;
+    uint32_t size, sum;
+    const char *p, *pe;
+    char *map;
+    int rc = -1;
+    int fd = open(fn, O_RDONLY|O_CLOEXEC|O_NOFOLLOW);
+
+    if (fd < 0)
+	return -1;
+    if (fstat(fd, &sb) || !S_ISREG(sb.st_mode) ||
+	    sb.st_size < SNAPSHOT_HDRSIZE ||
+	    !snapshotTrusted(&sb) || !snapshotDirTrusted(fn)) {
+	close(fd);
+	return -1;
+    }
+    map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+	return -1;
+
+    memcpy(&size, map + 8, sizeof(size));
+    memcpy(&sum, map + 12, sizeof(sum));
+    if (memcmp(map, SNAPSHOT_MAGIC, 8) || size != sb.st_size ||
+	    map[size - 1] != '\0' ||
+	    sum != macroNameHash(map + SNAPSHOT_HDRSIZE, size - SNAPSHOT_HDRSIZE))
+	goto exit;
+    p = map + SNAPSHOT_HDRSIZE;
+    pe = map + size;
+    if (!rstreq(p, key))
+	goto exit;
+    p += strlen(p) + 1;
+
+    /* entries of name, flags, opts and body, bottom of the stacks first */
+    while (p < pe) {
+	const char *n = p, *o, *b;
+	int flags;
+	p += strlen(p) + 1;
+	if (pe - p < 3)
+	    goto exit;
+	flags = (unsigned char)*p++;
+	o = (*p++ == 'o') ? p : NULL;
+	if (o)
+	    p += strlen(p) + 1;
+	if (p >= pe)
+	    goto exit;
+	b = p;
+	p += strlen(p) + 1;
+	pushMacro(mc, n, o, b, RMIL_MACROFILES, flags);
+    }
+    rc = 0;
+
+exit:
+    munmap(map, sb.st_size);
+    return rc;
+}
+
+static void saveMacroSnapshot(rpmMacroContext mc, const char *fn, const char *key)
+{
+    struct snapbuf_s sb = { NULL, 0, 0 };
+    char hdr[SNAPSHOT_HDRSIZE];
+    uint32_t size, sum;
+    char *tmp = NULL;
+    int fd;
+
+    if (!snapshotDirTrusted(fn))
+	return;
+
+    snapAppend(&sb, hdr, sizeof(hdr));
+    snapAppendStr(&sb, key);
+    for (int i = 0; i < mc->n; i++) {
+	rpmMacroEntry stack[64];
+	int nstack = 0;
+	/* collect the file level definitions, the stack is newest first */
+	for (rpmMacroEntry me = mc->tab[i]; me; me = me->prev) {
+	    if (me->level != RMIL_MACROFILES)
+		continue;
+	    if (nstack == sizeof(stack) / sizeof(*stack) || (me->flags & ~0xff) || me->func)
+		goto exit;	/* not worth it */
+	    stack[nstack++] = me;
+	}
+	while (nstack--) {
+	    rpmMacroEntry me = stack[nstack];
+	    char flags = me->flags;
+	    snapAppendStr(&sb, me->name);
+	    snapAppend(&sb, &flags, 1);
+	    snapAppend(&sb, me->opts ? "o" : "-", 1);
+	    if (me->opts)
+		snapAppendStr(&sb, me->opts);
+	    snapAppendStr(&sb, me->body);
+	}
+    }
+    size = sb.len;
+    sum = macroNameHash(sb.buf + SNAPSHOT_HDRSIZE, size - SNAPSHOT_HDRSIZE);
+    memcpy(sb.buf, SNAPSHOT_MAGIC, 8);
+    memcpy(sb.buf + 8, &size, sizeof(size));
+    memcpy(sb.buf + 12, &sum, sizeof(sum));
+
+    /* replace atomically, concurrent readers see the old or the new one */
+    rasprintf(&tmp, "%s.XXXXXX", fn);
+    fd = mkstemp(tmp);
+    if (fd < 0)
+	goto exit;
+    if (write(fd, sb.buf, sb.len) != (ssize_t)sb.len || fchmod(fd, 0644) ||
+	    close(fd) || rename(tmp, fn)) {
+	unlink(tmp);
+    }
+
+exit:
+    free(tmp);
+    free(sb.buf);
+}
+
 void
 rpmInitMacros(rpmMacroContext mc, const char * macrofiles)
 {
-    ARGV_t pattern, globs = NULL;
+    ARGV_t pattern, path, globs = NULL, allfiles = NULL;
     rpmMacroContext climc;
+    rpmMacroEntry *mep;
+    char *snapshot = NULL, *key = NULL;
+    int nfailed = 0;
     mc = rpmmctxAcquire(mc);
+    if (checkFrozen(mc)) {
+	rpmmctxRelease(mc);
+	return;
+    }
 
     /* Define built-in macros */
     for (const struct builtins_s *b = builtinmacros; b->name; b++) {
@@ -1968,19 +2455,37 @@ rpmInitMacros(rpmMacroContext mc, const char * macrofiles)
 	    continue;
 	}
 
-	/* Read macros from each file. */
 	for (path = files; *path; path++) {
 	    if (rpmFileHasSuffix(*path, ".rpmnew") || 
 		rpmFileHasSuffix(*path, ".rpmsave") ||
 		rpmFileHasSuffix(*path, ".rpmorig")) {
 		continue;
 	    }
-	    (void) loadMacroFile(mc, *path);
+	    argvAdd(&allfiles, *path);
 	}
 	argvFree(files);
     }
     argvFree(globs);
 
+    /* Reuse a snapshot of the macro files (configured in rpmrc) if valid */
+    if ((mep = findEntry(mc, "_macrosnapshot", 0, NULL)) && *(*mep)->body) {
+	snapshot = xstrdup((*mep)->body);
+	key = snapshotKey(allfiles);
+	if (loadMacroSnapshot(mc, snapshot, key) == 0)
+	    allfiles = argvFree(allfiles);
+    }
+
+    /* Read macros from each file. */
+    for (path = allfiles; path && *path; path++) {
+	if (loadMacroFile(mc, *path))
+	    nfailed++;
+    }
+    if (snapshot && allfiles && !nfailed)
+	saveMacroSnapshot(mc, snapshot, key);
+    argvFree(allfiles);
+    free(snapshot);
+    free(key);
+
     /* Reload cmdline macros */
     climc = rpmmctxAcquire(rpmCLIMacroContext);
     copyMacros(climc, mc, RMIL_CMDLINE);
@@ -1993,14 +2498,44 @@ void
 rpmFreeMacros(rpmMacroContext mc)
 {
     mc = rpmmctxAcquire(mc);
-    while (mc->n > 0) {
-	/* remove from the end to avoid memmove */
-	rpmMacroEntry me = mc->tab[mc->n - 1];
-	popMacro(mc, me->name);
-    }
+    if (!checkFrozen(mc))
+	clearEntries(mc);
     rpmmctxRelease(mc);
 }
 
+rpmMacroContext rpmMacroContextNew(rpmMacroContext parent)
+{
+    rpmMacroContext mc = xmalloc(sizeof(*mc));
+
+    parent = rpmmctxAcquire(parent);
+    initChild(mc, parent);
+    __atomic_add_fetch(&parent->nchildren, 1, __ATOMIC_ACQ_REL);
+    rpmmctxRelease(parent);
+
+    return mc;
+}
+
+rpmMacroContext rpmMacroContextFree(rpmMacroContext mc)
+{
+    /* the static contexts are not layered on anything */
+    if (mc == NULL || mc->parent == NULL)
+	return NULL;
+
+    if (threadMacroContext == mc)
+	threadMacroContext = NULL;
+    __atomic_sub_fetch(&mc->parent->nchildren, 1, __ATOMIC_ACQ_REL);
+    freeChild(mc);
+    free(mc);
+    return NULL;
+}
+
+rpmMacroContext rpmMacroContextSetThread(rpmMacroContext mc)
+{
+    rpmMacroContext prev = threadMacroContext;
+    threadMacroContext = (mc != rpmGlobalMacroContext) ? mc : NULL;
+    return prev;
+}
+
 char * 
 rpmExpand(const char *arg, ...)
 {
@@ -2039,16 +2574,9 @@ exit:
     return ret;
 }
 
-int
-rpmExpandNumeric(const char *arg)
+static int numericValue(const char *val)
 {
-    char *val;
     int rc;
-
-    if (arg == NULL)
-	return 0;
-
-    val = rpmExpand(arg, NULL);
     if (!(val && *val != '%'))
 	rc = 0;
     else if (*val == 'Y' || *val == 'y')
@@ -2061,7 +2589,76 @@ rpmExpandNumeric(const char *arg)
 	if (!(end && *end == '\0'))
 	    rc = 0;
     }
+    return rc;
+}
+
+int
+rpmExpandNumeric(const char *arg)
+{
+    char *val;
+    int rc;
+
+    if (arg == NULL)
+	return 0;
+
+    val = rpmExpand(arg, NULL);
+    rc = numericValue(val);
     free(val);
 
     return rc;
 }
+
+/* Refresh the cache if needed, the context lock must be held */
+static const char *expandCached(rpmMacroContext mc, rpmMacroCache *cache, const char *arg)
+{
+    if (cache->value == NULL || cache->generation != mc->generation) {
+	char *val = NULL;
+	(void) doExpandMacros(mc, arg, 0, &val);
+	free(cache->value);
+	cache->value = val;
+	/* after the expansion, which may push and pop macros itself */
+	cache->generation = mc->generation;
+    }
+    return cache->value;
+}
+
+char *
+rpmExpandCached(rpmMacroCache *cache, const char *arg)
+{
+    rpmMacroContext mc;
+    char *val;
+
+    if (arg == NULL)
+	return xstrdup("");
+
+    mc = rpmmctxAcquire(NULL);
+    /* the caches are shared, children don't get to update them */
+    if (mc->parent)
+	(void) doExpandMacros(mc, arg, 0, &val);
+    else
+	val = xstrdup(expandCached(mc, cache, arg));
+    rpmmctxRelease(mc);
+    return val;
+}
+
+int
+rpmExpandNumericCached(rpmMacroCache *cache, const char *arg)
+{
+    rpmMacroContext mc;
+    int rc;
+
+    if (arg == NULL)
+	return 0;
+
+    mc = rpmmctxAcquire(NULL);
+    if (mc->parent) {
+	char *val = NULL;
+	(void) doExpandMacros(mc, arg, 0, &val);
+	rc = numericValue(val);
+	free(val);
+    } else {
+	rc = numericValue(expandCached(mc, cache, arg));
+    }
+    rpmmctxRelease(mc);
+    return rc;
+}
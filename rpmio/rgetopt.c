@@ -1,4 +1,5 @@
 #include "system.h"
+#include <pthread.h>
 #include <string.h>
 #ifdef HAVE_GETOPT_H
 #include <getopt.h>
@@ -10,6 +11,9 @@ extern int optind;
 #include <rpm/argv.h>
 #include "rpmio/rpmmacro_internal.h"
 
+/* getopt() state is global, macros can be expanded in several threads */
+static pthread_mutex_t getoptLock = PTHREAD_MUTEX_INITIALIZER;
+
 int rgetopt(int argc, char * const argv[], const char *opts,
 		rgetoptcb callback, void *data)
 {
@@ -24,6 +28,7 @@ int rgetopt(int argc, char * const argv[], const char *opts,
      * POSIX states optind must be 1 before any call but glibc uses 0
      * to (re)initialize getopt structures, eww.
      */
+    pthread_mutex_lock(&getoptLock);
 #ifdef __GLIBC__
     optind = 0;
 #else
@@ -40,6 +45,8 @@ int rgetopt(int argc, char * const argv[], const char *opts,
 	    break;
 	}
     }
-    return (rc < 0) ? -optopt : optind;
+    rc = (rc < 0) ? -optopt : optind;
+    pthread_mutex_unlock(&getoptLock);
+    return rc;
 }
 
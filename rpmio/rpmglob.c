@@ -22,17 +22,56 @@
 #include <stdlib.h>
 #include <string.h>
 #include <dirent.h>
+#include <pthread.h>
 #include <pwd.h>
-#include <assert.h>
 #include <sys/stat.h>		/* S_ISDIR */
-#include <fnmatch.h>
-#include <glob.h>
+#include <glob.h>		/* GLOB_NOMATCH */
 
 #include <rpm/rpmfileutil.h>
+#include <rpm/rpmstring.h>
 #include <rpm/rpmurl.h>
 
+#include "rpmio/rpmio_internal.h"
 #include "debug.h"
 
+/*
+ * Patterns are matched one path component at a time against sorted
+ * directory listings, byte by byte as in the C locale, with glob(3)
+ * GLOB_BRACE and GLOB_TILDE semantics. The listings can be cached
+ * between calls, spec %files lists tend to have lots of patterns in
+ * the same few directories. Listings are reference counted so they can
+ * be used from several threads while the cache is flushed.
+ */
+struct globEnt_s {
+    const char *name;
+    unsigned char type;		/* d_type from readdir() */
+};
+
+struct globDir_s {
+    struct globDir_s *next;	/* hash chain */
+    char *path;			/* directory as given, "" for cwd */
+    int nrefs;
+    int nents;			/* -1 if the directory can't be read */
+    struct globEnt_s *ents;	/* sorted by name */
+    char *names;		/* storage for the entry names */
+};
+
+struct globCache_s {
+    int users;			/* rpmGlobCacheEnable() count */
+    unsigned int nbuckets;
+    unsigned int ndirs;
+    struct globDir_s **buckets;
+};
+
+static struct globCache_s globCache;
+static pthread_mutex_t globLock = PTHREAD_MUTEX_INITIALIZER;
+
+struct globState_s {
+    int tilde;			/* do tilde expansion */
+    int dironly;		/* pattern ends in a slash */
+    ARGV_t *argvp;		/* matches go here */
+};
+
 /* Return 1 if pattern contains a magic char, see glob(7) for a list */
 static int ismagic(const char *pattern)
 {
@@ -49,6 +88,584 @@ static int ismagic(const char *pattern)
     return 0;
 }
 
+static int entCmp(const void *a, const void *b)
+{
+    const struct globEnt_s *ea = a, *eb = b;
+    return strcmp(ea->name, eb->name);
+}
+
+static int pathCmp(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static struct globDir_s *dirRead(const char *path)
+{
+    struct globDir_s *gd = xcalloc(1, sizeof(*gd));
+    DIR *dir = opendir(*path ? path : ".");
+    size_t nalloced = 0, nbytes = 0, balloced = 0;
+    struct dirent *dp;
+    char *s;
+
+    gd->path = xstrdup(path);
+    gd->nrefs = 1;
+    gd->nents = -1;
+    if (dir == NULL)
+	return gd;
+
+    gd->nents = 0;
+    while ((dp = readdir(dir)) != NULL) {
+	size_t nlen = strlen(dp->d_name) + 1;
+	if (gd->nents == nalloced) {
+	    nalloced += 64;
+	    gd->ents = xrealloc(gd->ents, nalloced * sizeof(*gd->ents));
+	}
+	while (nbytes + nlen > balloced) {
+	    balloced += 1024;
+	    gd->names = xrealloc(gd->names, balloced);
+	}
+	memcpy(gd->names + nbytes, dp->d_name, nlen);
+	gd->ents[gd->nents].type = dp->d_type;
+	gd->nents++;
+	nbytes += nlen;
+    }
+    closedir(dir);
+
+    /* names can only be pointed to once they don't move anymore */
+    s = gd->names;
+    for (int i = 0; i < gd->nents; i++) {
+	gd->ents[i].name = s;
+	s += strlen(s) + 1;
+    }
+    qsort(gd->ents, gd->nents, sizeof(*gd->ents), entCmp);
+    return gd;
+}
+
+static void dirFree(struct globDir_s *gd)
+{
+    free(gd->path);
+    free(gd->ents);
+    free(gd->names);
+    free(gd);
+}
+
+/* Called with globLock held */
+static struct globDir_s *cacheFind(const char *path)
+{
+    struct globDir_s *gd = NULL;
+    if (globCache.nbuckets) {
+	gd = globCache.buckets[rstrhash(path) % globCache.nbuckets];
+	while (gd && !rstreq(gd->path, path))
+	    gd = gd->next;
+    }
+    return gd;
+}
+
+/* Called with globLock held, the cache takes a reference of its own */
+static void cacheAdd(struct globDir_s *gd)
+{
+    unsigned int h;
+
+    if (globCache.ndirs >= globCache.nbuckets) {
+	unsigned int nbuckets = globCache.nbuckets ? globCache.nbuckets * 2 : 256;
+	struct globDir_s **buckets = xcalloc(nbuckets, sizeof(*buckets));
+	for (unsigned int i = 0; i < globCache.nbuckets; i++) {
+	    struct globDir_s *d, *next;
+	    for (d = globCache.buckets[i]; d; d = next) {
+		next = d->next;
+		h = rstrhash(d->path) % nbuckets;
+		d->next = buckets[h];
+		buckets[h] = d;
+	    }
+	}
+	free(globCache.buckets);
+	globCache.buckets = buckets;
+	globCache.nbuckets = nbuckets;
+    }
+
+    h = rstrhash(gd->path) % globCache.nbuckets;
+    gd->next = globCache.buckets[h];
+    globCache.buckets[h] = gd;
+    globCache.ndirs++;
+    gd->nrefs++;
+}
+
+/* Called with globLock held, returns the listings nobody uses anymore */
+static struct globDir_s *cacheClear(void)
+{
+    struct globDir_s *unused = NULL;
+    for (unsigned int i = 0; i < globCache.nbuckets; i++) {
+	struct globDir_s *d, *next;
+	for (d = globCache.buckets[i]; d; d = next) {
+	    next = d->next;
+	    d->next = NULL;
+	    if (--d->nrefs == 0) {
+		d->next = unused;
+		unused = d;
+	    }
+	}
+    }
+    globCache.buckets = _free(globCache.buckets);
+    globCache.nbuckets = 0;
+    globCache.ndirs = 0;
+    return unused;
+}
+
+static void dirFreeList(struct globDir_s *gd)
+{
+    while (gd) {
+	struct globDir_s *next = gd->next;
+	dirFree(gd);
+	gd = next;
+    }
+}
+
+/* Return a cached listing of path, NULL if the cache isn't enabled */
+static struct globDir_s *dirGet(const char *path)
+{
+    struct globDir_s *gd = NULL, *ngd;
+    int enabled;
+
+    pthread_mutex_lock(&globLock);
+    enabled = (globCache.users > 0);
+    if (enabled && (gd = cacheFind(path)) != NULL)
+	gd->nrefs++;
+    pthread_mutex_unlock(&globLock);
+    if (gd || !enabled)
+	return gd;
+
+    /* Read without holding the lock, somebody else might beat us to it */
+    ngd = dirRead(path);
+    pthread_mutex_lock(&globLock);
+    if (globCache.users) {
+	if ((gd = cacheFind(path)) != NULL) {
+	    gd->nrefs++;
+	} else {
+	    cacheAdd(ngd);
+	    gd = ngd;
+	    ngd = NULL;
+	}
+    }
+    pthread_mutex_unlock(&globLock);
+
+    if (gd == NULL)
+	return ngd;
+    if (ngd)
+	dirFree(ngd);
+    return gd;
+}
+
+static void dirPut(struct globDir_s *gd)
+{
+    int unused;
+    pthread_mutex_lock(&globLock);
+    unused = (--gd->nrefs == 0);
+    pthread_mutex_unlock(&globLock);
+    if (unused)
+	dirFree(gd);
+}
+
+static int matchClass(const char *name, size_t nlen, unsigned char c)
+{
+    static const char * const classes[] = {
+	"alnum", "alpha", "blank", "cntrl", "digit", "graph",
+	"lower", "print", "punct", "space", "upper", "xdigit",
+    };
+    int graph = (c > 0x20 && c < 0x7f);
+    int i;
+
+    for (i = 0; i < sizeof(classes) / sizeof(classes[0]); i++) {
+	if (strlen(classes[i]) == nlen && rstreqn(classes[i], name, nlen))
+	    break;
+    }
+
+    switch (i) {
+    case 0: return risalnum(c);
+    case 1: return risalpha(c);
+    case 2: return risblank(c);
+    case 3: return (c < 0x20 || c == 0x7f);
+    case 4: return risdigit(c);
+    case 5: return graph;
+    case 6: return rislower(c);
+    case 7: return (graph || c == ' ');
+    case 8: return (graph && !risalnum(c));
+    case 9: return risspace(c);
+    case 10: return risupper(c);
+    case 11: return (risdigit(c) || (c >= 'a' && c <= 'f') ||
+			(c >= 'A' && c <= 'F'));
+    }
+    return 0;
+}
+
+/*
+ * Match c against the bracket expression at p (just past the '['), return
+ * a pointer past the closing ']' or NULL if the expression isn't closed.
+ */
+static const char *matchBracket(const char *p, unsigned char c, int *match)
+{
+    const char *start;
+    int negate = 0;
+    int found = 0;
+
+    if (*p == '!' || *p == '^') {
+	negate = 1;
+	p++;
+    }
+
+    /* a ']' right at the start is just a character */
+    for (start = p; *p != ']' || p == start; ) {
+	unsigned char lo, hi;
+
+	if (*p == '\0')
+	    return NULL;
+
+	/* [:class:], and [.c.] and [=c=] of single characters */
+	if (p[0] == '[' && (p[1] == ':' || p[1] == '.' || p[1] == '=')) {
+	    char end[3] = { p[1], ']', '\0' };
+	    const char *e = strstr(p + 2, end);
+	    if (e == NULL)
+		return NULL;
+	    if (p[1] == ':')
+		found |= matchClass(p + 2, e - (p + 2), c);
+	    else if (e - (p + 2) == 1 && p[2] == c)
+		found = 1;
+	    p = e + 2;
+	    continue;
+	}
+
+	if (*p == '\\' && p[1])
+	    p++;
+	lo = hi = *p++;
+	if (p[0] == '-' && p[1] != ']' && p[1] != '\0') {
+	    p++;
+	    if (*p == '\\' && p[1])
+		p++;
+	    hi = *p++;
+	}
+	if (c >= lo && c <= hi)
+	    found = 1;
+    }
+
+    *match = (found != negate);
+    return p + 1;
+}
+
+/* fnmatch(3) with FNM_PERIOD, for a single path component */
+static int matchComp(const char *p, const char *s)
+{
+    const char *bp = NULL, *bs = NULL;	/* where the last '*' was */
+
+    /* a leading period has to be matched explicitly */
+    if (*s == '.' && !(p[0] == '.' || (p[0] == '\\' && p[1] == '.')))
+	return 0;
+
+    while (*s) {
+	const char *np;
+	int m;
+
+	switch (*p) {
+	case '*':
+	    while (*p == '*')
+		p++;
+	    if (*p == '\0')
+		return 1;
+	    bp = p;
+	    bs = s;
+	    continue;
+	case '?':
+	    p++;
+	    s++;
+	    continue;
+	case '[':
+	    if ((np = matchBracket(p + 1, *s, &m)) != NULL) {
+		if (!m)
+		    goto backtrack;
+		p = np;
+		s++;
+		continue;
+	    }
+	    break;
+	case '\\':
+	    if (p[1])
+		p++;
+	    break;
+	}
+
+	if (*p != *s)
+	    goto backtrack;
+	p++;
+	s++;
+	continue;
+
+backtrack:
+	if (bp == NULL)
+	    return 0;
+	p = bp;
+	s = ++bs;
+    }
+
+    while (*p == '*')
+	p++;
+    return (*p == '\0');
+}
+
+/*
+ * Return the unescaped literal leading part of a pattern component,
+ * and whether there's anything magic after it.
+ */
+static char *compLiteral(const char *p, int *magic)
+{
+    char *lit = xmalloc(strlen(p) + 1);
+    char *t = lit;
+
+    *magic = 0;
+    while (*p) {
+	if (*p == '*' || *p == '?' || *p == '[') {
+	    *magic = 1;
+	    break;
+	}
+	if (*p == '\\' && p[1])
+	    p++;
+	*t++ = *p++;
+    }
+    *t = '\0';
+    return lit;
+}
+
+/*
+ * Add a match, type is the d_type of a directory entry or -1 for a
+ * literal path that might not exist. With a trailing slash directories
+ * get one too, and only literal paths may be something else.
+ */
+static void addMatch(struct globState_s *gs, const char *path, int type)
+{
+    struct stat sb;
+
+    if (type < 0 && lstat(path, &sb))
+	return;
+
+    if (gs->dironly) {
+	if (stat(path, &sb) == 0 && S_ISDIR(sb.st_mode)) {
+	    char *dir = rstrscat(NULL, path, "/", NULL);
+	    argvAdd(gs->argvp, dir);
+	    free(dir);
+	    return;
+	}
+	if (type >= 0)
+	    return;
+    }
+    argvAdd(gs->argvp, path);
+}
+
+static void globIn(struct globState_s *gs, const char *prefix, const char *pat);
+
+/* Match a directory entry against a component, and the rest after it */
+static void globEnt(struct globState_s *gs, const char *prefix,
+		    const char *comp, const char *seps, const char *next,
+		    const char *name, unsigned char type)
+{
+    char *path;
+
+    if (!matchComp(comp, name))
+	return;
+    /* with more components to go, only directories can match */
+    if (next && type != DT_DIR && type != DT_LNK && type != DT_UNKNOWN)
+	return;
+
+    path = rstrscat(NULL, prefix, name, seps, NULL);
+    if (next)
+	globIn(gs, path, next);
+    else
+	addMatch(gs, path, type);
+    free(path);
+}
+
+/* Expand the components of pat in directory prefix */
+static void globIn(struct globState_s *gs, const char *prefix, const char *pat)
+{
+    const char *end = strchr(pat, '/');
+    const char *next = end ? end + strspn(end, "/") : NULL;
+    char *comp = end ? rstrndup(pat, end - pat) : xstrdup(pat);
+    char *seps = end ? rstrndup(end, next - end) : xstrdup("");
+    int magic = 0;
+    char *lit = compLiteral(comp, &magic);
+    size_t llen = strlen(lit);
+    struct globDir_s *gd;
+
+    if (!magic) {
+	char *path = rstrscat(NULL, prefix, lit, seps, NULL);
+	if (end)
+	    globIn(gs, path, next);
+	else
+	    addMatch(gs, path, -1);
+	free(path);
+    } else if ((gd = dirGet(prefix)) != NULL) {
+	int lo = 0, hi = gd->nents > 0 ? gd->nents : 0;
+
+	/* only the entries starting with the literal part can match */
+	while (lo < hi) {
+	    int mid = (lo + hi) / 2;
+	    if (strcmp(gd->ents[mid].name, lit) < 0)
+		lo = mid + 1;
+	    else
+		hi = mid;
+	}
+
+	for (int i = lo; i < gd->nents; i++) {
+	    const struct globEnt_s *ent = &gd->ents[i];
+	    if (!rstreqn(ent->name, lit, llen))
+		break;
+	    globEnt(gs, prefix, comp, seps, next, ent->name, ent->type);
+	}
+	dirPut(gd);
+    } else {
+	/* not worth sorting a listing that's only used once */
+	DIR *dir = opendir(*prefix ? prefix : ".");
+	struct dirent *dp;
+
+	while (dir && (dp = readdir(dir)) != NULL) {
+	    if (rstreqn(dp->d_name, lit, llen))
+		globEnt(gs, prefix, comp, seps, next, dp->d_name, dp->d_type);
+	}
+	if (dir)
+	    closedir(dir);
+    }
+
+    free(lit);
+    free(seps);
+    free(comp);
+}
+
+static char *expandTilde(const char *pat)
+{
+    const char *end = strchrnul(pat, '/');
+    char *home = NULL;
+    char *res;
+
+    if (end == pat + 1) {
+	home = xstrdup(getenv("HOME"));
+    } else {
+	char *user = rstrndup(pat + 1, end - (pat + 1));
+	struct passwd pwbuf, *pw = NULL;
+	char buf[BUFSIZ];
+	if (getpwnam_r(user, &pwbuf, buf, sizeof(buf), &pw) == 0 && pw)
+	    home = xstrdup(pw->pw_dir);
+	free(user);
+    }
+
+    /* unknown users are left alone */
+    if (home == NULL)
+	return xstrdup(pat);
+
+    res = rstrscat(NULL, home, end, NULL);
+    free(home);
+    return res;
+}
+
+/* Expand a pattern without braces, the matches are sorted like glob(3) */
+static void globAlt(struct globState_s *gs, const char *pattern)
+{
+    int first = argvCount(*gs->argvp);
+    int tilde = (gs->tilde && *pattern == '~');
+    char *pat = tilde ? expandTilde(pattern) : xstrdup(pattern);
+    size_t plen = strlen(pat);
+    size_t nlead;
+
+    /* a lone ~user is just the name of a directory, no questions asked */
+    if (tilde && strchr(pattern, '/') == NULL) {
+	argvAdd(gs->argvp, pat);
+	free(pat);
+	return;
+    }
+
+    gs->dironly = 0;
+    while (plen > 1 && pat[plen - 1] == '/') {
+	pat[--plen] = '\0';
+	gs->dironly = 1;
+    }
+
+    nlead = strspn(pat, "/");
+    if (pat[nlead] == '\0') {
+	addMatch(gs, pat, -1);
+    } else {
+	char *prefix = rstrndup(pat, nlead);
+	globIn(gs, prefix, pat + nlead);
+	free(prefix);
+    }
+
+    if (argvCount(*gs->argvp) - first > 1) {
+	qsort(*gs->argvp + first, argvCount(*gs->argvp) - first,
+	      sizeof(**gs->argvp), pathCmp);
+    }
+    free(pat);
+}
+
+/* Return the brace closing the one at p, NULL if there is none */
+static const char *braceEnd(const char *p)
+{
+    int depth = 0;
+    for (; *p; p++) {
+	if (*p == '\\' && p[1])
+	    p++;
+	else if (*p == '{')
+	    depth++;
+	else if (*p == '}' && --depth == 0)
+	    return p;
+    }
+    return NULL;
+}
+
+/* Expand the first brace expression and recurse for the rest */
+static void globBraces(struct globState_s *gs, const char *pattern)
+{
+    const char *open = NULL, *close = NULL;
+    const char *alt;
+
+    for (const char *p = pattern; *p; p++) {
+	if (*p == '\\' && p[1]) {
+	    p++;
+	} else if (*p == '{') {
+	    open = p;
+	    break;
+	}
+    }
+
+    /* an unbalanced brace is taken literally, as glob(3) does */
+    if (open == NULL || (close = braceEnd(open)) == NULL) {
+	globAlt(gs, pattern);
+	return;
+    }
+
+    for (alt = open + 1; alt <= close; ) {
+	const char *p;
+	size_t plen = open - pattern;
+	size_t rlen = strlen(close + 1);
+	char *npat, *t;
+	int depth = 0;
+
+	for (p = alt; p < close; p++) {
+	    if (*p == '\\' && p[1])
+		p++;
+	    else if (*p == '{')
+		depth++;
+	    else if (*p == '}')
+		depth--;
+	    else if (*p == ',' && depth == 0)
+		break;
+	}
+
+	t = npat = xmalloc(plen + (p - alt) + rlen + 1);
+	t = mempcpy(t, pattern, plen);
+	t = mempcpy(t, alt, p - alt);
+	t = mempcpy(t, close + 1, rlen);
+	*t = '\0';
+	globBraces(gs, npat);
+	free(npat);
+
+	alt = p + 1;
+    }
+}
+
 /* librpmio exported interfaces */
 
 int rpmGlobPath(const char * pattern, rpmglobFlags flags,
@@ -61,17 +678,11 @@ int rpmGlobPath(const char * pattern, rpmglobFlags flags,
     int local = (urlPath(pattern, &path) == URL_IS_UNKNOWN);
     size_t plen = strlen(path);
     int dir_only = (plen > 0 && path[plen-1] == '/');
-    glob_t gl;
-    int gflags = 0;
+    struct globState_s gs;
+    int first;
     int i;
     int rc = 0;
 
-#ifdef ENABLE_NLS
-    char * old_collate = NULL;
-    char * old_ctype = NULL;
-    const char * t;
-#endif
-
     if (argvPtr == NULL)
 	/* We still want to count matches so use a scratch list */
 	argvPtr = &argv;
@@ -81,41 +692,37 @@ int rpmGlobPath(const char * pattern, rpmglobFlags flags,
 	goto exit;
     }
 
-    gflags |= GLOB_BRACE;
-    if (home != NULL && strlen(home) > 0) 
-	gflags |= GLOB_TILDE;
-    if (dir_only)
-	gflags |= GLOB_ONLYDIR;
-    if (flags & RPMGLOB_NOCHECK)
-	gflags |= GLOB_NOCHECK;
-
-#ifdef ENABLE_NLS
-    t = setlocale(LC_COLLATE, NULL);
-    if (t)
-    	old_collate = xstrdup(t);
-    t = setlocale(LC_CTYPE, NULL);
-    if (t)
-    	old_ctype = xstrdup(t);
-    (void) setlocale(LC_COLLATE, "C");
-    (void) setlocale(LC_CTYPE, "C");
-#endif
-    
-    gl.gl_pathc = 0;
-    gl.gl_pathv = NULL;
-    
-    rc = glob(pattern, gflags, NULL, &gl);
-    if (rc)
-	goto exit;
+    gs.tilde = (home != NULL && strlen(home) > 0);
+    gs.dironly = 0;
+    gs.argvp = argvPtr;
+
+    first = argvCount(*argvPtr);
+    globBraces(&gs, pattern);
 
-    for (i = 0; i < gl.gl_pathc; i++) {
-	if (dir_only && !(flags & RPMGLOB_NOCHECK)) {
+    if (argvCount(*argvPtr) == first) {
+	if (flags & RPMGLOB_NOCHECK) {
+	    /* glob(3) returns these without the trailing slash(es) */
+	    char *p = xstrdup(pattern);
+	    size_t len = strlen(p);
+	    while (len > 2 && p[len - 1] == '/')
+		p[--len] = '\0';
+	    argvAdd(argvPtr, p);
+	    free(p);
+	} else {
+	    rc = GLOB_NOMATCH;
+	}
+    } else if (dir_only && !(flags & RPMGLOB_NOCHECK)) {
+	ARGV_t av = *argvPtr;
+	int j = first;
+	for (i = first; av[i]; i++) {
 	    struct stat sb;
-	    if (lstat(gl.gl_pathv[i], &sb) || !S_ISDIR(sb.st_mode))
-		continue;
+	    if (lstat(av[i], &sb) || !S_ISDIR(sb.st_mode))
+		free(av[i]);
+	    else
+		av[j++] = av[i];
 	}
-	argvAdd(argvPtr, gl.gl_pathv[i]);
+	av[j] = NULL;
     }
-    globfree(&gl);
 
 exit:
     argc = argvCount(*argvPtr);
@@ -125,17 +732,6 @@ exit:
     if (argc == 0 && rc == 0)
 	rc = GLOB_NOMATCH;
 
-#ifdef ENABLE_NLS	
-    if (old_collate) {
-	(void) setlocale(LC_COLLATE, old_collate);
-	free(old_collate);
-    }
-    if (old_ctype) {
-	(void) setlocale(LC_CTYPE, old_ctype);
-	free(old_ctype);
-    }
-#endif
-
     return rc;
 }
 
@@ -143,3 +739,31 @@ int rpmGlob(const char * pattern, int * argcPtr, ARGV_t * argvPtr)
 {
     return rpmGlobPath(pattern, RPMGLOB_NONE, argcPtr, argvPtr);
 }
+
+void rpmGlobCacheEnable(void)
+{
+    pthread_mutex_lock(&globLock);
+    globCache.users++;
+    pthread_mutex_unlock(&globLock);
+}
+
+void rpmGlobCacheDisable(void)
+{
+    struct globDir_s *unused = NULL;
+
+    pthread_mutex_lock(&globLock);
+    if (globCache.users > 0 && --globCache.users == 0)
+	unused = cacheClear();
+    pthread_mutex_unlock(&globLock);
+    dirFreeList(unused);
+}
+
+void rpmGlobCacheFlush(void)
+{
+    struct globDir_s *unused;
+
+    pthread_mutex_lock(&globLock);
+    unused = cacheClear();
+    pthread_mutex_unlock(&globLock);
+    dirFreeList(unused);
+}
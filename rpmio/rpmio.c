@@ -13,6 +13,10 @@
 #endif
 #include <sys/utsname.h>
 #include <sys/resource.h>
+#ifdef HAVE_SENDFILE
+#include <sys/sendfile.h>
+#endif
+#include <pthread.h>
 
 #include <rpm/rpmlog.h>
 #include <rpm/rpmmacro.h>
@@ -150,6 +154,7 @@ struct FDIO_s {
 /* forward refs */
 static const FDIO_t fdio;
 static const FDIO_t ufdio;
+static const FDIO_t bufdio;
 static const FDIO_t gzdio;
 #ifdef HAVE_BZLIB_H
 static const FDIO_t bzdio;
@@ -425,14 +430,94 @@ static const struct FDIO_s fdio_s = {
 };
 static const FDIO_t fdio = &fdio_s ;
 
+#define UFDCOPY_BUFSIZE	(128 * 1024)
+
+enum {
+    COPY_FILE_RANGE,
+    COPY_SENDFILE,
+    COPY_SPLICE,
+};
+
+static ssize_t copyChunk(int how, int ifd, int ofd, size_t len)
+{
+    switch (how) {
+#ifdef HAVE_COPY_FILE_RANGE
+    case COPY_FILE_RANGE:
+	return copy_file_range(ifd, NULL, ofd, NULL, len, 0);
+#endif
+#ifdef HAVE_SENDFILE
+    case COPY_SENDFILE:
+	return sendfile(ofd, ifd, NULL, len);
+#endif
+#ifdef HAVE_SPLICE
+    case COPY_SPLICE:
+	return splice(ifd, NULL, ofd, NULL, len, SPLICE_F_MOVE);
+#endif
+    }
+    errno = ENOSYS;
+    return -1;
+}
+
+/*
+ * Copy between plain descriptors inside the kernel. copy_file_range()
+ * works between regular files, sendfile() from a regular file to
+ * anything and splice() when either end is a pipe, they're tried in
+ * that order. Returns -2 if none of them is possible, in which case
+ * nothing was copied and the caller needs to fall back to a userspace
+ * copy.
+ */
+static off_t fdCopyKernel(FD_t sfd, FD_t tfd)
+{
+    off_t total = -2;
+
+    /* Attached digests need to see the data */
+    if (!(fdIsPlain(sfd) && fdIsPlain(tfd) &&
+	    sfd->digests == NULL && tfd->digests == NULL))
+	return total;
+
+    int ifd = Fileno(sfd);
+    int ofd = Fileno(tfd);
+
+    for (int how = COPY_FILE_RANGE; how <= COPY_SPLICE; how++) {
+	total = 0;
+	while (1) {
+	    ssize_t nb = copyChunk(how, ifd, ofd, 1024 * 1024 * 1024);
+	    if (nb > 0) {
+		total += nb;
+	    } else if (nb == 0) {
+		break;
+	    } else if (errno == EINTR) {
+		continue;
+	    } else {
+		/* Not supported between these files (eg pipes, old kernel) */
+		if (total == 0 &&
+			(errno == ENOSYS || errno == EXDEV || errno == EINVAL ||
+			 errno == EOPNOTSUPP || errno == EBADF))
+		    total = -2;
+		else
+		    total = -1;
+		break;
+	    }
+	}
+	if (total != -2)
+	    break;
+    }
+    return total;
+}
+
 off_t ufdCopy(FD_t sfd, FD_t tfd)
 {
-    char buf[BUFSIZ];
+    char *buf;
     ssize_t rdbytes, wrbytes;
-    off_t total = 0;
+    off_t total;
+
+    if ((total = fdCopyKernel(sfd, tfd)) != -2)
+	return total;
 
+    total = 0;
+    buf = xmalloc(UFDCOPY_BUFSIZE);
     while (1) {
-	rdbytes = Fread(buf, sizeof(buf[0]), sizeof(buf), sfd);
+	rdbytes = Fread(buf, sizeof(buf[0]), UFDCOPY_BUFSIZE, sfd);
 
 	if (rdbytes > 0) {
 	    wrbytes = Fwrite(buf, sizeof(buf[0]), rdbytes, tfd);
@@ -447,6 +532,7 @@ off_t ufdCopy(FD_t sfd, FD_t tfd)
 	    break;
 	}
     }
+    free(buf);
 
     return total;
 }
@@ -523,6 +609,51 @@ fprintf(stderr, "*** ufdOpen(%s,0x%x,0%o)\n", url, (unsigned)flags, (unsigned)mo
     return fd;
 }
 
+/* Process-wide budget for compression threads, 0 for unlimited */
+static int threadBudget = 0;
+static int threadsInUse = 0;
+static pthread_mutex_t threadBudgetLock = PTHREAD_MUTEX_INITIALIZER;
+
+int rpmioSetThreadBudget(int nthreads)
+{
+    pthread_mutex_lock(&threadBudgetLock);
+    int prev = threadBudget;
+    threadBudget = (nthreads > 0) ? nthreads : 0;
+    pthread_mutex_unlock(&threadBudgetLock);
+    return prev;
+}
+
+/* Take up to threads from the budget, always granting at least one */
+static int reserve_threads(int threads)
+{
+    if (threads <= 0)
+	return threads;
+
+    pthread_mutex_lock(&threadBudgetLock);
+    if (threadBudget > 0) {
+	int avail = threadBudget - threadsInUse;
+	if (threads > avail)
+	    threads = (avail > 1) ? avail : 1;
+	threadsInUse += threads;
+    }
+    pthread_mutex_unlock(&threadBudgetLock);
+    return threads;
+}
+
+static void release_threads(int threads)
+{
+    if (threads <= 0)
+	return;
+
+    pthread_mutex_lock(&threadBudgetLock);
+    if (threadBudget > 0) {
+	threadsInUse -= threads;
+	if (threadsInUse < 0)
+	    threadsInUse = 0;
+    }
+    pthread_mutex_unlock(&threadBudgetLock);
+}
+
 /* Return number of threads ought to be used for compression based
    on a parsed value threads (e.g. from w7T0.xzdio or w7T16.xzdio).
    Value -1 means automatic detection. */
@@ -544,6 +675,28 @@ get_compression_threads(int threads)
     return threads;
 }
 
+/* Return number of threads ought to be used for decompression. An explicit
+   value from the mode (e.g. r.T4) takes precedence, otherwise it comes from
+   %_decompress_threads. Value 0 means single-threaded operation. */
+
+static int
+get_decompression_threads(int threads)
+{
+    if (threads == 0) {
+	char *val = rpmExpand("%{?_decompress_threads}", NULL);
+	if (*val) {
+	    threads = atoi(val);
+	    /* 0 means automatic detection, negative values disable */
+	    if (threads == 0)
+		threads = -1;
+	    else if (threads < 0)
+		threads = 0;
+	}
+	free(val);
+    }
+    return (threads != 0) ? get_compression_threads(threads) : 0;
+}
+
 static const struct FDIO_s ufdio_s = {
   "ufdio", NULL,
   fdRead, fdWrite, fdSeek, fdClose,
@@ -551,6 +704,167 @@ static const struct FDIO_s ufdio_s = {
 };
 static const FDIO_t ufdio = &ufdio_s ;
 
+/* =============================================================== */
+/* Support for user-space read buffering.  */
+
+/*
+ * The read-ahead starts small and doubles with each refill, so that
+ * header-only access reads little past what it needs while sequential
+ * reads quickly end up with large reads. Reads as large as the current
+ * read-ahead bypass the buffer.
+ */
+#define BUFDIO_MINSIZE	(8 * 1024)
+#define BUFDIO_MAXSIZE	(128 * 1024)
+
+typedef struct bufFile_s {
+    unsigned char *buf;
+    size_t size;		/* allocated size of buf */
+    size_t len;			/* number of valid bytes in buf */
+    size_t pos;			/* current read position in buf */
+    size_t readahead;		/* size of next refill */
+} * bufFile;
+
+static FD_t bufFdopen(FD_t fd, int fdno, const char *fmode)
+{
+    bufFile b = xcalloc(1, sizeof(*b));
+    b->readahead = BUFDIO_MINSIZE;
+
+    fdSetFdno(fd, -1);		/* XXX skip the fdio close */
+    fdPush(fd, bufdio, b, fdno);	/* Push bufdio onto stack */
+    return fd;
+}
+
+/* Drop buffered data, moving the descriptor back to the logical position */
+static int bufDiscard(FDSTACK_t fps)
+{
+    bufFile b = fps->fp;
+    int rc = 0;
+
+    if (b->pos < b->len) {
+	off_t unread = b->len - b->pos;
+	if (lseek(fps->fdno, -unread, SEEK_CUR) == -1)
+	    rc = -1;
+    }
+    b->pos = b->len = 0;
+    return rc;
+}
+
+static ssize_t bufRead(FDSTACK_t fps, void * buf, size_t count)
+{
+    bufFile b = fps->fp;
+    unsigned char *p = buf;
+    ssize_t total = 0;
+
+    while (count > 0) {
+	size_t avail = b->len - b->pos;
+	ssize_t nb;
+
+	if (avail == 0) {
+	    if (count >= b->readahead) {
+		nb = read(fps->fdno, p, count);
+	    } else {
+		if (b->size < b->readahead) {
+		    b->size = b->readahead;
+		    b->buf = xrealloc(b->buf, b->size);
+		}
+		nb = read(fps->fdno, b->buf, b->readahead);
+		if (nb > 0) {
+		    b->len = nb;
+		    b->pos = 0;
+		    if (b->readahead < BUFDIO_MAXSIZE)
+			b->readahead *= 2;
+		    continue;
+		}
+	    }
+	    if (nb < 0)
+		return (total > 0) ? total : nb;
+	    total += nb;
+	    break;
+	}
+
+	if (avail > count)
+	    avail = count;
+	memcpy(p, b->buf + b->pos, avail);
+	b->pos += avail;
+	p += avail;
+	count -= avail;
+	total += avail;
+    }
+    return total;
+}
+
+static ssize_t bufWrite(FDSTACK_t fps, const void * buf, size_t count)
+{
+    if (bufDiscard(fps))
+	return -1;
+    return fdWrite(fps, buf, count);
+}
+
+static int bufSeek(FDSTACK_t fps, off_t pos, int whence)
+{
+    bufFile b = fps->fp;
+
+    if (whence == SEEK_CUR) {
+	/* Seeks within the buffer don't need to touch the descriptor */
+	off_t npos = (off_t) b->pos + pos;
+	if (npos >= 0 && npos <= (off_t) b->len) {
+	    b->pos = npos;
+	    return 0;
+	}
+	pos -= (off_t) (b->len - b->pos);
+    }
+    b->pos = b->len = 0;
+    b->readahead = BUFDIO_MINSIZE;
+    return fdSeek(fps, pos, whence);
+}
+
+static off_t bufTell(FDSTACK_t fps)
+{
+    bufFile b = fps->fp;
+    off_t pos = fdTell(fps);
+
+    return (pos >= 0) ? pos - (off_t) (b->len - b->pos) : pos;
+}
+
+static int bufClose(FDSTACK_t fps)
+{
+    bufFile b = fps->fp;
+
+    if (b) {
+	free(b->buf);
+	free(b);
+	fps->fp = NULL;
+    }
+    return fdClose(fps);
+}
+
+/*
+ * Other io types operate on the underlying descriptor directly, so the
+ * buffer has to go before pushing them on the stack.
+ */
+static void bufPop(FD_t fd)
+{
+    FDSTACK_t fps = fdGetFps(fd);
+
+    if (fps && fps->io == bufdio) {
+	bufFile b = fps->fp;
+	int fdno = fps->fdno;
+
+	(void) bufDiscard(fps);
+	free(b->buf);
+	free(b);
+	fdPop(fd);
+	fdSetFdno(fd, fdno);
+    }
+}
+
+static const struct FDIO_s bufdio_s = {
+  "bufdio", "buf",
+  bufRead, bufWrite, bufSeek, bufClose,
+  NULL, bufFdopen, fdFlush, bufTell, fdError, fdStrerr
+};
+static const FDIO_t bufdio = &bufdio_s ;
+
 /* =============================================================== */
 /* Support for GZIP library.  */
 #include <zlib.h>
@@ -746,6 +1060,10 @@ static const FDIO_t bzdio = &bzdio_s ;
 #if LZMA_VERSION >= 50020002
 #define HAVE_LZMA_MT
 #endif
+/* ...and for decompression since xz 5.4.0 */
+#if LZMA_VERSION >= 50040002
+#define HAVE_LZMA_MT_DECODER
+#endif
 
 #define kBufferSize (1 << 15)
 
@@ -759,9 +1077,20 @@ typedef struct lzfile {
 
     int encoding;
     int eof;
+    int threads;	/* reserved compression threads */
+    rpmDigestBundle odigests;	/* digests of the written stream (or NULL) */
 
 } LZFILE;
 
+static int lzfwrite(LZFILE *lzfile, size_t n)
+{
+    if (fwrite(lzfile->buf, 1, n, lzfile->file) != n)
+	return -1;
+    if (lzfile->odigests)
+	rpmDigestBundleUpdate(lzfile->odigests, lzfile->buf, n);
+    return 0;
+}
+
 static LZFILE *lzopen_internal(const char *mode, int fd, int xz)
 {
     int level = LZMA_PRESET_DEFAULT;
@@ -817,7 +1146,8 @@ static LZFILE *lzopen_internal(const char *mode, int fd, int xz)
 		ret = lzma_easy_encoder(&lzfile->strm, level, LZMA_CHECK_SHA256);
 #ifdef HAVE_LZMA_MT
 	    } else {
-		threads = get_compression_threads(threads);
+		threads = reserve_threads(get_compression_threads(threads));
+		lzfile->threads = threads;
 		lzma_mt mt_options = {
 		    .flags = 0,
 		    .threads = threads,
@@ -836,7 +1166,23 @@ static LZFILE *lzopen_internal(const char *mode, int fd, int xz)
 	    ret = lzma_alone_encoder(&lzfile->strm, &options);
 	}
     } else {   /* lzma_easy_decoder_memusage(level) is not ready yet, use hardcoded limit for now */
-	ret = lzma_auto_decoder(&lzfile->strm, mem_limit ? mem_limit : 100<<20, 0);
+	if (!mem_limit)
+	    mem_limit = 100<<20;
+#ifdef HAVE_LZMA_MT_DECODER
+	/* Only xz streams with block sizes can be decoded in parallel */
+	threads = xz ? get_decompression_threads(threads) : 0;
+	if (threads > 1) {
+	    lzma_mt mt_options = {
+		.flags = 0,
+		.threads = threads,
+		.timeout = 0,
+		.memlimit_threading = mem_limit,
+		.memlimit_stop = mem_limit };
+
+	    ret = lzma_stream_decoder_mt(&lzfile->strm, &mt_options);
+	} else
+#endif
+	ret = lzma_auto_decoder(&lzfile->strm, mem_limit, 0);
     }
     if (ret != LZMA_OK) {
 	switch (ret) {
@@ -852,6 +1198,7 @@ static LZFILE *lzopen_internal(const char *mode, int fd, int xz)
 		rpmlog(RPMLOG_ERR, "liblzma: <Unknown error (%d), possibly a bug", ret);
 		break;
 	}
+	release_threads(lzfile->threads);
 	fclose(fp);
 	free(lzfile);
 	return NULL;
@@ -867,6 +1214,9 @@ static int lzclose(LZFILE *lzfile)
 
     if (!lzfile)
 	return -1;
+    /* Nothing but the final flush left to do */
+    release_threads(lzfile->threads);
+    lzfile->threads = 0;
     if (lzfile->encoding) {
 	for (;;) {
 	    lzfile->strm.avail_out = kBufferSize;
@@ -875,7 +1225,7 @@ static int lzclose(LZFILE *lzfile)
 	    if (ret != LZMA_OK && ret != LZMA_STREAM_END)
 		return -1;
 	    n = kBufferSize - lzfile->strm.avail_out;
-	    if (n && fwrite(lzfile->buf, 1, n, lzfile->file) != n)
+	    if (n && lzfwrite(lzfile, n))
 		return -1;
 	    if (ret == LZMA_STREAM_END)
 		break;
@@ -899,13 +1249,15 @@ static ssize_t lzread(LZFILE *lzfile, void *buf, size_t len)
     lzfile->strm.next_out = buf;
     lzfile->strm.avail_out = len;
     for (;;) {
+	size_t avail_out = lzfile->strm.avail_out;
 	if (!lzfile->strm.avail_in) {
 	    lzfile->strm.next_in = lzfile->buf;
 	    lzfile->strm.avail_in = fread(lzfile->buf, 1, kBufferSize, lzfile->file);
 	    if (!lzfile->strm.avail_in)
 		eof = 1;
 	}
-	ret = lzma_code(&lzfile->strm, LZMA_RUN);
+	/* The threaded decoder can have output pending after end of input */
+	ret = lzma_code(&lzfile->strm, eof ? LZMA_FINISH : LZMA_RUN);
 	if (ret == LZMA_STREAM_END) {
 	    lzfile->eof = 1;
 	    return len - lzfile->strm.avail_out;
@@ -914,7 +1266,7 @@ static ssize_t lzread(LZFILE *lzfile, void *buf, size_t len)
 	    return -1;
 	if (!lzfile->strm.avail_out)
 	    return len;
-	if (eof)
+	if (eof && lzfile->strm.avail_out == avail_out)
 	    return -1;
       }
 }
@@ -936,7 +1288,7 @@ static ssize_t lzwrite(LZFILE *lzfile, void *buf, size_t len)
 	if (ret != LZMA_OK)
 	    return -1;
 	n = kBufferSize - lzfile->strm.avail_out;
-	if (n && fwrite(lzfile->buf, 1, n, lzfile->file) != n)
+	if (n && lzfwrite(lzfile, n))
 	    return -1;
 	if (!lzfile->strm.avail_in)
 	    return len;
@@ -1030,6 +1382,56 @@ static const FDIO_t lzdio = &lzdio_s;
 #ifdef HAVE_ZSTD
 
 #include <zstd.h>
+#include <zdict.h>
+#include <pthread.h>
+
+#define ZSTD_RA_CHUNKS	4
+
+/* zstd seekable format, see contrib/seekable_format in zstd sources */
+#define ZSTD_SEEKABLE_MAGIC	0x8F92EAB1
+#define ZSTD_SKIPPABLE_MAGIC	0x184D2A5E
+#define ZSTD_SEEKABLE_FOOTER	9
+#define ZSTD_SEEKABLE_FRAME	(1 << 20)	/* uncompressed size of a frame */
+
+/*
+ * Content-defined frames: cut where a gear hash of the data matches,
+ * giving 256k frames on average (and 64k..1M), so that local changes to
+ * the data leave the other frames, and their digests, unchanged.
+ */
+#define ZSTD_CDC_MIN		(1 << 16)
+#define ZSTD_CDC_MASK		((1 << 18) - 1)
+#define ZSTD_CHUNKS_MAGIC	(ZSTD_SKIPPABLE_MAGIC + 1)
+
+static uint64_t zstdGear[256];
+static pthread_once_t zstdGearOnce = PTHREAD_ONCE_INIT;
+
+/* The table only needs to be fixed, use splitmix64 for filling it */
+static void zstdGearInit(void)
+{
+    uint64_t x = 0;
+    for (int i = 0; i < 256; i++) {
+	uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	zstdGear[i] = z ^ (z >> 31);
+    }
+}
+
+/* Decompressed data produced ahead of the reader by the worker thread */
+typedef struct rpmzstdra_s {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    size_t size;		/*!< size of each chunk buffer */
+    void * chunk[ZSTD_RA_CHUNKS];
+    size_t len[ZSTD_RA_CHUNKS];	/*!< valid data in each chunk */
+    unsigned int rd;		/*!< next chunk to consume */
+    unsigned int wr;		/*!< next chunk to fill */
+    size_t off;			/*!< consumed data in current chunk */
+    int eof;
+    int quit;
+    const char * err;
+} * rpmzstdra;
 
 typedef struct rpmzstd_s {
     int flags;			/*!< open flags. */
@@ -1041,8 +1443,37 @@ typedef struct rpmzstd_s {
     void * b;
     ZSTD_inBuffer zib;          /*!< ZSTD_inBuffer */
     ZSTD_outBuffer zob;         /*!< ZSTD_outBuffer */
+    rpmzstdra ra;		/*!< read-ahead worker (or NULL) */
+    int seekable;		/*!< write independent frames + seek table */
+    int cdc;			/*!< content-defined frame boundaries */
+    uint64_t gear;		/*!< rolling hash of current frame */
+    DIGEST_CTX fdig;		/*!< digest of current compressed frame */
+    uint8_t *digests;		/*!< digests of the written frames */
+    off_t base;			/*!< offset of the stream in the file */
+    off_t cpos;			/*!< compressed bytes written so far */
+    off_t fstart;		/*!< compressed offset of current frame */
+    size_t fsize;		/*!< uncompressed size of current frame */
+    uint32_t *frames;		/*!< (compressed, uncompressed) size pairs */
+    uint32_t nframes;
+    int threads;		/*!< reserved compression threads */
+    int rapending;		/*!< start read-ahead on first read */
+    void * dict;		/*!< dictionary (or NULL) */
+    size_t dictlen;
+    rpmDigestBundle odigests;	/*!< digests of the written stream (or NULL) */
 } * rpmzstd;
 
+static int zstdFwrite(rpmzstd zstd, const void *buf, size_t len)
+{
+    if (fwrite(buf, 1, len, zstd->fp) != len)
+	return -1;
+    if (zstd->odigests)
+	rpmDigestBundleUpdate(zstd->odigests, buf, len);
+    return 0;
+}
+
+static void zstdRAFree(rpmzstdra ra);
+static void zstdRAStart(rpmzstd zstd);
+
 static rpmzstd rpmzstdNew(int fdno, const char *fmode)
 {
     int flags = 0;
@@ -1055,6 +1486,8 @@ static rpmzstd rpmzstdNew(int fdno, const char *fmode)
     int threads = 0;
     int windowlog = 27;
     int longdist = 0;
+    int seekable = 0;
+    int cdc = 0;
 
     switch ((c = *s++)) {
     case 'a':
@@ -1091,6 +1524,13 @@ static rpmzstd rpmzstdNew(int fdno, const char *fmode)
 		    threads = -1;
 	    }
 	    continue;
+	case 'S':
+	    seekable = 1;
+	    continue;
+	case 'C':
+	    seekable = 1;
+	    cdc = 1;
+	    continue;
     case 'L':
 	    c = *s++;
 	    longdist = 1;
@@ -1154,8 +1594,12 @@ static rpmzstd rpmzstdNew(int fdno, const char *fmode)
 
 	threads = get_compression_threads(threads);
 	if (threads > 0) {
-	    if (ZSTD_isError (ZSTD_CCtx_setParameter(_stream, ZSTD_c_nbWorkers, threads)))
+	    threads = reserve_threads(threads);
+	    if (ZSTD_isError (ZSTD_CCtx_setParameter(_stream, ZSTD_c_nbWorkers, threads))) {
 		rpmlog(RPMLOG_DEBUG, "zstd library does not support multi-threading\n");
+		release_threads(threads);
+		threads = 0;
+	    }
 	}
 
 	nb = ZSTD_CStreamOutSize();
@@ -1169,6 +1613,21 @@ static rpmzstd rpmzstdNew(int fdno, const char *fmode)
     zstd->_stream = _stream;
     zstd->nb = nb;
     zstd->b = xmalloc(nb);
+    zstd->seekable = seekable;
+    if ((flags & O_ACCMODE) != O_RDONLY && cdc) {
+	pthread_once(&zstdGearOnce, zstdGearInit);
+	zstd->cdc = cdc;
+    }
+    zstd->base = lseek(fdno, 0, SEEK_CUR);
+    if ((flags & O_ACCMODE) != O_RDONLY)
+	zstd->threads = threads;
+
+    /*
+     * zstd decoding is single-threaded, but it can run ahead of the reader.
+     * Start it on first read, a dictionary may still get set before that.
+     */
+    if ((flags & O_ACCMODE) == O_RDONLY && get_decompression_threads(threads))
+	zstd->rapending = 1;
 
     return zstd;
 
@@ -1193,6 +1652,24 @@ static FD_t zstdFdopen(FD_t fd, int fdno, const char * fmode)
     return fd;
 }
 
+/* Write out the compressed data buffer */
+static int zstdWriteOut(rpmzstd zstd)
+{
+    size_t len = zstd->zob.pos;
+
+    if (len == 0)
+	return 0;
+    if (zstdFwrite(zstd, zstd->b, len))
+	return -1;
+    if (zstd->cdc) {
+	if (zstd->fdig == NULL)
+	    zstd->fdig = rpmDigestInit(RPM_HASH_SHA256, RPMDIGEST_NONE);
+	rpmDigestUpdate(zstd->fdig, zstd->b, len);
+    }
+    zstd->cpos += len;
+    return 0;
+}
+
 static int zstdFlush(FDSTACK_t fps)
 {
     rpmzstd zstd = (rpmzstd) fps->fp;
@@ -1214,7 +1691,7 @@ assert(zstd);
 	      fps->errcookie = ZSTD_getErrorName(xx);
 	      break;
 	  }
-	  else if (zstd->zob.pos != fwrite(zstd->b, 1, zstd->zob.pos, zstd->fp)) {
+	  else if (zstdWriteOut(zstd)) {
 	      fps->errcookie = "zstdClose fwrite failed.";
 	      break;
 	  }
@@ -1225,10 +1702,9 @@ assert(zstd);
     return rc;
 }
 
-static ssize_t zstdRead(FDSTACK_t fps, void * buf, size_t count)
+static ssize_t zstdDecompress(rpmzstd zstd, void * buf, size_t count,
+			      const char **err)
 {
-    rpmzstd zstd = (rpmzstd) fps->fp;
-assert(zstd);
     ZSTD_outBuffer zob = { buf, count, 0 };
 
     while (zob.pos < zob.size) {
@@ -1244,17 +1720,356 @@ assert(zstd);
 	/* Decompress next chunk. */
 	int xx = ZSTD_decompressStream(zstd->_stream, &zob, &zstd->zib);
 	if (ZSTD_isError(xx)) {
-	    fps->errcookie = ZSTD_getErrorName(xx);
+	    *err = ZSTD_getErrorName(xx);
 	    return -1;
 	}
     }
     return zob.pos;
 }
 
-static ssize_t zstdWrite(FDSTACK_t fps, const void * buf, size_t count)
+static void *zstdRAThread(void *arg)
+{
+    rpmzstd zstd = arg;
+    rpmzstdra ra = zstd->ra;
+    int done = 0;
+
+    while (!done) {
+	pthread_mutex_lock(&ra->lock);
+	while (!ra->quit && ra->wr - ra->rd >= ZSTD_RA_CHUNKS)
+	    pthread_cond_wait(&ra->cond, &ra->lock);
+	unsigned int slot = ra->wr % ZSTD_RA_CHUNKS;
+	done = ra->quit;
+	pthread_mutex_unlock(&ra->lock);
+	if (done)
+	    break;
+
+	const char *err = NULL;
+	ssize_t nb = zstdDecompress(zstd, ra->chunk[slot], ra->size, &err);
+
+	pthread_mutex_lock(&ra->lock);
+	if (nb < 0) {
+	    ra->err = err;
+	    done = 1;
+	} else {
+	    ra->len[slot] = nb;
+	    ra->wr++;
+	    /* A short chunk means the stream has ended */
+	    done = ((size_t)nb < ra->size);
+	}
+	ra->eof = done;
+	pthread_cond_broadcast(&ra->cond);
+	pthread_mutex_unlock(&ra->lock);
+    }
+    return NULL;
+}
+
+static void zstdRAStart(rpmzstd zstd)
+{
+    rpmzstdra ra = xcalloc(1, sizeof(*ra));
+
+    ra->size = 4 * ZSTD_DStreamOutSize();
+    for (int i = 0; i < ZSTD_RA_CHUNKS; i++)
+	ra->chunk[i] = xmalloc(ra->size);
+    pthread_mutex_init(&ra->lock, NULL);
+    pthread_cond_init(&ra->cond, NULL);
+    zstd->ra = ra;
+
+    if (pthread_create(&ra->thread, NULL, zstdRAThread, zstd)) {
+	rpmlog(RPMLOG_DEBUG, "failed to start zstd read-ahead thread\n");
+	zstd->ra = NULL;
+	ra->quit = 1;
+	zstdRAFree(ra);
+    }
+}
+
+static void zstdRAFree(rpmzstdra ra)
+{
+    if (ra == NULL)
+	return;
+    if (!ra->quit) {
+	pthread_mutex_lock(&ra->lock);
+	ra->quit = 1;
+	pthread_cond_broadcast(&ra->cond);
+	pthread_mutex_unlock(&ra->lock);
+	pthread_join(ra->thread, NULL);
+    }
+    pthread_cond_destroy(&ra->cond);
+    pthread_mutex_destroy(&ra->lock);
+    for (int i = 0; i < ZSTD_RA_CHUNKS; i++)
+	free(ra->chunk[i]);
+    free(ra);
+}
+
+static ssize_t zstdRARead(rpmzstdra ra, void * buf, size_t count,
+			  const char **err)
+{
+    size_t pos = 0;
+
+    pthread_mutex_lock(&ra->lock);
+    while (pos < count) {
+	while (ra->rd == ra->wr && !ra->eof)
+	    pthread_cond_wait(&ra->cond, &ra->lock);
+	if (ra->rd == ra->wr) {
+	    /* Worker is done, report errors only after all data is consumed */
+	    if (ra->err) {
+		*err = ra->err;
+		pos = -1;
+	    }
+	    break;
+	}
+
+	unsigned int slot = ra->rd % ZSTD_RA_CHUNKS;
+	size_t n = ra->len[slot] - ra->off;
+	if (n > count - pos)
+	    n = count - pos;
+	/* The chunk is ours until released, copy without the lock */
+	pthread_mutex_unlock(&ra->lock);
+	memcpy((char *)buf + pos, (char *)ra->chunk[slot] + ra->off, n);
+	pthread_mutex_lock(&ra->lock);
+	pos += n;
+	ra->off += n;
+
+	if (ra->off == ra->len[slot]) {
+	    ra->off = 0;
+	    ra->rd++;
+	    pthread_cond_broadcast(&ra->cond);
+	}
+    }
+    pthread_mutex_unlock(&ra->lock);
+    return pos;
+}
+
+static ssize_t zstdRead(FDSTACK_t fps, void * buf, size_t count)
+{
+    rpmzstd zstd = (rpmzstd) fps->fp;
+assert(zstd);
+    const char *err = NULL;
+    ssize_t rc;
+
+    if (zstd->rapending) {
+	zstd->rapending = 0;
+	zstdRAStart(zstd);
+    }
+
+    if (zstd->ra)
+	rc = zstdRARead(zstd->ra, buf, count, &err);
+    else
+	rc = zstdDecompress(zstd, buf, count, &err);
+    if (rc < 0)
+	fps->errcookie = err;
+    return rc;
+}
+
+static void zstdPut32(uint8_t *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static uint32_t zstdGet32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/* Finish the current frame, recording it in the seek table if needed */
+static int zstdEndFrame(FDSTACK_t fps)
+{
+    rpmzstd zstd = (rpmzstd) fps->fp;
+    int rc = -1;
+    int xx;
+
+    do {
+	ZSTD_inBuffer zib = { NULL, 0, 0 };
+	zstd->zob.dst  = zstd->b;
+	zstd->zob.size = zstd->nb;
+	zstd->zob.pos  = 0;
+	xx = ZSTD_compressStream2(zstd->_stream, &zstd->zob, &zib, ZSTD_e_end);
+	if (ZSTD_isError(xx)) {
+	    fps->errcookie = ZSTD_getErrorName(xx);
+	    break;
+	}
+	else if (zstdWriteOut(zstd)) {
+	    fps->errcookie = "zstdClose fwrite failed.";
+	    break;
+	}
+	else
+	    rc = 0;
+    } while (xx != 0);
+
+    if (rc == 0 && zstd->cdc) {
+	zstd->digests = xrealloc(zstd->digests, 32 * (zstd->nframes + 1));
+	void *d = NULL;
+	if (zstd->fdig == NULL)
+	    zstd->fdig = rpmDigestInit(RPM_HASH_SHA256, RPMDIGEST_NONE);
+	rpmDigestFinal(zstd->fdig, &d, NULL, 0);
+	memcpy(zstd->digests + 32 * zstd->nframes, d, 32);
+	free(d);
+	zstd->fdig = NULL;
+	zstd->gear = 0;
+    }
+
+    if (rc == 0 && zstd->seekable) {
+	zstd->frames = xrealloc(zstd->frames,
+				2 * (zstd->nframes + 1) * sizeof(*zstd->frames));
+	zstd->frames[2 * zstd->nframes] = zstd->cpos - zstd->fstart;
+	zstd->frames[2 * zstd->nframes + 1] = zstd->fsize;
+	zstd->nframes++;
+	zstd->fstart = zstd->cpos;
+	zstd->fsize = 0;
+    }
+    return rc;
+}
+
+/* Append the seek table as a skippable frame, ignored by other decoders */
+static int zstdWriteSeekTable(FDSTACK_t fps)
+{
+    rpmzstd zstd = (rpmzstd) fps->fp;
+    size_t tsize = 8 + 8 * zstd->nframes + ZSTD_SEEKABLE_FOOTER;
+    uint8_t *t = xmalloc(tsize);
+    uint8_t *p = t;
+    int rc = 0;
+
+    zstdPut32(p, ZSTD_SKIPPABLE_MAGIC);
+    zstdPut32(p + 4, tsize - 8);
+    p += 8;
+    for (uint32_t i = 0; i < zstd->nframes; i++, p += 8) {
+	zstdPut32(p, zstd->frames[2 * i]);
+	zstdPut32(p + 4, zstd->frames[2 * i + 1]);
+    }
+    zstdPut32(p, zstd->nframes);
+    p[4] = 0;			/* descriptor: no checksums */
+    zstdPut32(p + 5, ZSTD_SEEKABLE_MAGIC);
+
+    if (zstdFwrite(zstd, t, tsize)) {
+	fps->errcookie = "zstdClose fwrite failed.";
+	rc = -1;
+    }
+    free(t);
+    return rc;
+}
+
+/*
+ * Append the SHA256 digests of the compressed frames as a skippable frame.
+ * It comes before the seek table, which needs to be last.
+ */
+static int zstdWriteChunkDigests(FDSTACK_t fps)
+{
+    rpmzstd zstd = (rpmzstd) fps->fp;
+    size_t dsize = 32 * zstd->nframes;
+    uint8_t hdr[12];
+    int rc = 0;
+
+    zstdPut32(hdr, ZSTD_CHUNKS_MAGIC);
+    zstdPut32(hdr + 4, dsize + 4);
+    zstdPut32(hdr + 8, RPM_HASH_SHA256);
+    if (zstdFwrite(zstd, hdr, sizeof(hdr)) ||
+	    zstdFwrite(zstd, zstd->digests, dsize)) {
+	fps->errcookie = "zstdClose fwrite failed.";
+	rc = -1;
+    }
+    return rc;
+}
+
+/* Load the seek table from the end of the stream */
+static int zstdLoadSeekTable(rpmzstd zstd)
+{
+    int fdno = fileno(zstd->fp);
+    uint8_t footer[ZSTD_SEEKABLE_FOOTER];
+    uint8_t hdr[8];
+    struct stat sb;
+    off_t toff;
+    uint32_t n;
+
+    if (fstat(fdno, &sb) || sb.st_size < zstd->base + 8 + ZSTD_SEEKABLE_FOOTER)
+	return -1;
+    if (pread(fdno, footer, sizeof(footer),
+	      sb.st_size - ZSTD_SEEKABLE_FOOTER) != sizeof(footer))
+	return -1;
+    if (zstdGet32(footer + 5) != ZSTD_SEEKABLE_MAGIC || (footer[4] & 0x80))
+	return -1;
+
+    n = zstdGet32(footer);
+    toff = sb.st_size - ZSTD_SEEKABLE_FOOTER - 8 * (off_t)n - 8;
+    if (toff < zstd->base)
+	return -1;
+    if (pread(fdno, hdr, sizeof(hdr), toff) != sizeof(hdr) ||
+	    zstdGet32(hdr) != ZSTD_SKIPPABLE_MAGIC)
+	return -1;
+
+    uint8_t *t = xmalloc(8 * n + 1);
+    if (pread(fdno, t, 8 * n, toff + 8) != 8 * n) {
+	free(t);
+	return -1;
+    }
+    zstd->frames = xmalloc(2 * (n + 1) * sizeof(*zstd->frames));
+    for (uint32_t i = 0; i < n; i++) {
+	zstd->frames[2 * i] = zstdGet32(t + 8 * i);
+	zstd->frames[2 * i + 1] = zstdGet32(t + 8 * i + 4);
+    }
+    zstd->nframes = n;
+    free(t);
+    return 0;
+}
+
+static int zstdSeek(FDSTACK_t fps, off_t pos, int whence)
 {
     rpmzstd zstd = (rpmzstd) fps->fp;
 assert(zstd);
+    off_t coff = 0, doff = 0;
+    uint32_t i;
+
+    if ((zstd->flags & O_ACCMODE) != O_RDONLY || whence != SEEK_SET || pos < 0)
+	return -2;
+    if (zstd->frames == NULL && zstdLoadSeekTable(zstd)) {
+	fps->errcookie = "zstd stream is not seekable";
+	return -1;
+    }
+
+    /* Locate the frame containing the position */
+    for (i = 0; i < zstd->nframes; i++) {
+	if (pos < doff + zstd->frames[2 * i + 1])
+	    break;
+	coff += zstd->frames[2 * i];
+	doff += zstd->frames[2 * i + 1];
+    }
+    if (i == zstd->nframes && pos > doff)
+	return -1;
+
+    /* The read-ahead worker owns the stream position, stop it */
+    zstdRAFree(zstd->ra);
+    zstd->ra = NULL;
+    zstd->rapending = 0;
+
+    /* Reinitializing the stream drops the dictionary, load it again */
+    if (fseeko(zstd->fp, zstd->base + coff, SEEK_SET) ||
+	    ZSTD_isError(ZSTD_initDStream(zstd->_stream)))
+	return -1;
+    if (zstd->dict && ZSTD_isError(ZSTD_DCtx_loadDictionary(zstd->_stream,
+					    zstd->dict, zstd->dictlen)))
+	return -1;
+    zstd->zib.src = zstd->b;
+    zstd->zib.size = zstd->zib.pos = 0;
+
+    /* Decompress and discard up to the wanted position in the frame */
+    char skip[BUFSIZ];
+    while (doff < pos) {
+	const char *err = NULL;
+	size_t n = (pos - doff > sizeof(skip)) ? sizeof(skip) : pos - doff;
+	ssize_t nb = zstdDecompress(zstd, skip, n, &err);
+	if (nb <= 0) {
+	    fps->errcookie = err;
+	    return -1;
+	}
+	doff += nb;
+    }
+    return 0;
+}
+
+static ssize_t zstdCompress(FDSTACK_t fps, const void * buf, size_t count)
+{
+    rpmzstd zstd = (rpmzstd) fps->fp;
     ZSTD_inBuffer zib = { buf, count, 0 };
 
     while (zib.pos < zib.size) {
@@ -1272,17 +2087,76 @@ assert(zstd);
 	}
 
 	/* Write compressed data buffer. */
-        if (zstd->zob.pos > 0) {
-	    size_t nw = fwrite(zstd->b, 1, zstd->zob.pos, zstd->fp);
-	    if (nw != zstd->zob.pos) {
-		fps->errcookie = "zstdWrite fwrite failed.";
-		return -1;
-	    }
+	if (zstdWriteOut(zstd)) {
+	    fps->errcookie = "zstdWrite fwrite failed.";
+	    return -1;
 	}
     }
     return zib.pos;
 }
 
+/*
+ * Return the amount of data up to the next content-defined frame boundary
+ * (or all of it), setting *cut if the boundary is within the data.
+ */
+static size_t zstdCutPoint(rpmzstd zstd, const uint8_t *p, size_t len,
+			   int *cut)
+{
+    size_t max = ZSTD_SEEKABLE_FRAME - zstd->fsize;
+    size_t i = 0;
+    uint64_t h = zstd->gear;
+
+    *cut = 0;
+    /* No boundaries in the first bytes of a frame */
+    if (zstd->fsize < ZSTD_CDC_MIN) {
+	i = ZSTD_CDC_MIN - zstd->fsize;
+	if (i >= len)
+	    return len;
+    }
+
+    for (; i < len; i++) {
+	h = (h << 1) + zstdGear[p[i]];
+	if ((h & ZSTD_CDC_MASK) == 0 || i + 1 >= max) {
+	    *cut = 1;
+	    i++;
+	    break;
+	}
+    }
+    zstd->gear = h;
+    return i;
+}
+
+static ssize_t zstdWrite(FDSTACK_t fps, const void * buf, size_t count)
+{
+    rpmzstd zstd = (rpmzstd) fps->fp;
+assert(zstd);
+
+    if (!zstd->seekable)
+	return zstdCompress(fps, buf, count);
+
+    /* Cut the stream into frames of fixed or content-defined size */
+    size_t pos = 0;
+    while (pos < count) {
+	size_t n;
+	int cut;
+	if (zstd->cdc) {
+	    n = zstdCutPoint(zstd, (const uint8_t *)buf + pos, count - pos, &cut);
+	} else {
+	    n = ZSTD_SEEKABLE_FRAME - zstd->fsize;
+	    if (n > count - pos)
+		n = count - pos;
+	    cut = (zstd->fsize + n == ZSTD_SEEKABLE_FRAME);
+	}
+	if (zstdCompress(fps, (const char *)buf + pos, n) < 0)
+	    return -1;
+	pos += n;
+	zstd->fsize += n;
+	if (cut && zstdEndFrame(fps))
+	    return -1;
+    }
+    return pos;
+}
+
 static int zstdClose(FDSTACK_t fps)
 {
     rpmzstd zstd = (rpmzstd) fps->fp;
@@ -1291,42 +2165,62 @@ assert(zstd);
 
     if ((zstd->flags & O_ACCMODE) == O_RDONLY) { /* decompressing */
 	rc = 0;
+	zstdRAFree(zstd->ra);
 	ZSTD_freeDStream(zstd->_stream);
     } else {					/* compressing */
 	/* close frame */
-	int xx;
-	do {
-	  ZSTD_inBuffer zib = { NULL, 0, 0 };
-	  zstd->zob.dst  = zstd->b;
-	  zstd->zob.size = zstd->nb;
-	  zstd->zob.pos  = 0;
-	  xx = ZSTD_compressStream2(zstd->_stream, &zstd->zob, &zib, ZSTD_e_end);
-	  if (ZSTD_isError(xx)) {
-	      fps->errcookie = ZSTD_getErrorName(xx);
-	      break;
-	  }
-	  else if (zstd->zob.pos != fwrite(zstd->b, 1, zstd->zob.pos, zstd->fp)) {
-	      fps->errcookie = "zstdClose fwrite failed.";
-	      break;
-	  }
-	  else
-	      rc = 0;
-	} while (xx != 0);
+	if (zstd->seekable && zstd->fsize == 0 && zstd->nframes > 0)
+	    rc = 0;
+	else
+	    rc = zstdEndFrame(fps);
+	if (rc == 0 && zstd->cdc)
+	    rc = zstdWriteChunkDigests(fps);
+	if (rc == 0 && zstd->seekable)
+	    rc = zstdWriteSeekTable(fps);
 	ZSTD_freeCCtx(zstd->_stream);
+	release_threads(zstd->threads);
     }
 
     if (zstd->fp && fileno(zstd->fp) > 2)
 	(void) fclose(zstd->fp);
 
     if (zstd->b) free(zstd->b);
+    free(zstd->frames);
+    free(zstd->digests);
+    rpmDigestFinal(zstd->fdig, NULL, NULL, 0);
+    free(zstd->dict);
     free(zstd);
 
     return rc;
 }
 
+static int zstdSetDictionary(rpmzstd zstd, const void *dict, size_t len)
+{
+    size_t xx;
+
+    if ((zstd->flags & O_ACCMODE) == O_RDONLY) {
+	/* Too late once the read-ahead worker is decompressing */
+	if (zstd->ra)
+	    return -1;
+	xx = ZSTD_DCtx_loadDictionary(zstd->_stream, dict, len);
+    } else {
+	if (zstd->cpos || zstd->fsize)
+	    return -1;
+	xx = ZSTD_CCtx_loadDictionary(zstd->_stream, dict, len);
+    }
+    if (ZSTD_isError(xx))
+	return -1;
+
+    free(zstd->dict);
+    zstd->dict = xmalloc(len);
+    memcpy(zstd->dict, dict, len);
+    zstd->dictlen = len;
+    return 0;
+}
+
 static const struct FDIO_s zstdio_s = {
   "zstdio", "zstd",
-  zstdRead, zstdWrite, NULL, zstdClose,
+  zstdRead, zstdWrite, zstdSeek, zstdClose,
   NULL, zstdFdopen, zstdFlush, NULL, zfdError, zfdStrerr
 };
 static const FDIO_t zstdio = &zstdio_s ;
@@ -1541,6 +2435,7 @@ static FDIO_t findIOT(const char *name)
     static FDIO_t fdio_types[] = {
 	&fdio_s,
 	&ufdio_s,
+	&bufdio_s,
 	&gzdio_s,
 #ifdef HAVE_BZLIB_H
 	&bzdio_s,
@@ -1600,8 +2495,11 @@ fprintf(stderr, "*** Fdopen(%p,%s) %s\n", fd, fmode, fdbg(fd));
 	    iot = findIOT("gzdio");
     }
 
-    if (iot && iot->_fdopen)
+    if (iot && iot->_fdopen) {
+	if (iot != bufdio)
+	    bufPop(fd);
 	fd = iot->_fdopen(fd, fdno, stdioz);
+    }
 
 DBGIO(fd, (stderr, "==> Fdopen(%p,\"%s\") returns fd %p %s\n", ofd, fmode, (fd ? fd : NULL), fdbg(fd)));
     return fd;
@@ -1683,6 +2581,59 @@ DBGIO(fd, (stderr, "==> Ferror(%p) rc %d %s\n", fd, rc, fdbg(fd)));
     return rc;
 }
 
+int fdIsPlain(FD_t fd)
+{
+    FDSTACK_t fps = fdGetFps(fd);
+    return (fps && (fps->io == fdio || fps->io == ufdio));
+}
+
+int fdSetDictionary(FD_t fd, const void *dict, size_t len)
+{
+#ifdef HAVE_ZSTD
+    for (FDSTACK_t fps = fdGetFps(fd); fps != NULL; fps = fps->prev) {
+	if (fps->io == zstdio)
+	    return zstdSetDictionary(fps->fp, dict, len);
+    }
+#endif
+    return -1;
+}
+
+int fdSetOutputBundle(FD_t fd, rpmDigestBundle bundle)
+{
+    for (FDSTACK_t fps = fdGetFps(fd); fps != NULL; fps = fps->prev) {
+#ifdef HAVE_LZMA_H
+	if (fps->io == xzdio || fps->io == lzdio) {
+	    ((LZFILE *) fps->fp)->odigests = bundle;
+	    return 0;
+	}
+#endif
+#ifdef HAVE_ZSTD
+	if (fps->io == zstdio) {
+	    ((rpmzstd) fps->fp)->odigests = bundle;
+	    return 0;
+	}
+#endif
+    }
+    return -1;
+}
+
+size_t rpmioTrainDictionary(void *dict, size_t capacity, const void *samples,
+			    const size_t *sizes, unsigned int nsamples)
+{
+#ifdef HAVE_ZSTD
+    size_t len = ZDICT_trainFromBuffer(dict, capacity, samples,
+				       sizes, nsamples);
+    if (ZDICT_isError(len)) {
+	rpmlog(RPMLOG_DEBUG, "zstd dictionary training failed: %s\n",
+		ZDICT_getErrorName(len));
+	return 0;
+    }
+    return len;
+#else
+    return 0;
+#endif
+}
+
 int Fileno(FD_t fd)
 {
     int rc = -1;
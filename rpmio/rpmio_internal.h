@@ -31,6 +31,44 @@ void fdFiniDigest(FD_t fd, int id,
 
 DIGEST_CTX fdDupDigest(FD_t fd, int id);
 
+/** \ingroup rpmio
+ * Is fd a plain file descriptor without compression layers?
+ */
+int fdIsPlain(FD_t fd);
+
+/** \ingroup rpmio
+ * Set the dictionary of a zstd compression layer on fd. Must be called
+ * before any data is read or written through fd.
+ * @param fd		file handle
+ * @param dict		dictionary data
+ * @param len		dictionary size
+ * @return		0 on success, -1 on error (or no zstd layer)
+ */
+int fdSetDictionary(FD_t fd, const void *dict, size_t len);
+
+/** \ingroup rpmio
+ * Digest the compressed data a compression layer on fd writes to the
+ * underlying file, as opposed to the digests of fd which see the data
+ * passed to Fwrite(). Must be called before any data is written.
+ * @param fd		file handle
+ * @param bundle	digest bundle, owned by the caller and kept until
+ *			fd is closed (or NULL to stop)
+ * @return		0 on success, -1 on error (or no such layer)
+ */
+int fdSetOutputBundle(FD_t fd, rpmDigestBundle bundle);
+
+/** \ingroup rpmio
+ * Train a zstd dictionary from a set of sample buffers.
+ * @param dict		buffer for the dictionary
+ * @param capacity	size of dict buffer (ie maximum dictionary size)
+ * @param samples	sample data, concatenated
+ * @param sizes		size of each sample
+ * @param nsamples	number of samples
+ * @return		dictionary size, 0 on failure
+ */
+size_t rpmioTrainDictionary(void *dict, size_t capacity, const void *samples,
+			    const size_t *sizes, unsigned int nsamples);
+
 /**
  * Read an entire file into a buffer.
  * @param fn		file name to read
@@ -47,6 +85,70 @@ int rpmioSlurp(const char * fn,
  */
 void rpmSetCloseOnExec(void);
 
+/**
+ * Create an independent copy of a keyring.
+ * The keys are parsed again from their packets, so the copy shares no
+ * key state with the original and can be used from another thread
+ * without contention.
+ * @param keyring	keyring to copy
+ * @return		new keyring (or NULL)
+ */
+rpmKeyring rpmKeyringCopy(rpmKeyring keyring);
+
+/**
+ * Feed the identity of all keys in a keyring into a digest, so that
+ * results depending on the keyring contents can be tied to it.
+ * @param keyring	keyring
+ * @param ctx		digest context to update
+ */
+void rpmKeyringDigest(rpmKeyring keyring, DIGEST_CTX ctx);
+
+typedef struct rpmlogDefer_s * rpmlogDefer;
+
+/**
+ * Hold back log messages of the calling thread instead of logging them,
+ * so that work done in parallel can be logged in a stable order.
+ */
+void rpmlogDeferStart(void);
+
+/**
+ * Stop holding back log messages of the calling thread.
+ * @return		messages held back since rpmlogDeferStart()
+ */
+rpmlogDefer rpmlogDeferStop(void);
+
+/**
+ * Log held back messages in their original order and free them.
+ * @param defer		held back messages (or NULL)
+ * @return		NULL always
+ */
+rpmlogDefer rpmlogDeferFlush(rpmlogDefer defer);
+
+/**
+ * Free held back messages without logging them.
+ * @param defer		held back messages (or NULL)
+ * @return		NULL always
+ */
+rpmlogDefer rpmlogDeferFree(rpmlogDefer defer);
+
+/**
+ * Start caching directory listings in rpmGlobPath(). The cache is shared
+ * by all threads and dropped when the last user disables it again.
+ * Cached listings don't see changes to the directories, use
+ * rpmGlobCacheFlush() after modifying them.
+ */
+void rpmGlobCacheEnable(void);
+
+/**
+ * Stop caching directory listings in rpmGlobPath().
+ */
+void rpmGlobCacheDisable(void);
+
+/**
+ * Forget all cached directory listings.
+ */
+void rpmGlobCacheFlush(void);
+
 #ifdef __cplusplus
 }
 #endif
@@ -9,6 +9,8 @@
 #include <rpm/rpmkeyring.h>
 #include <rpm/rpmbase64.h>
 
+#include "rpmio/rpmio_internal.h"
+
 #include "debug.h"
 
 int _print_pkts = 0;
@@ -101,6 +103,58 @@ int rpmKeyringAddKey(rpmKeyring keyring, rpmPubkey key)
     return rc;
 }
 
+rpmKeyring rpmKeyringCopy(rpmKeyring keyring)
+{
+    rpmKeyring copy;
+
+    if (keyring == NULL)
+	return NULL;
+
+    copy = rpmKeyringNew();
+    pthread_rwlock_rdlock(&keyring->lock);
+    for (size_t i = 0; i < keyring->numkeys; i++) {
+	rpmPubkey key = keyring->keys[i];
+	rpmPubkey *subkeys;
+	int subkeysCount = 0;
+
+	/* Subkeys have no packets of their own, they come with the primary */
+	if (key->pktlen == 0)
+	    continue;
+
+	key = rpmPubkeyNew(key->pkt, key->pktlen);
+	if (key == NULL)
+	    continue;
+	rpmKeyringAddKey(copy, key);
+	subkeys = rpmGetSubkeys(key, &subkeysCount);
+	for (int j = 0; j < subkeysCount; j++) {
+	    rpmKeyringAddKey(copy, subkeys[j]);
+	    rpmPubkeyFree(subkeys[j]);
+	}
+	free(subkeys);
+	rpmPubkeyFree(key);
+    }
+    pthread_rwlock_unlock(&keyring->lock);
+
+    return copy;
+}
+
+void rpmKeyringDigest(rpmKeyring keyring, DIGEST_CTX ctx)
+{
+    if (keyring == NULL)
+	return;
+
+    /* Keys are kept sorted by keyid, so the order is stable */
+    pthread_rwlock_rdlock(&keyring->lock);
+    for (size_t i = 0; i < keyring->numkeys; i++) {
+	rpmPubkey key = keyring->keys[i];
+	rpmDigestUpdate(ctx, key->keyid, sizeof(key->keyid));
+	rpmDigestUpdate(ctx, &key->pktlen, sizeof(key->pktlen));
+	if (key->pktlen)
+	    rpmDigestUpdate(ctx, key->pkt, key->pktlen);
+    }
+    pthread_rwlock_unlock(&keyring->lock);
+}
+
 rpmKeyring rpmKeyringLink(rpmKeyring keyring)
 {
     if (keyring) {
@@ -284,3 +338,79 @@ rpmRC rpmKeyringVerifySig(rpmKeyring keyring, pgpDigParams sig, DIGEST_CTX ctx)
 
     return rc;
 }
+
+struct verifyBatch_s {
+    int nsigs;
+    pgpDigParams *sigs;
+    DIGEST_CTX *ctxs;
+    rpmRC *rcs;
+    int next;			/*!< next signature to verify */
+};
+
+struct verifyWorker_s {
+    struct verifyBatch_s *batch;
+    rpmKeyring keyring;
+    pthread_t thread;
+    int started;
+};
+
+static void *verifyWorker(void *arg)
+{
+    struct verifyWorker_s *w = arg;
+    struct verifyBatch_s *b = w->batch;
+    int i;
+
+    while ((i = __atomic_fetch_add(&b->next, 1, __ATOMIC_RELAXED)) < b->nsigs)
+	b->rcs[i] = rpmKeyringVerifySig(w->keyring, b->sigs[i], b->ctxs[i]);
+    return NULL;
+}
+
+int rpmKeyringVerifySigs(rpmKeyring keyring, int nsigs, pgpDigParams *sigs,
+			 DIGEST_CTX *ctxs, rpmRC *rcs, int nthreads)
+{
+    struct verifyBatch_s batch = {
+	.nsigs = nsigs,
+	.sigs = sigs,
+	.ctxs = ctxs,
+	.rcs = rcs,
+	.next = 0,
+    };
+    struct verifyWorker_s *workers;
+    int failed = 0;
+
+    if (nsigs <= 0)
+	return 0;
+    if (nthreads > nsigs)
+	nthreads = nsigs;
+    if (nthreads < 1)
+	nthreads = 1;
+
+    /*
+     * Backends may prepare key material on first use, keys are not
+     * shared between threads. The caller's keyring is used in slot 0.
+     */
+    workers = xcalloc(nthreads, sizeof(*workers));
+    for (int i = 0; i < nthreads; i++) {
+	workers[i].batch = &batch;
+	workers[i].keyring = i ? rpmKeyringCopy(keyring) : keyring;
+    }
+    for (int i = 1; i < nthreads; i++) {
+	workers[i].started = !pthread_create(&workers[i].thread, NULL,
+					     verifyWorker, &workers[i]);
+    }
+
+    verifyWorker(&workers[0]);
+
+    for (int i = 1; i < nthreads; i++) {
+	if (workers[i].started)
+	    pthread_join(workers[i].thread, NULL);
+	rpmKeyringFree(workers[i].keyring);
+    }
+    free(workers);
+
+    for (int i = 0; i < nsigs; i++) {
+	if (rcs[i] != RPMRC_OK)
+	    failed++;
+    }
+    return failed;
+}
@@ -10,6 +10,7 @@
 #include <rpm/rpmlog.h>
 #include <rpm/rpmmacro.h>
 #include <rpm/rpmstring.h>
+#include "rpmio/rpmio_internal.h"
 #include "debug.h"
 
 typedef struct rpmlogCtx_s * rpmlogCtx;
@@ -30,13 +31,29 @@ struct rpmlogRec_s {
     char * message;		/* log message string */
 };
 
-/* Force log context acquisition through a function */
-static rpmlogCtx rpmlogCtxAcquire(int write)
+struct rpmlogDefer_s {
+    int nrecs;
+    struct rpmlogRec_s *recs;
+};
+
+/* Messages up to this size are formatted on the stack */
+#define RPMLOG_MSGBUF	512
+
+/* Messages held back by the calling thread (or NULL) */
+static __thread rpmlogDefer deferred = NULL;
+
+static rpmlogCtx rpmlogCtxGet(void)
 {
     static struct rpmlogCtx_s _globalCtx = { PTHREAD_RWLOCK_INITIALIZER,
 					     RPMLOG_UPTO(RPMLOG_NOTICE),
 					     0, {0}, NULL, NULL, NULL, NULL };
-    rpmlogCtx ctx = &_globalCtx;
+    return &_globalCtx;
+}
+
+/* Force log context acquisition through a function */
+static rpmlogCtx rpmlogCtxAcquire(int write)
+{
+    rpmlogCtx ctx = rpmlogCtxGet();
     int xx;
 
     /* XXX Silently failing is bad, but we can't very well use log here... */
@@ -163,15 +180,27 @@ void rpmlogOpen (const char *ident, int option,
 {
 }
 
-int rpmlogSetMask (int mask)
+/*
+ * The mask is read without taking the lock, every rpmlog() call checks
+ * it and most debug messages are filtered out here.
+ */
+static unsigned rpmlogGetMask(void)
 {
-    rpmlogCtx ctx = rpmlogCtxAcquire(mask ? 1 : 0);
+    return __atomic_load_n(&rpmlogCtxGet()->mask, __ATOMIC_RELAXED);
+}
 
+int rpmlogSetMask (int mask)
+{
+    rpmlogCtx ctx;
     int omask = -1;
+
+    if (mask == 0)
+	return rpmlogGetMask();
+
+    ctx = rpmlogCtxAcquire(1);
     if (ctx) {
 	omask = ctx->mask;
-	if (mask)
-	    ctx->mask = mask;
+	__atomic_store_n(&ctx->mask, mask, __ATOMIC_RELAXED);
     }
 
     rpmlogCtxRelease(ctx);
@@ -384,8 +413,19 @@ static void dolog(struct rpmlogRec_s *rec, int saverec)
     FILE *clog = NULL;
     rpmlogCallbackData *cbdata = NULL;
     rpmlogCallback cbfunc = NULL;
-    rpmlogCtx ctx = rpmlogCtxAcquire(saverec);
+    rpmlogCtx ctx;
+
+    if (deferred) {
+	deferred->recs = xrealloc(deferred->recs,
+			    (deferred->nrecs + 1) * sizeof(*deferred->recs));
+	deferred->recs[deferred->nrecs].code = rec->code;
+	deferred->recs[deferred->nrecs].pri = rec->pri;
+	deferred->recs[deferred->nrecs].message = xstrdup(rec->message);
+	deferred->nrecs++;
+	return;
+    }
 
+    ctx = rpmlogCtxAcquire(saverec);
     if (ctx == NULL)
 	return;
 
@@ -432,33 +472,76 @@ void rpmlog (int code, const char *fmt, ...)
     unsigned pri = RPMLOG_PRI(code);
     unsigned mask = RPMLOG_MASK(pri);
     int saverec = (pri <= RPMLOG_WARNING);
+    char buf[RPMLOG_MSGBUF];
+    char *msg = buf;
     va_list ap;
     int n;
 
-    if ((mask & rpmlogSetMask(0)) == 0)
+    /* Skip formatting entirely for filtered out priorities */
+    if ((mask & rpmlogGetMask()) == 0)
 	goto exit;
 
+    /* Format on the stack, only long messages need a second pass */
     va_start(ap, fmt);
-    n = vsnprintf(NULL, 0, fmt, ap);
+    n = vsnprintf(buf, sizeof(buf), fmt, ap);
     va_end(ap);
 
-    if (n >= -1) {
-	struct rpmlogRec_s rec;
+    if (n >= (int)sizeof(buf)) {
 	size_t nb = n + 1;
-	char *msg = xmalloc(nb);
+	msg = xmalloc(nb);
 
 	va_start(ap, fmt);
 	n = vsnprintf(msg, nb, fmt, ap);
 	va_end(ap);
+    }
+
+    if (n >= 0) {
+	struct rpmlogRec_s rec;
 
 	rec.code = code;
 	rec.pri = pri;
 	rec.message = msg;
 
 	dolog(&rec, saverec);
+    }
 
+    if (msg != buf)
 	free(msg);
-    }
 exit:
     errno = saved_errno;
 }
+
+void rpmlogDeferStart(void)
+{
+    if (deferred == NULL)
+	deferred = xcalloc(1, sizeof(*deferred));
+}
+
+rpmlogDefer rpmlogDeferStop(void)
+{
+    rpmlogDefer defer = deferred;
+    deferred = NULL;
+    return defer;
+}
+
+rpmlogDefer rpmlogDeferFlush(rpmlogDefer defer)
+{
+    if (defer) {
+	for (int i = 0; i < defer->nrecs; i++) {
+	    struct rpmlogRec_s *rec = &defer->recs[i];
+	    dolog(rec, rec->pri <= RPMLOG_WARNING);
+	}
+    }
+    return rpmlogDeferFree(defer);
+}
+
+rpmlogDefer rpmlogDeferFree(rpmlogDefer defer)
+{
+    if (defer) {
+	for (int i = 0; i < defer->nrecs; i++)
+	    free(defer->recs[i].message);
+	free(defer->recs);
+	free(defer);
+    }
+    return NULL;
+}
@@ -42,8 +42,12 @@ struct rpmlua_s {
     lua_State *L;
     size_t pushsize;
     rpmluapb printbuf;
+    int nchunks;	/* no. of compiled chunks in the chunk cache */
 };
 
+/* Compiled chunks are dropped wholesale when the cache grows past this */
+#define CHUNK_CACHE_MAX 512
+
 #define INITSTATE(lua) \
     (lua = lua ? lua : \
 	    (globalLuaState ? globalLuaState : \
@@ -154,6 +158,9 @@ rpmlua rpmluaNew()
     lua_pushlightuserdata(L, (void *)lua);
     lua_rawset(L, LUA_REGISTRYINDEX);
 
+    lua_newtable(L);
+    lua_setfield(L, LUA_REGISTRYINDEX, "rpm_chunks");
+
     initlua = rpmGenPath(rpmConfigDir(), "init.lua", NULL);
     if (stat(initlua, &st) != -1)
 	(void)rpmluaRunScriptFile(lua, initlua);
@@ -216,6 +223,53 @@ char *rpmluaPopPrintBuffer(rpmlua lua)
     return ret;
 }
 
+/*
+ * Load a chunk like luaL_loadbuffer(), reusing the function compiled
+ * earlier for the same name and source. Macros such as %{lua:} ones
+ * in macro packages run the same code over and over, compiling it
+ * only once saves a good deal of time on large specs.
+ */
+static int loadchunk(rpmlua lua, const char *chunk, size_t len,
+		     const char *name)
+{
+    lua_State *L = lua->L;
+    int rc;
+
+    lua_getfield(L, LUA_REGISTRYINDEX, "rpm_chunks");
+    lua_pushstring(L, name);
+    lua_pushliteral(L, "\n");
+    lua_pushlstring(L, chunk, len);
+    lua_concat(L, 3);
+    lua_pushvalue(L, -1);
+    if (lua_rawget(L, -3) == LUA_TFUNCTION) {
+	/* leave just the function on the stack */
+	lua_replace(L, -3);
+	lua_pop(L, 1);
+	return 0;
+    }
+    lua_pop(L, 1);
+
+    rc = luaL_loadbuffer(L, chunk, len, name);
+    if (rc == 0) {
+	if (lua->nchunks >= CHUNK_CACHE_MAX) {
+	    lua_newtable(L);
+	    lua_pushvalue(L, -1);
+	    lua_setfield(L, LUA_REGISTRYINDEX, "rpm_chunks");
+	    lua_replace(L, -4);
+	    lua->nchunks = 0;
+	}
+	/* cache[key] = function */
+	lua_pushvalue(L, -2);
+	lua_pushvalue(L, -2);
+	lua_rawset(L, -5);
+	lua->nchunks++;
+    }
+    /* drop table and key, leaving function or error */
+    lua_replace(L, -3);
+    lua_pop(L, 1);
+    return rc;
+}
+
 int rpmluaCheckScript(rpmlua lua, const char *script, const char *name)
 {
     INITSTATE(lua);
@@ -260,7 +314,7 @@ int rpmluaRunScript(rpmlua lua, const char *script, const char *name,
 
     char *buf = rstrscat(NULL, lualocal, script, NULL);
 
-    if (luaL_loadbuffer(L, buf, strlen(buf), name) != 0) {
+    if (loadchunk(lua, buf, strlen(buf), name) != 0) {
 	rpmlog(RPMLOG_ERR, _("invalid syntax in lua script: %s\n"),
 		 lua_tostring(L, -1));
 	lua_pop(L, 1);
@@ -430,7 +484,7 @@ char *rpmluaCallStringFunction(rpmlua lua, const char *function, rpmhookArgs arg
 
     /* compile the call */
     rasprintf(&fcall, "return (%s)(...)", function);
-    if (luaL_loadbuffer(L, fcall, strlen(fcall), function) != 0) {
+    if (loadchunk(lua, fcall, strlen(fcall), function) != 0) {
 	rpmlog(RPMLOG_ERR, "%s: %s\n", function, lua_tostring(L, -1));
 	lua_pop(L, 1);
 	free(fcall);
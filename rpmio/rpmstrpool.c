@@ -2,6 +2,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include <rpm/rpmstring.h>
 #include <rpm/rpmstrpool.h>
 #include "debug.h"
@@ -15,28 +18,48 @@
 static int pool_debug = 0;
 
 typedef struct poolHash_s * poolHash;
-typedef struct poolHashBucket_s poolHashBucket;
 
-struct poolHashBucket_s {
-    rpmsid keyid;
-};
+/*
+ * Open addressing hash in the style of Swiss tables: slots are arranged in
+ * groups of POOLHASH_GROUP, each slot has a control byte holding seven bits
+ * of the hash (or POOLHASH_EMPTY), so a whole group can be probed at once
+ * without touching the strings. The full hash is kept to avoid string
+ * compares on control byte collisions and to resize without rehashing.
+ * Entries are never removed, so there's no need for tombstones.
+ */
+#define POOLHASH_GROUP	16
+#define POOLHASH_EMPTY	0x80
 
 struct poolHash_s {
-    int numBuckets;
-    poolHashBucket * buckets;
-    int keyCount;
+    unsigned int numBuckets;	/* power of two, multiple of group size */
+    uint8_t * ctrl;		/* control bytes */
+    unsigned int * hashes;	/* full hash of each slot */
+    rpmsid * keyids;		/* string ids of each slot */
+    unsigned int keyCount;
 };
 
+/*
+ * Strings are never moved or removed once added, which allows id -> string
+ * lookups without locking: the offsets array is only ever replaced by a
+ * larger copy, published before the new size. Replaced arrays are retired
+ * instead of freed as readers may still be looking at them, and released
+ * only on freeze, which must not race with lookups.
+ * Writers serialize on the lock, as do string -> id lookups in non-frozen
+ * pools. Frozen pools are immutable and need no locking at all.
+ */
 struct rpmstrPool_s {
     const char ** offs;		/* pointers into data area */
     rpmsid offs_size;		/* largest offset index */;
     rpmsid offs_alloced;	/* offsets allocation size */
+    const char *** retired;	/* replaced offset arrays */
+    int nretired;
 
     char ** chunks;		/* memory chunks for storing the strings */
     size_t chunks_size;		/* current chunk */
     size_t chunks_allocated;	/* allocated size of the chunks array */
     size_t chunk_allocated;	/* size of the current chunk */
     size_t chunk_used;		/* usage of the current chunk */
+    size_t chunks_bytes;	/* total size of the chunks */
 
     poolHash hash;		/* string -> sid hash table */
     int frozen;			/* are new id additions allowed? */
@@ -46,6 +69,19 @@ struct rpmstrPool_s {
 
 static inline const char *id2str(rpmstrPool pool, rpmsid sid);
 
+static inline int poolFrozen(rpmstrPool pool)
+{
+    return __atomic_load_n(&pool->frozen, __ATOMIC_ACQUIRE);
+}
+
+static void poolRetireOffs(rpmstrPool pool)
+{
+    for (int i = 0; i < pool->nretired; i++)
+	free(pool->retired[i]);
+    pool->retired = _free(pool->retired);
+    pool->nretired = 0;
+}
+
 static inline void poolLock(rpmstrPool pool, int write)
 {
     if (write)
@@ -59,143 +95,212 @@ static inline void poolUnlock(rpmstrPool pool)
     pthread_rwlock_unlock(&pool->lock);
 }
 
-/* calculate hash and string length on at once */
-static inline unsigned int rstrlenhash(const char * str, size_t * len)
+/*
+ * Hash a string of known length eight bytes at a time. Only used for the
+ * in-memory pool hash, so the values depending on byte order is fine.
+ */
+static inline unsigned int poolStrHash(const char * s, size_t len)
 {
-    /* Jenkins One-at-a-time hash */
-    unsigned int hash = 0xe4721b68;
-    const char * s = str;
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ len;
+    uint64_t w;
 
-    while (*s != '\0') {
-      hash += *s;
-      hash += (hash << 10);
-      hash ^= (hash >> 6);
-      s++;
+    for (; len >= 8; s += 8, len -= 8) {
+	memcpy(&w, s, 8);
+	h = (h ^ w) * 0xff51afd7ed558ccdULL;
+	h ^= h >> 32;
     }
-    hash += (hash << 3);
-    hash ^= (hash >> 11);
-    hash += (hash << 15);
+    w = 0;
+    memcpy(&w, s, len);
+    h = (h ^ w) * 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 29;
+
+    return h ^ (h >> 32);
+}
+
+/* calculate hash and string length on at once */
+static inline unsigned int rstrlenhash(const char * str, size_t * len)
+{
+    size_t slen = strlen(str);
 
     if (len)
-	*len = (s - str);
+	*len = slen;
 
-    return hash;
+    return poolStrHash(str, slen);
+}
+
+static inline unsigned int rstrnhash(const char * string, size_t n)
+{
+    return poolStrHash(string, strnlen(string, n));
 }
 
-static inline unsigned int rstrnlenhash(const char * str, size_t n, size_t * len)
+unsigned int rstrhash(const char * string)
 {
     /* Jenkins One-at-a-time hash */
     unsigned int hash = 0xe4721b68;
-    const char * s = str;
+    const char * s = string;
 
-    while (n > 0 && *s != '\0') {
+    while (*s != '\0') {
       hash += *s;
       hash += (hash << 10);
       hash ^= (hash >> 6);
       s++;
-      n--;
     }
     hash += (hash << 3);
     hash ^= (hash >> 11);
     hash += (hash << 15);
 
-    if (len)
-	*len = (s - str);
-
     return hash;
 }
 
-static inline unsigned int rstrnhash(const char * string, size_t n)
+/* Bitmask of slots in the group at ctrl matching the control byte c */
+static inline unsigned int groupMatch(const uint8_t *ctrl, uint8_t c)
 {
-    return rstrnlenhash(string, n, NULL);
+#ifdef __SSE2__
+    __m128i group = _mm_loadu_si128((const __m128i *) ctrl);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(c)));
+#else
+    unsigned int mask = 0;
+    for (int i = 0; i < POOLHASH_GROUP; i++) {
+	if (ctrl[i] == c)
+	    mask |= (1U << i);
+    }
+    return mask;
+#endif
 }
 
-unsigned int rstrhash(const char * string)
+static inline uint8_t hashCtrl(unsigned int hash)
 {
-    return rstrlenhash(string, NULL);
+    return hash & 0x7f;
 }
 
-static inline unsigned int hashbucket(unsigned int hash, unsigned int number)
+static inline unsigned int hashGroup(poolHash ht, unsigned int hash)
 {
-    return hash + number*number;
+    return ((hash >> 7) * POOLHASH_GROUP) & (ht->numBuckets - 1);
 }
 
-static poolHash poolHashCreate(int numBuckets)
+/* Triangular probing over groups visits each group once */
+static inline unsigned int nextGroup(poolHash ht, unsigned int g, unsigned int i)
+{
+    return (g + i * POOLHASH_GROUP) & (ht->numBuckets - 1);
+}
+
+static poolHash poolHashCreate(unsigned int numBuckets)
 {
     poolHash ht;
+    unsigned int n = POOLHASH_GROUP;
+
+    while (n < numBuckets)
+	n *= 2;
 
     ht = xmalloc(sizeof(*ht));
-    ht->numBuckets = numBuckets;
-    ht->buckets = xcalloc(numBuckets, sizeof(*ht->buckets));
+    ht->numBuckets = n;
+    ht->ctrl = xmalloc(n);
+    memset(ht->ctrl, POOLHASH_EMPTY, n);
+    ht->hashes = xmalloc(n * sizeof(*ht->hashes));
+    ht->keyids = xmalloc(n * sizeof(*ht->keyids));
     ht->keyCount = 0;
     return ht;
 }
 
-static void poolHashResize(rpmstrPool pool, int numBuckets)
+/* Find the first empty slot for hash, the key must not be present */
+static unsigned int poolHashFreeSlot(poolHash ht, unsigned int hash)
 {
-    poolHash ht = pool->hash;
-    poolHashBucket * buckets = xcalloc(numBuckets, sizeof(*ht->buckets));
-
-    for (int i=0; i<ht->numBuckets; i++) {
-        if (!ht->buckets[i].keyid) continue;
-        unsigned int keyHash = rstrhash(id2str(pool, ht->buckets[i].keyid));
-        for (unsigned int j=0;;j++) {
-            unsigned int hash = hashbucket(keyHash, j) % numBuckets;
-            if (!buckets[hash].keyid) {
-                buckets[hash].keyid = ht->buckets[i].keyid;
-                break;
-            }
-        }
+    unsigned int g = hashGroup(ht, hash);
+    for (unsigned int i = 1;; i++) {
+	unsigned int empty = groupMatch(ht->ctrl + g, POOLHASH_EMPTY);
+	if (empty)
+	    return g + __builtin_ctz(empty);
+	g = nextGroup(ht, g, i);
     }
-    free((void *)(ht->buckets));
-    ht->buckets = buckets;
-    ht->numBuckets = numBuckets;
 }
 
-static void poolHashAddHEntry(rpmstrPool pool, const char * key, unsigned int keyHash, rpmsid keyid)
+static inline void poolHashSet(poolHash ht, unsigned int slot,
+			       unsigned int hash, rpmsid keyid)
+{
+    ht->ctrl[slot] = hashCtrl(hash);
+    ht->hashes[slot] = hash;
+    ht->keyids[slot] = keyid;
+    ht->keyCount++;
+}
+
+static void poolHashResize(rpmstrPool pool, unsigned int numBuckets)
 {
     poolHash ht = pool->hash;
+    poolHash nt = poolHashCreate(numBuckets);
 
-    /* keep load factor between 0.25 and 0.5 */
-    if (2*(ht->keyCount) > ht->numBuckets) {
-        poolHashResize(pool, ht->numBuckets * 2);
+    for (unsigned int i = 0; i < ht->numBuckets; i++) {
+	if (ht->ctrl[i] == POOLHASH_EMPTY)
+	    continue;
+	unsigned int slot = poolHashFreeSlot(nt, ht->hashes[i]);
+	poolHashSet(nt, slot, ht->hashes[i], ht->keyids[i]);
     }
 
-    for (unsigned int i=0;;i++) {
-        unsigned int hash = hashbucket(keyHash, i) % ht->numBuckets;
-        if (!ht->buckets[hash].keyid) {
-            ht->buckets[hash].keyid = keyid;
-            ht->keyCount++;
-            break;
-        } else if (!strcmp(id2str(pool, ht->buckets[hash].keyid), key)) {
-            return;
-        }
-    }
+    free(ht->ctrl);
+    free(ht->hashes);
+    free(ht->keyids);
+    *ht = *nt;
+    free(nt);
 }
 
-static void poolHashAddEntry(rpmstrPool pool, const char * key, rpmsid keyid)
+/* Look up key, return its id or 0 and the slot for insertion in *slotp */
+static rpmsid poolHashFind(rpmstrPool pool, const char * key, size_t keylen,
+			   unsigned int keyHash, unsigned int *slotp)
 {
-    poolHashAddHEntry(pool, key, rstrhash(key), keyid);
+    poolHash ht = pool->hash;
+    uint8_t c = hashCtrl(keyHash);
+    unsigned int g = hashGroup(ht, keyHash);
+
+    for (unsigned int i = 1;; i++) {
+	const uint8_t *ctrl = ht->ctrl + g;
+	unsigned int match = groupMatch(ctrl, c);
+
+	while (match) {
+	    unsigned int slot = g + __builtin_ctz(match);
+	    match &= match - 1;
+	    if (ht->hashes[slot] == keyHash) {
+		const char *s = id2str(pool, ht->keyids[slot]);
+		/* pool string could be longer than keylen, require exact match */
+		if (strncmp(s, key, keylen) == 0 && s[keylen] == '\0')
+		    return ht->keyids[slot];
+	    }
+	}
+
+	unsigned int empty = groupMatch(ctrl, POOLHASH_EMPTY);
+	if (empty) {
+	    if (slotp)
+		*slotp = g + __builtin_ctz(empty);
+	    return 0;
+	}
+	g = nextGroup(ht, g, i);
+    }
 }
 
-static void poolHashEmpty( poolHash ht)
+static void poolHashAddHEntry(rpmstrPool pool, const char * key, unsigned int keyHash, rpmsid keyid)
 {
-    unsigned int i;
-
-    if (ht->keyCount == 0) return;
+    poolHash ht = pool->hash;
+    unsigned int slot = 0;
 
-    for (i = 0; i < ht->numBuckets; i++) {
-	ht->buckets[i].keyid = 0;
+    /* keep load factor below 7/8 */
+    if (8 * (ht->keyCount + 1) > 7 * ht->numBuckets) {
+	poolHashResize(pool, ht->numBuckets * 2);
     }
-    ht->keyCount = 0;
+
+    if (poolHashFind(pool, key, strlen(key), keyHash, &slot) == 0)
+	poolHashSet(ht, slot, keyHash, keyid);
+}
+
+static void poolHashAddEntry(rpmstrPool pool, const char * key, rpmsid keyid)
+{
+    poolHashAddHEntry(pool, key, rstrlenhash(key, NULL), keyid);
 }
 
 static poolHash poolHashFree(poolHash ht)
 {
     if (ht==NULL)
         return ht;
-    poolHashEmpty(ht);
-    ht->buckets = _free(ht->buckets);
+    free(ht->ctrl);
+    free(ht->hashes);
+    free(ht->keyids);
     ht = _free(ht);
 
     return NULL;
@@ -204,25 +309,27 @@ static poolHash poolHashFree(poolHash ht)
 static void poolHashPrintStats(rpmstrPool pool)
 {
     poolHash ht = pool->hash;
-    int i;
-    int collisions = 0;
-    int maxcollisions = 0;
-
-    for (i=0; i<ht->numBuckets; i++) {
-        unsigned int keyHash = rstrhash(id2str(pool, ht->buckets[i].keyid));
-        for (unsigned int j=0;;j++) {
-            unsigned int hash = hashbucket(keyHash, i) % ht->numBuckets;
-            if (hash==i) {
-                collisions += j;
-                maxcollisions = maxcollisions > j ? maxcollisions : j;
-                break;
-            }
-        }
+    unsigned int collisions = 0;
+    unsigned int maxcollisions = 0;
+
+    if (ht == NULL)
+	return;
+
+    /* count the extra groups probed to reach each key */
+    for (unsigned int slot = 0; slot < ht->numBuckets; slot++) {
+	if (ht->ctrl[slot] == POOLHASH_EMPTY)
+	    continue;
+	unsigned int g = hashGroup(ht, ht->hashes[slot]);
+	unsigned int j;
+	for (j = 0; g != slot - (slot % POOLHASH_GROUP); j++)
+	    g = nextGroup(ht, g, j + 1);
+	collisions += j;
+	maxcollisions = maxcollisions > j ? maxcollisions : j;
     }
-    fprintf(stderr, "Hashsize: %i\n", ht->numBuckets);
-    fprintf(stderr, "Keys: %i\n", ht->keyCount);
-    fprintf(stderr, "Collisions: %i\n", collisions);
-    fprintf(stderr, "Max collisions: %i\n", maxcollisions);
+    fprintf(stderr, "Hashsize: %u\n", ht->numBuckets);
+    fprintf(stderr, "Keys: %u\n", ht->keyCount);
+    fprintf(stderr, "Collisions: %u\n", collisions);
+    fprintf(stderr, "Max collisions: %u\n", maxcollisions);
 }
 
 static void rpmstrPoolRehash(rpmstrPool pool)
@@ -254,6 +361,7 @@ rpmstrPool rpmstrPoolCreate(void)
     pool->chunks_size = 1;
     pool->chunk_allocated = STRDATA_CHUNK;
     pool->chunks[pool->chunks_size] = xcalloc(1, pool->chunk_allocated);
+    pool->chunks_bytes = pool->chunk_allocated;
     pool->offs[1] = pool->chunks[pool->chunks_size];
 
     rpmstrPoolRehash(pool);
@@ -273,6 +381,7 @@ rpmstrPool rpmstrPoolFree(rpmstrPool pool)
 	    if (pool_debug)
 		poolHashPrintStats(pool);
 	    poolHashFree(pool->hash);
+	    poolRetireOffs(pool);
 	    free(pool->offs);
 	    for (int i=1;i<=pool->chunks_size;i++) {
 		pool->chunks[i] = _free(pool->chunks[i]);
@@ -306,10 +415,11 @@ void rpmstrPoolFreeze(rpmstrPool pool, int keephash)
 	if (!keephash) {
 	    pool->hash = poolHashFree(pool->hash);
 	}
+	poolRetireOffs(pool);
 	pool->offs_alloced = pool->offs_size + 2; /* space for end marker */
 	pool->offs = xrealloc(pool->offs,
 			      pool->offs_alloced * sizeof(*pool->offs));
-	pool->frozen = 1;
+	__atomic_store_n(&pool->frozen, 1, __ATOMIC_RELEASE);
     }
     poolUnlock(pool);
 }
@@ -321,7 +431,7 @@ void rpmstrPoolUnfreeze(rpmstrPool pool)
 	if (pool->hash == NULL) {
 	    rpmstrPoolRehash(pool);
 	}
-	pool->frozen = 0;
+	__atomic_store_n(&pool->frozen, 0, __ATOMIC_RELEASE);
 	poolUnlock(pool);
     }
 }
@@ -330,12 +440,18 @@ static rpmsid rpmstrPoolPut(rpmstrPool pool, const char *s, size_t slen, unsigne
 {
     char *t = NULL;
     size_t ssize = slen + 1;
-
-    pool->offs_size += 1;
-    if (pool->offs_alloced <= pool->offs_size) {
-	pool->offs_alloced += STROFFS_CHUNK;
-	pool->offs = xrealloc(pool->offs,
-			      pool->offs_alloced * sizeof(*pool->offs));
+    rpmsid sid = pool->offs_size + 1;
+
+    /* Lock-free readers may be using the old array, copy and retire it */
+    if (pool->offs_alloced <= sid) {
+	rpmsid alloced = pool->offs_alloced * 2;
+	const char **offs = xcalloc(alloced, sizeof(*offs));
+	memcpy(offs, pool->offs, pool->offs_alloced * sizeof(*offs));
+	pool->retired = xrealloc(pool->retired,
+			      (pool->nretired + 1) * sizeof(*pool->retired));
+	pool->retired[pool->nretired++] = pool->offs;
+	__atomic_store_n(&pool->offs, offs, __ATOMIC_RELEASE);
+	pool->offs_alloced = alloced;
     }
 
     /* Do we need a new chunk to store the string? */
@@ -354,6 +470,7 @@ static rpmsid rpmstrPoolPut(rpmstrPool pool, const char *s, size_t slen, unsigne
 	}
 
 	pool->chunks[pool->chunks_size] = xcalloc(1, pool->chunk_allocated);
+	pool->chunks_bytes += pool->chunk_allocated;
 	pool->chunk_used = 0;
     }
 
@@ -362,32 +479,18 @@ static rpmsid rpmstrPoolPut(rpmstrPool pool, const char *s, size_t slen, unsigne
     t[slen] = '\0';
     pool->chunk_used += ssize;
 
-    /* Actually add the string to the pool */
-    pool->offs[pool->offs_size] = t;
-    poolHashAddHEntry(pool, t, hash, pool->offs_size);
+    /* Actually add the string to the pool, publish it only when complete */
+    pool->offs[sid] = t;
+    __atomic_store_n(&pool->offs_size, sid, __ATOMIC_RELEASE);
+    poolHashAddHEntry(pool, t, hash, sid);
 
-    return pool->offs_size;
+    return sid;
 }
 
 static rpmsid rpmstrPoolGet(rpmstrPool pool, const char * key, size_t keylen,
 			    unsigned int keyHash)
 {
-    poolHash ht = pool->hash;
-    const char * s;
-
-
-    for (unsigned int i=0;; i++) {
-        unsigned int hash = hashbucket(keyHash, i) % ht->numBuckets;
-
-        if (!ht->buckets[hash].keyid) {
-            return 0;
-        }
-
-	s = id2str(pool, ht->buckets[hash].keyid);
-	/* pool string could be longer than keylen, require exact matche */
-	if (strncmp(s, key, keylen) == 0 && s[keylen] == '\0')
-	    return ht->buckets[hash].keyid;
-    }
+    return poolHashFind(pool, key, keylen, keyHash, NULL);
 }
 
 static inline rpmsid strn2id(rpmstrPool pool, const char *s, size_t slen,
@@ -397,7 +500,7 @@ static inline rpmsid strn2id(rpmstrPool pool, const char *s, size_t slen,
 
     if (pool->hash) {
 	sid = rpmstrPoolGet(pool, s, slen, hash);
-	if (sid == 0 && create && !pool->frozen)
+	if (sid == 0 && create && !poolFrozen(pool))
 	    sid = rpmstrPoolPut(pool, s, slen, hash);
     }
     return sid;
@@ -406,20 +509,33 @@ static inline rpmsid strn2id(rpmstrPool pool, const char *s, size_t slen,
 static inline const char *id2str(rpmstrPool pool, rpmsid sid)
 {
     const char *s = NULL;
-    if (sid > 0 && sid <= pool->offs_size)
-	s = pool->offs[sid];
+    if (sid > 0 && sid <= __atomic_load_n(&pool->offs_size, __ATOMIC_ACQUIRE))
+	s = __atomic_load_n(&pool->offs, __ATOMIC_ACQUIRE)[sid];
     return s;
 }
 
+static rpmsid poolIdn(rpmstrPool pool, const char *s, size_t slen,
+		      unsigned int hash, int create)
+{
+    rpmsid sid;
+
+    /* Frozen pools are immutable, lookups need no locking */
+    if (poolFrozen(pool))
+	return strn2id(pool, s, slen, hash, 0);
+
+    poolLock(pool, create);
+    sid = strn2id(pool, s, slen, hash, create);
+    poolUnlock(pool);
+    return sid;
+}
+
 rpmsid rpmstrPoolIdn(rpmstrPool pool, const char *s, size_t slen, int create)
 {
     rpmsid sid = 0;
 
     if (pool && s) {
 	unsigned int hash = rstrnhash(s, slen);
-	poolLock(pool, create);
-	sid = strn2id(pool, s, slen, hash, create);
-	poolUnlock(pool);
+	sid = poolIdn(pool, s, slen, hash, create);
     }
     return sid;
 }
@@ -431,9 +547,7 @@ rpmsid rpmstrPoolId(rpmstrPool pool, const char *s, int create)
     if (pool && s) {
 	size_t slen;
 	unsigned int hash = rstrlenhash(s, &slen);
-	poolLock(pool, create);
-	sid = strn2id(pool, s, slen, hash, create);
-	poolUnlock(pool);
+	sid = poolIdn(pool, s, slen, hash, create);
     }
     return sid;
 }
@@ -441,11 +555,8 @@ rpmsid rpmstrPoolId(rpmstrPool pool, const char *s, int create)
 const char * rpmstrPoolStr(rpmstrPool pool, rpmsid sid)
 {
     const char *s = NULL;
-    if (pool) {
-	poolLock(pool, 0);
+    if (pool)
 	s = id2str(pool, sid);
-	poolUnlock(pool);
-    }
     return s;
 }
 
@@ -453,11 +564,9 @@ size_t rpmstrPoolStrlen(rpmstrPool pool, rpmsid sid)
 {
     size_t slen = 0;
     if (pool) {
-	poolLock(pool, 0);
 	const char *s = id2str(pool, sid);
 	if (s)
 	    slen = strlen(s);
-	poolUnlock(pool);
     }
     return slen;
 }
@@ -469,13 +578,9 @@ int rpmstrPoolStreq(rpmstrPool poolA, rpmsid sidA,
     if (poolA == poolB)
 	 eq = (sidA == sidB);
     else {
-	poolLock(poolA, 0);
-	poolLock(poolB, 0);
 	const char *a = rpmstrPoolStr(poolA, sidA);
 	const char *b = rpmstrPoolStr(poolB, sidB);
 	eq = rstreq(a, b);
-	poolUnlock(poolA);
-	poolUnlock(poolB);
     }
     return eq;
 }
@@ -483,10 +588,25 @@ int rpmstrPoolStreq(rpmstrPool poolA, rpmsid sidA,
 rpmsid rpmstrPoolNumStr(rpmstrPool pool)
 {
     rpmsid n = 0;
+    if (pool)
+	n = __atomic_load_n(&pool->offs_size, __ATOMIC_ACQUIRE);
+    return n;
+}
+
+size_t rpmstrPoolMemSize(rpmstrPool pool)
+{
+    size_t size = 0;
     if (pool) {
 	poolLock(pool, 0);
-	n = pool->offs_size;
+	size = sizeof(*pool) + pool->chunks_bytes +
+	       pool->chunks_allocated * sizeof(*pool->chunks) +
+	       pool->offs_alloced * sizeof(*pool->offs);
+	if (pool->hash) {
+	    size += sizeof(*pool->hash) + pool->hash->numBuckets *
+		    (sizeof(*pool->hash->ctrl) + sizeof(*pool->hash->hashes) +
+		     sizeof(*pool->hash->keyids));
+	}
 	poolUnlock(pool);
     }
-    return n;
+    return size;
 }
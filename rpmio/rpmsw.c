@@ -3,6 +3,8 @@
  */
 
 #include "system.h"
+#include <pthread.h>
+#include <time.h>
 #include <rpm/rpmsw.h>
 #include "debug.h"
 
@@ -10,15 +12,38 @@ static rpmtime_t rpmsw_overhead = 0;
 
 static rpmtime_t rpmsw_cycles = 1;
 
-static int rpmsw_initialized = 0;
+static pthread_once_t rpmsw_initialized = PTHREAD_ONCE_INIT;
+
+static void rpmswOnce(void)
+{
+    (void) rpmswInit();
+}
+
+/*
+ * Time stamps come from the monotonic clock, which is immune to wall clock
+ * adjustments and served from the vDSO on Linux, making it cheap enough to
+ * use for per-file operations. The stamp is kept in the timeval member of
+ * struct rpmsw_s, in microsecond resolution.
+ */
+static int swNow(rpmsw sw)
+{
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0) {
+	sw->u.tv.tv_sec = ts.tv_sec;
+	sw->u.tv.tv_usec = ts.tv_nsec / 1000;
+	return 0;
+    }
+#endif
+    return gettimeofday(&sw->u.tv, NULL);
+}
 
 rpmsw rpmswNow(rpmsw sw)
 {
-    if (!rpmsw_initialized)
-	(void) rpmswInit();
+    pthread_once(&rpmsw_initialized, rpmswOnce);
     if (sw == NULL)
 	return NULL;
-    if (gettimeofday(&sw->u.tv, NULL))
+    if (swNow(sw))
     	return NULL;
     return sw;
 }
@@ -61,16 +86,15 @@ rpmtime_t rpmswInit(void)
     rpmtime_t sum_overhead = 0;
     int i;
 
-    rpmsw_initialized = 1;
-
     rpmsw_overhead = 0;
     rpmsw_cycles = 0;
 
     /* Convergence for simultaneous cycles and overhead is overkill ... */
     for (i = 0; i < 3; i++) {
 	/* Calculate timing overhead in usecs. */
-	(void) rpmswNow(&begin);
-	sum_overhead += rpmswDiff(rpmswNow(&end), &begin);
+	(void) swNow(&begin);
+	(void) swNow(&end);
+	sum_overhead += rpmswDiff(&end, &begin);
 
 	rpmsw_overhead = sum_overhead/(i+1);
     }
@@ -78,15 +102,30 @@ rpmtime_t rpmswInit(void)
     return rpmsw_overhead;
 }
 
+/*
+ * The counters are updated atomically so concurrent operations don't lose
+ * counts. The begin stamp in rpmop can only track one operation at a time
+ * though, concurrent users should keep their own with rpmswAccount().
+ */
+static void opAdd(rpmop op, int count, size_t bytes, rpmtime_t usecs)
+{
+    if (count)
+	__atomic_fetch_add(&op->count, count, __ATOMIC_RELAXED);
+    if (bytes)
+	__atomic_fetch_add(&op->bytes, bytes, __ATOMIC_RELAXED);
+    if (usecs)
+	__atomic_fetch_add(&op->usecs, usecs, __ATOMIC_RELAXED);
+}
+
 int rpmswEnter(rpmop op, ssize_t rc)
 {
     if (op == NULL)
 	return 0;
 
-    op->count++;
+    opAdd(op, 1, 0, 0);
     if (rc < 0) {
-	op->bytes = 0;
-	op->usecs = 0;
+	__atomic_store_n(&op->bytes, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&op->usecs, 0, __ATOMIC_RELAXED);
     }
     (void) rpmswNow(&op->begin);
     return 0;
@@ -99,21 +138,28 @@ rpmtime_t rpmswExit(rpmop op, ssize_t rc)
     if (op == NULL)
 	return 0;
 
-    op->usecs += rpmswDiff(rpmswNow(&end), &op->begin);
-    if (rc > 0)
-	op->bytes += rc;
+    opAdd(op, 0, (rc > 0) ? rc : 0, rpmswDiff(rpmswNow(&end), &op->begin));
     op->begin = end;	/* structure assignment */
-    return op->usecs;
+    return __atomic_load_n(&op->usecs, __ATOMIC_RELAXED);
+}
+
+rpmtime_t rpmswAccount(rpmop op, rpmsw begin, ssize_t rc)
+{
+    struct rpmsw_s end;
+
+    if (op == NULL || begin == NULL)
+	return 0;
+
+    opAdd(op, 1, (rc > 0) ? rc : 0, rpmswDiff(rpmswNow(&end), begin));
+    return __atomic_load_n(&op->usecs, __ATOMIC_RELAXED);
 }
 
 rpmtime_t rpmswAdd(rpmop to, rpmop from)
 {
     rpmtime_t usecs = 0;
     if (to != NULL && from != NULL) {
-	to->count += from->count;
-	to->bytes += from->bytes;
-	to->usecs += from->usecs;
-	usecs = to->usecs;
+	opAdd(to, from->count, from->bytes, from->usecs);
+	usecs = __atomic_load_n(&to->usecs, __ATOMIC_RELAXED);
     }
     return usecs;
 }
@@ -122,10 +168,10 @@ rpmtime_t rpmswSub(rpmop to, rpmop from)
 {
     rpmtime_t usecs = 0;
     if (to != NULL && from != NULL) {
-	to->count -= from->count;
-	to->bytes -= from->bytes;
-	to->usecs -= from->usecs;
-	usecs = to->usecs;
+	__atomic_fetch_sub(&to->count, from->count, __ATOMIC_RELAXED);
+	__atomic_fetch_sub(&to->bytes, from->bytes, __ATOMIC_RELAXED);
+	__atomic_fetch_sub(&to->usecs, from->usecs, __ATOMIC_RELAXED);
+	usecs = __atomic_load_n(&to->usecs, __ATOMIC_RELAXED);
     }
     return usecs;
 }
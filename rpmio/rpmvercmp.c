@@ -136,3 +136,76 @@ int rpmvercmp(const char * a, const char * b)
     if (!*one) return -1; else return 1;
 }
 
+/*
+ * Collation key tokens, in the order rpmvercmp() sorts them: tilde is
+ * older than anything, including the end of the version, caret is newer
+ * than the end only. Alpha segments are older than numeric ones.
+ */
+enum {
+    VK_TILDE	= 0x01,
+    VK_END	= 0x02,
+    VK_CARET	= 0x03,
+    VK_ALPHA	= 0x04,	/* followed by the letters and a zero byte */
+    VK_NUM	= 0x05,	/* followed by digit count and the digits */
+};
+
+uint8_t *rpmverkey(const char *v, size_t *keylen)
+{
+    /* Worst case is a token byte and a 5 byte count per character */
+    uint8_t *key = xmalloc(6 * strlen(v) + 1);
+    uint8_t *k = key;
+    const char *s = v;
+
+    while (*s) {
+	if (*s == '~') {
+	    *k++ = VK_TILDE;
+	    s++;
+	} else if (*s == '^') {
+	    *k++ = VK_CARET;
+	    s++;
+	} else if (risdigit(*s)) {
+	    const char *se;
+	    size_t n;
+
+	    /* leading zeros don't count */
+	    while (*s == '0') s++;
+	    for (se = s; risdigit(*se); se++) {};
+	    n = se - s;
+
+	    /* numbers with more digits are newer, encode the count first */
+	    *k++ = VK_NUM;
+	    if (n < 0xff) {
+		*k++ = n;
+	    } else {
+		*k++ = 0xff;
+		*k++ = (n >> 24) & 0xff;
+		*k++ = (n >> 16) & 0xff;
+		*k++ = (n >> 8) & 0xff;
+		*k++ = n & 0xff;
+	    }
+	    memcpy(k, s, n);
+	    k += n;
+	    s = se;
+	} else if (risalpha(*s)) {
+	    *k++ = VK_ALPHA;
+	    while (risalpha(*s))
+		*k++ = *s++;
+	    *k++ = '\0';
+	} else {
+	    /* everything else is a separator */
+	    s++;
+	}
+    }
+    *k++ = VK_END;
+
+    if (keylen)
+	*keylen = k - key;
+    return key;
+}
+
+int rpmverkeycmp(const uint8_t *a, size_t alen, const uint8_t *b, size_t blen)
+{
+    /* A key is never a prefix of another key, no need to look at lengths */
+    int rc = memcmp(a, b, (alen < blen) ? alen : blen);
+    return (rc > 0) - (rc < 0);
+}
@@ -170,12 +170,7 @@ static int doSign(poptContext optCon, struct rpmSignArgs *sargs)
     }
 #endif
 
-    const char *arg;
-    rc = 0;
-    while ((arg = poptGetArg(optCon)) != NULL) {
-	if (rpmPkgSign(arg, sargs) < 0)
-	    rc++;
-    }
+    rc = rpmPkgSignArgv((ARGV_const_t) poptGetArgs(optCon), sargs);
 
 exit:
     free(name);
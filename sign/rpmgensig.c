@@ -6,9 +6,13 @@
 #include "system.h"
 
 #include <errno.h>
+#include <pthread.h>
 #include <sys/wait.h>
 #include <popt.h>
 #include <fcntl.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #ifdef WITH_FSVERITY
 #include <libfsverity.h>
 #endif
@@ -188,55 +192,73 @@ exit:
     return sigtd;
 }
 
+/* The file name macros of the sign command are global state */
+static pthread_mutex_t signCmdLock = PTHREAD_MUTEX_INITIALIZER;
+
 static int runGPG(sigTarget sigt, const char *sigfile)
 {
     int pid = 0, status;
-    int pipefd[2];
+    int pipefd[2] = { -1, -1 };
     FILE *fpipe = NULL;
     unsigned char buf[BUFSIZ];
     ssize_t count;
     ssize_t wantCount;
     rpm_loff_t size;
     int rc = 1; /* assume failure */
+    const char **av = NULL;
+    char *cmd = NULL;
+    char *gpg_path = NULL;
+
+    /*
+     * Expand everything before forking, packages may be signed from
+     * several threads at once. For the same reason the pipe must not
+     * leak into the signers of other packages.
+     */
+    pthread_mutex_lock(&signCmdLock);
+    rpmPushMacro(NULL, "__plaintext_filename", NULL, "-", -1);
+    rpmPushMacro(NULL, "__signature_filename", NULL, sigfile, -1);
+    cmd = rpmExpand("%{?__gpg_sign_cmd}", NULL);
+    rpmPopMacro(NULL, "__plaintext_filename");
+    rpmPopMacro(NULL, "__signature_filename");
+    pthread_mutex_unlock(&signCmdLock);
+
+    gpg_path = rpmExpand("%{?_gpg_path}", NULL);
 
-    if (pipe(pipefd) < 0) {
+    if (poptParseArgvString(cmd, NULL, &av)) {
+	rpmlog(RPMLOG_ERR, _("Invalid sign command: %s\n"), cmd);
+	goto exit;
+    }
+
+    if (pipe2(pipefd, O_CLOEXEC) < 0) {
         rpmlog(RPMLOG_ERR, _("Could not create pipe for signing: %m\n"));
         goto exit;
     }
 
-    rpmPushMacro(NULL, "__plaintext_filename", NULL, "-", -1);
-    rpmPushMacro(NULL, "__signature_filename", NULL, sigfile, -1);
-
     if (!(pid = fork())) {
-	char *const *av;
-	char *cmd = NULL;
 	const char *tty = ttyname(STDIN_FILENO);
-	const char *gpg_path = NULL;
 
 	if (!getenv("GPG_TTY") && (!tty || setenv("GPG_TTY", tty, 0)))
 	    rpmlog(RPMLOG_WARNING, _("Could not set GPG_TTY to stdin: %m\n"));
 
-	gpg_path = rpmExpand("%{?_gpg_path}", NULL);
-	if (gpg_path && *gpg_path != '\0')
+	if (*gpg_path != '\0')
 	    (void) setenv("GNUPGHOME", gpg_path, 1);
 
 	dup2(pipefd[0], STDIN_FILENO);
 	close(pipefd[1]);
 
-	cmd = rpmExpand("%{?__gpg_sign_cmd}", NULL);
-	rc = poptParseArgvString(cmd, NULL, (const char ***)&av);
-	if (!rc)
-	    rc = execve(av[0], av+1, environ);
+	execve(av[0], (char *const *) av + 1, environ);
 
 	rpmlog(RPMLOG_ERR, _("Could not exec %s: %s\n"), "gpg",
 			strerror(errno));
 	_exit(EXIT_FAILURE);
     }
 
-    rpmPopMacro(NULL, "__plaintext_filename");
-    rpmPopMacro(NULL, "__signature_filename");
-
     close(pipefd[0]);
+    if (pid < 0) {
+	rpmlog(RPMLOG_ERR, _("Could not fork signer: %m\n"));
+	goto exit;
+    }
+
     fpipe = fdopen(pipefd[1], "w");
     if (!fpipe) {
 	rpmlog(RPMLOG_ERR, _("Could not open pipe for writing: %m\n"));
@@ -270,16 +292,21 @@ exit:
 
     if (fpipe)
 	fclose(fpipe);
-    if (pipefd[1])
+    else if (pipefd[1] >= 0)
 	close(pipefd[1]);
 
-    (void) waitpid(pid, &status, 0);
-    pid = 0;
-    if (!WIFEXITED(status) || WEXITSTATUS(status)) {
-	rpmlog(RPMLOG_ERR, _("gpg exec failed (%d)\n"), WEXITSTATUS(status));
-    } else {
-	rc = 0;
+    if (pid > 0) {
+	(void) waitpid(pid, &status, 0);
+	if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+	    rpmlog(RPMLOG_ERR, _("gpg exec failed (%d)\n"),
+		   WEXITSTATUS(status));
+	} else {
+	    rc = 0;
+	}
     }
+    free(av);
+    free(cmd);
+    free(gpg_path);
     return rc;
 }
 
@@ -461,6 +488,28 @@ static rpmRC includeFileSignatures(Header *sigp, Header *hdrp)
 #endif
 }
 
+/*
+ * Number of threads to sign with, from %_sign_threads: undefined or
+ * negative means serially, zero one per online CPU.
+ */
+static int signThreads(void)
+{
+    int nthreads = 1;
+#ifdef _OPENMP
+    char *val = rpmExpand("%{?_sign_threads}", NULL);
+
+    if (*val) {
+	nthreads = rpmExpandNumeric("%{?_sign_threads}");
+	if (nthreads == 0)
+	    nthreads = omp_get_num_procs();
+	if (nthreads < 1)
+	    nthreads = 1;
+    }
+    free(val);
+#endif
+    return nthreads;
+}
+
 static rpmRC includeVeritySignatures(FD_t fd, Header *sigp, Header *hdrp)
 {
 #ifdef WITH_FSVERITY
@@ -488,7 +537,8 @@ static rpmRC includeVeritySignatures(FD_t fd, Header *sigp, Header *hdrp)
 	    }
     }
     if (key && cert) {
-	    rc = rpmSignVerity(fd, *sigp, *hdrp, key, keypass, cert, algo);
+	    rc = rpmSignVerity(fd, *sigp, *hdrp, key, keypass, cert, algo,
+			       signThreads());
     } else {
 	rpmlog(RPMLOG_ERR, _("fsverity signatures requires a key and a cert\n"));
 	rc = RPMRC_FAIL;
@@ -553,6 +603,7 @@ static int rpmSign(const char *rpm, int deleting, int flags)
     struct sigTarget_s sigt_v3;
     struct sigTarget_s sigt_v4;
     unsigned int origSigSize;
+    off_t newSigSize;
     int insSig = 0;
 
     fprintf(stdout, "%s:\n", rpm);
@@ -646,7 +697,6 @@ static int rpmSign(const char *rpm, int deleting, int flags)
 	if (diff > 0 && diff < utd.count) {
 	    utd.count -= diff;
 	    headerMod(sigh, &utd);
-	    insSig = 1;
 	}
     }
 
@@ -655,6 +705,15 @@ static int rpmSign(const char *rpm, int deleting, int flags)
     if (sigh == NULL)	/* XXX can't happen */
 	goto exit;
 
+    /*
+     * If the padded signature fits exactly where the old one was,
+     * rewrite it in place and leave the header and payload alone.
+     */
+    newSigSize = headerSizeof(sigh, HEADER_MAGIC_YES);
+    newSigSize += (8 - (newSigSize % 8)) % 8;
+    if (newSigSize == headerStart - sigStart)
+	insSig = 1;
+
     if (insSig) {
 	/* Insert new signature into original rpm */
 	if (Fseek(fd, sigStart, SEEK_SET) < 0) {
@@ -733,10 +792,8 @@ exit:
     return res;
 }
 
-int rpmPkgSign(const char *path, const struct rpmSignArgs * args)
+static void pushSignArgs(const struct rpmSignArgs * args)
 {
-    int rc;
-
     if (args) {
 	if (args->hashalgo) {
 	    char *algo = NULL;
@@ -748,9 +805,10 @@ int rpmPkgSign(const char *path, const struct rpmSignArgs * args)
 	    rpmPushMacro(NULL, "_gpg_name", NULL, args->keyid, RMIL_GLOBAL);
 	}
     }
+}
 
-    rc = rpmSign(path, 0, args ? args->signflags : 0);
-
+static void popSignArgs(const struct rpmSignArgs * args)
+{
     if (args) {
 	if (args->hashalgo) {
 	    rpmPopMacro(NULL, "_gpg_digest_algo");
@@ -759,10 +817,48 @@ int rpmPkgSign(const char *path, const struct rpmSignArgs * args)
 	    rpmPopMacro(NULL, "_gpg_name");
 	}
     }
+}
+
+int rpmPkgSign(const char *path, const struct rpmSignArgs * args)
+{
+    int rc;
+
+    pushSignArgs(args);
+    rc = rpmSign(path, 0, args ? args->signflags : 0);
+    popSignArgs(args);
 
     return rc;
 }
 
+/*
+ * File signing libraries aren't known to be thread-safe, packages with
+ * file signatures go serially (fsverity uses the threads per file).
+ */
+int rpmPkgSignArgv(ARGV_const_t paths, const struct rpmSignArgs * args)
+{
+    rpmSignFlags flags = args ? args->signflags : 0;
+    int npaths = argvCount(paths);
+    int nthreads = 1;
+    int failed = 0;
+
+    if (!(flags & (RPMSIGN_FLAG_IMA | RPMSIGN_FLAG_FSVERITY)))
+	nthreads = signThreads();
+
+    if (nthreads > npaths)
+	nthreads = (npaths > 0) ? npaths : 1;
+
+    pushSignArgs(args);
+    #pragma omp parallel for schedule(dynamic, 1) num_threads(nthreads) \
+		reduction(+:failed)
+    for (int i = 0; i < npaths; i++) {
+	if (rpmSign(paths[i], 0, flags) < 0)
+	    failed++;
+    }
+    popSignArgs(args);
+
+    return failed;
+}
+
 int rpmPkgDelSign(const char *path, const struct rpmSignArgs * args)
 {
     return rpmSign(path, 1, 0);
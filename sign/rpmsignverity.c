@@ -6,6 +6,7 @@
 
 #include "system.h"
 
+#include <errno.h>
 #include <rpm/rpmlib.h>		/* RPMSIGTAG & related */
 #include <rpm/rpmlog.h>		/* rpmlog */
 #include <rpm/rpmfi.h>
@@ -22,6 +23,23 @@
 
 #define MAX_SIGNATURE_LENGTH 1024
 
+/*
+ * Payload files are read in batches of up to this many bytes or files,
+ * and each batch is digested and signed in parallel. Bigger files are
+ * done straight from the payload stream.
+ */
+#define VERITY_BATCH_BYTES	(64 * 1024 * 1024)
+#define VERITY_BATCH_FILES	1024
+
+struct verityFile_s {
+    int idx;			/*!< file index */
+    char *fn;			/*!< file name (for debug output) */
+    uint8_t *data;		/*!< file contents */
+    rpm_loff_t size;		/*!< file size */
+    rpm_loff_t pos;		/*!< read position */
+    size_t sig_size;		/*!< signature size */
+};
+
 static int rpmVerityRead(void *opaque, void *buf, size_t size)
 {
 	int retval;
@@ -34,22 +52,34 @@ static int rpmVerityRead(void *opaque, void *buf, size_t size)
 	return retval;
 }
 
-static char *rpmVeritySignFile(rpmfi fi, size_t *sig_size, char *key,
-			       char *keypass, char *cert, uint16_t algo)
+static int verityBufRead(void *opaque, void *buf, size_t size)
+{
+    struct verityFile_s *vf = opaque;
+
+    if (size > vf->size - vf->pos)
+	return -EIO;
+    memcpy(buf, vf->data + vf->pos, size);
+    vf->pos += size;
+    return 0;
+}
+
+static rpm_loff_t verityFileSize(rpmfi fi)
+{
+    return S_ISLNK(rpmfiFMode(fi)) ? 0 : rpmfiFSize(fi);
+}
+
+static char *veritySign(void *src, int (*readfn)(void *, void *, size_t),
+			rpm_loff_t file_size, const char *fn, int fx,
+			size_t *sig_size, char *key, char *keypass,
+			char *cert, uint16_t algo)
 {
     struct libfsverity_merkle_tree_params params;
     struct libfsverity_signature_params sig_params;
     struct libfsverity_digest *digest = NULL;
-    rpm_loff_t file_size;
     char *digest_hex, *digest_base64, *sig_base64 = NULL, *sig_hex = NULL;
     uint8_t *sig = NULL;
     int status;
 
-    if (S_ISLNK(rpmfiFMode(fi)))
-	file_size = 0;
-    else
-	file_size = rpmfiFSize(fi);
-
     memset(&params, 0, sizeof(struct libfsverity_merkle_tree_params));
     params.version = 1;
     params.hash_algorithm = algo;
@@ -57,7 +87,7 @@ static char *rpmVeritySignFile(rpmfi fi, size_t *sig_size, char *key,
     params.salt_size = 0 /* salt_size */;
     params.salt = NULL /* salt */;
     params.file_size = file_size;
-    status = libfsverity_compute_digest(fi, rpmVerityRead, &params, &digest);
+    status = libfsverity_compute_digest(src, readfn, &params, &digest);
     if (status) {
 	rpmlog(RPMLOG_DEBUG, _("failed to compute digest\n"));
 	goto out;
@@ -66,13 +96,13 @@ static char *rpmVeritySignFile(rpmfi fi, size_t *sig_size, char *key,
     digest_hex = rpmhex(digest->digest, digest->digest_size);
     digest_base64 = rpmBase64Encode(digest->digest, digest->digest_size, -1);
     rpmlog(RPMLOG_DEBUG, _("file(size %li): %s: digest(%i): %s, idx %i\n"),
-	   file_size, rpmfiFN(fi), digest->digest_size, digest_hex,
-	   rpmfiFX(fi));
+	   file_size, fn, digest->digest_size, digest_hex, fx);
     rpmlog(RPMLOG_DEBUG, _("file(size %li): %s: digest sz (%i): base64 sz (%li), %s, idx %i\n"),
-	   file_size, rpmfiFN(fi), digest->digest_size, strlen(digest_base64),
-	   digest_base64, rpmfiFX(fi));
+	   file_size, fn, digest->digest_size, strlen(digest_base64),
+	   digest_base64, fx);
 
     free(digest_hex);
+    free(digest_base64);
 
     memset(&sig_params, 0, sizeof(struct libfsverity_signature_params));
     sig_params.keyfile = key;
@@ -85,7 +115,7 @@ static char *rpmVeritySignFile(rpmfi fi, size_t *sig_size, char *key,
     sig_hex = rpmhex(sig, *sig_size);
     sig_base64 = rpmBase64Encode(sig, *sig_size, -1);
     rpmlog(RPMLOG_DEBUG, _("%s: sig_size(%li), base64_size(%li), idx %i: signature:\n%s\n"),
-	   rpmfiFN(fi), *sig_size, strlen(sig_base64), rpmfiFX(fi), sig_hex);
+	   fn, *sig_size, strlen(sig_base64), fx, sig_hex);
  out:
     free(sig_hex);
 
@@ -94,8 +124,42 @@ static char *rpmVeritySignFile(rpmfi fi, size_t *sig_size, char *key,
     return sig_base64;
 }
 
+static char *rpmVeritySignFile(rpmfi fi, size_t *sig_size, char *key,
+			       char *keypass, char *cert, uint16_t algo)
+{
+    return veritySign(fi, rpmVerityRead, verityFileSize(fi), rpmfiFN(fi),
+		      rpmfiFX(fi), sig_size, key, keypass, cert, algo);
+}
+
+/* Digest and sign a batch of files read from the payload in parallel */
+static void verityFlush(struct verityFile_s *batch, int *nbatch,
+			rpm_loff_t *nbytes, char **signatures,
+			size_t *sig_size, char *key, char *keypass,
+			char *cert, uint16_t algo, int nthreads)
+{
+    int n = *nbatch;
+
+    #pragma omp parallel for schedule(dynamic, 1) num_threads(nthreads)
+    for (int i = 0; i < n; i++) {
+	struct verityFile_s *vf = &batch[i];
+	signatures[vf->idx] = veritySign(vf, verityBufRead, vf->size, vf->fn,
+					 vf->idx, &vf->sig_size,
+					 key, keypass, cert, algo);
+    }
+
+    for (int i = 0; i < n; i++) {
+	struct verityFile_s *vf = &batch[i];
+	*sig_size = vf->sig_size;
+	free(vf->data);
+	free(vf->fn);
+	memset(vf, 0, sizeof(*vf));
+    }
+    *nbatch = 0;
+    *nbytes = 0;
+}
+
 rpmRC rpmSignVerity(FD_t fd, Header sigh, Header h, char *key,
-		    char *keypass, char *cert, uint16_t algo)
+		    char *keypass, char *cert, uint16_t algo, int nthreads)
 {
     int rc;
     FD_t gzdi;
@@ -109,9 +173,12 @@ rpmRC rpmSignVerity(FD_t fd, Header sigh, Header h, char *key,
     char *rpmio_flags = NULL;
     char *sig_hex;
     char **signatures = NULL;
-    size_t sig_size;
+    size_t sig_size = 0;
     int nr_files, idx;
     uint32_t algo32;
+    struct verityFile_s *batch = NULL;
+    int nbatch = 0;
+    rpm_loff_t nbytes = 0;
 
     Fseek(fd, 0, SEEK_SET);
     rpmtsSetVSFlags(ts, RPMVSF_MASK_NODIGESTS | RPMVSF_MASK_NOSIGNATURES |
@@ -135,6 +202,13 @@ rpmRC rpmSignVerity(FD_t fd, Header sigh, Header h, char *key,
     if (!gzdi)
 	rpmlog(RPMLOG_DEBUG, _("Fdopen() failed\n"));
 
+    struct rpmtd_s dict;
+    if (gzdi && headerGet(h, RPMTAG_PAYLOADDICT, &dict, HEADERGET_MINMEM)) {
+	if (fdSetDictionary(gzdi, dict.data, dict.count))
+	    rpmlog(RPMLOG_DEBUG, _("fdSetDictionary() failed\n"));
+	rpmtdFreeData(&dict);
+    }
+
     files = rpmfilesNew(NULL, h, RPMTAG_BASENAMES, RPMFI_FLAGS_QUERY);
     fi = rpmfiNewArchiveReader(gzdi, files,
 			       RPMFI_ITER_READ_ARCHIVE_OMIT_HARDLINKS);
@@ -161,12 +235,50 @@ rpmRC rpmSignVerity(FD_t fd, Header sigh, Header h, char *key,
     rpmlog(RPMLOG_DEBUG, _("file count - header: %i, payload %i\n"),
 	   nr_files, rpmfiFC(fi));
 
+    if (nthreads > 1)
+	batch = xcalloc(VERITY_BATCH_FILES, sizeof(*batch));
+
+    /*
+     * The payload can only be decoded serially, threads get to work on
+     * whole files read from it.
+     */
     while (rpmfiNext(fi) >= 0) {
+	rpm_loff_t size = verityFileSize(fi);
+	struct verityFile_s *vf;
+
 	idx = rpmfiFX(fi);
 
-	signatures[idx] = rpmVeritySignFile(fi, &sig_size, key, keypass, cert,
-					    algo);
+	if (batch == NULL || size > VERITY_BATCH_BYTES) {
+	    if (nbatch)
+		verityFlush(batch, &nbatch, &nbytes, signatures, &sig_size,
+			    key, keypass, cert, algo, nthreads);
+	    signatures[idx] = rpmVeritySignFile(fi, &sig_size, key, keypass,
+						cert, algo);
+	    continue;
+	}
+
+	vf = &batch[nbatch];
+	vf->idx = idx;
+	vf->fn = xstrdup(rpmfiFN(fi));
+	vf->size = size;
+	vf->data = xmalloc(size ? size : 1);
+	if (size && rpmfiArchiveRead(fi, vf->data, size) != size) {
+	    rpmlog(RPMLOG_DEBUG, _("%s: failed to read file data\n"), vf->fn);
+	    free(vf->data);
+	    free(vf->fn);
+	    memset(vf, 0, sizeof(*vf));
+	    continue;
+	}
+	nbatch++;
+	nbytes += size;
+
+	if (nbatch == VERITY_BATCH_FILES || nbytes >= VERITY_BATCH_BYTES)
+	    verityFlush(batch, &nbatch, &nbytes, signatures, &sig_size,
+			key, keypass, cert, algo, nthreads);
     }
+    if (nbatch)
+	verityFlush(batch, &nbatch, &nbytes, signatures, &sig_size,
+		    key, keypass, cert, algo, nthreads);
 
     while (rpmfiNext(hfi) >= 0) {
 	idx = rpmfiFX(hfi);
@@ -216,6 +328,7 @@ rpmRC rpmSignVerity(FD_t fd, Header sigh, Header h, char *key,
     rc = RPMRC_OK;
  out:
     signatures = _free(signatures);
+    free(batch);
     Fseek(fd, offset, SEEK_SET);
 
     rpmfilesFree(files);
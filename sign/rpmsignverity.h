@@ -23,11 +23,13 @@ extern "C" {
  * @param key		signing key
  * @param keypass	signing key password
  * @param cert		signing cert
+ * @param algo		fsverity hash algorithm (0 for default)
+ * @param nthreads	number of threads to compute signatures with
  * @return		RPMRC_OK on success
  */
 RPM_GNUC_INTERNAL
 rpmRC rpmSignVerity(FD_t fd, Header sigh, Header h, char *key,
-		    char *keypass, char *cert, uint16_t algo);
+		    char *keypass, char *cert, uint16_t algo, int nthreads);
 
 #ifdef __cplusplus
 }
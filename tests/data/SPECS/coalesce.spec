@@ -0,0 +1,19 @@
+Name:           coalesce%{n}
+Version:        1.0
+Release:        1
+Summary:        Testing scriptlet coalescing
+Group:          Testing
+License:        GPL
+BuildArch:	noarch
+
+%description
+%{summary}
+
+%files
+%defattr(-,root,root,-)
+
+%post
+echo COALESCE POST $*
+
+%postun
+echo COALESCE POSTUN $*
@@ -0,0 +1,931 @@
+/*
+ * Microbenchmarks of librpm core primitives.
+ *
+ * Each benchmark runs a fixed amount of work on fixed (pseudo random
+ * with a constant seed) input, repeated a number of times. The fastest
+ * repetition is reported, one JSON object per line on stdout:
+ *
+ *	{"name": "rpmvercmp", "ops": 200000, "ns": 1234567, "ns_per_op": 6.17}
+ *
+ * Throughput benchmarks add a "bytes" member.
+ *
+ * Usage: rpmbench [-r repeats] [-s scale] [-d dbpath] [name-prefix...]
+ *
+ * With -d, the rpmdb string pool benchmark loads the file names of the
+ * packages in the given rpmdb instead of generated ones.
+ */
+
+#include "system.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <rpm/rpmver.h>
+#include <rpm/rpmstrpool.h>
+#include <rpm/rpmds.h>
+#include <rpm/rpmtd.h>
+#include <rpm/header.h>
+#include <rpm/rpmcrypto.h>
+#include <rpm/rpmio.h>
+#include <rpm/rpmmacro.h>
+#include <rpm/rpmstring.h>
+#include <rpm/rpmbase64.h>
+#include <rpm/rpmfileutil.h>
+#include <rpm/argv.h>
+#include <rpm/rpmdb.h>
+#include <rpm/rpmlib.h>
+#include <rpm/rpmts.h>
+
+#undef HASHTYPE
+#undef HTKEYTYPE
+#undef HTDATATYPE
+#define HASHTYPE benchHash
+#define HTKEYTYPE const char *
+#define HTDATATYPE int
+#include "lib/rpmhash.H"
+#include "lib/rpmhash.C"
+
+#include "rpmio/rpmio_internal.h"
+#include "debug.h"
+
+#define NSTRINGS	10000
+#define NREADERS	4
+#define NFILES		2000
+#define IOSIZE		(4 * 1024 * 1024)
+/* generated rpmdb, about the size of a desktop installation */
+#define DBPKGS		2500
+#define DBFILES		140		/* files per package, on average */
+#define DBLOCALES	120
+
+struct bench_s {
+    const char *name;
+    void (*setup)(void);
+    /* run once, return the number of operations (and bytes) done */
+    unsigned long (*run)(unsigned long *bytes);
+    void (*cleanup)(void);
+};
+
+static int scale = 1;
+static const char *dbpath = NULL;
+static unsigned int seed;
+/* results go here so the work isn't optimized away */
+static volatile long sink;
+
+static unsigned int rnd(void)
+{
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 16) & 0x7fff;
+}
+
+static uint64_t now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static char **strings = NULL;
+
+static void makeStrings(void)
+{
+    strings = xmalloc(NSTRINGS * sizeof(*strings));
+    seed = 1;
+    for (int i = 0; i < NSTRINGS; i++)
+	rasprintf(&strings[i], "/usr/lib/bench/%04x/file-%d.so.%d",
+		  rnd() % 512, i, rnd() % 10);
+}
+
+static void freeStrings(void)
+{
+    for (int i = 0; i < NSTRINGS; i++)
+	free(strings[i]);
+    strings = _free(strings);
+}
+
+/****** rpmvercmp ******/
+
+static const char * const versions[] = {
+    "1.0", "1.0.1", "2.4.18", "2.4.18~rc1", "1.0^git1", "5.3.28",
+    "1:2.0", "1.0a", "1.0.0.0.1", "20230101", "0.9.8zh", "3.14159",
+};
+#define NVERSIONS (sizeof(versions) / sizeof(versions[0]))
+
+static unsigned long bench_vercmp(unsigned long *bytes)
+{
+    unsigned long ops = 0;
+    int sum = 0;
+    for (int n = 0; n < 5000 * scale; n++) {
+	for (int i = 0; i < NVERSIONS; i++) {
+	    sum += rpmvercmp(versions[i], versions[(i + n) % NVERSIONS]);
+	    ops++;
+	}
+    }
+    sink = sum;
+    return ops;
+}
+
+/****** string pool ******/
+
+static rpmstrPool pool = NULL;
+static rpmsid *sids = NULL;
+
+static unsigned long bench_poolid(unsigned long *bytes)
+{
+    unsigned long ops = 0;
+    for (int n = 0; n < scale; n++) {
+	rpmstrPool p = rpmstrPoolCreate();
+	/* every string twice: an insert and a lookup */
+	for (int r = 0; r < 2; r++) {
+	    for (int i = 0; i < NSTRINGS; i++) {
+		rpmstrPoolId(p, strings[i], 1);
+		ops++;
+	    }
+	}
+	rpmstrPoolFree(p);
+    }
+    return ops;
+}
+
+static void setup_poolstr(void)
+{
+    makeStrings();
+    pool = rpmstrPoolCreate();
+    sids = xmalloc(NSTRINGS * sizeof(*sids));
+    for (int i = 0; i < NSTRINGS; i++)
+	sids[i] = rpmstrPoolId(pool, strings[i], 1);
+    rpmstrPoolFreeze(pool, 0);
+}
+
+static unsigned long bench_poolstr(unsigned long *bytes)
+{
+    unsigned long ops = 0;
+    size_t len = 0;
+    for (int n = 0; n < 20 * scale; n++) {
+	for (int i = 0; i < NSTRINGS; i++) {
+	    len += strlen(rpmstrPoolStr(pool, sids[i]));
+	    ops++;
+	}
+    }
+    sink = len;
+    return ops;
+}
+
+static void cleanup_poolstr(void)
+{
+    pool = rpmstrPoolFree(pool);
+    sids = _free(sids);
+    freeStrings();
+}
+
+/*
+ * Lookups both ways from several threads while the main thread adds the
+ * strings to the pool. Ops are the lookups and additions done.
+ */
+static int poolWriting;
+
+static void *poolReader(void *arg)
+{
+    unsigned long ops = 0;
+    size_t len = 0;
+
+    while (__atomic_load_n(&poolWriting, __ATOMIC_ACQUIRE)) {
+	rpmsid n = rpmstrPoolNumStr(pool);
+	for (rpmsid sid = 1; sid <= n; sid++) {
+	    const char *s = rpmstrPoolStr(pool, sid);
+	    len += strlen(s);
+	    if (sid % 8 == 0)
+		len += rpmstrPoolId(pool, s, 0);
+	    ops++;
+	}
+    }
+    *(unsigned long *) arg = ops;
+    sink = len;
+    return NULL;
+}
+
+static unsigned long bench_poolcontended(unsigned long *bytes)
+{
+    pthread_t threads[NREADERS];
+    unsigned long nops[NREADERS];
+    unsigned long ops = 0;
+
+    for (int n = 0; n < scale; n++) {
+	pool = rpmstrPoolCreate();
+	__atomic_store_n(&poolWriting, 1, __ATOMIC_RELEASE);
+	for (int t = 0; t < NREADERS; t++)
+	    pthread_create(&threads[t], NULL, poolReader, &nops[t]);
+	for (int i = 0; i < NSTRINGS; i++) {
+	    rpmstrPoolId(pool, strings[i], 1);
+	    ops++;
+	}
+	__atomic_store_n(&poolWriting, 0, __ATOMIC_RELEASE);
+	for (int t = 0; t < NREADERS; t++) {
+	    pthread_join(threads[t], NULL);
+	    ops += nops[t];
+	}
+	pool = rpmstrPoolFree(pool);
+    }
+    return ops;
+}
+
+/*
+ * Adding the dirnames and basenames of all packages in an rpmdb to a
+ * pool, in header order, as a transaction or a query over all installed
+ * packages sharing one pool does. Either from a real rpmdb (-d), or from
+ * generated packages with the mix of shared and unique names of a real
+ * one: ~400k files in ~40k directories.
+ */
+static ARGV_t dbnames = NULL;
+
+static void addTag(Header h, rpmTagVal tag)
+{
+    struct rpmtd_s td;
+    if (headerGet(h, tag, &td, HEADERGET_MINMEM)) {
+	const char *s;
+	while ((s = rpmtdNextString(&td)))
+	    argvAdd(&dbnames, s);
+	rpmtdFreeData(&td);
+    }
+}
+
+static int loadRpmdb(void)
+{
+    rpmts ts = NULL;
+    rpmdbMatchIterator mi;
+    Header h;
+    int npkgs = 0;
+
+    if (rpmReadConfigFiles(NULL, NULL))
+	return -1;
+    rpmPushMacro(NULL, "_dbpath", NULL, dbpath, RMIL_CMDLINE);
+    ts = rpmtsCreate();
+    mi = rpmtsInitIterator(ts, RPMDBI_PACKAGES, NULL, 0);
+    while ((h = rpmdbNextIterator(mi)) != NULL) {
+	addTag(h, RPMTAG_DIRNAMES);
+	addTag(h, RPMTAG_BASENAMES);
+	npkgs++;
+    }
+    rpmdbFreeIterator(mi);
+    rpmtsFree(ts);
+    fprintf(stderr, "rpmbench: %d packages, %d names from %s\n",
+	    npkgs, argvCount(dbnames), dbpath);
+    return npkgs ? 0 : -1;
+}
+
+static void generateRpmdb(void)
+{
+    static const char *common[] = {
+	"COPYING", "LICENSE", "README", "README.md", "NEWS", "AUTHORS",
+	"__init__.py", "__init__.cpython-312.pyc", "index.html", "Makefile",
+	"config", "index.theme", "16x16", "32x32", "48x48", "scalable",
+    };
+    int ncommon = sizeof(common) / sizeof(common[0]);
+    char *s = NULL;
+
+    seed = 4;
+    for (int p = 0; p < DBPKGS; p++) {
+	int nfiles = 1 + rnd() % (2 * DBFILES);
+	int ndirs = 1 + nfiles / 9;
+	int nlocales = (rnd() % 4 == 0) ? DBLOCALES : 0;
+	char *pkg = NULL;
+
+	rasprintf(&pkg, "pkg%d-%c%c", p, 'a' + rnd() % 26, 'a' + rnd() % 26);
+	/* dirnames: shared system directories, then the package's own */
+	argvAdd(&dbnames, "/usr/bin/");
+	argvAdd(&dbnames, "/usr/lib64/");
+	for (int l = 0; l < nlocales; l++) {
+	    rasprintf(&s, "/usr/share/locale/l%d/LC_MESSAGES/", l);
+	    argvAdd(&dbnames, s);
+	    s = _free(s);
+	}
+	for (int d = 2; d < ndirs; d++) {
+	    rasprintf(&s, "/usr/%s/%s/sub%d/", (d % 3) ? "share" : "lib64",
+		      pkg, d);
+	    argvAdd(&dbnames, s);
+	    s = _free(s);
+	}
+	/* basenames: a third shared with other packages */
+	for (int f = 0; f < nfiles; f++) {
+	    if (f % 3 == 0)
+		argvAdd(&dbnames, common[rnd() % ncommon]);
+	    else {
+		rasprintf(&s, "%s-%d.%s", pkg, f, (f % 2) ? "so" : "h");
+		argvAdd(&dbnames, s);
+		s = _free(s);
+	    }
+	}
+	for (int l = 0; l < nlocales; l++) {
+	    rasprintf(&s, "%s.mo", pkg);
+	    argvAdd(&dbnames, s);
+	    s = _free(s);
+	}
+	free(pkg);
+    }
+}
+
+static void setup_pooldb(void)
+{
+    if (dbpath == NULL || loadRpmdb())
+	generateRpmdb();
+}
+
+static void cleanup_pooldb(void)
+{
+    dbnames = argvFree(dbnames);
+}
+
+static unsigned long bench_pooldb(unsigned long *bytes)
+{
+    unsigned long ops = 0;
+    size_t len = 0;
+    for (int n = 0; n < scale; n++) {
+	rpmstrPool p = rpmstrPoolCreate();
+	for (ARGV_const_t s = dbnames; s && *s; s++) {
+	    rpmstrPoolId(p, *s, 1);
+	    len += strlen(*s);
+	    ops++;
+	}
+	rpmstrPoolFreeze(p, 0);
+	rpmstrPoolFree(p);
+    }
+    *bytes = len;
+    return ops;
+}
+
+/****** rpmhash ******/
+
+static benchHash hash = NULL;
+
+static unsigned long bench_hashinsert(unsigned long *bytes)
+{
+    unsigned long ops = 0;
+    for (int n = 0; n < scale; n++) {
+	benchHash ht = benchHashCreate(NSTRINGS / 4, rstrhash, strcmp,
+					NULL, NULL);
+	for (int r = 0; r < 2; r++) {
+	    for (int i = 0; i < NSTRINGS; i++) {
+		benchHashAddEntry(ht, strings[i], i);
+		ops++;
+	    }
+	}
+	benchHashFree(ht);
+    }
+    return ops;
+}
+
+static void setup_hashlookup(void)
+{
+    makeStrings();
+    hash = benchHashCreate(NSTRINGS, rstrhash, strcmp, NULL, NULL);
+    for (int i = 0; i < NSTRINGS; i++)
+	benchHashAddEntry(hash, strings[i], i);
+}
+
+static unsigned long bench_hashlookup(unsigned long *bytes)
+{
+    unsigned long ops = 0;
+    int found = 0;
+    for (int n = 0; n < 20 * scale; n++) {
+	for (int i = 0; i < NSTRINGS; i++) {
+	    found += benchHashHasEntry(hash, strings[i]);
+	    ops++;
+	}
+    }
+    sink = found;
+    return ops;
+}
+
+static void cleanup_hashlookup(void)
+{
+    hash = benchHashFree(hash);
+    freeStrings();
+}
+
+/****** headers ******/
+
+static Header hdr = NULL;
+static void *blob = NULL;
+static unsigned int bloblen = 0;
+
+static void setup_header(void)
+{
+    const char *bn[NFILES];
+    const char *dn[NFILES / 16];
+    uint32_t di[NFILES], sizes[NFILES];
+    char *dirs[NFILES / 16];
+    char *names[NFILES];
+
+    seed = 2;
+    hdr = headerNew();
+    headerPutString(hdr, RPMTAG_NAME, "bench");
+    headerPutString(hdr, RPMTAG_VERSION, "1.2.3");
+    headerPutString(hdr, RPMTAG_RELEASE, "4.fc99");
+    headerPutString(hdr, RPMTAG_ARCH, "x86_64");
+    headerPutString(hdr, RPMTAG_SUMMARY, "Benchmark package header");
+    for (int i = 0; i < NFILES / 16; i++) {
+	rasprintf(&dirs[i], "/usr/share/bench/dir%d/", i);
+	dn[i] = dirs[i];
+    }
+    for (int i = 0; i < NFILES; i++) {
+	rasprintf(&names[i], "file-%d-%u.txt", i, rnd());
+	bn[i] = names[i];
+	di[i] = i % (NFILES / 16);
+	sizes[i] = rnd() * 7;
+    }
+    headerPutStringArray(hdr, RPMTAG_BASENAMES, bn, NFILES);
+    headerPutStringArray(hdr, RPMTAG_DIRNAMES, dn, NFILES / 16);
+    headerPutUint32(hdr, RPMTAG_DIRINDEXES, di, NFILES);
+    headerPutUint32(hdr, RPMTAG_FILESIZES, sizes, NFILES);
+
+    blob = headerExport(hdr, &bloblen);
+
+    for (int i = 0; i < NFILES / 16; i++)
+	free(dirs[i]);
+    for (int i = 0; i < NFILES; i++)
+	free(names[i]);
+}
+
+static void cleanup_header(void)
+{
+    hdr = headerFree(hdr);
+    blob = _free(blob);
+    bloblen = 0;
+}
+
+static unsigned long bench_hdrimport(unsigned long *bytes)
+{
+    unsigned long ops = 0;
+    for (int n = 0; n < 500 * scale; n++) {
+	Header h = headerImport(blob, bloblen, HEADERIMPORT_COPY);
+	headerFree(h);
+	ops++;
+    }
+    *bytes = ops * bloblen;
+    return ops;
+}
+
+static unsigned long bench_hdrexport(unsigned long *bytes)
+{
+    unsigned long ops = 0;
+    for (int n = 0; n < 500 * scale; n++) {
+	unsigned int len = 0;
+	free(headerExport(hdr, &len));
+	ops++;
+    }
+    *bytes = ops * bloblen;
+    return ops;
+}
+
+static unsigned long bench_hdrget(unsigned long *bytes)
+{
+    static const rpmTagVal tags[] = {
+	RPMTAG_NAME, RPMTAG_BASENAMES, RPMTAG_DIRINDEXES, RPMTAG_FILESIZES,
+    };
+    unsigned long ops = 0;
+    struct rpmtd_s td;
+    for (int n = 0; n < 20000 * scale; n++) {
+	for (int i = 0; i < sizeof(tags) / sizeof(tags[0]); i++) {
+	    headerGet(hdr, tags[i], &td, HEADERGET_MINMEM);
+	    rpmtdFreeData(&td);
+	    ops++;
+	}
+    }
+    return ops;
+}
+
+static unsigned long bench_hdrformat(unsigned long *bytes)
+{
+    const char *fmt = "%{name}-%{version}-%{release}.%{arch}\n"
+		      "[%{filesizes} %{dirindexes} %{basenames}\n]";
+    unsigned long ops = 0;
+    for (int n = 0; n < 50 * scale; n++) {
+	free(headerFormat(hdr, fmt, NULL));
+	ops++;
+    }
+    return ops;
+}
+
+/****** dependencies ******/
+
+static unsigned long bench_dscompare(unsigned long *bytes)
+{
+    static const struct { const char *evr; rpmsenseFlags sense; } reqs[] = {
+	{ "1.0", RPMSENSE_GREATER|RPMSENSE_EQUAL },
+	{ "2:1.0-1", RPMSENSE_LESS },
+	{ "1.2.3-4.fc99", RPMSENSE_EQUAL },
+	{ "1.2.3", RPMSENSE_GREATER },
+	{ "", RPMSENSE_ANY },
+    };
+    int nreqs = sizeof(reqs) / sizeof(reqs[0]);
+    rpmds prov = rpmdsSingle(RPMTAG_PROVIDENAME, "bench", "1.2.3-4.fc99",
+			     RPMSENSE_EQUAL);
+    rpmds req[nreqs];
+    unsigned long ops = 0;
+    int sum = 0;
+
+    for (int i = 0; i < nreqs; i++)
+	req[i] = rpmdsSingle(RPMTAG_REQUIRENAME, "bench", reqs[i].evr,
+			     reqs[i].sense);
+    for (int n = 0; n < 20000 * scale; n++) {
+	for (int i = 0; i < nreqs; i++) {
+	    sum += rpmdsCompare(prov, req[i]);
+	    ops++;
+	}
+    }
+    for (int i = 0; i < nreqs; i++)
+	rpmdsFree(req[i]);
+    rpmdsFree(prov);
+    sink = sum;
+    return ops;
+}
+
+/****** digests ******/
+
+static unsigned char *iobuf = NULL;
+
+static void setup_iobuf(void)
+{
+    /* Somewhat compressible, like typical package payloads */
+    iobuf = xmalloc(IOSIZE);
+    seed = 3;
+    for (int i = 0; i < IOSIZE; i++)
+	iobuf[i] = (rnd() % 4) ? "abcdefghij\n"[i % 11] : rnd();
+}
+
+static void cleanup_iobuf(void)
+{
+    iobuf = _free(iobuf);
+}
+
+static unsigned long bench_digest(unsigned long *bytes)
+{
+    rpmDigestBundle bundle = rpmDigestBundleNew();
+    unsigned long ops = 0;
+
+    rpmDigestBundleAdd(bundle, RPM_HASH_SHA256, RPMDIGEST_NONE);
+    rpmDigestBundleAdd(bundle, RPM_HASH_MD5, RPMDIGEST_NONE);
+    for (int n = 0; n < 4 * scale; n++) {
+	for (size_t off = 0; off < IOSIZE; off += 65536) {
+	    rpmDigestBundleUpdate(bundle, iobuf + off, 65536);
+	    ops++;
+	}
+    }
+    rpmDigestBundleFree(bundle);
+    *bytes = ops * 65536;
+    return ops;
+}
+
+/****** base64 ******/
+
+#define B64SIZE		65536
+
+static char *b64text = NULL;
+
+static void setup_base64(void)
+{
+    setup_iobuf();
+    b64text = rpmBase64Encode(iobuf, B64SIZE, -1);
+}
+
+static void cleanup_base64(void)
+{
+    b64text = _free(b64text);
+    cleanup_iobuf();
+}
+
+static unsigned long bench_b64encode(unsigned long *bytes)
+{
+    unsigned long ops = 0;
+    size_t len = 0;
+    for (int n = 0; n < 64 * scale; n++) {
+	char *s = rpmBase64Encode(iobuf, B64SIZE, -1);
+	len += strlen(s);
+	free(s);
+	ops++;
+    }
+    sink = len;
+    *bytes = ops * B64SIZE;
+    return ops;
+}
+
+static unsigned long bench_b64decode(unsigned long *bytes)
+{
+    unsigned long ops = 0;
+    size_t len = 0;
+    for (int n = 0; n < 64 * scale; n++) {
+	void *data = NULL;
+	size_t dlen = 0;
+	if (rpmBase64Decode(b64text, &data, &dlen) == 0)
+	    len += dlen;
+	free(data);
+	ops++;
+    }
+    sink = len;
+    *bytes = ops * B64SIZE;
+    return ops;
+}
+
+/****** glob ******/
+
+static char *globdir = NULL;
+
+static void setup_glob(void)
+{
+    char tmpl[] = "/tmp/rpmbench.XXXXXX";
+
+    if (mkdtemp(tmpl) == NULL)
+	return;
+    globdir = xstrdup(tmpl);
+    for (int i = 0; i < NFILES; i++) {
+	char *fn = NULL;
+	int fd;
+	rasprintf(&fn, "%s/file%d", globdir, i);
+	if ((fd = creat(fn, 0644)) >= 0)
+	    close(fd);
+	free(fn);
+    }
+}
+
+static void cleanup_glob(void)
+{
+    if (globdir) {
+	for (int i = 0; i < NFILES; i++) {
+	    char *fn = NULL;
+	    rasprintf(&fn, "%s/file%d", globdir, i);
+	    unlink(fn);
+	    free(fn);
+	}
+	rmdir(globdir);
+	globdir = _free(globdir);
+    }
+}
+
+static unsigned long globFiles(void)
+{
+    unsigned long ops = 0;
+    int nmatch = 0;
+    for (int n = 0; n < 20 * scale && globdir; n++) {
+	char *pattern = NULL;
+	int argc = 0;
+	rasprintf(&pattern, "%s/file%d*", globdir, n % 100);
+	if (rpmGlobPath(pattern, RPMGLOB_NONE, &argc, NULL) == 0)
+	    nmatch += argc;
+	free(pattern);
+	ops++;
+    }
+    sink = nmatch;
+    return ops;
+}
+
+static unsigned long bench_glob(unsigned long *bytes)
+{
+    return globFiles();
+}
+
+static unsigned long bench_globcached(unsigned long *bytes)
+{
+    unsigned long ops;
+    rpmGlobCacheEnable();
+    ops = globFiles();
+    rpmGlobCacheDisable();
+    return ops;
+}
+
+/****** compressors ******/
+
+static char *iofile = NULL;
+static const char *iomode = NULL;
+
+static int writeCompressed(const char *mode)
+{
+    char tmpl[] = "/tmp/rpmbench.XXXXXX";
+    char *wmode = rstrscat(NULL, "w", mode, NULL);
+    int fd = mkstemp(tmpl);
+    FD_t fdo = NULL;
+    int rc = -1;
+
+    if (fd < 0)
+	goto exit;
+    close(fd);
+    fdo = Fopen(tmpl, wmode);
+    if (fdo && !Ferror(fdo) &&
+	    Fwrite(iobuf, 1, IOSIZE, fdo) == IOSIZE) {
+	rc = Fclose(fdo);
+	fdo = NULL;
+    }
+
+exit:
+    if (fdo)
+	Fclose(fdo);
+    if (rc == 0)
+	iofile = xstrdup(tmpl);
+    else if (fd >= 0)
+	unlink(tmpl);
+    free(wmode);
+    return rc;
+}
+
+static unsigned long readCompressed(unsigned long *bytes, const char *mode)
+{
+    char *rmode = rstrscat(NULL, "r", mode, NULL);
+    unsigned char buf[65536];
+    unsigned long ops = 0;
+    ssize_t nb;
+
+    *bytes = 0;
+    for (int n = 0; n < scale && iofile; n++) {
+	FD_t fd = Fopen(iofile, rmode);
+	if (fd == NULL || Ferror(fd)) {
+	    if (fd)
+		Fclose(fd);
+	    break;
+	}
+	while ((nb = Fread(buf, 1, sizeof(buf), fd)) > 0) {
+	    *bytes += nb;
+	    ops++;
+	}
+	Fclose(fd);
+    }
+    free(rmode);
+    return ops;
+}
+
+static void cleanup_io(void)
+{
+    if (iofile) {
+	unlink(iofile);
+	iofile = _free(iofile);
+    }
+    cleanup_iobuf();
+}
+
+#define IOBENCH(_name, _mode) \
+static void setup_##_name(void) \
+{ \
+    setup_iobuf(); \
+    iomode = _mode; \
+    if (writeCompressed(iomode)) \
+	fprintf(stderr, "rpmbench: %s not available\n", iomode); \
+} \
+static unsigned long bench_##_name(unsigned long *bytes) \
+{ \
+    return readCompressed(bytes, iomode); \
+}
+
+IOBENCH(fdio, ".ufdio")
+IOBENCH(gzdio, ".gzdio")
+#ifdef HAVE_BZLIB_H
+IOBENCH(bzdio, ".bzdio")
+#endif
+#ifdef HAVE_LZMA_H
+IOBENCH(xzdio, ".xzdio")
+#endif
+#ifdef HAVE_ZSTD
+IOBENCH(zstdio, ".zstdio")
+#endif
+
+/****** macros ******/
+
+static void setup_macros(void)
+{
+    rpmDefineMacro(NULL, "bench_name bench", 0);
+    rpmDefineMacro(NULL, "bench_version 1.2.3", 0);
+    rpmDefineMacro(NULL, "bench_nvr %{bench_name}-%{bench_version}-1%{?bench_dist}", 0);
+    rpmDefineMacro(NULL, "bench_path(n) /usr/lib/%{-n*}/%{bench_nvr}", 0);
+}
+
+static void cleanup_macros(void)
+{
+    const char *names[] = {
+	"bench_name", "bench_version", "bench_nvr", "bench_path", NULL
+    };
+    for (const char **n = names; *n; n++)
+	rpmPopMacro(NULL, *n);
+}
+
+static unsigned long bench_macros(unsigned long *bytes)
+{
+    unsigned long ops = 0;
+    size_t len = 0;
+    for (int n = 0; n < 5000 * scale; n++) {
+	char *s = rpmExpand("%{bench_nvr} %{bench_path -n foo}", NULL);
+	len += strlen(s);
+	free(s);
+	ops++;
+    }
+    sink = len;
+    return ops;
+}
+
+static const struct bench_s benchmarks[] = {
+    { "rpmvercmp", NULL, bench_vercmp, NULL },
+    { "rpmstrPoolId", makeStrings, bench_poolid, freeStrings },
+    { "rpmstrPoolStr", setup_poolstr, bench_poolstr, cleanup_poolstr },
+    { "rpmstrPool-contended", makeStrings, bench_poolcontended, freeStrings },
+    { "rpmstrPool-rpmdb", setup_pooldb, bench_pooldb, cleanup_pooldb },
+    { "rpmhash-insert", makeStrings, bench_hashinsert, freeStrings },
+    { "rpmhash-lookup", setup_hashlookup, bench_hashlookup, cleanup_hashlookup },
+    { "headerImport", setup_header, bench_hdrimport, cleanup_header },
+    { "headerExport", setup_header, bench_hdrexport, cleanup_header },
+    { "headerGet", setup_header, bench_hdrget, cleanup_header },
+    { "headerFormat", setup_header, bench_hdrformat, cleanup_header },
+    { "rpmdsCompare", NULL, bench_dscompare, NULL },
+    { "rpmDigestBundleUpdate", setup_iobuf, bench_digest, cleanup_iobuf },
+    { "rpmBase64Encode", setup_base64, bench_b64encode, cleanup_base64 },
+    { "rpmBase64Decode", setup_base64, bench_b64decode, cleanup_base64 },
+    { "rpmGlobPath", setup_glob, bench_glob, cleanup_glob },
+    { "rpmGlobPath-cached", setup_glob, bench_globcached, cleanup_glob },
+    { "Fread-fdio", setup_fdio, bench_fdio, cleanup_io },
+    { "Fread-gzdio", setup_gzdio, bench_gzdio, cleanup_io },
+#ifdef HAVE_BZLIB_H
+    { "Fread-bzdio", setup_bzdio, bench_bzdio, cleanup_io },
+#endif
+#ifdef HAVE_LZMA_H
+    { "Fread-xzdio", setup_xzdio, bench_xzdio, cleanup_io },
+#endif
+#ifdef HAVE_ZSTD
+    { "Fread-zstdio", setup_zstdio, bench_zstdio, cleanup_io },
+#endif
+    { "rpmExpand", setup_macros, bench_macros, cleanup_macros },
+};
+
+static int selected(const char *name, int argc, char *argv[])
+{
+    if (argc == 0)
+	return 1;
+    for (int i = 0; i < argc; i++) {
+	if (rstreqn(name, argv[i], strlen(argv[i])))
+	    return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int repeats = 5;
+    int c;
+
+    while ((c = getopt(argc, argv, "r:s:d:")) != -1) {
+	switch (c) {
+	case 'r':
+	    repeats = atoi(optarg);
+	    break;
+	case 's':
+	    scale = atoi(optarg);
+	    break;
+	case 'd':
+	    dbpath = optarg;
+	    break;
+	default:
+	    fprintf(stderr, "usage: %s [-r repeats] [-s scale] [-d dbpath] "
+		    "[name...]\n", argv[0]);
+	    return EXIT_FAILURE;
+	}
+    }
+    if (repeats < 1)
+	repeats = 1;
+    if (scale < 1)
+	scale = 1;
+
+    for (int b = 0; b < sizeof(benchmarks) / sizeof(benchmarks[0]); b++) {
+	const struct bench_s *bench = &benchmarks[b];
+	uint64_t best = UINT64_MAX;
+	unsigned long ops = 0, bytes = 0;
+
+	if (!selected(bench->name, argc - optind, argv + optind))
+	    continue;
+
+	if (bench->setup)
+	    bench->setup();
+	for (int r = 0; r < repeats; r++) {
+	    uint64_t start = now();
+	    unsigned long nbytes = 0;
+	    unsigned long nops = bench->run(&nbytes);
+	    uint64_t elapsed = now() - start;
+	    if (elapsed < best) {
+		best = elapsed;
+		ops = nops;
+		bytes = nbytes;
+	    }
+	}
+	if (bench->cleanup)
+	    bench->cleanup();
+
+	if (ops == 0)
+	    continue;
+	printf("{\"name\": \"%s\", \"ops\": %lu, \"ns\": %llu, "
+	       "\"ns_per_op\": %.2f", bench->name, ops,
+	       (unsigned long long) best, (double) best / ops);
+	if (bytes)
+	    printf(", \"bytes\": %lu", bytes);
+	printf("}\n");
+	fflush(stdout);
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,573 @@
+/*
+ * Comparative benchmark of the rpmdb backends.
+ *
+ * For each backend, a scratch database is filled with generated package
+ * headers and a fixed set of operations is timed on it: adding the
+ * headers, iterating over all of them, getting random headers by number,
+ * Providename and Basenames lookups, walking the keys of the Basenames
+ * index, erasing a tenth of the packages and rebuilding the database.
+ * Each operation prints one JSON object per line on stdout with the
+ * number of operations, the total time, the per operation latency
+ * percentiles and, where it changes, the size of the database files:
+ *
+ *	{"backend": "sqlite", "op": "add", "ops": 2000, "ns": 123456789,
+ *	 "ops_per_sec": 16200.00, "p50_ns": 51234, "p90_ns": 70123,
+ *	 "p99_ns": 98765, "max_ns": 1234567, "disk_bytes": 12345678}
+ *
+ * The read-only bdb_ro backend can't create databases, it's measured on
+ * the read operations only, on an existing database given with -b.
+ *
+ * Usage: rpmdbbench [-n packages] [-m files] [-l lookups] [-d workdir]
+ *		     [-b bdbpath] [-k] [backend...]
+ */
+
+#include "system.h"
+
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <rpm/header.h>
+#include <rpm/rpmdb.h>
+#include <rpm/rpmfileutil.h>
+#include <rpm/rpmlib.h>
+#include <rpm/rpmmacro.h>
+#include <rpm/rpmstring.h>
+#include <rpm/rpmtd.h>
+#include <rpm/rpmts.h>
+
+#include "debug.h"
+
+static int npkgs = 2000;
+static int nfiles = 20;
+static int nlookups = 5000;
+static unsigned int seed;
+/* results go here so the work isn't optimized away */
+static volatile long sink;
+
+static unsigned int rnd(void)
+{
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 16) & 0x7fff;
+}
+
+static uint64_t now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* A plausible installed package header, the same for all backends */
+static Header makeHeader(int n)
+{
+    Header h = headerNew();
+    int ndirs = (nfiles + 7) / 8;
+    const char *pn[3], *pv[3], *rn[2], *rv[2];
+    const char **bn = xcalloc(nfiles, sizeof(*bn));
+    const char **dn = xcalloc(ndirs, sizeof(*dn));
+    uint32_t *di = xcalloc(nfiles, sizeof(*di));
+    uint32_t *sizes = xcalloc(nfiles, sizeof(*sizes));
+    uint16_t *modes = xcalloc(nfiles, sizeof(*modes));
+    uint32_t pf[3], rf[2];
+    uint32_t tid = 1000000000 + n;
+    char *name = NULL, *buf[3] = { NULL, NULL, NULL };
+    char *req[2] = { NULL, NULL };
+
+    rasprintf(&name, "bench%05d", n);
+    headerPutString(h, RPMTAG_NAME, name);
+    headerPutString(h, RPMTAG_VERSION, "1.0");
+    headerPutString(h, RPMTAG_RELEASE, "1");
+    headerPutString(h, RPMTAG_ARCH, "x86_64");
+    headerPutString(h, RPMTAG_OS, "linux");
+    headerPutString(h, RPMTAG_SUMMARY, "Database benchmark package");
+    headerPutString(h, RPMTAG_GROUP, "Unspecified");
+    headerPutUint32(h, RPMTAG_INSTALLTID, &tid, 1);
+    headerPutUint32(h, RPMTAG_INSTALLTIME, &tid, 1);
+
+    rasprintf(&buf[0], "%s", name);
+    rasprintf(&buf[1], "libbench%d.so.1()(64bit)", n);
+    rasprintf(&buf[2], "bench(%d)", n);
+    for (int i = 0; i < 3; i++) {
+	pn[i] = buf[i];
+	pv[i] = (i == 1) ? "" : "1.0-1";
+	pf[i] = (i == 1) ? 0 : RPMSENSE_EQUAL;
+    }
+    headerPutStringArray(h, RPMTAG_PROVIDENAME, pn, 3);
+    headerPutStringArray(h, RPMTAG_PROVIDEVERSION, pv, 3);
+    headerPutUint32(h, RPMTAG_PROVIDEFLAGS, pf, 3);
+
+    rasprintf(&req[0], "libbench%d.so.1()(64bit)", (n + 1) % npkgs);
+    rasprintf(&req[1], "bench(%d)", (n + 2) % npkgs);
+    for (int i = 0; i < 2; i++) {
+	rn[i] = req[i];
+	rv[i] = "";
+	rf[i] = 0;
+    }
+    headerPutStringArray(h, RPMTAG_REQUIRENAME, rn, 2);
+    headerPutStringArray(h, RPMTAG_REQUIREVERSION, rv, 2);
+    headerPutUint32(h, RPMTAG_REQUIREFLAGS, rf, 2);
+
+    for (int i = 0; i < ndirs; i++) {
+	char *d = NULL;
+	rasprintf(&d, "/usr/share/%s/dir%d/", name, i);
+	dn[i] = d;
+    }
+    for (int i = 0; i < nfiles; i++) {
+	char *b = NULL;
+	rasprintf(&b, "file%d", i);
+	bn[i] = b;
+	di[i] = i / 8;
+	sizes[i] = rnd() * 7;
+	modes[i] = 0100644;
+    }
+    headerPutStringArray(h, RPMTAG_BASENAMES, bn, nfiles);
+    headerPutStringArray(h, RPMTAG_DIRNAMES, dn, ndirs);
+    headerPutUint32(h, RPMTAG_DIRINDEXES, di, nfiles);
+    headerPutUint32(h, RPMTAG_FILESIZES, sizes, nfiles);
+    headerPutUint16(h, RPMTAG_FILEMODES, modes, nfiles);
+
+    /* Installed headers have an immutable region */
+    h = headerReload(h, RPMTAG_HEADERIMMUTABLE);
+
+    for (int i = 0; i < ndirs; i++)
+	free((char *) dn[i]);
+    for (int i = 0; i < nfiles; i++)
+	free((char *) bn[i]);
+    for (int i = 0; i < 3; i++)
+	free(buf[i]);
+    for (int i = 0; i < 2; i++)
+	free(req[i]);
+    free(name);
+    free(bn);
+    free(dn);
+    free(di);
+    free(sizes);
+    free(modes);
+    return h;
+}
+
+static uint64_t diskBytes;
+
+static int addSize(const char *path, const struct stat *st, int flag,
+		   struct FTW *ftw)
+{
+    if (flag == FTW_F)
+	diskBytes += st->st_blocks * 512;
+    return 0;
+}
+
+static int removePath(const char *path, const struct stat *st, int flag,
+		      struct FTW *ftw)
+{
+    return remove(path);
+}
+
+static int64_t dbSize(const char *dbpath)
+{
+    diskBytes = 0;
+    if (nftw(dbpath, addSize, 16, FTW_PHYS))
+	return -1;
+    return diskBytes;
+}
+
+static int cmpLatency(const void *a, const void *b)
+{
+    uint64_t la = *(const uint64_t *) a;
+    uint64_t lb = *(const uint64_t *) b;
+    return (la > lb) - (la < lb);
+}
+
+static uint64_t percentile(const uint64_t *lat, int n, int p)
+{
+    return lat[(uint64_t) (n - 1) * p / 100];
+}
+
+static void report(const char *backend, const char *op, uint64_t *lat,
+		   int n, uint64_t ns, const char *dbpath)
+{
+    if (n == 0)
+	return;
+
+    qsort(lat, n, sizeof(*lat), cmpLatency);
+    printf("{\"backend\": \"%s\", \"op\": \"%s\", \"ops\": %d, "
+	   "\"ns\": %llu, \"ops_per_sec\": %.2f, "
+	   "\"p50_ns\": %llu, \"p90_ns\": %llu, \"p99_ns\": %llu, "
+	   "\"max_ns\": %llu",
+	   backend, op, n, (unsigned long long) ns,
+	   ns ? (double) n * 1000000000 / ns : 0.0,
+	   (unsigned long long) percentile(lat, n, 50),
+	   (unsigned long long) percentile(lat, n, 90),
+	   (unsigned long long) percentile(lat, n, 99),
+	   (unsigned long long) lat[n - 1]);
+    if (dbpath)
+	printf(", \"disk_bytes\": %lld", (long long) dbSize(dbpath));
+    printf("}\n");
+    fflush(stdout);
+}
+
+/* Lookup keys, sampled from the database before timing anything */
+struct sample_s {
+    int n;
+    unsigned int *offsets;
+    char **provides;
+    char **files;
+};
+
+static void takeSample(rpmdb db, struct sample_s *s)
+{
+    rpmdbMatchIterator mi = rpmdbInitIterator(db, RPMDBI_PACKAGES, NULL, 0);
+    int alloced = 0;
+    Header h;
+
+    memset(s, 0, sizeof(*s));
+    while ((h = rpmdbNextIterator(mi)) != NULL) {
+	struct rpmtd_s td;
+	const char *str;
+
+	if (s->n == alloced) {
+	    alloced += 1024;
+	    s->offsets = xrealloc(s->offsets, alloced * sizeof(*s->offsets));
+	    s->provides = xrealloc(s->provides, alloced * sizeof(*s->provides));
+	    s->files = xrealloc(s->files, alloced * sizeof(*s->files));
+	}
+	s->offsets[s->n] = rpmdbGetIteratorOffset(mi);
+
+	str = NULL;
+	if (headerGet(h, RPMTAG_PROVIDENAME, &td, HEADERGET_MINMEM)) {
+	    rpmtdSetIndex(&td, rnd() % rpmtdCount(&td));
+	    str = rpmtdGetString(&td);
+	}
+	s->provides[s->n] = str ? xstrdup(str) : NULL;
+	rpmtdFreeData(&td);
+
+	str = NULL;
+	if (headerGet(h, RPMTAG_FILENAMES, &td, HEADERGET_EXT)) {
+	    rpmtdSetIndex(&td, rnd() % rpmtdCount(&td));
+	    str = rpmtdGetString(&td);
+	}
+	s->files[s->n] = str ? xstrdup(str) : NULL;
+	rpmtdFreeData(&td);
+
+	s->n++;
+    }
+    rpmdbFreeIterator(mi);
+}
+
+static void freeSample(struct sample_s *s)
+{
+    for (int i = 0; i < s->n; i++) {
+	free(s->provides[i]);
+	free(s->files[i]);
+    }
+    free(s->offsets);
+    free(s->provides);
+    free(s->files);
+}
+
+static int benchAdd(rpmts ts, const char *backend, const char *dbpath)
+{
+    uint64_t *lat = xcalloc(npkgs, sizeof(*lat));
+    uint64_t start, ns;
+    rpmtxn txn;
+    int n = 0;
+
+    start = now();
+    if ((txn = rpmtxnBegin(ts, RPMTXN_WRITE)) != NULL) {
+	for (n = 0; n < npkgs; n++) {
+	    Header h = makeHeader(n);
+	    uint64_t t = now();
+	    rpmRC rc = rpmtsImportHeader(txn, h, 0);
+	    lat[n] = now() - t;
+	    headerFree(h);
+	    if (rc != RPMRC_OK)
+		break;
+	}
+	rpmtxnEnd(txn);
+    }
+    ns = now() - start;
+
+    rpmtsCloseDB(ts);
+    report(backend, "add", lat, n, ns, dbpath);
+    free(lat);
+    return (n == npkgs) ? 0 : -1;
+}
+
+static void benchIterate(rpmdb db, const char *backend)
+{
+    uint64_t *lat = xcalloc(npkgs + 1, sizeof(*lat));
+    int alloced = npkgs + 1;
+    uint64_t start = now(), t = start;
+    rpmdbMatchIterator mi = rpmdbInitIterator(db, RPMDBI_PACKAGES, NULL, 0);
+    int n = 0;
+    Header h;
+
+    while ((h = rpmdbNextIterator(mi)) != NULL) {
+	uint64_t t2 = now();
+	if (n == alloced) {
+	    alloced *= 2;
+	    lat = xrealloc(lat, alloced * sizeof(*lat));
+	}
+	lat[n++] = t2 - t;
+	t = t2;
+	sink += headerIsEntry(h, RPMTAG_NAME);
+    }
+    rpmdbFreeIterator(mi);
+    report(backend, "iterate", lat, n, now() - start, NULL);
+    free(lat);
+}
+
+static void benchLookup(rpmdb db, const char *backend, const char *op,
+			rpmDbiTagVal tag, char **keys, unsigned int *offsets,
+			int nkeys)
+{
+    uint64_t *lat = xcalloc(nlookups, sizeof(*lat));
+    uint64_t start;
+    int n = 0;
+
+    seed = 3;
+    start = now();
+    for (int i = 0; i < nlookups && nkeys > 0; i++) {
+	int k = ((rnd() << 15) | rnd()) % nkeys;
+	rpmdbMatchIterator mi;
+	uint64_t t = now();
+	Header h;
+
+	if (offsets)
+	    mi = rpmdbInitIterator(db, tag, &offsets[k], sizeof(*offsets));
+	else if (keys[k])
+	    mi = rpmdbInitIterator(db, tag, keys[k], 0);
+	else
+	    continue;
+	while ((h = rpmdbNextIterator(mi)) != NULL)
+	    sink += headerIsEntry(h, RPMTAG_NAME);
+	rpmdbFreeIterator(mi);
+	lat[n++] = now() - t;
+    }
+    report(backend, op, lat, n, now() - start, NULL);
+    free(lat);
+}
+
+static void benchKeyscan(rpmdb db, const char *backend)
+{
+    int alloced = 1024;
+    uint64_t *lat = xcalloc(alloced, sizeof(*lat));
+    uint64_t start = now(), t = start;
+    rpmdbIndexIterator ii = rpmdbIndexIteratorInit(db, RPMDBI_BASENAMES);
+    const void *key;
+    size_t keylen;
+    int n = 0;
+
+    while (ii && rpmdbIndexIteratorNext(ii, &key, &keylen) == 0) {
+	uint64_t t2 = now();
+	if (n == alloced) {
+	    alloced *= 2;
+	    lat = xrealloc(lat, alloced * sizeof(*lat));
+	}
+	lat[n++] = t2 - t;
+	t = t2;
+	sink += rpmdbIndexIteratorNumPkgs(ii);
+    }
+    rpmdbIndexIteratorFree(ii);
+    report(backend, "keyscan", lat, n, now() - start, NULL);
+    free(lat);
+}
+
+/* Erase a tenth of the packages, one database only transaction each */
+static void benchErase(rpmts ts, const char *backend, const char *dbpath,
+		       struct sample_s *s)
+{
+    int nerase = s->n / 10 ? s->n / 10 : s->n;
+    uint64_t *lat = xcalloc(nerase, sizeof(*lat));
+    uint64_t start;
+    int n = 0;
+
+    rpmtsSetFlags(ts, RPMTRANS_FLAG_JUSTDB | RPMTRANS_FLAG_NOSCRIPTS |
+			RPMTRANS_FLAG_NOTRIGGERS | RPMTRANS_FLAG_NOPLUGINS |
+			RPMTRANS_FLAG_NOCONTEXTS);
+    rpmtsSetDBMode(ts, O_RDWR);
+    rpmtsOpenDB(ts, O_RDWR);
+
+    start = now();
+    for (int i = 0; i < nerase; i++) {
+	unsigned int off = s->offsets[i * (s->n / nerase)];
+	rpmdbMatchIterator mi;
+	uint64_t t = now();
+	Header h;
+	int rc = -1;
+
+	rpmtsEmpty(ts);
+	mi = rpmtsInitIterator(ts, RPMDBI_PACKAGES, &off, sizeof(off));
+	if ((h = rpmdbNextIterator(mi)) != NULL)
+	    rc = rpmtsAddEraseElement(ts, h, off);
+	rpmdbFreeIterator(mi);
+	if (rc == 0)
+	    rc = rpmtsRun(ts, NULL, 0);
+	if (rc)
+	    break;
+	lat[n++] = now() - t;
+    }
+    rpmtsEmpty(ts);
+    rpmtsCloseDB(ts);
+    report(backend, "erase", lat, n, now() - start, dbpath);
+    free(lat);
+}
+
+static void benchRebuild(rpmts ts, const char *backend, const char *dbpath)
+{
+    uint64_t lat = now();
+    int rc = rpmtsRebuildDB(ts);
+
+    lat = now() - lat;
+    if (rc == 0)
+	report(backend, "rebuild", &lat, 1, lat, dbpath);
+}
+
+static int runBackend(const char *backend, const char *dbpath, int readonly)
+{
+    rpmts ts;
+    struct sample_s sample;
+    int rc = 0;
+
+    rpmPushMacro(NULL, "_dbpath", NULL, dbpath, RMIL_CMDLINE);
+    rpmPushMacro(NULL, "_db_backend", NULL, backend, RMIL_CMDLINE);
+
+    ts = rpmtsCreate();
+    /* Measure the backends, not header digest checking */
+    rpmtsSetVSFlags(ts, _RPMVSF_NODIGESTS | _RPMVSF_NOSIGNATURES);
+
+    seed = 1;
+    if (!readonly) {
+	if (rpmioMkpath(dbpath, 0755, -1, -1) ||
+		benchAdd(ts, backend, dbpath)) {
+	    fprintf(stderr, "%s: failed to create database in %s\n",
+		    backend, dbpath);
+	    rc = -1;
+	    goto exit;
+	}
+    }
+
+    if (rpmtsOpenDB(ts, O_RDONLY)) {
+	fprintf(stderr, "%s: failed to open database in %s\n",
+		backend, dbpath);
+	rc = -1;
+	goto exit;
+    }
+
+    seed = 2;
+    takeSample(rpmtsGetRdb(ts), &sample);
+
+    benchIterate(rpmtsGetRdb(ts), backend);
+    benchLookup(rpmtsGetRdb(ts), backend, "get", RPMDBI_PACKAGES,
+		NULL, sample.offsets, sample.n);
+    benchLookup(rpmtsGetRdb(ts), backend, "providename", RPMDBI_PROVIDENAME,
+		sample.provides, NULL, sample.n);
+    benchLookup(rpmtsGetRdb(ts), backend, "basenames", RPMDBI_BASENAMES,
+		sample.files, NULL, sample.n);
+    benchKeyscan(rpmtsGetRdb(ts), backend);
+    rpmtsCloseDB(ts);
+
+    if (!readonly && sample.n > 0) {
+	benchErase(ts, backend, dbpath, &sample);
+	benchRebuild(ts, backend, dbpath);
+    }
+    freeSample(&sample);
+
+exit:
+    rpmtsFree(ts);
+    rpmPopMacro(NULL, "_db_backend");
+    rpmPopMacro(NULL, "_dbpath");
+    return rc;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *defbackends[] = { "sqlite", "ndb", "bdb_ro", NULL };
+    const char **backends = defbackends;
+    const char *bdbpath = NULL;
+    char *workdir = NULL;
+    int keep = 0;
+    int ec = EXIT_SUCCESS;
+    int c;
+
+    while ((c = getopt(argc, argv, "n:m:l:d:b:k")) != -1) {
+	switch (c) {
+	case 'n':
+	    npkgs = atoi(optarg);
+	    break;
+	case 'm':
+	    nfiles = atoi(optarg);
+	    break;
+	case 'l':
+	    nlookups = atoi(optarg);
+	    break;
+	case 'd':
+	    workdir = xstrdup(optarg);
+	    break;
+	case 'b':
+	    bdbpath = optarg;
+	    break;
+	case 'k':
+	    keep = 1;
+	    break;
+	default:
+	    fprintf(stderr, "usage: %s [-n packages] [-m files] [-l lookups] "
+		    "[-d workdir] [-b bdbpath] [-k] [backend...]\n", argv[0]);
+	    return EXIT_FAILURE;
+	}
+    }
+    if (npkgs < 1)
+	npkgs = 1;
+    if (nfiles < 1)
+	nfiles = 1;
+    if (nlookups < 1)
+	nlookups = 1;
+    if (optind < argc)
+	backends = (const char **) argv + optind;
+
+    if (rpmReadConfigFiles(NULL, NULL))
+	return EXIT_FAILURE;
+
+    if (workdir == NULL) {
+	workdir = xstrdup("/tmp/rpmdbbench.XXXXXX");
+	if (mkdtemp(workdir) == NULL) {
+	    perror(workdir);
+	    return EXIT_FAILURE;
+	}
+    } else if (rpmioMkpath(workdir, 0755, -1, -1)) {
+	perror(workdir);
+	return EXIT_FAILURE;
+    }
+
+    for (const char **b = backends; *b; b++) {
+	if (rstreq(*b, "bdb_ro")) {
+	    /* skip silently in the default set, there's nothing to read */
+	    if (bdbpath == NULL) {
+		if (backends != defbackends) {
+		    fprintf(stderr, "bdb_ro: needs a database path (-b)\n");
+		    ec = EXIT_FAILURE;
+		}
+		continue;
+	    }
+	    if (runBackend(*b, bdbpath, 1))
+		ec = EXIT_FAILURE;
+	} else {
+	    char *dbpath = rpmGetPath(workdir, "/", *b, NULL);
+	    if (runBackend(*b, dbpath, 0))
+		ec = EXIT_FAILURE;
+	    free(dbpath);
+	}
+    }
+
+    if (keep)
+	fprintf(stderr, "databases kept in %s\n", workdir);
+    else
+	nftw(workdir, removePath, 16, FTW_DEPTH | FTW_PHYS);
+    free(workdir);
+
+    return ec;
+}
@@ -0,0 +1,205 @@
+/*
+ * Test for rpmKeyringVerifySigs(): verify a batch of good, bad and
+ * unknown key header signatures on several threads, and check every
+ * result against the expected one.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include <rpm/header.h>
+#include <rpm/rpmcrypto.h>
+#include <rpm/rpmio.h>
+#include <rpm/rpmkeyring.h>
+#include <rpm/rpmpgp.h>
+#include <rpm/rpmtag.h>
+#include <rpm/rpmtd.h>
+
+#define LEAD_SIZE 96
+
+struct pkg_s {
+    pgpDigParams sig;		/* header signature */
+    DIGEST_CTX ctx;		/* hash of the header, as signed */
+};
+
+/* Read one header from its on-disk form, return the blob after magic */
+static unsigned char *readHeader(FD_t fd, size_t *sizep)
+{
+    unsigned char intro[16];
+    unsigned char *blob;
+    uint32_t il, dl;
+    size_t size;
+
+    if (Fread(intro, 1, sizeof(intro), fd) != sizeof(intro) ||
+	    memcmp(intro, rpm_header_magic, sizeof(rpm_header_magic)))
+	return NULL;
+    memcpy(&il, intro + 8, sizeof(il));
+    memcpy(&dl, intro + 12, sizeof(dl));
+    il = ntohl(il);
+    dl = ntohl(dl);
+    size = 8 + il * 16 + dl;
+    blob = malloc(size);
+    memcpy(blob, intro + 8, 8);
+    if (Fread(blob + 8, 1, size - 8, fd) != size - 8) {
+	free(blob);
+	return NULL;
+    }
+    *sizep = size;
+    return blob;
+}
+
+static int readPkg(const char *fn, struct pkg_s *pkg)
+{
+    unsigned char lead[LEAD_SIZE];
+    unsigned char pad[8];
+    unsigned char *sigblob = NULL, *blob = NULL;
+    size_t sigsize = 0, size = 0;
+    Header sigh = NULL;
+    struct rpmtd_s td;
+    int rc = -1;
+    FD_t fd = Fopen(fn, "r.ufdio");
+
+    if (fd == NULL || Ferror(fd))
+	goto exit;
+    if (Fread(lead, 1, sizeof(lead), fd) != sizeof(lead))
+	goto exit;
+    if ((sigblob = readHeader(fd, &sigsize)) == NULL)
+	goto exit;
+    /* the signature header is padded to a multiple of 8 */
+    if ((sigsize % 8) &&
+	    Fread(pad, 1, 8 - (sigsize % 8), fd) != 8 - (sigsize % 8))
+	goto exit;
+    if ((blob = readHeader(fd, &size)) == NULL)
+	goto exit;
+
+    if ((sigh = headerImport(sigblob, sigsize, 0)) == NULL)
+	goto exit;
+    sigblob = NULL;
+    if (!headerGet(sigh, RPMTAG_RSAHEADER, &td, HEADERGET_DEFAULT))
+	goto exit;
+    if (pgpPrtParams(td.data, td.count, PGPTAG_SIGNATURE, &pkg->sig) == 0) {
+	unsigned int algo = pgpDigParamsAlgo(pkg->sig, PGPVAL_HASHALGO);
+	pkg->ctx = rpmDigestInit(algo, RPMDIGEST_NONE);
+	rpmDigestUpdate(pkg->ctx, rpm_header_magic, sizeof(rpm_header_magic));
+	rpmDigestUpdate(pkg->ctx, blob, size);
+	rc = 0;
+    }
+    rpmtdFreeData(&td);
+
+exit:
+    if (rc)
+	fprintf(stderr, "%s: can't read header signature\n", fn);
+    headerFree(sigh);
+    free(sigblob);
+    free(blob);
+    Fclose(fd);
+    return rc;
+}
+
+static const char *rcname(rpmRC rc)
+{
+    switch (rc) {
+    case RPMRC_OK:	return "OK";
+    case RPMRC_FAIL:	return "BAD";
+    case RPMRC_NOKEY:	return "NOKEY";
+    default:		return "?";
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    struct pkg_s signed_pkg = { NULL, NULL };
+    struct pkg_s other_pkg = { NULL, NULL };
+    rpmKeyring keyring = NULL;
+    rpmPubkey key = NULL;
+    uint8_t *pkt = NULL;
+    size_t pktlen = 0;
+    int nsigs = 30;
+    int nthreads;
+    int fails = 0;
+
+    if (argc != 5) {
+	fprintf(stderr, "usage: %s <pubkey> <signed.rpm> <other-signed.rpm> "
+		"<nthreads>\n", argv[0]);
+	return EXIT_FAILURE;
+    }
+    nthreads = atoi(argv[4]);
+
+    if (pgpReadPkts(argv[1], &pkt, &pktlen) != PGPARMOR_PUBKEY ||
+	    (key = rpmPubkeyNew(pkt, pktlen)) == NULL) {
+	fprintf(stderr, "%s: can't read key\n", argv[1]);
+	return EXIT_FAILURE;
+    }
+    keyring = rpmKeyringNew();
+    rpmKeyringAddKey(keyring, key);
+
+    if (readPkg(argv[2], &signed_pkg) || readPkg(argv[3], &other_pkg))
+	return EXIT_FAILURE;
+
+    /*
+     * Every third signature each: the signature by the key in the keyring
+     * over its own header, the same one over another header and a
+     * signature by a key not in the keyring.
+     */
+    pgpDigParams *sigs = calloc(nsigs, sizeof(*sigs));
+    DIGEST_CTX *ctxs = calloc(nsigs, sizeof(*ctxs));
+    rpmRC *rcs = calloc(nsigs, sizeof(*rcs));
+    rpmRC *expect = calloc(nsigs, sizeof(*expect));
+    for (int i = 0; i < nsigs; i++) {
+	switch (i % 3) {
+	case 0:
+	    sigs[i] = signed_pkg.sig;
+	    ctxs[i] = rpmDigestDup(signed_pkg.ctx);
+	    expect[i] = RPMRC_OK;
+	    break;
+	case 1:
+	    sigs[i] = signed_pkg.sig;
+	    ctxs[i] = rpmDigestDup(other_pkg.ctx);
+	    expect[i] = RPMRC_FAIL;
+	    break;
+	case 2:
+	    sigs[i] = other_pkg.sig;
+	    ctxs[i] = rpmDigestDup(other_pkg.ctx);
+	    expect[i] = RPMRC_NOKEY;
+	    break;
+	}
+	rcs[i] = -1;
+    }
+
+    int nfailed = rpmKeyringVerifySigs(keyring, nsigs, sigs, ctxs, rcs,
+					nthreads);
+    int nexpect = 0;
+    for (int i = 0; i < nsigs; i++) {
+	if (rcs[i] != expect[i]) {
+	    printf("signature %d: %s, expected %s\n", i,
+		   rcname(rcs[i]), rcname(expect[i]));
+	    fails++;
+	}
+	if (expect[i] != RPMRC_OK)
+	    nexpect++;
+    }
+    if (nfailed != nexpect) {
+	printf("%d signatures not verified ok, expected %d\n",
+	       nfailed, nexpect);
+	fails++;
+    }
+    printf("%d signatures on %d threads: %d failed\n",
+	   nsigs, nthreads, nfailed);
+
+    for (int i = 0; i < nsigs; i++)
+	rpmDigestFinal(ctxs[i], NULL, NULL, 0);
+    rpmDigestFinal(signed_pkg.ctx, NULL, NULL, 0);
+    rpmDigestFinal(other_pkg.ctx, NULL, NULL, 0);
+    pgpDigParamsFree(signed_pkg.sig);
+    pgpDigParamsFree(other_pkg.sig);
+    free(sigs);
+    free(ctxs);
+    free(rcs);
+    free(expect);
+    rpmKeyringFree(keyring);
+    rpmPubkeyFree(key);
+    free(pkt);
+
+    return fails ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,375 @@
+/*
+ * Replay of a recorded transaction.
+ *
+ * With %_transaction_record_dir set, rpm leaves a copy of the inputs of
+ * each transaction: the installed package headers, the added packages
+ * (headers only) and the flags. This imports the headers into the
+ * database of a scratch root and runs the transaction again, timing each
+ * phase: importing the database, adding the elements, rpmtsCheck(),
+ * rpmtsOrder() and rpmtsRun(). The recorded packages have no payload, so
+ * the run is always done in test mode, which still does everything but
+ * unpacking and running scriptlets. Each phase prints one JSON object
+ * per line on stdout, the run includes the rpm --stats-format=json
+ * phase timings:
+ *
+ *	{"phase": "check", "ops": 120, "ns": 12345678, "rc": 0}
+ *
+ * Usage: rpmreplay [-r root] [-k] recorddir
+ */
+
+#include "system.h"
+
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <rpm/argv.h>
+#include <rpm/header.h>
+#include <rpm/rpmdb.h>
+#include <rpm/rpmfileutil.h>
+#include <rpm/rpmlib.h>
+#include <rpm/rpmmacro.h>
+#include <rpm/rpmps.h>
+#include <rpm/rpmstring.h>
+#include <rpm/rpmts.h>
+
+#include "debug.h"
+
+struct record_s {
+    rpmtransFlags flags;
+    rpmprobFilterFlags probfilter;
+    rpmVSFlags vsflags;
+    rpmVSFlags vfyflags;
+    int vfylevel;
+    rpm_color_t color;
+    rpm_color_t prefcolor;
+    ARGV_t elements;
+};
+
+static uint64_t now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void report(const char *phase, int ops, uint64_t ns, int rc,
+		   const char *stats)
+{
+    printf("{\"phase\": \"%s\", \"ops\": %d, \"ns\": %llu, \"rc\": %d",
+	   phase, ops, (unsigned long long) ns, rc);
+    if (stats) {
+	size_t len = strlen(stats);
+	while (len && stats[len - 1] == '\n')
+	    len--;
+	printf(", \"stats\": %.*s", (int) len, stats);
+    }
+    printf("}\n");
+    fflush(stdout);
+}
+
+static int removePath(const char *path, const struct stat *st, int flag,
+		      struct FTW *ftw)
+{
+    return remove(path);
+}
+
+static int readRecord(const char *recdir, struct record_s *rec)
+{
+    char *path = rpmGetPath(recdir, "/transaction", NULL);
+    FILE *f = fopen(path, "r");
+    char line[BUFSIZ];
+    int rc = 0;
+
+    memset(rec, 0, sizeof(*rec));
+    if (f == NULL) {
+	perror(path);
+	free(path);
+	return -1;
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+	char *val = strchr(line, ' ');
+	unsigned long n;
+
+	line[strcspn(line, "\n")] = '\0';
+	if (val == NULL)
+	    continue;
+	*val++ = '\0';
+	n = strtoul(val, NULL, 0);
+
+	if (rstreq(line, "flags"))
+	    rec->flags = n;
+	else if (rstreq(line, "probfilter"))
+	    rec->probfilter = n;
+	else if (rstreq(line, "vsflags"))
+	    rec->vsflags = n;
+	else if (rstreq(line, "vfyflags"))
+	    rec->vfyflags = n;
+	else if (rstreq(line, "vfylevel"))
+	    rec->vfylevel = n;
+	else if (rstreq(line, "color"))
+	    rec->color = n;
+	else if (rstreq(line, "prefcolor"))
+	    rec->prefcolor = n;
+	else if (rstreq(line, "install") || rstreq(line, "erase")) {
+	    char *e = rstrscat(NULL, line, " ", val, NULL);
+	    argvAdd(&rec->elements, e);
+	    free(e);
+	} else
+	    fprintf(stderr, "%s: unknown entry %s\n", path, line);
+    }
+    if (ferror(f))
+	rc = -1;
+    fclose(f);
+    free(path);
+    return rc;
+}
+
+/* Fill the scratch database, returning the new instances by position */
+static int importDb(rpmts ts, const char *recdir, unsigned int **instp,
+		    int *ninstp)
+{
+    char *path = rpmGetPath(recdir, "/rpmdb.hdr", NULL);
+    FD_t fd = Fopen(path, "r.ufdio");
+    unsigned int *inst = NULL;
+    uint64_t start;
+    rpmtxn txn;
+    int n = 0;
+    int rc = -1;
+    Header h;
+
+    if (fd == NULL || Ferror(fd)) {
+	fprintf(stderr, "%s: %s\n", path, Fstrerror(fd));
+	goto exit;
+    }
+
+    start = now();
+    if ((txn = rpmtxnBegin(ts, RPMTXN_WRITE)) != NULL) {
+	rc = 0;
+	while ((h = headerRead(fd, HEADER_MAGIC_YES)) != NULL) {
+	    if (rpmtsImportHeader(txn, h, 0) != RPMRC_OK) {
+		headerFree(h);
+		rc = -1;
+		break;
+	    }
+	    inst = xrealloc(inst, (n + 1) * sizeof(*inst));
+	    inst[n++] = headerGetInstance(h);
+	    headerFree(h);
+	}
+	rpmtxnEnd(txn);
+    }
+    rpmtsCloseDB(ts);
+    report("import", n, now() - start, rc, NULL);
+
+exit:
+    if (fd)
+	Fclose(fd);
+    free(path);
+    *instp = inst;
+    *ninstp = n;
+    return rc;
+}
+
+static int addElements(rpmts ts, const char *recdir,
+		       const struct record_s *rec, const unsigned int *inst,
+		       int ninst, ARGV_t *keys)
+{
+    uint64_t start = now();
+    int n = 0;
+    int rc = 0;
+
+    for (ARGV_const_t e = rec->elements; e && *e && rc == 0; e++) {
+	char fn[BUFSIZ];
+	unsigned int pos;
+	int op;
+
+	if (sscanf(*e, "install %d %s", &op, fn) == 2) {
+	    char *path = rpmGetPath(recdir, "/", fn, NULL);
+	    FD_t fd = Fopen(path, "r.ufdio");
+	    Header h = NULL;
+
+	    rc = -1;
+	    if (fd && !Ferror(fd) &&
+		    rpmReadPackageFile(ts, fd, path, &h) == RPMRC_OK) {
+		/* The key must live as long as the transaction set */
+		argvAdd(keys, path);
+		const char *key = (*keys)[argvCount(*keys) - 1];
+		if (op == 2)
+		    rc = rpmtsAddReinstallElement(ts, h, key);
+		else
+		    rc = rpmtsAddInstallElement(ts, h, key, (op == 1), NULL);
+	    }
+	    if (fd)
+		Fclose(fd);
+	    headerFree(h);
+	    free(path);
+	} else if (sscanf(*e, "erase %u", &pos) == 1 && pos < (unsigned int) ninst) {
+	    rpmdbMatchIterator mi;
+	    unsigned int off = inst[pos];
+	    Header h;
+
+	    rc = -1;
+	    mi = rpmtsInitIterator(ts, RPMDBI_PACKAGES, &off, sizeof(off));
+	    if ((h = rpmdbNextIterator(mi)) != NULL)
+		rc = rpmtsAddEraseElement(ts, h, off);
+	    rpmdbFreeIterator(mi);
+	} else {
+	    continue;
+	}
+	if (rc)
+	    fprintf(stderr, "failed to add element: %s\n", *e);
+	else
+	    n++;
+    }
+    report("add", n, now() - start, rc, NULL);
+    return rc;
+}
+
+static void *notify(const void *arg, const rpmCallbackType what,
+		    const rpm_loff_t amount, const rpm_loff_t total,
+		    fnpyKey key, void *data)
+{
+    static FD_t fd = NULL;
+
+    switch (what) {
+    case RPMCALLBACK_INST_OPEN_FILE:
+	fd = Fopen(key, "r.ufdio");
+	if (fd && Ferror(fd)) {
+	    Fclose(fd);
+	    fd = NULL;
+	}
+	return fd;
+    case RPMCALLBACK_INST_CLOSE_FILE:
+	if (fd)
+	    Fclose(fd);
+	fd = NULL;
+	break;
+    default:
+	break;
+    }
+    return NULL;
+}
+
+static int replay(const char *recdir, const char *root)
+{
+    struct record_s rec;
+    unsigned int *inst = NULL;
+    int ninst = 0;
+    ARGV_t keys = NULL;
+    char *dbpath = NULL;
+    uint64_t start;
+    rpmps ps;
+    rpmts ts;
+    int rc = -1;
+
+    if (readRecord(recdir, &rec))
+	return -1;
+
+    ts = rpmtsCreate();
+    rpmtsSetRootDir(ts, root);
+    dbpath = rpmGenPath(root, "%{_dbpath}", NULL);
+    if (rpmioMkpath(dbpath, 0755, -1, -1)) {
+	perror(dbpath);
+	goto exit;
+    }
+
+    if (importDb(ts, recdir, &inst, &ninst))
+	goto exit;
+
+    /* The recorded packages carry no signatures, nor a payload */
+    rpmtsSetVSFlags(ts, rec.vsflags | _RPMVSF_NOSIGNATURES | _RPMVSF_NOPAYLOAD);
+    rpmtsSetVfyFlags(ts, rec.vfyflags | _RPMVSF_NOSIGNATURES | _RPMVSF_NOPAYLOAD);
+    rpmtsSetVfyLevel(ts, rec.vfylevel & ~RPMSIG_SIGNATURE_TYPE);
+    rpmtsSetColor(ts, rec.color);
+    rpmtsSetPrefColor(ts, rec.prefcolor);
+    rpmtsSetFlags(ts, rec.flags | RPMTRANS_FLAG_TEST);
+    rpmtsSetNotifyCallback(ts, notify, NULL);
+
+    if (addElements(ts, recdir, &rec, inst, ninst, &keys))
+	goto exit;
+
+    start = now();
+    rc = rpmtsCheck(ts);
+    ps = rpmtsProblems(ts);
+    report("check", rpmtsNElements(ts), now() - start, rc, NULL);
+    if (rpmpsNumProblems(ps) > 0)
+	rpmpsPrint(stderr, ps);
+    rpmpsFree(ps);
+
+    start = now();
+    rc = rpmtsOrder(ts);
+    report("order", rpmtsNElements(ts), now() - start, rc, NULL);
+
+    start = now();
+    rc = rpmtsRun(ts, NULL, rec.probfilter);
+    {
+	uint64_t ns = now() - start;
+	char *stats = rpmtsFormatStats(ts, RPMTS_STATS_JSON);
+	report("run", rpmtsNElements(ts), ns, rc, stats);
+	free(stats);
+    }
+
+exit:
+    rpmtsFree(ts);
+    argvFree(rec.elements);
+    argvFree(keys);
+    free(inst);
+    free(dbpath);
+    return rc;
+}
+
+int main(int argc, char *argv[])
+{
+    char *root = NULL;
+    int keep = 0;
+    int ec = EXIT_SUCCESS;
+    int c;
+
+    while ((c = getopt(argc, argv, "r:k")) != -1) {
+	switch (c) {
+	case 'r':
+	    root = xstrdup(optarg);
+	    break;
+	case 'k':
+	    keep = 1;
+	    break;
+	default:
+	    optind = argc + 1;
+	    break;
+	}
+    }
+    if (optind != argc - 1) {
+	fprintf(stderr, "usage: %s [-r root] [-k] recorddir\n", argv[0]);
+	return EXIT_FAILURE;
+    }
+
+    if (rpmReadConfigFiles(NULL, NULL))
+	return EXIT_FAILURE;
+
+    if (root == NULL) {
+	root = xstrdup("/tmp/rpmreplay.XXXXXX");
+	if (mkdtemp(root) == NULL) {
+	    perror(root);
+	    return EXIT_FAILURE;
+	}
+    } else if (rpmioMkpath(root, 0755, -1, -1)) {
+	perror(root);
+	return EXIT_FAILURE;
+    }
+
+    if (replay(argv[optind], root))
+	ec = EXIT_FAILURE;
+
+    if (keep)
+	fprintf(stderr, "root kept in %s\n", root);
+    else
+	nftw(root, removePath, 16, FTW_DEPTH | FTW_PHYS);
+    free(root);
+
+    return ec;
+}
@@ -0,0 +1,84 @@
+/*
+ * Differential test for rpmverkey(): the collation keys must order
+ * exactly like rpmvercmp() on random version strings.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rpm/rpmver.h>
+
+static const char *cases[] = {
+    "1.0", "1.0.0", "1.0a", "1.0~rc1", "1.0^git1", "1.0~rc1^git1",
+    "1.0^", "1.0~", "1~~", "1_0", "01.001", "1.a", "a.1", "2.0.1a", "",
+    "10", "9", "000", "0", "1.0.", ".1.0", "~", "^", "a", "Z", "1..0",
+    "18446744073709551616", "18446744073709551617", NULL
+};
+
+static void randver(char *buf, int maxlen)
+{
+    static const char chars[] = "0123456789aZz~^._-+!\xe4";
+    int len = rand() % (maxlen + 1);
+    for (int i = 0; i < len; i++)
+	buf[i] = chars[rand() % (sizeof(chars) - 1)];
+    buf[len] = '\0';
+}
+
+static int check(const char *a, const char *b)
+{
+    size_t alen, blen;
+    uint8_t *akey = rpmverkey(a, &alen);
+    uint8_t *bkey = rpmverkey(b, &blen);
+    int exp = rpmvercmp(a, b);
+    int got = rpmverkeycmp(akey, alen, bkey, blen);
+
+    free(akey);
+    free(bkey);
+    if (exp != got) {
+	printf("mismatch: \"%s\" vs \"%s\": rpmvercmp %d, key %d\n",
+		a, b, exp, got);
+	return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int n = (argc > 1) ? atoi(argv[1]) : 200000;
+    int fails = 0;
+    char a[16], b[16];
+
+    for (const char **x = cases; *x; x++)
+	for (const char **y = cases; *y; y++)
+	    fails += check(*x, *y);
+
+    /* numbers too long for a single byte digit count */
+    char l1[302], l2[302];
+    memset(l1, '9', 300);
+    l1[300] = '\0';
+    memset(l2, '1', 301);
+    l2[301] = '\0';
+    fails += check(l1, l2);
+    fails += check(l2, l1);
+    l2[300] = '\0';
+    fails += check(l1, l2);
+    fails += check(l1, l1 + 46);
+
+    srand(n);
+    for (int i = 0; i < n && fails < 10; i++) {
+	randver(a, sizeof(a) - 1);
+	/* mostly compare related versions, they're the interesting case */
+	if (rand() % 2) {
+	    size_t len = strlen(a);
+	    strcpy(b, a);
+	    if (len > 0)
+		b[rand() % len] = "0a~^.1"[rand() % 6];
+	    if (len < sizeof(b) - 1 && rand() % 2)
+		strcat(b, (rand() % 2) ? "~" : "^");
+	} else {
+	    randver(b, sizeof(b) - 1);
+	}
+	fails += check(a, b);
+    }
+    return fails ? 1 : 0;
+}
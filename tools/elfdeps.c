@@ -8,6 +8,9 @@
 #include <errno.h>
 #include <popt.h>
 #include <gelf.h>
+#ifdef ENABLE_OPENMP
+#include <omp.h>
+#endif
 
 #include <rpm/rpmstring.h>
 #include <rpm/argv.h>
@@ -274,7 +277,7 @@ static void processProgHeaders(elfInfo *ei, GElf_Ehdr *ehdr)
     }
 }
 
-static int processFile(const char *fn, int dtype)
+static int processFile(const char *fn, int dtype, ARGV_t *deps)
 {
     int rc = 1;
     int fdno;
@@ -286,8 +289,7 @@ static int processFile(const char *fn, int dtype)
     if (fdno < 0 || fstat(fdno, &st) < 0)
 	goto exit;
 
-    (void) elf_version(EV_CURRENT);
-    ei->elf = elf_begin(fdno, ELF_C_READ, NULL);
+    ei->elf = elf_begin(fdno, ELF_C_READ_MMAP, NULL);
     if (ei->elf == NULL || elf_kind(ei->elf) != ELF_K_ELF)
 	goto exit;
 
@@ -331,9 +333,13 @@ static int processFile(const char *fn, int dtype)
 	argvAdd(&ei->requires, ei->interp);
 
     rc = 0;
-    /* dump the requested dependencies for this file */
-    for (ARGV_t dep = dtype ? ei->requires : ei->provides; dep && *dep; dep++) {
-	fprintf(stdout, "%s\n", *dep);
+    /* hand the requested dependencies for this file to the caller */
+    if (dtype) {
+	*deps = ei->requires;
+	ei->requires = NULL;
+    } else {
+	*deps = ei->provides;
+	ei->provides = NULL;
     }
 
 exit:
@@ -354,6 +360,12 @@ int main(int argc, char *argv[])
     int rc = 0;
     int provides = 0;
     int requires = 0;
+    int multifile = 0;
+    int nthreads = 0;
+    ARGV_t fns = NULL;
+    ARGV_t *deps = NULL;
+    int *rcs = NULL;
+    int nfns;
     poptContext optCon;
 
     struct poptOption opts[] = {
@@ -363,6 +375,8 @@ int main(int argc, char *argv[])
 	{ "no-fake-soname", 0, POPT_ARG_VAL, &fake_soname, 0, NULL, NULL },
 	{ "no-filter-soname", 0, POPT_ARG_VAL, &filter_soname, 0, NULL, NULL },
 	{ "require-interp", 0, POPT_ARG_VAL, &require_interp, -1, NULL, NULL },
+	{ "multifile", 0, POPT_ARG_VAL, &multifile, -1, NULL, NULL },
+	{ "threads", 'j', POPT_ARG_INT, &nthreads, 0, NULL, NULL },
 	POPT_AUTOHELP 
 	POPT_TABLEEND
     };
@@ -378,19 +392,49 @@ int main(int argc, char *argv[])
     /* Normally our data comes from stdin, but permit args too */
     if (poptPeekArg(optCon)) {
 	const char *fn;
-	while ((fn = poptGetArg(optCon)) != NULL) {
-	    if (processFile(fn, requires))
-		rc = EXIT_FAILURE;
-	}
+	while ((fn = poptGetArg(optCon)) != NULL)
+	    argvAdd(&fns, fn);
     } else {
 	char fn[BUFSIZ];
 	while (fgets(fn, sizeof(fn), stdin) != NULL) {
-	    fn[strlen(fn)-1] = '\0';
-	    if (processFile(fn, requires))
-		rc = EXIT_FAILURE;
+	    fn[strcspn(fn, "\n")] = '\0';
+	    argvAdd(&fns, fn);
 	}
     }
 
+    nfns = argvCount(fns);
+    deps = rcalloc(nfns + 1, sizeof(*deps));
+    rcs = rcalloc(nfns + 1, sizeof(*rcs));
+
+    (void) elf_version(EV_CURRENT);
+
+#ifdef ENABLE_OPENMP
+    if (nthreads > 0)
+	omp_set_num_threads(nthreads);
+#endif
+
+    /*
+     * Files are independent of each other, analyze them in parallel but
+     * print the results in the original order.
+     */
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (int i = 0; i < nfns; i++)
+	rcs[i] = processFile(fns[i], requires, &deps[i]);
+
+    for (int i = 0; i < nfns; i++) {
+	if (rcs[i])
+	    rc = EXIT_FAILURE;
+	/* In multifile mode, tag each file's output with its path */
+	if (multifile && deps[i])
+	    fprintf(stdout, ";%s\n", fns[i]);
+	for (ARGV_t dep = deps[i]; dep && *dep; dep++)
+	    fprintf(stdout, "%s\n", *dep);
+	argvFree(deps[i]);
+    }
+
+    free(deps);
+    free(rcs);
+    argvFree(fns);
     poptFreeContext(optCon);
     return rc;
 }
@@ -10,6 +10,10 @@
 
 #define BUFSIZE 2048
 
+/* Below this many records sort in place, below PAR_CUTOFF don't fork */
+#define SORT_CUTOFF 16
+#define PAR_CUTOFF 8192
+
 static size_t read_file(const char *input, char **ret)
 {
     FILE *in;
@@ -82,41 +86,99 @@ static void split_package_string(char *package_string, char **name,
     }
 }
 
-/* A package name-version-release comparator for qsort.  It expects p, q which
- * are pointers to character strings and will not be altered in this
- * function. */
-static int package_version_compare(const void *p, const void *q)
+/* A package name with collation keys for version and release */
+struct sortrec_s {
+    char *line;
+    char *name;
+    uint8_t *vkey;
+    uint8_t *rkey;
+    size_t vlen;
+    size_t rlen;
+};
+
+static void sortrec_init(struct sortrec_s *rec, char *line)
 {
-    char *local_p, *local_q;
-    char *lhs_name, *lhs_version, *lhs_release;
-    char *rhs_name, *rhs_version, *rhs_release;
-    int vercmpflag = 0;
+    char *version, *release;
 
-    local_p = rstrdup(*(char * const *)p);
-    local_q = rstrdup(*(char * const *)q);
+    rec->line = line;
+    rec->name = rstrdup(line);
+    split_package_string(rec->name, &rec->name, &version, &release);
+    rec->vkey = rpmverkey(version == NULL ? "" : version, &rec->vlen);
+    rec->rkey = rpmverkey(release == NULL ? "" : release, &rec->rlen);
+}
 
-    split_package_string(local_p, &lhs_name, &lhs_version, &lhs_release);
-    split_package_string(local_q, &rhs_name, &rhs_version, &rhs_release);
+/* A package name-version-release comparator. The version keys
+ * are calculated once up front, avoiding reparsing the strings for every
+ * comparison. */
+static int package_version_compare(const void *p, const void *q)
+{
+    const struct sortrec_s *lhs = p;
+    const struct sortrec_s *rhs = q;
+    int vercmpflag = 0;
 
     /* Check Name and return if unequal */
-    vercmpflag = strcmp((lhs_name == NULL ? "" : lhs_name),
-			(rhs_name == NULL ? "" : rhs_name));
+    vercmpflag = strcmp(lhs->name, rhs->name);
     if (vercmpflag != 0)
-	goto exit;
+	return vercmpflag;
 
     /* Check version and return if unequal */
-    vercmpflag = rpmvercmp((lhs_version == NULL ? "" : lhs_version),
-			   (rhs_version == NULL ? "" : rhs_version));
+    vercmpflag = rpmverkeycmp(lhs->vkey, lhs->vlen, rhs->vkey, rhs->vlen);
     if (vercmpflag != 0)
-	goto exit;
+	return vercmpflag;
 
     /* Check release and return the version compare value */
-    vercmpflag = rpmvercmp((lhs_release == NULL ? "" : lhs_release),
-			   (rhs_release == NULL ? "" : rhs_release));
-exit:
-    rfree(local_p);
-    rfree(local_q);
-    return vercmpflag;
+    return rpmverkeycmp(lhs->rkey, lhs->rlen, rhs->rkey, rhs->rlen);
+}
+
+/* Stable insertion sort for the short runs at the bottom of msort() */
+static void isort(struct sortrec_s *recs, size_t n)
+{
+    for (size_t i = 1; i < n; i++) {
+	struct sortrec_s rec = recs[i];
+	size_t j = i;
+	while (j > 0 && package_version_compare(&recs[j - 1], &rec) > 0) {
+	    recs[j] = recs[j - 1];
+	    j--;
+	}
+	recs[j] = rec;
+    }
+}
+
+/*
+ * Stable merge sort, the halves of large ranges are sorted in parallel
+ * tasks. tmp must have room for n records; the subranges use disjoint
+ * parts of it so the tasks don't step on each other.
+ */
+static void msort(struct sortrec_s *recs, struct sortrec_s *tmp, size_t n)
+{
+    size_t mid = n / 2;
+    size_t i = 0, j = mid, k = 0;
+
+    if (n <= SORT_CUTOFF) {
+	isort(recs, n);
+	return;
+    }
+
+    #pragma omp task if (n >= PAR_CUTOFF)
+    msort(recs, tmp, mid);
+    #pragma omp task if (n >= PAR_CUTOFF)
+    msort(recs + mid, tmp + mid, n - mid);
+    #pragma omp taskwait
+
+    /* Already in order, e.g. presorted input */
+    if (package_version_compare(&recs[mid - 1], &recs[mid]) <= 0)
+	return;
+
+    /* Merge the copied left half and the in-place right half into recs */
+    memcpy(tmp, recs, mid * sizeof(*recs));
+    while (i < mid && j < n) {
+	if (package_version_compare(&recs[j], &tmp[i]) < 0)
+	    recs[k++] = recs[j++];
+	else
+	    recs[k++] = tmp[i++];
+    }
+    if (i < mid)
+	memcpy(recs + k, tmp + i, (mid - i) * sizeof(*recs));
 }
 
 static void add_input(const char *filename, char ***package_names,
@@ -128,6 +190,7 @@ static void add_input(const char *filename, char ***package_names,
     char **names = *package_names;
     char **new_names = NULL;
     size_t n_names = *n_package_names;
+    size_t n_alloced = n_names;
 
     if (!*package_names)
 	new_names = names = xmalloc(sizeof(char *) * 2);
@@ -153,7 +216,10 @@ static void add_input(const char *filename, char ***package_names,
 
 	new = rstrndup(input_buffer, sz);
 
-	names = xrealloc(names, sizeof(char *) * (n_names + 1));
+	if (n_names >= n_alloced) {
+	    n_alloced = n_alloced ? n_alloced * 2 : 64;
+	    names = xrealloc(names, sizeof(char *) * n_alloced);
+	}
 	names[n_names] = new;
 	n_names++;
 
@@ -176,6 +242,8 @@ int main(int argc, const char *argv[])
     poptContext optCon;
     const char *arg;
     char **package_names = NULL;
+    struct sortrec_s *recs = NULL;
+    struct sortrec_s *tmp = NULL;
     size_t n_package_names = 0;
     char seen_file = 0;
 
@@ -200,15 +268,28 @@ int main(int argc, const char *argv[])
 	exit(EXIT_FAILURE);
     }
 
-    qsort(package_names, n_package_names, sizeof(char *),
-	  package_version_compare);
+    recs = xcalloc(n_package_names, sizeof(*recs));
+    tmp = xmalloc(n_package_names * sizeof(*tmp));
+
+    #pragma omp parallel for schedule(static, 1024)
+    for (size_t i = 0; i < n_package_names; i++)
+	sortrec_init(&recs[i], package_names[i]);
+
+    #pragma omp parallel
+    #pragma omp single
+    msort(recs, tmp, n_package_names);
 
     /* Send sorted list to stdout. */
     for (int i = 0; i < n_package_names; i++) {
-	fprintf(stdout, "%s\n", package_names[i]);
-	free(package_names[i]);
+	fprintf(stdout, "%s\n", recs[i].line);
+	free(recs[i].line);
+	free(recs[i].name);
+	free(recs[i].vkey);
+	free(recs[i].rkey);
     }
 
+    free(recs);
+    free(tmp);
     free(package_names);
     poptFreeContext(optCon);
     return 0;
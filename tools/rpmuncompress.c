@@ -33,21 +33,64 @@ struct archiveType_s {
     const char *cmd;
     const char *unpack;
     const char *quiet;
+    const char *mtcmd;	/* parallel decompressor to use instead, if set */
+    const char *mtopt;	/* option for decompressing with %d threads */
 } archiveTypes[] = {
-    { COMPRESSED_NOT,	0,	"%{__cat}" ,	"",		"" },
-    { COMPRESSED_OTHER,	0,	"%{__gzip}",	"-dc",		""  },
-    { COMPRESSED_BZIP2,	0,	"%{__bzip2}",	"-dc",		"" },
-    { COMPRESSED_ZIP,	1,	"%{__unzip}",	"",		"-qq" },
-    { COMPRESSED_LZMA,	0,	"%{__xz}",	"-dc",		"" },
-    { COMPRESSED_XZ,	0,	"%{__xz}",	"-dc",		"" },
-    { COMPRESSED_LZIP,	0,	"%{__lzip}",	"-dc",		"" },
-    { COMPRESSED_LRZIP,	0,	"%{__lrzip}",	"-dqo-",	"" },
-    { COMPRESSED_7ZIP,	1,	"%{__7zip}",	"x",		"" },
-    { COMPRESSED_ZSTD,	0,	"%{__zstd}",	"-dc",		"" },
-    { COMPRESSED_GEM,	1,	"%{__gem}",	"unpack",	"" },
-    { -1,		0,	NULL,		NULL,		NULL },
+    { COMPRESSED_NOT,	0,	"%{__cat}" ,	"",		"",
+	NULL,		NULL },
+    { COMPRESSED_OTHER,	0,	"%{__gzip}",	"-dc",		"",
+	"%{?__pigz}",	"-p%d" },
+    { COMPRESSED_BZIP2,	0,	"%{__bzip2}",	"-dc",		"",
+	"%{?__pbzip2}",	"-p%d" },
+    { COMPRESSED_ZIP,	1,	"%{__unzip}",	"",		"-qq",
+	NULL,		NULL },
+    { COMPRESSED_LZMA,	0,	"%{__xz}",	"-dc",		"",
+	NULL,		NULL },
+    { COMPRESSED_XZ,	0,	"%{__xz}",	"-dc",		"",
+	NULL,		"-T%d" },
+    { COMPRESSED_LZIP,	0,	"%{__lzip}",	"-dc",		"",
+	"%{?__plzip}",	"-n%d" },
+    { COMPRESSED_LRZIP,	0,	"%{__lrzip}",	"-dqo-",	"",
+	NULL,		"-p%d" },
+    { COMPRESSED_7ZIP,	1,	"%{__7zip}",	"x",		"",
+	NULL,		NULL },
+    { COMPRESSED_ZSTD,	0,	"%{__zstd}",	"-dc",		"",
+	NULL,		NULL },
+    { COMPRESSED_GEM,	1,	"%{__gem}",	"unpack",	"",
+	NULL,		NULL },
+    { -1,		0,	NULL,		NULL,		NULL,
+	NULL,		NULL },
 };
 
+/*
+ * Return the decompression command for an archive type, using a parallel
+ * decompressor and threads as per %_smp_build_nthreads where available.
+ * xz 5.4 and later decompress files written with threads in parallel, zstd
+ * has no multithreaded decoder but its frames are decoded fast enough.
+ */
+static char *getZipper(const struct archiveType_s *at)
+{
+    int nthreads = rpmExpandNumeric("%{?_smp_build_nthreads}");
+    char *cmd = NULL;
+    char *opt = NULL;
+
+    if (nthreads > 1 && at->mtcmd) {
+	cmd = rpmExpand(at->mtcmd, NULL);
+	if (*cmd == '\0')
+	    cmd = _free(cmd);
+    }
+    /* Only the threaded tools themselves support the thread option */
+    if (nthreads > 1 && at->mtopt && (cmd || at->mtcmd == NULL))
+	rasprintf(&opt, at->mtopt, nthreads);
+    if (cmd == NULL)
+	cmd = rpmExpand(at->cmd, NULL);
+
+    cmd = rstrscat(&cmd, " ", at->unpack, opt ? " " : "", opt ? opt : "",
+		   NULL);
+    free(opt);
+    return cmd;
+}
+
 static const struct archiveType_s *getArchiver(const char *fn)
 {
     const struct archiveType_s *archiver = NULL;
@@ -70,7 +113,7 @@ static char *doUncompress(const char *fn)
     char *cmd = NULL;
     const struct archiveType_s *at = getArchiver(fn);
     if (at) {
-	cmd = rpmExpand(at->cmd, " ", at->unpack, NULL);
+	cmd = getZipper(at);
 	/* path must not be expanded */
 	cmd = rstrscat(&cmd, " ", fn, NULL);
     }
@@ -89,11 +132,10 @@ static char *doUntar(const char *fn)
 
     tar = rpmGetPath("%{__tar}", NULL);
     if (at->compressed != COMPRESSED_NOT) {
-	char *zipper = NULL;
+	char *zipper = getZipper(at);
 	int needtar = (at->extractable == 0);
 
-	zipper = rpmExpand(at->cmd, " ", at->unpack, " ",
-			   verbose ? "" : at->quiet, NULL);
+	zipper = rstrscat(&zipper, " ", verbose ? "" : at->quiet, NULL);
 	if (needtar) {
 	    rasprintf(&buf, "%s '%s' | %s %s -", zipper, fn, tar, taropts);
 	} else if (at->compressed == COMPRESSED_GEM) {
@@ -151,9 +193,11 @@ int main(int argc, char *argv[])
 
 	inp = popen(cmd, "r");
 	if (inp) {
-	    int status, c;
-	    while ((c = fgetc(inp)) != EOF)
-		fputc(c, stdout);
+	    int status;
+	    size_t nb;
+	    char buf[BUFSIZ * 16];
+	    while ((nb = fread(buf, 1, sizeof(buf), inp)) > 0)
+		fwrite(buf, 1, nb, stdout);
 	    status = pclose(inp);
 	    if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
 		ec = EXIT_SUCCESS;